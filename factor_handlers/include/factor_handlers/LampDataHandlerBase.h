@@ -35,6 +35,9 @@
 #include <sensor_msgs/PointCloud2.h>
 #include <lamp_utils/CommonStructs.h>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/SpscRing.h>
+
+#include <functional>
 
 namespace gu = geometry_utils;
 namespace gr = geometry_utils::ros;
@@ -47,6 +50,22 @@ class LampDataHandlerBase {
     ~LampDataHandlerBase();
 
     virtual std::shared_ptr<FactorData> GetData() = 0;
+
+    // Called from the callbacks when new data was queued, so lamp can run its
+    // processing step without waiting for the next timer tick
+    void SetWakeCallback(const std::function<void()>& wake) {
+      wake_ = wake;
+    }
+
+  protected:
+
+    void Wake() {
+      if (wake_) {
+        wake_();
+      }
+    }
+
+    std::function<void()> wake_;
 };
 
 #endif
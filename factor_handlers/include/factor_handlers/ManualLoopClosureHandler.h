@@ -9,6 +9,7 @@
 
 // Includes 
 #include <factor_handlers/LampDataHandlerBase.h>
+#include <pose_graph_msgs/ManualLoopClosureBatch.h>
 
 namespace gu = geometry_utils;
 namespace gr = geometry_utils::ros;
@@ -23,6 +24,9 @@ class ManualLoopClosureHandler : public LampDataHandlerBase {
 
     bool Initialize(const ros::NodeHandle& n);
     std::shared_ptr<FactorData> GetData() override;
+    // Moves the loop closures received since the last call into data, which
+    // keeps its memory from one call to the next. False if there were none
+    bool GetData(LoopClosureData* data);
 
   protected:
 
@@ -32,7 +36,7 @@ class ManualLoopClosureHandler : public LampDataHandlerBase {
     bool CreatePublishers(const ros::NodeHandle& n);
 
     // Reset Factor data
-    void ResetFactorData();
+    void ResetFactorData(LoopClosureData* data) const;
 
   protected:
 
@@ -42,6 +46,7 @@ class ManualLoopClosureHandler : public LampDataHandlerBase {
     // Main subscriber 
     ros::Subscriber manual_loop_closure_sub_;
     ros::Subscriber suggest_loop_closure_sub_;
+    ros::Subscriber batch_loop_closure_sub_;
 
     // Publisher 
     ros::Publisher suggest_loop_closure_pub_;
@@ -49,9 +54,22 @@ class ManualLoopClosureHandler : public LampDataHandlerBase {
     // Main callback 
     void ManualLoopClosureCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg);
     void SuggestLoopClosureCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg);
-
-    // Factor data
-    LoopClosureData factors_; 
+    // Loop closures and suggestions of a review, the loop closures are handed
+    // to lamp together so they trigger one optimization
+    void BatchLoopClosureCallback(
+        const pose_graph_msgs::ManualLoopClosureBatch::ConstPtr& msg);
+
+    // Edges worth adding: keys of known prefixes, no self loops and each pair
+    // of keys once. Returns the number dropped
+    static size_t ValidateEdges(
+        const std::vector<pose_graph_msgs::PoseGraphEdge>& edges,
+        std::vector<pose_graph_msgs::PoseGraphEdge>* valid);
+    LoopClosureFactor ToFactor(const pose_graph_msgs::PoseGraphEdge& edge,
+                               const ros::Time& stamp) const;
+
+    // Factors received, drained by lamp. The factors of a message are queued
+    // together so lamp takes them in the same update
+    lamp_utils::SpscRing<std::vector<LoopClosureFactor>> factors_;
 
     // Precisions
     double manual_lc_rot_precision_;
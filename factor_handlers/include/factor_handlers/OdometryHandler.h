@@ -14,15 +14,18 @@
 #include <factor_handlers/LampDataHandlerBase.h>
 #include <std_msgs/Float64.h>
 #include <std_msgs/Float64MultiArray.h>
+#include <std_msgs/String.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/TimeIndexedBuffer.h>
 
 // Typedefs
 typedef nav_msgs::Odometry Odometry;
 typedef geometry_msgs::PoseWithCovarianceStamped PoseCovStamped;
 typedef std::pair<PoseCovStamped, PoseCovStamped> PoseCovStampedPair;
-typedef std::map<double, PoseCovStamped> OdomPoseBuffer;
+typedef lamp_utils::TimeIndexedBuffer<PoseCovStamped> OdomPoseBuffer;
 typedef std::pair<ros::Time, ros::Time> TimeStampedPair;
-typedef std::map<double, PointCloud> PointCloudBuffer;
+typedef lamp_utils::TimeIndexedBuffer<PointCloudConstPtr> PointCloudBuffer;
 
 typedef struct {
   bool b_has_value;
@@ -41,6 +44,16 @@ typedef std::pair<GtsamPosCov, GtsamPosCov> GtsamPosCovPair;
 const unsigned int LIDAR_ODOM_BUFFER_ID = 0;
 const unsigned int VISUAL_ODOM_BUFFER_ID = 1;
 const unsigned int WHEEL_ODOM_BUFFER_ID = 2;
+const unsigned int NUM_ODOM_BUFFERS = 3;
+
+// Health of an odometry stream, from the messages received so far
+typedef struct {
+  // Moving average of the time between messages (s), 0 before the second
+  double period;
+  double last_stamp;
+  // Trace of the position covariance of the latest message
+  double position_variance;
+} OdomSourceHealth;
 
 // Class Definition
 class OdometryHandler : public LampDataHandlerBase {
@@ -61,12 +74,23 @@ public:
   // LAMP Interface
   std::shared_ptr<FactorData> GetData() override;
   std::shared_ptr<FactorData> GetData(bool check_threshold);
+  // Fills data, which keeps its memory from one call to the next, with the
+  // factor to a new node if the odometry moved far enough (or regardless
+  // without check_threshold). False if there is none
+  bool GetData(OdomData* data, bool check_threshold = true);
+  // Starts the next factor at the latest odometry, dropping the motion since
+  // the last one (e.g. drift while standing still). False without odometry
+  bool SkipToLatest();
   bool GetOdomDelta(const ros::Time t_now, GtsamPosCov& delta_pose);
   bool GetOdomDeltaLatestTime(ros::Time& t_now, GtsamPosCov& delta_pose);
   bool GetKeyedScanAtTime(const ros::Time& stamp, PointCloud::Ptr& msg);
-  void ClearPreviousPointCloudScans(const PointCloudBuffer::iterator& itrTime);
+  // Drops the point clouds older than buffer position index
+  void ClearPreviousPointCloudScans(size_t index);
   GtsamPosCov GetFusedOdomDeltaBetweenTimes(const ros::Time t1,
                                             const ros::Time t2);
+  // Source used by the last successful GetFusedOdomDeltaBetweenTimes, one of
+  // the *_ODOM_BUFFER_ID
+  inline int GetLastFusedSource() const { return last_fused_source_; }
 
 protected:
   // Odometry Subscribers
@@ -79,6 +103,7 @@ protected:
 
   ros::Publisher time_diff_pub_;
   ros::Publisher factor_times_pub_;
+  ros::Publisher factor_source_pub_;
 
   // Subscriptions
   bool b_register_lidar_sub_;
@@ -99,13 +124,20 @@ protected:
   OdomPoseBuffer visual_odometry_buffer_;
   OdomPoseBuffer wheel_odometry_buffer_;
 
-  // Point Cloud Storage (Time stamp and point cloud)
+  // Point Cloud Storage (Time stamp and point cloud), the clouds are shared
+  // with the subscription, not copied
   PointCloudBuffer point_cloud_buffer_;
+  // Clouds kept regardless of the next keyframe, e.g. for forced nodes
+  static const size_t kRecentScans = 3;
+
+  // Bytes of the buffers and of the buffered clouds, set as clouds arrive
+  void UpdateMemoryAccount();
+  lamp_utils::MemoryAccount memory_account_{"odometry_handler.buffers"};
 
   // Utilities
   void InitializePoseCovStampedMsgValue(PoseCovStamped& msg);
-  template <typename T1, typename T2>
-  int CheckBufferSize(const std::map<T1, T2>& x) {
+  template <typename BufferT>
+  int CheckBufferSize(const BufferT& x) {
     return x.size();
   }
 
@@ -121,7 +153,18 @@ protected:
                            const ros::Time t2,
                            const int odom_buffer_id) const;
   double CalculatePoseDelta(const GtsamPosCov gtsam_pos_cov) const;
-  void ResetFactorData();
+
+  // Source selection
+  const OdomPoseBuffer& GetOdomBuffer(int odom_buffer_id) const;
+  bool IsSourceRegistered(int odom_buffer_id) const;
+  // Recent enough messages at a sufficient rate with a bounded covariance
+  bool IsSourceHealthy(int odom_buffer_id, const ros::Time& t) const;
+  void UpdateSourceHealth(const Odometry::ConstPtr& msg, int odom_buffer_id);
+  static std::string SourceName(int odom_buffer_id);
+  void ResetFactorData(OdomData* data) const;
+  // A cloud at time t may become the next keyed scan: the odometry is about
+  // to pass the translation threshold from the last key
+  bool IsKeyedScanCandidate(double t) const;
 
   // Setters
   void SetOdomValuesAtKey(const ros::Time query);
@@ -145,6 +188,11 @@ protected:
   gtsam::SharedNoiseModel
   GetCovariance(const PoseCovStampedPair pose_cov_stamped_pair) const;
   bool GetClosestLidarTime(const ros::Time time, ros::Time& closest_time) const;
+  // Slerp of the orientation and linear interpolation of the position and
+  // covariance, alpha in [0, 1] from first to second
+  PoseCovStamped InterpolatePoses(const PoseCovStamped& first,
+                                  const PoseCovStamped& second,
+                                  double alpha) const;
 
   // Converters
   gtsam::Pose3 ToGtsam(const gu::Transform3& pose)
@@ -155,9 +203,18 @@ protected:
 
   // Parameters
   double keyed_scan_time_diff_limit_;
+  // Only keep the clouds arriving within this time (s) of the predicted next
+  // keyframe, plus the latest kRecentScans
+  bool b_prune_point_cloud_buffer_;
+  double keyed_scan_candidate_window_;
   double pc_buffer_size_limit_;
   double translation_threshold_;
   bool b_debug_pointcloud_buffer_;
+  // Interpolate between the buffered messages around a query time instead
+  // of taking the closest one, if they are at most max_interpolation_gap_
+  // seconds apart
+  bool b_interpolate_poses_;
+  double max_interpolation_gap_;
 
   // Fusion logic
   bool b_is_first_query_;
@@ -165,8 +222,14 @@ protected:
   ros::Time query_timestamp_first_;
   GtsamPosCov fused_odom_;
 
-  // Factor data
-  OdomData factors_;
+  // Sources tried in order, the first healthy one with a delta is used
+  std::vector<int> source_priority_;
+  // A source is degraded below this message rate (Hz), or when its position
+  // covariance trace exceeds max_position_variance_ (non-positive disables)
+  double min_source_rate_;
+  double max_position_variance_;
+  OdomSourceHealth source_health_[NUM_ODOM_BUFFERS];
+  int last_fused_source_;
 
   /*
   Corner case handling
@@ -9,14 +9,35 @@
 
 // Includes
 #include <factor_handlers/LampDataHandlerBase.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <lamp_utils/Metrics.h>
 #include <lamp_utils/PointCloudUtils.h>
+#include <lamp_utils/PoseGraphDelta.h>
+#include <pose_graph_msgs/KeyedScanLayer.h>
+#include <ros/callback_queue.h>
+#include <ros/spinner.h>
+#include <std_msgs/Empty.h>
 
 namespace pu = parameter_utils;
 namespace gu = geometry_utils;
 namespace gr = geometry_utils::ros;
 
+// What the callbacks hand over to lamp, in the order they arrived
+struct PoseGraphEvent {
+  enum class Type { GRAPH, SCAN, COARSE_KEY, SCAN_REFINEMENT, COMPLETE_KEY };
+
+  Type type{Type::GRAPH};
+  pose_graph_msgs::PoseGraph::ConstPtr graph;
+  gtsam::Key key{0};
+  PointCloud::ConstPtr cloud;
+};
+
 class PoseGraphHandler : public LampDataHandlerBase {
 
   public:
@@ -26,9 +47,43 @@ class PoseGraphHandler : public LampDataHandlerBase {
 
     bool Initialize(const ros::NodeHandle& n, std::vector<std::string> robot_names);
     std::shared_ptr<FactorData> GetData() override;
+    // Moves what was received since the last call into data, which keeps its
+    // memory from one call to the next. False if nothing new arrived
+    bool GetData(PoseGraphData* data);
 
   protected:
 
+    // Everything received from one robot. The subscriptions of a robot are
+    // serviced by its own single threaded spinner, so its messages are
+    // handled in order while a burst from one robot (a reconnect) does not
+    // hold up the others. Only that spinner touches the bookkeeping below.
+    struct RobotChannel {
+      std::string robot;
+      ros::CallbackQueue queue;
+      std::unique_ptr<ros::AsyncSpinner> spinner;
+      std::vector<ros::Subscriber> subscribers;
+      ros::Publisher resync_pub;
+
+      // Pose graphs and keyed scan layers, filled by the callbacks and
+      // drained by lamp
+      lamp_utils::SpscRing<PoseGraphEvent> events{4096};
+
+      // Delta decoding of the incremental pose graph
+      lamp_utils::PoseGraphDeltaDecoder delta_decoder;
+      ros::Time last_resync_request;
+
+      std::unordered_set<uint64_t> keyed_scans_keys;
+      // Layers received of the keys still missing some
+      std::unordered_map<uint64_t, std::vector<PointXyziCloud::ConstPtr>>
+          scan_layers;
+      std::unordered_map<unsigned char, uint64_t> last_keyed_scan_key;
+      std::unordered_set<uint64_t> pose_graph_node_keys;
+      std::unordered_map<unsigned char, uint64_t> last_odom_node_key;
+
+      // Time the last message of the robot waited for its callback
+      lamp_utils::Gauge* lag_ms{nullptr};
+    };
+
     // Node initialization.
     bool LoadParameters(const ros::NodeHandle& n);
     bool RegisterCallbacks(const ros::NodeHandle& n);
@@ -38,11 +93,44 @@ class PoseGraphHandler : public LampDataHandlerBase {
     bool AddRobot(std::string robot);
 
     // Reset stored graph data
-    void ResetGraphData();
-
-    // Input callbacks
-    void PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg);
-    void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& msg);
+    void ResetGraphData(PoseGraphData* data) const;
+
+    // Subscribes to a topic of the robot on its callback queue, recording
+    // the lag of the robot
+    template <typename M>
+    ros::Subscriber SubscribeRobot(
+        ros::NodeHandle& nl,
+        RobotChannel* channel,
+        const std::string& topic,
+        void (PoseGraphHandler::*callback)(const boost::shared_ptr<const M>&,
+                                           RobotChannel*));
+    void StartSpinners();
+    void StopSpinners();
+
+    // Input callbacks, run on the spinner of the robot
+    void PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg,
+                           RobotChannel* channel);
+    void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& msg,
+                           RobotChannel* channel);
+    void CoarseKeyedScanCallback(
+        const pose_graph_msgs::KeyedScan::ConstPtr& msg,
+        RobotChannel* channel);
+    // Keyed scans sent in levels of detail. The coarse layer is handed to lamp
+    // like a downsampled scan and the refinements as points to append. The
+    // full scan is republished once every layer arrived.
+    void KeyedScanLayerCallback(
+        const pose_graph_msgs::KeyedScanLayer::ConstPtr& msg,
+        RobotChannel* channel);
+
+    // Keyed scan ingestion. Conversion, filtering and the normals for
+    // republishing run on worker threads, finished scans are handed to lamp
+    // in batches through GetData. The workers wake lamp from their threads
+    void StartIngestion();
+    void StopIngestion();
+    void IngestionWorker();
+    void IngestKeyedScan(const pose_graph_msgs::KeyedScan::ConstPtr& msg);
+    // Publishes a scan carrying its normals
+    void RepublishKeyedScan(gtsam::Key key, const PointCloud::ConstPtr& scan);
 
     // Publishers
     ros::Publisher keyed_scan_pub_;
@@ -50,24 +138,35 @@ class PoseGraphHandler : public LampDataHandlerBase {
     // The node's name.
     std::string name_;
 
-    // Subscribers
-    std::vector<ros::Subscriber> subscribers_posegraph;
-    std::vector<ros::Subscriber> subscribers_keyedscan;
-
-    // Pose graphs and keyed scans received from robot
-    PoseGraphData data_;
-
     // Robots that the base station subscribes to
     std::set<std::string> robot_names_;
+    std::map<std::string, std::unique_ptr<RobotChannel>> channels_;
+    // Messages buffered per topic of a robot, the oldest are dropped beyond
+    int robot_queue_size_{10000};
 
-    std::unordered_set<uint64_t> keyed_scans_keys_;
-    std::unordered_map<unsigned char,uint64_t> last_keyed_scan_key_from_robot_;
-    std::unordered_set<uint64_t> pose_graph_node_keys_;
-    std::unordered_map<unsigned char,uint64_t> last_odom_node_key_from_robot_;
+    double resync_request_interval_{1.0};
 
     // Parameters when recomputing normals for republishing keyed scans on base
     lamp_utils::NormalComputeParams normals_compute_params_;
 
+    // Ingestion parameters, no worker threads ingests in the callback
+    int ingestion_threads_{0};
+    // Back-pressure: the callback waits while this many scans are queued
+    int max_queued_scans_{200};
+    // Finished scans handed over per GetData
+    int max_scans_per_batch_{50};
+    // Voxel filter applied to the ingested scans, 0 for none
+    double ingestion_voxel_leaf_{0.0};
+
+    std::vector<std::thread> ingestion_workers_;
+    std::mutex ingestion_mutex_;
+    // Workers wait for scans, the callback for room in the queue
+    std::condition_variable ingestion_cv_;
+    std::condition_variable ingestion_space_cv_;
+    std::deque<pose_graph_msgs::KeyedScan::ConstPtr> ingestion_queue_;
+    std::deque<std::pair<gtsam::Key, PointCloud::ConstPtr>> ingested_scans_;
+    bool b_stop_ingestion_{false};
+
   private:
 
 };
@@ -9,6 +9,7 @@
 
 // Includes 
 #include <factor_handlers/LampDataHandlerBase.h>
+#include <lamp_utils/PoseExtrapolator.h>
 
 namespace pu = parameter_utils;
 namespace gu = geometry_utils;
@@ -23,6 +24,15 @@ class RobotPoseHandler : public LampDataHandlerBase {
 
     bool Initialize(const ros::NodeHandle& n, std::vector<std::string> robot_names);
     std::shared_ptr<FactorData> GetData() override;
+    // Fills data with the latest pose of every robot heard from since the
+    // last call. False if there were none
+    bool GetData(RobotPoseData* data);
+
+    // Pose of the robot extrapolated to stamp from the poses handed over by
+    // GetData. False if none was received from the robot
+    bool PredictPose(const std::string& robot,
+                     const ros::Time& stamp,
+                     lamp_utils::PosePrediction* prediction) const;
 
   protected:
 
@@ -35,7 +45,7 @@ class RobotPoseHandler : public LampDataHandlerBase {
     bool AddRobot(std::string robot);
 
     // Reset stored data
-    void ResetPoseData();
+    void ResetPoseData(RobotPoseData* data) const;
 
     // Input callbacks
     // void PoseCallback(const geometry_msgs::PoseStamped& msg, std::string robot);
@@ -49,13 +59,17 @@ class RobotPoseHandler : public LampDataHandlerBase {
     std::vector<ros::Publisher> publishers_pose_;
     std::vector<ros::Subscriber> subscribers_pose_;
 
-    // Pose graphs and keyed scans received from robot
-    RobotPoseData data_;
+    // Poses received from the robots, drained by lamp
+    lamp_utils::SpscRing<std::pair<std::string, PoseData>> poses_;
 
 
     // Robots that the base station subscribes to
     std::set<std::string> robot_names_;
 
+    // Recent poses of every robot, updated by GetData
+    lamp_utils::PoseExtrapolatorParams extrapolator_params_;
+    std::map<std::string, lamp_utils::PoseExtrapolator> extrapolators_;
+
 
   private:
 
@@ -6,13 +6,23 @@
 #ifndef STATIONARY_HANDLER_H
 #define STATIONARY_HANDLER_H
 
+#include <atomic>
+
 #include <factor_handlers/LampDataHandlerBase.h>
 #include <geometry_msgs/Vector3.h>
 #include <gtsam/navigation/AttitudeFactor.h>
 #include <localizer_zero_velocity_detector/Stationary.h>
 
 typedef localizer_zero_velocity_detector::Stationary StationaryMessage;
-typedef std::pair<ros::Time, geometry_msgs::Vector3> StationaryData;
+// Attitude measurement fused over one stationary interval
+struct StationaryData {
+  // Start of the interval
+  ros::Time stamp;
+  // Averaged gravity direction
+  geometry_msgs::Vector3 gravity;
+  // Isotropic noise of the fused direction
+  double sigma{0.0};
+};
 
 class StationaryHandler : public LampDataHandlerBase {
   friend class StationaryHandlerTest;
@@ -25,10 +35,18 @@ class StationaryHandler : public LampDataHandlerBase {
 
   // LAMP Interface
   std::shared_ptr<FactorData> GetData() override;
+  // Attitude factor at the query key from the latest detection since the
+  // last call, into data which keeps its memory. False if there was none
+  bool GetData(ImuData* data);
+  // A detection is waiting, consumer side
+  bool HasData() const;
+  // The detector reported standing still in its latest status, received at
+  // most max_age (s) before now. A stop is reported after its detection was
+  // queued, so HasData() covers it once this turns false
+  bool IsStationary(const ros::Time& now, double max_age) const;
 
   bool SetKeyForImuAttitude(const gtsam::Symbol& key);
   bool CheckKeyRecency(const gtsam::Symbol& key);
-  bool has_data_;
 
  protected:
   std::string name_;
@@ -46,14 +64,39 @@ class StationaryHandler : public LampDataHandlerBase {
   // Factors
   gtsam::Pose3AttitudeFactor CreateAttitudeFactor(
       const geometry_msgs::Vector3& gravity_vec) const;
-  void ResetFactorData();
+  gtsam::Pose3AttitudeFactor
+  CreateAttitudeFactor(const geometry_msgs::Vector3& gravity_vec,
+                       double sigma) const;
+  void ResetFactorData(ImuData* data) const;
 
   gtsam::Symbol query_key_;
   double noise_sigma_;
 
+  // Stationary intervals
+  void AddStationaryMeasurement(const ros::Time& stamp,
+                                const geometry_msgs::Vector3& accel);
+  void CloseStationaryInterval();
+
   bool currently_stationary_;
-  StationaryData last_detection_;
+  // Latest detector status for the consumer side
+  std::atomic<bool> b_reported_stationary_{false};
+  std::atomic<double> last_status_time_{0.0};
+  // Detections of the robot stopping, drained by lamp
+  lamp_utils::SpscRing<StationaryData> detections_{64};
   int key_step_threshold_;
+
+  // A stop is fused into one factor when the robot moves again or after
+  // max_duration_ (s) of standing still
+  double max_duration_;
+  // Spacing (s) of detector outputs taken as independent, e.g. its
+  // observation period, the outputs are averages over overlapping windows
+  double decorrelation_time_;
+  bool b_interval_open_;
+  ros::Time interval_start_;
+  ros::Time interval_end_;
+  // Sum of the unit gravity directions in the interval
+  gtsam::Vector3 direction_sum_;
+  int interval_count_;
 };
 
 #endif
\ No newline at end of file
@@ -1,6 +1,11 @@
 // Includes
 #include "factor_handlers/ManualLoopClosureHandler.h"
 
+#include <lamp_utils/PrefixHandling.h>
+
+#include <algorithm>
+#include <set>
+
 // Constructor
 ManualLoopClosureHandler::ManualLoopClosureHandler() {
 
@@ -63,6 +68,12 @@ bool ManualLoopClosureHandler::RegisterCallbacks(const ros::NodeHandle& n) {
                    &ManualLoopClosureHandler::SuggestLoopClosureCallback,
                    this);
 
+  batch_loop_closure_sub_ =
+      nl.subscribe("manual_lc_batch",
+                   10,
+                   &ManualLoopClosureHandler::BatchLoopClosureCallback,
+                   this);
+
   suggest_loop_closure_pub_ = nl.advertise<pose_graph_msgs::PoseGraph>(
       "suggest_loop_closures", 10, false);
 
@@ -77,41 +88,116 @@ void ManualLoopClosureHandler::ManualLoopClosureCallback(const pose_graph_msgs::
   }
 
   // Convert the message to factor data
+  std::vector<LoopClosureFactor> factors;
+  factors.reserve(msg->edges.size());
   for (const pose_graph_msgs::PoseGraphEdge& edge : msg->edges) {
+    factors.push_back(ToFactor(edge, msg->header.stamp));
+  }
+  factors_.Push(std::move(factors));
 
-    // Create the new factor
-    LoopClosureFactor new_factor;
-    new_factor.transform = lamp_utils::MessageToPose(edge);
-    new_factor.key_from = edge.key_from;
-    new_factor.key_to = edge.key_to;
-    new_factor.stamp = msg->header.stamp;
+  // Let lamp know new factors are waiting
+  Wake();
+}
+
+void ManualLoopClosureHandler::SuggestLoopClosureCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+  suggest_loop_closure_pub_.publish(*msg);
+}
 
-    // TODO handle covariances
-    new_factor.covariance = noise_;
+void ManualLoopClosureHandler::BatchLoopClosureCallback(
+    const pose_graph_msgs::ManualLoopClosureBatch::ConstPtr& msg) {
+  std::vector<pose_graph_msgs::PoseGraphEdge> loop_closures;
+  std::vector<pose_graph_msgs::PoseGraphEdge> suggestions;
+  const size_t num_dropped = ValidateEdges(msg->loop_closures, &loop_closures) +
+      ValidateEdges(msg->suggestions, &suggestions);
+  if (num_dropped > 0) {
+    ROS_WARN_STREAM(name_ << ": Dropped " << num_dropped
+                          << " invalid or repeated edges of a batch of "
+                          << msg->loop_closures.size() + msg->suggestions.size());
+  }
+  ROS_INFO_STREAM(name_ << ": Received a batch of " << loop_closures.size()
+                        << " manual loop closures and " << suggestions.size()
+                        << " suggestions");
+
+  // Suggestions go to loop computation in one message
+  if (!suggestions.empty()) {
+    pose_graph_msgs::PoseGraph suggestion_msg;
+    suggestion_msg.header = msg->header;
+    suggestion_msg.edges = std::move(suggestions);
+    suggest_loop_closure_pub_.publish(suggestion_msg);
+  }
 
-    // Add the new factor
-    factors_.factors.push_back(new_factor);
+  if (loop_closures.empty()) {
+    return;
   }
+  std::vector<LoopClosureFactor> factors;
+  factors.reserve(loop_closures.size());
+  for (const pose_graph_msgs::PoseGraphEdge& edge : loop_closures) {
+    factors.push_back(ToFactor(edge, msg->header.stamp));
+  }
+  factors_.Push(std::move(factors));
+  Wake();
+}
 
-  // Record that new data was stored
-  factors_.b_has_data = true;
+size_t ManualLoopClosureHandler::ValidateEdges(
+    const std::vector<pose_graph_msgs::PoseGraphEdge>& edges,
+    std::vector<pose_graph_msgs::PoseGraphEdge>* valid) {
+  const auto is_known = [](gtsam::Key key) {
+    const unsigned char prefix = gtsam::Symbol(key).chr();
+    return lamp_utils::IsRobotPrefix(prefix) ||
+        lamp_utils::IsSpecialSymbol(prefix);
+  };
+  std::set<std::pair<gtsam::Key, gtsam::Key>> pairs;
+  valid->reserve(valid->size() + edges.size());
+  for (const pose_graph_msgs::PoseGraphEdge& edge : edges) {
+    if (edge.key_from == edge.key_to || !is_known(edge.key_from) ||
+        !is_known(edge.key_to)) {
+      continue;
+    }
+    // Either direction constrains the same pair of keys
+    if (!pairs.emplace(std::min(edge.key_from, edge.key_to),
+                       std::max(edge.key_from, edge.key_to))
+             .second) {
+      continue;
+    }
+    valid->push_back(edge);
+  }
+  return edges.size() - pairs.size();
 }
 
-void ManualLoopClosureHandler::SuggestLoopClosureCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
-  suggest_loop_closure_pub_.publish(*msg);
+LoopClosureFactor
+ManualLoopClosureHandler::ToFactor(const pose_graph_msgs::PoseGraphEdge& edge,
+                                   const ros::Time& stamp) const {
+  LoopClosureFactor factor;
+  factor.transform = lamp_utils::MessageToPose(edge);
+  factor.key_from = edge.key_from;
+  factor.key_to = edge.key_to;
+  factor.stamp = stamp;
+
+  // TODO handle covariances
+  factor.covariance = noise_;
+  return factor;
 }
 
-void ManualLoopClosureHandler::ResetFactorData() {
-  factors_.b_has_data = false;
-  factors_.type = "manualloopclosure";
-  factors_.factors.clear();
+void ManualLoopClosureHandler::ResetFactorData(LoopClosureData* data) const {
+  data->b_has_data = false;
+  data->type = "manualloopclosure";
+  data->factors.clear();
 }
 
+bool ManualLoopClosureHandler::GetData(LoopClosureData* data) {
+  ResetFactorData(data);
+  std::vector<LoopClosureFactor> factors;
+  while (factors_.Pop(factors)) {
+    data->factors.insert(data->factors.end(), factors.begin(), factors.end());
+  }
+  data->b_has_data = !data->factors.empty();
+  return data->b_has_data;
+}
 
 std::shared_ptr<FactorData> ManualLoopClosureHandler::GetData() {
 
-  std::shared_ptr<LoopClosureData> output_data = std::make_shared<LoopClosureData>(factors_);
-  ResetFactorData();
+  std::shared_ptr<LoopClosureData> output_data = std::make_shared<LoopClosureData>();
+  GetData(output_data.get());
 
   return output_data;
 }
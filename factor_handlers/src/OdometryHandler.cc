@@ -9,6 +9,13 @@
 // Includes
 #include <factor_handlers/OdometryHandler.h>
 
+#include <lamp_utils/PointCloudPool.h>
+
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+
 namespace pu = parameter_utils;
 
 // Constructor & Destructors
@@ -16,13 +23,28 @@ namespace pu = parameter_utils;
 
 OdometryHandler::OdometryHandler()
   : keyed_scan_time_diff_limit_(0.2),
+    b_prune_point_cloud_buffer_(false),
+    keyed_scan_candidate_window_(1.0),
     pc_buffer_size_limit_(10),
     translation_threshold_(1.0),
     ts_threshold_(0.1),
     query_timestamp_first_(0),
     b_is_first_query_(true),
     max_buffer_size_(6000),
-    b_debug_pointcloud_buffer_(false) {
+    b_debug_pointcloud_buffer_(false),
+    b_interpolate_poses_(false),
+    max_interpolation_gap_(1.0),
+    source_priority_{static_cast<int>(LIDAR_ODOM_BUFFER_ID),
+                     static_cast<int>(VISUAL_ODOM_BUFFER_ID),
+                     static_cast<int>(WHEEL_ODOM_BUFFER_ID)},
+    min_source_rate_(0.0),
+    max_position_variance_(0.0),
+    last_fused_source_(LIDAR_ODOM_BUFFER_ID) {
+  for (auto& health : source_health_) {
+    health.period = 0;
+    health.last_stamp = 0;
+    health.position_variance = 0;
+  }
   b_odom_value_initialized_.lidar = false;
   b_odom_value_initialized_.visual = false;
   b_odom_value_initialized_.wheel = false;
@@ -62,6 +84,10 @@ bool OdometryHandler::LoadParameters(const ros::NodeHandle& n) {
     return false;
   if (!pu::Get("pc_buffer_size_limit", pc_buffer_size_limit_))
     return false;
+  if (!pu::Get("b_prune_point_cloud_buffer", b_prune_point_cloud_buffer_))
+    return false;
+  if (!pu::Get("keyed_scan_candidate_window", keyed_scan_candidate_window_))
+    return false;
 
   // Timestamp threshold used in GetPoseAtTime method to return true to the
   // caller
@@ -72,9 +98,44 @@ bool OdometryHandler::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get("max_buffer_size", max_buffer_size_))
     return false;
 
+  // Buffers drop their oldest entry once full
+  lidar_odometry_buffer_.SetCapacity(max_buffer_size_);
+  visual_odometry_buffer_.SetCapacity(max_buffer_size_);
+  wheel_odometry_buffer_.SetCapacity(max_buffer_size_);
+  point_cloud_buffer_.SetCapacity(static_cast<size_t>(pc_buffer_size_limit_));
+
   if (!pu::Get("b_debug_pointcloud_buffer", b_debug_pointcloud_buffer_))
     return false;
 
+  // Pose interpolation between buffered messages
+  if (!pu::Get("b_interpolate_poses", b_interpolate_poses_))
+    return false;
+  if (!pu::Get("max_interpolation_gap", max_interpolation_gap_))
+    return false;
+
+  // Source selection
+  std::vector<std::string> source_priority;
+  if (!pu::Get("fusion/source_priority", source_priority))
+    return false;
+  source_priority_.clear();
+  for (const auto& name : source_priority) {
+    bool b_known = false;
+    for (unsigned int id = 0; id < NUM_ODOM_BUFFERS; id++) {
+      if (name == SourceName(id)) {
+        source_priority_.push_back(id);
+        b_known = true;
+      }
+    }
+    if (!b_known) {
+      ROS_ERROR_STREAM(name_ << ": Unknown odometry source " << name);
+      return false;
+    }
+  }
+  if (!pu::Get("fusion/min_source_rate", min_source_rate_))
+    return false;
+  if (!pu::Get("fusion/max_position_variance", max_position_variance_))
+    return false;
+
   // Subscriptions
   if (!pu::Get("subscriptions/b_register_lidar_sub", b_register_lidar_sub_))
     return false;
@@ -118,6 +179,8 @@ bool OdometryHandler::RegisterCallbacks(const ros::NodeHandle& n) {
   }
   factor_times_pub_ = nl.advertise<std_msgs::Float64MultiArray>(
       "lamp_odom_factor_times", 10, false);
+  factor_source_pub_ =
+      nl.advertise<std_msgs::String>("lamp_odom_factor_source", 10, false);
 
   return true;
 }
@@ -130,16 +193,14 @@ void OdometryHandler::LidarOdometryCallback(const Odometry::ConstPtr& msg) {
   if (b_odom_value_initialized_.lidar == false) {
     InitializeOdomValueAtKey(msg, LIDAR_ODOM_BUFFER_ID);
   }
-  // CheckBufferSize
-  if (CheckBufferSize<double, PoseCovStamped>(lidar_odometry_buffer_) >
-      max_buffer_size_) {
-    lidar_odometry_buffer_.erase(lidar_odometry_buffer_.begin());
-  }
-  // InsertMsgInBuffer
+  // InsertMsgInBuffer, the buffer capacity bounds the history
   if (!InsertMsgInBuffer(msg, lidar_odometry_buffer_)) {
     ROS_WARN("OdometryHandler - LidarOdometryCallback - Unable to store "
              "message in buffer");
   }
+  UpdateSourceHealth(msg, LIDAR_ODOM_BUFFER_ID);
+  // Odometry factors are made from the lidar odometry
+  Wake();
 }
 
 void OdometryHandler::VisualOdometryCallback(const Odometry::ConstPtr& msg) {
@@ -147,16 +208,12 @@ void OdometryHandler::VisualOdometryCallback(const Odometry::ConstPtr& msg) {
   if (b_odom_value_initialized_.visual == false) {
     InitializeOdomValueAtKey(msg, VISUAL_ODOM_BUFFER_ID);
   }
-  // CheckBufferSize
-  if (CheckBufferSize<double, PoseCovStamped>(visual_odometry_buffer_) >
-      max_buffer_size_) {
-    visual_odometry_buffer_.erase(visual_odometry_buffer_.begin());
-  }
-  // InsertMsgInBuffer
+  // InsertMsgInBuffer, the buffer capacity bounds the history
   if (!InsertMsgInBuffer(msg, visual_odometry_buffer_)) {
     ROS_WARN("OdometryHandler - VisualOdometryCallback - Unable to store "
              "message in buffer");
   }
+  UpdateSourceHealth(msg, VISUAL_ODOM_BUFFER_ID);
 }
 
 void OdometryHandler::WheelOdometryCallback(const Odometry::ConstPtr& msg) {
@@ -164,16 +221,12 @@ void OdometryHandler::WheelOdometryCallback(const Odometry::ConstPtr& msg) {
   if (b_odom_value_initialized_.wheel == false) {
     InitializeOdomValueAtKey(msg, WHEEL_ODOM_BUFFER_ID);
   }
-  // CheckBufferSize
-  if (CheckBufferSize<double, PoseCovStamped>(wheel_odometry_buffer_) >
-      max_buffer_size_) {
-    wheel_odometry_buffer_.erase(wheel_odometry_buffer_.begin());
-  }
-  // InsertMsgInBuffer
+  // InsertMsgInBuffer, the buffer capacity bounds the history
   if (!InsertMsgInBuffer(msg, wheel_odometry_buffer_)) {
     ROS_WARN("OdometryHandler - WheelOdometryCallback - Unable to store "
              "message in buffer");
   }
+  UpdateSourceHealth(msg, WHEEL_ODOM_BUFFER_ID);
 }
 
 // void OdometryHandler::PointCloudCallback(
@@ -192,17 +245,57 @@ void OdometryHandler::WheelOdometryCallback(const Odometry::ConstPtr& msg) {
 void OdometryHandler::PointCloudCallback(const PointCloudConstPtr& msg) {
   ros::Time current_timestamp;
   pcl_conversions::fromPCL(msg->header.stamp, current_timestamp);
-  point_cloud_buffer_.insert({current_timestamp.toSec(), *msg});
+  // Held by pointer, once the buffer is full this drops the oldest cloud
+  point_cloud_buffer_.Insert(current_timestamp.toSec(), msg);
+
+  // Far from the next keyframe, only the latest clouds can still be asked for
+  if (b_prune_point_cloud_buffer_ &&
+      point_cloud_buffer_.size() > kRecentScans &&
+      !IsKeyedScanCandidate(current_timestamp.toSec())) {
+    ClearPreviousPointCloudScans(point_cloud_buffer_.size() - kRecentScans);
+  }
+  UpdateMemoryAccount();
+}
+
+void OdometryHandler::UpdateMemoryAccount() {
+  size_t bytes = lidar_odometry_buffer_.StorageBytes() +
+      visual_odometry_buffer_.StorageBytes() +
+      wheel_odometry_buffer_.StorageBytes() +
+      point_cloud_buffer_.StorageBytes();
+  for (size_t i = 0; i < point_cloud_buffer_.size(); i++) {
+    const PointCloudConstPtr& cloud = point_cloud_buffer_.At(i);
+    if (cloud != nullptr)
+      bytes += sizeof(PointCloud) + cloud->points.capacity() * sizeof(Point);
+  }
+  memory_account_.Set(bytes);
+}
 
-  //  double current_timestamp = msg->header.stamp.toSec();
-  //  PointCloud current_pointcloud;
-  //  pcl::fromROSMsg(*msg, current_pointcloud);
-  //  point_cloud_buffer_.insert({current_timestamp, current_pointcloud});
-  // Clear start of buffer if buffer is too large
-  if (point_cloud_buffer_.size() > pc_buffer_size_limit_) {
-    // Clear the first entry in the buffer
-    point_cloud_buffer_.erase(point_cloud_buffer_.begin());
+bool OdometryHandler::IsKeyedScanCandidate(double t) const {
+  // Keep everything until there is a key and odometry to predict from
+  if (b_is_first_query_ || !b_odom_value_initialized_.lidar ||
+      lidar_odometry_buffer_.size() < 2) {
+    return true;
+  }
+  const size_t last = lidar_odometry_buffer_.size() - 1;
+  const auto& key = lidar_odom_value_at_key_.pose.pose.position;
+  const auto& latest = lidar_odometry_buffer_.At(last).pose.pose.position;
+  const auto& previous = lidar_odometry_buffer_.At(last - 1).pose.pose.position;
+
+  const double remaining = translation_threshold_ -
+      std::hypot(std::hypot(latest.x - key.x, latest.y - key.y),
+                 latest.z - key.z);
+  if (remaining <= 0) {
+    return true;
   }
+  // Time to the threshold at the current speed
+  const double dt =
+      lidar_odometry_buffer_.TimeAt(last) - lidar_odometry_buffer_.TimeAt(last - 1);
+  const double speed = std::hypot(
+      std::hypot(latest.x - previous.x, latest.y - previous.y),
+      latest.z - previous.z) / std::max(dt, 1e-3);
+  const double t_latest = lidar_odometry_buffer_.BackTime();
+  return speed > 0 &&
+      t_latest + remaining / speed - t <= keyed_scan_candidate_window_;
 }
 
 // Utilities
@@ -219,20 +312,12 @@ void OdometryHandler::InitializePoseCovStampedMsgValue(PoseCovStamped& msg) {
 
 bool OdometryHandler::InsertMsgInBuffer(const Odometry::ConstPtr& odom_msg,
                                         OdomPoseBuffer& buffer) {
-  auto initial_size = buffer.size();
   PoseCovStamped current_msg;
   current_msg.header = odom_msg->header;
   current_msg.pose = odom_msg->pose;
-  current_msg.pose.covariance = odom_msg->pose.covariance;
   auto current_time = odom_msg->header.stamp.toSec();
-  buffer.insert({current_time, current_msg});
-  auto final_size = buffer.size();
-  if (final_size == (initial_size + 1)) {
-    // Msg insertion was successful, return true to the caller
-    return true;
-  } else {
-    return false;
-  }
+  // Returns false if a message with the same stamp is already stored
+  return buffer.Insert(current_time, current_msg);
 }
 
 bool OdometryHandler::GetOdomDelta(const ros::Time t_now,
@@ -249,7 +334,7 @@ bool OdometryHandler::GetOdomDelta(const ros::Time t_now,
   if (b_is_first_query_) {
     // Get the first time from the lidar scan
     if (lidar_odometry_buffer_.size() > 1) {
-      query_timestamp_first_.fromSec(lidar_odometry_buffer_.begin()->first);
+      query_timestamp_first_.fromSec(lidar_odometry_buffer_.FrontTime());
     } else {
       query_timestamp_first_ = t_now;
     }
@@ -270,9 +355,9 @@ bool OdometryHandler::GetOdomDelta(const ros::Time t_now,
   if (!fused_odom_.b_has_value) {
     ROS_ERROR("No valid return from GetFusedOdomDelta");
     ROS_INFO_STREAM("Earliest timestamp in buffer is "
-                    << lidar_odometry_buffer_.begin()->first);
+                    << lidar_odometry_buffer_.FrontTime());
     ROS_INFO_STREAM("Latest timestamp in buffer is "
-                    << lidar_odometry_buffer_.rbegin()->first);
+                    << lidar_odometry_buffer_.BackTime());
     ROS_INFO_STREAM("Input times are " << query_timestamp_first_.toSec()
                                        << " and " << t_now.toSec());
     return false;
@@ -296,17 +381,16 @@ bool OdometryHandler::GetOdomDeltaLatestTime(ros::Time& t_latest,
         "Buffers are empty, returning no data (GetOdomDeltaLatestTime)");
     return false;
   }
-  // Get the latest time (rbegin is the last entry in the map)
-  t_latest.fromSec(lidar_odometry_buffer_.rbegin()->first);
+  // Get the latest time
+  t_latest.fromSec(lidar_odometry_buffer_.BackTime());
 
   // Get the delta as normal
   return GetOdomDelta(t_latest, delta_pose);
 }
 
-std::shared_ptr<FactorData> OdometryHandler::GetData(bool check_threshold) {
+bool OdometryHandler::GetData(OdomData* output_data, bool check_threshold) {
   // Main interface with lamp for getting factor information
-  std::shared_ptr<OdomData> output_data = std::make_shared<OdomData>(factors_);
-  output_data->b_has_data = false;
+  ResetFactorData(output_data);
 
   static bool empty_buffer = false;
   if (!CheckOdomSize()) {
@@ -315,14 +399,14 @@ std::shared_ptr<FactorData> OdometryHandler::GetData(bool check_threshold) {
                "[OdometryHandler]");
       empty_buffer = true;
     }
-    return output_data;
+    return false;
   } else {
     empty_buffer = false;
   }
 
   GtsamPosCov fused_odom_for_factor;
 
-  PointCloud::Ptr new_scan(new PointCloud);
+  PointCloud::Ptr new_scan = lamp_utils::PointCloudPool::Instance().Acquire();
   OdometryFactor new_odom;
 
   if (!check_threshold ||
@@ -333,7 +417,7 @@ std::shared_ptr<FactorData> OdometryHandler::GetData(bool check_threshold) {
     ros::Time t2;
     ros::Time t_odom;
 
-    t_odom.fromSec(lidar_odometry_buffer_.rbegin()->first);
+    t_odom.fromSec(lidar_odometry_buffer_.BackTime());
 
     // Get keyed scan from closest time to latest odom
     if (!GetKeyedScanAtTime(t_odom, new_scan)) {
@@ -361,7 +445,7 @@ std::shared_ptr<FactorData> OdometryHandler::GetData(bool check_threshold) {
 
     if (!fused_odom_for_factor.b_has_value) {
       ROS_ERROR("Issues getting delta for factor. Returning no data");
-      return output_data;
+      return false;
     }
 
     // Fill factors data
@@ -380,18 +464,35 @@ std::shared_ptr<FactorData> OdometryHandler::GetData(bool check_threshold) {
     timing_msg.data.push_back(t2.toSec());
     factor_times_pub_.publish(timing_msg);
 
+    // And the odometry source the factor came from
+    std_msgs::String source_msg;
+    source_msg.data = SourceName(last_fused_source_);
+    factor_source_pub_.publish(source_msg);
+
     // Update the query timestamp to the time of the new node
     // TODO - update name to link to node/factor creation
     query_timestamp_first_ = t2;
 
     SetOdomValuesAtKey(t2);
+  }
+
+  return output_data->b_has_data;
+}
 
-    // Clear the stored data, now that it has been processed
-    // This will clear factors_ - hence we have created output_data in this
-    // function
-    ResetFactorData();
+bool OdometryHandler::SkipToLatest() {
+  if (lidar_odometry_buffer_.size() == 0) {
+    return false;
   }
+  ros::Time t_odom;
+  t_odom.fromSec(lidar_odometry_buffer_.BackTime());
+  query_timestamp_first_ = t_odom;
+  SetOdomValuesAtKey(t_odom);
+  return true;
+}
 
+std::shared_ptr<FactorData> OdometryHandler::GetData(bool check_threshold) {
+  std::shared_ptr<OdomData> output_data = std::make_shared<OdomData>();
+  GetData(output_data.get(), check_threshold);
   return output_data;
 }
 
@@ -408,14 +509,16 @@ bool OdometryHandler::GetKeyedScanAtTime(const ros::Time& stamp,
 
   // Search for lower-bound (first entry that is not less than the input
   // timestamp)
-  auto itrTime = point_cloud_buffer_.lower_bound(stamp.toSec());
-  auto time2 = itrTime->first;
+  const double query = stamp.toSec();
+  const size_t lower = point_cloud_buffer_.LowerBound(query);
+  const size_t closest = point_cloud_buffer_.Closest(query);
+  // The caller owns a copy, the buffered cloud is shared
+  *msg = *point_cloud_buffer_.At(closest);
   double time_diff;
 
   // If this gives the start of the buffer, then take that point cloud
-  if (itrTime == point_cloud_buffer_.begin()) {
-    *msg = itrTime->second;
-    time_diff = itrTime->first - stamp.toSec();
+  if (lower == 0) {
+    time_diff = point_cloud_buffer_.TimeAt(closest) - query;
     if (time_diff > keyed_scan_time_diff_limit_) {
       ROS_WARN(
           "Time diff between point cloud and node larger than threshold Using "
@@ -424,44 +527,28 @@ bool OdometryHandler::GetKeyedScanAtTime(const ros::Time& stamp,
                                  << " s. Time diff is: " << time_diff
                                  << ". [GetKeyedScanAtTime]");
     }
-  } else if (itrTime == point_cloud_buffer_.end()) {
+  } else if (lower == point_cloud_buffer_.size()) {
     // Check if it is past the end of the buffer - if so, take the last point
     // cloud
-    itrTime--;
-    *msg = itrTime->second;
-    time_diff = stamp.toSec() - itrTime->first;
-    if (stamp.toSec() - itrTime->first > ts_threshold_) {
+    time_diff = query - point_cloud_buffer_.TimeAt(closest);
+    if (time_diff > ts_threshold_) {
       if (b_debug_pointcloud_buffer_) {
         ROS_WARN(
             "Timestamp past the end of the point cloud buffer [GetKeyedScan]");
         ROS_WARN_STREAM("input time is "
-                        << stamp.toSec() << "s, and latest time is "
-                        << itrTime->first << " s [GetKeyedScan]"
+                        << query << "s, and latest time is "
+                        << point_cloud_buffer_.TimeAt(closest)
+                        << " s [GetKeyedScan]"
                         << " diff is " << time_diff
                         << ". [GetKeyedScanAtTime]");
       }
     }
-    ClearPreviousPointCloudScans(itrTime);
+    ClearPreviousPointCloudScans(closest);
   } else {
-    // Otherwise, step back by 1 to get the time before the input time (t1,
+    // Otherwise the closest of the two times around the input time (t1,
     // stamp, t2)
-    double time1 = std::prev(itrTime, 1)->first;
-
-    PointCloudBuffer::iterator itrTimeReturned;
-
-    // If closer to time2, then use that
-    if (time2 - stamp.toSec() < stamp.toSec() - time1) {
-      *msg = itrTime->second;
-      time_diff = time2 - stamp.toSec();
-      itrTimeReturned = itrTime;
-    } else {
-      // Otherwise use time1
-      *msg = std::prev(itrTime)->second;
-      time_diff = stamp.toSec() - time1;
-      itrTimeReturned = std::prev(itrTime);
-    }
-
-    ClearPreviousPointCloudScans(itrTimeReturned);
+    time_diff = std::fabs(point_cloud_buffer_.TimeAt(closest) - query);
+    ClearPreviousPointCloudScans(closest);
   }
 
   // Check if the time difference is too large
@@ -482,10 +569,12 @@ bool OdometryHandler::GetKeyedScanAtTime(const ros::Time& stamp,
   return true;
 }
 
-void OdometryHandler::ClearPreviousPointCloudScans(
-    const PointCloudBuffer::iterator& itrTime) {
-  auto itrBegin = point_cloud_buffer_.begin();
-  point_cloud_buffer_.erase(itrBegin, itrTime);
+void OdometryHandler::ClearPreviousPointCloudScans(size_t index) {
+  // Erased slots keep their value until reused, release the clouds now
+  for (size_t i = 0; i < std::min(index, point_cloud_buffer_.size()); i++) {
+    point_cloud_buffer_.At(i).reset();
+  }
+  point_cloud_buffer_.EraseBefore(index);
 }
 
 // Utilities
@@ -514,38 +603,32 @@ GtsamPosCov OdometryHandler::GetFusedOdomDeltaBetweenTimes(const ros::Time t1,
   //                                    << ". Difference is: "
   //                                    << t2.toSec() - t1.toSec());
 
-  GtsamPosCov lidar_odom, visual_odom, wheel_odom;
-
-  // ROS_INFO_STREAM("Lidar buffer size in GetFusedOdom is: "
-  //                 << lidar_odometry_buffer_.size());
-
-  if (b_register_lidar_sub_) {
-    FillGtsamPosCovOdom(
-        lidar_odometry_buffer_, lidar_odom, t1, t2, LIDAR_ODOM_BUFFER_ID);
-  }
-  if (b_register_visual_sub_) {
-    FillGtsamPosCovOdom(
-        visual_odometry_buffer_, visual_odom, t1, t2, VISUAL_ODOM_BUFFER_ID);
-  }
-  if (b_register_wheel_sub_) {
-    FillGtsamPosCovOdom(
-        wheel_odometry_buffer_, wheel_odom, t1, t2, WHEEL_ODOM_BUFFER_ID);
-  }
-
-  if (lidar_odom.b_has_value == true) {
-    // TODO: For the first implementation, pure lidar-based odometry is used.
-    output_odom = lidar_odom;
-  } else {
-    ROS_ERROR("Failed to get odom from lidar");
-    output_odom = lidar_odom;
-  }
-
-  if (visual_odom.b_has_value == true) {
-    //
+  // The odometry messages are poses in each source's odom frame, so a delta
+  // is two buffer lookups. Only the sources needed are evaluated: the first
+  // healthy one in priority order, else the first degraded one with a delta
+  for (int pass = 0; pass < 2 && !output_odom.b_has_value; pass++) {
+    for (int id : source_priority_) {
+      if (!IsSourceRegistered(id) || GetOdomBuffer(id).size() == 0) {
+        continue;
+      }
+      if ((pass == 0) != IsSourceHealthy(id, t2)) {
+        continue;
+      }
+      FillGtsamPosCovOdom(GetOdomBuffer(id), output_odom, t1, t2, id);
+      if (output_odom.b_has_value) {
+        if (id != last_fused_source_) {
+          ROS_INFO_STREAM(name_ << ": Odometry source switched from "
+                                << SourceName(last_fused_source_) << " to "
+                                << SourceName(id));
+        }
+        last_fused_source_ = id;
+        break;
+      }
+    }
   }
 
-  if (wheel_odom.b_has_value == true) {
-    //
+  if (!output_odom.b_has_value) {
+    ROS_ERROR("Failed to get odom from any source");
   }
 
   return output_odom;
@@ -580,6 +663,77 @@ void OdometryHandler::FillGtsamPosCovOdom(const OdomPoseBuffer& odom_buffer,
   }
 }
 
+const OdomPoseBuffer& OdometryHandler::GetOdomBuffer(int odom_buffer_id) const {
+  switch (odom_buffer_id) {
+  case VISUAL_ODOM_BUFFER_ID:
+    return visual_odometry_buffer_;
+  case WHEEL_ODOM_BUFFER_ID:
+    return wheel_odometry_buffer_;
+  default:
+    return lidar_odometry_buffer_;
+  }
+}
+
+bool OdometryHandler::IsSourceRegistered(int odom_buffer_id) const {
+  switch (odom_buffer_id) {
+  case LIDAR_ODOM_BUFFER_ID:
+    return b_register_lidar_sub_;
+  case VISUAL_ODOM_BUFFER_ID:
+    return b_register_visual_sub_;
+  case WHEEL_ODOM_BUFFER_ID:
+    return b_register_wheel_sub_;
+  default:
+    return false;
+  }
+}
+
+bool OdometryHandler::IsSourceHealthy(int odom_buffer_id,
+                                      const ros::Time& t) const {
+  const OdomSourceHealth& health = source_health_[odom_buffer_id];
+  if (min_source_rate_ > 0) {
+    const double max_period = 1.0 / min_source_rate_;
+    // Slow on average, or silent for longer than a period before t
+    if (health.period > max_period ||
+        t.toSec() - health.last_stamp > max_period) {
+      return false;
+    }
+  }
+  if (max_position_variance_ > 0 &&
+      health.position_variance > max_position_variance_) {
+    return false;
+  }
+  return true;
+}
+
+void OdometryHandler::UpdateSourceHealth(const Odometry::ConstPtr& msg,
+                                         int odom_buffer_id) {
+  OdomSourceHealth& health = source_health_[odom_buffer_id];
+  const double stamp = msg->header.stamp.toSec();
+  if (health.last_stamp > 0 && stamp > health.last_stamp) {
+    const double period = stamp - health.last_stamp;
+    // Recent periods weigh most, a stream slowing down shows within a few
+    // messages
+    health.period =
+        health.period > 0 ? 0.8 * health.period + 0.2 * period : period;
+  }
+  health.last_stamp = std::max(health.last_stamp, stamp);
+  const auto& covariance = msg->pose.covariance;
+  health.position_variance = covariance[0] + covariance[7] + covariance[14];
+}
+
+std::string OdometryHandler::SourceName(int odom_buffer_id) {
+  switch (odom_buffer_id) {
+  case LIDAR_ODOM_BUFFER_ID:
+    return "lidar";
+  case VISUAL_ODOM_BUFFER_ID:
+    return "visual";
+  case WHEEL_ODOM_BUFFER_ID:
+    return "wheel";
+  default:
+    return "unknown";
+  }
+}
+
 bool OdometryHandler::CheckOdomSize() {
   bool b_odom_has_data;
   b_odom_has_data = (lidar_odometry_buffer_.size() > 1);
@@ -588,11 +742,10 @@ bool OdometryHandler::CheckOdomSize() {
   return b_odom_has_data;
 }
 
-void OdometryHandler::ResetFactorData() {
-  // TODO: ResetFactors() clear all fields of private class member
-  factors_.b_has_data = false;
-  factors_.type = "odom";
-  factors_.factors.clear();
+void OdometryHandler::ResetFactorData(OdomData* data) const {
+  data->b_has_data = false;
+  data->type = "odom";
+  data->factors.clear();
 }
 
 void OdometryHandler::InitializeOdomValueAtKey(
@@ -659,58 +812,58 @@ bool OdometryHandler::GetPoseAtTime(const ros::Time stamp,
                                     PoseCovStamped& output,
                                     ros::Time* new_stamp) const {
   *new_stamp = stamp;
-  // If map is empty, return false to the caller
+  // If buffer is empty, return false to the caller
   if (odom_buffer.size() == 0) {
     return false;
   }
 
   // Given the input timestamp, search for lower bound (first entry that is not
-  // less than the given timestamp)
-  auto itrTime = odom_buffer.lower_bound(stamp.toSec());
-  auto time2 = itrTime->first;
+  // less than the given timestamp) and the closest entry
+  const double query = stamp.toSec();
+  const size_t lower = odom_buffer.LowerBound(query);
+
+  // Inside the buffer, interpolate between the messages around the query
+  if (b_interpolate_poses_ && lower > 0 && lower < odom_buffer.size()) {
+    const double time1 = odom_buffer.TimeAt(lower - 1);
+    const double time2 = odom_buffer.TimeAt(lower);
+    if (time2 - time1 <= max_interpolation_gap_) {
+      output = InterpolatePoses(odom_buffer.At(lower - 1),
+                                odom_buffer.At(lower),
+                                (query - time1) / (time2 - time1));
+      output.header.stamp = stamp;
+      return true;
+    }
+  }
+
+  const size_t closest = odom_buffer.Closest(query);
+  output = odom_buffer.At(closest);
+  *new_stamp = ros::Time(odom_buffer.TimeAt(closest));
   double time_diff;
 
   // If this gives the start of the buffer, then take that PosCovStamped
-  if (itrTime == odom_buffer.begin()) {
-    output = itrTime->second;
-    *new_stamp = ros::Time(itrTime->first);
-    time_diff = itrTime->first - stamp.toSec();
+  if (lower == 0) {
+    time_diff = odom_buffer.TimeAt(closest) - query;
     if (time_diff > ts_threshold_) {
       ROS_WARN("Timestamp before the start of the odometry buffer beyond "
                "threshold [GetPoseAtTime]");
       ROS_WARN_STREAM("time diff is: " << time_diff << ". [GetPoseAtTime]");
     }
-  } else if (itrTime == odom_buffer.end()) {
+  } else if (lower == odom_buffer.size()) {
     // Check if it is past the end of the buffer - if so, then take the last
     // PosCovStamped
-    itrTime--;
-    output = itrTime->second;
-    *new_stamp = ros::Time(itrTime->first);
-    time_diff = stamp.toSec() - itrTime->first;
+    time_diff = query - odom_buffer.TimeAt(closest);
     if (time_diff > ts_threshold_) {
       ROS_WARN("Timestamp past the end of the odometry buffer and beyond "
                "threshold [GetPoseAtTime]");
       ROS_WARN_STREAM("input time is "
-                      << stamp.toSec() << "s, and latest time is "
-                      << itrTime->first << " s"
+                      << query << "s, and latest time is "
+                      << odom_buffer.TimeAt(closest) << " s"
                       << " diff is " << time_diff << ". [GetPoseAtTime]");
     }
   } else {
-    // Otherwise step back by 1 to get the time before the input time (time1,
+    // Otherwise the closest of the two times around the input time (time1,
     // stamp, time2)
-    double time1 = std::prev(itrTime, 1)->first;
-
-    // If closer to time2, then use that
-    if (time2 - stamp.toSec() < stamp.toSec() - time1) {
-      output = itrTime->second;
-      *new_stamp = ros::Time(itrTime->first);
-      time_diff = time2 - stamp.toSec();
-    } else {
-      // Otherwise use time1
-      output = std::prev(itrTime, 1)->second;
-      *new_stamp = ros::Time(std::prev(itrTime, 1)->first);
-      time_diff = stamp.toSec() - time1;
-    }
+    time_diff = std::fabs(odom_buffer.TimeAt(closest) - query);
   }
 
   if (b_debug_pointcloud_buffer_) {
@@ -785,53 +938,39 @@ bool OdometryHandler::GetTransformBetweenTimes(
 
 bool OdometryHandler::GetClosestLidarTime(const ros::Time stamp,
                                           ros::Time& closest_stamp) const {
-  // Map based logic
-
-  // If map is empty, return false to the caller
+  // If buffer is empty, return false to the caller
   if (lidar_odometry_buffer_.size() == 0) {
     return false;
   }
 
   // Given the input timestamp, search for lower bound (first entry that is not
   // less than the given timestamp)
-  auto itrTime = lidar_odometry_buffer_.lower_bound(stamp.toSec());
-  auto time2 = itrTime->first;
+  const double query = stamp.toSec();
+  const size_t lower = lidar_odometry_buffer_.LowerBound(query);
+  const size_t closest = lidar_odometry_buffer_.Closest(query);
+  closest_stamp.fromSec(lidar_odometry_buffer_.TimeAt(closest));
 
   // If this gives the start of the buffer, then take that PosCovStamped
-  if (itrTime == lidar_odometry_buffer_.begin()) {
-    closest_stamp.fromSec(itrTime->first);
+  if (lower == 0) {
     return true;
   }
 
   // Check if it is past the end of the buffer - if so, then take the last
   // PosCovStamped
-  if (itrTime == lidar_odometry_buffer_.end()) {
-    itrTime--;
-    closest_stamp.fromSec(itrTime->first);
+  if (lower == lidar_odometry_buffer_.size()) {
     if ((stamp - closest_stamp).toSec() > ts_threshold_) {
       ROS_WARN("Timestamp past the end of the lidar odometry buffer "
                "[GetClosestLidarTime]");
       ROS_WARN_STREAM("input time is "
-                      << stamp.toSec() << "s, and latest time is "
-                      << itrTime->first << " s [GetClosestLidarTime]");
+                      << query << "s, and latest time is "
+                      << closest_stamp.toSec() << " s [GetClosestLidarTime]");
     }
     return true;
   }
 
-  // Otherwise step back by 1 to get the time before the input time (time1,
+  // Otherwise the closest of the two times around the input time (time1,
   // stamp, time2)
-  double time1 = std::prev(itrTime, 1)->first;
-  double time_diff;
-
-  // If closer to time2, then use that
-  if (time2 - stamp.toSec() < stamp.toSec() - time1) {
-    closest_stamp.fromSec(itrTime->first);
-    time_diff = time2 - stamp.toSec();
-  } else {
-    // Otherwise use time1
-    closest_stamp.fromSec(std::prev(itrTime, 1)->first);
-    time_diff = stamp.toSec() - time1;
-  }
+  double time_diff = std::fabs(closest_stamp.toSec() - query);
 
   // Check if the time difference is too large
   if (time_diff > ts_threshold_) {
@@ -844,6 +983,35 @@ bool OdometryHandler::GetClosestLidarTime(const ros::Time stamp,
   return true;
 }
 
+PoseCovStamped OdometryHandler::InterpolatePoses(const PoseCovStamped& first,
+                                                const PoseCovStamped& second,
+                                                double alpha) const {
+  PoseCovStamped output = first;
+
+  const auto& p1 = first.pose.pose.position;
+  const auto& p2 = second.pose.pose.position;
+  output.pose.pose.position.x = p1.x + alpha * (p2.x - p1.x);
+  output.pose.pose.position.y = p1.y + alpha * (p2.y - p1.y);
+  output.pose.pose.position.z = p1.z + alpha * (p2.z - p1.z);
+
+  const auto& o1 = first.pose.pose.orientation;
+  const auto& o2 = second.pose.pose.orientation;
+  Eigen::Quaterniond q1(o1.w, o1.x, o1.y, o1.z);
+  Eigen::Quaterniond q2(o2.w, o2.x, o2.y, o2.z);
+  Eigen::Quaterniond q = q1.normalized().slerp(alpha, q2.normalized());
+  output.pose.pose.orientation.x = q.x();
+  output.pose.pose.orientation.y = q.y();
+  output.pose.pose.orientation.z = q.z();
+  output.pose.pose.orientation.w = q.w();
+
+  // A convex combination of covariances is still a valid covariance
+  for (size_t i = 0; i < output.pose.covariance.size(); i++) {
+    output.pose.covariance[i] = (1.0 - alpha) * first.pose.covariance[i] +
+        alpha * second.pose.covariance[i];
+  }
+  return output;
+}
+
 gtsam::Pose3 OdometryHandler::GetTransform(
     const PoseCovStampedPair pose_cov_stamped_pair) const {
   // Gets the transform between two pose stamped - the delta
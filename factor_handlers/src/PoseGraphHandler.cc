@@ -6,10 +6,21 @@
 
 // Includes
 #include <factor_handlers/PoseGraphHandler.h>
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudPool.h>
+#include <lamp_utils/ScanCompression.h>
+#include <pcl/common/io.h>
+
+#include <algorithm>
 
 PoseGraphHandler::PoseGraphHandler() { }
 
-PoseGraphHandler::~PoseGraphHandler() { }
+PoseGraphHandler::~PoseGraphHandler() {
+  // Releases the callbacks waiting for room in the ingestion queue first
+  StopIngestion();
+  StopSpinners();
+}
 
 bool PoseGraphHandler::Initialize(const ros::NodeHandle& n, std::vector<std::string> robot_names) {
   name_ = ros::names::append(n.getNamespace(), "PoseGraphHandler");
@@ -34,6 +45,9 @@ bool PoseGraphHandler::Initialize(const ros::NodeHandle& n, std::vector<std::str
     return false;
   }
 
+  StartIngestion();
+  StartSpinners();
+
   return true;
 }
 
@@ -51,6 +65,18 @@ bool PoseGraphHandler::LoadParameters(const ros::NodeHandle& n) {
                normals_compute_params_.num_threads))
     return false;
 
+  if (!pu::Get("keyed_scan_ingestion/num_threads", ingestion_threads_))
+    return false;
+  if (!pu::Get("keyed_scan_ingestion/max_queued_scans", max_queued_scans_))
+    return false;
+  if (!pu::Get("keyed_scan_ingestion/max_scans_per_batch",
+               max_scans_per_batch_))
+    return false;
+  if (!pu::Get("keyed_scan_ingestion/voxel_leaf", ingestion_voxel_leaf_))
+    return false;
+  if (!pu::Get("robot_subscriptions/queue_size", robot_queue_size_))
+    return false;
+
   return true;
 }
 
@@ -73,34 +99,82 @@ bool PoseGraphHandler::RegisterCallbacks(const ros::NodeHandle& n) {
 
   ros::NodeHandle nl(n);
 
-  ros::Subscriber pose_graph_sub;
-  ros::Subscriber keyed_scan_sub;
-
-  // Create subscribers for each robot
+  // Create subscribers for each robot, on the callback queue of the robot
   for (std::string robot : robot_names_) {
+    std::unique_ptr<RobotChannel>& channel = channels_[robot];
+    channel.reset(new RobotChannel);
+    channel->robot = robot;
+    channel->lag_ms = &lamp_utils::MetricsRegistry::Instance().GetGauge(
+        "pose_graph_handler." + robot + ".lag_ms");
 
     // Pose graph
-    pose_graph_sub = nl.subscribe<pose_graph_msgs::PoseGraph>(
-        "/" + robot + "/lamp/pose_graph_incremental",
-        100000,
-        &PoseGraphHandler::PoseGraphCallback,
-        this);
+    channel->subscribers.push_back(SubscribeRobot(
+        nl,
+        channel.get(),
+        "/lamp/pose_graph_incremental",
+        &PoseGraphHandler::PoseGraphCallback));
 
     // Keyed scans
-    keyed_scan_sub = nl.subscribe<pose_graph_msgs::KeyedScan>(
-        "/" + robot + "/lamp/keyed_scans",
-        100000,
-        &PoseGraphHandler::KeyedScanCallback,
-        this);
-
-    // Store the subscribers
-    subscribers_posegraph.push_back(pose_graph_sub);
-    subscribers_keyedscan.push_back(keyed_scan_sub);
+    channel->subscribers.push_back(
+        SubscribeRobot(nl,
+                       channel.get(),
+                       "/lamp/keyed_scans",
+                       &PoseGraphHandler::KeyedScanCallback));
+
+    // Downsampled keyed scans, sent when the link is short on bandwidth
+    channel->subscribers.push_back(
+        SubscribeRobot(nl,
+                       channel.get(),
+                       "/lamp/keyed_scans_coarse",
+                       &PoseGraphHandler::CoarseKeyedScanCallback));
+
+    // Keyed scans in levels of detail
+    channel->subscribers.push_back(
+        SubscribeRobot(nl,
+                       channel.get(),
+                       "/lamp/keyed_scan_layers",
+                       &PoseGraphHandler::KeyedScanLayerCallback));
   }
 
   return true;
 }
 
+template <typename M>
+ros::Subscriber PoseGraphHandler::SubscribeRobot(
+    ros::NodeHandle& nl,
+    RobotChannel* channel,
+    const std::string& topic,
+    void (PoseGraphHandler::*callback)(const boost::shared_ptr<const M>&,
+                                       RobotChannel*)) {
+  ros::SubscribeOptions options;
+  options.template initByFullCallbackType<const ros::MessageEvent<const M>&>(
+      "/" + channel->robot + topic,
+      robot_queue_size_,
+      [this, channel, callback](const ros::MessageEvent<const M>& event) {
+        channel->lag_ms->Set(
+            (ros::Time::now() - event.getReceiptTime()).toSec() * 1e3);
+        (this->*callback)(event.getConstMessage(), channel);
+      });
+  options.callback_queue = &channel->queue;
+  return nl.subscribe(options);
+}
+
+void PoseGraphHandler::StartSpinners() {
+  for (auto& kv : channels_) {
+    // One thread per robot keeps the messages of the robot in order
+    kv.second->spinner.reset(new ros::AsyncSpinner(1, &kv.second->queue));
+    kv.second->spinner->start();
+  }
+}
+
+void PoseGraphHandler::StopSpinners() {
+  for (auto& kv : channels_) {
+    if (kv.second->spinner) {
+      kv.second->spinner->stop();
+    }
+  }
+}
+
 bool PoseGraphHandler::CreatePublishers(const ros::NodeHandle& n) {
   // Create a local nodehandle to manage callback subscriptions.
   ros::NodeHandle nl(n);
@@ -108,40 +182,135 @@ bool PoseGraphHandler::CreatePublishers(const ros::NodeHandle& n) {
   // Keyed scans are republished at the base station as soon as they are received
   keyed_scan_pub_ =
       nl.advertise<pose_graph_msgs::KeyedScan>("keyed_scans", 1000000, false);
+
+  // Keyframe requests when the delta stream of a robot has a gap
+  for (auto& kv : channels_) {
+    kv.second->resync_pub = nl.advertise<std_msgs::Empty>(
+        "/" + kv.first + "/lamp/pose_graph_resync", 10, false);
+  }
   return true;
 }
 
+bool PoseGraphHandler::GetData(PoseGraphData* data) {
+  ResetGraphData(data);
+
+  // Robot by robot, keeping the order of the events of each
+  PoseGraphEvent event;
+  for (auto& kv : channels_) {
+    while (kv.second->events.Pop(event)) {
+      switch (event.type) {
+      case PoseGraphEvent::Type::GRAPH:
+        data->graphs.push_back(std::move(event.graph));
+        break;
+      case PoseGraphEvent::Type::SCAN:
+        data->clouds.emplace_back(event.key, std::move(event.cloud));
+        break;
+      case PoseGraphEvent::Type::COARSE_KEY:
+        data->coarse_keys.push_back(event.key);
+        break;
+      case PoseGraphEvent::Type::SCAN_REFINEMENT:
+        data->scan_refinements.emplace_back(event.key,
+                                            std::move(event.cloud));
+        break;
+      case PoseGraphEvent::Type::COMPLETE_KEY:
+        data->complete_keys.push_back(event.key);
+        break;
+      }
+    }
+  }
+
+  // Hand over a batch of the ingested scans
+  {
+    std::lock_guard<std::mutex> lock(ingestion_mutex_);
+    size_t n = ingested_scans_.size();
+    if (max_scans_per_batch_ > 0) {
+      n = std::min<size_t>(n, max_scans_per_batch_);
+    }
+    data->clouds.insert(data->clouds.end(),
+                        ingested_scans_.begin(),
+                        ingested_scans_.begin() + n);
+    ingested_scans_.erase(ingested_scans_.begin(),
+                          ingested_scans_.begin() + n);
+  }
+
+  data->b_has_data = !data->graphs.empty() || !data->clouds.empty() ||
+      !data->coarse_keys.empty() || !data->scan_refinements.empty() ||
+      !data->complete_keys.empty();
+  return data->b_has_data;
+}
+
 std::shared_ptr<FactorData> PoseGraphHandler::GetData() {
 
   // Main interface with lamp for getting new pose graphs
-  std::shared_ptr<PoseGraphData> output_data = std::make_shared<PoseGraphData>(data_);
-
-  // Clear the stored data
-  ResetGraphData();
+  std::shared_ptr<PoseGraphData> output_data = std::make_shared<PoseGraphData>();
+  GetData(output_data.get());
 
   return output_data;
 }
 
-void PoseGraphHandler::ResetGraphData() {
-  data_.b_has_data = false; 
-  data_.type = "posegraph";
-  data_.graphs.clear();
-  data_.scans.clear();
+void PoseGraphHandler::ResetGraphData(PoseGraphData* data) const {
+  data->b_has_data = false;
+  data->type = "posegraph";
+  data->graphs.clear();
+  data->scans.clear();
+  data->clouds.clear();
+  data->coarse_keys.clear();
+  data->scan_refinements.clear();
+  data->complete_keys.clear();
 }
 
-void PoseGraphHandler::PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+void PoseGraphHandler::PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg,
+                                         RobotChannel* channel) {
+  const std::string& robot = channel->robot;
+
+  // Apply delta encoded graphs in order, expanding the pose updates
+  pose_graph_msgs::PoseGraph::ConstPtr decoded;
+  auto status = channel->delta_decoder.Decode(msg, &decoded);
+  if (status == lamp_utils::PoseGraphDeltaDecoder::Status::STALE) {
+    ROS_DEBUG_STREAM("PoseGraphHandler: Dropping stale pose graph "
+                     << msg->sequence << " from " << robot);
+    return;
+  }
+  if (status == lamp_utils::PoseGraphDeltaDecoder::Status::GAP) {
+    ros::Time now = ros::Time::now();
+    if ((now - channel->last_resync_request).toSec() >
+        resync_request_interval_) {
+      ROS_WARN_STREAM("PoseGraphHandler: Missed pose graphs from "
+                      << robot << " (got " << msg->sequence
+                      << "), requesting a keyframe");
+      channel->resync_pub.publish(std_msgs::Empty());
+      channel->last_resync_request = now;
+    }
+    return;
+  }
 
-  data_.b_has_data = true;
-  data_.graphs.push_back(msg);
+  PoseGraphEvent event;
+  event.type = PoseGraphEvent::Type::GRAPH;
+  event.graph = decoded;
+  channel->events.Push(std::move(event));
+  Wake();
+
+  // Keyframes restate the whole graph, only catch up on the keys
+  if (msg->keyframe) {
+    for (const auto& node : msg->nodes) {
+      channel->pose_graph_node_keys.insert(node.key);
+      if (node.ID == "odom_node") {
+        gtsam::Symbol node_symbol(node.key);
+        uint64_t& last_key = channel->last_odom_node_key[node_symbol.chr()];
+        last_key = std::max<uint64_t>(last_key, node.key);
+      }
+    }
+    return;
+  }
 
   std::unordered_set<uint64_t> repeated_keys;
   for (const auto& node : msg->nodes){
       if (node.ID == "odom_node") {
           //check we only increase by one if it's on the same robot
           gtsam::Symbol node_symbol(node.key);
-          if (last_odom_node_key_from_robot_.count(node_symbol.chr()) > 0){
+          if (channel->last_odom_node_key.count(node_symbol.chr()) > 0){
               uint64_t cur_key = node.key;
-              uint64_t last_key = last_odom_node_key_from_robot_[node_symbol.chr()];
+              uint64_t last_key = channel->last_odom_node_key[node_symbol.chr()];
               if (cur_key != last_key) { // this gets handled by the repeated key
                   if (cur_key < last_key) {
                       ROS_WARN_STREAM(
@@ -158,13 +327,13 @@ void PoseGraphHandler::PoseGraphCallback(const pose_graph_msgs::PoseGraph::Const
                   }
               }
           }
-          last_odom_node_key_from_robot_[node_symbol.chr()] = node_symbol.key();
+          channel->last_odom_node_key[node_symbol.chr()] = node_symbol.key();
       }
       //check that the key hasn't already been sent
-      if (pose_graph_node_keys_.count(node.key) > 0) {
+      if (channel->pose_graph_node_keys.count(node.key) > 0) {
           repeated_keys.insert(node.key);
       } else {
-          pose_graph_node_keys_.insert(node.key);
+          channel->pose_graph_node_keys.insert(node.key);
 
       }
   }
@@ -179,31 +348,37 @@ void PoseGraphHandler::PoseGraphCallback(const pose_graph_msgs::PoseGraph::Const
   }
 }
 
-void PoseGraphHandler::KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& msg) {
+void PoseGraphHandler::KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& msg,
+                                         RobotChannel* channel) {
+
+  if (ingestion_workers_.empty()) {
+    IngestKeyedScan(msg);
+  } else {
+    std::unique_lock<std::mutex> lock(ingestion_mutex_);
+    // Back-pressure, the scans wait in the subscriber queue until the
+    // workers catch up
+    ingestion_space_cv_.wait(lock, [this] {
+      return b_stop_ingestion_ ||
+          ingestion_queue_.size() < static_cast<size_t>(max_queued_scans_);
+    });
+    ingestion_queue_.push_back(msg);
+    lock.unlock();
+    ingestion_cv_.notify_one();
+  }
 
-  data_.b_has_data = true;
-  data_.scans.push_back(msg);
+  // The full scan replaces any layers still missing
+  channel->scan_layers.erase(msg->key);
 
-  // Republish from base station
-  // Compute keyed scan normals
-  pose_graph_msgs::KeyedScan::Ptr new_pub_ks(
-      new pose_graph_msgs::KeyedScan(*msg));
-  PointXyziCloud::Ptr msg_cloud(new PointXyziCloud);
-  PointCloud::Ptr pub_cloud(new PointCloud);
-  pcl::fromROSMsg(msg->scan, *msg_cloud);
-  lamp_utils::AddNormals(msg_cloud, normals_compute_params_, pub_cloud);
-  pcl::toROSMsg(*pub_cloud, new_pub_ks->scan);
-  keyed_scan_pub_.publish(new_pub_ks);
   // Add scan
-  if (keyed_scans_keys_.count(msg->key) > 0){
+  if (channel->keyed_scans_keys.count(msg->key) > 0){
       ROS_DEBUG_STREAM("PoseGraphHandler: Repeated keyed Scan for key " << msg->key);
   } else {
-      keyed_scans_keys_.insert(msg->key);
+      channel->keyed_scans_keys.insert(msg->key);
 
       gtsam::Symbol node_symbol(msg->key);
-      if (last_keyed_scan_key_from_robot_.count(node_symbol.chr()) > 0) {
+      if (channel->last_keyed_scan_key.count(node_symbol.chr()) > 0) {
           uint64_t cur_key = node_symbol.key();
-          uint64_t last_key = last_keyed_scan_key_from_robot_[node_symbol.chr()];
+          uint64_t last_key = channel->last_keyed_scan_key[node_symbol.chr()];
           if (cur_key < last_key) {
               ROS_WARN_STREAM(
                       "PoseGraphHandler: Keyed scans arriving out of order for " << node_symbol.chr() << ". Last key "
@@ -219,6 +394,163 @@ void PoseGraphHandler::KeyedScanCallback(const pose_graph_msgs::KeyedScan::Const
           }
       }
 
-      last_keyed_scan_key_from_robot_[node_symbol.chr()] = node_symbol.key();
+      channel->last_keyed_scan_key[node_symbol.chr()] = node_symbol.key();
+  }
+}
+
+void PoseGraphHandler::CoarseKeyedScanCallback(
+    const pose_graph_msgs::KeyedScan::ConstPtr& msg,
+    RobotChannel* channel) {
+  PoseGraphEvent event;
+  event.type = PoseGraphEvent::Type::COARSE_KEY;
+  event.key = msg->key;
+  channel->events.Push(std::move(event));
+  KeyedScanCallback(msg, channel);
+}
+
+void PoseGraphHandler::KeyedScanLayerCallback(
+    const pose_graph_msgs::KeyedScanLayer::ConstPtr& msg,
+    RobotChannel* channel) {
+  if (msg->num_layers == 0 || msg->layer >= msg->num_layers) {
+    ROS_WARN_STREAM("PoseGraphHandler: Invalid layer " << int(msg->layer)
+                                                       << " of keyed scan "
+                                                       << msg->key);
+    return;
+  }
+  // Key already complete
+  if (channel->keyed_scans_keys.count(msg->key) &&
+      !channel->scan_layers.count(msg->key)) {
+    ROS_DEBUG_STREAM("PoseGraphHandler: Repeated keyed scan layer for key "
+                     << msg->key);
+    return;
+  }
+  auto& layers = channel->scan_layers[msg->key];
+  if (layers.empty()) {
+    layers.resize(msg->num_layers);
+  }
+  if (msg->layer >= layers.size() || layers[msg->layer] != nullptr) {
+    return;
   }
-}
\ No newline at end of file
+  channel->keyed_scans_keys.insert(msg->key);
+
+  PointXyziCloud::Ptr layer(new PointXyziCloud);
+  lamp_utils::FromRosMsg(msg->scan, layer.get());
+  layers[msg->layer] = layer;
+
+  PointCloud::Ptr cloud(new PointCloud);
+  pcl::copyPointCloud(*layer, *cloud);
+  const bool b_complete = std::all_of(
+      layers.begin(), layers.end(), [](const PointXyziCloud::ConstPtr& l) {
+        return l != nullptr;
+      });
+  PoseGraphEvent event;
+  event.key = msg->key;
+  event.cloud = cloud;
+  if (msg->layer == 0) {
+    event.type = PoseGraphEvent::Type::SCAN;
+    channel->events.Push(std::move(event));
+    if (!b_complete) {
+      event.type = PoseGraphEvent::Type::COARSE_KEY;
+      event.key = msg->key;
+      channel->events.Push(std::move(event));
+    }
+  } else {
+    event.type = PoseGraphEvent::Type::SCAN_REFINEMENT;
+    channel->events.Push(std::move(event));
+  }
+  if (!b_complete) {
+    Wake();
+    return;
+  }
+
+  // Downstream consumers take the first scan of a key, only give them the
+  // full one
+  PointXyziCloud::Ptr full(new PointXyziCloud);
+  for (const auto& l : layers) {
+    *full += *l;
+  }
+  full->header = layers[0]->header;
+  PointCloud::Ptr full_normals(new PointCloud);
+  lamp_utils::AddNormals(full, normals_compute_params_, full_normals);
+  RepublishKeyedScan(msg->key, full_normals);
+  PoseGraphEvent complete;
+  complete.type = PoseGraphEvent::Type::COMPLETE_KEY;
+  complete.key = msg->key;
+  channel->events.Push(std::move(complete));
+  channel->scan_layers.erase(msg->key);
+  Wake();
+}
+
+void PoseGraphHandler::StartIngestion() {
+  b_stop_ingestion_ = false;
+  for (int i = 0; i < ingestion_threads_; i++) {
+    ingestion_workers_.emplace_back(&PoseGraphHandler::IngestionWorker, this);
+  }
+  ROS_INFO_STREAM(name_ << ": Ingesting keyed scans on "
+                        << ingestion_workers_.size() << " threads");
+}
+
+void PoseGraphHandler::StopIngestion() {
+  {
+    std::lock_guard<std::mutex> lock(ingestion_mutex_);
+    b_stop_ingestion_ = true;
+  }
+  ingestion_cv_.notify_all();
+  ingestion_space_cv_.notify_all();
+  for (auto& worker : ingestion_workers_) {
+    worker.join();
+  }
+  ingestion_workers_.clear();
+}
+
+void PoseGraphHandler::IngestionWorker() {
+  while (true) {
+    pose_graph_msgs::KeyedScan::ConstPtr msg;
+    {
+      std::unique_lock<std::mutex> lock(ingestion_mutex_);
+      ingestion_cv_.wait(lock, [this] {
+        return b_stop_ingestion_ || !ingestion_queue_.empty();
+      });
+      if (b_stop_ingestion_)
+        return;
+      msg = ingestion_queue_.front();
+      ingestion_queue_.pop_front();
+    }
+    ingestion_space_cv_.notify_one();
+    IngestKeyedScan(msg);
+  }
+}
+
+void PoseGraphHandler::IngestKeyedScan(
+    const pose_graph_msgs::KeyedScan::ConstPtr& msg) {
+  // Cloud for the map and the scan store
+  PointCloud::Ptr cloud = lamp_utils::PointCloudPool::Instance().Acquire();
+  if (!lamp_utils::KeyedScanMsgToScan(*msg, cloud.get())) {
+    ROS_WARN_STREAM("PoseGraphHandler: Failed to decode keyed scan "
+                    << msg->key);
+    return;
+  }
+
+  // Republish from base station, with the normals the robot sent or
+  // estimated here once
+  lamp_utils::EnsureNormals(cloud, normals_compute_params_);
+  RepublishKeyedScan(msg->key, cloud);
+
+  if (ingestion_voxel_leaf_ > 0) {
+    lamp_utils::VoxelDownsample(*cloud, ingestion_voxel_leaf_, cloud.get());
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(ingestion_mutex_);
+    ingested_scans_.emplace_back(msg->key, cloud);
+  }
+  Wake();
+}
+
+void PoseGraphHandler::RepublishKeyedScan(gtsam::Key key,
+                                          const PointCloud::ConstPtr& scan) {
+  pose_graph_msgs::KeyedScan::Ptr new_pub_ks(new pose_graph_msgs::KeyedScan);
+  new_pub_ks->key = key;
+  lamp_utils::ToRosMsg(*scan, &new_pub_ks->scan);
+  keyed_scan_pub_.publish(new_pub_ks);
+}
@@ -40,6 +40,17 @@ bool RobotPoseHandler::Initialize(const ros::NodeHandle& n, std::vector<std::str
 bool RobotPoseHandler::LoadParameters(const ros::NodeHandle& n) {
   ROS_INFO("LoadParameters method called in RobotPoseHandler");
 
+  int history_size = 0;
+  if (!pu::Get("robot_pose_prediction/history_size", history_size))
+    return false;
+  if (!pu::Get("robot_pose_prediction/max_horizon",
+               extrapolator_params_.max_horizon))
+    return false;
+  if (!pu::Get("robot_pose_prediction/confidence_time_constant",
+               extrapolator_params_.confidence_time_constant))
+    return false;
+  extrapolator_params_.history_size = history_size;
+
   return true;
 }
 
@@ -87,17 +98,45 @@ bool RobotPoseHandler::CreatePublishers(const ros::NodeHandle& n) {
   return true;
 }
 
-void RobotPoseHandler::ResetPoseData() {
-  data_.b_has_data = false;
-  data_.poses.clear();
-  data_.type = "pose";
+void RobotPoseHandler::ResetPoseData(RobotPoseData* data) const {
+  data->b_has_data = false;
+  data->poses.clear();
+  data->type = "pose";
+}
+
+bool RobotPoseHandler::GetData(RobotPoseData* data) {
+  ResetPoseData(data);
+  std::pair<std::string, PoseData> robot_pose;
+  while (poses_.Pop(robot_pose)) {
+    // Overwrite previous data from this robot with the newest entry
+    data->poses[robot_pose.first] = robot_pose.second;
+
+    auto it = extrapolators_.find(robot_pose.first);
+    if (it == extrapolators_.end()) {
+      it = extrapolators_
+               .emplace(robot_pose.first,
+                        lamp_utils::PoseExtrapolator(extrapolator_params_))
+               .first;
+    }
+    it->second.AddSample(robot_pose.second.stamp, robot_pose.second.pose);
+  }
+  data->b_has_data = !data->poses.empty();
+  return data->b_has_data;
+}
+
+bool RobotPoseHandler::PredictPose(
+    const std::string& robot,
+    const ros::Time& stamp,
+    lamp_utils::PosePrediction* prediction) const {
+  auto it = extrapolators_.find(robot);
+  return it != extrapolators_.end() && it->second.Predict(stamp, prediction);
 }
 
 std::shared_ptr<FactorData> RobotPoseHandler::GetData() {
 
   // Main interface with lamp for getting new pose graphs
-  std::shared_ptr<RobotPoseData> output_data = std::make_shared<RobotPoseData>(data_);
-  ResetPoseData();
+  std::shared_ptr<RobotPoseData> output_data = std::make_shared<RobotPoseData>();
+  GetData(output_data.get());
 
   return output_data;
 }
@@ -107,7 +146,6 @@ void RobotPoseHandler::PoseCallback(const geometry_msgs::PoseStamped::ConstPtr&
   new_data.stamp = msg->header.stamp;
   new_data.pose = lamp_utils::ToGtsam(msg->pose);
 
-  // Overwrite previous data from this robot with the newest entry
-  data_.poses[robot] = new_data;
-  data_.b_has_data = true;
-}
\ No newline at end of file
+  poses_.Push(std::make_pair(robot, new_data));
+  Wake();
+}
@@ -5,13 +5,21 @@
 
 #include <factor_handlers/StationaryHandler.h>
 
+#include <algorithm>
+#include <cmath>
+
 namespace pu = parameter_utils;
 
 // Constructor and Destructor
 // -------------------------------------------------------------
 
 StationaryHandler::StationaryHandler()
-    : currently_stationary_(true), has_data_(false) {
+    : currently_stationary_(true),
+      max_duration_(30.0),
+      decorrelation_time_(3.0),
+      b_interval_open_(false),
+      direction_sum_(gtsam::Vector3::Zero()),
+      interval_count_(0) {
   ROS_INFO("StationaryHandler Class Constructor");
 }
 
@@ -41,6 +49,9 @@ bool StationaryHandler::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get("stationary_noise_sigma", noise_sigma_)) return false;
   if (!pu::Get("stationary_key_step_threshold", key_step_threshold_))
     return false;
+  if (!pu::Get("stationary_max_duration", max_duration_)) return false;
+  if (!pu::Get("stationary_decorrelation_time", decorrelation_time_))
+    return false;
   return true;
 }
 
@@ -60,44 +71,137 @@ void StationaryHandler::StationaryCallback(
     const StationaryMessage::ConstPtr& msg) {
   if (msg->status == 0) {
     if (!currently_stationary_) {
-      ROS_INFO("Robot stopped. Preparing attitude factor...");
+      ROS_INFO("Robot stopped. Averaging attitude measurements...");
       // We want to place the stationary factors when the robot stops
-      last_detection_ =
-          StationaryData(msg->header.stamp, msg->average_acceleration);
-      has_data_ = true;
+      b_interval_open_ = true;
     }
     currently_stationary_ = true;
+    if (b_interval_open_) {
+      AddStationaryMeasurement(msg->header.stamp, msg->average_acceleration);
+      if (interval_count_ > 0 &&
+          (interval_end_ - interval_start_).toSec() >= max_duration_) {
+        // Long stop, keep averaging into a new factor
+        CloseStationaryInterval();
+      }
+    }
   } else {
+    if (b_interval_open_) {
+      ROS_INFO("Robot moving. Preparing attitude factor...");
+      CloseStationaryInterval();
+      b_interval_open_ = false;
+    }
     currently_stationary_ = false;
   }
+  b_reported_stationary_ = currently_stationary_;
+  last_status_time_ = msg->header.stamp.toSec();
+}
+
+void StationaryHandler::AddStationaryMeasurement(
+    const ros::Time& stamp, const geometry_msgs::Vector3& accel) {
+  const gtsam::Vector3 gravity(accel.x, accel.y, accel.z);
+  const double norm = gravity.norm();
+  if (!std::isfinite(norm) || norm < 1e-6) {
+    return;
+  }
+  if (interval_count_ == 0) {
+    interval_start_ = stamp;
+  }
+  interval_end_ = stamp;
+  direction_sum_ += gravity / norm;
+  interval_count_++;
+}
+
+void StationaryHandler::CloseStationaryInterval() {
+  if (interval_count_ == 0) {
+    return;
+  }
+  // The direction sigma shrinks with the independent measurements averaged,
+  // the spread of the directions (1 - mean resultant length, the per axis
+  // variance for small angles) is added so a shaky stop is not
+  // overconfident
+  const double duration = (interval_end_ - interval_start_).toSec();
+  int n_independent = interval_count_;
+  if (decorrelation_time_ > 0) {
+    n_independent = std::min(
+        interval_count_,
+        1 + static_cast<int>(std::max(0.0, duration) / decorrelation_time_));
+  }
+  const gtsam::Vector3 mean = direction_sum_ / interval_count_;
+  const double spread = std::max(0.0, 1.0 - mean.norm());
+
+  StationaryData detection;
+  detection.stamp = interval_start_;
+  detection.gravity.x = mean.x();
+  detection.gravity.y = mean.y();
+  detection.gravity.z = mean.z();
+  detection.sigma = std::sqrt(noise_sigma_ * noise_sigma_ / n_independent +
+                              spread);
+  ROS_INFO_STREAM("Attitude factor from " << interval_count_
+                                          << " measurements over " << duration
+                                          << " s, sigma " << detection.sigma);
+  detections_.Push(detection);
+  Wake();
+
+  direction_sum_.setZero();
+  interval_count_ = 0;
 }
 
 // LAMP Interface
 // -------------------------------------------------------------------------
 std::shared_ptr<FactorData> StationaryHandler::GetData() {
   std::shared_ptr<ImuData> factors_output = std::make_shared<ImuData>();
-  factors_output->b_has_data = false;
+  GetData(factors_output.get());
+  return factors_output;
+}
+
+bool StationaryHandler::GetData(ImuData* data) {
+  ResetFactorData(data);
 
-  if (has_data_) {
+  // Only the latest stop gets a factor
+  StationaryData detection;
+  bool b_detected = false;
+  while (detections_.Pop(detection)) {
+    b_detected = true;
+  }
+  if (b_detected) {
     ROS_DEBUG("New attitude factor in StationaryHandler.");
-    ImuFactor new_factor(CreateAttitudeFactor(last_detection_.second));
-    factors_output->b_has_data = true;
-    factors_output->type = "imu";
-    factors_output->factors.push_back(new_factor);
-  } else {
-    factors_output->b_has_data = false;
+    ImuFactor new_factor(
+        CreateAttitudeFactor(detection.gravity, detection.sigma));
+    data->b_has_data = true;
+    data->factors.push_back(new_factor);
   }
-  has_data_ = false;
-  return factors_output;
+  return data->b_has_data;
+}
+
+bool StationaryHandler::HasData() const {
+  return !detections_.Empty();
+}
+
+bool StationaryHandler::IsStationary(const ros::Time& now,
+                                     double max_age) const {
+  return b_reported_stationary_ &&
+      now.toSec() - last_status_time_ <= max_age;
+}
+
+void StationaryHandler::ResetFactorData(ImuData* data) const {
+  data->b_has_data = false;
+  data->type = "imu";
+  data->factors.clear();
 }
 
 gtsam::Pose3AttitudeFactor StationaryHandler::CreateAttitudeFactor(
     const geometry_msgs::Vector3& gravity_vec) const {
+  return CreateAttitudeFactor(gravity_vec, noise_sigma_);
+}
+
+gtsam::Pose3AttitudeFactor
+StationaryHandler::CreateAttitudeFactor(const geometry_msgs::Vector3& gravity_vec,
+                                        double sigma) const {
   gtsam::Point3 gravity(gravity_vec.x, gravity_vec.y, gravity_vec.z);
   gtsam::Unit3 gravity_dir(gravity.normalized());
   gtsam::Unit3 ref(0, 0, 1);
   gtsam::SharedNoiseModel model =
-      gtsam::noiseModel::Isotropic::Sigma(2, noise_sigma_);
+      gtsam::noiseModel::Isotropic::Sigma(2, sigma);
   gtsam::Pose3AttitudeFactor factor(query_key_, ref, model, gravity_dir);
   return factor;
 }
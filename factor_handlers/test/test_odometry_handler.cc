@@ -14,6 +14,8 @@ public:
     system("rosparam load $(rospack find "
            "factor_handlers)/config/odom_parameters.yaml");
     system("rosparam set translation_threshold 1.0");
+    // Most tests check the closest message lookups
+    system("rosparam set b_interpolate_poses false");
 
     tolerance_ = 1e-5;
 
@@ -149,8 +151,8 @@ protected:
   bool GetKeyedScanAtTime(const ros::Time& stamp, PointCloud::Ptr& msg) {
     return oh.GetKeyedScanAtTime(stamp, msg);
   }
-  void ClearPreviousPointCloudScans(const PointCloudBuffer::iterator& itrTime) {
-    return oh.ClearPreviousPointCloudScans(itrTime);
+  void ClearPreviousPointCloudScans(size_t index) {
+    return oh.ClearPreviousPointCloudScans(index);
   }
 
   PointCloudBuffer *GetPointCloudBuffer() {
@@ -288,9 +290,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseAtTime) {
   PoseCovStamped myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   bool result = GetPoseAtTime(t3_ros, myBuffer, myOutput);
   EXPECT_NEAR(
       msg_third.pose.pose.position.x, myOutput.pose.pose.position.x, 1e-5);
@@ -305,9 +307,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseAtTimeFuture) {
   PoseCovStamped myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   ros::Time query;
   query.fromSec(1.5);
   bool result = GetPoseAtTime(query, myBuffer, myOutput);
@@ -324,9 +326,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseAtTimePast) {
   PoseCovStamped myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   ros::Time query;
   query.fromSec(0.6);
   bool result = GetPoseAtTime(query, myBuffer, myOutput);
@@ -344,9 +346,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseAtTimeOutOfRange) {
   // Create a buffer
   OdomPoseBuffer myBuffer;
 
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   ros::Time query;
   query.fromSec(5000);
   bool result = GetPoseAtTime(query, myBuffer, myOutput);
@@ -355,6 +357,45 @@ TEST_F(OdometryHandlerTest, TestGetPoseAtTimeOutOfRange) {
   EXPECT_FALSE(result);
 }
 
+TEST_F(OdometryHandlerTest, TestGetPoseAtTimeInterpolated) {
+  ros::NodeHandle nh("~");
+  system("rosparam set ts_threshold 0.01");
+  system("rosparam set b_interpolate_poses true");
+  oh.Initialize(nh);
+  PoseCovStamped myOutput;
+  OdomPoseBuffer myBuffer;
+  for (size_t i = 0; i < 36; i++) {
+    msg_third.pose.covariance[i] = 1;
+    msg_fourth.pose.covariance[i] = 3;
+  }
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
+  myBuffer.Insert(t4_ros.toSec(), msg_fourth);
+
+  // Position only, further than ts_threshold from either message
+  ros::Time query;
+  query.fromSec(1.02);
+  ASSERT_TRUE(GetPoseAtTime(query, myBuffer, myOutput));
+  EXPECT_NEAR(1.4, myOutput.pose.pose.position.x, tolerance_);
+  EXPECT_NEAR(query.toSec(), myOutput.header.stamp.toSec(), tolerance_);
+
+  // Half way through a 90 degree turn
+  query.fromSec(1.125);
+  ASSERT_TRUE(GetPoseAtTime(query, myBuffer, myOutput));
+  EXPECT_NEAR(3.0, myOutput.pose.pose.position.x, tolerance_);
+  EXPECT_NEAR(0.5, myOutput.pose.pose.position.y, tolerance_);
+  EXPECT_NEAR(M_PI / 4.0,
+              gr::FromROS(myOutput.pose.pose).rotation.Yaw(),
+              tolerance_);
+  EXPECT_NEAR(2.0, myOutput.pose.covariance[0], tolerance_);
+
+  // Outside the buffer still falls back to the closest message
+  query.fromSec(5000);
+  EXPECT_FALSE(GetPoseAtTime(query, myBuffer, myOutput));
+  system("rosparam set b_interpolate_poses false");
+}
+
 TEST_F(OdometryHandlerTest, TestGetPoseBetweenTimesExact) {
   ros::NodeHandle nh("~");
   system("rosparam set ts_threshold 0.6");
@@ -363,9 +404,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseBetweenTimesExact) {
   GtsamPosCov myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   FillGtsamPosCovOdom(myBuffer, myOutput, t1_ros, t2_ros, LIDAR_ODOM_BUFFER_ID);
   EXPECT_NEAR(1, myOutput.pose.x(), 1e-5);
   EXPECT_TRUE(myOutput.b_has_value);
@@ -385,9 +426,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseBetweenTimesOff) {
   GtsamPosCov myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   ros::Time query1, query2, query3;
   query1.fromSec(1.01);
   query2.fromSec(1.04);
@@ -411,9 +452,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseBetweenTimesOutOfRange) {
   GtsamPosCov myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   ros::Time query1, query2, query3;
   query1.fromSec(0.7);
   query2.fromSec(1.3);
@@ -430,9 +471,9 @@ TEST_F(OdometryHandlerTest, TestGetPoseBetweenOutsideThreshold) {
   GtsamPosCov myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
   ros::Time query1, query2, query3;
   query1.fromSec(0.0);
   query2.fromSec(10.3);
@@ -450,11 +491,11 @@ TEST_F(OdometryHandlerTest, TestGetPoseBetweenTimesRotationOneStep90) {
   GtsamPosCov myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
-  myBuffer[t4_ros.toSec()] = msg_fourth;
-  myBuffer[t5_ros.toSec()] = msg_fifth;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
+  myBuffer.Insert(t4_ros.toSec(), msg_fourth);
+  myBuffer.Insert(t5_ros.toSec(), msg_fifth);
   FillGtsamPosCovOdom(myBuffer, myOutput, t3_ros, t4_ros, LIDAR_ODOM_BUFFER_ID);
   EXPECT_NEAR(1, myOutput.pose.y(), 1e-5);
   EXPECT_NEAR(M_PI / 2.0f, myOutput.pose.rotation().yaw(), 1e-5);
@@ -470,11 +511,11 @@ TEST_F(OdometryHandlerTest, TestGetPoseBetweenTimesRotationCheckLocal) {
   GtsamPosCov myOutput;
   // Create a buffer
   OdomPoseBuffer myBuffer;
-  myBuffer[t1_ros.toSec()] = msg_first;
-  myBuffer[t2_ros.toSec()] = msg_second;
-  myBuffer[t3_ros.toSec()] = msg_third;
-  myBuffer[t4_ros.toSec()] = msg_fourth;
-  myBuffer[t5_ros.toSec()] = msg_fifth;
+  myBuffer.Insert(t1_ros.toSec(), msg_first);
+  myBuffer.Insert(t2_ros.toSec(), msg_second);
+  myBuffer.Insert(t3_ros.toSec(), msg_third);
+  myBuffer.Insert(t4_ros.toSec(), msg_fourth);
+  myBuffer.Insert(t5_ros.toSec(), msg_fifth);
   FillGtsamPosCovOdom(myBuffer, myOutput, t4_ros, t5_ros, LIDAR_ODOM_BUFFER_ID);
   EXPECT_NEAR(1, myOutput.pose.y(), 1e-5);
   EXPECT_NEAR(M_PI / 2.0f, myOutput.pose.rotation().yaw(), 1e-5);
@@ -929,6 +970,42 @@ TEST_F(OdometryHandlerTest, TestGetRelativeData) {
   EXPECT_NEAR(0.0, myOutput.pose.rotation().yaw(), 1e-5);
 }
 
+TEST_F(OdometryHandlerTest, TestFusedOdomSourceFallback) {
+  ros::NodeHandle nh("~");
+  system("rosparam set ts_threshold 0.6");
+  system("rosparam set subscriptions/b_register_visual_sub true");
+  // Lidar at 2 Hz is degraded, visual at 20 Hz is not
+  system("rosparam set fusion/min_source_rate 5.0");
+  oh.Initialize(nh);
+
+  for (int i = 0; i <= 20; i++) {
+    nav_msgs::Odometry::Ptr msg(new nav_msgs::Odometry);
+    msg->header.stamp.fromSec(1.0 + 0.05 * i);
+    msg->pose.pose.orientation.w = 1;
+    msg->pose.pose.position.x = 0.5 * i;
+    VisualOdometryCallback(msg);
+    if (i % 10 == 0) {
+      nav_msgs::Odometry::Ptr lidar_msg(new nav_msgs::Odometry(*msg));
+      lidar_msg->pose.pose.position.x = 0.1 * i;
+      LidarOdometryCallback(lidar_msg);
+    }
+  }
+
+  GtsamPosCov myOutput =
+      GetFusedOdomDeltaBetweenTimes(ros::Time(1.0), ros::Time(2.0));
+  EXPECT_TRUE(myOutput.b_has_value);
+  EXPECT_NEAR(10, myOutput.pose.x(), 1e-5);
+  EXPECT_EQ(VISUAL_ODOM_BUFFER_ID, oh.GetLastFusedSource());
+
+  // Without the rate requirement the lidar has priority again
+  system("rosparam set fusion/min_source_rate 0.0");
+  oh.LoadParameters(nh);
+  myOutput = GetFusedOdomDeltaBetweenTimes(ros::Time(1.0), ros::Time(2.0));
+  EXPECT_TRUE(myOutput.b_has_value);
+  EXPECT_NEAR(2, myOutput.pose.x(), 1e-5);
+  EXPECT_EQ(LIDAR_ODOM_BUFFER_ID, oh.GetLastFusedSource());
+}
+
 // TODO: Fix this test as GetPosesAtTimes logic has been changed to handle corner cases
 TEST_F(OdometryHandlerTest, TestGetRelativeDataOutOfRange) {
   ros::NodeHandle nh("~");
@@ -1103,6 +1180,45 @@ TEST_F(OdometryHandlerTest, TestGetKeyedScanAtTimeError) {
   EXPECT_FALSE(result);
 }
 
+TEST_F(OdometryHandlerTest, TestPointCloudBufferPruning) {
+  ros::NodeHandle nh("~");
+  system("rosparam set ts_threshold 0.6");
+  system("rosparam set b_prune_point_cloud_buffer true");
+  system("rosparam set keyed_scan_candidate_window 0.5");
+  oh.Initialize(nh);
+
+  auto odom = [](double t, double x) {
+    nav_msgs::Odometry::Ptr msg(new nav_msgs::Odometry);
+    msg->header.stamp.fromSec(t);
+    msg->pose.pose.orientation.w = 1;
+    msg->pose.pose.position.x = x;
+    return msg;
+  };
+  auto cloud = [](double t) {
+    PointCloud::Ptr msg(new PointCloud);
+    pcl_conversions::toPCL(ros::Time(t), msg->header.stamp);
+    return PointCloudConstPtr(msg);
+  };
+
+  // Standing still at the key, the next keyframe is not in sight
+  LidarOdometryCallback(odom(1.0, 0.0));
+  LidarOdometryCallback(odom(1.1, 0.0));
+  GtsamPosCov delta;
+  GetOdomDelta(ros::Time(1.1), delta);
+  for (int i = 0; i < 6; i++) {
+    PointCloudCallback(cloud(1.0 + 0.1 * i));
+  }
+  EXPECT_EQ(3, GetPointCloudBuffer()->size());
+  EXPECT_NEAR(1.5, GetPointCloudBuffer()->BackTime(), 1e-6);
+
+  // Close to the translation threshold, every cloud is kept
+  LidarOdometryCallback(odom(1.6, 0.9));
+  for (int i = 6; i < 9; i++) {
+    PointCloudCallback(cloud(1.0 + 0.1 * i));
+  }
+  EXPECT_EQ(6, GetPointCloudBuffer()->size());
+}
+
 TEST_F(OdometryHandlerTest, TestClearPreviousPointCloudScans) {
   ros::NodeHandle nh("~");
   oh.Initialize(nh);
@@ -1124,10 +1240,10 @@ TEST_F(OdometryHandlerTest, TestClearPreviousPointCloudScans) {
   PointCloudCallback(pc_ptr3);
   auto ptr_buffer_2 = GetPointCloudBuffer();
   ASSERT_EQ(ptr_buffer_2->size(), 3);
-  auto itrTime_2 = ptr_buffer_2->lower_bound(t2);
-  ClearPreviousPointCloudScans(itrTime_2);
+  auto index_2 = ptr_buffer_2->LowerBound(t2);
+  ClearPreviousPointCloudScans(index_2);
   ASSERT_EQ(ptr_buffer_2->size(), 2);
-  ASSERT_EQ((ptr_buffer_2->rbegin())->first, t3);
+  ASSERT_EQ(ptr_buffer_2->BackTime(), t3);
 }
 
 /* TEST Utilities */
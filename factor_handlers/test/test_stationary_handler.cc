@@ -41,7 +41,7 @@ class StationaryHandlerTest : public ::testing::Test {
     return sh_.CreateAttitudeFactor(gravity_vec);
   }
 
-  void resetFactorData() { sh_.ResetFactorData(); }
+  void resetFactorData(ImuData* data) { sh_.ResetFactorData(data); }
 
   bool isCurrentlyStationary() { return sh_.currently_stationary_; }
 };
@@ -122,6 +122,13 @@ TEST_F(StationaryHandlerTest, StationaryCallback) {
   stationaryCallback(msg2);
   EXPECT_TRUE(isCurrentlyStationary());
 
+  // The factor comes once the robot moves again
+  factor_data = getData();
+  EXPECT_FALSE(factor_data->b_has_data);
+
+  stationaryCallback(msg1);
+  EXPECT_FALSE(isCurrentlyStationary());
+
   SetKeyForImuAttitude(gtsam::Symbol('a', 1));
   factor_data = getData();
 
@@ -140,6 +147,76 @@ TEST_F(StationaryHandlerTest, StationaryCallback) {
   EXPECT_NEAR(0, factor.bRef().unitVector()[2], tolerance_);
 }
 
+TEST_F(StationaryHandlerTest, AveragesStationaryInterval) {
+  ros::NodeHandle nh;
+  sh_.Initialize(nh);
+
+  StationaryMessage::Ptr moving(new StationaryMessage);
+  moving->status = 1;
+  stationaryCallback(moving);
+
+  // Two measurements tilted either way of z, further apart than the
+  // decorrelation time
+  const double tilt = 0.02;
+  for (int i = 0; i < 2; i++) {
+    StationaryMessage::Ptr msg(new StationaryMessage);
+    msg->header.stamp = ros::Time(100.0 + 10.0 * i);
+    msg->status = 0;
+    msg->average_acceleration.x = i == 0 ? -tilt : tilt;
+    msg->average_acceleration.z = 1;
+    stationaryCallback(msg);
+  }
+  EXPECT_FALSE(getData()->b_has_data);
+
+  moving->header.stamp = ros::Time(115.0);
+  stationaryCallback(moving);
+
+  SetKeyForImuAttitude(gtsam::Symbol('a', 5));
+  std::shared_ptr<ImuData> factor_data = getData();
+  ASSERT_TRUE(factor_data->b_has_data);
+  ASSERT_EQ(1, factor_data->factors.size());
+
+  gtsam::Pose3AttitudeFactor factor = factor_data->factors[0].attitude;
+  EXPECT_EQ(gtsam::Symbol('a', 5), factor.key());
+  EXPECT_NEAR(0, factor.bRef().unitVector()[0], tolerance_);
+  EXPECT_NEAR(1, factor.bRef().unitVector()[2], tolerance_);
+
+  double noise_sigma;
+  ASSERT_TRUE(ros::param::get("stationary_noise_sigma", noise_sigma));
+  const double spread = 1 - 1 / std::sqrt(1 + tilt * tilt);
+  const double sigma =
+      boost::dynamic_pointer_cast<gtsam::noiseModel::Isotropic>(
+          factor.noiseModel())
+          ->sigma();
+  EXPECT_NEAR(std::sqrt(noise_sigma * noise_sigma / 2 + spread), sigma,
+              tolerance_);
+}
+
+TEST_F(StationaryHandlerTest, ReportsStationaryStatus) {
+  ros::NodeHandle nh;
+  sh_.Initialize(nh);
+
+  // Nothing reported yet
+  EXPECT_FALSE(sh_.IsStationary(ros::Time(100.0), 1.0));
+
+  StationaryMessage::Ptr stopped(new StationaryMessage);
+  stopped->status = 0;
+  stopped->header.stamp = ros::Time(100.0);
+  stopped->average_acceleration.z = 1;
+  stationaryCallback(stopped);
+  EXPECT_TRUE(sh_.IsStationary(ros::Time(100.5), 1.0));
+  // The detector went silent
+  EXPECT_FALSE(sh_.IsStationary(ros::Time(102.0), 1.0));
+
+  StationaryMessage::Ptr moving(new StationaryMessage);
+  moving->status = 1;
+  moving->header.stamp = ros::Time(101.0);
+  stationaryCallback(moving);
+  EXPECT_FALSE(sh_.IsStationary(ros::Time(101.0), 1.0));
+  // The stop was queued before the status changed
+  EXPECT_TRUE(sh_.HasData());
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_stationary_handler");
@@ -24,6 +24,8 @@
 #include <gtsam/slam/PriorFactor.h>
 
 #include <pose_graph_msgs/KeyedScan.h>
+#include <pose_graph_msgs/KeyedScanRequest.h>
+#include <pose_graph_msgs/KeyedScans.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <pose_graph_msgs/PoseGraphEdge.h>
 #include <pose_graph_msgs/PoseGraphNode.h>
@@ -42,10 +44,22 @@
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/DoubleBuffer.h>
+#include <lamp_utils/Metrics.h>
+#include <lamp_utils/PipelineStage.h>
 #include <lamp_utils/PoseGraph.h>
+#include <lamp_utils/PoseGraphDelta.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/PriorMap.h>
+#include <lamp_utils/SendScheduler.h>
+#include <lamp_utils/VoxelMap.h>
 
+#include <std_msgs/Empty.h>
+
+#include <atomic>
+#include <deque>
 #include <math.h>
+#include <unordered_set>
 
 // Services
 
@@ -78,6 +92,21 @@ protected:
   // Set precisions for fixed covariance settings
   bool SetFactorPrecisions();
 
+  // Load settings for updating the map after optimization
+  bool SetMapUpdateParameters();
+
+  // Load settings for delta encoding the incremental pose graph
+  bool SetDeltaPublicationParameters();
+
+  // Load settings for checkpointing the session
+  bool SetCheckpointParameters();
+
+  // Load settings for replaying the keyed scans to downstream nodes
+  bool SetKeyedScanReplayParameters();
+
+  // Load settings for relocalizing against the map of a former session
+  bool SetPriorMapParameters();
+
   // Use this for any "private" things to be used in the derived class
   // Node initialization.
   // Set precisions for fixed covariance settings
@@ -88,26 +117,76 @@ protected:
   double update_rate_;
   ros::Timer update_timer_;
 
+  // Handlers call WakeProcessing when new data arrived, with
+  // rate/b_wake_on_data the processing step then runs from the callback queue
+  // right away instead of on the next tick. Wakes coalesce, only one waits in
+  // the queue at a time
+  void WakeProcessing();
+  virtual void ProcessOnWake();
+  bool b_wake_on_data_{false};
+  std::atomic<bool> b_wake_pending_{false};
+
+  // Memory accounts of the pose graph, refreshed by the processing step at
+  // most once a second
+  void UpdateMemoryAccounts();
+  ros::WallTime last_memory_update_;
+
   // retrieve data from all handlers
   virtual bool CheckHandlers() = 0;
 
   // Callback for loop closures
   void LaserLoopClosureCallback(const pose_graph_msgs::PoseGraphConstPtr msg);
   void AddLoopClosureToGraph(const pose_graph_msgs::PoseGraphConstPtr msg);
-  pose_graph_msgs::PoseGraph
-  ChangeCovarianceInMessage(pose_graph_msgs::PoseGraph msg,
-                            gtsam::SharedNoiseModel noise);
+  // Adds the prior map nodes the loop closures of msg reach that the graph
+  // does not have, each anchored by a prior at its pose of the former session
+  void ImportPriorMapNodes(const pose_graph_msgs::PoseGraph& msg);
+  // Sets the covariance of every edge of msg to the one of noise
+  void ChangeCovarianceInMessage(pose_graph_msgs::PoseGraph* msg,
+                                 const gtsam::SharedNoiseModel& noise);
 
   // Functions to publish
   bool PublishPoseGraph(bool b_publish_incremental = true);
+  // A receiver of the incremental graph lost messages, send a keyframe next
+  void PoseGraphResyncCallback(const std_msgs::Empty::ConstPtr& msg);
   bool PublishPoseGraphForOptimizer();
 
   // Generate map from keyed scans
   bool ReGenerateMapPointCloud();
+  // Update the map after optimization, only re-transforming the keyed scans
+  // whose node has moved (falls back to full regeneration when disabled)
+  bool UpdateMapPointCloud();
+  // Part of the update on the map stage
+  void UpdateMapScans(const PoseGraph& graph);
+  bool HasNodeMoved(const gtsam::Pose3& old_pose,
+                    const gtsam::Pose3& new_pose) const;
+  // Readers of pose_graph_, or of the given graph (e.g. a snapshot on a stage)
   bool CombineKeyedScansWorld(PointCloud* points);
+  bool CombineKeyedScansWorld(const PoseGraph& graph, PointCloud* points);
   bool GetTransformedPointCloudWorld(const gtsam::Symbol key,
                                      PointCloud* points);
+  bool GetTransformedPointCloudWorld(const PoseGraph& graph,
+                                     const gtsam::Symbol key,
+                                     PointCloud* points);
+  // Body to world transform of the node, false if key or scan is missing
+  bool GetScanToWorld(const gtsam::Symbol key, Eigen::Matrix4d* b2w);
+  bool GetScanToWorld(const PoseGraph& graph,
+                      const gtsam::Symbol key,
+                      Eigen::Matrix4d* b2w);
   bool AddTransformedPointCloudToMap(const gtsam::Symbol key);
+  // Publish the map once the queued map work is done (coalesced, at most one
+  // publish waits on the map stage)
+  void QueueMapPublish();
+  // On the map stage: every change to the map goes through these, so the
+  // map products follow the mapper
+  void InsertIntoMap(const PointCloud::Ptr& points);
+  void ResetMap();
+  // Publishes map product i from the map stage, at its own rate
+  void MapProductTimerCallback(const ros::TimerEvent& ev, size_t i);
+  // Publishes the points added to the map since the last call on
+  // map_incremental_pub_ (coalesced like QueueMapPublish). Subscribers get
+  // the full map again after remaps or on map_resync.
+  void QueueMapIncrementPublish();
+  void MapResyncCallback(const std_msgs::Empty::ConstPtr& msg);
 
   // Placeholder for setting fixed noise
   gtsam::SharedNoiseModel SetFixedNoiseModels(std::string type);
@@ -121,13 +200,48 @@ protected:
   void OptimizerUpdateCallback(const pose_graph_msgs::PoseGraphConstPtr& msg);
   void MergeOptimizedGraph(const pose_graph_msgs::PoseGraphConstPtr& msg);
 
+  // Queues every keyed scan for the replay and returns right away
   void PublishAllKeyedScans();
+  // Bytes is set to the serialized size of the message if given
+  bool PublishKeyedScan(const gtsam::Symbol& key, size_t* bytes = nullptr);
+
+  // Keyed scan replay: queued scans are published on keyed_scans in the
+  // background within a byte budget, highest priority first (see
+  // keyed_scan_replay/order). Downstream nodes that restart or miss scans
+  // send the keys they lack on keyed_scan_replay_request (none for all), and
+  // those go ahead of a bulk replay.
+  void StartKeyedScanReplay(const ros::NodeHandle& n);
+  void QueueKeyedScanReplay(std::vector<gtsam::Symbol> keys, bool b_front);
+  void KeyedScanReplayRequestCallback(
+      const pose_graph_msgs::KeyedScanRequest::ConstPtr& msg);
+  void KeyedScanReplayTimerCallback(const ros::TimerEvent& ev);
+
+  // Scans of the requested keys from the scan store, so viewers fetch the
+  // few they show instead of keeping a copy of every keyed scan
+  bool KeyedScansService(pose_graph_msgs::KeyedScans::Request& request,
+                         pose_graph_msgs::KeyedScans::Response& response);
+
+  // Session checkpoints: the pose graph and keyed scans are saved
+  // periodically to an archive (appending since the last checkpoint). On
+  // startup the archive is loaded and its scans are added to the map and
+  // published in the background. Returns true if a session was restored.
+  bool StartCheckpointing(const ros::NodeHandle& n);
+  void CheckpointTimerCallback(const ros::TimerEvent& ev);
+
+  // Saves the session to filename from a snapshot on the save stage, so the
+  // update loop does not wait on the disk. Saves to the checkpoint file
+  // flush the checkpoint: only the tail since the last one is written.
+  void QueueSave(const std::string& filename);
+  lamp_utils::PipelineStage::Task
+  SaveTask(const std::shared_ptr<const PoseGraph>& graph,
+           const std::string& filename) const;
+  void RestoreScansTimerCallback(const ros::TimerEvent& ev);
 
   // Pose graph structure storing values, factors and meta data.
   PoseGraph pose_graph_;
 
   // Function used for retrieving internal identifier given gtsam::Symbol.
-  std::string MapSymbolToId(gtsam::Symbol key) const;
+  const std::string& MapSymbolToId(gtsam::Symbol key) const;
 
   // Publishers
   ros::Publisher pose_graph_pub_;
@@ -138,6 +252,7 @@ protected:
   // Subscribers
   ros::Subscriber back_end_pose_graph_sub_;
   ros::Subscriber laser_loop_closure_sub_;
+  ros::Subscriber pose_graph_resync_sub_;
 
   // Services
 
@@ -153,15 +268,113 @@ protected:
   bool b_repub_values_after_optimization_;
   bool b_have_received_first_pg_{false};
 
+  // Generation (header.seq) of the last optimizer result that was merged
+  uint32_t last_optimizer_generation_{0};
+
   // Frames.
   std::string base_frame_id_;
 
   // Pose graph merger
   Merger merger_;
 
+  // Delta encoding of the incremental pose graph
+  lamp_utils::PoseGraphDeltaEncoder delta_encoder_;
+
+  // Serialized bytes of the incremental graphs published so far
+  size_t incremental_graph_bytes_{0};
+
   // Mapper
   IPointCloudMapper::Ptr mapper_;
 
+  // World frame keyed scans (and the pose used to transform them) that make
+  // up the current map, used for incremental map updates
+  struct MapScan {
+    gtsam::Pose3 pose;
+    PointCloud::ConstPtr points;
+  };
+  std::map<gtsam::Symbol, MapScan> map_scans_world_;
+
+  // Incremental map update settings
+  bool b_incremental_map_update_{false};
+  double map_update_trans_threshold_{0.05};
+  double map_update_rot_threshold_{0.01};
+  int full_map_regeneration_interval_{0};
+  int map_update_count_{0};
+  // Threads transforming keyed scans when the map is regenerated
+  int map_update_threads_{1};
+
+  // Voxel downsampled copies of the map, updated as scans are inserted and
+  // published on their own topic and rate, so consumers of a coarse map do
+  // not need the full map serialized
+  struct MapProduct {
+    lamp_utils::VoxelMap map;
+    double rate{1.0};
+    std::string topic;
+    ros::Publisher pub;
+    ros::Timer timer;
+    // A publish is waiting on the map stage
+    std::shared_ptr<std::atomic<bool>> b_queued;
+  };
+  std::vector<MapProduct> map_products_;
+
+  // Publish only the points new to the map after scans are added, the full
+  // map after remaps and on request
+  bool b_incremental_map_publish_{true};
+  ros::Publisher map_incremental_pub_;
+  ros::Subscriber map_resync_sub_;
+  // Points added since the last incremental publish, owned by the map stage
+  PointCloud::Ptr map_increment_{new PointCloud};
+  std::atomic<bool> b_map_increment_queued_{false};
+
+  // Checkpoint settings
+  bool b_checkpoint_{false};
+  bool b_restore_checkpoint_{false};
+  std::string checkpoint_file_;
+  double checkpoint_period_{30.0};
+  int restore_scans_per_tick_{20};
+  ros::Timer checkpoint_timer_;
+  ros::Timer restore_scans_timer_;
+  // Restored keyed scans still to add to the map and publish
+  std::vector<gtsam::Symbol> restore_scan_keys_;
+  size_t restore_scan_index_{0};
+
+  // Prior map, of which only the nodes closing loops join the graph
+  lamp_utils::PriorMap prior_map_;
+  gtsam::SharedNoiseModel prior_map_noise_;
+
+  // Keyed scan replay settings
+  enum class ReplayOrder { KEY = 0, RECENT = 1, NEAR_ROBOTS = 2 };
+  ReplayOrder replay_order_{ReplayOrder::RECENT};
+  double replay_rate_{20.0e6};
+  double replay_period_{0.1};
+  ros::Timer replay_timer_;
+  ros::Subscriber replay_request_sub_;
+  ros::ServiceServer keyed_scans_srv_;
+  // Only the budget is used, the order is kept in replay_keys_
+  lamp_utils::SendScheduler replay_budget_;
+  // Keys still to publish. A key requested again moves to the front, its
+  // older entry is skipped since it has left replay_queued_ by then
+  std::deque<gtsam::Symbol> replay_keys_;
+  std::unordered_set<gtsam::Key> replay_queued_;
+
+  // Stages off the update loop, started by the derived class: every mapper_
+  // call (and map_scans_world_) runs on the map stage, graph and keyed scan
+  // publishing on the output stage, checkpoints on the save stage. They read
+  // the graph from snapshots (PoseGraph::Snapshot). Their tasks run inline
+  // until started.
+  lamp_utils::PipelineStage map_stage_{"lamp.map_stage", 64};
+  lamp_utils::PipelineStage output_stage_{"lamp.output_stage", 64};
+  lamp_utils::PipelineStage save_stage_{"lamp.save_stage", 1};
+  std::atomic<bool> b_map_publish_queued_{false};
+  // With the stages running the map is published from a copy taken on the
+  // map stage, so publishing does not hold up the insertions
+  bool b_publish_map_snapshot_{false};
+  lamp_utils::DoubleBuffer<PointCloud> map_snapshot_;
+  ros::Publisher map_snapshot_pub_;
+
+  // Snapshots of the metrics registry on /lamp/metrics
+  lamp_utils::MetricsPublisher metrics_publisher_;
+
   // Precisions
   double attitude_sigma_;
   double position_sigma_;
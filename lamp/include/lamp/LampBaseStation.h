@@ -14,6 +14,7 @@
 #include <factor_handlers/RobotPoseHandler.h>
 
 #include <point_cloud_mapper/SimplePointCloudMapper.h>
+#include <pose_graph_msgs/KeyedScanRequest.h>
 #include <std_msgs/Bool.h>
 #include <std_msgs/String.h>
 
@@ -59,17 +60,32 @@ protected:
   // Process keyed scan candidates to add to the map
   void AddKeyedScanCandidatesToMap();
 
+  // Appends the points of a finer layer to a keyed scan, and to the map if
+  // the scan is already in it
+  void AddScanRefinement(const gtsam::Symbol& key,
+                         const PointCloud::ConstPtr& points);
+
+  // Ask the robots for the keyed scans the base is missing, or only has
+  // downsampled
+  bool SetScanRequestParameters();
+  void RequestMissingScans();
+
   // Robots that the base station subscribes to
   std::vector<std::string> robot_names_;
 
   // Factor handler wrappers
-  bool ProcessPoseGraphData(std::shared_ptr<FactorData> data);
-  bool ProcessManualLoopClosureData(std::shared_ptr<FactorData> data);
-  bool ProcessRobotPoseData(std::shared_ptr<FactorData> data);
+  bool ProcessPoseGraphData(const PoseGraphData& pose_graph_data);
+  bool ProcessManualLoopClosureData(
+      const LoopClosureData& manual_loop_closure_data);
+  bool ProcessRobotPoseData(const RobotPoseData& pose_data);
 
   // Data handler classes
   PoseGraphHandler pose_graph_handler_;
   RobotPoseHandler robot_pose_handler_;
+  // Filled by the handlers every tick, reusing their memory
+  PoseGraphData pose_graph_data_;
+  LoopClosureData manual_loop_closure_data_;
+  RobotPoseData robot_pose_data_;
 
   // Subscribers
   ros::Subscriber debug_sub_;
@@ -91,12 +107,28 @@ private:
   // Track latest pose from each robot
   std::map<char, std::pair<gtsam::Key, gtsam::Pose3>> latest_node_pose_;
 
+  // Robot poses extrapolated to the time they are published, the last
+  // received pose is kept below the confidence
+  bool b_predict_robot_poses_{false};
+  double min_robot_pose_confidence_{0.2};
+
   // Vector list of keyed scans to add to map
   std::vector<gtsam::Symbol> keyed_scan_candidates_;
 
   // Last pose graph publish time
   ros::Time last_pg_update_time_;
 
+  // Keyed scan requests
+  bool b_scan_requests_{false};
+  double scan_request_period_{5.0};
+  double missing_scan_delay_{10.0};
+  int max_requested_scans_{50};
+  int max_scan_request_attempts_{3};
+  ros::Time last_scan_request_time_;
+  std::set<gtsam::Key> coarse_scan_keys_;
+  std::map<gtsam::Key, int> scan_request_attempts_;
+  std::map<char, ros::Publisher> scan_request_pubs_;
+
   // Test class fixtures
   friend class TestLampBase;
 };
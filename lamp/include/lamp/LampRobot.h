@@ -15,6 +15,11 @@
 
 #include <pcl_ros/point_cloud.h>
 #include <lamp_utils/LampPcldFilter.h>
+#include <lamp_utils/ScanCompression.h>
+#include <lamp_utils/SendScheduler.h>
+#include <pose_graph_msgs/KeyedScanLayer.h>
+#include <pose_graph_msgs/KeyedScanRequest.h>
+#include <silvus_msgs/SilvusStreamscape.h>
 // Services
 
 // Class Definition
@@ -65,10 +70,26 @@ class LampRobot : public LampBase {
   // Overwrite base classs functions where needed
 
    // Factor Handler Wrappers
-   bool ProcessOdomData(std::shared_ptr<FactorData> data);
+   bool ProcessOdomData(const OdomData& odom_data);
 
    // Process Stationary data when robot stops
-   bool ProcessStationaryData(std::shared_ptr<FactorData> data);
+   bool ProcessStationaryData(const ImuData& imu_data);
+
+   // Keyframe suppression while standing still
+   bool SetStationarySuppressionParameters();
+   void UpdateStationaryMode();
+   void EnterStationaryMode();
+   void LeaveStationaryMode();
+   // Attitude factors of the queued stops at key
+   void ProcessStationaryDetections(const gtsam::Symbol& key);
+
+   // Marginalization of old odometry nodes every sparsification_interval_
+   // keys
+   bool SetSparsificationParameters();
+   void SparsifyGraph();
+
+   // Only once initialized, the initialization counts the timer ticks
+   void ProcessOnWake() override;
 
    bool InitializeGraph(gtsam::Pose3& pose,
                         gtsam::noiseModel::Diagonal::shared_ptr& covariance);
@@ -76,6 +97,26 @@ class LampRobot : public LampBase {
    void AddKeyedScanAndPublish(PointCloud::Ptr new_scan,
                                gtsam::Symbol current_key);
 
+   // Bandwidth scheduling of the traffic to the base station
+   bool SetSendSchedulerParameters(const ros::NodeHandle& n);
+   void QueueKeyedScan(const gtsam::Symbol& key,
+                       const PointCloud::ConstPtr& scan,
+                       bool b_expires);
+   void PublishScanLayers(const gtsam::Symbol& key,
+                          const PointCloud::ConstPtr& scan);
+
+   // Keyed scan messages, compressed if enabled
+   bool SetScanCompressionParameters();
+   pose_graph_msgs::KeyedScan::Ptr
+   ToKeyedScanMsg(const gtsam::Symbol& key,
+                  const PointCloud::ConstPtr& scan) const;
+   void ScheduleSends();
+   bool SetPipelineParameters();
+   void LinkQualityCallback(
+       const silvus_msgs::SilvusStreamscape::ConstPtr& msg);
+   void KeyedScanRequestCallback(
+       const pose_graph_msgs::KeyedScanRequest::ConstPtr& msg);
+
    void HandleRelativePoseMeasurement(const ros::Time& time,
                                       const gtsam::Pose3& relative_pose,
                                       gtsam::Pose3& transform,
@@ -96,6 +137,9 @@ class LampRobot : public LampBase {
    // Data Handler classes
    OdometryHandler odometry_handler_;
    StationaryHandler stationary_handler_;
+   // Filled by the handlers every tick, reusing their memory
+   OdomData odom_data_;
+   ImuData imu_data_;
 
    // Add new functions as needed
 
@@ -116,6 +160,53 @@ class LampRobot : public LampBase {
    // Point cloud filter
    LampPcldFilter filter_;
    LampPcldFilterParams filter_params_;
+
+   // Send scheduler. Graphs go first, then downsampled scans, then full
+   // scans, within a byte budget following the radio link quality. Full
+   // scans that wait too long are sent downsampled instead and the base
+   // requests them later.
+   bool b_send_scheduler_{false};
+   lamp_utils::SendScheduler send_scheduler_;
+   double default_link_rate_{200000.0};
+   double link_fraction_{0.2};
+   double link_timeout_{5.0};
+   double max_full_scan_delay_{2.0};
+   double coarse_scan_leaf_{1.0};
+   std::string radio_label_;
+   ros::Time last_link_update_;
+   size_t charged_graph_bytes_{0};
+   std::set<gtsam::Key> requested_scan_keys_;
+   ros::Publisher keyed_scan_coarse_pub_;
+   ros::Subscriber link_quality_sub_;
+   ros::Subscriber keyed_scan_request_sub_;
+
+   // Keyed scans sent as octree levels of detail, the coarse layer with the
+   // scheduler priority of downsampled scans and the refinements after it
+   bool b_scan_layers_{false};
+   int num_scan_layers_{3};
+   double scan_layer_leaf_{2.0};
+   ros::Publisher keyed_scan_layer_pub_;
+
+   // Standing still, the stop is held at stationary_anchor_ without new
+   // keyframes
+   bool b_stationary_suppression_{false};
+   double stationary_status_timeout_{1.0};
+   gtsam::SharedNoiseModel zero_motion_noise_;
+   bool b_stationary_mode_{false};
+   gtsam::Symbol stationary_anchor_;
+
+   lamp_utils::SparsificationParams sparsification_params_;
+   int sparsification_interval_{50};
+   uint64_t sparsified_at_{0};
+
+   // Quantized and entropy coded keyed scans
+   bool b_compress_scans_{false};
+   lamp_utils::ScanCompressionParams scan_compression_params_;
+
+   // Map insertion/publishing and graph/keyed scan publishing on their own
+   // stages, so the update loop only runs the front end (odometry, handlers
+   // and pose graph)
+   bool b_pipeline_{false};
 };
 
 #endif
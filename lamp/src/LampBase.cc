@@ -6,6 +6,20 @@
 
 // Includes
 #include <lamp/LampBase.h>
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudPool.h>
+#include <lamp_utils/ThreadGovernor.h>
+#include <lamp_utils/Tracing.h>
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <ros/callback_queue.h>
 
 // #include <math.h>
 // #include <ctime>
@@ -37,7 +51,52 @@ LampBase::LampBase()
 }
 
 // Destructor
-LampBase::~LampBase() {}
+LampBase::~LampBase() {
+  ros::getGlobalCallbackQueue()->removeByID(reinterpret_cast<uint64_t>(this));
+}
+
+namespace {
+
+// Processing step queued by a handler wake
+class WakeCallback : public ros::CallbackInterface {
+public:
+  explicit WakeCallback(const std::function<void()>& run) : run_(run) {}
+
+  CallResult call() override {
+    run_();
+    return Success;
+  }
+
+private:
+  std::function<void()> run_;
+};
+
+} // namespace
+
+void LampBase::WakeProcessing() {
+  // Called from the handler callbacks and ingestion threads
+  if (!b_wake_on_data_ || b_wake_pending_.exchange(true)) {
+    return;
+  }
+  ros::getGlobalCallbackQueue()->addCallback(
+      boost::make_shared<WakeCallback>([this]() {
+        b_wake_pending_ = false;
+        ProcessOnWake();
+      }),
+      reinterpret_cast<uint64_t>(this));
+}
+
+void LampBase::ProcessOnWake() {
+  ProcessTimerCallback(ros::TimerEvent());
+}
+
+void LampBase::UpdateMemoryAccounts() {
+  const ros::WallTime now = ros::WallTime::now();
+  if ((now - last_memory_update_).toSec() < 1.0)
+    return;
+  last_memory_update_ = now;
+  pose_graph_.UpdateMemoryAccounts();
+}
 
 bool LampBase::SetFactorPrecisions() {
   if (!pu::Get("attitude_sigma", attitude_sigma_))
@@ -59,13 +118,141 @@ bool LampBase::SetFactorPrecisions() {
   gtsam::Vector6 sigmas;
   sigmas.head<3>().setConstant(attitude_sigma_);
   sigmas.tail<3>().setConstant(position_sigma_);
-  odom_noise_ = gtsam::noiseModel::Diagonal::Sigmas(sigmas);
+  // Interned, so the factors with fixed covariances share these models
+  odom_noise_ = lamp_utils::NoiseModelCache::Instance().Intern(
+      gtsam::noiseModel::Diagonal::Sigmas(sigmas));
 
   // Set as noise models
   sigmas.head<3>().setConstant(laser_lc_rot_sigma_);
   sigmas.tail<3>().setConstant(laser_lc_trans_sigma_);
-  laser_lc_noise_ = gtsam::noiseModel::Diagonal::Sigmas(sigmas);
+  laser_lc_noise_ = lamp_utils::NoiseModelCache::Instance().Intern(
+      gtsam::noiseModel::Diagonal::Sigmas(sigmas));
+
+  return true;
+}
+
+bool LampBase::SetMapUpdateParameters() {
+  if (!pu::Get("map_update/b_incremental", b_incremental_map_update_))
+    return false;
+  if (!pu::Get("map_update/translation_threshold",
+               map_update_trans_threshold_))
+    return false;
+  if (!pu::Get("map_update/rotation_threshold", map_update_rot_threshold_))
+    return false;
+  if (!pu::Get("map_update/full_regeneration_interval",
+               full_map_regeneration_interval_))
+    return false;
+  if (!pu::Get("map_update/num_threads", map_update_threads_))
+    return false;
+  map_update_threads_ = static_cast<int>(
+      lamp_utils::ThreadGovernor::Instance().Threads(
+          "map_update", std::max(map_update_threads_, 1)));
+  if (!pu::Get("map_update/b_incremental_publish", b_incremental_map_publish_))
+    return false;
+
+  // Downsampled map products
+  std::vector<double> leaf_sizes, rates;
+  std::vector<std::string> topics;
+  if (!pu::Get("map_products/leaf_sizes", leaf_sizes))
+    return false;
+  if (!pu::Get("map_products/rates", rates))
+    return false;
+  if (!pu::Get("map_products/topics", topics))
+    return false;
+  if (rates.size() != leaf_sizes.size() || topics.size() != leaf_sizes.size()) {
+    ROS_ERROR("map_products: leaf_sizes, rates and topics differ in length");
+    return false;
+  }
+  map_products_.clear();
+  for (size_t i = 0; i < leaf_sizes.size(); i++) {
+    if (leaf_sizes[i] <= 0 || rates[i] <= 0) {
+      ROS_ERROR("map_products: leaf sizes and rates must be positive");
+      return false;
+    }
+    MapProduct product;
+    product.map = lamp_utils::VoxelMap(leaf_sizes[i]);
+    product.rate = rates[i];
+    product.topic = topics[i];
+    product.b_queued = std::make_shared<std::atomic<bool>>(false);
+    map_products_.push_back(product);
+  }
+
+  // Recycled clouds for the keyed scans, map transforms and scratch clouds
+  int pool_max_clouds, pool_max_points;
+  if (!pu::Get("point_cloud_pool/max_clouds", pool_max_clouds))
+    return false;
+  if (!pu::Get("point_cloud_pool/max_points", pool_max_points))
+    return false;
+  lamp_utils::PointCloudPool::Instance().SetCapacity(
+      std::max(pool_max_clouds, 0), std::max(pool_max_points, 0));
+
+  return true;
+}
+
+bool LampBase::SetDeltaPublicationParameters() {
+  lamp_utils::DeltaPublicationParams params;
+  if (!pu::Get("pose_graph_delta/b_enabled", params.b_enabled))
+    return false;
+  if (!pu::Get("pose_graph_delta/position_resolution",
+               params.position_resolution))
+    return false;
+  if (!pu::Get("pose_graph_delta/keyframe_interval", params.keyframe_interval))
+    return false;
+  if (params.position_resolution <= 0) {
+    ROS_ERROR("pose_graph_delta/position_resolution must be positive");
+    return false;
+  }
+  delta_encoder_.SetParams(params);
+
+  return true;
+}
+
+bool LampBase::SetCheckpointParameters() {
+  if (!pu::Get("checkpoint/b_enabled", b_checkpoint_))
+    return false;
+  if (!pu::Get("checkpoint/b_restore", b_restore_checkpoint_))
+    return false;
+  if (!pu::Get("checkpoint/file", checkpoint_file_))
+    return false;
+  if (!pu::Get("checkpoint/period", checkpoint_period_))
+    return false;
+  if (!pu::Get("checkpoint/restore_scans_per_tick", restore_scans_per_tick_))
+    return false;
+  if ((b_checkpoint_ || b_restore_checkpoint_) && checkpoint_file_.empty()) {
+    ROS_ERROR("checkpoint/file must be set to checkpoint the session");
+    return false;
+  }
+
+  return true;
+}
 
+bool LampBase::SetPriorMapParameters() {
+  std::string file;
+  double rot_sigma, trans_sigma;
+  if (!pu::Get("prior_map/file", file))
+    return false;
+  if (!pu::Get("prior_map/rot_sigma", rot_sigma))
+    return false;
+  if (!pu::Get("prior_map/trans_sigma", trans_sigma))
+    return false;
+  gtsam::Vector6 sigmas;
+  sigmas.head<3>().setConstant(rot_sigma);
+  sigmas.tail<3>().setConstant(trans_sigma);
+  prior_map_noise_ = lamp_utils::NoiseModelCache::Instance().Intern(
+      gtsam::noiseModel::Diagonal::Sigmas(sigmas));
+  if (file.empty())
+    return true;
+
+  if (!prior_map_.Open(file)) {
+    ROS_ERROR_STREAM("Could not open the prior map " << file);
+    return false;
+  }
+  // Only the nodes reached by loop closures are imported
+  for (unsigned char prefix : prior_map_.Prefixes()) {
+    pose_graph_.ExcludeFromChains(prefix);
+  }
+  ROS_INFO_STREAM("Prior map " << file << " with " << prior_map_.NumScans()
+                               << " keyed scans");
   return true;
 }
 
@@ -81,11 +268,33 @@ bool LampBase::CreatePublishers(const ros::NodeHandle& n) {
   keyed_scan_pub_ =
       nl.advertise<pose_graph_msgs::KeyedScan>("keyed_scans", 10, true);
 
+  // Downsampled map products, each on its own timer
+  for (size_t i = 0; i < map_products_.size(); i++) {
+    MapProduct& product = map_products_[i];
+    product.pub = nl.advertise<PointCloud>(product.topic, 1, false);
+    product.timer = nl.createTimer(
+        ros::Duration(1.0 / product.rate),
+        boost::bind(&LampBase::MapProductTimerCallback, this, _1, i));
+  }
+
+  metrics_publisher_.Start(n);
+
   return true;
 }
 
 void LampBase::OptimizerUpdateCallback(
     const pose_graph_msgs::PoseGraphConstPtr& msg) {
+  // Discard results older than the last merged one. Generation 1 is the first
+  // result of a (re)started optimizer so it is always accepted
+  const uint32_t generation = msg->header.seq;
+  if (generation > 1 && generation <= last_optimizer_generation_) {
+    ROS_WARN_STREAM("Discarding stale optimizer result (generation "
+                    << generation << ", last merged "
+                    << last_optimizer_generation_ << ")");
+    return;
+  }
+  last_optimizer_generation_ = generation;
+
   ROS_WARN_STREAM("Received new pose graph from optimizer - merging now "
                   "-----------------------------------------------------");
   b_received_optimizer_update_ = true;
@@ -105,38 +314,21 @@ void LampBase::OptimizerUpdateCallback(
   PublishPoseGraph(false);
 
   // Update the map (also publishes)
-  ReGenerateMapPointCloud();
+  UpdateMapPointCloud();
 }
 
 void LampBase::MergeOptimizedGraph(
     const pose_graph_msgs::PoseGraphConstPtr& msg) {
-  // Process the slow graph update
-  merger_.OnSlowGraphMsg(msg);
-
-  // Give merger the current graph (will likely have more nodes that the
-  // optimized)
-  merger_.OnFastGraphMsg(pose_graph_.ToMsg());
-
-  gtsam::Values new_values;
-  gtsam::Symbol key;
-
-  // Update the internal LAMP graph using the one stored by the merger
-  pose_graph_msgs::PoseGraphConstPtr fused_graph(
-      new pose_graph_msgs::PoseGraph(merger_.GetCurrentGraph()));
-
-  // update the LAMP internal values_ and factors
-  pose_graph_.UpdateFromMsg(fused_graph);
+  // Merge the optimized graph straight into the current graph (will likely
+  // have more nodes than the optimized)
+  std::vector<gtsam::Key> changed_keys =
+      merger_.MergeIntoGraph(msg, &pose_graph_);
+  ROS_DEBUG_STREAM("Optimized graph moved " << changed_keys.size()
+                   << " nodes");
 
   // prune outliers given optimized graph
   pose_graph_.UpdateLoopClosures(msg);
 
-  // ROS_DEBUG_STREAM("Pose graph after update: ");
-  // for (auto n : pose_graph_.GetNodes()) {
-  //   ROS_INFO_STREAM(gtsam::DefaultKeyFormatter(n.key)
-  //                   << "(" << n.pose.position.x << ", " << n.pose.position.y
-  //                   << ", " << n.pose.position.z << ")");
-  // }
-
   if (b_repub_values_after_optimization_) {
     // ROS_INFO("Republishing all values on incremental pose graph");
     pose_graph_.AddAllValuesToNew();
@@ -150,12 +342,13 @@ void LampBase::LaserLoopClosureCallback(
                   "--------------------------------------------------");
 
   // Do things particular to loop closures from the laser
+  ImportPriorMapNodes(*msg);
 
   if (b_use_fixed_covariances_) {
     // Change the covariances in the message first
     pose_graph_msgs::PoseGraph graph_msg = *msg;
 
-    ChangeCovarianceInMessage(graph_msg, laser_lc_noise_);
+    ChangeCovarianceInMessage(&graph_msg, laser_lc_noise_);
 
     pose_graph_msgs::PoseGraphConstPtr msg_ptr(
         new pose_graph_msgs::PoseGraph(graph_msg));
@@ -178,16 +371,50 @@ void LampBase::AddLoopClosureToGraph(
   b_run_optimization_ = true;
 }
 
-pose_graph_msgs::PoseGraph
-LampBase::ChangeCovarianceInMessage(pose_graph_msgs::PoseGraph msg,
-                                    gtsam::SharedNoiseModel noise) {
-  // Loop through each edge
-  for (pose_graph_msgs::PoseGraphEdge& edge : msg.edges) {
-    // Replace covariance with the noise model
-    lamp_utils::UpdateCovariance(edge, noise);
+void LampBase::ImportPriorMapNodes(const pose_graph_msgs::PoseGraph& msg) {
+  if (!prior_map_.IsOpen())
+    return;
+  pose_graph_msgs::PoseGraphPtr imported(new pose_graph_msgs::PoseGraph);
+  for (const auto& edge : msg.edges) {
+    for (gtsam::Key key : {edge.key_from, edge.key_to}) {
+      gtsam::Pose3 pose;
+      ros::Time stamp;
+      if (pose_graph_.HasKey(key) ||
+          std::any_of(imported->nodes.begin(),
+                      imported->nodes.end(),
+                      [key](const pose_graph_msgs::PoseGraphNode& node) {
+                        return node.key == key;
+                      }) ||
+          !prior_map_.GetPose(key, &pose, &stamp))
+        continue;
+      imported->nodes.push_back(lamp_utils::GtsamToRosMsg(
+          stamp, pose_graph_.fixed_frame_id, key, pose, prior_map_noise_));
+      imported->edges.push_back(
+          lamp_utils::GtsamToRosMsg(key,
+                                    key,
+                                    pose_graph_msgs::PoseGraphEdge::PRIOR,
+                                    pose,
+                                    prior_map_noise_));
+    }
   }
+  if (imported->nodes.empty())
+    return;
+  ROS_INFO_STREAM("Importing " << imported->nodes.size()
+                               << " nodes of the prior map");
+  pose_graph_.UpdateFromMsg(imported);
+}
 
-  return msg;
+void LampBase::ChangeCovarianceInMessage(
+    pose_graph_msgs::PoseGraph* msg,
+    const gtsam::SharedNoiseModel& noise) {
+  // The edges all get the one covariance, and so share the interned model
+  // when converted
+  const gtsam::Matrix66 covariance =
+      boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(noise)
+          ->covariance();
+  for (pose_graph_msgs::PoseGraphEdge& edge : msg->edges) {
+    lamp_utils::UpdateCovariance(edge, covariance);
+  }
 }
 
 //------------------------------------------------------------------------------------------
@@ -195,109 +422,361 @@ LampBase::ChangeCovarianceInMessage(pose_graph_msgs::PoseGraph msg,
 //------------------------------------------------------------------------------------------
 
 bool LampBase::ReGenerateMapPointCloud() {
-  // Reset the map
-  mapper_->Reset();
+  // Combine the keyed scans with the latest node values on the map stage,
+  // after the scans already queued, from a snapshot of the graph as it
+  // keeps growing meanwhile
+  const std::shared_ptr<const PoseGraph> graph = pose_graph_.Snapshot();
+  map_stage_.Push([this, graph] {
+    PointCloud::Ptr regenerated_map =
+        lamp_utils::PointCloudPool::Instance().Acquire();
+    map_scans_world_.clear();
+    CombineKeyedScansWorld(*graph, regenerated_map.get());
+
+    // Reset the map and insert the points (publishes incremental point
+    // clouds)
+    ResetMap();
+    InsertIntoMap(regenerated_map);
+  });
+
+  // Publish map
+  QueueMapPublish();
+  return true;
+}
 
-  // Combine the keyed scans with the latest node values
-  PointCloud::Ptr regenerated_map(new PointCloud);
-  CombineKeyedScansWorld(regenerated_map.get());
+bool LampBase::UpdateMapPointCloud() {
+  if (!b_incremental_map_update_) {
+    return ReGenerateMapPointCloud();
+  }
 
-  // Insert points into the map (publishes incremental point clouds)
-  PointCloud::Ptr unused(new PointCloud);
-  mapper_->InsertPoints(regenerated_map, unused.get());
+  // Occasional full regeneration as a fallback
+  map_update_count_++;
+  if (full_map_regeneration_interval_ > 0 &&
+      map_update_count_ % full_map_regeneration_interval_ == 0) {
+    ROS_DEBUG("Periodic full regeneration of the map");
+    return ReGenerateMapPointCloud();
+  }
 
-  // Publish map
-  mapper_->PublishMap();
+  // The scans are re-transformed on the map stage, which owns
+  // map_scans_world_, from a snapshot of the graph
+  const std::shared_ptr<const PoseGraph> graph = pose_graph_.Snapshot();
+  map_stage_.Push([this, graph] { UpdateMapScans(*graph); });
+
+  QueueMapPublish();
   return true;
 }
 
+void LampBase::UpdateMapScans(const PoseGraph& graph) {
+  // Drop scans whose node is no longer in the graph (e.g. removed robots)
+  int n_removed = 0;
+  for (auto it = map_scans_world_.begin(); it != map_scans_world_.end();) {
+    if (!graph.HasKey(it->first) || !graph.HasScan(it->first)) {
+      it = map_scans_world_.erase(it);
+      n_removed++;
+    } else {
+      ++it;
+    }
+  }
+
+  // Re-transform only the scans whose node moved beyond the thresholds
+  int n_moved = 0;
+  for (const gtsam::Symbol& key : graph.GetKeyedScanKeys()) {
+    if (!graph.HasKey(key)) {
+      continue;
+    }
+
+    const gtsam::Pose3 pose = graph.GetPose(key);
+    auto map_scan = map_scans_world_.find(key);
+    if (map_scan != map_scans_world_.end() &&
+        !HasNodeMoved(map_scan->second.pose, pose)) {
+      continue;
+    }
+
+    PointCloud::Ptr scan_world =
+        lamp_utils::PointCloudPool::Instance().Acquire();
+    if (!GetTransformedPointCloudWorld(graph, key, scan_world.get()))
+      continue;
+    map_scans_world_[key] = MapScan{pose, scan_world};
+    n_moved++;
+  }
+
+  ROS_DEBUG_STREAM("Incremental map update: " << n_moved << " of "
+                                              << map_scans_world_.size()
+                                              << " scans re-transformed, "
+                                              << n_removed << " removed");
+
+  // Nothing changed, keep the current map
+  if (n_moved == 0 && n_removed == 0) {
+    return;
+  }
+
+  // The mapper does not support point removal, so rebuild it from the cached
+  // world frame scans
+  PointCloud::Ptr updated_map =
+      lamp_utils::PointCloudPool::Instance().Acquire();
+  for (const auto& map_scan : map_scans_world_) {
+    *updated_map += *map_scan.second.points;
+  }
+  ResetMap();
+  InsertIntoMap(updated_map);
+}
+
+bool LampBase::HasNodeMoved(const gtsam::Pose3& old_pose,
+                            const gtsam::Pose3& new_pose) const {
+  const gtsam::Pose3 delta = old_pose.between(new_pose);
+  if (delta.translation().norm() > map_update_trans_threshold_) {
+    return true;
+  }
+  return gtsam::Rot3::Logmap(delta.rotation()).norm() >
+      map_update_rot_threshold_;
+}
+
 // For combining all the scans together
 bool LampBase::CombineKeyedScansWorld(PointCloud* points) {
+  return CombineKeyedScansWorld(pose_graph_, points);
+}
+
+bool LampBase::CombineKeyedScansWorld(const PoseGraph& graph,
+                                      PointCloud* points) {
   if (points == NULL) {
     ROS_ERROR("%s: Output point cloud container is null.", name_.c_str());
     return false;
   }
   points->points.clear();
 
-  // Iterate over poses in the graph, transforming their corresponding laser
-  // scans into world frame and appending them to the output.
-  for (const auto& keyed_pose : pose_graph_.GetValues()) {
+  // Collect the scans in graph order and size the output up front, each scan
+  // gets a disjoint slice
+  std::vector<PointCloud::ConstPtr> scans;
+  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>>
+      transforms;
+  std::vector<gtsam::Symbol> keys;
+  std::vector<size_t> offsets;
+  size_t n_points = 0;
+  for (const auto& keyed_pose : graph.GetValues()) {
     const gtsam::Symbol key = keyed_pose.key;
+    Eigen::Matrix4d b2w;
+    if (!GetScanToWorld(graph, key, &b2w))
+      continue;
+    const PointCloud::ConstPtr scan = graph.GetKeyedScan(key);
+    if (scan == nullptr)
+      continue;
+    scans.push_back(scan);
+    transforms.push_back(b2w);
+    keys.push_back(key);
+    offsets.push_back(n_points);
+    n_points += scan->size();
+  }
+  points->points.resize(n_points);
+  points->width = n_points;
+  points->height = 1;
+
+  // Transform the body-frame scans into world frame concurrently. For
+  // incremental updates each world-frame scan is also kept on its own.
+  std::vector<PointCloud::Ptr> scans_world(
+      b_incremental_map_update_ ? scans.size() : 0);
+  const int n_scans = scans.size();
+  const int enable_omp = (1 < map_update_threads_);
+#pragma omp parallel for schedule(dynamic, 8) num_threads(map_update_threads_) if (enable_omp)
+  for (int i = 0; i < n_scans; i++) {
+    PointCloud::PointType* slice = points->points.data() + offsets[i];
+    lamp_utils::TransformPoints(
+        scans[i]->points.data(), scans[i]->size(), transforms[i], slice);
+    if (b_incremental_map_update_) {
+      scans_world[i] = lamp_utils::PointCloudPool::Instance().Acquire();
+      scans_world[i]->header = scans[i]->header;
+      scans_world[i]->points.assign(slice, slice + scans[i]->size());
+      scans_world[i]->width = scans[i]->size();
+      scans_world[i]->height = 1;
+    }
+  }
 
-    PointCloud::Ptr scan_world(new PointCloud);
-
-    // Transform the body-frame scan into world frame.
-    GetTransformedPointCloudWorld(key, scan_world.get());
-
-    // Append the world-frame point cloud to the output.
-    *points += *scan_world;
+  // Keep the world-frame scans for later incremental updates
+  for (size_t i = 0; i < scans_world.size(); i++) {
+    map_scans_world_[keys[i]] =
+        MapScan{graph.GetPose(keys[i]), scans_world[i]};
   }
+
   ROS_DEBUG_STREAM("Points size is: " << points->points.size()
                                       << ", in CombineKeyedScansWorld");
   return true;
 }
 
-// Transform the point cloud to world frame
-bool LampBase::GetTransformedPointCloudWorld(const gtsam::Symbol key,
-                                             PointCloud* points) {
-  if (points == NULL) {
-    ROS_ERROR("%s: Output point cloud container is null.", name_.c_str());
-    return false;
-  }
-  points->points.clear();
+bool LampBase::GetScanToWorld(const gtsam::Symbol key, Eigen::Matrix4d* b2w) {
+  return GetScanToWorld(pose_graph_, key, b2w);
+}
 
+bool LampBase::GetScanToWorld(const PoseGraph& graph,
+                              const gtsam::Symbol key,
+                              Eigen::Matrix4d* b2w) {
   // No key associated with the scan
-  if (!pose_graph_.HasScan(key)) {
+  if (!graph.HasScan(key)) {
     ROS_WARN("Could not find scan associated with key in "
              "GetTransformedPointCloudWorld");
     return false;
   }
 
   // Check that the key exists
-  if (!pose_graph_.HasKey(key)) {
+  if (!graph.HasKey(key)) {
     ROS_WARN("Key %s does not exist in values in GetTransformedPointCloudWorld",
              gtsam::DefaultKeyFormatter(key).c_str());
     return false;
   }
 
-  const gu::Transform3 pose = lamp_utils::ToGu(pose_graph_.GetPose(key));
-  Eigen::Matrix4d b2w;
-  b2w.setZero();
-  b2w.block(0, 0, 3, 3) = pose.rotation.Eigen();
-  b2w.block(0, 3, 3, 1) = pose.translation.Eigen();
-  b2w(3, 3) = 1;
+  const gu::Transform3 pose = lamp_utils::ToGu(graph.GetPose(key));
+  b2w->setZero();
+  b2w->block(0, 3, 3, 1) = pose.translation.Eigen();
+  (*b2w)(3, 3) = 1;
 
   Eigen::Quaterniond quat(pose.rotation.Eigen());
   quat.normalize();
-  b2w.block(0, 0, 3, 3) = quat.matrix();
+  b2w->block(0, 0, 3, 3) = quat.matrix();
+  return true;
+}
 
-  // ROS_INFO_STREAM("TRANSFORMATION MATRIX (rotation det: " <<
-  // pose.rotation.Eigen().determinant() << ")"); Eigen::IOFormat CleanFmt(4, 0,
-  // ", ", "\n", "[", "]"); ROS_INFO_STREAM("\n" << b2w.format(CleanFmt));
+// Transform the point cloud to world frame
+bool LampBase::GetTransformedPointCloudWorld(const gtsam::Symbol key,
+                                             PointCloud* points) {
+  return GetTransformedPointCloudWorld(pose_graph_, key, points);
+}
 
-  // Transform the body-frame scan into world frame.
-  pcl::transformPointCloud(*pose_graph_.keyed_scans[key], *points, b2w);
+bool LampBase::GetTransformedPointCloudWorld(const PoseGraph& graph,
+                                             const gtsam::Symbol key,
+                                             PointCloud* points) {
+  if (points == NULL) {
+    ROS_ERROR("%s: Output point cloud container is null.", name_.c_str());
+    return false;
+  }
+  points->points.clear();
+
+  Eigen::Matrix4d b2w;
+  if (!GetScanToWorld(graph, key, &b2w))
+    return false;
 
-  // ROS_INFO_STREAM("Points size is: " << points->points.size()
-  //                                    << ", in
-  //                                    GetTransformedPointCloudWorld");
+  // Transform the body-frame scan into world frame.
+  const PointCloud::ConstPtr scan = graph.GetKeyedScan(key);
+  if (scan == nullptr)
+    return false;
+  lamp_utils::TransformPointCloud(*scan, b2w, points);
   return true;
 }
 
 // For adding one scan to the map
 bool LampBase::AddTransformedPointCloudToMap(const gtsam::Symbol key) {
-  PointCloud::Ptr points(new PointCloud);
+  Eigen::Matrix4d b2w;
+  if (!GetScanToWorld(key, &b2w))
+    return false;
+  const PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(key);
+  if (scan == nullptr)
+    return false;
 
-  GetTransformedPointCloudWorld(key, points.get());
+  // Filled on the map stage, and kept there for later incremental updates
+  PointCloud::Ptr points = lamp_utils::PointCloudPool::Instance().Acquire();
+  const gtsam::Pose3 pose = pose_graph_.GetPose(key);
+
+  // Transform and add to the map, unaligned copy of the transform as the
+  // task is heap allocated
+  static lamp_utils::Counter& map_inserts =
+      lamp_utils::MetricsRegistry::Instance().GetCounter("lamp.map_inserts");
+  const Eigen::Matrix<double, 4, 4, Eigen::DontAlign> transform = b2w;
+  map_stage_.Push([this, key, scan, transform, points, pose] {
+    lamp_utils::TraceSpan span("map.insert", key);
+    if (b_incremental_map_update_) {
+      map_scans_world_[key] = MapScan{pose, points};
+    }
+    lamp_utils::TransformPointCloud(*scan, transform, points.get());
+    ROS_DEBUG_STREAM("Points size is: " << points->points.size()
+                                        << ", in AddTransformedPointCloudToMap");
+    InsertIntoMap(points);
+    map_inserts.Increment();
+  });
 
-  ROS_DEBUG_STREAM("Points size is: " << points->points.size()
-                                     << ", in AddTransformedPointCloudToMap");
+  return true;
+}
 
-  // Add to the map
-  PointCloud::Ptr unused(new PointCloud);
-  mapper_->InsertPoints(points, unused.get());
+void LampBase::InsertIntoMap(const PointCloud::Ptr& points) {
+  PointCloud::Ptr incremental =
+      lamp_utils::PointCloudPool::Instance().Acquire();
+  mapper_->InsertPoints(points, incremental.get());
+  if (map_incremental_pub_)
+    *map_increment_ += *incremental;
+  for (MapProduct& product : map_products_)
+    product.map.Insert(*points);
+}
 
-  return true;
+void LampBase::ResetMap() {
+  mapper_->Reset();
+  // Incremental subscribers catch up from the full map published next
+  map_increment_->clear();
+  for (MapProduct& product : map_products_)
+    product.map.clear();
+}
+
+void LampBase::MapProductTimerCallback(const ros::TimerEvent& ev, size_t i) {
+  MapProduct& product = map_products_[i];
+  if (product.pub.getNumSubscribers() == 0 || product.b_queued->exchange(true))
+    return;
+  const std::string frame_id = pose_graph_.fixed_frame_id;
+  const ros::Time stamp = ev.current_real;
+  map_stage_.Push([this, i, frame_id, stamp] {
+    MapProduct& product = map_products_[i];
+    *product.b_queued = false;
+    // Only the downsampled cloud is copied and serialized
+    PointCloud::Ptr cloud = lamp_utils::PointCloudPool::Instance().Acquire();
+    product.map.GetCloud(cloud.get());
+    cloud->header.frame_id = frame_id;
+    pcl_conversions::toPCL(stamp, cloud->header.stamp);
+    output_stage_.Push(
+        [this, i, cloud] { map_products_[i].pub.publish(*cloud); });
+  });
+}
+
+void LampBase::QueueMapIncrementPublish() {
+  if (b_map_increment_queued_.exchange(true))
+    return;
+  const std::string frame_id = pose_graph_.fixed_frame_id;
+  const ros::Time stamp = ros::Time::now();
+  map_stage_.Push([this, frame_id, stamp] {
+    b_map_increment_queued_ = false;
+    if (map_increment_->empty())
+      return;
+    if (map_incremental_pub_.getNumSubscribers() == 0) {
+      map_increment_->clear();
+      return;
+    }
+    PointCloud::Ptr increment = map_increment_;
+    map_increment_ = lamp_utils::PointCloudPool::Instance().Acquire();
+    increment->header.frame_id = frame_id;
+    pcl_conversions::toPCL(stamp, increment->header.stamp);
+    output_stage_.Push(
+        [this, increment] { map_incremental_pub_.publish(*increment); });
+  });
+}
+
+void LampBase::MapResyncCallback(const std_msgs::Empty::ConstPtr& msg) {
+  ROS_INFO("Map resync requested, publishing the full map");
+  QueueMapPublish();
+}
+
+void LampBase::QueueMapPublish() {
+  if (b_map_publish_queued_.exchange(true))
+    return;
+  map_stage_.Push([this] {
+    b_map_publish_queued_ = false;
+    if (!b_publish_map_snapshot_) {
+      mapper_->PublishMap();
+      return;
+    }
+    if (map_snapshot_pub_.getNumSubscribers() == 0)
+      return;
+    // Only the copy holds the map stage, serializing happens on the output
+    // stage while the next scans go in
+    map_snapshot_.Back() = *mapper_->GetMapData();
+    map_snapshot_.Swap();
+    output_stage_.Push([this] {
+      const std::shared_ptr<const PointCloud> map = map_snapshot_.Front();
+      if (map)
+        map_snapshot_pub_.publish(*map);
+    });
+  });
 }
 
 //------------------------------------------------------------------------------------------
@@ -305,8 +784,30 @@ bool LampBase::AddTransformedPointCloudToMap(const gtsam::Symbol key) {
 //------------------------------------------------------------------------------------------
 
 bool LampBase::PublishPoseGraph(bool b_publish_incremental) {
-  // Incremental publishing
-  if (b_publish_incremental) {
+  // Delta encoded incremental publishing
+  if (b_publish_incremental && delta_encoder_.GetParams().b_enabled) {
+    // Until the first graph went through every message is a keyframe
+    if (!b_have_received_first_pg_) {
+      delta_encoder_.RequestKeyframe();
+    }
+    pose_graph_msgs::PoseGraphConstPtr g_delta =
+        delta_encoder_.Encode(pose_graph_);
+    if (g_delta) {
+      ROS_DEBUG_STREAM("Publishing "
+                       << (g_delta->keyframe ? "keyframe" : "delta")
+                       << " graph " << g_delta->sequence << " with "
+                       << g_delta->nodes.size() << " nodes, "
+                       << g_delta->edges.size() << " edges and "
+                       << g_delta->pose_updates.size() << " pose updates");
+      output_stage_.Push(
+          [this, g_delta] { pose_graph_incremental_pub_.publish(*g_delta); });
+      incremental_graph_bytes_ +=
+          ros::serialization::serializationLength(*g_delta);
+      pose_graph_.ClearIncrementalMessages();
+    } else {
+      ROS_DEBUG("No information for incremental publishing");
+    }
+  } else if (b_publish_incremental) {
     // Convert new parts of the pose-graph to messages
     pose_graph_msgs::PoseGraphConstPtr g_inc;
 
@@ -318,13 +819,17 @@ bool LampBase::PublishPoseGraph(bool b_publish_incremental) {
     // TODO - change interface to just take a flag? Then do the clear in there?
     // - no want to make sure it is published
 
-    if (g_inc->nodes.size() > 0 || g_inc->edges.size() > 0) {
+    if (g_inc->nodes.size() > 0 || g_inc->edges.size() > 0 ||
+        !g_inc->marginalized_keys.empty()) {
       ROS_DEBUG_STREAM("Publishing incremental graph with "
                        << g_inc->nodes.size() << " nodes and "
                        << g_inc->edges.size() << " edges");
 
       // Publish
-      pose_graph_incremental_pub_.publish(*g_inc);
+      output_stage_.Push(
+          [this, g_inc] { pose_graph_incremental_pub_.publish(*g_inc); });
+      incremental_graph_bytes_ +=
+          ros::serialization::serializationLength(*g_inc);
 
       // Reset new tracking
       pose_graph_.ClearIncrementalMessages();
@@ -333,22 +838,32 @@ bool LampBase::PublishPoseGraph(bool b_publish_incremental) {
     }
   }
 
-  // Full pose graph publishing
-  // Convert master pose-graph to messages
-  pose_graph_msgs::PoseGraphConstPtr g_full = pose_graph_.ToMsg();
-
-  // Publish
-  pose_graph_pub_.publish(*g_full);
+  // Full pose graph publishing, converted to messages on the output stage
+  // from a snapshot
+  const std::shared_ptr<const PoseGraph> graph = pose_graph_.Snapshot();
+  output_stage_.Push(
+      [this, graph] { pose_graph_pub_.publish(*graph->ToMsg()); });
   ROS_DEBUG_STREAM("Publishing full graph with "
-                   << g_full->nodes.size() << " nodes and "
-                   << g_full->edges.size() << " edges");
+                   << graph->GetNodes().size() << " nodes and "
+                   << graph->GetEdges().size() << " edges");
 
   return true;
 }
 
+void LampBase::PoseGraphResyncCallback(const std_msgs::Empty::ConstPtr& msg) {
+  ROS_WARN("Pose graph resync requested, publishing a keyframe next");
+  delta_encoder_.RequestKeyframe();
+}
+
 bool LampBase::PublishPoseGraphForOptimizer() {
   // TODO incremental publishing instead of full graph?
 
+  // Constant time, the optimizer never gets a broken chain
+  if (!pose_graph_.CheckGraphValid()) {
+    ROS_ERROR("Invalid pose graph, not publishing it to the optimizer");
+    return false;
+  }
+
   // Convert master pose-graph to messages
   pose_graph_msgs::PoseGraphConstPtr g = pose_graph_.ToMsg();
 
@@ -361,7 +876,7 @@ bool LampBase::PublishPoseGraphForOptimizer() {
   }
 
   // Publish
-  pose_graph_to_optimize_pub_.publish(*g);
+  output_stage_.Push([this, g] { pose_graph_to_optimize_pub_.publish(*g); });
 
   return true;
 }
@@ -369,9 +884,7 @@ bool LampBase::PublishPoseGraphForOptimizer() {
 // Placeholder function to used fixed covariances while proper covariances are
 // being developed
 gtsam::SharedNoiseModel LampBase::SetFixedNoiseModels(std::string type) {
-  gtsam::Vector6 zero;
-  zero << 0, 0, 0, 0, 0, 0;
-  gtsam::SharedNoiseModel noise = gtsam::noiseModel::Diagonal::Sigmas(zero);
+  gtsam::SharedNoiseModel noise;
 
   // Switch based on type
   if (type == "odom") {
@@ -387,6 +900,8 @@ gtsam::SharedNoiseModel LampBase::SetFixedNoiseModels(std::string type) {
     // noise = gtsam::noiseModel::Diagonal::Sigmas(sigmas);
     noise = laser_lc_noise_;
   } else if (type == "total_station") {
+    noise = lamp_utils::NoiseModelCache::Instance().Intern(
+        gtsam::noiseModel::Diagonal::Sigmas(gtsam::Vector6::Zero()));
   } else {
     ROS_ERROR("Incorrect input into SetFixedNoiseModels - invalid type");
     throw std::invalid_argument("set fixed noise models");
@@ -396,40 +911,277 @@ gtsam::SharedNoiseModel LampBase::SetFixedNoiseModels(std::string type) {
   return noise;
 }
 
-std::string LampBase::MapSymbolToId(gtsam::Symbol key) const {
+const std::string& LampBase::MapSymbolToId(gtsam::Symbol key) const {
+  static const std::string key_frame_id("key_frame");
+  static const std::string odom_node_id("odom_node");
+  const lamp_utils::SymbolIdIndex& artifact_ids = pose_graph_.GetArtifactIds();
+
   if (pose_graph_.HasScan(key)) {
     // Key frame, note in the ID
-    return "key_frame";
+    return key_frame_id;
   }
 
   else if (lamp_utils::IsRobotPrefix(key.chr())) {
     // Odom or key frame
-    return "odom_node";
+    return odom_node_id;
+  }
+
+  else if (lamp_utils::IsArtifactPrefix(key.chr())) {
+    // Artifact tracked with its UUID, empty if not linked yet
+    return artifact_ids.Id(artifact_ids.IdOf(key));
   }
 
   else {
     ROS_ERROR("Unknown ID");
-    return "";
+    return artifact_ids.Id(lamp_utils::SymbolIdIndex::kNoId);
   }
 }
 
 void LampBase::PublishAllKeyedScans() {
-  if (pose_graph_.keyed_scans.size() == 0) {
+  const std::vector<gtsam::Symbol> keys = pose_graph_.GetKeyedScanKeys();
+  if (keys.size() == 0) {
     ROS_WARN("No keyed scans and you are trying to publish all keyed scans");
     return;
   }
+  QueueKeyedScanReplay(keys, false);
+  ROS_INFO("Queued %lu keyed scans for replay", keys.size());
+}
 
-  // ROS_INFO("Publishing All Keyed Scans");
+bool LampBase::PublishKeyedScan(const gtsam::Symbol& key, size_t* bytes) {
+  const PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(key);
+  if (scan == nullptr)
+    return false;
   pose_graph_msgs::KeyedScan keyed_scan_msg;
+  keyed_scan_msg.key = key;
+  lamp_utils::ToRosMsg(*scan, &keyed_scan_msg.scan);
+  if (bytes)
+    *bytes = ros::serialization::serializationLength(keyed_scan_msg);
+  keyed_scan_pub_.publish(keyed_scan_msg);
+  return true;
+}
 
-  for (auto it = pose_graph_.keyed_scans.begin();
-       it != pose_graph_.keyed_scans.end();
-       ++it) {
-    ROS_INFO_ONCE("Publishing Keyed Scans... WAIT UNTIL DONE");
-    keyed_scan_msg.key = it->first;
-    pcl::toROSMsg(*it->second, keyed_scan_msg.scan);
-    keyed_scan_pub_.publish(keyed_scan_msg);
+bool LampBase::SetKeyedScanReplayParameters() {
+  int order = 0;
+  if (!pu::Get("keyed_scan_replay/bytes_per_second", replay_rate_))
+    return false;
+  if (!pu::Get("keyed_scan_replay/period", replay_period_))
+    return false;
+  if (!pu::Get("keyed_scan_replay/order", order))
+    return false;
+  if (replay_rate_ <= 0 || replay_period_ <= 0 || order < 0 || order > 2) {
+    ROS_ERROR("keyed_scan_replay: bytes_per_second and period must be "
+              "positive, order one of 0, 1, 2");
+    return false;
+  }
+  replay_order_ = static_cast<ReplayOrder>(order);
+  // One tick of budget, so a replay never bursts past the rate
+  replay_budget_.SetRate(replay_rate_);
+  replay_budget_.SetBurst(replay_rate_ * replay_period_);
+  return true;
+}
+
+void LampBase::StartKeyedScanReplay(const ros::NodeHandle& n) {
+  ros::NodeHandle nl(n);
+  replay_request_sub_ =
+      nl.subscribe("keyed_scan_replay_request",
+                   10,
+                   &LampBase::KeyedScanReplayRequestCallback,
+                   this);
+  replay_timer_ = nl.createTimer(ros::Duration(replay_period_),
+                                 &LampBase::KeyedScanReplayTimerCallback,
+                                 this);
+}
+
+void LampBase::QueueKeyedScanReplay(std::vector<gtsam::Symbol> keys,
+                                    bool b_front) {
+  if (replay_order_ == ReplayOrder::RECENT) {
+    // Newest first, keys without a stamp last
+    std::vector<std::pair<ros::Time, gtsam::Symbol>> stamped;
+    stamped.reserve(keys.size());
+    for (const gtsam::Symbol& key : keys) {
+      auto stamp = pose_graph_.keyed_stamps.Find(key);
+      stamped.emplace_back(stamp ? *stamp : ros::Time(), key);
+    }
+    std::stable_sort(stamped.begin(),
+                     stamped.end(),
+                     [](const std::pair<ros::Time, gtsam::Symbol>& a,
+                        const std::pair<ros::Time, gtsam::Symbol>& b) {
+                       return a.first > b.first;
+                     });
+    for (size_t i = 0; i < keys.size(); i++)
+      keys[i] = stamped[i].second;
+  } else if (replay_order_ == ReplayOrder::NEAR_ROBOTS) {
+    // Closest to where any robot last was first, where loop closures with
+    // new scans are most likely
+    std::set<unsigned char> prefixes;
+    for (const gtsam::Symbol& key : keys) {
+      if (lamp_utils::IsRobotPrefix(key.chr()))
+        prefixes.insert(key.chr());
+    }
+    std::vector<gtsam::Point3> robots;
+    for (unsigned char prefix : prefixes)
+      robots.push_back(pose_graph_.LastPose(prefix).translation());
+    std::vector<std::pair<double, gtsam::Symbol>> distances;
+    distances.reserve(keys.size());
+    for (const gtsam::Symbol& key : keys) {
+      double distance = std::numeric_limits<double>::max();
+      if (pose_graph_.HasKey(key)) {
+        const gtsam::Point3 position = pose_graph_.GetPose(key).translation();
+        for (const gtsam::Point3& robot : robots)
+          distance = std::min(distance, (position - robot).norm());
+      }
+      distances.emplace_back(distance, key);
+    }
+    std::stable_sort(distances.begin(),
+                     distances.end(),
+                     [](const std::pair<double, gtsam::Symbol>& a,
+                        const std::pair<double, gtsam::Symbol>& b) {
+                       return a.first < b.first;
+                     });
+    for (size_t i = 0; i < keys.size(); i++)
+      keys[i] = distances[i].second;
+  }
+
+  if (b_front) {
+    for (auto it = keys.rbegin(); it != keys.rend(); it++) {
+      replay_queued_.insert(*it);
+      replay_keys_.push_front(*it);
+    }
+    return;
+  }
+  for (const gtsam::Symbol& key : keys) {
+    if (replay_queued_.insert(key).second)
+      replay_keys_.push_back(key);
+  }
+}
+
+void LampBase::KeyedScanReplayRequestCallback(
+    const pose_graph_msgs::KeyedScanRequest::ConstPtr& msg) {
+  if (msg->keys.empty()) {
+    PublishAllKeyedScans();
+    return;
+  }
+  std::vector<gtsam::Symbol> keys;
+  keys.reserve(msg->keys.size());
+  for (const gtsam::Key& key : msg->keys) {
+    if (pose_graph_.HasScan(key))
+      keys.push_back(key);
+  }
+  ROS_INFO("Replaying %lu of %lu requested keyed scans",
+           keys.size(),
+           msg->keys.size());
+  QueueKeyedScanReplay(keys, true);
+}
+
+void LampBase::KeyedScanReplayTimerCallback(const ros::TimerEvent& ev) {
+  static auto& replayed_bytes =
+      lamp_utils::MetricsRegistry::Instance().GetCounter(
+          "lamp.keyed_scan_replay.bytes");
+  static auto& queued = lamp_utils::MetricsRegistry::Instance().GetGauge(
+      "lamp.keyed_scan_replay.queued");
+
+  replay_budget_.Refill(ev.current_real.toSec());
+  // At least one scan per tick, a scan larger than the budget would stall
+  // the replay otherwise
+  bool b_sent = false;
+  while (!replay_keys_.empty() && (!b_sent || replay_budget_.budget() > 0)) {
+    const gtsam::Symbol key = replay_keys_.front();
+    replay_keys_.pop_front();
+    if (replay_queued_.erase(key) == 0)
+      continue;
+    size_t bytes = 0;
+    if (!PublishKeyedScan(key, &bytes))
+      continue;
+    replay_budget_.Charge(bytes);
+    replayed_bytes.Increment(bytes);
+    b_sent = true;
+  }
+  queued.Set(replay_keys_.size());
+}
+
+bool LampBase::KeyedScansService(
+    pose_graph_msgs::KeyedScans::Request& request,
+    pose_graph_msgs::KeyedScans::Response& response) {
+  response.scans.reserve(request.keys.size());
+  for (const gtsam::Key& key : request.keys) {
+    const PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(key);
+    if (scan == nullptr)
+      continue;
+    response.scans.emplace_back();
+    response.scans.back().key = key;
+    lamp_utils::ToRosMsg(*scan, &response.scans.back().scan);
+  }
+  return true;
+}
+
+bool LampBase::StartCheckpointing(const ros::NodeHandle& n) {
+  ros::NodeHandle nl(n);
+  bool b_restored = false;
+  if (b_restore_checkpoint_ && boost::filesystem::exists(checkpoint_file_)) {
+    ROS_INFO_STREAM("Restoring session from " << checkpoint_file_);
+    if (pose_graph_.Load(checkpoint_file_)) {
+      b_restored = true;
+      b_has_new_factor_ = true;
+      // Map and downstream nodes get the scans in the background
+      restore_scan_keys_ = pose_graph_.GetKeyedScanKeys();
+      restore_scan_index_ = 0;
+      restore_scans_timer_ = nl.createTimer(
+          update_rate_, &LampBase::RestoreScansTimerCallback, this);
+    } else {
+      ROS_ERROR_STREAM("Failed to restore session from " << checkpoint_file_
+                                                         << ", starting anew");
+      pose_graph_.Reset();
+    }
+  }
+
+  if (b_checkpoint_) {
+    checkpoint_timer_ = nl.createTimer(ros::Duration(checkpoint_period_),
+                                       &LampBase::CheckpointTimerCallback,
+                                       this);
+  }
+  return b_restored;
+}
+
+void LampBase::CheckpointTimerCallback(const ros::TimerEvent& ev) {
+  if (pose_graph_.GetValues().size() == 0)
+    return;
+  // Skipped while the previous checkpoint is still waiting
+  if (!save_stage_.TryPush(SaveTask(pose_graph_.Snapshot(), checkpoint_file_)))
+    ROS_WARN("Previous checkpoint still pending, skipping this one");
+}
+
+void LampBase::QueueSave(const std::string& filename) {
+  save_stage_.Push(SaveTask(pose_graph_.Snapshot(), filename));
+}
+
+lamp_utils::PipelineStage::Task
+LampBase::SaveTask(const std::shared_ptr<const PoseGraph>& graph,
+                   const std::string& filename) const {
+  return [graph, filename] {
+    if (!graph->CheckGraphValid())
+      return;
+    // Only the scans added since the last save to the file are written
+    if (!graph->Save(filename))
+      ROS_WARN_STREAM("Failed to save session to " << filename);
+  };
+}
+
+void LampBase::RestoreScansTimerCallback(const ros::TimerEvent& ev) {
+  const size_t end =
+      std::min(restore_scan_keys_.size(),
+               restore_scan_index_ + std::max(1, restore_scans_per_tick_));
+  for (; restore_scan_index_ < end; restore_scan_index_++) {
+    const gtsam::Symbol key = restore_scan_keys_[restore_scan_index_];
+    if (pose_graph_.HasKey(key))
+      AddTransformedPointCloudToMap(key);
+    PublishKeyedScan(key);
+  }
+  b_has_new_scan_ = true;
 
-    ros::Duration(0.01).sleep();
+  if (restore_scan_index_ == restore_scan_keys_.size()) {
+    ROS_INFO("Restored %lu keyed scans", restore_scan_keys_.size());
+    restore_scan_keys_.clear();
+    restore_scan_index_ = 0;
+    restore_scans_timer_.stop();
   }
 }
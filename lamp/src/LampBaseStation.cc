@@ -6,6 +6,14 @@
 
 // Includes
 #include <lamp/LampBaseStation.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudPool.h>
+#include <lamp_utils/ScanCompression.h>
+#include <lamp_utils/ThreadGovernor.h>
+#include <lamp_utils/Tracing.h>
+
+#include <algorithm>
 
 // #include <math.h>
 // #include <ctime>
@@ -23,7 +31,10 @@ LampBaseStation::LampBaseStation()
 }
 
 // Destructor
-LampBaseStation::~LampBaseStation() {}
+LampBaseStation::~LampBaseStation() {
+  // Queued saves use the members of this class
+  save_stage_.Stop();
+}
 
 // Initialization - override for Base Station Setup
 bool LampBaseStation::Initialize(const ros::NodeHandle& n) {
@@ -58,10 +69,28 @@ bool LampBaseStation::Initialize(const ros::NodeHandle& n) {
     ROS_ERROR("%s: Failed to initialize handlers.", name_.c_str());
     return false;
   }
+
+  // Saves and checkpoints are written in the background
+  save_stage_.Start();
+
+  // Resume a saved session, the optimizer restarts from the restored graph
+  if (StartCheckpointing(n)) {
+    PublishPoseGraph();
+    std_msgs::Bool signal;
+    signal.data = true;
+    lamp_pgo_reset_pub_.publish(signal);
+    PublishPoseGraphForOptimizer();
+  }
   return true;
 }
 
 bool LampBaseStation::LoadParameters(const ros::NodeHandle& n) {
+  // Thread groups, before the parameters sizing them
+  if (!lamp_utils::ThreadGovernor::Instance().LoadParameters(n))
+    return false;
+  if (!lamp_utils::MemoryAccountant::Instance().LoadParameters(n))
+    return false;
+
   // Names of all robots for base station to subscribe to
   if (!pu::Get("robot_names", robot_names_)) {
     ROS_ERROR("%s: No robot names provided to base station.", name_.c_str());
@@ -75,6 +104,8 @@ bool LampBaseStation::LoadParameters(const ros::NodeHandle& n) {
   // TODO : separate rate for base and robot
   if (!pu::Get("rate/update_rate", update_rate_))
     return false;
+  if (!pu::Get("rate/b_wake_on_data", b_wake_on_data_))
+    return false;
 
   // Fixed precisions
   // TODO - eventually remove the need to use this
@@ -83,6 +114,49 @@ bool LampBaseStation::LoadParameters(const ros::NodeHandle& n) {
     return false;
   }
 
+  // Map update settings
+  if (!SetMapUpdateParameters()) {
+    ROS_ERROR("SetMapUpdateParameters failed");
+    return false;
+  }
+
+  // Incremental pose graph delta encoding
+  if (!SetDeltaPublicationParameters()) {
+    ROS_ERROR("SetDeltaPublicationParameters failed");
+    return false;
+  }
+
+  // Session checkpoints
+  if (!SetCheckpointParameters()) {
+    ROS_ERROR("SetCheckpointParameters failed");
+    return false;
+  }
+
+  // Keyed scan replay to downstream nodes
+  if (!SetKeyedScanReplayParameters()) {
+    ROS_ERROR("SetKeyedScanReplayParameters failed");
+    return false;
+  }
+
+  // Map of a former session to relocalize against
+  if (!SetPriorMapParameters()) {
+    ROS_ERROR("SetPriorMapParameters failed");
+    return false;
+  }
+
+  // Requests for missing keyed scans
+  if (!SetScanRequestParameters()) {
+    ROS_ERROR("SetScanRequestParameters failed");
+    return false;
+  }
+
+  // Extrapolation of the robot poses to the time they are published
+  if (!pu::Get("robot_pose_prediction/b_enabled", b_predict_robot_poses_))
+    return false;
+  if (!pu::Get("robot_pose_prediction/min_confidence",
+               min_robot_pose_confidence_))
+    return false;
+
   // Initialize frame IDs
   pose_graph_.fixed_frame_id = "world";
 
@@ -123,6 +197,17 @@ bool LampBaseStation::RegisterCallbacks(const ros::NodeHandle& n) {
   // Uncomment when needed for debugging
   debug_sub_ = nl.subscribe("debug", 1, &LampBaseStation::DebugCallback, this);
 
+  map_resync_sub_ = nl.subscribe("map_resync",
+                                 1,
+                                 &LampBaseStation::MapResyncCallback,
+                                 dynamic_cast<LampBase*>(this));
+
+  StartKeyedScanReplay(n);
+  keyed_scans_srv_ =
+      nl.advertiseService("get_keyed_scans",
+                          &LampBaseStation::KeyedScansService,
+                          dynamic_cast<LampBase*>(this));
+
   return true;
 }
 
@@ -137,6 +222,10 @@ bool LampBaseStation::CreatePublishers(const ros::NodeHandle& n) {
   pose_graph_to_optimize_pub_ = nl.advertise<pose_graph_msgs::PoseGraph>(
       "pose_graph_to_optimize", 10, true);
   lamp_pgo_reset_pub_ = nl.advertise<std_msgs::Bool>("reset_pgo", 10, true);
+  if (b_incremental_map_publish_) {
+    map_incremental_pub_ =
+        nl.advertise<PointCloud>("octree_map_incremental", 10, false);
+  }
 
   // Robot pose publishers
   ros::Publisher pose_pub_;
@@ -144,12 +233,36 @@ bool LampBaseStation::CreatePublishers(const ros::NodeHandle& n) {
     pose_pub_ = nl.advertise<geometry_msgs::PoseStamped>(
         "/" + robot + "/lamp/pose_base", 10, false);
     publishers_pose_[lamp_utils::GetRobotPrefix(robot)] = pose_pub_;
+    scan_request_pubs_[lamp_utils::GetRobotPrefix(robot)] =
+        nl.advertise<pose_graph_msgs::KeyedScanRequest>(
+            "/" + robot + "/lamp/keyed_scan_request", 10, false);
   }
 
   return true;
 }
 
+bool LampBaseStation::SetScanRequestParameters() {
+  if (!pu::Get("scan_requests/b_enabled", b_scan_requests_))
+    return false;
+  if (!pu::Get("scan_requests/period", scan_request_period_))
+    return false;
+  if (!pu::Get("scan_requests/missing_delay", missing_scan_delay_))
+    return false;
+  if (!pu::Get("scan_requests/max_keys", max_requested_scans_))
+    return false;
+  if (!pu::Get("scan_requests/max_attempts", max_scan_request_attempts_))
+    return false;
+
+  return true;
+}
+
 bool LampBaseStation::InitializeHandlers(const ros::NodeHandle& n) {
+  // Set before the handlers subscribe and start their threads
+  const auto wake = [this]() { WakeProcessing(); };
+  manual_loop_closure_handler_.SetWakeCallback(wake);
+  pose_graph_handler_.SetWakeCallback(wake);
+  robot_pose_handler_.SetWakeCallback(wake);
+
   // Manual loop closure handler
   if (!manual_loop_closure_handler_.Initialize(n)) {
     ROS_ERROR("%s: Failed to initialize the manual loop closure handler.",
@@ -175,8 +288,12 @@ bool LampBaseStation::InitializeHandlers(const ros::NodeHandle& n) {
 }
 
 void LampBaseStation::ProcessTimerCallback(const ros::TimerEvent& ev) {
+  static lamp_utils::Histogram& process_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram("lamp.process_ms");
+  lamp_utils::ScopedLatency latency(process_ms);
   // Check the handlers
   CheckHandlers();
+  UpdateMemoryAccounts();
 
   if (!pose_graph_.CheckGraphValid()) {
     double time_since_last_update =
@@ -203,54 +320,53 @@ void LampBaseStation::ProcessTimerCallback(const ros::TimerEvent& ev) {
 
   if (b_has_new_scan_) {
     mapper_->PublishMapInfo();
-    mapper_->PublishMap();
+    // The full map only goes out after remaps (see UpdateMapPointCloud) and
+    // on map_resync
+    if (b_incremental_map_publish_)
+      QueueMapIncrementPublish();
+    else
+      mapper_->PublishMap();
 
     b_has_new_scan_ = false;
   }
 
+  if (b_scan_requests_ &&
+      (ros::Time::now() - last_scan_request_time_).toSec() >
+          scan_request_period_) {
+    RequestMissingScans();
+    last_scan_request_time_ = ros::Time::now();
+  }
+
   last_pg_update_time_ = ros::Time::now();
   // Publish anything that is needed
 }
 
-bool LampBaseStation::ProcessPoseGraphData(std::shared_ptr<FactorData> data) {
+bool LampBaseStation::ProcessPoseGraphData(const PoseGraphData& pose_graph_data) {
+  lamp_utils::TraceSpan span("base.pose_graph");
   // ROS_INFO_STREAM("In ProcessPoseGraphData");
 
-  // Extract pose graph data
-  std::shared_ptr<PoseGraphData> pose_graph_data =
-      std::dynamic_pointer_cast<PoseGraphData>(data);
-
   // Check if there are new pose graphs
-  if (!pose_graph_data->b_has_data) {
+  if (!pose_graph_data.b_has_data) {
     return false;
   }
 
   ROS_DEBUG_STREAM("New data received at base: "
-                  << pose_graph_data->graphs.size() << " graphs, "
-                  << pose_graph_data->scans.size() << " scans ");
+                  << pose_graph_data.graphs.size() << " graphs, "
+                  << pose_graph_data.scans.size() + pose_graph_data.clouds.size()
+                  << " scans ");
   b_has_new_factor_ = true;
 
-  pose_graph_msgs::PoseGraph::Ptr graph_ptr;
-
-  gtsam::Values new_values;
+  // Merge all graphs received since the last tick into the internal pose
+  // graph in one batch
+  if (!pose_graph_data.graphs.empty()) {
+    merger_.MergeFastGraphs(pose_graph_data.graphs, &pose_graph_);
+  }
 
-  for (auto g : pose_graph_data->graphs) {
+  for (auto g : pose_graph_data.graphs) {
     ROS_DEBUG_STREAM("LampBase new graph with "
                      << g->nodes.size() << " nodes and " << g->edges.size()
                      << " edges");
 
-    // Register new data - this will cause pose graph to publish
-    b_has_new_factor_ = true;
-
-    // Merge the current (slow) graph before processing incoming graphs
-    merger_.OnSlowGraphMsg(pose_graph_.ToMsg());
-    merger_.OnFastGraphMsg(g);
-
-    // Update the internal pose graph using the merger output
-    pose_graph_msgs::PoseGraphConstPtr fused_graph(
-        new pose_graph_msgs::PoseGraph(merger_.GetCurrentGraph()));
-    // ROS_INFO_STREAM("Fused Graph: UpdateFromMsg");
-    pose_graph_.UpdateFromMsg(fused_graph);
-
     // Check for new loop closure edges
     for (pose_graph_msgs::PoseGraphEdge e : g->edges) {
       // Optimize on loop closures, IMU factors and artifact loop closures
@@ -287,15 +403,15 @@ bool LampBaseStation::ProcessPoseGraphData(std::shared_ptr<FactorData> data) {
   ROS_DEBUG_STREAM("Keyed stamps: " << pose_graph_.keyed_stamps.size());
 
   // Update from stored keyed scans
-  for (auto s : pose_graph_data->scans) {
+  for (auto s : pose_graph_data.scans) {
     // Register new data - this will cause map to publish
     b_has_new_scan_ = true;
 
     // Create new PCL pointer
-    PointCloud::Ptr scan_ptr(new PointCloud);
+    PointCloud::Ptr scan_ptr = lamp_utils::PointCloudPool::Instance().Acquire();
 
     // Copy from ROS to PCL
-    pcl::fromROSMsg(s->scan, *scan_ptr);
+    lamp_utils::KeyedScanMsgToScan(*s, scan_ptr.get());
 
     pose_graph_.InsertKeyedScan(s->key,
                                 scan_ptr); // TODO: add overloaded function
@@ -307,12 +423,120 @@ bool LampBaseStation::ProcessPoseGraphData(std::shared_ptr<FactorData> data) {
                                                      << " points");
   }
 
+  // Scans already converted by the handler workers
+  bool b_replaced_map_scan = false;
+  for (const auto& c : pose_graph_data.clouds) {
+    b_has_new_scan_ = true;
+    if (coarse_scan_keys_.erase(c.first) && pose_graph_.HasScan(c.first)) {
+      // Full resolution scan replacing the downsampled one
+      pose_graph_.keyed_scans[c.first] = c.second;
+      b_replaced_map_scan = true;
+      continue;
+    }
+    pose_graph_.InsertKeyedScan(c.first, c.second);
+    keyed_scan_candidates_.push_back(c.first);
+  }
+  for (const auto& key : pose_graph_data.coarse_keys) {
+    coarse_scan_keys_.insert(key);
+  }
+  if (b_replaced_map_scan) {
+    ReGenerateMapPointCloud();
+  }
+
+  // Levels of detail of scans already received coarse
+  for (const auto& r : pose_graph_data.scan_refinements) {
+    b_has_new_scan_ = true;
+    AddScanRefinement(r.first, r.second);
+  }
+  for (const auto& key : pose_graph_data.complete_keys) {
+    coarse_scan_keys_.erase(key);
+  }
+
   // Go through the candidates to add to the map'
   AddKeyedScanCandidatesToMap();
 
   return true;
 }
 
+void LampBaseStation::RequestMissingScans() {
+  ros::Time now = ros::Time::now();
+  std::map<char, pose_graph_msgs::KeyedScanRequest> requests;
+  auto request = [&](gtsam::Key key) {
+    int& attempts = scan_request_attempts_[key];
+    auto& keys = requests[gtsam::Symbol(key).chr()].keys;
+    if (attempts >= max_scan_request_attempts_ ||
+        keys.size() >= static_cast<size_t>(max_requested_scans_))
+      return;
+    keys.push_back(key);
+    attempts++;
+  };
+
+  // Scans that were only received downsampled
+  for (const auto& key : coarse_scan_keys_) {
+    request(key);
+  }
+
+  // Robot nodes whose scan never arrived
+  pose_graph_.keyed_stamps.ForEach(
+      [&](gtsam::Key key, const ros::Time& stamp) {
+        if (!lamp_utils::IsRobotPrefix(gtsam::Symbol(key).chr()) ||
+            (now - stamp).toSec() < missing_scan_delay_ ||
+            pose_graph_.HasScan(key))
+          return;
+        request(key);
+      });
+
+  static lamp_utils::Counter& requested_scans =
+      lamp_utils::MetricsRegistry::Instance().GetCounter(
+          "lamp.requested_scans");
+  for (auto& kv : requests) {
+    auto pub = scan_request_pubs_.find(kv.first);
+    if (pub == scan_request_pubs_.end() || kv.second.keys.empty())
+      continue;
+    requested_scans.Increment(kv.second.keys.size());
+    ROS_DEBUG_STREAM("Requesting " << kv.second.keys.size()
+                                   << " keyed scans from robot " << kv.first);
+    kv.second.header.stamp = now;
+    pub->second.publish(kv.second);
+  }
+}
+
+void LampBaseStation::AddScanRefinement(const gtsam::Symbol& key,
+                                        const PointCloud::ConstPtr& points) {
+  PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(key);
+  if (scan == nullptr) {
+    // The coarse layer was lost, start the scan from the refinement
+    pose_graph_.InsertKeyedScan(key, points);
+    keyed_scan_candidates_.push_back(key);
+    return;
+  }
+  PointCloud::Ptr refined(new PointCloud(*scan));
+  *refined += *points;
+  pose_graph_.keyed_scans[key] = refined;
+
+  // Not in the map yet, added whole with the candidates
+  if (std::find(keyed_scan_candidates_.begin(),
+                keyed_scan_candidates_.end(),
+                key) != keyed_scan_candidates_.end())
+    return;
+
+  // Only the new points go into the map, no regeneration
+  Eigen::Matrix4d b2w;
+  if (!GetScanToWorld(key, &b2w))
+    return;
+  PointCloud::Ptr points_world =
+      lamp_utils::PointCloudPool::Instance().Acquire();
+  lamp_utils::TransformPointCloud(*points, b2w, points_world.get());
+  auto map_scan = map_scans_world_.find(key);
+  if (map_scan != map_scans_world_.end()) {
+    PointCloud::Ptr merged =
+        lamp_utils::PointCloudPool::Instance().Copy(*map_scan->second.points);
+    *merged += *points_world;
+    map_scan->second.points = merged;
+  }
+  InsertIntoMap(points_world);
+}
+
 void LampBaseStation::AddKeyedScanCandidatesToMap() {
   // Loop through list of candidates
   auto key_it = keyed_scan_candidates_.begin();
@@ -336,19 +560,35 @@ void LampBaseStation::AddKeyedScanCandidatesToMap() {
   ROS_DEBUG_STREAM("Added " << scan_count << " scans to the map.");
 }
 
-bool LampBaseStation::ProcessRobotPoseData(std::shared_ptr<FactorData> data) {
-  // Extract pose graph data
-  std::shared_ptr<RobotPoseData> pose_data =
-      std::dynamic_pointer_cast<RobotPoseData>(data);
-
-  // Check if there are new pose graphs
-  if (!pose_data->b_has_data) {
+bool LampBaseStation::ProcessRobotPoseData(const RobotPoseData& pose_data) {
+  // Predicted poses move on without new data
+  if (!pose_data.b_has_data && !b_predict_robot_poses_) {
     return false;
   }
 
-  for (auto pair : pose_data->poses) {
-    char robot = lamp_utils::GetRobotPrefix(pair.first);
-    gtsam::Pose3 pose = pair.second.pose;
+  const ros::Time now = ros::Time::now();
+  for (const std::string& robot_name : robot_names_) {
+    PoseData robot_pose;
+    lamp_utils::PosePrediction prediction;
+    auto received = pose_data.poses.find(robot_name);
+    if (b_predict_robot_poses_ &&
+        robot_pose_handler_.PredictPose(robot_name, now, &prediction) &&
+        prediction.confidence >= min_robot_pose_confidence_) {
+      robot_pose.stamp = prediction.stamp;
+      robot_pose.pose = prediction.pose;
+    } else if (received != pose_data.poses.end()) {
+      robot_pose = received->second;
+    } else {
+      continue;
+    }
+    if (b_predict_robot_poses_) {
+      lamp_utils::MetricsRegistry::Instance()
+          .GetGauge("lamp.robot_pose_confidence." + robot_name)
+          .Set(prediction.confidence);
+    }
+
+    char robot = lamp_utils::GetRobotPrefix(robot_name);
+    gtsam::Pose3 pose = robot_pose.pose;
 
     if (latest_node_pose_.count(robot)) {
       gtsam::Pose3 last_pose_base = pose_graph_.LastPose(robot);
@@ -361,7 +601,7 @@ bool LampBaseStation::ProcessRobotPoseData(std::shared_ptr<FactorData> data) {
       geometry_msgs::PoseStamped msg;
       msg.pose = lamp_utils::GtsamToRosMsg(new_pose);
       msg.header.frame_id = pose_graph_.fixed_frame_id;
-      msg.header.stamp = pair.second.stamp;
+      msg.header.stamp = robot_pose.stamp;
 
       publishers_pose_[robot].publish(msg);
     }
@@ -370,18 +610,23 @@ bool LampBaseStation::ProcessRobotPoseData(std::shared_ptr<FactorData> data) {
 }
 
 bool LampBaseStation::ProcessManualLoopClosureData(
-    std::shared_ptr<FactorData> data) {
-  // Extract loop closure data
-  std::shared_ptr<LoopClosureData> manual_loop_closure_data =
-      std::dynamic_pointer_cast<LoopClosureData>(data);
-
-  if (!manual_loop_closure_data->b_has_data) {
+    const LoopClosureData& manual_loop_closure_data) {
+  if (!manual_loop_closure_data.b_has_data) {
     return false;
   }
 
-  ROS_INFO_STREAM("Received new manual loop closure data");
-
-  for (auto factor : manual_loop_closure_data->factors) {
+  ROS_INFO_STREAM("Received " << manual_loop_closure_data.factors.size()
+                              << " manual loop closures");
+
+  // Everything received is added before the single optimization of this
+  // update, loop closures to keys not in the graph are dropped
+  size_t num_missing = 0;
+  for (const auto& factor : manual_loop_closure_data.factors) {
+    if (!pose_graph_.HasKey(factor.key_from) ||
+        !pose_graph_.HasKey(factor.key_to)) {
+      num_missing++;
+      continue;
+    }
     pose_graph_.TrackFactor(factor.key_from,
                             factor.key_to,
                             pose_graph_msgs::PoseGraphEdge::LOOPCLOSE,
@@ -390,6 +635,11 @@ bool LampBaseStation::ProcessManualLoopClosureData(
 
     b_run_optimization_ = true;
   }
+  if (num_missing > 0) {
+    ROS_WARN_STREAM("Dropped " << num_missing
+                               << " manual loop closures to keys not in the "
+                                  "pose graph");
+  }
 
   return true;
 }
@@ -397,13 +647,16 @@ bool LampBaseStation::ProcessManualLoopClosureData(
 // Check for data from all of the handlers
 bool LampBaseStation::CheckHandlers() {
   // Check for pose graphs from the robots
-  ProcessPoseGraphData(pose_graph_handler_.GetData());
+  pose_graph_handler_.GetData(&pose_graph_data_);
+  ProcessPoseGraphData(pose_graph_data_);
 
   // Check for manual loop closures
-  ProcessManualLoopClosureData(manual_loop_closure_handler_.GetData());
+  manual_loop_closure_handler_.GetData(&manual_loop_closure_data_);
+  ProcessManualLoopClosureData(manual_loop_closure_data_);
 
   // Check for poses
-  ProcessRobotPoseData(robot_pose_handler_.GetData());
+  robot_pose_handler_.GetData(&robot_pose_data_);
+  ProcessRobotPoseData(robot_pose_data_);
 
   return true;
 }
@@ -445,15 +698,18 @@ void LampBaseStation::DebugCallback(const std_msgs::String msg) {
     mapper_->PublishMapFrozen();
   }
 
-  // Save the pose graph
+  // Save the pose graph in the background. Without a filename a
+  // checkpointed session is flushed to its checkpoint
   else if (cmd == "save") {
     ROS_INFO_STREAM("Saving the pose graph");
 
     // Use filename if provided
     if (data.size() >= 2) {
-      pose_graph_.Save(data[1]);
+      QueueSave(data[1]);
+    } else if (b_checkpoint_) {
+      QueueSave(checkpoint_file_);
     } else {
-      pose_graph_.Save("saved_pose_graph.zip");
+      QueueSave("saved_pose_graph.zip");
     }
   }
 
@@ -473,9 +729,9 @@ void LampBaseStation::DebugCallback(const std_msgs::String msg) {
     ReGenerateMapPointCloud();
     ROS_INFO_STREAM("Done regenerating Map Pointcloud");
 
-    PublishAllKeyedScans(); // So the loop closure module has all the keyed
-                            // scans
-    ROS_INFO_STREAM("Done publishing keyed scans");
+    // So the loop closure module has all the keyed scans, replayed in the
+    // background
+    PublishAllKeyedScans();
   }
 
   else if (msg.data == "optimize") {
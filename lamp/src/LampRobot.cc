@@ -14,7 +14,14 @@
 
 // Includes
 #include <lamp/LampRobot.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/ObservabilityCache.h>
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudPool.h>
 #include <lamp_utils/PointCloudUtils.h>
+#include <lamp_utils/ThreadGovernor.h>
+#include <lamp_utils/Tracing.h>
 
 // #include <math.h>
 // #include <ctime>
@@ -40,7 +47,12 @@ LampRobot::LampRobot() : b_init_pg_pub_(false), init_count_(0) {
 }
 
 // Destructor
-LampRobot::~LampRobot() {}
+LampRobot::~LampRobot() {
+  // Queued tasks use the members of this class
+  map_stage_.Stop();
+  output_stage_.Stop();
+  save_stage_.Stop();
+}
 
 // Initialization - override for robot specific setup
 bool LampRobot::Initialize(const ros::NodeHandle& n) {
@@ -76,13 +88,28 @@ bool LampRobot::Initialize(const ros::NodeHandle& n) {
     return false;
   }
 
+  // Map, output and save stages off the update loop
+  if (b_pipeline_) {
+    map_stage_.Start();
+    output_stage_.Start();
+    save_stage_.Start();
+  }
+
   return true;
 }
 
 bool LampRobot::LoadParameters(const ros::NodeHandle& n) {
+  // Thread groups, before the parameters sizing them
+  if (!lamp_utils::ThreadGovernor::Instance().LoadParameters(n))
+    return false;
+  if (!lamp_utils::MemoryAccountant::Instance().LoadParameters(n))
+    return false;
+
   // Rates
   if (!pu::Get("rate/update_rate", update_rate_))
     return false;
+  if (!pu::Get("rate/b_wake_on_data", b_wake_on_data_))
+    return false;
   if (!pu::Get("init_wait_time", init_wait_time_))
     return false;
   if (!pu::Get("repub_first_wait_time", repub_first_wait_time_))
@@ -138,6 +165,48 @@ bool LampRobot::LoadParameters(const ros::NodeHandle& n) {
     return false;
   }
 
+  // Map update settings
+  if (!SetMapUpdateParameters()) {
+    ROS_ERROR("SetMapUpdateParameters failed");
+    return false;
+  }
+
+  // Incremental pose graph delta encoding
+  if (!SetDeltaPublicationParameters()) {
+    ROS_ERROR("SetDeltaPublicationParameters failed");
+    return false;
+  }
+
+  // Bandwidth scheduling
+  if (!SetSendSchedulerParameters(n)) {
+    ROS_ERROR("SetSendSchedulerParameters failed");
+    return false;
+  }
+
+  // Keyed scan encoding
+  if (!SetScanCompressionParameters()) {
+    ROS_ERROR("SetScanCompressionParameters failed");
+    return false;
+  }
+
+  // Keyframes while standing still
+  if (!SetStationarySuppressionParameters()) {
+    ROS_ERROR("SetStationarySuppressionParameters failed");
+    return false;
+  }
+
+  // Marginalization of old odometry nodes
+  if (!SetSparsificationParameters()) {
+    ROS_ERROR("SetSparsificationParameters failed");
+    return false;
+  }
+
+  // Processing stages
+  if (!SetPipelineParameters()) {
+    ROS_ERROR("SetPipelineParameters failed");
+    return false;
+  }
+
   // Set the initial key - to get the right symbol
   if (!SetInitialKey()) {
     ROS_ERROR("SetInitialKey failed");
@@ -190,6 +259,18 @@ bool LampRobot::RegisterCallbacks(const ros::NodeHandle& n) {
                                          &LampRobot::LaserLoopClosureCallback,
                                          dynamic_cast<LampBase*>(this));
 
+  pose_graph_resync_sub_ = nl.subscribe("pose_graph_resync",
+                                        1,
+                                        &LampRobot::PoseGraphResyncCallback,
+                                        dynamic_cast<LampBase*>(this));
+
+  if (b_send_scheduler_) {
+    link_quality_sub_ = nl.subscribe(
+        "silvus_raw", 10, &LampRobot::LinkQualityCallback, this);
+    keyed_scan_request_sub_ = nl.subscribe(
+        "keyed_scan_request", 10, &LampRobot::KeyedScanRequestCallback, this);
+  }
+
   return true;
 }
 
@@ -205,10 +286,21 @@ bool LampRobot::CreatePublishers(const ros::NodeHandle& n) {
       "pose_graph_to_optimize", 10, true);
   keyed_scan_pub_ =
       nl.advertise<pose_graph_msgs::KeyedScan>("keyed_scans", 10, true);
+  keyed_scan_coarse_pub_ = nl.advertise<pose_graph_msgs::KeyedScan>(
+      "keyed_scans_coarse", 10, true);
+  keyed_scan_layer_pub_ = nl.advertise<pose_graph_msgs::KeyedScanLayer>(
+      "keyed_scan_layers", 10, true);
 
   // Publishers
   pose_pub_ = nl.advertise<geometry_msgs::PoseStamped>("lamp_pose", 10, false);
 
+  // Map published from the snapshot taken on the map stage, on the topic of
+  // the mapper
+  if (b_pipeline_) {
+    map_snapshot_pub_ = nl.advertise<PointCloud>("octree_map", 1, true);
+    b_publish_map_snapshot_ = true;
+  }
+
   return true;
 }
 
@@ -314,6 +406,10 @@ bool LampRobot::InitializeGraph(
 }
 
 bool LampRobot::InitializeHandlers(const ros::NodeHandle& n) {
+  const auto wake = [this]() { WakeProcessing(); };
+  odometry_handler_.SetWakeCallback(wake);
+  stationary_handler_.SetWakeCallback(wake);
+
   if (!odometry_handler_.Initialize(n)) {
     ROS_ERROR("%s: Failed to initialize the odometry handler.", name_.c_str());
     return false;
@@ -335,23 +431,90 @@ bool LampRobot::CheckHandlers() {
   bool b_have_odom_factors;
   // bool b_have_loop_closure;
 
-  // Check the odom for adding new poses
-  b_have_odom_factors = ProcessOdomData(odometry_handler_.GetData());
+  if (b_stationary_suppression_ && b_add_imu_factors_) {
+    UpdateStationaryMode();
+  }
+
+  // Check the odom for adding new poses, none while standing still
+  if (!b_stationary_mode_) {
+    odometry_handler_.GetData(&odom_data_);
+    b_have_odom_factors = ProcessOdomData(odom_data_);
+  }
 
-  if (b_add_imu_factors_ && stationary_handler_.has_data_) {
-    // Check if we have moved since the last stationary factor
-    if (stationary_handler_.CheckKeyRecency(pose_graph_.key)) {
+  if (b_add_imu_factors_ && stationary_handler_.HasData()) {
+    if (b_stationary_mode_) {
+      // Long stop, the stop already has its node
+      ProcessStationaryDetections(stationary_anchor_);
+    } else if (stationary_handler_.CheckKeyRecency(pose_graph_.key)) {
+      // Check if we have moved since the last stationary factor
       // Passes, so create a new factor
       // Force new odometry node
-      ProcessOdomData(odometry_handler_.GetData(false));
-      stationary_handler_.SetKeyForImuAttitude(pose_graph_.key - 1);
-      ProcessStationaryData(stationary_handler_.GetData());
+      odometry_handler_.GetData(&odom_data_, false);
+      ProcessOdomData(odom_data_);
+      ProcessStationaryDetections(pose_graph_.key - 1);
     }
   }
   return true;
 }
 
+void LampRobot::UpdateStationaryMode() {
+  const bool b_stationary = stationary_handler_.IsStationary(
+      ros::Time::now(), stationary_status_timeout_);
+  if (b_stationary && !b_stationary_mode_) {
+    EnterStationaryMode();
+  } else if (!b_stationary && b_stationary_mode_) {
+    LeaveStationaryMode();
+  }
+}
+
+void LampRobot::EnterStationaryMode() {
+  // The stop gets a node at its start, unless there is no odometry yet
+  odometry_handler_.GetData(&odom_data_, false);
+  ProcessOdomData(odom_data_);
+  stationary_anchor_ = pose_graph_.key - 1;
+  b_stationary_mode_ = true;
+  ROS_INFO_STREAM("Standing still, holding keyframes at "
+                  << gtsam::DefaultKeyFormatter(stationary_anchor_));
+}
+
+void LampRobot::LeaveStationaryMode() {
+  // The stop is queued before the detector reports moving
+  if (stationary_handler_.HasData()) {
+    ProcessStationaryDetections(stationary_anchor_);
+  }
+
+  // The odometry drifted while standing still, the next node starts from the
+  // stop with zero motion
+  if (odometry_handler_.SkipToLatest() &&
+      odometry_handler_.GetData(&odom_data_, false)) {
+    for (auto& odom_factor : odom_data_.factors) {
+      odom_factor.transform = gtsam::Pose3();
+      odom_factor.covariance = zero_motion_noise_;
+    }
+    ProcessOdomData(odom_data_);
+  }
+  b_stationary_mode_ = false;
+  ROS_INFO_STREAM("Moving again after standing still at "
+                  << gtsam::DefaultKeyFormatter(stationary_anchor_));
+}
+
+void LampRobot::ProcessStationaryDetections(const gtsam::Symbol& key) {
+  stationary_handler_.SetKeyForImuAttitude(key);
+  stationary_handler_.GetData(&imu_data_);
+  ProcessStationaryData(imu_data_);
+}
+
+void LampRobot::ProcessOnWake() {
+  if (b_have_received_first_pg_) {
+    ProcessTimerCallback(ros::TimerEvent());
+  }
+}
+
 void LampRobot::ProcessTimerCallback(const ros::TimerEvent& ev) {
+  static lamp_utils::Histogram& process_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram("lamp.process_ms");
+  lamp_utils::ScopedLatency latency(process_ms);
+  UpdateMemoryAccounts();
   // Print some debug messages
   // ROS_INFO_STREAM("Checking for new data");
 
@@ -364,7 +527,8 @@ void LampRobot::ProcessTimerCallback(const ros::TimerEvent& ev) {
         PublishPoseGraph(true);
 
         // Get a keyed scan
-        PointCloud::Ptr new_scan(new PointCloud);
+        PointCloud::Ptr new_scan =
+            lamp_utils::PointCloudPool::Instance().Acquire();
         // Take away 0.1 from ros::Time::now() so the delay in getting point
         // clouds is accounted for
         if (odometry_handler_.GetKeyedScanAtTime(
@@ -382,7 +546,8 @@ void LampRobot::ProcessTimerCallback(const ros::TimerEvent& ev) {
       PublishPoseGraph(true);
 
       // Publish first point cloud
-      PointCloud::Ptr new_scan(new PointCloud);
+      PointCloud::Ptr new_scan =
+          lamp_utils::PointCloudPool::Instance().Acquire();
       // Take away 0.1 from ros::Time::now() so the delay in getting point
       // clouds is accounted for
       if (odometry_handler_.GetKeyedScanAtTime(
@@ -405,13 +570,18 @@ void LampRobot::ProcessTimerCallback(const ros::TimerEvent& ev) {
   // Check the handlers
   CheckHandlers();
 
+  // Thin out the old part of the chain
+  if (sparsification_params_.b_enabled) {
+    SparsifyGraph();
+  }
+
   // Publish the pose graph
   if (b_has_new_factor_) {
     ROS_DEBUG("Have new factor, publishing pose-graph");
     PublishPoseGraph();
 
     // Publish the full map (for debug)
-    mapper_->PublishMap();
+    QueueMapPublish();
 
     b_has_new_factor_ = false;
     if (!b_init_pg_pub_) {
@@ -439,7 +609,10 @@ void LampRobot::ProcessTimerCallback(const ros::TimerEvent& ev) {
     b_received_optimizer_update_ = false;
   }
 
-  // Publish anything that is needed
+  // Send the queued scans the link budget allows
+  if (b_send_scheduler_) {
+    ScheduleSends();
+  }
 }
 
 //-------------------------------------------------------------------
@@ -453,13 +626,9 @@ void LampRobot::ProcessTimerCallback(const ros::TimerEvent& ev) {
   \author Benjamin Morrell
   \date 01 Oct 2019
 */
-bool LampRobot::ProcessOdomData(std::shared_ptr<FactorData> data) {
-  // Extract odom data
-  std::shared_ptr<OdomData> odom_data =
-      std::dynamic_pointer_cast<OdomData>(data);
-
+bool LampRobot::ProcessOdomData(const OdomData& odom_data) {
   // Check if there are new factors
-  if (!odom_data->b_has_data) {
+  if (!odom_data.b_has_data) {
     return false;
   }
 
@@ -468,14 +637,15 @@ bool LampRobot::ProcessOdomData(std::shared_ptr<FactorData> data) {
   b_has_new_factor_ = true;
 
   // process data for each new factor
-  for (auto odom_factor : odom_data->factors) {
+  for (auto odom_factor : odom_data.factors) {
     ROS_DEBUG("Adding new odom factor to pose graph");
     // Get the transforms - odom transforms
     Pose3 transform = odom_factor.transform;
     gtsam::SharedNoiseModel covariance =
         odom_factor.covariance; // TODO - check format
 
-    if (b_use_fixed_covariances_) {
+    // The zero motion factor of a stop keeps its noise
+    if (b_use_fixed_covariances_ && !b_stationary_mode_) {
       covariance = SetFixedNoiseModels("odom");
     }
 
@@ -517,12 +687,9 @@ bool LampRobot::ProcessOdomData(std::shared_ptr<FactorData> data) {
     pose_graph_.TrackFactor(prev_key, current_key, type, transform, covariance);
 
     // Get keyed scan from odom handler
-    PointCloud::Ptr new_scan(new PointCloud);
-
     if (odom_factor.b_has_point_cloud) {
       // Store the keyed scan and add it to the map
-      // Copy input scan.
-      new_scan = odom_factor.point_cloud;
+      PointCloud::Ptr new_scan = odom_factor.point_cloud;
 
       if (!new_scan->points.empty() && new_scan != NULL ||
           new_scan->size() != 0) {
@@ -539,21 +706,320 @@ bool LampRobot::ProcessOdomData(std::shared_ptr<FactorData> data) {
 
 void LampRobot::AddKeyedScanAndPublish(PointCloud::Ptr new_scan,
                                        gtsam::Symbol current_key) {
+  lamp_utils::TraceSpan span("robot.keyed_scan", current_key);
+  static lamp_utils::Counter& keyed_scans =
+      lamp_utils::MetricsRegistry::Instance().GetCounter("lamp.keyed_scans");
+  keyed_scans.Increment();
   // Filter and publish scan
   filter_.Filter(*new_scan, new_scan);
+  // Normals sent with the scan are estimated here once, the filter keeps
+  // those of the observability check
+  if (b_compress_scans_ && scan_compression_params_.b_normals) {
+    lamp_utils::EnsureNormals(new_scan);
+  }
+
+  // Shared with the in-process observability consumers
+  lamp_utils::ScanObservability observability;
+  if (filter_.GetObservability(&observability)) {
+    lamp_utils::ObservabilityCache::Instance().Insert(current_key,
+                                                      observability);
+  }
 
   pose_graph_.InsertKeyedScan(current_key, new_scan);
 
   AddTransformedPointCloudToMap(current_key);
 
+  if (b_scan_layers_) {
+    PublishScanLayers(current_key, new_scan);
+    return;
+  }
+
+  // Sent when the link budget allows
+  if (b_send_scheduler_) {
+    QueueKeyedScan(current_key, new_scan, true);
+    return;
+  }
+
   // publish keyed scan
-  pose_graph_msgs::KeyedScan keyed_scan_msg;
-  keyed_scan_msg.key = current_key;
-  // Publish the keyed scans without normals
-  PointXyziCloud::Ptr pub_scan(new PointXyziCloud);
-  lamp_utils::ConvertPointCloud(new_scan, pub_scan);
-  pcl::toROSMsg(*pub_scan, keyed_scan_msg.scan);
-  keyed_scan_pub_.publish(keyed_scan_msg);
+  output_stage_.Push([this, current_key, new_scan] {
+    keyed_scan_pub_.publish(ToKeyedScanMsg(current_key, new_scan));
+  });
+}
+
+bool LampRobot::SetPipelineParameters() {
+  int queue_size = 64;
+  if (!pu::Get("pipeline/b_enabled", b_pipeline_))
+    return false;
+  if (!pu::Get("pipeline/queue_size", queue_size))
+    return false;
+  if (queue_size < 1) {
+    ROS_ERROR("pipeline/queue_size must be positive");
+    return false;
+  }
+  map_stage_.SetCapacity(queue_size);
+  output_stage_.SetCapacity(queue_size);
+  return true;
+}
+
+bool LampRobot::SetSendSchedulerParameters(const ros::NodeHandle& n) {
+  double burst = 0.0;
+  if (!pu::Get("send_scheduler/b_enabled", b_send_scheduler_))
+    return false;
+  if (!pu::Get("send_scheduler/default_rate", default_link_rate_))
+    return false;
+  if (!pu::Get("send_scheduler/burst", burst))
+    return false;
+  if (!pu::Get("send_scheduler/link_fraction", link_fraction_))
+    return false;
+  if (!pu::Get("send_scheduler/link_timeout", link_timeout_))
+    return false;
+  if (!pu::Get("send_scheduler/max_full_scan_delay", max_full_scan_delay_))
+    return false;
+  if (!pu::Get("send_scheduler/coarse_leaf", coarse_scan_leaf_))
+    return false;
+  if (coarse_scan_leaf_ <= 0) {
+    ROS_ERROR("send_scheduler/coarse_leaf must be positive");
+    return false;
+  }
+  if (!pu::Get("scan_layers/b_enabled", b_scan_layers_))
+    return false;
+  if (!pu::Get("scan_layers/num_layers", num_scan_layers_))
+    return false;
+  if (!pu::Get("scan_layers/base_leaf", scan_layer_leaf_))
+    return false;
+  if (num_scan_layers_ < 1 || num_scan_layers_ > 255 ||
+      scan_layer_leaf_ <= 0) {
+    ROS_ERROR("scan_layers needs 1 to 255 layers and a positive base_leaf");
+    return false;
+  }
+
+  send_scheduler_.SetBurst(burst);
+  send_scheduler_.SetRate(default_link_rate_);
+
+  // The robot radio is labelled after the robot namespace
+  std::string robot = ros::names::parentNamespace(n.getNamespace());
+  radio_label_ = "scom-" + robot.substr(robot.find_last_of('/') + 1);
+
+  return true;
+}
+
+bool LampRobot::SetScanCompressionParameters() {
+  if (!pu::Get("scan_compression/b_enabled", b_compress_scans_))
+    return false;
+  if (!pu::Get("scan_compression/position_step",
+               scan_compression_params_.position_step))
+    return false;
+  if (!pu::Get("scan_compression/intensity_step",
+               scan_compression_params_.intensity_step))
+    return false;
+  if (!pu::Get("scan_compression/level", scan_compression_params_.level))
+    return false;
+  if (!pu::Get("scan_compression/b_normals",
+               scan_compression_params_.b_normals))
+    return false;
+  if (scan_compression_params_.position_step <= 0 ||
+      scan_compression_params_.intensity_step <= 0) {
+    ROS_ERROR("scan_compression steps must be positive");
+    return false;
+  }
+  return true;
+}
+
+bool LampRobot::SetStationarySuppressionParameters() {
+  double rotation_sigma, position_sigma;
+  if (!pu::Get("stationary_suppression/b_enabled", b_stationary_suppression_))
+    return false;
+  if (!pu::Get("stationary_suppression/status_timeout",
+               stationary_status_timeout_))
+    return false;
+  if (!pu::Get("stationary_suppression/zero_motion_rotation_sigma",
+               rotation_sigma))
+    return false;
+  if (!pu::Get("stationary_suppression/zero_motion_position_sigma",
+               position_sigma))
+    return false;
+  if (rotation_sigma <= 0 || position_sigma <= 0) {
+    ROS_ERROR("stationary_suppression sigmas must be positive");
+    return false;
+  }
+  gtsam::Vector6 sigmas;
+  sigmas.head<3>().setConstant(rotation_sigma);
+  sigmas.tail<3>().setConstant(position_sigma);
+  zero_motion_noise_ = lamp_utils::NoiseModelCache::Instance().Intern(
+      gtsam::noiseModel::Diagonal::Sigmas(sigmas));
+  return true;
+}
+
+bool LampRobot::SetSparsificationParameters() {
+  if (!pu::Get("sparsification/b_enabled", sparsification_params_.b_enabled))
+    return false;
+  if (!pu::Get("sparsification/min_age", sparsification_params_.min_age))
+    return false;
+  if (!pu::Get("sparsification/max_translation",
+               sparsification_params_.max_translation))
+    return false;
+  if (!pu::Get("sparsification/max_rotation",
+               sparsification_params_.max_rotation))
+    return false;
+  if (!pu::Get("sparsification/check_interval", sparsification_interval_))
+    return false;
+  if (sparsification_params_.min_age < 0 || sparsification_interval_ < 1) {
+    ROS_ERROR("sparsification min_age and check_interval must be positive");
+    return false;
+  }
+  return true;
+}
+
+void LampRobot::SparsifyGraph() {
+  const uint64_t index = GetCurrentKey().index();
+  if (index < sparsified_at_ + sparsification_interval_) {
+    return;
+  }
+  sparsified_at_ = index;
+  const std::vector<gtsam::Key> marginalized = pose_graph_.Sparsify(
+      GetInitialKey().chr(), sparsification_params_);
+  if (!marginalized.empty()) {
+    ROS_INFO_STREAM("Marginalized " << marginalized.size()
+                                    << " odometry nodes");
+    b_has_new_factor_ = true;
+  }
+}
+
+pose_graph_msgs::KeyedScan::Ptr
+LampRobot::ToKeyedScanMsg(const gtsam::Symbol& key,
+                          const PointCloud::ConstPtr& scan) const {
+  pose_graph_msgs::KeyedScan::Ptr msg(new pose_graph_msgs::KeyedScan);
+  msg->key = key;
+  lamp_utils::ScanToKeyedScanMsg(
+      *scan,
+      b_compress_scans_ ? &scan_compression_params_ : nullptr,
+      msg.get());
+  return msg;
+}
+
+void LampRobot::QueueKeyedScan(const gtsam::Symbol& key,
+                               const PointCloud::ConstPtr& scan,
+                               bool b_expires) {
+  pose_graph_msgs::KeyedScan::Ptr msg = ToKeyedScanMsg(key, scan);
+
+  lamp_utils::SendScheduler::Message message;
+  message.key = key;
+  message.bytes = ros::serialization::serializationLength(*msg);
+  message.stamp = ros::Time::now().toSec();
+  message.b_expires = b_expires;
+  message.send = [this, msg]() {
+    keyed_scan_pub_.publish(msg);
+    requested_scan_keys_.erase(msg->key);
+  };
+  send_scheduler_.Push(lamp_utils::SendScheduler::SCAN_FULL, message);
+}
+
+void LampRobot::PublishScanLayers(const gtsam::Symbol& key,
+                                  const PointCloud::ConstPtr& scan) {
+  std::vector<PointCloud> layers;
+  lamp_utils::SplitIntoLayers(
+      *scan, scan_layer_leaf_, num_scan_layers_, &layers);
+
+  for (size_t i = 0; i < layers.size(); i++) {
+    pose_graph_msgs::KeyedScanLayer::Ptr msg(
+        new pose_graph_msgs::KeyedScanLayer);
+    msg->key = key;
+    msg->layer = i;
+    msg->num_layers = layers.size();
+    PointXyziCloud::Ptr pub_scan(new PointXyziCloud);
+    lamp_utils::ConvertPointCloud(layers[i].makeShared(), pub_scan);
+    lamp_utils::ToRosMsg(*pub_scan, &msg->scan);
+
+    if (!b_send_scheduler_) {
+      keyed_scan_layer_pub_.publish(msg);
+      continue;
+    }
+    // Refinements never expire, they are small and the base merges them
+    // into what it has
+    lamp_utils::SendScheduler::Message message;
+    message.key = key;
+    message.bytes = ros::serialization::serializationLength(*msg);
+    message.stamp = ros::Time::now().toSec();
+    message.send = [this, msg]() { keyed_scan_layer_pub_.publish(msg); };
+    send_scheduler_.Push(i == 0 ? lamp_utils::SendScheduler::SCAN_COARSE
+                                : lamp_utils::SendScheduler::SCAN_FULL,
+                         message);
+  }
+}
+
+void LampRobot::ScheduleSends() {
+  ros::Time now = ros::Time::now();
+  if ((now - last_link_update_).toSec() > link_timeout_) {
+    send_scheduler_.SetRate(default_link_rate_);
+  }
+  send_scheduler_.Refill(now.toSec());
+
+  // Graphs are published as soon as they are ready, charge them to the
+  // budget so the scans wait for them
+  send_scheduler_.Charge(incremental_graph_bytes_ - charged_graph_bytes_);
+  charged_graph_bytes_ = incremental_graph_bytes_;
+
+  // Full scans that waited too long are sent downsampled instead
+  for (const auto& expired : send_scheduler_.TakeExpired(
+           lamp_utils::SendScheduler::SCAN_FULL,
+           now.toSec() - max_full_scan_delay_)) {
+    PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(expired.key);
+    if (scan == nullptr)
+      continue;
+    PointCloud::Ptr coarse = lamp_utils::PointCloudPool::Instance().Acquire();
+    lamp_utils::VoxelDownsample(*scan, coarse_scan_leaf_, coarse.get());
+    pose_graph_msgs::KeyedScan::Ptr msg = ToKeyedScanMsg(expired.key, coarse);
+
+    lamp_utils::SendScheduler::Message message;
+    message.key = expired.key;
+    message.bytes = ros::serialization::serializationLength(*msg);
+    message.stamp = now.toSec();
+    message.send = [this, msg]() { keyed_scan_coarse_pub_.publish(msg); };
+    send_scheduler_.Push(lamp_utils::SendScheduler::SCAN_COARSE, message);
+  }
+
+  size_t sent = send_scheduler_.Dispatch();
+  static lamp_utils::Gauge& queued_bytes =
+      lamp_utils::MetricsRegistry::Instance().GetGauge(
+          "lamp.send_queued_bytes");
+  queued_bytes.Set(send_scheduler_.QueuedBytes());
+  ROS_DEBUG_STREAM("Sent " << sent << " scan bytes, "
+                           << send_scheduler_.QueuedBytes() << " queued, "
+                           << send_scheduler_.rate() << " bytes/s budget");
+}
+
+void LampRobot::LinkQualityCallback(
+    const silvus_msgs::SilvusStreamscape::ConstPtr& msg) {
+  for (const auto& node : msg->nodes) {
+    if (node.node_label != radio_label_)
+      continue;
+    // Best link to a neighbour radio, discounted by its loss rate
+    double mbps = 0.0;
+    for (const auto& neighbor : node.neighbors) {
+      mbps = std::max(mbps,
+                      neighbor.theoretical_udp_throughput_Mbps *
+                          (1.0 - neighbor.loss_rate_percent / 100.0));
+    }
+    send_scheduler_.SetRate(mbps * 1e6 / 8.0 * link_fraction_);
+    last_link_update_ = ros::Time::now();
+    return;
+  }
+}
+
+void LampRobot::KeyedScanRequestCallback(
+    const pose_graph_msgs::KeyedScanRequest::ConstPtr& msg) {
+  ROS_INFO_STREAM("Base station requested " << msg->keys.size()
+                                            << " keyed scans");
+  for (const auto& key : msg->keys) {
+    // Already queued from an earlier request
+    if (requested_scan_keys_.count(key))
+      continue;
+    PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(key);
+    if (scan != nullptr) {
+      requested_scan_keys_.insert(key);
+      QueueKeyedScan(key, scan, false);
+    }
+  }
 }
 
 // Odometry update
@@ -610,17 +1076,14 @@ void LampRobot::UpdateAndPublishOdom() {
   \author Benjamin Morrell
   \date 22 Nov 2019
 */
-bool LampRobot::ProcessStationaryData(std::shared_ptr<FactorData> data) {
-  // Extract odom data
-  std::shared_ptr<ImuData> imu_data = std::dynamic_pointer_cast<ImuData>(data);
-
+bool LampRobot::ProcessStationaryData(const ImuData& imu_data) {
   // Check if there are new factors
-  if (!imu_data->b_has_data) {
+  if (!imu_data.b_has_data) {
     return false;
   }
 
-  gtsam::Unit3 ref_unit = imu_data->factors[0].attitude.nZ();
-  gtsam::Unit3 meas_unit = imu_data->factors[0].attitude.bRef();
+  gtsam::Unit3 ref_unit = imu_data.factors[0].attitude.nZ();
+  gtsam::Unit3 meas_unit = imu_data.factors[0].attitude.bRef();
   geometry_msgs::Point meas, ref;
   meas.x = meas_unit.point3().x();
   meas.y = meas_unit.point3().y();
@@ -633,11 +1096,11 @@ bool LampRobot::ProcessStationaryData(std::shared_ptr<FactorData> data) {
   // boost::dynamic_pointer_cast<gtsam::noiseModel::Isotropic>(imu_data->factors[0].attitude.noiseModel());
   double noise_sigma =
       boost::dynamic_pointer_cast<gtsam::noiseModel::Isotropic>(
-          imu_data->factors[0].attitude.noiseModel())
+          imu_data.factors[0].attitude.noiseModel())
           ->sigma();
 
   pose_graph_.TrackIMUFactor(
-      imu_data->factors[0].attitude.front(), meas, ref, noise_sigma, true);
+      imu_data.factors[0].attitude.front(), meas, ref, noise_sigma, true);
 
   // Do not optimize on the robot
   // Optimize every "imu_factors_per_opt"
@@ -671,7 +1134,8 @@ void LampRobot::HandleRelativePoseMeasurement(const ros::Time& stamp,
   }
 
   // Time from this key - closest time that there is anode
-  ros::Time stamp_from = pose_graph_.keyed_stamps[key_from];
+  ros::Time stamp_from =
+      pose_graph_.keyed_stamps.Find(key_from).value_or(ros::Time());
 
   // Get the delta pose from the key_from to the time of the observation
   GtsamPosCov delta_pose_cov;
@@ -720,7 +1184,8 @@ void LampRobot::HandleRelativePoseMeasurementWithFixedKey(
   }
 
   // Time from this key - closest time that there is anode
-  ros::Time stamp_from = pose_graph_.keyed_stamps[key_from];
+  ros::Time stamp_from =
+      pose_graph_.keyed_stamps.Find(key_from).value_or(ros::Time());
 
   // Get the delta pose from the key_from to the time of the observation
   GtsamPosCov delta_pose_cov;
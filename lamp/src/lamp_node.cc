@@ -5,6 +5,7 @@
  */
 
 #include <lamp/LampRobot.h>
+#include <lamp_utils/ThreadGovernor.h>
 #include <ros/ros.h>
 
 int main(int argc, char** argv) {
@@ -17,6 +18,7 @@ int main(int argc, char** argv) {
               ros::this_node::getName().c_str());
     return EXIT_FAILURE;
   }
+  lamp_utils::ThreadGovernor::Instance().RegisterThread("ros_spinners");
   ros::spin();
 
   return EXIT_SUCCESS;
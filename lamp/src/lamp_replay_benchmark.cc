@@ -0,0 +1,414 @@
+/*
+ * Copyright Notes
+ *
+ * End to end benchmark of the base station stack. Replays a recorded multi
+ * robot bag (robot pose graphs and keyed scans as received by the base) into
+ * LampBaseStation, the loop closure stages and LampPgo, all hosted in this
+ * process, on a simulated clock stepped by the harness. Runs at a multiple of
+ * the recorded speed (0 replays as fast as the stack drains) and writes the
+ * sustained throughput, the latency from a keyed scan arriving to its
+ * insertion in the map, the memory growth and the lag behind the schedule as
+ * JSON, next to a snapshot of the metrics registry of every stage. Running it
+ * at 1x, 5x and 20x shows which stage saturates first.
+ *
+ * Robots are not hosted: LampRobot reads its parameters by relative name like
+ * the base station, so only one of them fits in a process. The bag holds what
+ * the base receives from them instead.
+ */
+
+#include <lamp/LampBaseStation.h>
+#include <lamp_pgo/LampPgo.h>
+#include <lamp_pgo/SolverStats.h>
+#include <lamp_utils/Metrics.h>
+#include <lamp_utils/Tracing.h>
+#include <loop_closure/GenericLoopPrioritization.h>
+#include <loop_closure/IcpLoopComputation.h>
+#include <loop_closure/LoopCandidateQueue.h>
+#include <loop_closure/ObservabilityLoopPrioritization.h>
+#include <loop_closure/ObservabilityQueue.h>
+#include <loop_closure/ProximityLoopGeneration.h>
+#include <loop_closure/RoundRobinLoopCandidateQueue.h>
+#include <loop_closure/ScanContextLoopGeneration.h>
+
+#include <rosbag/bag.h>
+#include <rosbag/player.h>
+#include <rosbag/view.h>
+#include <rosgraph_msgs/Clock.h>
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
+#include <topic_tools/shape_shifter.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace lc = lamp_loop_closure;
+namespace pu = parameter_utils;
+
+namespace {
+
+struct Distribution {
+  size_t count{0};
+  double mean{0};
+  double p50{0};
+  double p99{0};
+  double max{0};
+};
+
+Distribution Summarize(std::vector<double> samples) {
+  Distribution d;
+  d.count = samples.size();
+  if (samples.empty())
+    return d;
+  std::sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (double s : samples)
+    sum += s;
+  d.mean = sum / samples.size();
+  auto percentile = [&samples](double p) {
+    size_t i = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+    return samples[std::min(i, samples.size() - 1)];
+  };
+  d.p50 = percentile(0.5);
+  d.p99 = percentile(0.99);
+  d.max = samples.back();
+  return d;
+}
+
+void WriteDistribution(std::ostream& out,
+                       const std::string& name,
+                       const Distribution& d) {
+  out << "\"" << name << "\": {\"count\": " << d.count
+      << ", \"mean\": " << d.mean << ", \"p50\": " << d.p50
+      << ", \"p99\": " << d.p99 << ", \"max\": " << d.max << "}";
+}
+
+// Names relative to the harness namespace, as remaps in a launch file
+std::string Resolve(const std::string& name) {
+  if (!name.empty() && name[0] == '/')
+    return name;
+  return ros::names::append(ros::this_node::getNamespace(), name);
+}
+
+// Handle of a stage in its namespace with the remaps of the stage applied.
+// The stages read their parameters through parameter_utils, which resolves
+// them against this node, so the launch file loads every configuration here
+ros::NodeHandle StageHandle(XmlRpc::XmlRpcValue& stage) {
+  const std::string ns = Resolve(static_cast<std::string>(stage["ns"]));
+  ros::M_string remappings;
+  if (stage.hasMember("remappings")) {
+    for (auto& remap : stage["remappings"]) {
+      remappings[ros::names::append(ns, remap.first)] =
+          Resolve(static_cast<std::string>(remap.second));
+    }
+  }
+  return ros::NodeHandle(ns, remappings);
+}
+
+// Keeps a stage alive with whatever it needs to run (spinners)
+struct Stage {
+  std::string name;
+  std::shared_ptr<void> module;
+  std::vector<ros::AsyncSpinner> spinners;
+};
+
+template <typename T>
+std::shared_ptr<T> InitializeStage(const ros::NodeHandle& n, T* module) {
+  std::shared_ptr<T> stage(module);
+  if (!stage->Initialize(n))
+    return nullptr;
+  return stage;
+}
+
+// Same choice of implementation as the stand alone nodes
+bool CreateStage(XmlRpc::XmlRpcValue& params, Stage* stage) {
+  const std::string type = params["type"];
+  ros::NodeHandle n = StageHandle(params);
+  const std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+  stage->name = type;
+
+  if (type == "lamp_pgo") {
+    stage->module = InitializeStage(n, new LampPgo);
+  } else if (type == "loop_generation") {
+    int method = 0;
+    pu::Get(param_ns + "/generation_method", method);
+    if (method == 1) {
+      lamp_utils::SharedScanStore::Instance().SetEnabled(true);
+      stage->module = InitializeStage(n, new lc::ScanContextLoopGeneration);
+    } else {
+      stage->module = InitializeStage(n, new lc::ProximityLoopGeneration);
+    }
+  } else if (type == "loop_prioritization") {
+    int method = 0;
+    pu::Get(param_ns + "/prioritization_method", method);
+    std::shared_ptr<lc::LoopPrioritization> prioritization;
+    if (method == 1) {
+      prioritization =
+          InitializeStage(n, new lc::ObservabilityLoopPrioritization);
+    } else {
+      prioritization = InitializeStage(n, new lc::GenericLoopPrioritization);
+    }
+    if (prioritization) {
+      stage->spinners = prioritization->SetAsyncSpinners(n);
+      for (auto& spinner : stage->spinners)
+        spinner.start();
+    }
+    stage->module = prioritization;
+  } else if (type == "loop_candidate_queue") {
+    int method = 1;
+    pu::Get(param_ns + "/queue/method", method);
+    if (method == 2) {
+      stage->module = InitializeStage(n, new lc::ObservabilityQueue);
+    } else {
+      stage->module = InitializeStage(n, new lc::RoundRobinLoopCandidateQueue);
+    }
+  } else if (type == "loop_computation") {
+    lamp_utils::SharedScanStore::Instance().SetEnabled(true);
+    stage->module = InitializeStage(n, new lc::IcpLoopComputation);
+  } else {
+    ROS_ERROR_STREAM("Unknown stage type " << type);
+    return false;
+  }
+  if (!stage->module) {
+    ROS_ERROR_STREAM("Failed to initialize stage " << type << " in "
+                                                   << n.getNamespace());
+    return false;
+  }
+  return true;
+}
+
+// Runs every callback that is ready, so each replayed message is handled
+// before the clock moves on
+void Drain() {
+  ros::CallbackQueue* queue = ros::getGlobalCallbackQueue();
+  while (!queue->isEmpty()) {
+    queue->callAvailable(ros::WallDuration(0));
+  }
+}
+
+struct ReplayResult {
+  double speed{0};
+  double bag_duration_s{0};
+  double wall_duration_s{0};
+  size_t messages{0};
+  size_t keyed_scans{0};
+  size_t graph_nodes{0}; // Unique keys in the replayed pose graphs
+  std::vector<double> lag_s; // Behind schedule, sampled per message
+  std::vector<double> scan_to_map_ms;
+  size_t rss_start_kb{0};
+  size_t rss_end_kb{0};
+  size_t rss_peak_kb{0};
+};
+
+void WriteResults(const std::string& path,
+                  const std::string& bag_file,
+                  const ReplayResult& r) {
+  std::ofstream out(path);
+  std::time_t now = std::time(nullptr);
+  char date[32];
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+  const double wall = std::max(r.wall_duration_s, 1e-9);
+  const double bag_minutes = std::max(r.bag_duration_s / 60.0, 1e-9);
+  out << "{\n  \"context\": {\"date\": \"" << date << "\", \"num_cpus\": "
+      << std::thread::hardware_concurrency() << ", \"bag\": \"" << bag_file
+      << "\", \"speed\": " << r.speed << "},\n  \"replay\": {"
+      << "\"bag_duration_s\": " << r.bag_duration_s
+      << ", \"wall_duration_s\": " << r.wall_duration_s
+      << ", \"achieved_speed\": " << r.bag_duration_s / wall
+      << ", \"messages\": " << r.messages
+      << ", \"keyed_scans\": " << r.keyed_scans
+      << ", \"graph_nodes\": " << r.graph_nodes
+      << ", \"keyed_scans_per_s\": " << r.keyed_scans / wall
+      << ", \"nodes_per_s\": " << r.graph_nodes / wall << ",\n    ";
+  WriteDistribution(out, "lag_s", Summarize(r.lag_s));
+  out << ",\n    ";
+  WriteDistribution(out, "scan_to_map_ms", Summarize(r.scan_to_map_ms));
+  out << ",\n    \"memory_kb\": {\"start\": " << r.rss_start_kb
+      << ", \"end\": " << r.rss_end_kb << ", \"peak\": " << r.rss_peak_kb
+      << ", \"growth_per_bag_minute\": "
+      << (static_cast<double>(r.rss_end_kb) - r.rss_start_kb) / bag_minutes
+      << "}},\n  \"metrics\": {";
+  bool b_first = true;
+  for (const auto& metric : lamp_utils::MetricsRegistry::Instance().Snapshot()) {
+    out << (b_first ? "\n" : ",\n") << "    \"" << metric.first
+        << "\": " << metric.second;
+    b_first = false;
+  }
+  out << "\n  }\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  // Named like the base station node so it reads the same parameters
+  ros::init(argc, argv, "lamp");
+  ros::NodeHandle n("~");
+
+  if (!ros::Time::isSimTime()) {
+    ROS_ERROR("The replay benchmark needs /use_sim_time set to true.");
+    return EXIT_FAILURE;
+  }
+
+  std::string bag_file, output_file;
+  n.getParam("bag_file", bag_file);
+  n.getParam("output_file", output_file);
+  double speed = 1.0;
+  n.getParam("speed", speed);
+  // Wall time given to the stack to finish after the last message
+  double drain_time = 10.0;
+  n.getParam("drain_time", drain_time);
+  std::vector<std::string> topics;
+  n.getParam("topics", topics);
+  XmlRpc::XmlRpcValue stage_params;
+  if (!n.getParam("stages", stage_params) ||
+      stage_params.getType() != XmlRpc::XmlRpcValue::TypeArray) {
+    ROS_ERROR("Replay benchmark needs a stages list.");
+    return EXIT_FAILURE;
+  }
+
+  // Spans give the time from a scan arriving to its map insertion
+  lamp_utils::Tracer& tracer = lamp_utils::Tracer::Instance();
+  tracer.SetCapacity(1 << 20);
+  tracer.Enable(true);
+
+  rosbag::Bag bag;
+  try {
+    bag.open(bag_file, rosbag::bagmode::Read);
+  } catch (const rosbag::BagException& e) {
+    ROS_ERROR_STREAM("Failed to open " << bag_file << ": " << e.what());
+    return EXIT_FAILURE;
+  }
+  std::unique_ptr<rosbag::View> view(
+      topics.empty() ? new rosbag::View(bag)
+                     : new rosbag::View(bag, rosbag::TopicQuery(topics)));
+  if (view->size() == 0) {
+    ROS_ERROR("Nothing to replay in %s", bag_file.c_str());
+    return EXIT_FAILURE;
+  }
+  const ros::Time bag_start = view->getBeginTime();
+  ros::Time::setNow(bag_start);
+
+  LampBaseStation base;
+  if (!base.Initialize(n)) {
+    ROS_ERROR("Failed to initialize LAMP Base Station.");
+    return EXIT_FAILURE;
+  }
+  std::vector<Stage> stages(stage_params.size());
+  for (int i = 0; i < stage_params.size(); i++) {
+    if (!CreateStage(stage_params[i], &stages[i]))
+      return EXIT_FAILURE;
+  }
+
+  ros::NodeHandle nh;
+  ros::Publisher clock_pub = nh.advertise<rosgraph_msgs::Clock>("/clock", 1);
+  std::map<std::string, ros::Publisher> publishers;
+
+  ReplayResult result;
+  result.speed = speed;
+  result.rss_start_kb = result.rss_peak_kb = ResidentMemoryKb();
+  std::unordered_map<gtsam::Key, int64_t> scan_arrival_us;
+  std::unordered_set<gtsam::Key> graph_keys;
+  ros::WallTime last_memory_sample = ros::WallTime::now();
+  const ros::WallTime wall_start = ros::WallTime::now();
+
+  for (const rosbag::MessageInstance& m : *view) {
+    if (!ros::ok())
+      break;
+    const double bag_elapsed = (m.getTime() - bag_start).toSec();
+
+    // Hold the message until its time at the replay speed
+    if (speed > 0) {
+      const double due = bag_elapsed / speed;
+      const double elapsed = (ros::WallTime::now() - wall_start).toSec();
+      if (due > elapsed) {
+        ros::WallDuration(due - elapsed).sleep();
+      }
+      result.lag_s.push_back(
+          std::max(0.0, (ros::WallTime::now() - wall_start).toSec() - due));
+    }
+
+    ros::Time::setNow(m.getTime());
+    rosgraph_msgs::Clock clock;
+    clock.clock = m.getTime();
+    clock_pub.publish(clock);
+
+    auto pub = publishers.find(m.getTopic());
+    if (pub == publishers.end()) {
+      ros::AdvertiseOptions options = rosbag::createAdvertiseOptions(m, 1000);
+      pub = publishers.emplace(m.getTopic(), nh.advertise(options)).first;
+    }
+
+    if (m.getDataType() == "pose_graph_msgs/KeyedScan") {
+      auto scan = m.instantiate<pose_graph_msgs::KeyedScan>();
+      if (scan && !scan_arrival_us.count(scan->key)) {
+        scan_arrival_us[scan->key] = lamp_utils::Tracer::NowMicroseconds();
+        result.keyed_scans++;
+      }
+    } else if (m.getDataType() == "pose_graph_msgs/PoseGraph") {
+      auto graph = m.instantiate<pose_graph_msgs::PoseGraph>();
+      if (graph) {
+        for (const auto& node : graph->nodes)
+          graph_keys.insert(node.key);
+      }
+    }
+
+    pub->second.publish(m.instantiate<topic_tools::ShapeShifter>());
+    result.messages++;
+    Drain();
+
+    if ((ros::WallTime::now() - last_memory_sample).toSec() >= 1.0) {
+      last_memory_sample = ros::WallTime::now();
+      result.rss_peak_kb = std::max(result.rss_peak_kb, ResidentMemoryKb());
+    }
+  }
+  result.bag_duration_s = (view->getEndTime() - bag_start).toSec();
+  result.graph_nodes = graph_keys.size();
+
+  // Let the timers and the stage threads finish what is queued, with the
+  // clock still moving
+  const ros::WallTime drain_start = ros::WallTime::now();
+  ros::Time sim_now = view->getEndTime();
+  while (ros::ok() && (ros::WallTime::now() - drain_start).toSec() < drain_time) {
+    sim_now += ros::Duration(0.01);
+    ros::Time::setNow(sim_now);
+    Drain();
+    ros::WallDuration(0.01).sleep();
+  }
+  result.wall_duration_s = (ros::WallTime::now() - wall_start).toSec();
+  result.rss_end_kb = ResidentMemoryKb();
+  result.rss_peak_kb = std::max(result.rss_peak_kb, result.rss_end_kb);
+
+  // First map insertion of every replayed scan
+  std::unordered_map<gtsam::Key, int64_t> inserted_us;
+  for (const auto& event : tracer.Snapshot()) {
+    if (std::string(event.name) != "map.insert")
+      continue;
+    auto arrival = scan_arrival_us.find(event.key);
+    if (arrival == scan_arrival_us.end() || inserted_us.count(event.key))
+      continue;
+    inserted_us[event.key] = event.start_us + event.duration_us;
+    result.scan_to_map_ms.push_back(
+        (inserted_us[event.key] - arrival->second) / 1000.0);
+  }
+
+  WriteResults(output_file, bag_file, result);
+  ROS_INFO("Replayed %zu messages (%zu keyed scans) in %.1f s, written to %s",
+           result.messages,
+           result.keyed_scans,
+           result.wall_duration_s,
+           output_file.c_str());
+
+  for (auto& stage : stages) {
+    for (auto& spinner : stage.spinners)
+      spinner.stop();
+  }
+  bag.close();
+  return EXIT_SUCCESS;
+}
@@ -94,10 +94,10 @@ public:
 
   // Access functions
   void AddStampToOdomKey(ros::Time stamp, gtsam::Symbol key) {
-    lr.graph().stamp_to_odom_key[stamp.toSec()] = key;
+    lr.graph().stamp_to_odom_key.Assign(stamp.toSec(), key);
   }
   void AddKeyedStamp(gtsam::Symbol key, ros::Time stamp) {
-    lr.graph().keyed_stamps[key] = stamp;
+    lr.graph().keyed_stamps.Assign(key, stamp);
   }
   void SetTimeThreshold(double threshold) {
     lr.graph().time_threshold = threshold;
@@ -120,6 +120,12 @@ public:
   bool AddTransformedPointCloudToMap(const gtsam::Symbol key) {
     lr.AddTransformedPointCloudToMap(key);
   }
+  bool CombineKeyedScansWorld(PointCloud* points) {
+    return lr.CombineKeyedScansWorld(points);
+  }
+  void SetMapUpdateThreads(int threads) {
+    lr.map_update_threads_ = threads;
+  }
 
   // Other utilities
   bool GetOptFlag() {
@@ -135,29 +141,30 @@ public:
   const gtsam::NonlinearFactorGraph& GetNfg() const {
     return lr.graph().GetNfg();
   }
-  const EdgeSet& GetEdges() const {
+  const lamp_utils::EdgeStore& GetEdges() const {
     return lr.graph().GetEdges();
   }
-  const NodeSet& GetNodes() const {
+  const lamp_utils::NodeStore& GetNodes() const {
     return lr.graph().GetNodes();
   }
-  const EdgeSet& GetPriors() const {
+  const lamp_utils::EdgeStore& GetPriors() const {
     return lr.graph().GetPriors();
   }
-  const EdgeSet& GetNewEdges() const {
+  const lamp_utils::EdgeStore& GetNewEdges() const {
     return lr.graph().GetNewEdges();
   }
-  const NodeSet& GetNewNodes() const {
+  const lamp_utils::NodeStore& GetNewNodes() const {
     return lr.graph().GetNewNodes();
   }
-  const EdgeSet& GetNewPriors() const {
+  const lamp_utils::EdgeStore& GetNewPriors() const {
     return lr.graph().GetNewPriors();
   }
 
   gtsam::Pose3 GetPose(gtsam::Key key) const {
     return lr.graph().GetPose(key);
   }
-  const EdgeMessage* FindEdge(gtsam::Key key_from, gtsam::Key key_to) const {
+  boost::optional<EdgeMessage> FindEdge(gtsam::Key key_from,
+                                        gtsam::Key key_to) const {
     return lr.graph().FindEdge(key_from, key_to);
   }
 
@@ -521,7 +528,7 @@ TEST_F(TestLampRobot, ConvertPoseGraphToMsg) {
   EXPECT_EQ(pose2.equals(actual2, tolerance_), true);
 
   // Odom edge
-  const auto* edge0 = graph.FindEdge(key0, key1);
+  const auto edge0 = graph.FindEdge(key0, key1);
   auto edge0_tf = lamp_utils::MessageToPose(*edge0);
   auto edge0_noise = lamp_utils::MessageToCovariance(*edge0);
   EXPECT_EQ(edge0->type, pose_graph_msgs::PoseGraphEdge::ODOM);
@@ -529,7 +536,7 @@ TEST_F(TestLampRobot, ConvertPoseGraphToMsg) {
   EXPECT_EQ(edge0_noise->equals(*noise, tolerance_), true);
 
   // Prior factor
-  const auto* prior = graph.FindPrior(key0);
+  const auto prior = graph.FindPrior(key0);
   auto prior_tf = lamp_utils::MessageToPose(*prior);
   auto prior_noise = lamp_utils::MessageToCovariance(*prior);
   EXPECT_EQ(prior->type, pose_graph_msgs::PoseGraphEdge::PRIOR);
@@ -646,7 +653,7 @@ TEST_F(TestLampRobot, SaveLoadPoseGraph) {
   EXPECT_EQ(pose2.equals(actual2, tolerance_), true);
 
   // Odom edge
-  const auto* edge0 = graph.FindEdge(key0, key1);
+  const auto edge0 = graph.FindEdge(key0, key1);
   auto edge0_tf = lamp_utils::MessageToPose(*edge0);
   auto edge0_noise = lamp_utils::MessageToCovariance(*edge0);
   EXPECT_EQ(edge0->type, pose_graph_msgs::PoseGraphEdge::ODOM);
@@ -654,7 +661,7 @@ TEST_F(TestLampRobot, SaveLoadPoseGraph) {
   EXPECT_EQ(edge0_noise->equals(*noise, tolerance_), true);
 
   // Prior factor
-  const auto* prior = graph.FindPrior(key0);
+  const auto prior = graph.FindPrior(key0);
   auto prior_tf = lamp_utils::MessageToPose(*prior);
   auto prior_noise = lamp_utils::MessageToCovariance(*prior);
   EXPECT_EQ(prior->type, pose_graph_msgs::PoseGraphEdge::PRIOR);
@@ -739,7 +746,7 @@ TEST_F(TestLampRobot, TestLaserLoopClosure) {
 
   LaserLoopClosureCallback(pg_ptr);
 
-  EdgeSet edges_info = GetEdges();
+  EdgeMessages edges_info(GetEdges().begin(), GetEdges().end());
 
   gtsam::NonlinearFactorGraph nfg = GetNfg();
 
@@ -832,6 +839,43 @@ TEST_F(TestLampRobot, TestPointCloudTransformSingle) {
   }
 }
 
+TEST_F(TestLampRobot, TestCombineKeyedScansWorldParallel) {
+  ros::NodeHandle nh, pnh("~");
+  lr.Initialize(nh);
+  SetMapUpdateThreads(4);
+
+  // Scans of different sizes at different poses
+  PointCloud expected;
+  for (int k = 0; k < 20; k++) {
+    gtsam::Symbol key('a', k + 1);
+    PointCloud::Ptr scan(new PointCloud);
+    for (int i = 0; i < k % 5 + 1; i++) {
+      Point p;
+      p.x = i;
+      p.y = k;
+      p.z = 0.5 * i;
+      scan->push_back(p);
+    }
+    AddToKeyScans(key, scan);
+    gtsam::Pose3 pose(gtsam::Rot3::Ypr(0.1 * k, 0.05 * k, 0),
+                      gtsam::Point3(k, -k, 0.2 * k));
+    InsertValues(key, pose);
+
+    PointCloud scan_world;
+    pcl::transformPointCloud(*scan, scan_world, pose.matrix());
+    expected += scan_world;
+  }
+
+  PointCloud combined;
+  ASSERT_TRUE(CombineKeyedScansWorld(&combined));
+  ASSERT_EQ(expected.size(), combined.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_NEAR(expected[i].x, combined[i].x, tolerance_);
+    EXPECT_NEAR(expected[i].y, combined[i].y, tolerance_);
+    EXPECT_NEAR(expected[i].z, combined[i].z, tolerance_);
+  }
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_lamp_robot");
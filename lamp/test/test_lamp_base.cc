@@ -78,13 +78,39 @@ public:
   // void SetPoseGraph(PoseGraph graph) { lb.pose_graph_ = graph; }
   // PoseGraph GetPoseGraph() { return lb.pose_graph_; }
   bool ProcessPoseGraphData(std::shared_ptr<FactorData> data) {
-    return lb.ProcessPoseGraphData(data);
+    return lb.ProcessPoseGraphData(
+        *std::static_pointer_cast<PoseGraphData>(data));
   }
 
   int GetMapDataSize() {
     return lb.mapper_->GetMapData()->size();
   }
 
+  bool UpdateMapPointCloud() {
+    return lb.UpdateMapPointCloud();
+  }
+
+  void SetIncrementalMapUpdate(bool b_incremental, int full_interval = 0) {
+    lb.b_incremental_map_update_ = b_incremental;
+    lb.full_map_regeneration_interval_ = full_interval;
+  }
+
+  bool HasMapScan(const gtsam::Symbol& key) {
+    return lb.map_scans_world_.count(key);
+  }
+
+  gtsam::Pose3 GetMapScanPose(const gtsam::Symbol& key) {
+    return lb.map_scans_world_.at(key).pose;
+  }
+
+  void RestoreScans() {
+    lb.RestoreScansTimerCallback(ros::TimerEvent());
+  }
+
+  size_t NumScansToRestore() {
+    return lb.restore_scan_keys_.size() - lb.restore_scan_index_;
+  }
+
   LampBaseStation lb;
 
   PoseGraphData data_;
@@ -136,6 +162,71 @@ TEST_F(TestLampBase, AddScansBeforePoseNodes) {
   EXPECT_TRUE(GetMapDataSize() > 0);
 }
 
+TEST_F(TestLampBase, IncrementalMapUpdate) {
+  ros::NodeHandle nh, pnh("~");
+  lb.Initialize(pnh);
+  SetIncrementalMapUpdate(true);
+
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+  gtsam::Symbol key('a', 0);
+  lb.graph().TrackNode(ros::Time(0.0), key, gtsam::Pose3(), noise);
+  lb.graph().InsertKeyedScan(key, scan_);
+
+  // First update adds the scan
+  EXPECT_TRUE(UpdateMapPointCloud());
+  EXPECT_TRUE(HasMapScan(key));
+  EXPECT_TRUE(GetMapDataSize() > 0);
+
+  // Motion below the threshold keeps the cached scan
+  gtsam::Pose3 small_move(gtsam::Rot3(), gtsam::Point3(0.001, 0.0, 0.0));
+  lb.graph().TrackNode(ros::Time(0.0), key, small_move, noise);
+  EXPECT_TRUE(UpdateMapPointCloud());
+  EXPECT_NEAR(GetMapScanPose(key).translation().x(), 0.0, 1e-6);
+
+  // Motion above the threshold re-transforms the scan
+  gtsam::Pose3 large_move(gtsam::Rot3(), gtsam::Point3(1.0, 0.0, 0.0));
+  lb.graph().TrackNode(ros::Time(0.0), key, large_move, noise);
+  EXPECT_TRUE(UpdateMapPointCloud());
+  EXPECT_NEAR(GetMapScanPose(key).translation().x(), 1.0, 1e-6);
+  EXPECT_TRUE(GetMapDataSize() > 0);
+}
+
+TEST_F(TestLampBase, RestoreCheckpoint) {
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+  const std::string file = "test_checkpoint.lpg";
+  {
+    // Session before the restart
+    PoseGraph graph;
+    for (int i = 0; i < 3; i++) {
+      gtsam::Symbol key('a', i);
+      graph.TrackNode(ros::Time(i), key, gtsam::Pose3(), noise);
+      graph.InsertKeyedScan(key, scan_);
+      graph.InsertKeyedStamp(key, ros::Time(i));
+    }
+    ASSERT_TRUE(graph.Save(file));
+  }
+
+  system("rosparam set checkpoint/b_restore true");
+  system(("rosparam set checkpoint/file " + file).c_str());
+  system("rosparam set checkpoint/restore_scans_per_tick 2");
+  ros::NodeHandle nh, pnh("~");
+  lb.Initialize(pnh);
+  system("rosparam set checkpoint/b_restore false");
+
+  // The graph is back at once, the scans follow in the background
+  EXPECT_EQ(lb.graph().GetValues().size(), 3);
+  EXPECT_TRUE(lb.graph().HasScan(gtsam::Symbol('a', 2)));
+  EXPECT_EQ(NumScansToRestore(), 3);
+  RestoreScans();
+  EXPECT_EQ(NumScansToRestore(), 1);
+  RestoreScans();
+  EXPECT_EQ(NumScansToRestore(), 0);
+  EXPECT_TRUE(HasMapScan(gtsam::Symbol('a', 2)));
+  EXPECT_TRUE(GetMapDataSize() > 0);
+}
+
 TEST_F(TestLampBase, PoseGraphUpdateAfterOptimization) {
   // float zero_noise = 0.001;
   // gtsam::Vector6 noise;
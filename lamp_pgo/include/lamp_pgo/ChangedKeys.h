@@ -0,0 +1,45 @@
+/*
+ChangedKeys.h
+Keys of the optimized values that moved since they were last reported
+*/
+
+#ifndef CHANGED_KEYS_H_
+#define CHANGED_KEYS_H_
+
+#include <unordered_map>
+
+#include <Eigen/StdVector>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include <pose_graph_msgs/ChangedKeys.h>
+
+// Poses are compared with the pose last reported for the key rather than the
+// last published one, so slow drift is reported once it adds up to the
+// thresholds and consumers updating incrementally stay within them.
+class ChangedKeysTracker {
+ public:
+  // Translation (m) and rotation (rad) past which a key is reported
+  void SetThresholds(double translation, double rotation);
+
+  // Fills msg with the keys of values that moved, are new or were removed
+  // since the last update, and records the reported poses
+  void Update(const gtsam::Values& values, pose_graph_msgs::ChangedKeys* msg);
+
+  // The next update reports every key
+  void Reset();
+
+ private:
+  double translation_threshold_{0.01};
+  double rotation_threshold_{0.005};
+  bool b_full_{true};
+  std::unordered_map<
+      gtsam::Key,
+      gtsam::Pose3,
+      std::hash<gtsam::Key>,
+      std::equal_to<gtsam::Key>,
+      Eigen::aligned_allocator<std::pair<const gtsam::Key, gtsam::Pose3>>>
+      reported_;
+};
+
+#endif  // CHANGED_KEYS_H_
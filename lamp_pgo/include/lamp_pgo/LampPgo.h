@@ -7,8 +7,15 @@ Interface for ROS and KimeraRPGO
 #ifndef LAMP_PGO_H_
 #define LAMP_PGO_H_
 
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <unordered_map>
 
+#include <gtsam/nonlinear/ISAM2.h>
 #include <gtsam/nonlinear/Marginals.h>
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
@@ -18,11 +25,18 @@ Interface for ROS and KimeraRPGO
 #include <std_msgs/Bool.h>
 #include <std_msgs/String.h>
 
+#include <pose_graph_msgs/MarginalCovariance.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <pose_graph_msgs/PoseGraphEdge.h>
 
+#include <lamp_utils/Metrics.h>
 #include <lamp_utils/PrefixHandling.h>
 
+#include "lamp_pgo/ChangedKeys.h"
+#include "lamp_pgo/ParallelPcm.h"
+#include "lamp_pgo/SkeletonGraph.h"
+#include "lamp_pgo/SolverStats.h"
+
 #include "KimeraRPGO/RobustSolver.h"
 
 class LampPgo {
@@ -36,7 +50,10 @@ class LampPgo {
  private:
   // define publishers and subscribers
   ros::Publisher optimized_pub_;
+  ros::Publisher changed_keys_pub_;
   ros::Publisher ignored_list_pub_;
+  ros::Publisher stats_pub_;
+  lamp_utils::MetricsPublisher metrics_publisher_;
 
   ros::Subscriber input_sub_;
 
@@ -50,10 +67,94 @@ class LampPgo {
   // reset subscriber
   ros::Subscriber reset_sub_;
 
-  void PublishValues() const;
+  // Marginal covariances of a set of keys on demand
+  ros::ServiceServer marginal_covariance_srv_;
+
+  // Publish the optimized values, stamped with the next generation in
+  // header.seq so that consumers can discard stale results, and the keys
+  // that moved on changed_keys
+  void PublishValues();
+
+  // Marginal covariance of a key in the last solve, cached until the next
+  // one. False if the key has none, b_marginals_indeterminant_ is set if the
+  // graph could not be factorized. Requires solver_mutex_
+  bool GetMarginalCovariance(gtsam::Key key, gtsam::Matrix* covariance);
+
+  // Drop the factorization and the cached marginals of the previous solve
+  void ResetMarginals();
 
+  bool MarginalCovarianceCallback(
+      pose_graph_msgs::MarginalCovariance::Request& request,
+      pose_graph_msgs::MarginalCovariance::Response& response);
+
+  // Publish the statistics of the last update and export them if due
+  void PublishStats();
+
+  // Queue the graph for the solver thread (or solve directly if not async)
   void InputCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
 
+  // Run the solver on a graph message. Requires solver_mutex_
+  void ProcessGraph(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
+
+  // Odometry the sender put in place of nodes it marginalized, spanning
+  // nodes still solved here. The solver keeps the dense chain instead.
+  bool BridgesKnownNodes(const gtsam::NonlinearFactor& factor) const;
+
+  // Add new factors and values to the incremental solver. Returns false if
+  // the update failed, in which case a batch update is needed
+  bool UpdateIncremental(const gtsam::NonlinearFactorGraph& new_factors,
+                         const gtsam::Values& new_values);
+
+  // Add new factors and values, along with the odometry deferred by the
+  // incremental updates, to the robust solver and reseed the incremental one
+  // (unless b_reseed is false). If loop closures are removed the robust
+  // solver is rebuilt without them.
+  void UpdateBatch(const gtsam::NonlinearFactorGraph& new_factors,
+                   const gtsam::Values& new_values,
+                   const gtsam::NonlinearFactorGraph& removed =
+                       gtsam::NonlinearFactorGraph(),
+                   bool b_reseed = true);
+
+  // Chain the new values that follow a node already solved from its solution
+  // with the new odometry, instead of the poses of the message, which are
+  // propagated from a possibly older solution. Returns the number updated
+  size_t WarmStartNewValues(const gtsam::NonlinearFactorGraph& new_factors,
+                            gtsam::Values* new_values) const;
+
+  // Run the consistency check of pcm_ on the new loop closures. Only the
+  // inliers are left in new_factors, previous inliers that are now rejected
+  // are returned in removed
+  void CheckLoopClosures(gtsam::NonlinearFactorGraph* new_factors,
+                         gtsam::NonlinearFactorGraph* removed);
+
+  // Read the values and factors from the robust solver, the dense ones in
+  // the skeleton mode
+  void ExtractEstimate();
+
+  // Drop a loop closure (keys of the robust solver) removed from the robust
+  // solver from pcm_ and skeleton_
+  void ForgetLoopClosure(gtsam::Key from, gtsam::Key to);
+
+  // Hand the deferred odometry to the robust solver before modifying it. The
+  // incremental solver already holds that odometry, reseeding it is left to
+  // the caller when b_reseed is false.
+  void FlushIncremental(bool b_reseed = true);
+
+  // Rebuild the incremental solver from the robust solver result
+  void ReseedIncremental();
+
+  // Remove (b_ignore) or add back the loop closures of a robot in the
+  // incremental solver after the robust solver ignored or revived them,
+  // instead of reseeding it. Returns false if it has to be reseeded.
+  bool UpdateIncrementalPrefix(char prefix, bool b_ignore);
+
+  // Solver thread loop, processes the coalesced pending graph
+  void SolverThread();
+
+  // Merge nodes and edges of input into pending (newer entries win)
+  static void MergeGraphMsg(const pose_graph_msgs::PoseGraph& input,
+                            pose_graph_msgs::PoseGraph* pending);
+
   void RemoveLCByIdCallback(const std_msgs::String::ConstPtr& msg);
 
   void RemoveLCCallback(const std_msgs::Bool::ConstPtr& msg);
@@ -77,7 +178,8 @@ class LampPgo {
 
   gtsam::Values values_;
   gtsam::NonlinearFactorGraph nfg_;
-  gtsam::NonlinearFactorGraph nfg_all_;
+  // Keys of all the added factors (including rejected ones)
+  std::set<gtsam::KeyVector> factor_keys_;
 
   // Parameter namespace ("robot" or "base")
   std::string param_ns_;
@@ -92,6 +194,66 @@ class LampPgo {
 
   // Max loop closure factor error
   double max_lc_error_;
+
+  // Start the new tail of the graph from the previous solution
+  bool b_warm_start_{true};
+
+  // Run the solver on a dedicated thread
+  bool b_async_solver_{false};
+  std::thread solver_thread_;
+  bool b_shutdown_{false};
+
+  // Graphs received while the solver is busy are merged into one batch
+  std::mutex input_mutex_;
+  std::condition_variable input_cv_;
+  pose_graph_msgs::PoseGraph::Ptr pending_graph_;
+
+  // Solve odometry only updates with iSAM2 and run the robust batch solver
+  // only when loop closures (or artifact, UWB... factors) arrive
+  bool b_incremental_solver_{false};
+  std::unique_ptr<gtsam::ISAM2> isam2_;
+  // Factor index in isam2_ of the loop closures it holds, by factor keys
+  std::map<gtsam::KeyVector, size_t> isam2_loop_closures_;
+  // Odometry added to isam2_ but not yet to the robust solver
+  gtsam::NonlinearFactorGraph deferred_factors_;
+  gtsam::Values deferred_values_;
+
+  // Consistency check of the loop closures done here instead of in
+  // KimeraRPGO, in parallel and cached between updates
+  std::unique_ptr<ParallelPcm> pcm_;
+
+  // Hierarchical mode: the robust solver only holds the skeleton of keyframes
+  // and separators, the dense nodes are recovered from it
+  std::unique_ptr<SkeletonGraph> skeleton_;
+  gtsam::Values skeleton_values_;
+  size_t skeleton_spacing_{1};
+
+  // Factorization of the last solve (none with the incremental solver, which
+  // has its own Bayes tree) and the marginals computed from it
+  std::unique_ptr<gtsam::Marginals> marginals_;
+  std::unordered_map<gtsam::Key, gtsam::Matrix> marginal_cache_;
+  bool b_marginals_indeterminant_{false};
+  // Compute the marginals of all the nodes for optimized_values, otherwise
+  // only on request
+  bool b_publish_marginals_{true};
+
+  // Statistics of the last update
+  bool b_publish_stats_{false};
+  SolverStats stats_;
+  size_t num_loop_closures_{0};
+  // Prometheus textfile export, disabled if empty
+  std::string stats_prometheus_file_;
+  double stats_export_period_{0};
+  ros::WallTime last_stats_export_;
+
+  // Guards the solver, values and factors
+  std::mutex solver_mutex_;
+
+  // Counter for published optimizer results
+  uint32_t generation_{0};
+
+  // Keys of the published results that moved since they were last reported
+  ChangedKeysTracker changed_keys_;
 };
 
 #endif  // LAMP_PGO_H_
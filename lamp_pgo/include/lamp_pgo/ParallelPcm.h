@@ -0,0 +1,94 @@
+/*
+ParallelPcm.h
+Pairwise consistency maximization of loop closures, with the consistency
+checks spread over threads and cached between updates
+*/
+
+#ifndef PARALLEL_PCM_H_
+#define PARALLEL_PCM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/slam/BetweenFactor.h>
+
+typedef gtsam::BetweenFactor<gtsam::Pose3> Pose3Between;
+
+// Same check as the simple 3D PCM of KimeraRPGO: two loop closures between
+// the same pair of robots are consistent if the cycle they form with the
+// odometry of the two robots is within the translation and rotation
+// thresholds. The loop closures are grouped by robot pair, and the inliers
+// of a group are the (heuristic) maximum clique of its consistency graph.
+// The consistency of the loop closures already checked is kept, so an
+// update only checks the new loop closures against their group.
+class ParallelPcm {
+public:
+  // num_threads 0 uses all the cores
+  ParallelPcm(double translation_threshold,
+              double rotation_threshold,
+              size_t num_threads);
+
+  // Odometry between consecutive keys of a robot, chained into its
+  // odometric trajectory
+  void AddOdometry(const Pose3Between& factor);
+
+  // Check the new loop closures and update the maximum cliques of the groups
+  // they fall in. Returns the loop closures that became inliers in added and
+  // the ones that are no longer inliers in removed.
+  void AddLoopClosures(const std::vector<Pose3Between::shared_ptr>& factors,
+                       gtsam::NonlinearFactorGraph* added,
+                       gtsam::NonlinearFactorGraph* removed);
+
+  // Forget a loop closure (removed from the solver). Returns false if it is
+  // not known
+  bool Remove(gtsam::Key from, gtsam::Key to);
+
+  void Clear();
+
+  inline size_t NumLoopClosures() const { return num_loop_closures_; }
+  size_t NumInliers() const;
+
+private:
+  struct LoopClosure {
+    Pose3Between::shared_ptr factor;
+    // Oriented from the first robot of the group to the second
+    gtsam::Key a, b;
+    gtsam::Pose3 measured;
+    bool b_removed{false};
+  };
+
+  struct Group {
+    std::vector<LoopClosure> loop_closures;
+    // Sorted indices of the consistent loop closures
+    std::vector<std::vector<uint32_t>> neighbors;
+    // Sorted indices of the current maximum clique
+    std::vector<uint32_t> inliers;
+  };
+
+  bool IsConsistent(const LoopClosure& lc1, const LoopClosure& lc2) const;
+
+  // Check the loop closures from index first on of a group against all the
+  // ones before them
+  void CheckNew(Group* group, size_t first) const;
+
+  static std::vector<uint32_t> MaxClique(const Group& group);
+
+  double translation_threshold_;
+  double rotation_threshold_;
+  size_t num_threads_;
+
+  // Odometric trajectories
+  std::unordered_map<gtsam::Key, gtsam::Pose3> odom_poses_;
+
+  std::map<std::pair<char, char>, Group> groups_;
+  size_t num_loop_closures_{0};
+};
+
+#endif  // PARALLEL_PCM_H_
@@ -0,0 +1,120 @@
+/*
+SkeletonGraph.h
+Condensed pose graph of keyframes and separators for the hierarchical solve
+*/
+
+#ifndef SKELETON_GRAPH_H_
+#define SKELETON_GRAPH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/slam/BetweenFactor.h>
+
+// Keeps the odometry of every robot chain and condenses it between skeleton
+// nodes: the first node of the chain, every spacing-th node and the
+// separators, the nodes touched by any other factor (loop closures,
+// artifacts, priors...). The global solve runs over the condensed odometry
+// and the other factors only, and the dense nodes are then recovered from
+// the optimized skeleton chain by chain, in parallel.
+// The skeleton nodes of a chain are numbered consecutively in the solver, so
+// that the condensed odometry is still odometry to KimeraRPGO (PCM, GNC).
+class SkeletonGraph {
+public:
+  explicit SkeletonGraph(size_t spacing);
+
+  // Add dense factors. Odometry between consecutive keys is kept for
+  // condensing, the other factors are passed to the skeleton as they are.
+  void Add(const gtsam::NonlinearFactorGraph& factors);
+
+  // Forget passed through factors (rejected after they were added)
+  void Remove(const gtsam::NonlinearFactorGraph& factors);
+  void Remove(gtsam::Key from, gtsam::Key to);
+
+  // Skeleton factors, with the values of their keys new to the solver taken
+  // from the dense estimate, added since the last call. Returns true instead
+  // if a separator fell inside a condensed segment: the solver has to be
+  // rebuilt and factors and values then hold the whole skeleton.
+  bool Update(const gtsam::Values& estimate,
+              gtsam::NonlinearFactorGraph* factors,
+              gtsam::Values* values);
+
+  // The whole skeleton, for a rebuild of the solver
+  void Build(const gtsam::Values& estimate,
+             gtsam::NonlinearFactorGraph* factors,
+             gtsam::Values* values);
+
+  // Update the dense values from the optimized skeleton. Every segment is
+  // chained from its start and the mismatch at its end is spread along it.
+  void Densify(const gtsam::Values& skeleton_values,
+               gtsam::Values* dense) const;
+
+  // Add the new values to dense, chaining them from their predecessor by
+  // odometry if possible
+  void Propagate(const gtsam::Values& new_values, gtsam::Values* dense) const;
+
+  // The dense odometry and the passed through factors still in the solver
+  gtsam::NonlinearFactorGraph
+  DenseFactors(const gtsam::NonlinearFactorGraph& solver_factors) const;
+
+  // Solver key of a dense key, false if the key is not in the skeleton
+  bool SolverKey(gtsam::Key key, gtsam::Key* solver_key) const;
+  // Dense key of a solver key
+  gtsam::Key DenseKey(gtsam::Key solver_key) const;
+  // Solver key of the skeleton node at or before a dense key
+  bool SkeletonKey(gtsam::Key key, gtsam::Key* solver_key) const;
+
+  void Clear();
+
+private:
+  typedef gtsam::BetweenFactor<gtsam::Pose3> Pose3Between;
+
+  struct Chain {
+    char prefix;
+    // Odometry by index of its from key
+    std::map<uint64_t, Pose3Between::shared_ptr> odometry;
+    // Separators not yet in the skeleton
+    std::set<uint64_t> separators;
+    // Indices of the skeleton nodes in the solver, by solver index
+    std::vector<uint64_t> nodes;
+    std::map<uint64_t, uint64_t> node_index;
+  };
+
+  // Condense the odometry of the chain after its last node
+  void CondenseChain(Chain* chain,
+                     const gtsam::Values& estimate,
+                     gtsam::NonlinearFactorGraph* factors,
+                     gtsam::Values* values);
+
+  // Add a node to the solver, with its value from estimate
+  void AddNode(Chain* chain,
+               uint64_t index,
+               const gtsam::Values& estimate,
+               gtsam::Values* values);
+
+  // Add a passed through factor to the skeleton, with the values of its new
+  // keys. Returns false if one of its nodes is not in the skeleton yet.
+  bool AddFactor(const gtsam::NonlinearFactor::shared_ptr& factor,
+                 const gtsam::Values& estimate,
+                 gtsam::NonlinearFactorGraph* factors,
+                 gtsam::Values* values);
+
+  size_t spacing_;
+  std::map<char, Chain> chains_;
+
+  // Factors passed through, and those not yet in the skeleton
+  gtsam::NonlinearFactorGraph others_;
+  gtsam::NonlinearFactorGraph pending_;
+
+  // Keys other than the skeleton nodes in the solver (artifacts...)
+  gtsam::KeySet other_keys_;
+};
+
+#endif  // SKELETON_GRAPH_H_
@@ -0,0 +1,67 @@
+/*
+SolverStats.h
+Timing and size statistics of the LampPgo solver updates
+*/
+
+#ifndef SOLVER_STATS_H_
+#define SOLVER_STATS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <diagnostic_msgs/DiagnosticStatus.h>
+
+struct SolverStats {
+  // Generation of the published result (header.seq of optimized_values)
+  uint32_t generation{0};
+  // Whether the update was solved incrementally
+  bool b_incremental{false};
+
+  // Wall time of the update phases (ms). The robust solve includes PCM, GNC
+  // and the batch iterations, which KimeraRPGO does not time separately
+  double convert_ms{0};
+  double extract_ms{0};
+  double incremental_ms{0};
+  double robust_solve_ms{0};
+  double reseed_ms{0};
+  double marginals_ms{0};
+  double publish_ms{0};
+  double total_ms{0};
+
+  size_t num_new_factors{0};
+  size_t num_new_values{0};
+  // New values chained from the previous solution
+  size_t num_warm_started{0};
+  size_t num_factors{0};
+  size_t num_values{0};
+
+  // Loop closures added, kept by PCM, and then kept by GNC. Updated on the
+  // batch solves only
+  size_t num_loop_closures{0};
+  size_t num_lc_inliers{0};
+  size_t num_lc_outliers{0};
+
+  // Work done by the last incremental update
+  size_t num_relinearized{0};
+  size_t num_reeliminated{0};
+  size_t num_cliques{0};
+
+  // Resident memory of the process (kB)
+  size_t memory_kb{0};
+};
+
+// Resident set size of this process (kB), 0 if unavailable
+size_t ResidentMemoryKb();
+
+void SolverStatsToDiagnostic(const SolverStats& stats,
+                             const std::string& name,
+                             diagnostic_msgs::DiagnosticStatus* status);
+
+// Write the statistics in the Prometheus text format, for the textfile
+// collector of node_exporter. The file is replaced atomically.
+bool WriteSolverStatsPrometheus(const SolverStats& stats,
+                                const std::string& name,
+                                const std::string& filename);
+
+#endif  // SOLVER_STATS_H_
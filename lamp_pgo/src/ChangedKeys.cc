@@ -0,0 +1,79 @@
+/*
+ChangedKeys.cc
+Keys of the optimized values that moved since they were last reported
+*/
+
+#include "lamp_pgo/ChangedKeys.h"
+
+#include <algorithm>
+#include <map>
+
+#include <gtsam/inference/Symbol.h>
+
+#include <lamp_utils/PrefixHandling.h>
+
+void ChangedKeysTracker::SetThresholds(double translation, double rotation) {
+  translation_threshold_ = translation;
+  rotation_threshold_ = rotation;
+}
+
+void ChangedKeysTracker::Update(const gtsam::Values& values,
+                                pose_graph_msgs::ChangedKeys* msg) {
+  msg->b_full = b_full_;
+  msg->keys.clear();
+  msg->displacements.clear();
+  msg->removed_keys.clear();
+  msg->robot_prefixes.clear();
+  msg->max_displacements.clear();
+
+  std::map<unsigned char, double> max_displacements;
+  for (const auto& key_value : values) {
+    auto value = dynamic_cast<const gtsam::GenericValue<gtsam::Pose3>*>(
+        &key_value.value);
+    if (!value) {
+      continue;
+    }
+    const gtsam::Pose3& pose = value->value();
+    double displacement = 0;
+    auto reported = reported_.find(key_value.key);
+    if (reported == reported_.end()) {
+      reported_.emplace(key_value.key, pose);
+    } else {
+      const gtsam::Pose3 delta = reported->second.between(pose);
+      displacement = delta.translation().norm();
+      if (!b_full_ && displacement < translation_threshold_ &&
+          gtsam::Rot3::Logmap(delta.rotation()).norm() < rotation_threshold_) {
+        continue;
+      }
+      reported->second = pose;
+    }
+    msg->keys.push_back(key_value.key);
+    msg->displacements.push_back(displacement);
+
+    const unsigned char prefix = gtsam::Symbol(key_value.key).chr();
+    if (lamp_utils::IsRobotPrefix(prefix)) {
+      double& max_displacement = max_displacements[prefix];
+      max_displacement = std::max(max_displacement, displacement);
+    }
+  }
+
+  for (auto it = reported_.begin(); it != reported_.end();) {
+    if (values.exists(it->first)) {
+      it++;
+      continue;
+    }
+    msg->removed_keys.push_back(it->first);
+    it = reported_.erase(it);
+  }
+
+  for (const auto& kv : max_displacements) {
+    msg->robot_prefixes.push_back(kv.first);
+    msg->max_displacements.push_back(kv.second);
+  }
+  b_full_ = false;
+}
+
+void ChangedKeysTracker::Reset() {
+  reported_.clear();
+  b_full_ = true;
+}
@@ -6,7 +6,12 @@ Interface for ROS and KimeraRPGO
 
 #include "lamp_pgo/LampPgo.h"
 
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include <gtsam/geometry/Point3.h>
@@ -15,6 +20,10 @@ Interface for ROS and KimeraRPGO
 
 #include <parameter_utils/ParameterUtils.h>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/ThreadGovernor.h>
+#include <lamp_utils/Tracing.h>
+
+#include <diagnostic_msgs/DiagnosticArray.h>
 
 #include "pose_graph_msgs/PoseGraphNode.h"
 
@@ -23,8 +32,57 @@ using gtsam::Values;
 
 namespace pu = parameter_utils;
 
+namespace {
+
+// Factors above this error after a solve are likely GNC outliers
+const double kHighFactorError = 10.0;
+
+// Loop closure between two robot keys
+bool IsLoopClosure(const gtsam::NonlinearFactor& factor) {
+  return lamp_utils::IsRobotPrefix(gtsam::Symbol(factor.back()).chr()) &&
+      lamp_utils::IsRobotPrefix(gtsam::Symbol(factor.front()).chr()) &&
+      factor.back() != factor.front() + 1;
+}
+
+// One of the keys has the prefix
+bool HasPrefix(const gtsam::KeyVector& keys, char prefix) {
+  for (gtsam::Key key : keys) {
+    if (gtsam::Symbol(key).chr() == prefix) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Priors and other unary factors, or odometry between consecutive keys
+bool IsOdometryOrUnary(const gtsam::NonlinearFactor& factor) {
+  if (factor.size() == 1) {
+    return true;
+  }
+  return factor.size() == 2 &&
+      lamp_utils::IsRobotPrefix(gtsam::Symbol(factor.front()).chr()) &&
+      factor.back() == factor.front() + 1;
+}
+
+double MillisecondsSince(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+} // namespace
+
 LampPgo::LampPgo() {}
-LampPgo::~LampPgo() {}
+LampPgo::~LampPgo() {
+  if (solver_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(input_mutex_);
+      b_shutdown_ = true;
+    }
+    input_cv_.notify_all();
+    solver_thread_.join();
+  }
+}
 
 bool LampPgo::Initialize(const ros::NodeHandle& n) {
   // Create subscriber and publisher
@@ -35,12 +93,17 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
       nl.advertise<pose_graph_msgs::PoseGraph>("optimized_values", 10, false);
   // TODO - make names uniform? - "optimized_values"(here) =
   // "back_end_pose_graph"(lamp)
+  changed_keys_pub_ = nl.advertise<pose_graph_msgs::ChangedKeys>(
+      "optimized_values_changed_keys", 10, false);
   ignored_list_pub_ =
       nl.advertise<std_msgs::String>("ignored_robots", 10, true);
+  stats_pub_ =
+      nl.advertise<diagnostic_msgs::DiagnosticArray>("solver_stats", 10, false);
+  metrics_publisher_.Start(nl);
 
   // Subscriber
   input_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
-      "pose_graph_to_optimize", 1, &LampPgo::InputCallback, this);
+      "pose_graph_to_optimize", 10, &LampPgo::InputCallback, this);
   remove_lc_sub_ = nl.subscribe<std_msgs::Bool>(
       "remove_loop_closure", 1, &LampPgo::RemoveLCCallback, this);
   remove_lc_by_id_sub_ = nl.subscribe<std_msgs::String>(
@@ -52,6 +115,10 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
   reset_sub_ =
       nl.subscribe<std_msgs::Bool>("reset", 1, &LampPgo::ResetCallback, this);
 
+  // Service
+  marginal_covariance_srv_ = nl.advertiseService(
+      "marginal_covariance", &LampPgo::MarginalCovarianceCallback, this);
+
   // Parse parameters
   // Optimizer backend
   ROS_INFO_STREAM("PGO NODE NAMESPACE: " << n.getNamespace());
@@ -72,8 +139,20 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
     bool b_gnc_bias_odom;
     if (!pu::Get(param_ns_ + "/b_gnc_bias_odom", b_gnc_bias_odom))
       return false;
-    rpgo_params_.setPcmSimple3DParams(
-        trans_threshold, rot_threshold, KimeraRPGO::Verbosity::VERBOSE);
+    bool b_parallel_pcm;
+    int pcm_threads;
+    if (!pu::Get(param_ns_ + "/b_parallel_pcm", b_parallel_pcm))
+      return false;
+    if (!pu::Get(param_ns_ + "/pcm_threads", pcm_threads)) return false;
+    if (b_parallel_pcm) {
+      // Consistency checked by pcm_, KimeraRPGO only runs GNC
+      rpgo_params_.setNoRejection(KimeraRPGO::Verbosity::VERBOSE);
+      pcm_.reset(new ParallelPcm(
+          trans_threshold, rot_threshold, std::max(0, pcm_threads)));
+    } else {
+      rpgo_params_.setPcmSimple3DParams(
+          trans_threshold, rot_threshold, KimeraRPGO::Verbosity::VERBOSE);
+    }
     if (gnc_alpha > 0 && gnc_alpha < 1) {
       rpgo_params_.setGncInlierCostThresholdsAtProbability(gnc_alpha);
       if (b_gnc_bias_odom)
@@ -106,6 +185,48 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/max_lc_error", max_lc_error_))
     return false;
 
+  if (!pu::Get(param_ns_ + "/b_warm_start", b_warm_start_))
+    return false;
+  if (!pu::Get(param_ns_ + "/b_async_solver", b_async_solver_))
+    return false;
+
+  if (!pu::Get(param_ns_ + "/b_incremental_solver", b_incremental_solver_))
+    return false;
+
+  bool b_skeleton_solver;
+  int skeleton_spacing;
+  if (!pu::Get(param_ns_ + "/b_skeleton_solver", b_skeleton_solver))
+    return false;
+  if (!pu::Get(param_ns_ + "/skeleton_spacing", skeleton_spacing))
+    return false;
+  if (b_skeleton_solver) {
+    skeleton_spacing_ = std::max(1, skeleton_spacing);
+    skeleton_.reset(new SkeletonGraph(skeleton_spacing_));
+    if (b_incremental_solver_) {
+      ROS_WARN("Skeleton solver enabled, disabling the incremental solver");
+      b_incremental_solver_ = false;
+    }
+  }
+
+  if (!pu::Get(param_ns_ + "/b_publish_marginals", b_publish_marginals_))
+    return false;
+
+  double changed_translation, changed_rotation;
+  if (!pu::Get(param_ns_ + "/changed_keys_translation_threshold",
+               changed_translation))
+    return false;
+  if (!pu::Get(param_ns_ + "/changed_keys_rotation_threshold",
+               changed_rotation))
+    return false;
+  changed_keys_.SetThresholds(changed_translation, changed_rotation);
+
+  if (!pu::Get(param_ns_ + "/b_publish_stats", b_publish_stats_))
+    return false;
+  if (!pu::Get(param_ns_ + "/stats_prometheus_file", stats_prometheus_file_))
+    return false;
+  if (!pu::Get(param_ns_ + "/stats_export_period", stats_export_period_))
+    return false;
+
   std::string log_path;
   if (pu::Get("log_path", log_path)) {
     rpgo_params_.logOutput(log_path);
@@ -117,16 +238,25 @@ bool LampPgo::Initialize(const ros::NodeHandle& n) {
   // Publish ignored list once
   PublishIgnoredList();
 
+  // Start the solver thread
+  if (b_async_solver_) {
+    solver_thread_ = std::thread(&LampPgo::SolverThread, this);
+  }
+
   return true;
 }
 
 void LampPgo::RemoveLastLoopClosure(char prefix_1, char prefix_2) {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  FlushIncremental();
   KimeraRPGO::EdgePtr removed_edge =
       pgo_solver_->removeLastLoopClosure(prefix_1, prefix_2);
   if (removed_edge != NULL) {
     // Extract the optimized values
-    values_ = pgo_solver_->calculateEstimate();
-    nfg_ = pgo_solver_->getFactorsUnsafe();
+    ExtractEstimate();
+    ReseedIncremental();
+
+    ForgetLoopClosure(removed_edge->from_key, removed_edge->to_key);
 
     ROS_INFO_STREAM("Removed last loop closure between "
                     << gtsam::DefaultKeyFormatter(removed_edge->from_key)
@@ -141,11 +271,15 @@ void LampPgo::RemoveLastLoopClosure(char prefix_1, char prefix_2) {
 }
 
 void LampPgo::RemoveLastLoopClosure() {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  FlushIncremental();
   KimeraRPGO::EdgePtr removed_edge = pgo_solver_->removeLastLoopClosure();
   if (removed_edge != NULL) {
     // Extract the optimized values
-    values_ = pgo_solver_->calculateEstimate();
-    nfg_ = pgo_solver_->getFactorsUnsafe();
+    ExtractEstimate();
+    ReseedIncremental();
+
+    ForgetLoopClosure(removed_edge->from_key, removed_edge->to_key);
 
     ROS_INFO_STREAM("Removed last loop closure between "
                     << gtsam::DefaultKeyFormatter(removed_edge->from_key)
@@ -174,24 +308,149 @@ void LampPgo::RemoveLCCallback(const std_msgs::Bool::ConstPtr& msg) {
 
 void LampPgo::ResetCallback(const std_msgs::Bool::ConstPtr& msg) {
   if (msg->data) {
+    // Drop graphs queued before the reset
+    {
+      std::lock_guard<std::mutex> lock(input_mutex_);
+      pending_graph_.reset();
+    }
+
     // Re-initialize solver
+    std::lock_guard<std::mutex> lock(solver_mutex_);
     pgo_solver_.reset(new KimeraRPGO::RobustSolver(rpgo_params_));
     values_ = Values();
     nfg_ = NonlinearFactorGraph();
-    nfg_all_ = NonlinearFactorGraph();
+    factor_keys_.clear();
+    if (pcm_) {
+      pcm_->Clear();
+    }
+    if (skeleton_) {
+      skeleton_->Clear();
+      skeleton_values_ = Values();
+    }
+    isam2_.reset();
+    isam2_loop_closures_.clear();
+    deferred_factors_ = NonlinearFactorGraph();
+    deferred_values_ = Values();
+    ResetMarginals();
+    changed_keys_.Reset();
   }
 }
 
 void LampPgo::InputCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  if (!b_async_solver_) {
+    std::lock_guard<std::mutex> lock(solver_mutex_);
+    ProcessGraph(graph_msg);
+    return;
+  }
+
+  // Hand over to the solver thread, coalescing with anything still pending
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    if (!pending_graph_) {
+      pending_graph_.reset(new pose_graph_msgs::PoseGraph(*graph_msg));
+    } else {
+      ROS_DEBUG("PGO busy, merging input graph into pending batch");
+      MergeGraphMsg(*graph_msg, pending_graph_.get());
+    }
+  }
+  input_cv_.notify_one();
+}
+
+void LampPgo::SolverThread() {
+  lamp_utils::ThreadGovernor::Instance().RegisterThread("pgo_solver");
+  while (true) {
+    pose_graph_msgs::PoseGraph::ConstPtr graph_msg;
+    {
+      std::unique_lock<std::mutex> lock(input_mutex_);
+      input_cv_.wait(lock, [this] { return b_shutdown_ || pending_graph_; });
+      if (b_shutdown_)
+        return;
+      graph_msg = pending_graph_;
+      pending_graph_.reset();
+    }
+
+    std::lock_guard<std::mutex> lock(solver_mutex_);
+    ProcessGraph(graph_msg);
+  }
+}
+
+void LampPgo::MergeGraphMsg(const pose_graph_msgs::PoseGraph& input,
+                            pose_graph_msgs::PoseGraph* pending) {
+  pending->header = input.header;
+  pending->incremental = pending->incremental && input.incremental;
+
+  // Nodes by key
+  std::map<gtsam::Key, size_t> node_index;
+  for (size_t i = 0; i < pending->nodes.size(); i++) {
+    node_index[pending->nodes[i].key] = i;
+  }
+  for (const auto& node : input.nodes) {
+    auto it = node_index.find(node.key);
+    if (it != node_index.end()) {
+      pending->nodes[it->second] = node;
+    } else {
+      node_index[node.key] = pending->nodes.size();
+      pending->nodes.push_back(node);
+    }
+  }
+
+  // Edges by keys and type
+  std::map<std::tuple<gtsam::Key, gtsam::Key, int32_t>, size_t> edge_index;
+  for (size_t i = 0; i < pending->edges.size(); i++) {
+    const auto& e = pending->edges[i];
+    edge_index[std::make_tuple(e.key_from, e.key_to, e.type)] = i;
+  }
+  for (const auto& edge : input.edges) {
+    auto edge_key = std::make_tuple(edge.key_from, edge.key_to, edge.type);
+    auto it = edge_index.find(edge_key);
+    if (it != edge_index.end()) {
+      pending->edges[it->second] = edge;
+    } else {
+      edge_index[edge_key] = pending->edges.size();
+      pending->edges.push_back(edge);
+    }
+  }
+}
+
+bool LampPgo::BridgesKnownNodes(const gtsam::NonlinearFactor& factor) const {
+  if (factor.size() != 2) {
+    return false;
+  }
+  const gtsam::Symbol from(factor.front());
+  const gtsam::Symbol to(factor.back());
+  auto type = edge_to_type_.find(std::make_pair(to.key(), from.key()));
+  if (type == edge_to_type_.end() ||
+      type->second != pose_graph_msgs::PoseGraphEdge::ODOM ||
+      from.chr() != to.chr() || to.index() <= from.index() + 1) {
+    return false;
+  }
+  for (uint64_t index = from.index() + 1; index < to.index(); index++) {
+    if (values_.exists(gtsam::Symbol(from.chr(), index))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void LampPgo::ProcessGraph(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
   // Callback for the input posegraph
+  lamp_utils::TraceSpan span("pgo.process_graph");
+  if (!graph_msg->nodes.empty()) {
+    span.SetKey(graph_msg->nodes.back().key);
+  }
   NonlinearFactorGraph all_factors, new_factors;
   Values all_values, new_values;
+  const auto t_start = std::chrono::steady_clock::now();
+  stats_.incremental_ms = stats_.robust_solve_ms = stats_.reseed_ms = 0;
 
   ROS_DEBUG_STREAM("PGO received graph of size " << graph_msg->nodes.size());
 
   // Convert to gtsam type
   lamp_utils::PoseGraphMsgToGtsam(graph_msg, &all_factors, &all_values);
+  stats_.convert_ms = MillisecondsSince(t_start);
+  const auto t_extract = std::chrono::steady_clock::now();
 
   // Track node IDs
   for (auto n : graph_msg->nodes) {
@@ -216,64 +475,98 @@ void LampPgo::InputCallback(
     }
   }
 
-  gtsam::Values temp_values = values_;
-  temp_values.insert(new_values);
-
-  // Extract the new factors
-  for (size_t i = 0; i < all_factors.size(); i++) {
-    bool factor_exists = false;
-    for (size_t j = 0; j < nfg_all_.size(); j++) {
-      if (nfg_all_[j]->keys() == all_factors[i]->keys()) {
-        factor_exists = true;
-        break;
-      }
+  // Extract the new factors. Values with the new ones are only needed to
+  // check loop closures
+  std::unique_ptr<Values> temp_values;
+  // The skeleton mode handles odometry without the solver
+  bool b_batch = !skeleton_ && (!b_incremental_solver_ || !isam2_);
+  for (const auto& factor : all_factors) {
+    if (factor_keys_.count(factor->keys())) {
+      // this factor exists before
+      continue;
     }
-    if (!factor_exists) {
-      // this factor does not exist before
-      bool loop_closure =
-          (lamp_utils::IsRobotPrefix(gtsam::Symbol(all_factors[i]->back()).chr()) &&
-           lamp_utils::IsRobotPrefix(gtsam::Symbol(all_factors[i]->front()).chr()) &&
-           all_factors[i]->back() != all_factors[i]->front() + 1);
-      if (!loop_closure) {
-        new_factors.add(all_factors[i]);
-      } else {
-        if (all_factors[i]->error(temp_values) < max_lc_error_)
-          new_factors.add(all_factors[i]);
-        else {
-          ROS_WARN("Loop closure discarded because of large error. ");
-        }
+    if (BridgesKnownNodes(*factor)) {
+      continue;
+    }
+    if (IsLoopClosure(*factor)) {
+      if (!temp_values) {
+        temp_values.reset(new Values(values_));
+        temp_values->insert(new_values);
       }
+      if (factor->error(*temp_values) >= max_lc_error_) {
+        ROS_WARN("Loop closure discarded because of large error. ");
+        continue;
+      }
+      num_loop_closures_++;
+    }
+    if (!IsOdometryOrUnary(*factor)) {
+      b_batch = true;
     }
+    new_factors.add(factor);
+    // Track all the added factors (including rejected ones)
+    factor_keys_.insert(factor->keys());
   }
 
   ROS_DEBUG_STREAM("PGO adding new values " << new_values.size());
   for (auto k : new_values) {
     ROS_DEBUG_STREAM("\t" << gtsam::DefaultKeyFormatter(k.key));
   }
-  ROS_DEBUG_STREAM("PGO adding new factors " << new_factors.size());
+  NonlinearFactorGraph removed_factors;
+  if (pcm_) {
+    CheckLoopClosures(&new_factors, &removed_factors);
+  }
 
-  // new_factors.print("new factors");
+  if (skeleton_) {
+    skeleton_->Add(new_factors);
+  }
 
-  ROS_DEBUG_STREAM("FACTORS BEFORE");
+  // The skeleton mode chains the dense nodes itself
+  stats_.num_warm_started = 0;
+  if (b_warm_start_ && !skeleton_) {
+    stats_.num_warm_started = WarmStartNewValues(new_factors, &new_values);
+  }
 
-  // Run the optimizer
-  pgo_solver_->update(new_factors, new_values);
-  // Track all the added factors (including rejected ones)
-  nfg_all_.add(new_factors);
+  ROS_DEBUG_STREAM("PGO adding new factors " << new_factors.size());
+  stats_.extract_ms = MillisecondsSince(t_extract);
+  stats_.num_new_factors = new_factors.size();
+  stats_.num_new_values = new_values.size();
 
-  // Extract the optimized values
-  values_ = pgo_solver_->calculateEstimate();
-  nfg_ = pgo_solver_->getFactorsUnsafe();
+  // Run the optimizer
+  if (skeleton_ && !b_batch) {
+    // Odometry only, chain the new nodes from the optimized ones
+    skeleton_->Propagate(new_values, &values_);
+    nfg_.add(new_factors);
+    stats_.b_incremental = true;
+  } else {
+    stats_.b_incremental =
+        !b_batch && UpdateIncremental(new_factors, new_values);
+  }
+  if (stats_.b_incremental) {
+    ROS_DEBUG("PGO odometry only update, solved incrementally");
+    ROS_DEBUG_STREAM("PGO stored values of size " << values_.size());
+    PublishValues();
+    stats_.total_ms = MillisecondsSince(t_start);
+    PublishStats();
+    return;
+  }
+  UpdateBatch(new_factors, new_values, removed_factors);
 
-  ROS_DEBUG_STREAM("FACTORS AFTER");
   std::vector<double> bad_errors;
+  stats_.num_loop_closures = num_loop_closures_;
+  stats_.num_lc_inliers = stats_.num_lc_outliers = 0;
   for (auto f : nfg_) {
-    // f->printKeys();
     double error = f->error(values_);
     ROS_DEBUG_STREAM("Error: " << error);
-    if (error > 10.0){
+    if (error > kHighFactorError) {
       bad_errors.push_back(error);
     }
+    if (IsLoopClosure(*f)) {
+      if (error > kHighFactorError) {
+        stats_.num_lc_outliers++;
+      } else {
+        stats_.num_lc_inliers++;
+      }
+    }
   }
 
   ROS_DEBUG_STREAM("PGO stored values of size " << values_.size());
@@ -281,6 +574,8 @@ void LampPgo::InputCallback(
 
   // publish posegraph
   PublishValues();
+  stats_.total_ms = MillisecondsSince(t_start);
+  PublishStats();
 
   if (!bad_errors.empty()) {
     ROS_WARN_STREAM("After optimization, "
@@ -289,9 +584,274 @@ void LampPgo::InputCallback(
   }
 }
 
+bool LampPgo::UpdateIncremental(const NonlinearFactorGraph& new_factors,
+                                const Values& new_values) {
+  const auto t_start = std::chrono::steady_clock::now();
+  try {
+    const gtsam::ISAM2Result result =
+        isam2_->update(new_factors, new_values);
+    stats_.num_relinearized = result.variablesRelinearized;
+    stats_.num_reeliminated = result.variablesReeliminated;
+    stats_.num_cliques = result.cliques;
+  } catch (const std::exception& e) {
+    ROS_WARN_STREAM("Incremental update failed (" << e.what()
+                                                  << "), running batch");
+    isam2_.reset();
+    return false;
+  }
+  deferred_factors_.add(new_factors);
+  deferred_values_.insert(new_values);
+  values_ = isam2_->calculateEstimate();
+  nfg_.add(new_factors);
+  stats_.incremental_ms = MillisecondsSince(t_start);
+  return true;
+}
+
+void LampPgo::UpdateBatch(const NonlinearFactorGraph& new_factors,
+                          const Values& new_values,
+                          const NonlinearFactorGraph& removed,
+                          bool b_reseed) {
+  NonlinearFactorGraph factors;
+  Values values;
+  if (skeleton_) {
+    // Solve over the skeleton, rebuilt if segments were split or loop
+    // closures removed
+    skeleton_->Propagate(new_values, &values_);
+    bool b_rebuild = !removed.empty();
+    if (b_rebuild) {
+      skeleton_->Remove(removed);
+      skeleton_->Build(values_, &factors, &values);
+    } else {
+      b_rebuild = skeleton_->Update(values_, &factors, &values);
+    }
+    if (b_rebuild) {
+      ROS_INFO_STREAM("PGO rebuilding skeleton solver with "
+                      << factors.size() << " factors");
+      pgo_solver_.reset(new KimeraRPGO::RobustSolver(rpgo_params_));
+    }
+  } else if (!removed.empty()) {
+    // Rebuild from everything held (including the deferred odometry)
+    // except the removed factors
+    ROS_INFO_STREAM("PGO rebuilding solver without " << removed.size()
+                                                     << " loop closures");
+    std::set<gtsam::KeyVector> removed_keys;
+    for (const auto& factor : removed) {
+      removed_keys.insert(factor->keys());
+    }
+    for (const auto& factor : nfg_) {
+      if (factor && !removed_keys.count(factor->keys())) {
+        factors.add(factor);
+      }
+    }
+    values = values_;
+    pgo_solver_.reset(new KimeraRPGO::RobustSolver(rpgo_params_));
+    factors.add(new_factors);
+    values.insert(new_values);
+  } else {
+    // The deferred odometry starts from the incremental estimate
+    factors = deferred_factors_;
+    for (const auto& key_value : deferred_values_) {
+      values.insert(key_value.key, values_.at(key_value.key));
+    }
+    factors.add(new_factors);
+    values.insert(new_values);
+  }
+  deferred_factors_ = NonlinearFactorGraph();
+  deferred_values_ = Values();
+
+  const auto t_solve = std::chrono::steady_clock::now();
+  pgo_solver_->update(factors, values);
+
+  // Extract the optimized values
+  ExtractEstimate();
+  stats_.robust_solve_ms = MillisecondsSince(t_solve);
+  if (!b_reseed) {
+    return;
+  }
+
+  const auto t_reseed = std::chrono::steady_clock::now();
+  ReseedIncremental();
+  stats_.reseed_ms = MillisecondsSince(t_reseed);
+}
+
+size_t LampPgo::WarmStartNewValues(const NonlinearFactorGraph& new_factors,
+                                   Values* new_values) const {
+  // Odometry of the new values by the key it leads to
+  std::unordered_map<gtsam::Key, Pose3Between::shared_ptr> odometry;
+  for (const auto& factor : new_factors) {
+    auto between = boost::dynamic_pointer_cast<Pose3Between>(factor);
+    if (between && IsOdometryOrUnary(*factor) &&
+        new_values->exists(between->key2())) {
+      odometry[between->key2()] = between;
+    }
+  }
+
+  // Values are visited in key order, so the predecessor of a new value is
+  // either solved or already chained
+  size_t num_updated = 0;
+  for (const auto& key_value : *new_values) {
+    auto it = odometry.find(key_value.key);
+    if (it == odometry.end()) {
+      continue;
+    }
+    const gtsam::Key previous = it->second->key1();
+    const gtsam::Pose3* start = nullptr;
+    if (values_.exists(previous)) {
+      start = &values_.at<gtsam::Pose3>(previous);
+    } else if (new_values->exists(previous)) {
+      start = &new_values->at<gtsam::Pose3>(previous);
+    } else {
+      continue;
+    }
+    new_values->update(key_value.key, start->compose(it->second->measured()));
+    num_updated++;
+  }
+  return num_updated;
+}
+
+void LampPgo::CheckLoopClosures(NonlinearFactorGraph* new_factors,
+                                NonlinearFactorGraph* removed) {
+  NonlinearFactorGraph checked;
+  std::vector<Pose3Between::shared_ptr> loop_closures;
+  for (const auto& factor : *new_factors) {
+    auto between = boost::dynamic_pointer_cast<Pose3Between>(factor);
+    if (between && IsLoopClosure(*factor)) {
+      loop_closures.push_back(between);
+      continue;
+    }
+    if (between && IsOdometryOrUnary(*factor)) {
+      pcm_->AddOdometry(*between);
+    }
+    checked.add(factor);
+  }
+  if (loop_closures.empty()) {
+    return;
+  }
+
+  NonlinearFactorGraph added;
+  pcm_->AddLoopClosures(loop_closures, &added, removed);
+  ROS_INFO_STREAM("PCM: " << loop_closures.size() << " new loop closures, "
+                          << added.size() << " new inliers, "
+                          << removed->size() << " rejected inliers, "
+                          << pcm_->NumInliers() << "/"
+                          << pcm_->NumLoopClosures() << " inliers in total");
+  checked.add(added);
+  *new_factors = checked;
+}
+
+void LampPgo::ExtractEstimate() {
+  if (!skeleton_) {
+    values_ = pgo_solver_->calculateEstimate();
+    nfg_ = pgo_solver_->getFactorsUnsafe();
+    return;
+  }
+  skeleton_values_ = pgo_solver_->calculateEstimate();
+  skeleton_->Densify(skeleton_values_, &values_);
+  nfg_ = skeleton_->DenseFactors(pgo_solver_->getFactorsUnsafe());
+}
+
+void LampPgo::ForgetLoopClosure(gtsam::Key from, gtsam::Key to) {
+  if (skeleton_) {
+    from = skeleton_->DenseKey(from);
+    to = skeleton_->DenseKey(to);
+    skeleton_->Remove(from, to);
+  }
+  if (pcm_) {
+    pcm_->Remove(from, to);
+  }
+}
+
+void LampPgo::FlushIncremental(bool b_reseed) {
+  if (deferred_factors_.empty() && deferred_values_.empty()) {
+    return;
+  }
+  UpdateBatch(NonlinearFactorGraph(), Values(), NonlinearFactorGraph(),
+              b_reseed);
+}
+
+void LampPgo::ReseedIncremental() {
+  isam2_.reset();
+  isam2_loop_closures_.clear();
+  if (!b_incremental_solver_ || values_.empty()) {
+    return;
+  }
+
+  // Leave out the loop closures the robust solver rejected or down weighted
+  NonlinearFactorGraph inliers;
+  for (const auto& factor : nfg_) {
+    if (factor && (!IsLoopClosure(*factor) ||
+                   factor->error(values_) <= kHighFactorError)) {
+      inliers.add(factor);
+    }
+  }
+
+  isam2_.reset(new gtsam::ISAM2());
+  try {
+    const gtsam::ISAM2Result result = isam2_->update(inliers, values_);
+    for (size_t i = 0; i < inliers.size(); i++) {
+      if (IsLoopClosure(*inliers[i])) {
+        isam2_loop_closures_[inliers[i]->keys()] = result.newFactorsIndices[i];
+      }
+    }
+  } catch (const std::exception& e) {
+    ROS_WARN_STREAM("Failed to seed the incremental solver: " << e.what());
+    isam2_.reset();
+    isam2_loop_closures_.clear();
+  }
+}
+
+bool LampPgo::UpdateIncrementalPrefix(char prefix, bool b_ignore) {
+  if (!isam2_) {
+    return false;
+  }
+
+  NonlinearFactorGraph added;
+  gtsam::FactorIndices removed;
+  if (b_ignore) {
+    for (auto it = isam2_loop_closures_.begin();
+         it != isam2_loop_closures_.end();) {
+      if (HasPrefix(it->first, prefix)) {
+        removed.push_back(it->second);
+        it = isam2_loop_closures_.erase(it);
+      } else {
+        it++;
+      }
+    }
+  } else {
+    // The revived loop closures the robust solver kept as inliers
+    for (const auto& factor : nfg_) {
+      if (factor && IsLoopClosure(*factor) &&
+          HasPrefix(factor->keys(), prefix) &&
+          !isam2_loop_closures_.count(factor->keys()) &&
+          factor->error(values_) <= kHighFactorError) {
+        added.add(factor);
+      }
+    }
+  }
+  if (added.empty() && removed.empty()) {
+    return true;
+  }
+
+  try {
+    const gtsam::ISAM2Result result =
+        isam2_->update(added, Values(), removed);
+    for (size_t i = 0; i < added.size(); i++) {
+      isam2_loop_closures_[added[i]->keys()] = result.newFactorsIndices[i];
+    }
+  } catch (const std::exception& e) {
+    ROS_WARN_STREAM("Incremental update of prefix " << prefix << " failed ("
+                                                     << e.what() << ")");
+    return false;
+  }
+  return true;
+}
+
 // TODO - check that this is ok including just the positions in the message
-void LampPgo::PublishValues() const {
+void LampPgo::PublishValues() {
+  const auto t_start = std::chrono::steady_clock::now();
   pose_graph_msgs::PoseGraph pose_graph_msg;
+  pose_graph_msg.header.stamp = ros::Time::now();
+  pose_graph_msg.header.seq = ++generation_;
   int iter_debug = 0;
   // Then store the values as nodes
   gtsam::KeyVector key_list = values_.keys();
@@ -330,36 +890,31 @@ void LampPgo::PublishValues() const {
 
     pose_graph_msg.nodes.push_back(node);
   }
-  try {
-    gtsam::Marginals marginal(nfg_, values_);
-    for (size_t k = 0 ; k < key_list.size(); ++k) {
-      auto key = key_list[k];
-      auto node = pose_graph_msg.nodes[k];
-      // covariance
-      try {
-        auto cov_matrix = marginal.marginalCovariance(gtsam::Symbol(key));
-        int iter = 0;
-        for (int i = 0; i < 6; i++) {
-          for (int j = 0; j < 6; j++) {
-            node.covariance[iter] = cov_matrix(i, j);
-            iter++;
-          }
-        }
-      }
-      catch (std::exception& e) {
-        ROS_WARN_STREAM("Key is not found in the clique"
-                        << gtsam::DefaultKeyFormatter(key));
+  const auto t_marginals = std::chrono::steady_clock::now();
+  ResetMarginals();
+  for (size_t k = 0; b_publish_marginals_ && k < key_list.size(); ++k) {
+    gtsam::Matrix cov_matrix;
+    if (!GetMarginalCovariance(key_list[k], &cov_matrix)) {
+      if (b_marginals_indeterminant_)
+        break;
+      continue;
+    }
+    auto& node = pose_graph_msg.nodes[k];
+    int iter = 0;
+    for (int i = 0; i < 6; i++) {
+      for (int j = 0; j < 6; j++) {
+        node.covariance[iter] = cov_matrix(i, j);
+        iter++;
       }
     }
-  } catch (gtsam::IndeterminantLinearSystemException e) {
+  }
+  if (b_marginals_indeterminant_) {
     ROS_ERROR_STREAM("LampPgo System is indeterminant, not computing covariance");
-      boost::array<float, 36> default_covariance;
-      default_covariance.assign(1e-4);
-      for (size_t k = 0 ; k < key_list.size(); ++k) {
-          auto node = pose_graph_msg.nodes[k];
-          node.covariance = default_covariance;
-        }
+    for (auto& node : pose_graph_msg.nodes) {
+      node.covariance.assign(1e-4);
+    }
   }
+  stats_.marginals_ms = MillisecondsSince(t_marginals);
   for (const auto& factor : nfg_) {
     if (boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3>>(factor)) {
       pose_graph_msgs::PoseGraphEdge edge;
@@ -392,17 +947,145 @@ void LampPgo::PublishValues() const {
   ROS_DEBUG_STREAM("PGO publishing graph with " << pose_graph_msg.nodes.size()
                                                 << " values");
   optimized_pub_.publish(pose_graph_msg);
+
+  // Without subscribers the moves add up until the next one is reported
+  if (changed_keys_pub_.getNumSubscribers() > 0) {
+    pose_graph_msgs::ChangedKeys changed_keys_msg;
+    changed_keys_msg.header = pose_graph_msg.header;
+    changed_keys_.Update(values_, &changed_keys_msg);
+    changed_keys_pub_.publish(changed_keys_msg);
+  }
+  stats_.publish_ms = MillisecondsSince(t_start) - stats_.marginals_ms;
+}
+
+void LampPgo::ResetMarginals() {
+  marginals_.reset();
+  marginal_cache_.clear();
+  b_marginals_indeterminant_ = false;
+}
+
+bool LampPgo::GetMarginalCovariance(gtsam::Key key, gtsam::Matrix* covariance) {
+  auto cached = marginal_cache_.find(key);
+  if (cached != marginal_cache_.end()) {
+    *covariance = cached->second;
+    return true;
+  }
+  if (b_marginals_indeterminant_ || !values_.exists(key))
+    return false;
+
+  // The skeleton mode uses the covariance of the skeleton node at or before
+  // each node
+  gtsam::Key marginal_key = key;
+  if (skeleton_ && !skeleton_->SkeletonKey(key, &marginal_key))
+    return false;
+
+  // The incremental solver has the factorization already, otherwise
+  // factorize the whole graph once per solve. Either way the marginals come
+  // from the Bayes tree, without inverting the information matrix
+  if (!isam2_ && !marginals_) {
+    try {
+      if (skeleton_) {
+        if (skeleton_values_.empty())
+          return false;
+        marginals_.reset(new gtsam::Marginals(pgo_solver_->getFactorsUnsafe(),
+                                              skeleton_values_));
+      } else {
+        marginals_.reset(new gtsam::Marginals(nfg_, values_));
+      }
+    } catch (gtsam::IndeterminantLinearSystemException& e) {
+      b_marginals_indeterminant_ = true;
+      return false;
+    }
+  }
+
+  try {
+    *covariance = isam2_ ? isam2_->marginalCovariance(key)
+                         : marginals_->marginalCovariance(marginal_key);
+  } catch (std::exception& e) {
+    ROS_WARN_STREAM("Key is not found in the clique"
+                    << gtsam::DefaultKeyFormatter(key));
+    return false;
+  }
+  marginal_cache_[key] = *covariance;
+  return true;
+}
+
+bool LampPgo::MarginalCovarianceCallback(
+    pose_graph_msgs::MarginalCovariance::Request& request,
+    pose_graph_msgs::MarginalCovariance::Response& response) {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+  response.generation = generation_;
+  response.nodes.reserve(request.keys.size());
+  for (const gtsam::Key key : request.keys) {
+    gtsam::Matrix cov_matrix;
+    if (!GetMarginalCovariance(key, &cov_matrix))
+      continue;
+    pose_graph_msgs::PoseGraphNode node;
+    node.key = key;
+    node.pose = lamp_utils::GtsamToRosMsg(values_.at<gtsam::Pose3>(key));
+    int iter = 0;
+    for (int i = 0; i < 6; i++) {
+      for (int j = 0; j < 6; j++) {
+        node.covariance[iter] = cov_matrix(i, j);
+        iter++;
+      }
+    }
+    response.nodes.push_back(node);
+  }
+  return true;
+}
+
+void LampPgo::PublishStats() {
+  lamp_utils::MetricsRegistry& metrics = lamp_utils::MetricsRegistry::Instance();
+  static lamp_utils::Histogram& solve_ms = metrics.GetHistogram("pgo.total_ms");
+  static lamp_utils::Gauge& factors = metrics.GetGauge("pgo.factors");
+  static lamp_utils::Gauge& values = metrics.GetGauge("pgo.values");
+  solve_ms.Observe(stats_.total_ms);
+  factors.Set(nfg_.size());
+  values.Set(values_.size());
+  if (!b_publish_stats_) {
+    return;
+  }
+  stats_.generation = generation_;
+  stats_.num_factors = nfg_.size();
+  stats_.num_values = values_.size();
+  stats_.memory_kb = ResidentMemoryKb();
+
+  if (stats_pub_.getNumSubscribers() > 0) {
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    msg.status.resize(1);
+    SolverStatsToDiagnostic(stats_, "lamp_pgo/" + param_ns_, &msg.status[0]);
+    stats_pub_.publish(msg);
+  }
+
+  if (!stats_prometheus_file_.empty()) {
+    const ros::WallTime now = ros::WallTime::now();
+    if ((now - last_stats_export_).toSec() >= stats_export_period_) {
+      last_stats_export_ = now;
+      if (!WriteSolverStatsPrometheus(
+              stats_, param_ns_, stats_prometheus_file_)) {
+        ROS_WARN_STREAM("Failed to write solver stats to "
+                        << stats_prometheus_file_);
+      }
+    }
+  }
 }
 
 void LampPgo::IgnoreRobotLoopClosures(const std_msgs::String::ConstPtr& msg) {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+
   // First convert string "huskyn" to char prefix
   char prefix = lamp_utils::GetRobotPrefix(msg->data);
 
+  FlushIncremental(false);
   pgo_solver_->ignorePrefix(prefix);
 
   // Extract the optimized values
-  values_ = pgo_solver_->calculateEstimate();
-  nfg_ = pgo_solver_->getFactorsUnsafe();
+  ExtractEstimate();
+  if (!UpdateIncrementalPrefix(prefix, true)) {
+    ReseedIncremental();
+  }
 
   // Double check that it is actually ignored
   std::vector<char> ignored_prefixes = pgo_solver_->getIgnoredPrefixes();
@@ -426,14 +1109,19 @@ void LampPgo::IgnoreRobotLoopClosures(const std_msgs::String::ConstPtr& msg) {
 }
 
 void LampPgo::ReviveRobotLoopClosures(const std_msgs::String::ConstPtr& msg) {
+  std::lock_guard<std::mutex> lock(solver_mutex_);
+
   // First convert string "huskyn" to char prefix
   char prefix = lamp_utils::GetRobotPrefix(msg->data);
 
+  FlushIncremental(false);
   pgo_solver_->revivePrefix(prefix);
 
   // Extract the optimized values
-  values_ = pgo_solver_->calculateEstimate();
-  nfg_ = pgo_solver_->getFactorsUnsafe();
+  ExtractEstimate();
+  if (!UpdateIncrementalPrefix(prefix, false)) {
+    ReseedIncremental();
+  }
 
   // Double check that it is actually revived
   std::vector<char> ignored_prefixes = pgo_solver_->getIgnoredPrefixes();
@@ -0,0 +1,262 @@
+/*
+ParallelPcm.cc
+Pairwise consistency maximization of loop closures, with the consistency
+checks spread over threads and cached between updates
+*/
+
+#include "lamp_pgo/ParallelPcm.h"
+
+#include <algorithm>
+#include <set>
+#include <thread>
+
+#include <gtsam/inference/Symbol.h>
+
+namespace {
+
+// Below this many checks threads are not worth starting
+const size_t kMinChecksPerThread = 2000;
+
+inline char Prefix(gtsam::Key key) {
+  return gtsam::Symbol(key).chr();
+}
+
+bool Contains(const std::vector<uint32_t>& sorted, uint32_t i) {
+  return std::binary_search(sorted.begin(), sorted.end(), i);
+}
+
+} // namespace
+
+ParallelPcm::ParallelPcm(double translation_threshold,
+                         double rotation_threshold,
+                         size_t num_threads)
+  : translation_threshold_(translation_threshold),
+    rotation_threshold_(rotation_threshold),
+    num_threads_(num_threads > 0
+                     ? num_threads
+                     : std::max(1u, std::thread::hardware_concurrency())) {}
+
+void ParallelPcm::AddOdometry(const Pose3Between& factor) {
+  const gtsam::Key from = factor.front();
+  const gtsam::Key to = factor.back();
+  // A trajectory starts at the first key seen of the robot
+  auto it = odom_poses_.find(from);
+  if (it == odom_poses_.end()) {
+    it = odom_poses_.emplace(from, gtsam::Pose3()).first;
+  }
+  odom_poses_[to] = it->second.compose(factor.measured());
+}
+
+bool ParallelPcm::IsConsistent(const LoopClosure& lc1,
+                               const LoopClosure& lc2) const {
+  auto a1 = odom_poses_.find(lc1.a);
+  auto a2 = odom_poses_.find(lc2.a);
+  auto b1 = odom_poses_.find(lc1.b);
+  auto b2 = odom_poses_.find(lc2.b);
+  if (a1 == odom_poses_.end() || a2 == odom_poses_.end() ||
+      b1 == odom_poses_.end() || b2 == odom_poses_.end()) {
+    return false;
+  }
+  // a1 -> a2 -> b2 -> b1 -> a1
+  const gtsam::Pose3 cycle = a1->second.between(a2->second)
+                                 .compose(lc2.measured)
+                                 .compose(b2->second.between(b1->second))
+                                 .compose(lc1.measured.inverse());
+  return cycle.translation().norm() < translation_threshold_ &&
+      gtsam::Rot3::Logmap(cycle.rotation()).norm() < rotation_threshold_;
+}
+
+void ParallelPcm::CheckNew(Group* group, size_t first) const {
+  const size_t n = group->loop_closures.size();
+  group->neighbors.resize(n);
+
+  // Row i holds the loop closures before i consistent with it. Every thread
+  // fills its own rows, interleaved so that the work is even.
+  auto check_rows = [this, group, first, n](size_t offset, size_t stride) {
+    for (size_t i = first + offset; i < n; i += stride) {
+      const LoopClosure& lc = group->loop_closures[i];
+      std::vector<uint32_t>& row = group->neighbors[i];
+      row.clear();
+      if (lc.b_removed) {
+        continue;
+      }
+      for (size_t j = 0; j < i; j++) {
+        if (!group->loop_closures[j].b_removed &&
+            IsConsistent(lc, group->loop_closures[j])) {
+          row.push_back(j);
+        }
+      }
+    }
+  };
+
+  const size_t num_checks = (n - first) * (n + first) / 2;
+  const size_t num_threads = std::min(
+      num_threads_, std::max<size_t>(1, num_checks / kMinChecksPerThread));
+  if (num_threads <= 1) {
+    check_rows(0, 1);
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++) {
+      threads.emplace_back(check_rows, t, num_threads);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Mirror the new rows. Appending in increasing i keeps the lists sorted.
+  for (size_t i = first; i < n; i++) {
+    for (size_t k = 0; k < group->neighbors[i].size(); k++) {
+      const uint32_t j = group->neighbors[i][k];
+      if (j < first) {
+        group->neighbors[j].push_back(i);
+      }
+    }
+  }
+  for (size_t i = first; i < n; i++) {
+    // Rows of new loop closures also get the new ones after them
+    for (size_t k = i + 1; k < n; k++) {
+      if (Contains(group->neighbors[k], i)) {
+        group->neighbors[i].push_back(k);
+      }
+    }
+  }
+}
+
+std::vector<uint32_t> ParallelPcm::MaxClique(const Group& group) {
+  // Greedy clique growth from the vertices in decreasing degree, as the
+  // heuristic max clique of PCM
+  const size_t n = group.loop_closures.size();
+  std::vector<uint32_t> order;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!group.loop_closures[i].b_removed) {
+      order.push_back(i);
+    }
+  }
+  auto by_degree = [&group](uint32_t i, uint32_t j) {
+    return group.neighbors[i].size() > group.neighbors[j].size();
+  };
+  std::stable_sort(order.begin(), order.end(), by_degree);
+
+  std::vector<uint32_t> best;
+  for (const uint32_t v : order) {
+    if (group.neighbors[v].size() + 1 <= best.size()) {
+      break;
+    }
+    std::vector<uint32_t> candidates;
+    for (const uint32_t u : group.neighbors[v]) {
+      if (!group.loop_closures[u].b_removed &&
+          group.neighbors[u].size() >= best.size()) {
+        candidates.push_back(u);
+      }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), by_degree);
+
+    std::vector<uint32_t> clique{v};
+    for (const uint32_t u : candidates) {
+      bool b_in_clique = true;
+      for (const uint32_t w : clique) {
+        if (!Contains(group.neighbors[u], w)) {
+          b_in_clique = false;
+          break;
+        }
+      }
+      if (b_in_clique) {
+        clique.push_back(u);
+      }
+    }
+    if (clique.size() > best.size()) {
+      best.swap(clique);
+    }
+  }
+  std::sort(best.begin(), best.end());
+  return best;
+}
+
+void ParallelPcm::AddLoopClosures(
+    const std::vector<Pose3Between::shared_ptr>& factors,
+    gtsam::NonlinearFactorGraph* added,
+    gtsam::NonlinearFactorGraph* removed) {
+  // Sort the new loop closures into their groups
+  std::map<std::pair<char, char>, size_t> first_new;
+  for (const auto& factor : factors) {
+    LoopClosure lc;
+    lc.factor = factor;
+    lc.a = factor->front();
+    lc.b = factor->back();
+    lc.measured = factor->measured();
+    if (Prefix(lc.a) > Prefix(lc.b)) {
+      std::swap(lc.a, lc.b);
+      lc.measured = lc.measured.inverse();
+    }
+    const auto group_key = std::make_pair(Prefix(lc.a), Prefix(lc.b));
+    Group& group = groups_[group_key];
+    first_new.emplace(group_key, group.loop_closures.size());
+    group.loop_closures.push_back(lc);
+    num_loop_closures_++;
+  }
+
+  // Check the groups with new loop closures and update their cliques
+  for (const auto& group_first : first_new) {
+    Group& group = groups_[group_first.first];
+    CheckNew(&group, group_first.second);
+
+    std::vector<uint32_t> inliers = MaxClique(group);
+    std::vector<uint32_t> difference;
+    std::set_difference(inliers.begin(),
+                        inliers.end(),
+                        group.inliers.begin(),
+                        group.inliers.end(),
+                        std::back_inserter(difference));
+    for (const uint32_t i : difference) {
+      added->add(group.loop_closures[i].factor);
+    }
+    difference.clear();
+    std::set_difference(group.inliers.begin(),
+                        group.inliers.end(),
+                        inliers.begin(),
+                        inliers.end(),
+                        std::back_inserter(difference));
+    for (const uint32_t i : difference) {
+      removed->add(group.loop_closures[i].factor);
+    }
+    group.inliers.swap(inliers);
+  }
+}
+
+bool ParallelPcm::Remove(gtsam::Key from, gtsam::Key to) {
+  if (Prefix(from) > Prefix(to)) {
+    std::swap(from, to);
+  }
+  auto it = groups_.find(std::make_pair(Prefix(from), Prefix(to)));
+  if (it == groups_.end()) {
+    return false;
+  }
+  Group& group = it->second;
+  for (uint32_t i = 0; i < group.loop_closures.size(); i++) {
+    LoopClosure& lc = group.loop_closures[i];
+    if (!lc.b_removed && ((lc.a == from && lc.b == to) ||
+                          (lc.a == to && lc.b == from))) {
+      lc.b_removed = true;
+      group.inliers.erase(
+          std::remove(group.inliers.begin(), group.inliers.end(), i),
+          group.inliers.end());
+      return true;
+    }
+  }
+  return false;
+}
+
+void ParallelPcm::Clear() {
+  odom_poses_.clear();
+  groups_.clear();
+  num_loop_closures_ = 0;
+}
+
+size_t ParallelPcm::NumInliers() const {
+  size_t num_inliers = 0;
+  for (const auto& group : groups_) {
+    num_inliers += group.second.inliers.size();
+  }
+  return num_inliers;
+}
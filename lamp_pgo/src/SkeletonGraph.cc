@@ -0,0 +1,437 @@
+/*
+SkeletonGraph.cc
+Condensed pose graph of keyframes and separators for the hierarchical solve
+*/
+
+#include "lamp_pgo/SkeletonGraph.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/linear/NoiseModel.h>
+
+#include <lamp_utils/PrefixHandling.h>
+
+namespace {
+
+bool IsOdometry(const gtsam::NonlinearFactor& factor) {
+  return factor.size() == 2 &&
+      lamp_utils::IsRobotPrefix(gtsam::Symbol(factor.front()).chr()) &&
+      factor.back() == factor.front() + 1;
+}
+
+inline bool IsRobotKey(gtsam::Key key) {
+  return lamp_utils::IsRobotPrefix(gtsam::Symbol(key).chr());
+}
+
+void InsertOrUpdate(gtsam::Key key, const gtsam::Pose3& pose,
+                    gtsam::Values* values) {
+  if (values->exists(key)) {
+    values->update(key, pose);
+  } else {
+    values->insert(key, pose);
+  }
+}
+
+} // namespace
+
+SkeletonGraph::SkeletonGraph(size_t spacing)
+  : spacing_(std::max<size_t>(1, spacing)) {}
+
+void SkeletonGraph::Add(const gtsam::NonlinearFactorGraph& factors) {
+  for (const auto& factor : factors) {
+    if (!factor) {
+      continue;
+    }
+    auto between = boost::dynamic_pointer_cast<Pose3Between>(factor);
+    if (between && IsOdometry(*factor)) {
+      const gtsam::Symbol from(factor->front());
+      Chain& chain = chains_[from.chr()];
+      chain.prefix = from.chr();
+      chain.odometry[from.index()] = between;
+      continue;
+    }
+    others_.add(factor);
+    pending_.add(factor);
+    for (const gtsam::Key key : factor->keys()) {
+      if (IsRobotKey(key)) {
+        const gtsam::Symbol symbol(key);
+        Chain& chain = chains_[symbol.chr()];
+        chain.prefix = symbol.chr();
+        chain.separators.insert(symbol.index());
+      }
+    }
+  }
+}
+
+void SkeletonGraph::Remove(const gtsam::NonlinearFactorGraph& factors) {
+  std::set<gtsam::KeyVector> removed;
+  for (const auto& factor : factors) {
+    removed.insert(factor->keys());
+  }
+  gtsam::NonlinearFactorGraph others, pending;
+  for (const auto& factor : others_) {
+    if (!removed.count(factor->keys())) {
+      others.add(factor);
+    }
+  }
+  for (const auto& factor : pending_) {
+    if (!removed.count(factor->keys())) {
+      pending.add(factor);
+    }
+  }
+  others_ = others;
+  pending_ = pending;
+}
+
+void SkeletonGraph::Remove(gtsam::Key from, gtsam::Key to) {
+  gtsam::NonlinearFactorGraph removed;
+  for (const auto& factor : others_) {
+    if (factor->size() == 2 &&
+        ((factor->front() == from && factor->back() == to) ||
+         (factor->front() == to && factor->back() == from))) {
+      removed.add(factor);
+    }
+  }
+  Remove(removed);
+}
+
+void SkeletonGraph::AddNode(Chain* chain,
+                            uint64_t index,
+                            const gtsam::Values& estimate,
+                            gtsam::Values* values) {
+  const uint64_t solver_index = chain->nodes.size();
+  chain->nodes.push_back(index);
+  chain->node_index[index] = solver_index;
+  const gtsam::Key key = gtsam::Symbol(chain->prefix, index);
+  if (estimate.exists(key)) {
+    values->insert(gtsam::Symbol(chain->prefix, solver_index),
+                   estimate.at(key));
+  }
+}
+
+void SkeletonGraph::CondenseChain(Chain* chain,
+                                  const gtsam::Values& estimate,
+                                  gtsam::NonlinearFactorGraph* factors,
+                                  gtsam::Values* values) {
+  if (chain->odometry.empty()) {
+    return;
+  }
+  if (chain->nodes.empty()) {
+    AddNode(chain, chain->odometry.begin()->first, estimate, values);
+  }
+  const uint64_t first = chain->nodes.front();
+
+  uint64_t index = chain->nodes.back();
+  gtsam::Pose3 measured;
+  gtsam::Matrix6 covariance = gtsam::Matrix6::Zero();
+  for (auto it = chain->odometry.find(index);
+       it != chain->odometry.end() && it->first == index;
+       ++it) {
+    gtsam::Matrix6 H1, H2;
+    measured = measured.compose(it->second->measured(), H1, H2);
+    auto gaussian = boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(
+        it->second->noiseModel());
+    const gtsam::Matrix6 step_covariance = gaussian
+        ? gtsam::Matrix6(gaussian->covariance())
+        : gtsam::Matrix6::Identity();
+    covariance = H1 * covariance * H1.transpose() +
+        H2 * step_covariance * H2.transpose();
+    index++;
+
+    if (chain->separators.count(index) || (index - first) % spacing_ == 0) {
+      const uint64_t from = chain->nodes.size() - 1;
+      factors->add(Pose3Between(
+          gtsam::Symbol(chain->prefix, from),
+          gtsam::Symbol(chain->prefix, from + 1),
+          measured,
+          gtsam::noiseModel::Gaussian::Covariance(covariance)));
+      AddNode(chain, index, estimate, values);
+      measured = gtsam::Pose3();
+      covariance.setZero();
+    }
+  }
+}
+
+bool SkeletonGraph::AddFactor(const gtsam::NonlinearFactor::shared_ptr& factor,
+                              const gtsam::Values& estimate,
+                              gtsam::NonlinearFactorGraph* factors,
+                              gtsam::Values* values) {
+  std::map<gtsam::Key, gtsam::Key> rekey;
+  for (const gtsam::Key key : factor->keys()) {
+    gtsam::Key solver_key;
+    if (!SolverKey(key, &solver_key)) {
+      return false;
+    }
+    if (solver_key != key) {
+      rekey[key] = solver_key;
+    }
+  }
+  for (const gtsam::Key key : factor->keys()) {
+    if (!IsRobotKey(key) && !other_keys_.count(key) && estimate.exists(key)) {
+      values->insert(key, estimate.at(key));
+      other_keys_.insert(key);
+    }
+  }
+  factors->add(rekey.empty() ? factor : factor->rekey(rekey));
+  return true;
+}
+
+bool SkeletonGraph::Update(const gtsam::Values& estimate,
+                           gtsam::NonlinearFactorGraph* factors,
+                           gtsam::Values* values) {
+  // Separators inside a condensed segment split it
+  for (const auto& prefix_chain : chains_) {
+    const Chain& chain = prefix_chain.second;
+    if (chain.nodes.empty()) {
+      continue;
+    }
+    for (auto it = chain.separators.lower_bound(chain.nodes.front());
+         it != chain.separators.end() && *it < chain.nodes.back();
+         ++it) {
+      if (!chain.node_index.count(*it)) {
+        Build(estimate, factors, values);
+        return true;
+      }
+    }
+  }
+
+  for (auto& prefix_chain : chains_) {
+    CondenseChain(&prefix_chain.second, estimate, factors, values);
+  }
+  gtsam::NonlinearFactorGraph pending;
+  for (const auto& factor : pending_) {
+    if (!AddFactor(factor, estimate, factors, values)) {
+      pending.add(factor);
+    }
+  }
+  pending_ = pending;
+  return false;
+}
+
+void SkeletonGraph::Build(const gtsam::Values& estimate,
+                          gtsam::NonlinearFactorGraph* factors,
+                          gtsam::Values* values) {
+  *factors = gtsam::NonlinearFactorGraph();
+  *values = gtsam::Values();
+  other_keys_.clear();
+  for (auto& prefix_chain : chains_) {
+    Chain& chain = prefix_chain.second;
+    chain.nodes.clear();
+    chain.node_index.clear();
+    CondenseChain(&chain, estimate, factors, values);
+  }
+  pending_ = gtsam::NonlinearFactorGraph();
+  for (const auto& factor : others_) {
+    if (!AddFactor(factor, estimate, factors, values)) {
+      pending_.add(factor);
+    }
+  }
+}
+
+void SkeletonGraph::Densify(const gtsam::Values& skeleton_values,
+                            gtsam::Values* dense) const {
+  std::vector<const Chain*> chains;
+  for (const auto& prefix_chain : chains_) {
+    if (!prefix_chain.second.nodes.empty()) {
+      chains.push_back(&prefix_chain.second);
+    }
+  }
+
+  typedef std::vector<std::pair<gtsam::Key, gtsam::Pose3>> PoseList;
+  std::vector<PoseList> results(chains.size());
+  auto densify_chain = [&skeleton_values](const Chain& chain,
+                                          PoseList* poses) {
+    // Chain the odometry from index up to end, stopping at a gap
+    auto chain_from = [&chain](uint64_t index,
+                               uint64_t end,
+                               gtsam::Pose3 pose,
+                               std::vector<gtsam::Pose3>* chained) {
+      for (auto it = chain.odometry.find(index);
+           it != chain.odometry.end() && it->first == index && index < end;
+           ++it, ++index) {
+        pose = pose.compose(it->second->measured());
+        chained->push_back(pose);
+      }
+    };
+
+    for (size_t i = 0; i < chain.nodes.size(); i++) {
+      const gtsam::Key key0 = gtsam::Symbol(chain.prefix, i);
+      if (!skeleton_values.exists(key0)) {
+        continue;
+      }
+      const gtsam::Pose3 start = skeleton_values.at<gtsam::Pose3>(key0);
+      const uint64_t index = chain.nodes[i];
+      poses->emplace_back(gtsam::Symbol(chain.prefix, index), start);
+
+      std::vector<gtsam::Pose3> chained;
+      if (i + 1 == chain.nodes.size()) {
+        // Tail after the last skeleton node, by odometry
+        chain_from(index, std::numeric_limits<uint64_t>::max(), start,
+                   &chained);
+        for (size_t k = 0; k < chained.size(); k++) {
+          poses->emplace_back(gtsam::Symbol(chain.prefix, index + k + 1),
+                              chained[k]);
+        }
+        break;
+      }
+
+      const uint64_t n = chain.nodes[i + 1] - index;
+      const gtsam::Key key1 = gtsam::Symbol(chain.prefix, i + 1);
+      chain_from(index, chain.nodes[i + 1], start, &chained);
+      if (chained.size() != n || !skeleton_values.exists(key1)) {
+        continue;
+      }
+      // Spread the mismatch with the optimized end along the segment
+      const gtsam::Vector6 error = gtsam::Pose3::Logmap(
+          chained.back().between(skeleton_values.at<gtsam::Pose3>(key1)));
+      for (uint64_t k = 0; k + 1 < n; k++) {
+        const double alpha = static_cast<double>(k + 1) / n;
+        poses->emplace_back(
+            gtsam::Symbol(chain.prefix, index + k + 1),
+            chained[k].compose(gtsam::Pose3::Expmap(alpha * error)));
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < chains.size(); i++) {
+    threads.emplace_back(densify_chain, std::cref(*chains[i]), &results[i]);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Artifacts and the other keys are in the solver as they are
+  for (const auto& key_value : skeleton_values) {
+    if (IsRobotKey(key_value.key)) {
+      continue;
+    }
+    if (dense->exists(key_value.key)) {
+      dense->update(key_value.key, key_value.value);
+    } else {
+      dense->insert(key_value.key, key_value.value);
+    }
+  }
+  for (const auto& poses : results) {
+    for (const auto& key_pose : poses) {
+      InsertOrUpdate(key_pose.first, key_pose.second, dense);
+    }
+  }
+}
+
+void SkeletonGraph::Propagate(const gtsam::Values& new_values,
+                              gtsam::Values* dense) const {
+  // Values are visited in key order, so predecessors come first
+  for (const auto& key_value : new_values) {
+    const gtsam::Key key = key_value.key;
+    if (dense->exists(key)) {
+      continue;
+    }
+    const gtsam::Symbol symbol(key);
+    auto chain = chains_.find(symbol.chr());
+    if (chain != chains_.end() && symbol.index() > 0 &&
+        dense->exists(key - 1)) {
+      auto odometry = chain->second.odometry.find(symbol.index() - 1);
+      if (odometry != chain->second.odometry.end()) {
+        dense->insert(key,
+                      dense->at<gtsam::Pose3>(key - 1).compose(
+                          odometry->second->measured()));
+        continue;
+      }
+    }
+    dense->insert(key, key_value.value);
+  }
+}
+
+gtsam::NonlinearFactorGraph SkeletonGraph::DenseFactors(
+    const gtsam::NonlinearFactorGraph& solver_factors) const {
+  std::set<gtsam::KeyVector> in_solver;
+  for (const auto& factor : solver_factors) {
+    if (factor) {
+      in_solver.insert(factor->keys());
+    }
+  }
+
+  gtsam::NonlinearFactorGraph factors;
+  for (const auto& prefix_chain : chains_) {
+    for (const auto& index_factor : prefix_chain.second.odometry) {
+      factors.add(index_factor.second);
+    }
+  }
+  for (const auto& factor : others_) {
+    gtsam::KeyVector keys;
+    for (const gtsam::Key key : factor->keys()) {
+      gtsam::Key solver_key;
+      if (SolverKey(key, &solver_key)) {
+        keys.push_back(solver_key);
+      }
+    }
+    if (in_solver.count(keys)) {
+      factors.add(factor);
+    }
+  }
+  return factors;
+}
+
+bool SkeletonGraph::SolverKey(gtsam::Key key, gtsam::Key* solver_key) const {
+  if (!IsRobotKey(key)) {
+    *solver_key = key;
+    return true;
+  }
+  const gtsam::Symbol symbol(key);
+  auto chain = chains_.find(symbol.chr());
+  if (chain == chains_.end()) {
+    return false;
+  }
+  auto node = chain->second.node_index.find(symbol.index());
+  if (node == chain->second.node_index.end()) {
+    return false;
+  }
+  *solver_key = gtsam::Symbol(symbol.chr(), node->second);
+  return true;
+}
+
+gtsam::Key SkeletonGraph::DenseKey(gtsam::Key solver_key) const {
+  if (!IsRobotKey(solver_key)) {
+    return solver_key;
+  }
+  const gtsam::Symbol symbol(solver_key);
+  auto chain = chains_.find(symbol.chr());
+  if (chain == chains_.end() ||
+      symbol.index() >= chain->second.nodes.size()) {
+    return solver_key;
+  }
+  return gtsam::Symbol(symbol.chr(), chain->second.nodes[symbol.index()]);
+}
+
+bool SkeletonGraph::SkeletonKey(gtsam::Key key, gtsam::Key* solver_key) const {
+  if (!IsRobotKey(key)) {
+    *solver_key = key;
+    return true;
+  }
+  const gtsam::Symbol symbol(key);
+  auto chain = chains_.find(symbol.chr());
+  if (chain == chains_.end()) {
+    return false;
+  }
+  auto node = chain->second.node_index.upper_bound(symbol.index());
+  if (node == chain->second.node_index.begin()) {
+    return false;
+  }
+  *solver_key = gtsam::Symbol(symbol.chr(), std::prev(node)->second);
+  return true;
+}
+
+void SkeletonGraph::Clear() {
+  chains_.clear();
+  others_ = gtsam::NonlinearFactorGraph();
+  pending_ = gtsam::NonlinearFactorGraph();
+  other_keys_.clear();
+}
@@ -0,0 +1,93 @@
+/*
+SolverStats.cc
+Timing and size statistics of the LampPgo solver updates
+*/
+
+#include "lamp_pgo/SolverStats.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+typedef std::vector<std::pair<std::string, double>> StatList;
+
+StatList ToList(const SolverStats& s) {
+  StatList list;
+  list.emplace_back("generation", s.generation);
+  list.emplace_back("incremental", s.b_incremental ? 1 : 0);
+  list.emplace_back("convert_ms", s.convert_ms);
+  list.emplace_back("extract_ms", s.extract_ms);
+  list.emplace_back("incremental_ms", s.incremental_ms);
+  list.emplace_back("robust_solve_ms", s.robust_solve_ms);
+  list.emplace_back("reseed_ms", s.reseed_ms);
+  list.emplace_back("marginals_ms", s.marginals_ms);
+  list.emplace_back("publish_ms", s.publish_ms);
+  list.emplace_back("total_ms", s.total_ms);
+  list.emplace_back("new_factors", s.num_new_factors);
+  list.emplace_back("new_values", s.num_new_values);
+  list.emplace_back("warm_started", s.num_warm_started);
+  list.emplace_back("factors", s.num_factors);
+  list.emplace_back("values", s.num_values);
+  list.emplace_back("loop_closures", s.num_loop_closures);
+  list.emplace_back("lc_inliers", s.num_lc_inliers);
+  list.emplace_back("lc_outliers", s.num_lc_outliers);
+  list.emplace_back("relinearized", s.num_relinearized);
+  list.emplace_back("reeliminated", s.num_reeliminated);
+  list.emplace_back("cliques", s.num_cliques);
+  list.emplace_back("memory_kb", s.memory_kb);
+  return list;
+}
+
+} // namespace
+
+size_t ResidentMemoryKb() {
+  std::ifstream statm("/proc/self/statm");
+  size_t total_pages = 0, resident_pages = 0;
+  if (!(statm >> total_pages >> resident_pages)) {
+    return 0;
+  }
+  return resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void SolverStatsToDiagnostic(const SolverStats& stats,
+                             const std::string& name,
+                             diagnostic_msgs::DiagnosticStatus* status) {
+  status->level = diagnostic_msgs::DiagnosticStatus::OK;
+  status->name = name;
+  status->message = stats.b_incremental ? "incremental" : "batch";
+  status->values.clear();
+  for (const auto& stat : ToList(stats)) {
+    diagnostic_msgs::KeyValue key_value;
+    key_value.key = stat.first;
+    std::ostringstream value;
+    value << stat.second;
+    key_value.value = value.str();
+    status->values.push_back(key_value);
+  }
+}
+
+bool WriteSolverStatsPrometheus(const SolverStats& stats,
+                                const std::string& name,
+                                const std::string& filename) {
+  const std::string tmp_filename = filename + ".tmp";
+  {
+    std::ofstream file(tmp_filename);
+    if (!file.is_open()) {
+      return false;
+    }
+    for (const auto& stat : ToList(stats)) {
+      file << "lamp_pgo_" << stat.first << "{name=\"" << name << "\"} "
+           << stat.second << "\n";
+    }
+    if (!file.good()) {
+      return false;
+    }
+  }
+  return std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
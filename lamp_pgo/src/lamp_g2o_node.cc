@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <ros/ros.h>
 #include <rosbag/bag.h>
@@ -6,21 +7,24 @@
 #include <unordered_map>
 
 #include <parameter_utils/ParameterUtils.h>
-#include <pcl/common/transforms.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
 #include <pose_graph_msgs/KeyedScan.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/G2oStream.h>
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudKernels.h>
 #include <lamp_utils/PointCloudTypes.h>
+#include <lamp_utils/PoseGraphArchive.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/ScanCompression.h>
 #include <visualization_msgs/Marker.h>
 
 #include <gtsam/inference/Symbol.h>
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
-#include <gtsam/slam/dataset.h>
 
 #include "KimeraRPGO/RobustSolver.h"
 
@@ -29,91 +33,158 @@ using KimeraRPGO::RobustSolver;
 using KimeraRPGO::RobustSolverParams;
 using pose_graph_msgs::KeyedScan;
 
-void inputKeyedScansBag(
-    const std::string& filename,
-    std::unordered_map<gtsam::Key, PointCloud>* keyed_scans) {
-  ROS_INFO("Reading keyed scans from %s", filename.c_str());
+// Keyed scans are read through an archive so they stay on disk until the
+// map is built. A bag is converted into an archive next to it first.
+bool openKeyedScans(const std::string& filename,
+                    lamp_utils::PoseGraphArchiveReader* scans) {
+  if (lamp_utils::IsPoseGraphArchive(filename)) {
+    return scans->Open(filename);
+  }
+
+  const std::string archive_file = filename + ".scans";
+  if (lamp_utils::IsPoseGraphArchive(archive_file) &&
+      scans->Open(archive_file)) {
+    ROS_INFO("Using keyed scans converted earlier in %s",
+             archive_file.c_str());
+    return true;
+  }
+
+  ROS_INFO("Converting keyed scans from %s to %s",
+           filename.c_str(),
+           archive_file.c_str());
+  lamp_utils::PoseGraphArchiveWriter writer;
+  if (!writer.Open(archive_file)) {
+    ROS_ERROR("Failed to create %s", archive_file.c_str());
+    return false;
+  }
   rosbag::Bag bag;
   bag.open(filename);
   for (rosbag::MessageInstance const m : rosbag::View(bag)) {
     KeyedScan::ConstPtr ks = m.instantiate<KeyedScan>();
-    if (ks != nullptr) {
-      PointCloud scan;
-      pcl::fromROSMsg(ks->scan, scan);
-      keyed_scans->insert({ks->key, scan});
+    if (ks == nullptr || writer.HasScan(ks->key)) {
+      continue;
+    }
+    PointCloud scan;
+    if (lamp_utils::KeyedScanMsgToScan(*ks, &scan)) {
+      writer.AppendScan(ks->key, m.getTime(), scan);
     }
   }
   bag.close();
-  ROS_INFO("Processed %d keyed scans from bag. ", keyed_scans->size());
+  if (!writer.Commit(pose_graph_msgs::PoseGraph())) {
+    ROS_ERROR("Failed to write %s", archive_file.c_str());
+    return false;
+  }
+  writer.Close();
+  return scans->Open(archive_file);
 }
 
+// Streams the g2o file into the solver a chunk of edges at a time. Loop
+// closures with an initial error above max_lc_error are dropped, edges are
+// held back until the values of both keys were read, and values are handed
+// over with the first edge using them.
 void inputG2oFile(const std::string& filename,
-                  gtsam::NonlinearFactorGraph* nfg,
+                  size_t chunk_edges,
+                  double max_lc_error,
+                  KimeraRPGO::RobustSolver* pgo,
                   gtsam::Values* values) {
   ROS_INFO("Reading factors and values from %s", filename.c_str());
-  gtsam::GraphAndValues graph_and_values = gtsam::load3D(filename);
-  *nfg = *graph_and_values.first;
-  *values = *graph_and_values.second;
-  ROS_INFO("Read in %d factors and %d values from g2o.",
-           nfg->size(),
-           values->size());
-}
-
-PointCloud transformCloudToWorld(const gtsam::Key& key,
-                                 const gtsam::Values& values,
-                                 const PointCloud& cloud) {
-  PointCloud output_cloud;
-  gtsam::Pose3 pose = values.at<gtsam::Pose3>(key);
-  Eigen::Matrix4d b2w = pose.matrix();
-  pcl::transformPointCloud(cloud, output_cloud, b2w);
-  return output_cloud;
-}
+  lamp_utils::G2oReader reader;
+  if (!reader.Open(filename)) {
+    ROS_ERROR("Failed to open %s", filename.c_str());
+    return;
+  }
 
-PointCloud
-buildCloudMap(const gtsam::Values& values,
-              const std::unordered_map<gtsam::Key, PointCloud>& keyed_scans,
-              const double& grid_size) {
-  PointCloud::Ptr map_cloud(new PointCloud);
-  for (const auto& ks : keyed_scans) {
-    if (values.exists(ks.first)) {
-      PointCloud transformed_scan =
-          transformCloudToWorld(ks.first, values, ks.second);
-      *map_cloud += transformed_scan;
+  gtsam::NonlinearFactorGraph pending;
+  gtsam::KeySet sent_keys;
+  size_t n_dropped = 0;
+  gtsam::NonlinearFactorGraph chunk;
+  gtsam::Values read_values;
+  while (reader.ReadChunk(chunk_edges, &chunk, &read_values)) {
+    values->insert(read_values);
+
+    gtsam::NonlinearFactorGraph ready, waiting;
+    pending.push_back(chunk);
+    for (const auto& factor : pending) {
+      if (!values->exists(factor->front()) || !values->exists(factor->back())) {
+        waiting.add(factor);
+        continue;
+      }
+      // filter out bad loop closures
+      if (factor->front() != factor->back() - 1 &&
+          factor->error(*values) > max_lc_error) {
+        n_dropped++;
+        continue;
+      }
+      ready.add(factor);
     }
+    pending = waiting;
+
+    // Input graph and values
+    gtsam::Values new_values;
+    for (const auto& factor : ready) {
+      for (const gtsam::Key key : factor->keys()) {
+        if (sent_keys.insert(key).second) {
+          new_values.insert(key, values->at(key));
+        }
+      }
+    }
+    if (ready.size() > 0) {
+      pgo->update(ready, new_values);
+    }
+    chunk = gtsam::NonlinearFactorGraph();
+    read_values.clear();
   }
-  pcl::VoxelGrid<Point> grid;
-  grid.setLeafSize(grid_size, grid_size, grid_size);
-  grid.setInputCloud(map_cloud);
-  grid.filter(*map_cloud);
-
-  return *map_cloud;
+  if (pending.size() > 0) {
+    ROS_WARN("Dropped %zu edges to vertices missing from the g2o file",
+             pending.size());
+  }
+  ROS_INFO("Read in %zu edges and %zu vertices from g2o, dropped %zu loop "
+           "closures.",
+           reader.NumEdges(),
+           reader.NumVertices(),
+           n_dropped);
 }
 
-PointCloud buildCloudMapByRobot(
-    const std::string robot_name,
-    const gtsam::Values& values,
-    const std::unordered_map<gtsam::Key, PointCloud>& keyed_scans,
-    const double& grid_size) {
-  const char prefix = lamp_utils::ROBOT_PREFIXES.at(robot_name);
-
-  PointCloud::Ptr map_cloud(new PointCloud);
-  for (const auto& ks : keyed_scans) {
-    if (gtsam::Symbol(ks.first).chr() != prefix) {
+// Scans are read, transformed and downsampled one at a time, the map is
+// downsampled again whenever it grew by max_points
+PointCloud buildCloudMap(const gtsam::Values& values,
+                         const lamp_utils::PoseGraphArchiveReader& scans,
+                         const double& grid_size,
+                         char prefix = 0) {
+  const size_t max_points = 2000000;
+  PointCloud map_cloud;
+  size_t downsampled_size = 0;
+  for (const gtsam::Key key : scans.ScanKeys()) {
+    if ((prefix != 0 && gtsam::Symbol(key).chr() != prefix) ||
+        !values.exists(key)) {
       continue;
     }
-
-    if (values.exists(ks.first)) {
-      PointCloud transformed_scan =
-          transformCloudToWorld(ks.first, values, ks.second);
-      *map_cloud += transformed_scan;
+    PointCloud::Ptr scan = scans.ReadScan(key);
+    if (scan == nullptr) {
+      continue;
+    }
+    lamp_utils::TransformAndAppend(
+        *scan, values.at<gtsam::Pose3>(key).matrix(), &map_cloud);
+    if (map_cloud.size() - downsampled_size > max_points) {
+      lamp_utils::VoxelDownsample(map_cloud, grid_size, &map_cloud);
+      downsampled_size = map_cloud.size();
     }
   }
   pcl::VoxelGrid<Point> grid;
   grid.setLeafSize(grid_size, grid_size, grid_size);
-  grid.setInputCloud(map_cloud);
-  grid.filter(*map_cloud);
+  grid.setInputCloud(map_cloud.makeShared());
+  grid.filter(map_cloud);
 
-  return *map_cloud;
+  return map_cloud;
+}
+
+PointCloud
+buildCloudMapByRobot(const std::string robot_name,
+                     const gtsam::Values& values,
+                     const lamp_utils::PoseGraphArchiveReader& scans,
+                     const double& grid_size) {
+  return buildCloudMap(
+      values, scans, grid_size, lamp_utils::ROBOT_PREFIXES.at(robot_name));
 }
 
 bool isRobotKey(gtsam::Key key) {
@@ -305,42 +376,45 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  bool visualize;
+  bool visualize = false;
   pu::Get("visualize", visualize);
 
-  //// Load g2o file
-  gtsam::NonlinearFactorGraph nfg, filtered_nfg;
-  gtsam::Values values;
-  inputG2oFile(g2o_file, &nfg, &values);
-
   double max_lc_error;
   if (!pu::Get(param_ns + "/max_lc_error", max_lc_error))
     return 1;
 
-  // filter out bad loop closures
-  for (const auto& factor : nfg) {
-    if (factor->front() != factor->back() - 1) {
-      if (factor->error(values) > max_lc_error) {
-        continue;
-      }
-    }
-    filtered_nfg.add(factor);
-  }
-
-  //// Load keyed scans
-  std::unordered_map<gtsam::Key, PointCloud> keyed_scans;
-  inputKeyedScansBag(ks_file, &keyed_scans);
+  // Edges handed to the solver per update, 0 for the whole file at once
+  int g2o_chunk_edges = 0;
+  pu::Get("g2o_chunk_edges", g2o_chunk_edges);
 
   //// Initialize solver
   KimeraRPGO::RobustSolver pgo(rpgo_params);
 
-  //// Input graphand values
-  pgo.update(filtered_nfg, values);
+  //// Stream the g2o file into the solver
+  gtsam::Values values;
+  inputG2oFile(g2o_file,
+               std::max(g2o_chunk_edges, 0),
+               max_lc_error,
+               &pgo,
+               &values);
 
-  nfg = pgo.getFactorsUnsafe();
+  gtsam::NonlinearFactorGraph nfg = pgo.getFactorsUnsafe();
   values = pgo.calculateEstimate();
   gtsam::Vector gnc_weights = pgo.getGncWeights();
 
+  // The scans are only needed for the maps
+  if (!save_output && !visualize) {
+    return 0;
+  }
+
+  //// Open keyed scans
+  lamp_utils::PoseGraphArchiveReader keyed_scans;
+  if (!openKeyedScans(ks_file, &keyed_scans)) {
+    ROS_ERROR("Failed to read keyed scans from %s", ks_file.c_str());
+    return 1;
+  }
+  ROS_INFO("%zu keyed scans on disk", keyed_scans.NumScans());
+
   ROS_INFO("Building point cloud map from optimized values. ");
   PointCloud map_cloud = buildCloudMap(values, keyed_scans, map_grid_size);
 
@@ -376,7 +450,7 @@ int main(int argc, char** argv) {
         n.advertise<visualization_msgs::Marker>("outlier_edges", 1, true);
 
     sensor_msgs::PointCloud2 map_msg;
-    pcl::toROSMsg(map_cloud, map_msg);
+    lamp_utils::ToRosMsg(map_cloud, &map_msg);
     map_msg.header.frame_id = "world";
     map_pub.publish(map_msg);
 
@@ -389,7 +463,7 @@ int main(int argc, char** argv) {
       ros::Publisher robot_map_pub =
           n.advertise<PointCloud>(topic_name, 1, true);
       sensor_msgs::PointCloud2 robot_map_msg;
-      pcl::toROSMsg(robot_maps[robot], robot_map_msg);
+      lamp_utils::ToRosMsg(robot_maps[robot], &robot_map_msg);
       robot_map_msg.header.frame_id = "world";
       robot_map_pub.publish(robot_map_msg);
       map_publishers.push_back(robot_map_pub);
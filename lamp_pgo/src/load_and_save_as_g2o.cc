@@ -3,16 +3,11 @@
 // Use case is for post analysis with kimera rpgo
 // Author: Yun Chang
 
-#include <gtsam/nonlinear/NonlinearFactorGraph.h>
-#include <gtsam/nonlinear/Values.h>
-#include <gtsam/slam/dataset.h>
 #include <pose_graph_msgs/PoseGraph.h>
-#include <pose_graph_msgs/PoseGraphEdge.h>
-#include <pose_graph_msgs/PoseGraphNode.h>
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
 
-#include "lamp_utils/CommonFunctions.h"
+#include "lamp_utils/G2oStream.h"
 
 int main(int argc, char** argv) {
   ros::init(argc, argv, "load_and_save_as_g2o");
@@ -23,6 +18,7 @@ int main(int argc, char** argv) {
     std::cout
         << "usage: rosrun load_and_save_as_g2o bag_path topic_name output_path"
         << std::endl;
+    return 1;
   }
 
   rosbag::Bag bag;
@@ -30,16 +26,23 @@ int main(int argc, char** argv) {
   std::vector<std::string> topics;
   topics.push_back(argv[2]);
   rosbag::View view(bag, rosbag::TopicQuery(topics));
-  pose_graph_msgs::PoseGraph::Ptr last_posegraph(new pose_graph_msgs::PoseGraph());
+  // Only the last graph is kept, the earlier ones are dropped as they are read
+  pose_graph_msgs::PoseGraph::ConstPtr last_posegraph;
   for (const rosbag::MessageInstance& msg : view) {
-    const std::string& msg_topic = msg.getTopic();
-    pose_graph_msgs::PoseGraph::Ptr pg =
+    pose_graph_msgs::PoseGraph::ConstPtr pg =
         msg.instantiate<pose_graph_msgs::PoseGraph>();
-    if (pg != NULL and msg_topic == argv[2]) *last_posegraph = *pg;
+    if (pg != NULL) last_posegraph = pg;
+  }
+  if (last_posegraph == NULL) {
+    std::cout << "no pose graph on " << argv[2] << std::endl;
+    return 1;
+  }
+
+  // Written straight from the message, without building a gtsam graph
+  lamp_utils::G2oWriter writer;
+  if (!writer.Open(argv[3]) || !writer.WritePoseGraph(*last_posegraph)) {
+    std::cout << "failed to write " << argv[3] << std::endl;
+    return 1;
   }
-  gtsam::NonlinearFactorGraph nfg;
-  gtsam::Values values;
-  lamp_utils::PoseGraphMsgToGtsam(last_posegraph, &nfg, &values);
-  gtsam::writeG2o(nfg, values, argv[3]);
   std::cout << "wrote g2o to: " << argv[3] << std::endl;
 }
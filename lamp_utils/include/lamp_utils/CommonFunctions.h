@@ -14,6 +14,7 @@
 #include <gtsam/nonlinear/Values.h>
 
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/NoiseModelCache.h>
 
 #include <pose_graph_msgs/KeyedScan.h>
 #include <pose_graph_msgs/PoseGraph.h>
@@ -27,6 +28,9 @@
 #include <geometry_msgs/Transform.h>
 #include <nav_msgs/Odometry.h>
 
+#include <algorithm>
+#include <vector>
+
 namespace gu = geometry_utils;
 namespace gr = gu::ros;
 
@@ -41,55 +45,46 @@ void PoseGraphMsgToGtsam(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg,
 // Convert edge/node message to gtsam pose
 template <typename MessageT>
 gtsam::Pose3 MessageToPose(const MessageT& msg) {
-  gtsam::Point3 delta_translation(
-      msg.pose.position.x, msg.pose.position.y, msg.pose.position.z);
-  gtsam::Rot3 delta_orientation(msg.pose.orientation.w,
-                                msg.pose.orientation.x,
-                                msg.pose.orientation.y,
-                                msg.pose.orientation.z);
-  gtsam::Pose3 delta = gtsam::Pose3(delta_orientation, delta_translation);
-
   // Normalize the rotation
-  Eigen::Quaterniond quat(delta.rotation().matrix());
-  quat = quat.normalized();
-  delta = gtsam::Pose3(gtsam::Rot3(quat.toRotationMatrix()), delta.translation());
+  const Eigen::Quaterniond quat = Eigen::Quaterniond(msg.pose.orientation.w,
+                                                     msg.pose.orientation.x,
+                                                     msg.pose.orientation.y,
+                                                     msg.pose.orientation.z)
+                                      .normalized();
+  return gtsam::Pose3(
+      gtsam::Rot3(quat),
+      gtsam::Point3(
+          msg.pose.position.x, msg.pose.position.y, msg.pose.position.z));
+}
 
-  return delta;
+// Row major view of the covariance of an edge or node message
+template <typename MessageT>
+Eigen::Map<const Eigen::Matrix<double, 6, 6, Eigen::RowMajor>>
+MessageCovarianceMap(const MessageT& msg) {
+  return Eigen::Map<const Eigen::Matrix<double, 6, 6, Eigen::RowMajor>>(
+      msg.covariance.data());
 }
 
 // Extract the covariance (as Matrix) from
 // edge or node message
 template <typename MessageT>
 gtsam::Matrix66 MessageToCovarianceMatrix(const MessageT& msg) {
-  // TODO: unit test
-  gtsam::Matrix66 covariance;
-  for (size_t i = 0; i < msg.covariance.size(); i++) {
-    size_t row = static_cast<size_t>(i / 6);
-    size_t col = i % 6;
-    covariance(row, col) = msg.covariance[i];
-  }
-  return covariance;
+  return MessageCovarianceMap(msg);
 }
 
 // Extract the covariance (as Gaussian Covariance in Shared Noise Model) from
-// edge or node message
+// edge or node message. Messages with the same covariance share the model
+// (see NoiseModelCache).
 template <typename MessageT>
 Gaussian::shared_ptr MessageToCovariance(const MessageT& msg) {
-  // TODO: unit test
-  gtsam::Matrix66 covariance = MessageToCovarianceMatrix<MessageT>(msg);
-  Gaussian::shared_ptr noise = Gaussian::Covariance(covariance);
-
-  return noise;
+  return NoiseModelCache::Instance().Get(msg.covariance.data());
 }
 
 // Update covariances in an edge or node message
 template <typename MessageT>
 void UpdateCovariance(MessageT& msg, const gtsam::Matrix66& covariance) {
-  for (size_t i = 0; i < msg.covariance.size(); i++) {
-    size_t row = static_cast<size_t>(i / 6);
-    size_t col = i % 6;
-    msg.covariance[i] = covariance(row, col);
-  }
+  Eigen::Map<Eigen::Matrix<double, 6, 6, Eigen::RowMajor>>(
+      msg.covariance.data()) = covariance;
 }
 template <typename MessageT>
 void UpdateCovariance(MessageT& msg, const gtsam::SharedNoiseModel& noise) {
@@ -108,6 +103,52 @@ void UpdateCovariance(MessageT& msg, const gtsam::SharedNoiseModel& noise) {
   UpdateCovariance(msg, covariance);
 }
 
+// Batch conversions of message arrays (edges or nodes), straight into
+// contiguous buffers laid out as the graph store columns: x y z qx qy qz qw
+// per pose, and the 36 covariance entries row major per message.
+template <typename MessageT>
+void MessagesToPoseBuffer(const std::vector<MessageT>& msgs,
+                          std::vector<double>* poses) {
+  poses->resize(7 * msgs.size());
+  double* p = poses->data();
+  for (const MessageT& msg : msgs) {
+    p[0] = msg.pose.position.x;
+    p[1] = msg.pose.position.y;
+    p[2] = msg.pose.position.z;
+    p[3] = msg.pose.orientation.x;
+    p[4] = msg.pose.orientation.y;
+    p[5] = msg.pose.orientation.z;
+    p[6] = msg.pose.orientation.w;
+    p += 7;
+  }
+}
+
+template <typename MessageT>
+void MessagesToCovarianceBuffer(const std::vector<MessageT>& msgs,
+                                std::vector<double>* covariances) {
+  covariances->resize(36 * msgs.size());
+  double* c = covariances->data();
+  for (const MessageT& msg : msgs) {
+    std::copy(msg.covariance.begin(), msg.covariance.end(), c);
+    c += 36;
+  }
+}
+
+// Poses and interned noise models of every message, in order
+template <typename MessageT>
+void MessagesToGtsam(const std::vector<MessageT>& msgs,
+                     std::vector<gtsam::Pose3>* poses,
+                     std::vector<Gaussian::shared_ptr>* noises) {
+  poses->clear();
+  noises->clear();
+  poses->reserve(msgs.size());
+  noises->reserve(msgs.size());
+  for (const MessageT& msg : msgs) {
+    poses->push_back(MessageToPose(msg));
+    noises->push_back(MessageToCovariance(msg));
+  }
+}
+
 // Convert gtsam data types to a ros message
 geometry_msgs::PoseWithCovariance
 GtsamToRosMsg(const gtsam::Pose3& pose, const gtsam::Matrix66& covariance);
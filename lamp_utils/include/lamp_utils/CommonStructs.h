@@ -86,8 +86,10 @@ struct NodeMessageComparator {
 typedef std::set<EdgeMessage, EdgeMessageComparator> EdgeSet;
 typedef std::set<NodeMessage, NodeMessageComparator> NodeSet;
 
-// Function that maps gtsam::Symbol to internal identifier string.
-typedef boost::function<std::string(gtsam::Symbol)> SymbolIdMapping;
+// Function that maps gtsam::Symbol to internal identifier string. The
+// identifiers are shared by many nodes, so the function returns a reference
+// to a string it keeps instead of building one per call.
+typedef boost::function<const std::string&(gtsam::Symbol)> SymbolIdMapping;
 
 // Forward declaration.
 class PoseGraph;
@@ -259,6 +261,14 @@ public:
 
   std::vector<pose_graph_msgs::PoseGraph::ConstPtr> graphs;
   std::vector<pose_graph_msgs::KeyedScan::ConstPtr> scans;
+  // Keyed scans already converted to point clouds by the handler
+  std::vector<std::pair<gtsam::Key, PointCloud::ConstPtr>> clouds;
+  // Keys of the scans the robots only sent downsampled
+  std::vector<gtsam::Key> coarse_keys;
+  // Points to append to the scans of keys sent in levels of detail, and the
+  // keys whose every layer arrived
+  std::vector<std::pair<gtsam::Key, PointCloud::ConstPtr>> scan_refinements;
+  std::vector<gtsam::Key> complete_keys;
 };
 
 class RobotPoseData : public FactorData {
@@ -0,0 +1,52 @@
+/*
+DoubleBuffer.h
+Front/back versions of a value for one writer and concurrent readers
+*/
+
+#ifndef DOUBLE_BUFFER_H
+#define DOUBLE_BUFFER_H
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace lamp_utils {
+
+// The writer fills the back buffer while readers hold on to the front one,
+// Swap makes the back buffer the new front. The previous front becomes the
+// next back buffer, reused (with the memory it owns, e.g. point cloud
+// points) unless a reader still holds it, so a steady stream of versions does
+// not reallocate. Back and Swap are for a single writer thread.
+template <typename T>
+class DoubleBuffer {
+public:
+  DoubleBuffer() : back_(std::make_shared<T>()) {}
+
+  // Buffer for the next version
+  T& Back() {
+    if (!back_ || back_.use_count() > 1) {
+      back_ = std::make_shared<T>();
+    }
+    return *back_;
+  }
+
+  void Swap() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::swap(front_, back_);
+  }
+
+  // Latest swapped version, nullptr before the first Swap
+  std::shared_ptr<const T> Front() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return front_;
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::shared_ptr<T> front_;
+  std::shared_ptr<T> back_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,138 @@
+/*
+FlatHashMap.h
+Open addressing hash map for keys that are only ever added
+*/
+
+#ifndef FLAT_HASH_MAP_H
+#define FLAT_HASH_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace lamp_utils {
+
+// Hash map over one contiguous slot array with linear probing, a lookup is a
+// few adjacent reads instead of a tree walk or a bucket list. The hash is
+// mixed before probing, so sequential keys (e.g. symbol indices) and weak
+// hashes spread over the table. Keys can not be erased, clear keeps the slots
+// for the next fill. Pointers to values are invalidated by inserts.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class FlatHashMap {
+public:
+  explicit FlatHashMap(size_t capacity = 16) {
+    Reserve(capacity);
+  }
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  inline bool Contains(const K& key) const {
+    return Find(key) != nullptr;
+  }
+
+  // Stored value of key, nullptr if not stored
+  V* Find(const K& key) {
+    Slot& slot = slots_[Probe(key)];
+    return slot.b_used ? &slot.value : nullptr;
+  }
+  const V* Find(const K& key) const {
+    const Slot& slot = slots_[Probe(key)];
+    return slot.b_used ? &slot.value : nullptr;
+  }
+
+  // Adds key with value unless it is stored. Returns the stored value and
+  // true if added.
+  std::pair<V*, bool> Insert(const K& key, const V& value) {
+    // At most half full, probe sequences stay short
+    if (2 * (size_ + 1) > slots_.size()) {
+      Rehash(2 * slots_.size());
+    }
+    Slot& slot = slots_[Probe(key)];
+    if (slot.b_used) {
+      return std::make_pair(&slot.value, false);
+    }
+    slot.key = key;
+    slot.value = value;
+    slot.b_used = true;
+    size_++;
+    return std::make_pair(&slot.value, true);
+  }
+
+  V& operator[](const K& key) {
+    return *Insert(key, V()).first;
+  }
+
+  // Makes room for n keys without rehashing
+  void Reserve(size_t n) {
+    size_t size = 16;
+    while (size < 2 * n) {
+      size <<= 1;
+    }
+    if (size > slots_.size()) {
+      Rehash(size);
+    }
+  }
+
+  void clear() {
+    if (size_ == 0) {
+      return;
+    }
+    for (Slot& slot : slots_) {
+      slot.b_used = false;
+    }
+    size_ = 0;
+  }
+
+  // Calls f(key, value) for every stored key, in unspecified order
+  template <typename F>
+  void ForEach(F f) const {
+    for (const Slot& slot : slots_) {
+      if (slot.b_used)
+        f(slot.key, slot.value);
+    }
+  }
+
+private:
+  struct Slot {
+    K key{};
+    V value{};
+    bool b_used{false};
+  };
+
+  // Slot holding key, or the free slot it would go in
+  size_t Probe(const K& key) const {
+    const size_t mask = slots_.size() - 1;
+    // Fibonacci hashing, the high bits of the product are the well mixed ones
+    size_t i = static_cast<size_t>(
+        (static_cast<uint64_t>(hash_(key)) * 0x9E3779B97F4A7C15ull) >> 32) &
+        mask;
+    while (slots_[i].b_used && !(slots_[i].key == key)) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void Rehash(size_t size) {
+    std::vector<Slot> slots(size);
+    slots.swap(slots_);
+    for (Slot& slot : slots) {
+      if (!slot.b_used)
+        continue;
+      Slot& target = slots_[Probe(slot.key)];
+      target.key = std::move(slot.key);
+      target.value = std::move(slot.value);
+      target.b_used = true;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_{0};
+  Hash hash_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,74 @@
+/*
+G2oStream.h
+Chunked reading and streamed writing of g2o files
+*/
+
+#ifndef G2O_STREAM_H
+#define G2O_STREAM_H
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+#include <pose_graph_msgs/PoseGraph.h>
+
+namespace lamp_utils {
+
+// Reads the VERTEX_SE3:QUAT and EDGE_SE3:QUAT lines of a g2o file a chunk
+// at a time, with the conventions of gtsam::load3D, so a large file never
+// has to be held in memory at once. Other lines are skipped.
+class G2oReader {
+public:
+  bool Open(const std::string& filename);
+  inline bool IsOpen() const { return file_.is_open(); }
+
+  // Reads until max_edges edges were read (0 for the rest of the file). The
+  // vertices met on the way are returned in values. Returns false once the
+  // file is exhausted and nothing was read.
+  bool ReadChunk(size_t max_edges,
+                 gtsam::NonlinearFactorGraph* factors,
+                 gtsam::Values* values);
+
+  inline size_t NumVertices() const { return num_vertices_; }
+  inline size_t NumEdges() const { return num_edges_; }
+  inline size_t NumSkippedLines() const { return num_skipped_; }
+
+private:
+  std::ifstream file_;
+  size_t num_vertices_{0};
+  size_t num_edges_{0};
+  size_t num_skipped_{0};
+};
+
+// Writes g2o lines as they are given, as gtsam::writeG2o formats them
+class G2oWriter {
+public:
+  ~G2oWriter();
+
+  bool Open(const std::string& filename);
+  void Close();
+  inline bool IsOpen() const { return file_.is_open(); }
+
+  void WriteVertex(gtsam::Key key, const gtsam::Pose3& pose);
+  // information in gtsam order, rotation first
+  void WriteEdge(gtsam::Key from,
+                 gtsam::Key to,
+                 const gtsam::Pose3& measured,
+                 const gtsam::Matrix6& information);
+
+  // Nodes, then the odometry, loop closure, artifact and UWB between edges
+  // of a pose graph message. Priors, ranges and IMU factors have no g2o
+  // equivalent and are skipped, as gtsam::writeG2o does.
+  bool WritePoseGraph(const pose_graph_msgs::PoseGraph& graph);
+
+private:
+  std::ofstream file_;
+};
+
+} // namespace lamp_utils
+
+#endif
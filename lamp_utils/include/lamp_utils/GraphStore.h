@@ -0,0 +1,300 @@
+/*
+GraphStore.h
+Columnar storage of the node and edge messages cached by the pose graph
+*/
+
+#ifndef GRAPH_STORE_H
+#define GRAPH_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <gtsam/inference/Key.h>
+
+#include "lamp_utils/CommonStructs.h"
+
+namespace lamp_utils {
+
+// Deduplicates the frame ids and node IDs shared by many entries. Index 0 is
+// always the empty string.
+class StringTable {
+public:
+  StringTable();
+
+  uint32_t Intern(const std::string& str);
+  // Index of str, 0 if it was never interned
+  uint32_t Find(const std::string& str) const;
+  inline size_t size() const { return strings_.size(); }
+  inline const std::string& Get(uint32_t index) const {
+    return strings_[index];
+  }
+
+  void clear();
+  // Estimated heap bytes
+  size_t MemoryBytes() const;
+
+private:
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint32_t> index_;
+};
+
+// Slots of a store by the prefix (gtsam::Symbol::chr()) of their keys, so
+// the entries of one robot are reached without scanning the others. An entry
+// is listed once under each prefix of its keys.
+class PrefixIndex {
+public:
+  void Add(gtsam::Key key, size_t i);
+  void Remove(gtsam::Key key, size_t i);
+  // The entry of key moved from slot from to slot to
+  void Move(gtsam::Key key, size_t from, size_t to);
+  // Copy of the slots, erasing the entries changes them
+  std::vector<size_t> Slots(unsigned char prefix) const;
+  void clear();
+  // Estimated heap bytes
+  size_t MemoryBytes() const;
+
+private:
+  std::unordered_map<unsigned char, std::unordered_set<size_t>> slots_;
+};
+
+// Iterates a store, building each message on dereference.
+template <typename StoreT, typename MessageT>
+class StoreIterator {
+public:
+  typedef std::forward_iterator_tag iterator_category;
+  typedef MessageT value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const MessageT* pointer;
+  typedef MessageT reference;
+
+  StoreIterator(const StoreT* store, size_t index)
+    : store_(store), index_(index) {}
+
+  inline MessageT operator*() const { return store_->At(index_); }
+  inline StoreIterator& operator++() {
+    ++index_;
+    return *this;
+  }
+  inline StoreIterator operator++(int) {
+    StoreIterator it = *this;
+    ++index_;
+    return it;
+  }
+  inline bool operator==(const StoreIterator& other) const {
+    return index_ == other.index_;
+  }
+  inline bool operator!=(const StoreIterator& other) const {
+    return index_ != other.index_;
+  }
+
+private:
+  const StoreT* store_;
+  size_t index_;
+};
+
+// Columns shared by nodes and edges: header stamp and frame, pose (x y z qx
+// qy qz qw) and the 6x6 covariance, stored contiguously per column.
+class PoseCovarianceColumns {
+public:
+  static const size_t kPoseStride = 7;
+  static const size_t kCovarianceStride = 36;
+
+  inline size_t size() const { return stamps_.size(); }
+  inline bool empty() const { return stamps_.empty(); }
+
+  // Read only views of the contiguous columns, entry i starts at
+  // i * kPoseStride and i * kCovarianceStride.
+  inline const std::vector<double>& poses() const { return poses_; }
+  inline const std::vector<double>& covariances() const {
+    return covariances_;
+  }
+
+protected:
+  void ReserveColumns(size_t n);
+  void Append(const std_msgs::Header& header,
+              const geometry_msgs::Pose& pose,
+              const boost::array<double, 36>& covariance);
+  void Assign(size_t i,
+              const std_msgs::Header& header,
+              const geometry_msgs::Pose& pose,
+              const boost::array<double, 36>& covariance);
+  void SetPose(size_t i, const geometry_msgs::Pose& pose);
+  void Read(size_t i,
+            std_msgs::Header* header,
+            geometry_msgs::Pose* pose,
+            boost::array<double, 36>* covariance) const;
+  // Moves the last entry into slot i and drops the last slot
+  void MoveLastTo(size_t i);
+  // Keeps the entries flagged in keep, in order
+  void Compact(const std::vector<bool>& keep);
+  void ClearColumns();
+  // Estimated heap bytes of the columns and strings
+  size_t ColumnBytes() const;
+
+  StringTable strings_;
+
+private:
+  std::vector<ros::Time> stamps_;
+  std::vector<uint32_t> frame_ids_;
+  std::vector<double> poses_;
+  std::vector<double> covariances_;
+};
+
+// Node messages indexed by key. Iteration order is unspecified.
+class NodeStore : public PoseCovarianceColumns {
+public:
+  typedef StoreIterator<NodeStore, NodeMessage> const_iterator;
+
+  inline const_iterator begin() const { return const_iterator(this, 0); }
+  inline const_iterator end() const { return const_iterator(this, size()); }
+
+  inline bool Contains(gtsam::Key key) const {
+    return index_.find(key) != index_.end();
+  }
+
+  // Adds the node unless a node with the same key is stored. Returns true if
+  // added.
+  bool Insert(const NodeMessage& msg);
+  // Adds the node or replaces the one with the same key. Returns true if
+  // added.
+  bool Assign(const NodeMessage& msg);
+  // Only replaces the pose of a stored node. Returns false if not stored.
+  bool SetPose(gtsam::Key key, const geometry_msgs::Pose& pose);
+  bool Erase(gtsam::Key key);
+  // Erases the nodes whose key has the prefix, in time proportional to their
+  // number
+  void ErasePrefix(unsigned char prefix);
+
+  // Erases every node whose key satisfies pred
+  template <typename Pred>
+  void EraseIf(Pred pred) {
+    std::vector<bool> keep(keys_.size());
+    for (size_t i = 0; i < keys_.size(); i++)
+      keep[i] = !pred(keys_[i]);
+    CompactNodes(keep);
+  }
+
+  boost::optional<NodeMessage> Find(gtsam::Key key) const;
+  NodeMessage At(size_t i) const;
+  void AppendTo(NodeMessages* msgs) const;
+
+  inline const std::vector<gtsam::Key>& keys() const { return keys_; }
+
+  void clear();
+  // Estimated heap bytes, for memory accounting
+  size_t MemoryBytes() const;
+
+private:
+  void CompactNodes(const std::vector<bool>& keep);
+
+  std::vector<gtsam::Key> keys_;
+  std::vector<uint32_t> ids_;
+  std::unordered_map<gtsam::Key, size_t> index_;
+  PrefixIndex prefix_index_;
+};
+
+// Edge messages indexed by (key_from, key_to, type), with secondary indices
+// on either key. Iteration order is unspecified.
+class EdgeStore : public PoseCovarianceColumns {
+public:
+  typedef StoreIterator<EdgeStore, EdgeMessage> const_iterator;
+
+  inline const_iterator begin() const { return const_iterator(this, 0); }
+  inline const_iterator end() const { return const_iterator(this, size()); }
+
+  bool Contains(gtsam::Key key_from, gtsam::Key key_to, int type) const;
+  inline bool Contains(const EdgeMessage& msg) const {
+    return Contains(msg.key_from, msg.key_to, msg.type);
+  }
+
+  // Adds the edge unless an edge with the same keys and type is stored.
+  // Returns true if added.
+  bool Insert(const EdgeMessage& msg);
+  // Adds the edge or replaces the one with the same keys and type in its
+  // slot. Returns true if added.
+  bool Assign(const EdgeMessage& msg);
+  bool Erase(gtsam::Key key_from, gtsam::Key key_to, int type);
+  inline bool Erase(const EdgeMessage& msg) {
+    return Erase(msg.key_from, msg.key_to, msg.type);
+  }
+  // Erases the edges with a key of the prefix, in time proportional to
+  // their number
+  void ErasePrefix(unsigned char prefix);
+
+  // Erases every edge for which pred(key_from, key_to, type) holds
+  template <typename Pred>
+  void EraseIf(Pred pred) {
+    std::vector<bool> keep(keys_from_.size());
+    for (size_t i = 0; i < keys_from_.size(); i++)
+      keep[i] = !pred(keys_from_[i], keys_to_[i], types_[i]);
+    CompactEdges(keep);
+  }
+
+  boost::optional<EdgeMessage>
+  Find(gtsam::Key key_from, gtsam::Key key_to, int type) const;
+  inline boost::optional<EdgeMessage> Find(const EdgeMessage& msg) const {
+    return Find(msg.key_from, msg.key_to, msg.type);
+  }
+  // Number of edges from or to key, an edge from key to itself counts twice
+  inline size_t Degree(gtsam::Key key) const {
+    return from_index_.count(key) + to_index_.count(key);
+  }
+  // Lookups by partial key return the smallest match in (key_from, key_to,
+  // type) order.
+  boost::optional<EdgeMessage> FindAnyType(gtsam::Key key_from,
+                                           gtsam::Key key_to) const;
+  boost::optional<EdgeMessage> FindKeyFrom(gtsam::Key key_from) const;
+  boost::optional<EdgeMessage> FindKeyTo(gtsam::Key key_to) const;
+
+  EdgeMessage At(size_t i) const;
+  void AppendTo(EdgeMessages* msgs) const;
+
+  // Room for n edges in total
+  void Reserve(size_t n);
+  void clear();
+  // Estimated heap bytes, for memory accounting
+  size_t MemoryBytes() const;
+
+private:
+  struct EdgeKey {
+    gtsam::Key key_from;
+    gtsam::Key key_to;
+    int type;
+    inline bool operator==(const EdgeKey& other) const {
+      return key_from == other.key_from && key_to == other.key_to &&
+          type == other.type;
+    }
+  };
+  struct EdgeKeyHash {
+    size_t operator()(const EdgeKey& key) const;
+  };
+  typedef std::unordered_multimap<gtsam::Key, size_t> KeyIndex;
+
+  bool IsBefore(size_t lhs, size_t rhs) const;
+  boost::optional<EdgeMessage> FindSmallest(const KeyIndex& index,
+                                            gtsam::Key key,
+                                            bool match_from,
+                                            gtsam::Key key_from) const;
+  void CompactEdges(const std::vector<bool>& keep);
+  void RebuildIndices();
+
+  std::vector<gtsam::Key> keys_from_;
+  std::vector<gtsam::Key> keys_to_;
+  std::vector<int> types_;
+  std::vector<double> ranges_;
+  std::vector<double> range_errors_;
+  std::unordered_map<EdgeKey, size_t, EdgeKeyHash> index_;
+  KeyIndex from_index_;
+  KeyIndex to_index_;
+  PrefixIndex prefix_index_;
+};
+
+} // namespace lamp_utils
+
+#endif
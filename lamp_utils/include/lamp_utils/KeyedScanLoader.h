@@ -0,0 +1,87 @@
+/*
+KeyedScanLoader.h
+Background loading of the keyed scans of a loaded pose graph
+*/
+
+#ifndef KEYED_SCAN_LOADER_H
+#define KEYED_SCAN_LOADER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+// Reads the scans of the given keys with read on worker threads (the
+// scan_loader thread group), in key order, so the graph they belong to is
+// usable before they are. A scan asked for before the workers got to it is
+// read on the calling thread, or awaited if a worker is reading it. A scan
+// taken out of the loader is read again if asked for later. Thread safe.
+class KeyedScanLoader {
+public:
+  // Called concurrently, returns nullptr if the scan cannot be read
+  typedef std::function<PointCloud::Ptr(const gtsam::Key&)> ReadFunction;
+
+  // Starts the workers, num_threads is capped by the thread governor
+  KeyedScanLoader(const std::vector<gtsam::Key>& keys,
+                  const ReadFunction& read,
+                  size_t num_threads);
+  // Stops the workers after the scans they are reading
+  ~KeyedScanLoader();
+  KeyedScanLoader(const KeyedScanLoader&) = delete;
+  KeyedScanLoader& operator=(const KeyedScanLoader&) = delete;
+
+  bool Has(const gtsam::Key& key) const;
+  // In key order
+  inline const std::vector<gtsam::Key>& Keys() const { return keys_; }
+
+  // Scan of key, kept by the loader. Returns nullptr if the key has no scan
+  // or it cannot be read.
+  PointCloudConstPtr Get(const gtsam::Key& key);
+  // Same, handing the scan over to the caller
+  PointCloudConstPtr Take(const gtsam::Key& key);
+
+  // Blocks until every key was read once
+  void Wait();
+  bool IsDone() const;
+  size_t NumRead() const;
+  // Of the scans kept by the loader
+  size_t ResidentBytes() const;
+
+private:
+  enum class State { PENDING, READING, READ, TAKEN };
+  struct Entry {
+    State state{State::PENDING};
+    PointCloudConstPtr scan;
+  };
+
+  void WorkerLoop();
+  PointCloudConstPtr Load(const gtsam::Key& key, bool b_take);
+  // Stores the scan read for entry, with the lock held
+  void Finish(Entry* entry, const PointCloudConstPtr& scan, bool b_take);
+
+  std::vector<gtsam::Key> keys_;
+  const ReadFunction read_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable read_cv_;
+  std::unordered_map<gtsam::Key, Entry> entries_;
+  // Next key for the workers
+  size_t next_{0};
+  size_t num_read_{0};
+  size_t resident_bytes_{0};
+  bool b_shutdown_{false};
+  std::vector<std::thread> workers_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,98 @@
+/*
+KeyedScanStore.h
+Memory bounded keyed scan storage with LRU eviction and on-disk spill
+*/
+
+#ifndef KEYED_SCAN_STORE_H
+#define KEYED_SCAN_STORE_H
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <gtsam/inference/Key.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+// Keeps keyed scans within a RAM budget. When the budget is exceeded the
+// least recently used scans are compressed into a spill file and dropped from
+// memory, and are paged back in (through a read-only mapping of the file) the
+// next time they are requested. Scans handed out stay valid after eviction
+// since the store only drops its own reference.
+// Thread safe.
+class KeyedScanStore {
+public:
+  struct Stats {
+    size_t hits{0};      // Get served from memory
+    size_t misses{0};    // Get paged in from the spill file
+    size_t evictions{0}; // Scans dropped from memory
+    size_t resident_bytes{0};
+    size_t spilled_bytes{0}; // Compressed size of the spill file
+  };
+
+  KeyedScanStore();
+  ~KeyedScanStore();
+
+  // A budget of 0 keeps every scan in memory. The spill file is created in
+  // spill_directory and removed when the store is destroyed
+  bool Configure(size_t ram_budget_bytes, const std::string& spill_directory);
+
+  // Called with the store locked whenever a scan leaves memory (evicted or
+  // erased), so caches derived from the scan can be dropped with it
+  void SetEvictionCallback(
+      const std::function<void(const gtsam::Key&)>& callback);
+
+  // Returns false if the key already has a scan
+  bool Insert(const gtsam::Key& key, const PointCloudConstPtr& scan);
+
+  // Returns nullptr if the key has no scan
+  PointCloudConstPtr Get(const gtsam::Key& key);
+
+  bool Has(const gtsam::Key& key) const;
+  bool Erase(const gtsam::Key& key);
+  void Clear();
+  size_t Size() const;
+
+  Stats GetStats() const;
+
+private:
+  struct Entry {
+    PointCloudConstPtr scan; // nullptr while evicted
+    size_t bytes{0};
+    bool b_on_disk{false};
+    size_t offset{0};
+    size_t raw_bytes{0};
+    size_t compressed_bytes{0};
+    std::list<gtsam::Key>::iterator lru_it;
+  };
+
+  bool Spill(Entry* entry);
+  PointCloudConstPtr PageIn(Entry* entry);
+  bool MapSpillFile(size_t min_size);
+  void EvictToBudget();
+  void CloseSpillFile();
+
+  static size_t ScanBytes(const PointCloudConstPtr& scan);
+
+  mutable std::mutex mutex_;
+  std::unordered_map<gtsam::Key, Entry> entries_;
+  // Resident keys, most recently used first
+  std::list<gtsam::Key> lru_;
+
+  size_t ram_budget_bytes_{0};
+  Stats stats_;
+  std::function<void(const gtsam::Key&)> eviction_callback_;
+
+  int spill_fd_{-1};
+  size_t spill_size_{0};
+  char* spill_map_{nullptr};
+  size_t spill_map_size_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
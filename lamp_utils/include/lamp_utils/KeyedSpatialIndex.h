@@ -0,0 +1,78 @@
+/*
+KeyedSpatialIndex.h
+Spatial index over keyed positions for fast proximity queries
+*/
+
+#ifndef KEYED_SPATIAL_INDEX_H
+#define KEYED_SPATIAL_INDEX_H
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/geometry/Point3.h>
+#include <gtsam/inference/Key.h>
+
+namespace lamp_utils {
+
+// Voxel hash over keyed 3D positions. Supports incremental insertion, update
+// and removal of keys and radius queries without scanning every key.
+class KeyedSpatialIndex {
+public:
+  explicit KeyedSpatialIndex(double cell_size = 10.0);
+
+  // Change the voxel size (re-buckets all stored keys)
+  void SetCellSize(double cell_size);
+  inline double GetCellSize() const {
+    return cell_size_;
+  }
+
+  // Insert a key, or move it if it is already in the index
+  void Insert(const gtsam::Key& key, const gtsam::Point3& position);
+  // Insert or move many keys at once, e.g. after an optimization. Re-buckets
+  // everything instead when the batch moves a large part of the index
+  void InsertBatch(
+      const std::vector<std::pair<gtsam::Key, gtsam::Point3>>& keyed_positions);
+  bool Erase(const gtsam::Key& key);
+  void Clear();
+
+  inline bool Has(const gtsam::Key& key) const {
+    return positions_.count(key) > 0;
+  }
+  inline size_t Size() const {
+    return positions_.size();
+  }
+
+  // Get all keys within radius of position (in no particular order)
+  std::vector<gtsam::Key> RadiusSearch(const gtsam::Point3& position,
+                                       double radius) const;
+
+private:
+  struct Cell {
+    int x, y, z;
+    bool operator==(const Cell& other) const {
+      return x == other.x && y == other.y && z == other.z;
+    }
+  };
+
+  struct CellHash {
+    size_t operator()(const Cell& c) const {
+      // Large primes from Teschner et al. spatial hashing
+      return static_cast<size_t>(c.x) * 73856093 ^
+          static_cast<size_t>(c.y) * 19349663 ^
+          static_cast<size_t>(c.z) * 83492791;
+    }
+  };
+
+  Cell ToCell(const gtsam::Point3& position) const;
+  void RemoveFromCell(const Cell& cell, const gtsam::Key& key);
+  void Rebucket();
+
+  double cell_size_;
+  std::unordered_map<Cell, std::vector<gtsam::Key>, CellHash> cells_;
+  std::unordered_map<gtsam::Key, gtsam::Point3> positions_;
+};
+
+} // namespace lamp_utils
+
+#endif // KEYED_SPATIAL_INDEX_H
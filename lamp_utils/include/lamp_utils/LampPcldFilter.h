@@ -8,6 +8,7 @@
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/ObservabilityCache.h>
 #include <lamp_utils/PointCloudUtils.h>
 
 struct LampPcldFilterParams {
@@ -32,17 +33,37 @@ public:
 
   void Filter(const PointCloud& original_cloud, PointCloud::Ptr new_cloud);
 
+  // Observability of the last filtered cloud, if the observability check
+  // computed it on that exact cloud (no random filter after it)
+  bool GetObservability(lamp_utils::ScanObservability* observability) const;
+
 private:
+  // Voxel filters original_cloud into new_cloud with the leaf size that
+  // gives close to target_pt_size points for this scan. With the
+  // observability check the normals of new_cloud are computed and stored in
+  // its points, for the observability estimate and for later ICP.
   void AdaptiveGridFilter(const double& target_pt_size,
                           const double& min_leaf_size,
                           const double& max_leaf_size,
                           const PointCloud& original_cloud,
                           PointCloud::Ptr new_cloud);
 
+  // Counts the occupied voxels of cloud for a ladder of leaf sizes between
+  // min and max in one pass, and interpolates the leaf size giving
+  // target_pt_size voxels
+  double SelectLeafSize(const PointCloud& cloud,
+                        const double& target_pt_size,
+                        const double& min_leaf_size,
+                        const double& max_leaf_size) const;
+
   LampPcldFilterParams params_;
   double grid_leaf_size_;
   double prev_observability_;
+  // Relative observability loss of the last scan, positive when it dropped
+  double obs_factor_{0.0};
   bool processed_first_cloud_;
+  bool b_observability_{false};
+  lamp_utils::ScanObservability observability_;
 };
 
 #endif
\ No newline at end of file
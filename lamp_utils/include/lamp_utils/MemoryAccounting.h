@@ -0,0 +1,119 @@
+/*
+MemoryAccounting.h
+Live bytes and high-water marks of the stores of a process, by subsystem
+*/
+
+#ifndef MEMORY_ACCOUNTING_H
+#define MEMORY_ACCOUNTING_H
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <ros/ros.h>
+
+#include "lamp_utils/Metrics.h"
+
+namespace lamp_utils {
+
+class MemoryAccountant;
+
+// Bytes held by one store, registered with the MemoryAccountant under the
+// name of its subsystem for the lifetime of the account. Stores of the same
+// subsystem (e.g. every PoseGraph) add up. A store sets its bytes itself
+// (Set) or, if it is thread safe, hands a sampler called on each update.
+// A cache may also hand a pressure callback, asked to free bytes when the
+// process exceeds its budget. The sampler and the callback run on the
+// updating thread, so the account must be destroyed outside the locks they
+// take.
+class MemoryAccount {
+public:
+  typedef std::function<size_t()> Sampler;
+  // Asked to free at least the bytes given, returns the bytes freed
+  typedef std::function<size_t(size_t)> PressureCallback;
+
+  explicit MemoryAccount(const std::string& name,
+                         const Sampler& sampler = nullptr,
+                         const PressureCallback& pressure_callback = nullptr);
+  // A copy joins the subsystem with no bytes, sampler or callback, those
+  // belong to the store of the original
+  MemoryAccount(const MemoryAccount& other);
+  // Keeps the registration and bytes of this account
+  MemoryAccount& operator=(const MemoryAccount& other);
+  ~MemoryAccount();
+
+  void Set(size_t bytes);
+  size_t Bytes() const;
+  inline const std::string& Name() const { return name_; }
+
+private:
+  friend class MemoryAccountant;
+
+  void Register();
+
+  std::string name_;
+  Sampler sampler_;
+  PressureCallback pressure_callback_;
+  // Guarded by the accountant
+  size_t bytes_{0};
+};
+
+// Sums the accounts of the process by subsystem. Update, called by the
+// MetricsPublisher, samples the accounts, sets memory.<name>.bytes and
+// memory.<name>.peak (high-water mark) per subsystem and memory.total.bytes
+// and .peak, then, over the budget, asks the pressure callbacks to free the
+// excess, largest account first. Thread safe.
+class MemoryAccountant {
+public:
+  static MemoryAccountant& Instance();
+
+  MemoryAccountant();
+
+  // Reads memory/budget_mb relative to n, 0 for no budget. Only the first
+  // call of the process applies it, later ones (other nodelets) return true
+  // without reading.
+  bool LoadParameters(const ros::NodeHandle& n);
+
+  void SetBudget(size_t bytes);
+  size_t Budget() const;
+
+  void Update();
+
+  size_t Bytes(const std::string& name) const;
+  size_t Peak(const std::string& name) const;
+  size_t TotalBytes() const;
+  size_t TotalPeak() const;
+
+private:
+  MemoryAccountant(const MemoryAccountant&) = delete;
+  MemoryAccountant& operator=(const MemoryAccountant&) = delete;
+
+  friend class MemoryAccount;
+
+  struct Subsystem {
+    size_t bytes{0};
+    size_t peak{0};
+    std::set<MemoryAccount*> accounts;
+  };
+
+  void Register(MemoryAccount* account);
+  void Unregister(MemoryAccount* account);
+  void Set(MemoryAccount* account, size_t bytes);
+  size_t Bytes(const MemoryAccount* account) const;
+
+  // Held by Update while it calls samplers and callbacks, and by Unregister
+  // so an account is not destroyed under them
+  std::mutex update_mutex_;
+  mutable std::mutex mutex_;
+  bool b_loaded_{false};
+  size_t budget_{0};
+  std::map<std::string, Subsystem> subsystems_;
+  size_t total_bytes_{0};
+  size_t total_peak_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,151 @@
+/*
+Metrics.h
+Process-wide counters, gauges and histograms published as diagnostics
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <diagnostic_msgs/DiagnosticStatus.h>
+#include <ros/ros.h>
+
+namespace lamp_utils {
+
+// Writers add to one of a few cache line aligned shards picked per thread,
+// so callbacks on different threads do not contend on one atomic. Readers
+// sum the shards.
+const size_t kMetricShards = 16;
+
+class Counter {
+public:
+  void Increment(int64_t n = 1);
+  int64_t Value() const;
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> value{0};
+  };
+  Shard shards_[kMetricShards];
+};
+
+// Last value set wins, e.g. a queue depth or the bytes held by a store
+class Gauge {
+public:
+  inline void Set(double value) {
+    value_.store(value, std::memory_order_relaxed);
+  }
+  inline double Value() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<double> value_{0.0};
+};
+
+// Counts per fixed bucket, bucket i holds the samples up to bounds[i] and
+// the last bucket everything above
+class Histogram {
+public:
+  explicit Histogram(const std::vector<double>& bounds);
+
+  void Observe(double value);
+
+  struct Summary {
+    uint64_t count{0};
+    double sum{0.0};
+    // Upper bound of the bucket holding the quantile (the last bound for
+    // the overflow bucket)
+    double p50{0.0};
+    double p99{0.0};
+  };
+  Summary Summarize() const;
+  inline const std::vector<double>& bounds() const { return bounds_; }
+
+private:
+  struct alignas(64) Shard {
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<double> sum{0.0};
+  };
+  std::vector<double> bounds_;
+  Shard shards_[kMetricShards];
+};
+
+// Callback latency buckets in ms
+std::vector<double> LatencyBucketsMs();
+
+// Metrics of the process by name. References returned stay valid for the
+// life of the process, so callers look a metric up once and keep it.
+// Thread safe.
+class MetricsRegistry {
+public:
+  static MetricsRegistry& Instance();
+
+  Counter& GetCounter(const std::string& name);
+  Gauge& GetGauge(const std::string& name);
+  // bounds are only used when the histogram is created
+  Histogram& GetHistogram(const std::string& name,
+                          const std::vector<double>& bounds =
+                              LatencyBucketsMs());
+
+  // Every metric as name/value pairs sorted by name, histograms as
+  // <name>.count, .mean, .p50 and .p99
+  std::vector<std::pair<std::string, double>> Snapshot() const;
+  void ToDiagnostic(const std::string& name,
+                    diagnostic_msgs::DiagnosticStatus* status) const;
+
+private:
+  MetricsRegistry() = default;
+  MetricsRegistry(const MetricsRegistry&) = delete;
+  MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<Counter>> counters_;
+  std::map<std::string, std::unique_ptr<Gauge>> gauges_;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms_;
+};
+
+// Publishes the registry of the process on /lamp/metrics, named after the
+// node, at a fixed rate (1 Hz by default). Nodes only need to start it; when
+// several are started in one process (nodelets) only the first publishes.
+class MetricsPublisher {
+public:
+  ~MetricsPublisher();
+
+  void Start(const ros::NodeHandle& n, double rate = 1.0);
+  void Stop();
+
+private:
+  void TimerCallback(const ros::TimerEvent& ev);
+
+  bool b_started_{false};
+  std::string name_;
+  ros::Publisher pub_;
+  ros::Timer timer_;
+};
+
+// Observes the time from construction to destruction in ms
+class ScopedLatency {
+public:
+  explicit ScopedLatency(Histogram& histogram)
+    : histogram_(histogram), start_(ros::WallTime::now()) {}
+  ~ScopedLatency() {
+    histogram_.Observe((ros::WallTime::now() - start_).toSec() * 1000.0);
+  }
+
+private:
+  Histogram& histogram_;
+  ros::WallTime start_;
+};
+
+} // namespace lamp_utils
+
+#endif
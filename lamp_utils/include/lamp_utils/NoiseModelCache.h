@@ -0,0 +1,67 @@
+/*
+NoiseModelCache.h
+Process-wide interning of the Gaussian noise models of graph messages
+*/
+
+#ifndef NOISE_MODEL_CACHE_H
+#define NOISE_MODEL_CACHE_H
+
+#include <array>
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+
+#include <gtsam/linear/NoiseModel.h>
+
+namespace lamp_utils {
+
+// Every edge message used to get its own Gaussian::Covariance, a Cholesky
+// factorization and a heap allocation, although most edges of a robot carry
+// the same few covariances (fixed odometry and loop closure noise). The
+// cache hands out one immutable model per distinct covariance, whether it
+// comes from a message or from a model built elsewhere (Intern), so the
+// factors of the pose graph share them. Covariances are compared exactly.
+// The cache is dropped when it reaches its capacity, handed out models stay
+// valid.
+class NoiseModelCache {
+public:
+  typedef std::array<double, 36> Covariance;
+
+  static NoiseModelCache& Instance();
+
+  // Model of the row major 6x6 covariance
+  gtsam::noiseModel::Gaussian::shared_ptr Get(const double* covariance);
+
+  // The cached model with the covariance of model, which is cached if there
+  // is none, keeping its type (e.g. Diagonal). Models that are not 6
+  // dimensional Gaussians (robust, isotropic range noise) are returned as is.
+  gtsam::SharedNoiseModel Intern(const gtsam::SharedNoiseModel& model);
+
+  void SetCapacity(size_t capacity);
+  size_t Size() const;
+  void Clear();
+
+  // Models handed out from the cache rather than created
+  size_t GetNumHits() const;
+
+private:
+  NoiseModelCache() = default;
+  NoiseModelCache(const NoiseModelCache&) = delete;
+  NoiseModelCache& operator=(const NoiseModelCache&) = delete;
+
+  struct CovarianceHash {
+    size_t operator()(const Covariance& c) const;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<Covariance,
+                     gtsam::noiseModel::Gaussian::shared_ptr,
+                     CovarianceHash>
+      models_;
+  size_t capacity_{4096};
+  size_t num_hits_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
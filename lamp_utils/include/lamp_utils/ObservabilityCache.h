@@ -0,0 +1,95 @@
+/*
+ObservabilityCache.h
+Process-wide cache of the ICP observability of keyed scans
+*/
+
+#ifndef OBSERVABILITY_CACHE_H
+#define OBSERVABILITY_CACHE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <gtsam/inference/Key.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+struct ScanObservability {
+  // Eigenvalues of ComputeIcpObservability
+  Eigen::Matrix<double, 3, 1> eigenvalues;
+  size_t num_points{0};
+};
+
+// The observability of a keyed scan needs the normals and an eigen
+// decomposition over the whole cloud. It is computed once per key, on the
+// cache worker threads, and read by every consumer of the process (the
+// observability queue and prioritization, and the robot that filtered the
+// scan before keying it).
+class ObservabilityCache {
+public:
+  static ObservabilityCache& Instance();
+
+  // Workers used by Request, only ever raised
+  void SetNumThreads(size_t num_threads);
+
+  // Queue the computation for key, unless cached or already queued
+  void Request(const gtsam::Key& key, const PointCloudConstPtr& scan);
+
+  // Compute on the calling thread if not cached
+  ScanObservability GetOrCompute(const gtsam::Key& key,
+                                 const PointCloudConstPtr& scan);
+
+  // Store an observability computed elsewhere (no-op if the key exists)
+  void Insert(const gtsam::Key& key, const ScanObservability& observability);
+
+  // Returns false if the key is not computed (yet)
+  bool Get(const gtsam::Key& key, ScanObservability* observability) const;
+
+  // Called with each key once its observability is cached, on the thread
+  // that computed it. Listeners must be quick, they hold the listener lock.
+  typedef std::function<void(const gtsam::Key&)> Listener;
+  // Returns the id to remove the listener with
+  size_t AddListener(const Listener& listener);
+  void RemoveListener(size_t id);
+
+  bool Has(const gtsam::Key& key) const;
+  void Erase(const gtsam::Key& key);
+  void Clear();
+  size_t Size() const;
+
+private:
+  ObservabilityCache() = default;
+  ~ObservabilityCache();
+  ObservabilityCache(const ObservabilityCache&) = delete;
+  ObservabilityCache& operator=(const ObservabilityCache&) = delete;
+
+  void WorkerLoop();
+  void NotifyListeners(const gtsam::Key& key);
+
+  mutable std::mutex mutex_;
+  std::condition_variable queue_cv_;
+  std::unordered_map<gtsam::Key, ScanObservability> cache_;
+  std::deque<std::pair<gtsam::Key, PointCloudConstPtr>> queue_;
+  std::unordered_set<gtsam::Key> queued_;
+  std::vector<std::thread> workers_;
+  size_t num_threads_{1};
+  bool b_shutdown_{false};
+
+  std::mutex listeners_mutex_;
+  std::unordered_map<size_t, Listener> listeners_;
+  size_t next_listener_id_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,79 @@
+/*
+PipelineStage.h
+Worker thread fed through a bounded task queue
+*/
+
+#ifndef PIPELINE_STAGE_H
+#define PIPELINE_STAGE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "lamp_utils/Metrics.h"
+
+namespace lamp_utils {
+
+// One stage of a processing pipeline: tasks pushed by the previous stage run
+// in order on the worker thread of this one. The queue is bounded, a full
+// queue blocks the producer (Push) or rejects the task (TryPush), so a stage
+// that cannot keep up shows as backpressure instead of unbounded memory.
+// Until Start is called (and after Stop) tasks run inline on the caller, so
+// the owner can keep a single code path whether the stage is threaded or not.
+// Publishes <name>.queue (depth), <name>.task_ms and <name>.blocked (pushes
+// that waited on a full queue) in the metrics registry.
+class PipelineStage {
+public:
+  typedef std::function<void()> Task;
+
+  PipelineStage(const std::string& name, size_t capacity);
+  ~PipelineStage();
+
+  void Start();
+  // Runs the tasks still queued, then joins the worker
+  void Stop();
+  bool IsRunning() const;
+
+  void SetCapacity(size_t capacity);
+  inline size_t capacity() const {
+    return capacity_;
+  }
+  size_t Size() const;
+
+  // Blocks while the queue is full
+  void Push(Task task);
+  // False, and the task is dropped, if the queue is full
+  bool TryPush(Task task);
+  // Blocks until every task pushed so far has run. Not from a task
+  void Flush();
+
+private:
+  PipelineStage(const PipelineStage&) = delete;
+  PipelineStage& operator=(const PipelineStage&) = delete;
+
+  void WorkerLoop();
+
+  std::string name_;
+  size_t capacity_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::condition_variable idle_;
+  std::deque<Task> tasks_;
+  bool b_running_{false};
+  bool b_stop_{false};
+  bool b_busy_{false};
+  std::thread worker_;
+
+  Gauge& queue_depth_;
+  Histogram& task_ms_;
+  Counter& blocked_;
+};
+
+} // namespace lamp_utils
+
+#endif
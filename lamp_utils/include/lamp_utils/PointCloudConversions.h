@@ -0,0 +1,38 @@
+/*
+PointCloudConversions.h
+Direct conversions between PointCloud2 messages and PCL clouds
+*/
+
+#ifndef POINT_CLOUD_CONVERSIONS_H
+#define POINT_CLOUD_CONVERSIONS_H
+
+#include <pcl/point_cloud.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+// Replacements of pcl::fromROSMsg and pcl::toROSMsg without the intermediate
+// pcl::PCLPointCloud2 copy and the per-call field mapping. The layout of a
+// message is checked against the fields of PointT:
+//  - same layout (e.g. the message came from ToRosMsg with the same point
+//    type): the point buffer is copied with one memcpy
+//  - the fields of PointT found with the same type, at other offsets or in a
+//    message with other fields (e.g. x, y, z, intensity into a Point): each
+//    point is gathered with a few fixed copies, adjacent fields merged into
+//    one, and the missing fields keep their PointT default
+//  - any other layout (other field types, big endian): pcl::fromROSMsg
+// Defined for Point and PointXyzi.
+template <typename PointT>
+void FromRosMsg(const sensor_msgs::PointCloud2& msg,
+                pcl::PointCloud<PointT>* cloud);
+
+// The message gets the fields of PointT and a copy of the point buffer
+template <typename PointT>
+void ToRosMsg(const pcl::PointCloud<PointT>& cloud,
+              sensor_msgs::PointCloud2* msg);
+
+} // namespace lamp_utils
+
+#endif
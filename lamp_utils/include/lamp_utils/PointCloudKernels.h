@@ -0,0 +1,83 @@
+/*
+PointCloudKernels.h
+Transform and voxel downsampling kernels for the LAMP point clouds
+*/
+
+#ifndef POINT_CLOUD_KERNELS_H
+#define POINT_CLOUD_KERNELS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_utils {
+
+// Integer coordinates of a voxel, floor(position / leaf size)
+struct VoxelIndex {
+  int64_t x;
+  int64_t y;
+  int64_t z;
+  inline bool operator==(const VoxelIndex& other) const {
+    return x == other.x && y == other.y && z == other.z;
+  }
+};
+
+struct VoxelIndexHash {
+  inline size_t operator()(const VoxelIndex& v) const {
+    return static_cast<size_t>(v.x * 73856093) ^
+        static_cast<size_t>(v.y * 19349663) ^
+        static_cast<size_t>(v.z * 83492791);
+  }
+};
+
+inline VoxelIndex ToVoxelIndex(const Point& p, double inverse_leaf) {
+  return VoxelIndex{static_cast<int64_t>(std::floor(p.x * inverse_leaf)),
+                    static_cast<int64_t>(std::floor(p.y * inverse_leaf)),
+                    static_cast<int64_t>(std::floor(p.z * inverse_leaf))};
+}
+
+// Transforms the positions of n points from in into out (other fields are
+// copied). in and out may be the same buffer. The work is done on strided
+// Eigen maps over the point arrays in blocks, so the compiler vectorizes it
+// for the enabled instruction set (SSE/AVX/NEON).
+void TransformPoints(const Point* in,
+                     size_t n,
+                     const Eigen::Matrix4d& transform,
+                     Point* out);
+
+// Drop in replacement for pcl::transformPointCloud on the LAMP point type
+void TransformPointCloud(const PointCloud& in,
+                         const Eigen::Matrix4d& transform,
+                         PointCloud* out);
+
+// Transforms in and appends it to out, without an intermediate cloud
+void TransformAndAppend(const PointCloud& in,
+                        const Eigen::Matrix4d& transform,
+                        PointCloud* out);
+
+// Replaces every occupied voxel of the given leaf size by the average of its
+// points over all fields, as pcl::VoxelGrid does. Voxels are found by
+// hashing rather than sorting, points with non finite positions are dropped.
+// Output points are in the order their voxel was first seen. in and out may
+// be the same cloud.
+void VoxelDownsample(const PointCloud& in, double leaf_size, PointCloud* out);
+
+// Splits in into num_layers disjoint levels of detail, an octree of points.
+// Layer 0 holds one point of every occupied voxel of size base_leaf, layer k
+// one point of every voxel of size base_leaf / 2^k not yet represented, and
+// the last layer the remaining points. The layers together hold every point
+// of in (points with non finite positions go to the last layer), so a
+// receiver can use the first layers as a coarse scan and append the others.
+void SplitIntoLayers(const PointCloud& in,
+                     double base_leaf,
+                     int num_layers,
+                     std::vector<PointCloud>* layers);
+
+} // namespace lamp_utils
+
+#endif
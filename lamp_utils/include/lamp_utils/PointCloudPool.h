@@ -0,0 +1,90 @@
+/*
+PointCloudPool.h
+Process-wide pool of recycled point clouds
+*/
+
+#ifndef POINT_CLOUD_POOL_H
+#define POINT_CLOUD_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "lamp_utils/Metrics.h"
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+struct PointCloudPoolStats {
+  // Clouds handed out, and how many of them were recycled
+  size_t acquired{0};
+  size_t reused{0};
+  // Clouds given back and kept, or freed as the pool was full
+  size_t recycled{0};
+  size_t dropped{0};
+  // Clouds waiting in the pool and the points they have room for
+  size_t free{0};
+  size_t free_points{0};
+};
+
+// Keyed scans, their filtered and transformed copies and scratch clouds are
+// allocated at sensor rate and freed in a different order, which fragments
+// the heap and grows the RSS over long missions. Clouds acquired here go
+// back to the pool when the last reference is dropped, on any thread, and
+// are handed out again empty but with their point capacity. The pool keeps
+// at most max_clouds clouds and max_points points of capacity, clouds past
+// that are freed. The statistics are also published as point_cloud_pool.*
+// metrics. Thread safe.
+class PointCloudPool {
+public:
+  static PointCloudPool& Instance();
+
+  // Empty cloud, recycled when one is free
+  PointCloud::Ptr Acquire();
+  // Copy of cloud in a recycled cloud
+  PointCloud::Ptr Copy(const PointCloud& cloud);
+
+  void SetCapacity(size_t max_clouds, size_t max_points);
+  PointCloudPoolStats GetStats() const;
+  // Frees the clouds waiting in the pool
+  void Clear();
+
+private:
+  PointCloudPool();
+  PointCloudPool(const PointCloudPool&) = delete;
+  PointCloudPool& operator=(const PointCloudPool&) = delete;
+
+  // Outlives the pool while clouds are handed out
+  struct State {
+    State();
+    ~State();
+    void Recycle(PointCloud* cloud);
+    void UpdateGauges();
+
+    mutable std::mutex mutex;
+    std::vector<PointCloud*> free;
+    size_t max_clouds{64};
+    size_t max_points{2000000};
+    PointCloudPoolStats stats;
+
+    Gauge& free_gauge;
+    Gauge& free_points_gauge;
+    Counter& acquired_counter;
+    Counter& reused_counter;
+    Counter& dropped_counter;
+  };
+
+  struct Recycler {
+    std::shared_ptr<State> state;
+    void operator()(PointCloud* cloud) const {
+      state->Recycle(cloud);
+    }
+  };
+
+  std::shared_ptr<State> state_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -61,6 +61,20 @@ void ComputeNormals(const typename pcl::PointCloud<pointT>::ConstPtr& input,
   norm_est.compute(*normals);
 }
 
+// True if the points carry normals, i.e. some point has a non zero normal.
+// Points whose normal could not be estimated or encoded keep a zero one.
+bool HasNormals(const PointCloud& cloud);
+
+// Normals of a scan are estimated once, where the scan is made or ingested,
+// and travel with it (octahedral encoded in compressed keyed scans). The
+// GICP covariances are planes built from them, so consumers never search
+// the neighbourhoods again. Computes the normals of cloud in place if it
+// carries none, otherwise scales the stored ones back to unit length (voxel
+// filters average them). Returns true if they were computed.
+bool EnsureNormals(
+    const PointCloud::Ptr& cloud,
+    const NormalComputeParams& params = NormalComputeParams());
+
 void ExtractNormals(
     const PointCloud::ConstPtr& input,
     Normals::Ptr normals,
@@ -89,6 +103,10 @@ void ComputeFeatures(const PointCloud::ConstPtr& keypoints,
                      const int& num_threads,
                      Features::Ptr features);
 
+// Eigenvalues (ascending) of the translation block of the point to plane
+// ICP information of the scan against itself, the sum of n * n' over its
+// points. Uses the stored normals if the scan has them, otherwise estimates
+// them with params. Summed over params.num_threads.
 void ComputeIcpObservability(
     PointCloudConstPtr scan,
     Eigen::Matrix<double, 3, 1>* eigenvalues,
@@ -105,11 +123,25 @@ bool ComputeICPCovariancePointPlane(const PointCloud::ConstPtr& query_cloud,
                                     const Eigen::Matrix4f& T,
                                     Eigen::Matrix<double, 6, 6>* covariance);
 
+// Ap (Hessian) of the point to plane ICP, summed over num_threads
 void ComputeAp_ForPoint2PlaneICP(const PointCloud::Ptr query_normalized,
                                  const Normals::Ptr reference_normals,
                                  const std::vector<size_t>& correspondences,
                                  const Eigen::Matrix4f& T,
-                                 Eigen::Matrix<double, 6, 6>& Ap);
+                                 Eigen::Matrix<double, 6, 6>& Ap,
+                                 int num_threads = 1);
+
+// Same over the matched pairs (query_indices[k], reference_indices[k]), e.g.
+// the final correspondences of the GICP. The query is normalized as by
+// NormalizePCloud without a copy and the normals are read from the reference
+// points, so there is no normal estimation or neighbour search.
+void ComputeAp_ForPoint2PlaneICP(const PointCloud& query,
+                                 const PointCloud& reference,
+                                 const std::vector<int>& query_indices,
+                                 const std::vector<int>& reference_indices,
+                                 const Eigen::Matrix4f& T,
+                                 int num_threads,
+                                 Eigen::Matrix<double, 6, 6>* Ap);
 
 void ConvertPointCloud(const PointCloud::ConstPtr& point_normal_cloud,
                        PointXyziCloud::Ptr point_cloud);
@@ -0,0 +1,69 @@
+/*
+PoseExtrapolator.h
+Constant twist extrapolation of the pose of a robot
+*/
+
+#ifndef POSE_EXTRAPOLATOR_H
+#define POSE_EXTRAPOLATOR_H
+
+#include <cstddef>
+#include <deque>
+
+#include <gtsam/base/Vector.h>
+#include <gtsam/geometry/Pose3.h>
+#include <ros/time.h>
+
+namespace lamp_utils {
+
+struct PosePrediction {
+  ros::Time stamp;
+  gtsam::Pose3 pose;
+  // Seconds past the newest sample
+  double horizon{0};
+  // 1 at the newest sample, falls with the horizon and with how much the
+  // recent motion of the robot varied
+  double confidence{0};
+};
+
+struct PoseExtrapolatorParams {
+  // Samples the twist is averaged over
+  size_t history_size{10};
+  // Furthest the motion is extrapolated, later stamps hold the pose there
+  double max_horizon{3.0};
+  // Confidence decays as exp(-horizon / confidence_time_constant)
+  double confidence_time_constant{2.0};
+};
+
+// Keeps the recent poses of a robot and predicts its pose at a later stamp.
+// The robot is assumed to keep its body frame twist, the average over the
+// history, which covers constant velocity and constant turn rate motion.
+class PoseExtrapolator {
+public:
+  explicit PoseExtrapolator(
+      const PoseExtrapolatorParams& params = PoseExtrapolatorParams());
+
+  // Samples not newer than the last one are ignored, returns false then
+  bool AddSample(const ros::Time& stamp, const gtsam::Pose3& pose);
+
+  // False without samples. Stamps before the newest sample get its pose.
+  bool Predict(const ros::Time& stamp, PosePrediction* prediction) const;
+
+  inline size_t size() const { return history_.size(); }
+  inline bool empty() const { return history_.empty(); }
+  void clear();
+
+private:
+  struct Sample {
+    ros::Time stamp;
+    gtsam::Pose3 pose;
+    // Body frame twist from the previous sample, zero for the first
+    gtsam::Vector6 twist;
+  };
+
+  PoseExtrapolatorParams params_;
+  std::deque<Sample> history_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -10,8 +10,38 @@
 #ifndef POSE_GRAPH_H
 #define POSE_GRAPH_H
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/GraphStore.h>
+#include <lamp_utils/KeyedScanLoader.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/PoseGraphArchive.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/RobotChainIndex.h>
+#include <lamp_utils/RobotPoseIndex.h>
+#include <lamp_utils/SymbolIdIndex.h>
+#include <lamp_utils/TimeKeyIndex.h>
+
+namespace lamp_utils {
+
+// Which odometry nodes PoseGraph::Sparsify marginalizes
+struct SparsificationParams {
+  bool b_enabled{false};
+  // Nodes within this many keys of the newest one of their robot are kept
+  int min_age{200};
+  // A kept node takes over the scans of the marginalized nodes after it up to
+  // this distance (m) and rotation (rad) from it
+  double max_translation{2.0};
+  double max_rotation{0.5};
+};
+
+} // namespace lamp_utils
 
 // Pose graph structure storing values, factors and meta data.
 class PoseGraph {
@@ -21,11 +51,26 @@ class PoseGraph {
   inline const gtsam::Values& GetNewValues() const { return values_new_; }
   inline const gtsam::NonlinearFactorGraph& GetNfg() const { return nfg_; }
 
-  // Modifiable references to pose graph data structures.
-  inline gtsam::Values& GetValues() { return values_; }
+  // Poses of the robot keys, stored densely per robot
+  inline const lamp_utils::RobotPoseIndex& GetRobotPoses() const {
+    return robot_poses_;
+  }
+
+  // Modifiable references to pose graph data structures. Factors must only
+  // be appended to the nfg, the loop closure index refers to their slots.
+  // Values are only modified through the graph, which mirrors the robot
+  // poses in GetRobotPoses().
   inline gtsam::Values& GetNewValues() { return values_new_; }
   inline gtsam::NonlinearFactorGraph& GetNfg() { return nfg_; }
 
+  // IDs of the artifact nodes, linked as the nodes are tracked. Users may
+  // intern their own IDs (e.g. of artifact messages whose node is not in the
+  // graph yet) to compare them with the handles of the graph.
+  inline const lamp_utils::SymbolIdIndex& GetArtifactIds() const {
+    return artifact_ids_;
+  }
+  inline lamp_utils::SymbolIdIndex& GetArtifactIds() { return artifact_ids_; }
+
   // Function that maps gtsam::Symbol to std::string (internal identifier for
   // node messages).
   SymbolIdMapping symbol_id_map;
@@ -34,10 +79,21 @@ class PoseGraph {
 
   // Keep a list of keyed laser scans and keyed timestamps.
   std::map<gtsam::Symbol, PointCloud::ConstPtr> keyed_scans;
-  std::map<gtsam::Symbol, ros::Time> keyed_stamps;  // All nodes
-  std::map<double, gtsam::Symbol> stamp_to_odom_key;
+  lamp_utils::KeyedStampStore keyed_stamps;  // All nodes
+  lamp_utils::StampKeyIndex stamp_to_odom_key;
 
+  // True if no robot chain misses a node (marginalized nodes are bridged by
+  // the odometry replacing them), logging the missing ones otherwise. Kept
+  // as nodes are tracked and erased, so checking takes constant time.
   bool CheckGraphValid() const;
+  inline const lamp_utils::RobotChainIndex& GetRobotChains() const {
+    return robot_chains_;
+  }
+  // Nodes of prefix may be held without the rest of their chain (e.g. those
+  // imported from a prior map), CheckGraphValid leaves them out
+  inline void ExcludeFromChains(unsigned char prefix) {
+    robot_chains_.Exclude(prefix);
+  }
 
   void InsertKeyedScan(const gtsam::Symbol& key,
                        const PointCloud::ConstPtr& scan);
@@ -45,15 +101,31 @@ class PoseGraph {
   void InsertStampedOdomKey(double seconds, const gtsam::Symbol& key);
 
   inline bool HasKey(const gtsam::Symbol& key) const {
-    return values_.exists(key);
+    return robot_poses_.Find(key) != nullptr || values_.exists(key);
   }
   // Check if given key has a registered time stamp.
   inline bool HasStamp(const gtsam::Symbol& key) const {
-    return keyed_stamps.find(key) != keyed_stamps.end();
+    return keyed_stamps.Contains(key);
   }
   inline bool HasScan(const gtsam::Symbol& key) const {
-    return keyed_scans.find(key) != keyed_scans.end();
+    return keyed_scans.find(key) != keyed_scans.end() ||
+        (((scan_archive_ && scan_archive_->HasScan(key)) ||
+          (scan_loader_ && scan_loader_->Has(key))) &&
+         !IsMarginalized(key));
   }
+  // Scan of the given key, read from the loaded archive or zip and kept in
+  // keyed_scans on first access. Returns nullptr if the key has no scan.
+  PointCloud::ConstPtr GetKeyedScan(const gtsam::Symbol& key);
+  // Same without keeping the scans read from the archive, for readers of a
+  // snapshot
+  PointCloud::ConstPtr GetKeyedScan(const gtsam::Symbol& key) const;
+  // Keys with a scan, in memory or in the loaded archive, in key order.
+  std::vector<gtsam::Symbol> GetKeyedScanKeys() const;
+
+  // Sets the memory accounts of the graph (pose_graph.scans, .nodes and
+  // .edges) from what it holds now, in time linear in the scans held. Scans
+  // shared with other graphs are counted by each.
+  void UpdateMemoryAccounts();
 
   // Message filters (if any)
   std::string prefix{""};
@@ -67,7 +139,7 @@ class PoseGraph {
   gtsam::Vector6 initial_noise{gtsam::Vector6::Zero()};
 
   inline gtsam::Pose3 LastPose() const {
-    return values_.at<gtsam::Pose3>(key - 1);
+    return GetPose(key - 1);
   }
   inline void AddLastNodeToNew() {
     gtsam::Key last_node_key = key - 1;
@@ -81,7 +153,8 @@ class PoseGraph {
   }
 
   inline gtsam::Pose3 GetPose(gtsam::Symbol key) const {
-    return values_.at<gtsam::Pose3>(key);
+    const gtsam::Pose3* pose = robot_poses_.Find(key);
+    return pose ? *pose : values_.at<gtsam::Pose3>(key);
   }
 
   void Initialize(const gtsam::Symbol& initial_key,
@@ -116,6 +189,12 @@ class PoseGraph {
                            bool create_msg = true,
                            bool update_value = true);
 
+  // Tracks a batch of edges in one pass. Repeated observations of an
+  // artifact are collapsed into the last one and the changed artifact
+  // factors are replaced with a single rebuild of the graph. Returns the
+  // number of factors added.
+  size_t TrackFactors(const EdgeMessages& msgs);
+
   // Tracks nodes and updates values. Returns true if new node is added.
   // Updates the internal keyed_stamp map for this key.
   bool TrackNode(const Node& node);
@@ -137,12 +216,52 @@ class PoseGraph {
                   const gtsam::SharedNoiseModel& covariance,
                   bool create_msg = true);
 
-  // Removal tools
+  // Removal tools. Edges, priors, factors and values are reached through
+  // per-prefix indices, so the cost follows the size of the removed robot
+  // rather than the whole graph.
   void RemoveRobotFromGraph(std::string robot_name);
   void RemoveEdgesWithPrefix(unsigned char prefix);
   void RemoveValuesWithPrefix(unsigned char prefix);
 
-  // Update to reflect set of inlier loop closures
+  // Sparsification (PoseGraphSparsification.cc). An odometry node whose only
+  // factors are its incoming and outgoing odometry is marginalized exactly
+  // into one odometry edge between its neighbours, the composed measurement
+  // with the propagated covariance (nonlinear factor recovery of a chain
+  // node), and its keyed scan is merged into the scan of its predecessor.
+  // The robot owning the chain decides, receivers of its graphs apply the
+  // marginalizations they can (see ApplyMarginalizations) so all graphs hold
+  // the same edges.
+
+  // Marginalizes the old nodes of the robot with the prefix following
+  // params, starting after the nodes already considered. Returns the keys
+  // marginalized
+  std::vector<gtsam::Key> Sparsify(unsigned char prefix,
+                                   const lamp_utils::SparsificationParams& params);
+  // Marginalizes the given keys in key order, skipping those that have other
+  // factors. Returns the number marginalized
+  size_t MarginalizeNodes(std::vector<gtsam::Key> keys);
+  inline bool IsMarginalized(gtsam::Key key) const {
+    return marginalized_.count(key) > 0;
+  }
+  // Marginalized keys in key order
+  std::vector<gtsam::Key> GetMarginalizedKeys() const;
+  inline const std::vector<gtsam::Key>& GetNewMarginalizedKeys() const {
+    return marginalized_new_;
+  }
+  // Applies the marginalizations of a received graph and drops from edges the
+  // odometry bridging over nodes this graph keeps (e.g. one with a loop
+  // closure of the base station), so no measurement is counted twice
+  void ApplyMarginalizations(const std::vector<gtsam::Key>& keys,
+                             EdgeMessages* edges);
+  // Times the scan of key took over the scan of a marginalized node
+  inline uint32_t GetScanRevision(gtsam::Key key) const {
+    auto it = scan_revisions_.find(key);
+    return it == scan_revisions_.end() ? 0 : it->second;
+  }
+
+  // Update to reflect set of inlier loop closures. Only the factors of the
+  // loop closures that changed are touched: outliers are swapped out of
+  // their slot with the last factor, new inliers are appended.
   void UpdateLoopClosures(const GraphMsgPtr& msg);
 
   // Adds gtsam::Values to internal values and values_new without updating node
@@ -151,6 +270,10 @@ class PoseGraph {
   // Adds factors to internal nfg without updating edge messages.
   void AddNewFactors(const gtsam::NonlinearFactorGraph& nfg);
 
+  // Moves an existing node (value and node message) without going through a
+  // message. Returns false if the key is not in the graph.
+  bool UpdateNodePose(const gtsam::Symbol& key, const gtsam::Pose3& pose);
+
   inline void ClearNewValues() { values_new_.clear(); }
   bool EraseValue(const gtsam::Symbol& key);
 
@@ -169,12 +292,31 @@ class PoseGraph {
     return std::abs(time - target.toSec()) <= time_threshold;
   }
 
-  // Saves pose graph and accompanying point clouds to a zip file.
-  bool Save(const std::string& zipFilename) const;
-
-  // Loads pose graph and accompanying point clouds from a zip file.
-  bool Load(const std::string& zipFilename,
+  // Immutable copy of the graph for readers on other threads (map
+  // regeneration, publishing, saving) while this one keeps tracking. Keyed
+  // scans and factors are never modified in place and are shared, values,
+  // stores and indices are copied. Incremental tracking and symbol_id_map
+  // are left out. Saving a snapshot continues the archive of this graph.
+  std::shared_ptr<const PoseGraph> Snapshot() const;
+
+  // Saves pose graph and accompanying point clouds to an archive (see
+  // PoseGraphArchive.h). Saving again to the same file only appends the scans
+  // added since and the current graph, also when saves to other files came
+  // in between.
+  bool Save(const std::string& filename) const;
+
+  // Loads pose graph and accompanying point clouds. The scans of an archive
+  // stay in the mapped file until requested through GetKeyedScan. Of zip
+  // files of the former format only the graph (from the given bag topic) and
+  // the scan stamps are read before returning, the scans are decompressed by
+  // the scan_loader threads in the background, or on demand by GetKeyedScan.
+  // WaitForScans blocks until they are all read.
+  bool Load(const std::string& filename,
             const std::string& pose_graph_topic_name = "pose_graph");
+  inline void WaitForScans() const {
+    if (scan_loader_)
+      scan_loader_->Wait();
+  }
 
   // Convert entire pose graph to message.
   GraphMsgPtr ToMsg() const;
@@ -195,6 +337,7 @@ class PoseGraph {
     nodes_new_.clear();
     priors_new_.clear();
     values_new_.clear();
+    marginalized_new_.clear();
   }
 
   // Clears entire pose graph (values, factors, meta data)
@@ -204,54 +347,143 @@ class PoseGraph {
     nodes_.clear();
     priors_.clear();
     values_.clear();
+    robot_poses_.clear();
+    robot_chains_.clear();
+    artifact_ids_.clear();
     nfg_ = gtsam::NonlinearFactorGraph();
+    loop_closure_slots_.clear();
+    factor_prefixes_.clear();
+    num_indexed_factors_ = 0;
     keyed_scans.clear();
     keyed_stamps.clear();
     stamp_to_odom_key.clear();
+    marginalized_.clear();
+    scan_revisions_.clear();
+    sparsified_until_.clear();
+    scan_archive_.reset();
+    scan_loader_.reset();
+    archive_writer_ = std::make_shared<ArchiveWriterSlot>();
   }
 
-  inline const EdgeSet& GetEdges() const { return edges_; }
-  inline const NodeSet& GetNodes() const { return nodes_; }
-  inline const EdgeSet& GetPriors() const { return priors_; }
+  inline const lamp_utils::EdgeStore& GetEdges() const { return edges_; }
+  inline const lamp_utils::NodeStore& GetNodes() const { return nodes_; }
+  inline const lamp_utils::EdgeStore& GetPriors() const { return priors_; }
 
-  inline const EdgeSet& GetNewEdges() const { return edges_new_; }
-  inline const NodeSet& GetNewNodes() const { return nodes_new_; }
-  inline const EdgeSet& GetNewPriors() const { return priors_new_; }
+  inline const lamp_utils::EdgeStore& GetNewEdges() const {
+    return edges_new_;
+  }
+  inline const lamp_utils::NodeStore& GetNewNodes() const {
+    return nodes_new_;
+  }
+  inline const lamp_utils::EdgeStore& GetNewPriors() const {
+    return priors_new_;
+  }
 
-  // Retrieves node at the given key, returns nullptr otherwise.
-  // Returns const ptr because std::set only has const_iterators.
-  const NodeMessage* FindNode(const gtsam::Key& key) const;
+  // Retrieves node at the given key, returns none otherwise.
+  boost::optional<NodeMessage> FindNode(const gtsam::Key& key) const;
 
-  // Retrieves edge connecting the given keys, returns nullptr otherwise.
-  // Returns const ptr because std::set only has const_iterators.
-  const EdgeMessage* FindEdge(const gtsam::Key& key_from,
-                              const gtsam::Key& key_to) const;
-  const EdgeMessage* FindEdgeKeyTo(const gtsam::Key& key_to) const;
+  // Retrieves edge connecting the given keys, returns none otherwise.
+  boost::optional<EdgeMessage> FindEdge(const gtsam::Key& key_from,
+                                        const gtsam::Key& key_to) const;
+  boost::optional<EdgeMessage> FindEdgeKeyTo(const gtsam::Key& key_to) const;
 
-  // Retrieves prior of the given key, returns nullptr otherwise.
-  // Returns const ptr because std::set only has const_iterators.
-  const EdgeMessage* FindPrior(const gtsam::Key& key) const;
+  // Retrieves prior of the given key, returns none otherwise.
+  boost::optional<EdgeMessage> FindPrior(const gtsam::Key& key) const;
 
  private:
   gtsam::Values values_;
   gtsam::NonlinearFactorGraph nfg_;
 
-  // Cached messages for edges, nodes and priors to reduce publishing overhead.
-  EdgeSet edges_;
-  NodeSet nodes_;
-  EdgeSet priors_;
+  // Mirror of the robot poses of values_, updated with it
+  lamp_utils::RobotPoseIndex robot_poses_;
+  // Robot keys with a value or marginalized, for CheckGraphValid
+  lamp_utils::RobotChainIndex robot_chains_;
+
+  // Keys of the artifact nodes and their IDs
+  lamp_utils::SymbolIdIndex artifact_ids_;
+
+  // Edges, nodes and priors in columnar form, messages are only built when
+  // publishing.
+  lamp_utils::EdgeStore edges_;
+  lamp_utils::NodeStore nodes_;
+  lamp_utils::EdgeStore priors_;
+
+  // Slot in nfg_ of the factor of every loop closure edge, by (key_from,
+  // key_to)
+  typedef std::pair<gtsam::Key, gtsam::Key> LoopClosureId;
+  struct LoopClosureIdHash {
+    size_t operator()(const LoopClosureId& id) const {
+      return std::hash<gtsam::Key>()(id.first) * 31 +
+          std::hash<gtsam::Key>()(id.second);
+    }
+  };
+  std::unordered_map<LoopClosureId, size_t, LoopClosureIdHash>
+      loop_closure_slots_;
+
+  // Slots in nfg_ by the prefix of the factor keys. Factors are indexed
+  // lazily, up to num_indexed_factors_, as nfg_ is also appended to directly.
+  lamp_utils::PrefixIndex factor_prefixes_;
+  size_t num_indexed_factors_ = 0;
+
+  // Removes the factor in slot by moving the last factor into it
+  void RemoveFactorSlot(size_t slot);
+  void IndexNewFactors();
+  // After nfg_ was rebuilt
+  void RebuildFactorIndices();
+  // Whether an artifact edge moved enough to replace the stored one
+  static bool IsArtifactEdgeChanged(const EdgeMessage& stored,
+                                    const EdgeMessage& msg);
+
+  // Marginalized nodes, never tracked again, and the next index of each
+  // robot Sparsify considers
+  std::unordered_set<gtsam::Key> marginalized_;
+  std::vector<gtsam::Key> marginalized_new_;
+  std::unordered_map<gtsam::Key, uint32_t> scan_revisions_;
+  std::map<unsigned char, uint64_t> sparsified_until_;
+
+  // Incoming and outgoing odometry of a node with no other factor
+  bool GetChainEdges(gtsam::Key key, EdgeMessage* in, EdgeMessage* out) const;
+  // Odometry edge over a node of the graph
+  bool BridgesNode(const EdgeMessage& edge) const;
+  // Removes the node, its stamps and values, and hands its scan to key_to
+  void EraseMarginalizedNode(gtsam::Key key,
+                             gtsam::Key key_to,
+                             const gtsam::Pose3& pose_in_key_to);
 
   // Variables for tracking the new features only
   gtsam::Values values_new_;
-  EdgeSet edges_new_;
-  NodeSet nodes_new_;
-  EdgeSet priors_new_;
+  lamp_utils::EdgeStore edges_new_;
+  lamp_utils::NodeStore nodes_new_;
+  lamp_utils::EdgeStore priors_new_;
+
+  // Archive the scans were loaded from and those saves wrote, by file,
+  // which the next save to the same file continues. The writers are shared
+  // with the snapshots, saves are serialized on them.
+  std::shared_ptr<lamp_utils::PoseGraphArchiveReader> scan_archive_;
+  // Scans of the zip loaded last, shared with the snapshots
+  std::shared_ptr<lamp_utils::KeyedScanLoader> scan_loader_;
+  struct ArchiveWriterSlot {
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<lamp_utils::PoseGraphArchiveWriter>>
+        writers;
+  };
+  std::shared_ptr<ArchiveWriterSlot> archive_writer_{
+      std::make_shared<ArchiveWriterSlot>()};
+
+  // Set by UpdateMemoryAccounts, a snapshot starts with empty accounts
+  lamp_utils::MemoryAccount scans_account_{"pose_graph.scans"};
+  lamp_utils::MemoryAccount nodes_account_{"pose_graph.nodes"};
+  lamp_utils::MemoryAccount edges_account_{"pose_graph.edges"};
+
+  bool LoadZip(const std::string& zipFilename,
+               const std::string& pose_graph_topic_name);
 
   // Convert incremental pose graph with given values, edges and priors to
   // message.
-  GraphMsgPtr ToMsg_(const EdgeSet& edges,
-                     const NodeSet& nodes,
-                     const EdgeSet& priors) const;
+  GraphMsgPtr ToMsg_(const lamp_utils::EdgeStore& edges,
+                     const lamp_utils::NodeStore& nodes,
+                     const lamp_utils::EdgeStore& priors,
+                     const std::vector<gtsam::Key>& marginalized) const;
 };
 
 #endif
@@ -0,0 +1,244 @@
+/*
+PoseGraphArchive.h
+Chunked, indexed file format for saved pose graphs and their keyed scans
+*/
+
+#ifndef POSE_GRAPH_ARCHIVE_H
+#define POSE_GRAPH_ARCHIVE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/PoseGraph.h>
+#include <ros/time.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+// Layout of an archive:
+//   file header | block | block | ... | index block | trailer
+// Every block starts with a BlockHeader followed by its zlib compressed
+// payload: one keyed scan per scan block, the serialized pose graph message
+// for a graph block. Each commit also writes a poses block, uncompressed so
+// it is searched in place: the node poses by key and by cell of a voxel grid.
+// The index lists the offset of every scan block and of the latest graph and
+// poses blocks, the fixed size trailer at the end of the file points to the
+// index. Appending rewrites only the index and the trailer.
+// Every commit ends with a trailer, the blocks of a commit cut short are
+// ignored and the archive reads as of the commit before.
+namespace archive {
+
+const char kMagic[8] = {'L', 'A', 'M', 'P', 'P', 'G', 'A', '1'};
+const uint32_t kVersion = 1;
+
+enum BlockType : uint32_t { SCAN = 1, GRAPH = 2, INDEX = 3, POSES = 4 };
+
+// Edge of the cells of the poses block
+const double kPoseCellSize = 20.0;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  // sizeof(Point) of the writer, points are stored raw
+  uint32_t point_size;
+};
+
+struct BlockHeader {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t key;
+  int64_t stamp_ns;
+  uint64_t raw_bytes;
+  uint64_t stored_bytes;
+};
+
+struct IndexEntry {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t key;
+  int64_t stamp_ns;
+  uint64_t offset; // Of the block header
+  uint64_t raw_bytes;
+  uint64_t stored_bytes;
+};
+
+// Poses block payload:
+//   PosesHeader | PoseEntry[num_poses] by key | CellEntry[num_cells] by cell
+//   | uint64_t entry of each cell member [num_poses]
+struct PosesHeader {
+  double cell_size;
+  uint64_t num_poses;
+  uint64_t num_cells;
+};
+
+struct PoseEntry {
+  uint64_t key;
+  int64_t stamp_ns;
+  double position[3];
+  double orientation[4]; // w, x, y, z
+};
+
+struct CellEntry {
+  int32_t x;
+  int32_t y;
+  int32_t z;
+  uint32_t num_members;
+  uint64_t first_member;
+};
+
+struct Trailer {
+  uint64_t index_offset;
+  uint64_t num_entries;
+  char magic[8];
+};
+
+} // namespace archive
+
+// Returns true if filename starts with the archive magic
+bool IsPoseGraphArchive(const std::string& filename);
+
+// Read only access to an archive through a mapping of the file. Scans are
+// only decompressed when asked for. Reads are thread safe.
+class PoseGraphArchiveReader {
+public:
+  PoseGraphArchiveReader() = default;
+  ~PoseGraphArchiveReader();
+  PoseGraphArchiveReader(const PoseGraphArchiveReader&) = delete;
+  PoseGraphArchiveReader& operator=(const PoseGraphArchiveReader&) = delete;
+
+  bool Open(const std::string& filename);
+  void Close();
+  inline bool IsOpen() const { return map_ != nullptr; }
+  inline const std::string& filename() const { return filename_; }
+
+  // Latest graph committed to the archive, nullptr if none or corrupted
+  pose_graph_msgs::PoseGraphPtr ReadGraph() const;
+
+  inline bool HasScan(gtsam::Key key) const {
+    return scans_.find(key) != scans_.end();
+  }
+  // Returns nullptr if the key has no scan or the block is corrupted
+  PointCloud::Ptr ReadScan(gtsam::Key key) const;
+  // Compressed block of the scan of key, header included, for copying it
+  // into another archive without decompressing
+  bool GetScanBlock(gtsam::Key key,
+                    const char** data,
+                    size_t* size,
+                    ros::Time* stamp) const;
+
+  std::vector<gtsam::Key> ScanKeys() const;
+  inline size_t NumScans() const { return scans_.size(); }
+  ros::Time ScanStamp(gtsam::Key key) const;
+
+  // Without a poses block (archives of former commits) the poses are only
+  // in the graph
+  inline bool HasPoseIndex() const { return b_has_poses_; }
+  // Node of key in the poses block, false if not there
+  bool FindPose(gtsam::Key key, archive::PoseEntry* pose) const;
+  // Nodes of the poses block within radius of position, in key order. Only
+  // the cells around position are read from the file
+  std::vector<archive::PoseEntry> PosesWithin(const double position[3],
+                                              double radius) const;
+  // Symbol prefixes of the nodes of the poses block
+  std::vector<unsigned char> PosePrefixes() const;
+
+  inline const std::vector<archive::IndexEntry>& index() const {
+    return index_;
+  }
+  // Offset of the index block, where appended blocks start
+  inline size_t index_offset() const { return index_offset_; }
+
+private:
+  bool ReadBlock(const archive::IndexEntry& entry,
+                 std::vector<char>* raw) const;
+  archive::PoseEntry PoseAt(size_t i) const;
+  // First pose entry of key at least key, num_poses if none
+  size_t LowerBoundPose(gtsam::Key key) const;
+
+  std::string filename_;
+  int fd_{-1};
+  char* map_{nullptr};
+  size_t map_size_{0};
+  size_t index_offset_{0};
+  std::vector<archive::IndexEntry> index_;
+  // Position of the scan entries in index_
+  std::unordered_map<gtsam::Key, size_t> scans_;
+  bool b_has_graph_{false};
+  archive::IndexEntry graph_;
+  bool b_has_poses_{false};
+  archive::PosesHeader poses_header_;
+  // Pose entries, cell entries and cell members in the mapping
+  const char* poses_{nullptr};
+  const char* cells_{nullptr};
+  const char* members_{nullptr};
+};
+
+// Append only writer. Scans are written as they are added and the graph on
+// every commit, which also rewrites the index, so an archive can be saved
+// incrementally during a mission and every commit leaves a complete file.
+class PoseGraphArchiveWriter {
+public:
+  PoseGraphArchiveWriter() = default;
+  ~PoseGraphArchiveWriter();
+  PoseGraphArchiveWriter(const PoseGraphArchiveWriter&) = delete;
+  PoseGraphArchiveWriter& operator=(const PoseGraphArchiveWriter&) = delete;
+
+  // Creates filename, or with append continues an existing archive keeping
+  // its scan blocks
+  bool Open(const std::string& filename, bool append = false);
+  void Close();
+  inline bool IsOpen() const { return fd_ >= 0; }
+  inline const std::string& filename() const { return filename_; }
+
+  inline bool HasScan(gtsam::Key key) const {
+    return scan_entries_.find(key) != scan_entries_.end();
+  }
+  // Compresses and appends the scan. Returns false if the key already has a
+  // scan or the write failed
+  bool AppendScan(gtsam::Key key,
+                  const ros::Time& stamp,
+                  const PointCloud& scan,
+                  uint32_t revision = 0);
+  // Appends a newer revision of the scan of key (e.g. after it took over the
+  // scan of a marginalized node), which the next commit indexes instead
+  bool ReplaceScan(gtsam::Key key,
+                   const ros::Time& stamp,
+                   const PointCloud& scan,
+                   uint32_t revision);
+  // Revision of the scan written for key, 0 if never replaced
+  inline uint32_t ScanRevision(gtsam::Key key) const {
+    auto it = scan_revisions_.find(key);
+    return it == scan_revisions_.end() ? 0 : it->second;
+  }
+  // Appends a block as returned by PoseGraphArchiveReader::GetScanBlock
+  bool AppendScanBlock(gtsam::Key key, const char* data, size_t size);
+
+  // Appends the graph and its poses, then the index and trailer. The file is
+  // complete after each commit
+  bool Commit(const pose_graph_msgs::PoseGraph& graph);
+
+private:
+  bool Write(const void* data, size_t size);
+  bool AppendBlock(const archive::BlockHeader& header,
+                   const std::vector<char>& raw,
+                   archive::IndexEntry* entry);
+  // Poses block of the nodes of graph, stored uncompressed
+  bool AppendPoses(const pose_graph_msgs::PoseGraph& graph,
+                   archive::IndexEntry* entry);
+
+  std::string filename_;
+  int fd_{-1};
+  size_t offset_{0};
+  std::vector<archive::IndexEntry> scan_index_;
+  std::unordered_map<gtsam::Key, size_t> scan_entries_;
+  std::unordered_map<gtsam::Key, uint32_t> scan_revisions_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,85 @@
+/*
+PoseGraphDelta.h
+Sequence numbered delta encoding of the incremental pose graph stream
+*/
+
+#ifndef POSE_GRAPH_DELTA_H
+#define POSE_GRAPH_DELTA_H
+
+#include <unordered_map>
+
+#include <pose_graph_msgs/QuantizedPose.h>
+
+#include "lamp_utils/PoseGraph.h"
+
+namespace lamp_utils {
+
+struct DeltaPublicationParams {
+  bool b_enabled{false};
+  // Position quantization step (m)
+  double position_resolution{0.001};
+  // Messages between periodic keyframes, 0 to only send them on request
+  int keyframe_interval{0};
+};
+
+pose_graph_msgs::QuantizedPose QuantizePose(gtsam::Key key,
+                                            const geometry_msgs::Pose& pose,
+                                            double position_resolution);
+geometry_msgs::Pose DequantizePose(const pose_graph_msgs::QuantizedPose& pose,
+                                   double position_resolution);
+
+// Publisher side. Every message carries the nodes and edges added since the
+// last one, plus the quantized poses of already sent nodes whose quantized
+// pose changed. Keyframes carry the whole graph.
+class PoseGraphDeltaEncoder {
+public:
+  inline void SetParams(const DeltaPublicationParams& params) {
+    params_ = params;
+  }
+  inline const DeltaPublicationParams& GetParams() const { return params_; }
+
+  // Next message of the stream, nullptr if there is nothing to send. The
+  // caller clears the incremental messages of the graph once published.
+  pose_graph_msgs::PoseGraph::Ptr Encode(const PoseGraph& graph);
+
+  // The next message will be a keyframe
+  inline void RequestKeyframe() { b_keyframe_requested_ = true; }
+
+private:
+  DeltaPublicationParams params_;
+
+  uint32_t sequence_{0};
+  int messages_since_keyframe_{0};
+  bool b_keyframe_requested_{true};
+
+  // Quantized pose last sent for every node
+  std::unordered_map<gtsam::Key, pose_graph_msgs::QuantizedPose> sent_poses_;
+};
+
+// Receiver side, one per publisher. Checks the sequence and expands the pose
+// updates into full node messages so the stream can be consumed like the
+// plain incremental graph.
+class PoseGraphDeltaDecoder {
+public:
+  enum class Status {
+    ACCEPTED, // decoded holds the message to apply
+    STALE,    // Already applied, drop it
+    GAP       // Messages were lost, drop until the next keyframe
+  };
+
+  // Messages that are not delta encoded are passed through unchanged
+  Status Decode(const GraphMsgPtr& msg, GraphMsgPtr* decoded);
+
+  inline bool IsSynchronized() const { return b_synchronized_; }
+
+private:
+  bool b_synchronized_{false};
+  uint32_t next_sequence_{0};
+
+  // Last node message received for every key, updates only carry the pose
+  std::unordered_map<gtsam::Key, NodeMessage> nodes_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -8,9 +8,11 @@
 #ifndef PREFIX_HANDLING_H
 #define PREFIX_HANDLING_H
 
+#include <cstdint>
 #include <map>
 #include <ros/ros.h>
 #include <string>
+#include <vector>
 
 #include <gtsam/inference/Symbol.h>
 
@@ -23,6 +25,9 @@ namespace lamp_utils {
   // UWB
   const char UWB_PREFIX = 'u';
 
+  // Node prefix of the base station, also listed as a robot
+  const char BASE_PREFIX = 'z';
+
   // Define prefixes for ALL VALID ROBOTS in this file
   const std::map<std::string, char> ROBOT_PREFIXES = {{"husky1", 'a'},
                                                       {"husky2", 'b'},
@@ -56,61 +61,133 @@ namespace lamp_utils {
                                                          {"xmaxx1", 'X'}};
 
   // ---------------------------------------------------------
-  //                    Query functions
+  //                    Prefix classification
   // ---------------------------------------------------------
 
+  // Classes of a prefix character, as bit flags (the base is also a robot)
+  enum PrefixClass : uint8_t {
+    PREFIX_NONE = 0,
+    PREFIX_ROBOT = 1 << 0,
+    PREFIX_ARTIFACT = 1 << 1,
+    PREFIX_UWB = 1 << 2,
+    PREFIX_BASE = 1 << 3
+  };
+
+  // The prefixes of ROBOT_PREFIXES and ARTIFACT_PREFIXES, for the compile
+  // time table (the test checks they stay in sync)
+  constexpr char BUILTIN_ROBOT_PREFIXES[] = "abcdefghijklmxz";
+  constexpr char BUILTIN_ARTIFACT_PREFIXES[] = "ABCDEFGHIJKLMX";
+
+  constexpr bool IsPrefixInList(unsigned char c, const char* list) {
+    return *list != '\0' &&
+        (static_cast<unsigned char>(*list) == c || IsPrefixInList(c, list + 1));
+  }
+
+  constexpr uint8_t ClassifyPrefix(unsigned char c) {
+    return static_cast<uint8_t>(
+        (IsPrefixInList(c, BUILTIN_ROBOT_PREFIXES) ? PREFIX_ROBOT : 0) |
+        (IsPrefixInList(c, BUILTIN_ARTIFACT_PREFIXES) ? PREFIX_ARTIFACT : 0) |
+        (c == static_cast<unsigned char>(UWB_PREFIX) ? PREFIX_UWB : 0) |
+        (c == static_cast<unsigned char>(BASE_PREFIX) ? PREFIX_BASE : 0));
+  }
+
+#define LAMP_PREFIX_CLASSES_4(c)                                   \
+  lamp_utils::ClassifyPrefix(c), lamp_utils::ClassifyPrefix(c + 1), \
+      lamp_utils::ClassifyPrefix(c + 2), lamp_utils::ClassifyPrefix(c + 3)
+#define LAMP_PREFIX_CLASSES_16(c)                                  \
+  LAMP_PREFIX_CLASSES_4(c), LAMP_PREFIX_CLASSES_4(c + 4),           \
+      LAMP_PREFIX_CLASSES_4(c + 8), LAMP_PREFIX_CLASSES_4(c + 12)
+#define LAMP_PREFIX_CLASSES_64(c)                                  \
+  LAMP_PREFIX_CLASSES_16(c), LAMP_PREFIX_CLASSES_16(c + 16),        \
+      LAMP_PREFIX_CLASSES_16(c + 32), LAMP_PREFIX_CLASSES_16(c + 48)
+
+  // Classes of the built in prefixes, by character
+  constexpr uint8_t BUILTIN_PREFIX_CLASSES[256] = {
+      LAMP_PREFIX_CLASSES_64(0),
+      LAMP_PREFIX_CLASSES_64(64),
+      LAMP_PREFIX_CLASSES_64(128),
+      LAMP_PREFIX_CLASSES_64(192)};
+
+  static_assert(BUILTIN_PREFIX_CLASSES['a'] == PREFIX_ROBOT &&
+                    BUILTIN_PREFIX_CLASSES['A'] == PREFIX_ARTIFACT &&
+                    BUILTIN_PREFIX_CLASSES['u'] == PREFIX_UWB &&
+                    BUILTIN_PREFIX_CLASSES['z'] == (PREFIX_ROBOT | PREFIX_BASE),
+                "Prefix classification table");
+
+  // Robots of the process: the built in ones plus those registered at
+  // runtime, e.g. from a parameter. The classes of every prefix sit in a
+  // dense array, so a query is a single load. Robots are registered at
+  // startup, before the queries run on other threads.
+  class RobotRegistry {
+  public:
+    static inline uint8_t Classes(unsigned char c) {
+      return classes_[c];
+    }
+
+    // Adds robot with its node prefix, and artifact_prefix if nonzero.
+    // False if a prefix already belongs to another robot, or to no robot
+    // but is reserved (UWB).
+    static bool Register(const std::string& robot,
+                         unsigned char prefix,
+                         unsigned char artifact_prefix = 0);
+
+    // Registers the robots of a parameter mapping robot names to their node
+    // prefix followed by their artifact prefix (e.g. husky5: "nN"). False
+    // if the parameter is missing or an entry could not be registered.
+    static bool LoadFromParam(const std::string& param);
+
+    // 0 if robot is unknown
+    static unsigned char GetRobotPrefix(const std::string& robot);
+    static unsigned char GetArtifactPrefix(const std::string& robot);
+    // Empty if no robot has the prefix
+    static std::string GetRobotName(unsigned char prefix);
+
+  private:
+    static uint8_t classes_[256];
+  };
+
+  // ---------------------------------------------------------
+  //                    Query functions
+  // ---------------------------------------------------------
 
   // Checks if the character is a robot node prefix;
   inline bool IsRobotPrefix(unsigned char c) {
-    for (auto k : ROBOT_PREFIXES) {  
-      if (k.second == c) {
-        return true;
-      }
-    }
-    return false;
+    return RobotRegistry::Classes(c) & PREFIX_ROBOT;
   }
 
   // Checks if the character is an artifact prefix;
   inline bool IsArtifactPrefix(unsigned char c) {
-    for (auto k : ARTIFACT_PREFIXES) {
-      if (k.second == c) {
-        return true;
-      }
-    }
-    return false;
+    return RobotRegistry::Classes(c) & PREFIX_ARTIFACT;
+  }
+
+  // Checks if the character is the base station prefix;
+  inline bool IsBasePrefix(unsigned char c) {
+    return RobotRegistry::Classes(c) & PREFIX_BASE;
   }
 
   // Checks if the character is an artifact or UWB prefix;
   inline bool IsSpecialSymbol(unsigned char c) {
-    return IsArtifactPrefix(c) || (c == UWB_PREFIX);
+    return RobotRegistry::Classes(c) & (PREFIX_ARTIFACT | PREFIX_UWB);
   }
 
   // Get the prefix for the given robot
-  inline unsigned char GetRobotPrefix(std::string robot) {
-    if (!ROBOT_PREFIXES.count(robot)) {
-      return 0;
-    }
-
-    return ROBOT_PREFIXES.at(robot);
+  inline unsigned char GetRobotPrefix(const std::string& robot) {
+    return RobotRegistry::GetRobotPrefix(robot);
   }
 
   // Get the artifact prefix for the given robot
-  inline unsigned char GetArtifactPrefix(std::string robot) {
-    if (!ARTIFACT_PREFIXES.count(robot)) {
-      return 0;
-    }
-
-    return ARTIFACT_PREFIXES.at(robot);
+  inline unsigned char GetArtifactPrefix(const std::string& robot) {
+    return RobotRegistry::GetArtifactPrefix(robot);
   }
 
   // For a given node namespace (e.g. /husky1/lamp_pgo), returns the parameter
   // namespace that should be used ("base" or "robot")
-  inline std::string GetParamNamespace(std::string ns) {
+  inline std::string GetParamNamespace(const std::string& ns) {
     if (ns.find("base") != std::string::npos) {
       return "base";
     }
 
-    for (auto pair : ROBOT_PREFIXES) {
+    for (const auto& pair : ROBOT_PREFIXES) {
       if (ns.find(pair.first) != std::string::npos) {
         return "robot";
       }
@@ -143,20 +220,24 @@ namespace lamp_utils {
   //                    Get full vectors
   // ---------------------------------------------------------
 
-  // Get all the robot prefixes
+  // Get all the robot prefixes, registered ones included
   inline std::vector<char> GetAllRobotPrefixes() {
     std::vector<char> output;
-    for (auto p : ROBOT_PREFIXES) {
-      output.push_back(p.second);
+    for (int c = 0; c < 256; c++) {
+      if (IsRobotPrefix(c)) {
+        output.push_back(static_cast<char>(c));
+      }
     }
     return output;
   }
 
-  // Get all the artifact prefixes
+  // Get all the artifact prefixes, registered ones included
   inline std::vector<char> GetAllArtifactPrefixes() {
     std::vector<char> output;
-    for (auto p : ARTIFACT_PREFIXES) {
-      output.push_back(p.second);
+    for (int c = 0; c < 256; c++) {
+      if (IsArtifactPrefix(c)) {
+        output.push_back(static_cast<char>(c));
+      }
     }
     return output;
   }
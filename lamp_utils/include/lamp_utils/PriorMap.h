@@ -0,0 +1,69 @@
+/*
+PriorMap.h
+Read only pose graph of a former session, queried by region
+*/
+
+#ifndef PRIOR_MAP_H
+#define PRIOR_MAP_H
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Key.h>
+#include <ros/time.h>
+
+#include "lamp_utils/KeyedSpatialIndex.h"
+#include "lamp_utils/PointCloudTypes.h"
+#include "lamp_utils/PoseGraphArchive.h"
+
+namespace lamp_utils {
+
+// The nodes and keyed scans of a saved archive, for relocalizing against a
+// former session without loading it. Regions are looked up in the poses
+// block of the mapped file and scans are read from it when asked for, so
+// only the pages of the regions visited are brought into memory. Archives
+// saved before the poses block existed have their poses indexed in memory
+// instead. Keys of the former session must not be used by the current one.
+// Reads are thread safe.
+class PriorMap {
+public:
+  PriorMap() = default;
+  PriorMap(const PriorMap&) = delete;
+  PriorMap& operator=(const PriorMap&) = delete;
+
+  bool Open(const std::string& filename);
+  void Close();
+  inline bool IsOpen() const { return archive_.IsOpen(); }
+  inline const std::string& filename() const { return archive_.filename(); }
+
+  // Robot nodes with a scan within radius of position, in key order
+  std::vector<std::pair<gtsam::Key, gtsam::Pose3>>
+  Query(const gtsam::Point3& position, double radius) const;
+
+  bool GetPose(gtsam::Key key,
+               gtsam::Pose3* pose,
+               ros::Time* stamp = nullptr) const;
+  inline bool HasScan(gtsam::Key key) const { return archive_.HasScan(key); }
+  // Read from the file on every call, nullptr if key has no scan
+  inline PointCloud::Ptr ReadScan(gtsam::Key key) const {
+    return archive_.ReadScan(key);
+  }
+  inline size_t NumScans() const { return archive_.NumScans(); }
+
+  // Symbol prefixes of the nodes
+  std::vector<unsigned char> Prefixes() const;
+
+private:
+  PoseGraphArchiveReader archive_;
+
+  // Without a poses block
+  std::unordered_map<gtsam::Key, std::pair<gtsam::Pose3, ros::Time>> poses_;
+  KeyedSpatialIndex positions_{archive::kPoseCellSize};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,62 @@
+/*
+RobotChainIndex.h
+Continuity of the odometry chains of the robot keys of the pose graph
+*/
+
+#ifndef ROBOT_CHAIN_INDEX_H
+#define ROBOT_CHAIN_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <gtsam/inference/Symbol.h>
+
+#include <lamp_utils/PrefixHandling.h>
+
+namespace lamp_utils {
+
+// The keys held of each robot prefix (with a value or marginalized), as one
+// past the highest index held and the ranges missing below it. Odometry keys
+// of a robot are handed out in sequence from 0, so the chains are complete
+// when no range is missing, known without visiting the keys. Adding or
+// removing a key takes time logarithmic in the number of gaps of its chain.
+class RobotChainIndex {
+public:
+  // Ignore keys without a robot prefix. Return true if key was added
+  // (removed).
+  bool Insert(gtsam::Key key);
+  bool Erase(gtsam::Key key);
+  void ErasePrefix(unsigned char prefix);
+  // Keys of prefix are ignored from now on, e.g. of a former session whose
+  // nodes are only held in part. Kept by clear
+  void Exclude(unsigned char prefix);
+  void clear();
+
+  inline bool IsContiguous() const { return num_missing_ == 0; }
+  // Keys missing below the highest key of their chain
+  inline size_t NumMissing() const { return num_missing_; }
+  // Missing keys as ranges [first, last], in key order, at most max_gaps
+  std::vector<std::pair<gtsam::Key, gtsam::Key>>
+  Gaps(size_t max_gaps = std::numeric_limits<size_t>::max()) const;
+
+private:
+  struct Chain {
+    // One past the highest index held
+    uint64_t end{0};
+    // Missing indices [begin, end) by begin, all below end
+    std::map<uint64_t, uint64_t> gaps;
+  };
+
+  std::map<unsigned char, Chain> chains_;
+  std::set<unsigned char> excluded_;
+  size_t num_missing_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
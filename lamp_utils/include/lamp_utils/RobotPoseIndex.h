@@ -0,0 +1,116 @@
+/*
+RobotPoseIndex.h
+Dense poses of the robot keys of the pose graph
+*/
+
+#ifndef ROBOT_POSE_INDEX_H
+#define ROBOT_POSE_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <Eigen/StdVector>
+#include <boost/optional.hpp>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include <lamp_utils/PrefixHandling.h>
+
+namespace lamp_utils {
+
+// Poses of the keys with a robot prefix, mirroring those of the graph values.
+// Odometry keys of a robot are handed out in sequence, so the poses of each
+// prefix are stored densely by symbol index and a lookup is two loads
+// instead of a search of the type-erased gtsam::Values. Keys far past the
+// end of their prefix column are kept in a map, as in KeyedStampStore.
+class RobotPoseIndex {
+public:
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  // Whether the pose of key belongs in the index
+  static inline bool IsIndexed(gtsam::Key key) {
+    return IsRobotPrefix(gtsam::Symbol(key).chr());
+  }
+
+  // Pose of key, nullptr if not stored
+  inline const gtsam::Pose3* Find(gtsam::Key key) const {
+    const gtsam::Symbol symbol(key);
+    if (symbol.chr() < columns_.size()) {
+      const Column& column = columns_[symbol.chr()];
+      if (symbol.index() < column.end && column.b_set[symbol.index()])
+        return &column.poses[symbol.index()];
+    }
+    return FindSparse(key);
+  }
+
+  // Adds the pose of key or replaces it. Ignores keys without a robot
+  // prefix, returns true if key is indexed.
+  bool Assign(gtsam::Key key, const gtsam::Pose3& pose);
+  // Returns true if key was stored
+  bool Erase(gtsam::Key key);
+  void ErasePrefix(unsigned char prefix);
+
+  // Key with the highest index of the prefix, none if it has no pose
+  boost::optional<gtsam::Key> LastKey(unsigned char prefix) const;
+
+  // Calls f(key, pose) for the keys of prefix, the dense ones in index order
+  // then the sparse ones
+  template <typename F>
+  void ForEach(unsigned char prefix, F f) const {
+    if (prefix < columns_.size()) {
+      const Column& c = columns_[prefix];
+      for (size_t i = 0; i < c.end; i++) {
+        if (c.b_set[i])
+          f(gtsam::Key(gtsam::Symbol(prefix, i)), c.poses[i]);
+      }
+    }
+    for (auto it = sparse_.lower_bound(gtsam::Symbol(prefix, 0));
+         it != sparse_.end() && gtsam::Symbol(it->first).chr() == prefix;
+         it++) {
+      f(it->first, it->second);
+    }
+  }
+
+  // Calls f(key, pose) for every stored key, prefix by prefix
+  template <typename F>
+  void ForEach(F f) const {
+    for (size_t prefix = 0; prefix < columns_.size(); prefix++) {
+      ForEach(static_cast<unsigned char>(prefix), f);
+    }
+  }
+
+  // Replaces the index with the robot poses of values
+  void Rebuild(const gtsam::Values& values);
+
+  void clear();
+
+private:
+  // Furthest past the end of a column a key is still stored densely
+  static const size_t kMaxGap = 4096;
+
+  struct Column {
+    std::vector<gtsam::Pose3, Eigen::aligned_allocator<gtsam::Pose3>> poses;
+    std::vector<uint8_t> b_set;
+    // One past the highest stored index
+    size_t end{0};
+  };
+
+  const gtsam::Pose3* FindSparse(gtsam::Key key) const;
+
+  // By prefix, sized on the first insert
+  std::vector<Column> columns_;
+  std::map<gtsam::Key,
+           gtsam::Pose3,
+           std::less<gtsam::Key>,
+           Eigen::aligned_allocator<std::pair<const gtsam::Key, gtsam::Pose3>>>
+      sparse_;
+  size_t size_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ScanCompression.h
+Compact encoding of keyed scans for the radio link
+*/
+
+#ifndef SCAN_COMPRESSION_H
+#define SCAN_COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <pose_graph_msgs/KeyedScan.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+struct ScanCompressionParams {
+  // Quantization steps of the positions (m) and the intensities
+  double position_step{0.01};
+  double intensity_step{1.0};
+  // Octahedral encoded normals, 2 bytes per point
+  bool b_normals{false};
+  // zlib level of the entropy coding
+  int level{1};
+};
+
+// Encoding of a scan:
+//   header | zlib(x planes | y planes | z planes | intensities | normals)
+// Positions are quantized to 16 bits relative to the minimum corner of the
+// scan and delta coded between consecutive points, which are close in
+// lidar order. Every 16 bit stream is split into its low and high byte
+// planes before the entropy coding. Curvature is not kept.
+// Returns false, leaving out empty, if the scan extent does not fit 16 bits
+// at the position step. Points with non finite positions are dropped.
+bool EncodeScan(const PointCloud& scan,
+                const ScanCompressionParams& params,
+                std::vector<uint8_t>* out);
+
+// Returns false if the data is not a valid encoding
+bool DecodeScan(const uint8_t* data, size_t size, PointCloud* scan);
+
+// Saves the scan compressed into msg, or uncompressed if it cannot be
+// encoded. With params nullptr the scan is always stored uncompressed
+// (without normals, as the robots publish their scans).
+void ScanToKeyedScanMsg(const PointCloud& scan,
+                        const ScanCompressionParams* params,
+                        pose_graph_msgs::KeyedScan* msg);
+
+// Reads the scan of a keyed scan message, compressed or not
+bool KeyedScanMsgToScan(const pose_graph_msgs::KeyedScan& msg,
+                        PointCloud* scan);
+
+} // namespace lamp_utils
+
+#endif
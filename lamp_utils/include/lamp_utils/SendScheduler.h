@@ -0,0 +1,76 @@
+/*
+SendScheduler.h
+Priority queues with a byte budget for the robot to base traffic
+*/
+
+#ifndef SEND_SCHEDULER_H
+#define SEND_SCHEDULER_H
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+
+namespace lamp_utils {
+
+// Token bucket in front of the radio. The budget fills at the link rate up
+// to a burst size, queued messages are sent highest priority first and in
+// order within a priority, as long as the budget covers them. A message that
+// does not fit holds back everything of lower priority, so scans never delay
+// graph traffic. Graph messages are always sent and only drain the budget.
+// Not thread safe.
+class SendScheduler {
+public:
+  enum Priority { GRAPH = 0, SCAN_COARSE = 1, SCAN_FULL = 2, NUM_PRIORITIES };
+
+  struct Message {
+    gtsam::Key key{0};
+    size_t bytes{0};
+    double stamp{0.0}; // Time queued
+    // Messages that expire can be taken back with TakeExpired
+    bool b_expires{false};
+    std::function<void()> send;
+  };
+
+  SendScheduler() = default;
+  SendScheduler(double rate, double burst);
+
+  // Budget rate in bytes per second and the most it can hold
+  void SetRate(double rate);
+  void SetBurst(double burst);
+  inline double rate() const { return rate_; }
+  inline double budget() const { return budget_; }
+
+  // Adds the budget gained since the last refill, the first call only sets
+  // the time
+  void Refill(double now);
+  // Accounts for bytes sent outside of the scheduler
+  void Charge(size_t bytes);
+
+  void Push(Priority priority, const Message& message);
+
+  // Sends what the budget allows. Returns the bytes sent
+  size_t Dispatch();
+
+  // Removes and returns the expiring messages of priority queued before t
+  std::vector<Message> TakeExpired(Priority priority, double t);
+
+  inline size_t Queued(Priority priority) const {
+    return queues_[priority].size();
+  }
+  size_t QueuedBytes() const;
+  void Clear();
+
+private:
+  double rate_{0.0};
+  double burst_{0.0};
+  double budget_{0.0};
+  double last_refill_{-1.0};
+  std::deque<Message> queues_[NUM_PRIORITIES];
+};
+
+} // namespace lamp_utils
+
+#endif
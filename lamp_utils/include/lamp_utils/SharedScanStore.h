@@ -0,0 +1,73 @@
+/*
+SharedScanStore.h
+Process-wide store of deserialized keyed scans
+*/
+
+#ifndef SHARED_SCAN_STORE_H
+#define SHARED_SCAN_STORE_H
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/KeyedScan.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+// Every module that listens to keyed scans used to run its own pcl::fromROSMsg
+// and keep a private copy of the cloud. The store converts each KeyedScan once
+// per process and hands out the same immutable cloud to every consumer. When
+// the consumers run as nodelets in one manager, roscpp also shares the
+// deserialized KeyedScan message between them, so a scan crosses the wire and
+// is converted exactly once.
+// Sharing is off by default: standalone nodes only convert, since there is
+// nobody to share with and a reset node must not see scans it dropped.
+class SharedScanStore {
+public:
+  static SharedScanStore& Instance();
+
+  inline void SetEnabled(bool enabled) {
+    b_enabled_ = enabled;
+  }
+  inline bool IsEnabled() const {
+    return b_enabled_;
+  }
+
+  // Return the cloud for the message key, converting the message if the key
+  // has not been seen by this process yet (always converts when disabled)
+  PointCloudConstPtr GetOrConvert(const pose_graph_msgs::KeyedScan& msg);
+
+  // Register an already converted cloud (no-op if the key exists)
+  // Returns the cloud that ends up stored for the key
+  PointCloudConstPtr Insert(const gtsam::Key& key,
+                            const PointCloudConstPtr& scan);
+
+  // Returns nullptr if the key is not stored
+  PointCloudConstPtr Get(const gtsam::Key& key) const;
+
+  bool Has(const gtsam::Key& key) const;
+  void Erase(const gtsam::Key& key);
+  void Clear();
+  size_t Size() const;
+
+  // Number of conversions avoided by sharing
+  size_t GetNumShared() const;
+
+private:
+  SharedScanStore() = default;
+  SharedScanStore(const SharedScanStore&) = delete;
+  SharedScanStore& operator=(const SharedScanStore&) = delete;
+
+  std::atomic<bool> b_enabled_{false};
+
+  mutable std::mutex mutex_;
+  std::unordered_map<gtsam::Key, PointCloudConstPtr> scans_;
+  size_t num_shared_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,115 @@
+/*
+SpscRing.h
+Ring buffer handing values from one producer thread to one consumer thread
+*/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace lamp_utils {
+
+// Single producer, single consumer queue over preallocated slots. Push and
+// Pop only touch the two indices, so in the steady state neither side locks
+// or allocates. Values are moved out of their slot on Pop, a slot does not
+// hold on to memory (e.g. a shared point cloud) after it was consumed.
+// Push never fails and never blocks the producer, e.g. a subscriber callback
+// on the thread that also drains the ring: when the ring is full the values
+// spill into a locked overflow queue, drained after the ring so the order is
+// kept, until the consumer catches up.
+template <typename T>
+class SpscRing {
+public:
+  // Capacity is rounded up to a power of two
+  explicit SpscRing(size_t capacity = 1024) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  // Producer side
+  void Push(T value) {
+    if (b_spilled_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(overflow_mutex_);
+      // The consumer may have emptied the overflow in the meantime
+      if (b_spilled_.load(std::memory_order_relaxed)) {
+        overflow_.push_back(std::move(value));
+        return;
+      }
+    }
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      std::lock_guard<std::mutex> lock(overflow_mutex_);
+      overflow_.push_back(std::move(value));
+      b_spilled_.store(true, std::memory_order_release);
+      return;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Consumer side, false when there is nothing to take
+  bool Pop(T& value) {
+    // Read before the ring, the values pushed ahead of a spill are visible
+    const bool b_spilled = b_spilled_.load(std::memory_order_acquire);
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head != tail_.load(std::memory_order_acquire)) {
+      value = std::move(slots_[head & mask_]);
+      slots_[head & mask_] = T();
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+    // Spilled values are newer than anything left in the ring
+    if (!b_spilled) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    if (overflow_.empty()) {
+      return false;
+    }
+    value = std::move(overflow_.front());
+    overflow_.pop_front();
+    if (overflow_.empty()) {
+      b_spilled_.store(false, std::memory_order_release);
+    }
+    return true;
+  }
+
+  // Consumer side
+  bool Empty() const {
+    return head_.load(std::memory_order_relaxed) ==
+        tail_.load(std::memory_order_acquire) &&
+        !b_spilled_.load(std::memory_order_acquire);
+  }
+
+  inline size_t capacity() const {
+    return mask_ + 1;
+  }
+
+private:
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  std::vector<T> slots_;
+  size_t mask_;
+  // Next slot to pop and to push, only ever increasing
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+
+  std::atomic<bool> b_spilled_{false};
+  std::mutex overflow_mutex_;
+  std::deque<T> overflow_;
+};
+
+} // namespace lamp_utils
+
+#endif
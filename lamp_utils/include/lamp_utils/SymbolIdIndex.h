@@ -0,0 +1,71 @@
+/*
+SymbolIdIndex.h
+Bidirectional index between graph keys and the IDs of artifacts
+*/
+
+#ifndef SYMBOL_ID_INDEX_H
+#define SYMBOL_ID_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+
+#include "lamp_utils/GraphStore.h"
+
+namespace lamp_utils {
+
+// Links the keys of artifact nodes with their ID strings (UUIDs) both ways.
+// IDs are interned once and handed out as integer handles, so the artifact
+// bookkeeping compares and indexes integers instead of hashing strings.
+// Handles live as long as the index, clear() only drops the links. Handle 0
+// (kNoId) is the empty ID.
+class SymbolIdIndex {
+public:
+  typedef uint32_t Handle;
+  typedef std::unordered_map<gtsam::Key, Handle>::const_iterator
+      const_iterator;
+
+  static constexpr Handle kNoId = 0;
+
+  // Handle of id, interned if new
+  inline Handle Intern(const std::string& id) { return ids_.Intern(id); }
+  // Handle of id, kNoId if it was never interned
+  inline Handle Find(const std::string& id) const { return ids_.Find(id); }
+  inline const std::string& Id(Handle id) const { return ids_.Get(id); }
+
+  // Links key and id, replacing the earlier links of either. Linking kNoId
+  // erases the link of key.
+  void Link(gtsam::Key key, Handle id);
+  inline void Link(gtsam::Key key, const std::string& id) {
+    Link(key, Intern(id));
+  }
+  bool Erase(gtsam::Key key);
+  void ErasePrefix(unsigned char prefix);
+
+  // ID linked with key, kNoId if none
+  Handle IdOf(gtsam::Key key) const;
+  // Key linked with id, false if none
+  bool KeyOf(Handle id, gtsam::Key* key) const;
+
+  // Links, by key
+  inline const_iterator begin() const { return key_ids_.begin(); }
+  inline const_iterator end() const { return key_ids_.end(); }
+  inline size_t size() const { return key_ids_.size(); }
+  inline bool empty() const { return key_ids_.empty(); }
+  void clear();
+
+private:
+  StringTable ids_;
+  std::unordered_map<gtsam::Key, Handle> key_ids_;
+  // Key of each handle, flat since handles are dense
+  std::vector<gtsam::Key> id_keys_;
+  std::vector<bool> b_linked_;
+};
+
+} // namespace lamp_utils
+
+#endif
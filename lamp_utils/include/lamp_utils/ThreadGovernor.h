@@ -0,0 +1,105 @@
+/*
+ThreadGovernor.h
+Named thread groups of a process with their cores, priority and budget
+*/
+
+#ifndef THREAD_GOVERNOR_H
+#define THREAD_GOVERNOR_H
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "lamp_utils/Metrics.h"
+
+namespace lamp_utils {
+
+struct ThreadGroupConfig {
+  // Cores the threads of the group run on, any core if empty
+  std::vector<int> cpus;
+  // Nice value of the threads, 0 leaves them as created. Negative values
+  // need CAP_SYS_NICE
+  int nice{0};
+  // Most threads the group starts, 0 for no limit of its own
+  int max_threads{0};
+};
+
+// The thread groups of the process by name: the loop closure pool, the GICP
+// OpenMP threads of an alignment, the observability workers, the ROS
+// spinners, each pipeline stage... A thread joins a group from inside
+// (RegisterThread), which pins it to the cores of the group, sets its nice
+// value and accounts its CPU time to the group until it exits. Threads it
+// starts afterwards inherit the cores and nice value, which is how the
+// OpenMP threads of GICP follow the pool worker that first runs them.
+// Owners size their groups with Threads, capped by the limit of the group
+// and by the core budget shared by all groups of the process.
+// UpdateUsage, called by the MetricsPublisher, sets per group
+// threads.<group>.cpu (cores used since the last update), .count and
+// .granted, and threads.process.cpu for the whole process. Thread safe.
+class ThreadGovernor {
+public:
+  static ThreadGovernor& Instance();
+
+  ThreadGovernor();
+  ~ThreadGovernor();
+
+  // Reads thread_governor/core_budget and the groups of
+  // thread_governor/groups (<name>: {cpus, nice, max_threads}) relative to
+  // n. Only the first call of the process applies them, later ones (other
+  // nodelets) return true without reading.
+  bool LoadParameters(const ros::NodeHandle& n);
+
+  // Applies to threads registered after the call
+  void Configure(const std::string& group, const ThreadGroupConfig& config);
+  ThreadGroupConfig Config(const std::string& group) const;
+  // Threads granted to all groups together, 0 for the core count
+  void SetCoreBudget(size_t cores);
+  size_t CoreBudget() const;
+
+  // Threads the group may run of the requested ones, at least one. The
+  // grant replaces the previous one of the group in the budget.
+  size_t Threads(const std::string& group, size_t requested);
+
+  // The calling thread joins the group, once per thread, a thread already
+  // in another group moves
+  void RegisterThread(const std::string& group);
+
+  void UpdateUsage();
+  // CPU seconds of the threads of the group, alive or exited
+  double CpuTime(const std::string& group) const;
+  size_t NumThreads(const std::string& group) const;
+
+private:
+  ThreadGovernor(const ThreadGovernor&) = delete;
+  ThreadGovernor& operator=(const ThreadGovernor&) = delete;
+
+  struct Group {
+    ThreadGroupConfig config;
+    size_t granted{0};
+    // CPU clocks of the live threads by thread id, with their CPU time when
+    // they joined
+    std::map<long, std::pair<clockid_t, double>> threads;
+    double exited_cpu{0};
+    double reported_cpu{0};
+  };
+  friend struct ThreadRegistration;
+
+  void UnregisterThread(const std::string& group, long tid, clockid_t clock);
+  double CpuTimeLocked(const Group& group) const;
+
+  mutable std::mutex mutex_;
+  bool b_loaded_{false};
+  size_t core_budget_{0};
+  std::map<std::string, Group> groups_;
+  double last_update_{0};
+  double last_process_cpu_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,185 @@
+/*
+TimeIndexedBuffer.h
+Time sorted ring buffer for high rate sensor streams
+*/
+
+#ifndef TIME_INDEXED_BUFFER_H
+#define TIME_INDEXED_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace lamp_utils {
+
+// Entries sorted by time stamp (seconds) in contiguous ring storage. With a
+// capacity the oldest entry is overwritten once full, so the slots and any
+// memory owned by the stored values (e.g. point cloud points) are reused
+// instead of reallocated. Without a capacity the storage grows as needed.
+// Entries are addressed by their position in time order, 0 being the oldest.
+template <typename T>
+class TimeIndexedBuffer {
+public:
+  explicit TimeIndexedBuffer(size_t capacity = 0) {
+    SetCapacity(capacity);
+  }
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline size_t capacity() const { return capacity_; }
+  // Bytes of the slots, not counting memory owned by the values
+  inline size_t StorageBytes() const {
+    return slots_.capacity() * sizeof(T) + times_.capacity() * sizeof(double);
+  }
+
+  // Bounds the buffer to capacity entries (0 for unbounded), keeping the
+  // newest ones.
+  void SetCapacity(size_t capacity) {
+    if (capacity > 0 && size_ > capacity) {
+      EraseBefore(size_ - capacity);
+    }
+    Linearize(std::max(capacity, size_));
+    capacity_ = capacity;
+  }
+
+  // Adds value at time t. Returns false, leaving the buffer unchanged, if an
+  // entry already has the same time stamp.
+  bool Insert(double t, const T& value) {
+    const size_t pos = LowerBound(t);
+    if (pos < size_ && TimeAt(pos) == t) {
+      return false;
+    }
+    if (size_ == slots_.size()) {
+      if (capacity_ > 0 && size_ == capacity_) {
+        // Older than everything kept, would be evicted immediately
+        if (pos == 0) {
+          return false;
+        }
+        PopFront();
+        return InsertAt(pos - 1, t, value);
+      }
+      Linearize(std::max<size_t>(8, 2 * slots_.size()));
+    }
+    return InsertAt(pos, t, value);
+  }
+
+  // Position of the first entry not older than t (size() if none)
+  size_t LowerBound(double t) const {
+    if (size_ == 0 || t <= TimeAt(0)) {
+      return 0;
+    }
+    if (t > TimeAt(size_ - 1)) {
+      return size_;
+    }
+    // Streams are close to uniformly sampled, start the binary search from
+    // an interpolated guess and its neighbourhood
+    size_t lo = 0, hi = size_ - 1;
+    const double span = TimeAt(hi) - TimeAt(lo);
+    if (span > 0) {
+      const size_t guess = std::min(
+          hi, static_cast<size_t>((t - TimeAt(0)) / span * (size_ - 1)));
+      const size_t window = 2;
+      const size_t g_lo = guess > window ? guess - window : 0;
+      const size_t g_hi = std::min(hi, guess + window);
+      if (TimeAt(g_lo) < t && t <= TimeAt(g_hi)) {
+        lo = g_lo;
+        hi = g_hi;
+      }
+    }
+    // Invariant: TimeAt(lo) < t <= TimeAt(hi)
+    while (hi - lo > 1) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (TimeAt(mid) < t) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    return hi;
+  }
+
+  // Position of the entry closest in time to t, ties go to the older entry.
+  // The buffer must not be empty.
+  size_t Closest(double t) const {
+    const size_t pos = LowerBound(t);
+    if (pos == 0) {
+      return 0;
+    }
+    if (pos == size_) {
+      return size_ - 1;
+    }
+    return (TimeAt(pos) - t < t - TimeAt(pos - 1)) ? pos : pos - 1;
+  }
+
+  inline double TimeAt(size_t i) const { return times_[Slot(i)]; }
+  inline const T& At(size_t i) const { return slots_[Slot(i)]; }
+  inline T& At(size_t i) { return slots_[Slot(i)]; }
+
+  inline double FrontTime() const { return TimeAt(0); }
+  inline double BackTime() const { return TimeAt(size_ - 1); }
+  inline const T& Front() const { return At(0); }
+  inline const T& Back() const { return At(size_ - 1); }
+
+  inline void PopFront() { EraseBefore(1); }
+  // Drops the entries older than position i. The slots are kept for reuse.
+  void EraseBefore(size_t i) {
+    i = std::min(i, size_);
+    if (i == 0) {
+      return;
+    }
+    head_ = (head_ + i) % slots_.size();
+    size_ -= i;
+  }
+
+  void clear() {
+    head_ = 0;
+    size_ = 0;
+  }
+
+private:
+  inline size_t Slot(size_t i) const { return (head_ + i) % slots_.size(); }
+
+  // Writes into the free slot after the newest entry and moves it back to
+  // position pos. Out of order entries are rare, moving by swaps keeps the
+  // memory owned by the slots in the ring.
+  bool InsertAt(size_t pos, double t, const T& value) {
+    size_t i = size_++;
+    times_[Slot(i)] = t;
+    slots_[Slot(i)] = value;
+    for (; i > pos; i--) {
+      std::swap(times_[Slot(i)], times_[Slot(i - 1)]);
+      std::swap(slots_[Slot(i)], slots_[Slot(i - 1)]);
+    }
+    return true;
+  }
+
+  // Moves the entries to the start of storage with room for n slots
+  void Linearize(size_t n) {
+    if (n == 0) {
+      n = 1;
+    }
+    if (n == slots_.size() && head_ == 0) {
+      return;
+    }
+    std::vector<double> times(n);
+    std::vector<T> slots(n);
+    for (size_t i = 0; i < size_; i++) {
+      times[i] = TimeAt(i);
+      std::swap(slots[i], slots_[Slot(i)]);
+    }
+    times_.swap(times);
+    slots_.swap(slots);
+    head_ = 0;
+  }
+
+  std::vector<double> times_;
+  std::vector<T> slots_;
+  size_t head_{0};
+  size_t size_{0};
+  size_t capacity_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
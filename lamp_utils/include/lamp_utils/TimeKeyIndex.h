@@ -0,0 +1,105 @@
+/*
+TimeKeyIndex.h
+Flat time stamp indices of the pose graph keys
+*/
+
+#ifndef TIME_KEY_INDEX_H
+#define TIME_KEY_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <gtsam/inference/Key.h>
+#include <ros/time.h>
+
+namespace lamp_utils {
+
+// Keys sorted by time stamp (seconds), in two contiguous columns. Keys are
+// stamped in time order as the graph grows, so inserts append; an older
+// stamp is inserted in place.
+class StampKeyIndex {
+public:
+  inline size_t size() const { return stamps_.size(); }
+  inline bool empty() const { return stamps_.empty(); }
+
+  // Adds key at time t unless a key has exactly that stamp. Returns true if
+  // added.
+  bool Insert(double t, gtsam::Key key);
+  // Adds key at time t or replaces the key with exactly that stamp
+  void Assign(double t, gtsam::Key key);
+  // Key with exactly the stamp t
+  boost::optional<gtsam::Key> Find(double t) const;
+  // Removes the entry of key at exactly the stamp t. Returns true if removed
+  bool Erase(double t, gtsam::Key key);
+
+  // Position of the first entry not older than t (size() if none)
+  size_t LowerBound(double t) const;
+  inline double StampAt(size_t i) const { return stamps_[i]; }
+  inline gtsam::Key KeyAt(size_t i) const { return keys_[i]; }
+
+  void clear();
+
+private:
+  std::vector<double> stamps_;
+  std::vector<gtsam::Key> keys_;
+};
+
+// Time stamp of every key. The keys of each prefix are stored densely by
+// symbol index, which the graph hands out in sequence, so a stamp costs its
+// eight bytes instead of a map node. Keys far past the end of their prefix
+// column (e.g. a sparse numbering) are kept in a map. Iteration order is
+// unspecified.
+class KeyedStampStore {
+public:
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  inline bool Contains(gtsam::Key key) const {
+    return Find(key).is_initialized();
+  }
+  boost::optional<ros::Time> Find(gtsam::Key key) const;
+  // Stamp of a stored key, throws std::out_of_range otherwise
+  ros::Time At(gtsam::Key key) const;
+  // Adds the stamp of key or replaces it
+  void Assign(gtsam::Key key, const ros::Time& stamp);
+  bool Erase(gtsam::Key key);
+
+  // Calls f(key, stamp) for every stored key
+  template <typename F>
+  void ForEach(F f) const {
+    for (const auto& column : columns_) {
+      const Column& c = column.second;
+      for (size_t i = 0; i < c.stamps.size(); i++) {
+        if (c.b_set[i])
+          f(ColumnKey(column.first, i), c.stamps[i]);
+      }
+    }
+    for (const auto& kv : sparse_) {
+      f(kv.first, kv.second);
+    }
+  }
+
+  void clear();
+
+private:
+  // Furthest past the end of a column a key is still stored densely
+  static const size_t kMaxGap = 4096;
+
+  struct Column {
+    std::vector<ros::Time> stamps;
+    std::vector<bool> b_set;
+  };
+
+  static gtsam::Key ColumnKey(unsigned char chr, size_t index);
+
+  std::map<unsigned char, Column> columns_;
+  std::map<gtsam::Key, ros::Time> sparse_;
+  size_t size_{0};
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,106 @@
+/*
+Tracing.h
+Scoped timing spans per key, exported as a Chrome trace
+*/
+
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+
+namespace lamp_utils {
+
+struct TraceEvent {
+  const char* name{nullptr}; // Must outlive the tracer, use literals
+  gtsam::Key key{0};         // Correlation id, 0 if the span has no key
+  int64_t start_us{0};       // Wall clock, so traces of nodes can be merged
+  int64_t duration_us{0};
+  uint32_t thread_id{0};
+};
+
+// Process-wide ring of the latest spans. Recording is lock free: a writer
+// claims a slot with one fetch_add and publishes it with a sequence number,
+// so the oldest spans are overwritten and never block the pipeline. Spans
+// carry the pose graph key they work on, which every keyed message already
+// holds, so the same key can be followed from robot to map across the
+// traces of all nodes.
+// Disabled unless LAMP_TRACE_FILE is set (the trace is then written there
+// when the process exits) or Enable is called. A disabled span costs one
+// relaxed atomic load.
+class Tracer {
+public:
+  static Tracer& Instance();
+
+  inline bool IsEnabled() const {
+    return b_enabled_.load(std::memory_order_relaxed);
+  }
+  void Enable(bool b_enable);
+
+  // Spans kept, rounded up to a power of two. Drops the recorded spans
+  void SetCapacity(size_t capacity);
+
+  void Record(const TraceEvent& event);
+
+  // Recorded spans, oldest first. Slots being written are skipped
+  std::vector<TraceEvent> Snapshot() const;
+  void Clear();
+
+  // Chrome trace event format, readable by chrome://tracing and Perfetto
+  std::string ToChromeTrace() const;
+  bool WriteChromeTrace(const std::string& filename) const;
+
+  static int64_t NowMicroseconds();
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> sequence{0}; // 0 while empty or being written
+    TraceEvent event;
+  };
+
+  Tracer();
+  ~Tracer();
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  std::atomic<bool> b_enabled_{false};
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_{0};
+  std::atomic<uint64_t> next_{0};
+  std::string output_file_;
+};
+
+// Records the time from construction to destruction as one span
+class TraceSpan {
+public:
+  explicit TraceSpan(const char* name, gtsam::Key key = 0) {
+    if (Tracer::Instance().IsEnabled()) {
+      event_.name = name;
+      event_.key = key;
+      event_.start_us = Tracer::NowMicroseconds();
+    }
+  }
+  ~TraceSpan() {
+    if (event_.name) {
+      event_.duration_us = Tracer::NowMicroseconds() - event_.start_us;
+      Tracer::Instance().Record(event_);
+    }
+  }
+  // For spans whose key is only known once the work started
+  inline void SetKey(gtsam::Key key) { event_.key = key; }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  TraceEvent event_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,54 @@
+/*
+VoxelMap.h
+Voxel downsampled copy of a map kept up to date as points are inserted
+*/
+
+#ifndef VOXEL_MAP_H
+#define VOXEL_MAP_H
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_utils {
+
+// Running sum of the points of every occupied voxel, so inserting a scan only
+// touches the voxels of its points. GetCloud gives what VoxelDownsample gives
+// on every point inserted since the last clear, without keeping the points.
+// Not thread safe.
+class VoxelMap {
+public:
+  explicit VoxelMap(double leaf_size = 0.4);
+
+  // Points with non finite positions are dropped
+  void Insert(const PointCloud& points);
+
+  // Average of the points of every occupied voxel, in the order the voxels
+  // were first seen
+  void GetCloud(PointCloud* out) const;
+
+  inline double leaf_size() const { return leaf_size_; }
+  inline size_t size() const { return counts_.size(); }
+  inline bool empty() const { return counts_.empty(); }
+  void clear();
+
+private:
+  static const int kStride = sizeof(Point) / sizeof(float);
+  typedef Eigen::Matrix<double, kStride, 1> PointSum;
+
+  double leaf_size_;
+  double inverse_leaf_;
+  std::unordered_map<VoxelIndex, size_t, VoxelIndexHash> voxels_;
+  std::vector<PointSum, Eigen::aligned_allocator<PointSum>> sums_;
+  std::vector<int> counts_;
+};
+
+} // namespace lamp_utils
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ZipScanReader.h
+Reads the entries of a pose graph zip of the former format on demand
+*/
+
+#ifndef ZIP_SCAN_READER_H
+#define ZIP_SCAN_READER_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <minizip/unzip.h>
+
+#include "lamp_utils/PointCloudTypes.h"
+
+namespace lamp_utils {
+
+// Entries are decompressed when asked for, each into memory or a file of a
+// temporary directory removed with the reader. A minizip handle is not
+// thread safe, so every concurrent read takes a handle of its own, opened
+// as needed and kept for the next reads. Reads are thread safe.
+class ZipScanReader {
+public:
+  ZipScanReader() = default;
+  ~ZipScanReader();
+  ZipScanReader(const ZipScanReader&) = delete;
+  ZipScanReader& operator=(const ZipScanReader&) = delete;
+
+  // Lists the entries and creates the temporary directory
+  bool Open(const std::string& filename);
+  inline const std::string& filename() const { return filename_; }
+  inline const std::vector<std::string>& entries() const { return entries_; }
+
+  bool ReadEntry(const std::string& entry, std::vector<char>* data);
+  // Writes the entry to a new file of the temporary directory, the caller
+  // may remove it when done
+  bool ExtractEntry(const std::string& entry, std::string* path);
+  // Point cloud of a PCD entry, nullptr if it cannot be read
+  PointCloud::Ptr ReadPointCloud(const std::string& entry);
+
+private:
+  unzFile AcquireHandle();
+  void ReleaseHandle(unzFile handle);
+
+  std::string filename_;
+  std::string directory_;
+  std::vector<std::string> entries_;
+  std::atomic<size_t> num_extracted_{0};
+
+  std::mutex handles_mutex_;
+  std::vector<unzFile> handles_;
+};
+
+} // namespace lamp_utils
+
+#endif
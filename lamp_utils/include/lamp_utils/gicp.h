@@ -43,6 +43,7 @@
 
 #include <omp.h>
 
+#include <lamp_utils/PointCloudTypes.h>
 #include <lamp_utils/gicp_utils.h>
 #include <pcl/registration/bfgs.h>
 #include <pcl/registration/gicp.h>
@@ -50,6 +51,26 @@
 #include <ros/ros.h>
 
 namespace pcl {
+/** \brief State of a registration after one of its outer iterations, handed
+ * to the iteration callback
+ */
+struct GicpIterationState {
+  /** \brief Outer iterations done */
+  int iteration{0};
+  /** \brief Source points, and those with a correspondence closer than the
+   * maximum correspondence distance */
+  size_t num_points{0};
+  size_t num_correspondences{0};
+  /** \brief Mean squared distance of the correspondences */
+  double mean_sq_distance{0};
+  /** \brief Largest transformation change over its epsilon, converged below 1
+   */
+  double delta{0};
+};
+
+/** \brief Called after every outer iteration, returns false to abort */
+typedef boost::function<bool(const GicpIterationState&)> GicpIterationCallback;
+
 /** \brief GeneralizedIterativeClosestPoint is an ICP variant that implements
  * the generalized iterative closest point algorithm as described by Alex Segal
  * et al. in
@@ -58,8 +79,18 @@ namespace pcl {
  * alignment after closest point assignments have been made. The original code
  * uses GSL and ANN while in ours we use an eigen mapped BFGS and FLANN. \author
  * Nizar Sallem \ingroup registration
+ *
+ * Scalar is the precision of the per correspondence Mahalanobis matrices and
+ * residuals, Covariance the stored per point covariance: a full
+ * Eigen::Matrix<Scalar, 3, 3> or a PlaneCovariance<Scalar> keeping only the
+ * normal and its eigenvalue (every covariance built here has that form). The
+ * BFGS state and the cost sums stay in double. Explicitly instantiated in
+ * gicp.cc for Point with both scalars and both covariances.
  */
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar = double,
+          typename Covariance = Eigen::Matrix<Scalar, 3, 3>>
 class MultithreadedGeneralizedIterativeClosestPoint
   : public GeneralizedIterativeClosestPoint<PointSource, PointTarget> {
 public:
@@ -96,8 +127,11 @@ public:
   typedef PointIndices::Ptr PointIndicesPtr;
   typedef PointIndices::ConstPtr PointIndicesConstPtr;
 
-  typedef std::vector<Eigen::Matrix3d,
-                      Eigen::aligned_allocator<Eigen::Matrix3d>>
+  typedef Eigen::Matrix<Scalar, 3, 3> Matrix3;
+  typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+
+  typedef Covariance CovarianceType;
+  typedef std::vector<Covariance, Eigen::aligned_allocator<Covariance>>
       MatricesVector;
   typedef boost::shared_ptr<MatricesVector> MatricesVectorPtr;
   typedef boost::shared_ptr<const MatricesVector> MatricesVectorConstPtr;
@@ -106,12 +140,17 @@ public:
   typedef
       typename Registration<PointSource, PointTarget>::KdTreePtr InputKdTreePtr;
 
-  typedef boost::shared_ptr<
-      MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>>
+  typedef boost::shared_ptr<MultithreadedGeneralizedIterativeClosestPoint<
+      PointSource,
+      PointTarget,
+      Scalar,
+      Covariance>>
       Ptr;
   typedef boost::shared_ptr<
       const MultithreadedGeneralizedIterativeClosestPoint<PointSource,
-                                                          PointTarget>>
+                                                          PointTarget,
+                                                          Scalar,
+                                                          Covariance>>
       ConstPtr;
 
   typedef Eigen::Matrix<double, 6, 1> Vector6d;
@@ -127,7 +166,8 @@ public:
       gicp_epsilon_(0.001),
       rotation_epsilon_(2e-3),
       mahalanobis_(0),
-      max_inner_iterations_(20) {
+      max_inner_iterations_(20),
+      b_aborted_(false) {
     min_number_correspondences_ = 4;
     reg_name_ = "MultithreadedGeneralizedIterativeClosestPoint";
     max_iterations_ = 200;
@@ -136,7 +176,9 @@ public:
     rigid_transformation_estimation_ =
         boost::bind(&MultithreadedGeneralizedIterativeClosestPoint<
                         PointSource,
-                        PointTarget>::estimateRigidTransformationBFGS,
+                        PointTarget,
+                        Scalar,
+                        Covariance>::estimateRigidTransformationBFGS,
                     this,
                     _1,
                     _2,
@@ -146,10 +188,13 @@ public:
     setNumThreads(k_num_threads_);
   }
 
+  /** \brief OpenMP threads of the parallel loops, given to each of them
+   * explicitly rather than through the calling thread's default, so a GICP
+   * set up on one thread runs with the same team size on any other
+   */
   void setNumThreads(int num_threads) {
     assert(num_threads > 0);
     k_num_threads_ = num_threads;
-    omp_set_num_threads(k_num_threads_);
   }
 
   void enableTimingOutput(bool enable) {
@@ -234,7 +279,7 @@ public:
                                        Eigen::Matrix4f& transformation_matrix);
 
   /** \brief \return Mahalanobis distance matrix for the given point index */
-  inline const Eigen::Matrix3d& mahalanobis(size_t index) const {
+  inline const Matrix3& mahalanobis(size_t index) const {
     assert(index < mahalanobis_.size());
     return mahalanobis_[index];
   }
@@ -293,6 +338,19 @@ public:
     return (max_inner_iterations_);
   }
 
+  /** \brief Build the search tree and covariances of a cloud once, so they
+   * can be reused over many alignments through setSourceCovariances /
+   * setTargetCovariances and setSearchMethodSource / setSearchMethodTarget
+   * with force_no_recompute. Uses the current correspondence randomness.
+   * \param[in] cloud the cloud to prepare
+   * \param[out] tree search tree over the cloud
+   * \param[out] covariances per point covariances
+   */
+  void prepareCloud(const PointCloudTargetConstPtr& cloud,
+                    InputKdTreePtr& tree,
+                    MatricesVectorPtr& covariances,
+                    bool recompute = false);
+
   void RecomputeTargetCovariance(bool recalculate) {
     recompute_target_cov_ = recalculate;
   }
@@ -300,6 +358,35 @@ public:
     recompute_source_cov = recalculate;
   }
 
+  /** \brief Callback deciding after every outer iteration whether to go on,
+   * e.g. to give up early on a bad match. Kept over alignments, an empty
+   * function removes it.
+   */
+  void setIterationCallback(const GicpIterationCallback& callback) {
+    iteration_callback_ = callback;
+  }
+
+  /** \brief The last alignment was stopped by the iteration callback */
+  bool wasAborted() const {
+    return b_aborted_;
+  }
+
+  /** \brief Outer iterations of the last alignment */
+  int getNumIterations() const {
+    return nr_iterations_;
+  }
+
+  /** \brief Correspondences of the last iteration of the last alignment, as
+   * indices of the input source and target points, e.g. to compute the
+   * alignment covariance without another neighbour search
+   */
+  const std::vector<int>& getFinalSourceIndices() const {
+    return final_source_indices_;
+  }
+  const std::vector<int>& getFinalTargetIndices() const {
+    return final_target_indices_;
+  }
+
 protected:
   /** \brief The number of neighbors used for covariances computation.
    * default: 20
@@ -339,11 +426,18 @@ protected:
   MatricesVectorPtr target_covariances_;
 
   /** \brief Mahalanobis matrices holder. */
-  std::vector<Eigen::Matrix3d> mahalanobis_;
+  std::vector<Matrix3> mahalanobis_;
 
   /** \brief maximum number of optimizations */
   int max_inner_iterations_;
 
+  GicpIterationCallback iteration_callback_;
+  bool b_aborted_;
+
+  /** \brief Correspondences of the last iteration */
+  std::vector<int> final_source_indices_;
+  std::vector<int> final_target_indices_;
+
   /** \brief compute points covariances matrices according to the K nearest
    * neighbors. K is set via setCorrespondenceRandomness() methode.
    * \param cloud pointer to point cloud
@@ -432,6 +526,29 @@ private:
 };
 } // namespace pcl
 
+#ifdef GICP_IMPLEMENTATION
 #include <lamp_utils/gicp.hpp>
+#else
+extern template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    double,
+    Eigen::Matrix3d>;
+extern template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    double,
+    PlaneCovariance<double>>;
+extern template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    float,
+    Eigen::Matrix3f>;
+extern template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    float,
+    PlaneCovariance<float>>;
+#endif
 
 #endif //#ifndef MULTITHREADED_GICP_H_
@@ -50,21 +50,28 @@
 #include <ros/ros.h>
 
 ///////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
-                                                        PointTarget>::
-    setInputCloud(
-        const typename pcl::MultithreadedGeneralizedIterativeClosestPoint<
-            PointSource,
-            PointTarget>::PointCloudSourceConstPtr& cloud) {
+                                                        PointTarget,
+                                                        Scalar,
+                                                        Covariance>::
+    setInputCloud(const PointCloudSourceConstPtr& cloud) {
   setInputSource(cloud);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 template <typename PointT>
 void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
-                                                        PointTarget>::
+                                                        PointTarget,
+                                                        Scalar,
+                                                        Covariance>::
     computeCovariances(typename pcl::PointCloud<PointT>::ConstPtr cloud,
                        const typename pcl::search::KdTree<PointT>::Ptr kdtree,
                        MatricesVector& cloud_covariances,
@@ -87,7 +94,7 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
     }
 
     int enable_omp = (1 < k_num_threads_);
-#pragma omp parallel for schedule(dynamic, 1) if (enable_omp)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(k_num_threads_) if (enable_omp)
     for (int i = 0; i < cloud->points.size(); i++) {
       if (k_enable_timing_output_) {
         if (0 == i) {
@@ -99,7 +106,8 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
       std::vector<int> nn_indices(k_correspondences_);
       std::vector<float> nn_dist_sq(k_correspondences_);
       const PointT& query_point = cloud->points[i];
-      Eigen::Matrix3d& cov = cloud_covariances[i];
+      // Accumulated in double whatever the scalar, the raw moments cancel
+      Eigen::Matrix3d cov;
       // Zero out the cov and mean
       cov.setZero();
       mean.setZero();
@@ -138,30 +146,48 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
 
       // Compute the SVD (covariance matrix is symmetric so U = V')
       Eigen::JacobiSVD<Eigen::Matrix3d> svd(cov, Eigen::ComputeFullU);
-      cov.setZero();
-      Eigen::Matrix3d U = svd.matrixU();
 
-      // Reconstitute the covariance matrix with modified singular values using
-      // the column     // vectors in V.
-      for (int k = 0; k < 3; k++) {
-        Eigen::Vector3d col = U.col(k);
-        double v = 1.; // biggest 2 singular values replaced by 1
-        if (k == 2) {  // smallest singular value replaced by gicp_epsilon
-          v = gicp_epsilon_;
-        }
-        cov += v * col * col.transpose();
-      }
+      // Reconstitute the covariance matrix with modified singular values: the
+      // biggest 2 replaced by 1, the smallest by gicp_epsilon, i.e. a plane
+      // with the last column of U as normal
+      const Vector3 normal = svd.matrixU().col(2).template cast<Scalar>();
+      SetPlaneCovariance<Scalar>(
+          normal, static_cast<Scalar>(gicp_epsilon_), &cloud_covariances[i]);
     }
   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
-void pcl::MultithreadedGeneralizedIterativeClosestPoint<
-    PointSource,
-    PointTarget>::computeRDerivative(const Vector6d& x,
-                                     const Eigen::Matrix3d& R,
-                                     Vector6d& g) const {
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget,
+                                                        Scalar,
+                                                        Covariance>::
+    prepareCloud(const PointCloudTargetConstPtr& cloud,
+                 InputKdTreePtr& tree,
+                 MatricesVectorPtr& covariances,
+                 bool recompute) {
+  tree.reset(new pcl::search::KdTree<PointTarget>);
+  tree->setInputCloud(cloud);
+  covariances.reset(new MatricesVector);
+  computeCovariances<PointTarget>(cloud, tree, *covariances, recompute);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget,
+                                                        Scalar,
+                                                        Covariance>::
+    computeRDerivative(const Vector6d& x,
+                       const Eigen::Matrix3d& R,
+                       Vector6d& g) const {
   Eigen::Matrix3d dR_dPhi;
   Eigen::Matrix3d dR_dTheta;
   Eigen::Matrix3d dR_dPsi;
@@ -214,9 +240,14 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
-                                                        PointTarget>::
+                                                        PointTarget,
+                                                        Scalar,
+                                                        Covariance>::
     estimateRigidTransformationBFGS(const PointCloudSource& cloud_src,
                                     const std::vector<int>& indices_src,
                                     const PointCloudTarget& cloud_tgt,
@@ -287,9 +318,15 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 inline double
-pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                   PointTarget,
+                                                   Scalar,
+                                                   Covariance>::
     OptimizationFunctorWithIndices::operator()(const Vector6d& x) {
   Eigen::Matrix4f transformation_matrix = gicp_->base_transformation_;
   gicp_->applyState(transformation_matrix, x);
@@ -307,25 +344,32 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     Eigen::Vector4f pp(transformation_matrix * p_src);
     // Estimate the distance (cost function)
     // The last coordiante is still guaranteed to be set to 1.0
-    Eigen::Vector3d res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
-    Eigen::Vector3d temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
+    const Vector3 res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
+    const Vector3 temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
     // increment= res'*temp/num_matches = temp'*M*temp/num_matches (we postpone
     // 1/num_matches after the loop closes)
-    f += double(res.transpose() * temp);
+    f += double(res.dot(temp));
   }
   return f / m;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 inline void
-pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                   PointTarget,
+                                                   Scalar,
+                                                   Covariance>::
     OptimizationFunctorWithIndices::df(const Vector6d& x, Vector6d& g) {
   Eigen::Matrix4f transformation_matrix = gicp_->base_transformation_;
   gicp_->applyState(transformation_matrix, x);
   // Zero out g
   g.setZero();
   // Eigen::Vector3d g_t = g.head<3> ();
+  // Summed in double, the terms are in Scalar
   Eigen::Matrix3d R = Eigen::Matrix3d::Zero();
   int m = static_cast<int>(gicp_->tmp_idx_src_->size());
   for (int i = 0; i < m; ++i) {
@@ -340,17 +384,17 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
 
     Eigen::Vector4f pp(transformation_matrix * p_src);
     // The last coordiante is still guaranteed to be set to 1.0
-    Eigen::Vector3d res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
+    const Vector3 res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
     // temp = M*res
-    Eigen::Vector3d temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
+    const Vector3 temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
     // Increment translation gradient
     // g.head<3> ()+= 2*M*res/num_matches (we postpone 2/num_matches after the
     // loop closes)
-    g.head<3>() += temp;
+    g.head<3>() += temp.template cast<double>();
     // Increment rotation gradient
     pp = gicp_->base_transformation_ * p_src;
-    Eigen::Vector3d p_src3(pp[0], pp[1], pp[2]);
-    R += p_src3 * temp.transpose();
+    const Vector3 p_src3(pp[0], pp[1], pp[2]);
+    R += (p_src3 * temp.transpose()).template cast<double>();
   }
   g.head<3>() *= 2.0 / m;
   R *= 2.0 / m;
@@ -358,9 +402,15 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 inline void
-pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                   PointTarget,
+                                                   Scalar,
+                                                   Covariance>::
     OptimizationFunctorWithIndices::fdf(const Vector6d& x,
                                         double& f,
                                         Vector6d& g) {
@@ -368,6 +418,7 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   gicp_->applyState(transformation_matrix, x);
   f = 0;
   g.setZero();
+  // Summed in double, the terms are in Scalar
   Eigen::Matrix3d R = Eigen::Matrix3d::Zero();
   const int m = static_cast<const int>(gicp_->tmp_idx_src_->size());
   for (int i = 0; i < m; ++i) {
@@ -381,19 +432,19 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
         gicp_->tmp_tgt_->points[(*gicp_->tmp_idx_tgt_)[i]].getVector4fMap();
     Eigen::Vector4f pp(transformation_matrix * p_src);
     // The last coordiante is still guaranteed to be set to 1.0
-    Eigen::Vector3d res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
+    const Vector3 res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
     // temp = M*res
-    Eigen::Vector3d temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
+    const Vector3 temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
     // Increment total error
-    f += double(res.transpose() * temp);
+    f += double(res.dot(temp));
     // Increment translation gradient
     // g.head<3> ()+= 2*M*res/num_matches (we postpone 2/num_matches after the
     // loop closes)
-    g.head<3>() += temp;
+    g.head<3>() += temp.template cast<double>();
     pp = gicp_->base_transformation_ * p_src;
-    Eigen::Vector3d p_src3(pp[0], pp[1], pp[2]);
+    const Vector3 p_src3(pp[0], pp[1], pp[2]);
     // Increment rotation gradient
-    R += p_src3 * temp.transpose();
+    R += (p_src3 * temp.transpose()).template cast<double>();
   }
   f /= double(m);
   g.head<3>() *= double(2.0 / m);
@@ -402,9 +453,15 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
 inline void
-pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                   PointTarget,
+                                                   Scalar,
+                                                   Covariance>::
     computeTransformation(PointCloudSource& output,
                           const Eigen::Matrix4f& guess) {
   auto start_gicp = std::chrono::steady_clock::now();
@@ -415,7 +472,7 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   // Get the size of the target
   const size_t N = indices_->size();
   // Set the mahalanobis matrices to identity
-  mahalanobis_.resize(N, Eigen::Matrix3d::Identity());
+  mahalanobis_.resize(N, Matrix3::Identity());
 
   // Compute target cloud covariance matrices
   auto start_covariances = std::chrono::steady_clock::now();
@@ -435,6 +492,9 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   base_transformation_ = Eigen::Matrix4f::Identity();
   nr_iterations_ = 0;
   converged_ = false;
+  b_aborted_ = false;
+  final_source_indices_.clear();
+  final_target_indices_.clear();
   double dist_threshold = corr_dist_threshold_ * corr_dist_threshold_;
 
   pcl::transformPointCloud(output, output, guess);
@@ -445,6 +505,8 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   while (!converged_) {
     std::vector<int> source_indices(indices_->size(), -1);
     std::vector<int> target_indices(indices_->size(), -1);
+    // Squared distances of the correspondences, for the iteration callback
+    std::vector<float> sq_distances(indices_->size(), 0.f);
 
     // guess corresponds to base_t and transformation_ to t
     Eigen::Matrix4d transform_R = Eigen::Matrix4d::Zero();
@@ -457,11 +519,11 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
       }
     }
 
-    const Eigen::Matrix3d R = transform_R.topLeftCorner<3, 3>();
+    const Matrix3 R = transform_R.topLeftCorner<3, 3>().cast<Scalar>();
     int failure = 0;
     auto start_lookups = std::chrono::steady_clock::now();
     int enable_omp = (1 < k_num_threads_);
-#pragma omp parallel for schedule(dynamic, 1) if (enable_omp)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(k_num_threads_) if (enable_omp)
     for (size_t i = 0; i < N; i++) {
       std::vector<int> nn_indices(1);
       std::vector<float> nn_dists(1);
@@ -481,19 +543,17 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
       // Check if the distance to the nearest neighbor is smaller than the user
       // imposed threshold
       if (nn_dists[0] < dist_threshold) {
-        Eigen::Matrix3d& C1 = (*input_covariances_)[i];
-        Eigen::Matrix3d& C2 = (*target_covariances_)[nn_indices[0]];
-        Eigen::Matrix3d& M = mahalanobis_[i];
-        // M = R*C1
-        M = R * C1;
-        // temp = M*R' + C2 = R*C1*R' + C2
-        Eigen::Matrix3d temp = M * R.transpose();
-        temp += C2;
+        const Covariance& C1 = (*input_covariances_)[i];
+        const Covariance& C2 = (*target_covariances_)[nn_indices[0]];
+        // temp = R*C1*R' + C2
+        Matrix3 temp = RotateCovariance(R, C1);
+        temp += CovarianceMatrix(C2);
         // M = temp^-1
-        M = temp.inverse();
+        mahalanobis_[i] = temp.inverse();
 
         source_indices[i] = static_cast<int>(i);
         target_indices[i] = nn_indices[0];
+        sq_distances[i] = nn_dists[0];
       }
     }
     auto end_lookups = std::chrono::steady_clock::now();
@@ -512,6 +572,8 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     target_indices.erase(
         std::remove(target_indices.begin(), target_indices.end(), -1),
         target_indices.end());
+    final_source_indices_ = source_indices;
+    final_target_indices_ = target_indices;
 
     /* optimize transformation using the current assignment and Mahalanobis
      * metrics*/
@@ -577,6 +639,28 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
       PCL_DEBUG("[pcl::%s::computeTransformation] Convergence failed\n",
                 getClassName().c_str());
     }
+
+    if (!converged_ && iteration_callback_) {
+      GicpIterationState state;
+      state.iteration = nr_iterations_;
+      state.num_points = N;
+      state.num_correspondences = source_indices.size();
+      for (int index : source_indices) {
+        state.mean_sq_distance += sq_distances[index];
+      }
+      if (!source_indices.empty()) {
+        state.mean_sq_distance /= source_indices.size();
+      }
+      state.delta = delta;
+      if (!iteration_callback_(state)) {
+        PCL_DEBUG("[pcl::%s::computeTransformation] Aborted after %d "
+                  "iterations\n",
+                  getClassName().c_str(),
+                  nr_iterations_);
+        b_aborted_ = true;
+        break;
+      }
+    }
   }
   auto end_iterations = std::chrono::steady_clock::now();
 
@@ -616,10 +700,15 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   }
 }
 
-template <typename PointSource, typename PointTarget>
-void pcl::MultithreadedGeneralizedIterativeClosestPoint<
-    PointSource,
-    PointTarget>::applyState(Eigen::Matrix4f& t, const Vector6d& x) const {
+template <typename PointSource,
+          typename PointTarget,
+          typename Scalar,
+          typename Covariance>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget,
+                                                        Scalar,
+                                                        Covariance>::
+    applyState(Eigen::Matrix4f& t, const Vector6d& x) const {
   // !!! CAUTION Stanford GICP uses the Z Y X euler angles convention
   Eigen::Matrix3f R;
   R = Eigen::AngleAxisf(static_cast<float>(x[5]), Eigen::Vector3f::UnitZ()) *
@@ -47,16 +47,89 @@ Eigen::Matrix<T, 3, 3> PCLTwoPlaneVectorsFromNormal(const PointF& normal) {
       vec2 * vec2.transpose();
 }
 
+// GICP covariance I - (1 - epsilon) * normal * normal^T, a plane with unit
+// variance along it and epsilon across it. Keeps 4 scalars instead of 9.
 template <typename T>
-void CalculateCovarianceFromNormals(const PointCloudF::ConstPtr& point_cloud,
-                                    MatricesVectorT<T>& cloud_covariances,
-                                    int k_num_threads = 1) {
-  Eigen::Matrix<T, 3, 1> vec1, vec2;
+struct PlaneCovariance {
+  Eigen::Matrix<T, 3, 1> normal{Eigen::Matrix<T, 3, 1>::Zero()};
+  T epsilon{1};
+
+  Eigen::Matrix<T, 3, 3> matrix() const {
+    return Eigen::Matrix<T, 3, 3>::Identity() -
+        (1 - epsilon) * normal * normal.transpose();
+  }
+};
+
+// Plane covariance with the unit normal, in either representation
+template <typename T>
+inline void SetPlaneCovariance(const Eigen::Matrix<T, 3, 1>& normal,
+                               T epsilon,
+                               Eigen::Matrix<T, 3, 3>* cov) {
+  *cov = Eigen::Matrix<T, 3, 3>::Identity() -
+      (1 - epsilon) * normal * normal.transpose();
+}
+
+template <typename T>
+inline void SetPlaneCovariance(const Eigen::Matrix<T, 3, 1>& normal,
+                               T epsilon,
+                               PlaneCovariance<T>* cov) {
+  cov->normal = normal;
+  cov->epsilon = epsilon;
+}
+
+template <typename T>
+inline Eigen::Matrix<T, 3, 3>
+CovarianceMatrix(const Eigen::Matrix<T, 3, 3>& cov) {
+  return cov;
+}
+
+template <typename T>
+inline Eigen::Matrix<T, 3, 3> CovarianceMatrix(const PlaneCovariance<T>& cov) {
+  return cov.matrix();
+}
+
+// R * cov * R^T, only the normal is rotated for a plane covariance
+template <typename T>
+inline Eigen::Matrix<T, 3, 3>
+RotateCovariance(const Eigen::Matrix<T, 3, 3>& R,
+                 const Eigen::Matrix<T, 3, 3>& cov) {
+  return R * cov * R.transpose();
+}
+
+template <typename T>
+inline Eigen::Matrix<T, 3, 3>
+RotateCovariance(const Eigen::Matrix<T, 3, 3>& R,
+                 const PlaneCovariance<T>& cov) {
+  const Eigen::Matrix<T, 3, 1> normal = R * cov.normal;
+  return Eigen::Matrix<T, 3, 3>::Identity() -
+      (1 - cov.epsilon) * normal * normal.transpose();
+}
+
+// Covariance of a point from its normal
+template <typename T>
+inline void CovarianceFromNormal(const PointF& point,
+                                 Eigen::Matrix<T, 3, 3>* cov) {
+  *cov = PCLTwoPlaneVectorsFromNormal<T>(point);
+}
+
+template <typename T>
+inline void CovarianceFromNormal(const PointF& point, PlaneCovariance<T>* cov) {
+  cov->normal = Eigen::Matrix<T, 3, 1>(
+      point.normal_x, point.normal_y, point.normal_z);
+  // A zero normal stays zero, the covariance is then the identity
+  cov->normal.normalize();
+  cov->epsilon = 0.001;
+}
+
+template <typename Covariance>
+void CalculateCovarianceFromNormals(
+    const PointCloudF::ConstPtr& point_cloud,
+    std::vector<Covariance, Eigen::aligned_allocator<Covariance>>&
+        cloud_covariances,
+    int k_num_threads = 1) {
   cloud_covariances.resize(point_cloud->size());
-  omp_set_num_threads(k_num_threads);
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(k_num_threads) if (k_num_threads > 1)
   for (int i = 0; i < point_cloud->points.size(); ++i) {
-    cloud_covariances[i] =
-        PCLTwoPlaneVectorsFromNormal<T>(point_cloud->points[i]);
+    CovarianceFromNormal(point_cloud->points[i], &cloud_covariances[i]);
   }
 }
\ No newline at end of file
@@ -0,0 +1,180 @@
+/*
+G2oStream.cc
+Chunked reading and streamed writing of g2o files
+*/
+
+#include "lamp_utils/G2oStream.h"
+
+#include <iomanip>
+#include <sstream>
+
+#include <gtsam/slam/BetweenFactor.h>
+
+#include "lamp_utils/CommonFunctions.h"
+
+namespace lamp_utils {
+
+namespace {
+
+// g2o orders the information with the translation first, gtsam with the
+// rotation first. The permutation is its own inverse.
+gtsam::Matrix6 SwapRotationTranslation(const gtsam::Matrix6& m) {
+  gtsam::Matrix6 swapped;
+  swapped.block<3, 3>(0, 0) = m.block<3, 3>(3, 3);
+  swapped.block<3, 3>(3, 3) = m.block<3, 3>(0, 0);
+  swapped.block<3, 3>(0, 3) = m.block<3, 3>(3, 0);
+  swapped.block<3, 3>(3, 0) = m.block<3, 3>(0, 3);
+  return swapped;
+}
+
+bool ReadPose(std::istringstream& line, gtsam::Pose3* pose) {
+  double x, y, z, qx, qy, qz, qw;
+  if (!(line >> x >> y >> z >> qx >> qy >> qz >> qw)) {
+    return false;
+  }
+  *pose = gtsam::Pose3(gtsam::Rot3::Quaternion(qw, qx, qy, qz),
+                       gtsam::Point3(x, y, z));
+  return true;
+}
+
+void WritePose(std::ofstream& file, const gtsam::Pose3& pose) {
+  const gtsam::Point3 t = pose.translation();
+  const gtsam::Quaternion q = pose.rotation().toQuaternion();
+  file << t.x() << " " << t.y() << " " << t.z() << " " << q.x() << " "
+       << q.y() << " " << q.z() << " " << q.w();
+}
+
+} // namespace
+
+bool G2oReader::Open(const std::string& filename) {
+  file_.close();
+  file_.clear();
+  file_.open(filename);
+  num_vertices_ = num_edges_ = num_skipped_ = 0;
+  return file_.is_open();
+}
+
+bool G2oReader::ReadChunk(size_t max_edges,
+                          gtsam::NonlinearFactorGraph* factors,
+                          gtsam::Values* values) {
+  size_t n_read = 0;
+  size_t n_edges = 0;
+  std::string text;
+  while ((max_edges == 0 || n_edges < max_edges) &&
+         std::getline(file_, text)) {
+    std::istringstream line(text);
+    std::string tag;
+    if (!(line >> tag)) {
+      continue;
+    }
+
+    if (tag == "VERTEX_SE3:QUAT") {
+      gtsam::Key key;
+      gtsam::Pose3 pose;
+      if (!(line >> key) || !ReadPose(line, &pose) || values->exists(key)) {
+        num_skipped_++;
+        continue;
+      }
+      values->insert(key, pose);
+      num_vertices_++;
+      n_read++;
+    } else if (tag == "EDGE_SE3:QUAT") {
+      gtsam::Key from, to;
+      gtsam::Pose3 measured;
+      if (!(line >> from >> to) || !ReadPose(line, &measured)) {
+        num_skipped_++;
+        continue;
+      }
+      // Upper triangle, row major
+      gtsam::Matrix6 information;
+      bool b_valid = true;
+      for (int i = 0; i < 6 && b_valid; i++) {
+        for (int j = i; j < 6; j++) {
+          if (!(line >> information(i, j))) {
+            b_valid = false;
+            break;
+          }
+          information(j, i) = information(i, j);
+        }
+      }
+      if (!b_valid) {
+        num_skipped_++;
+        continue;
+      }
+      factors->add(gtsam::BetweenFactor<gtsam::Pose3>(
+          from,
+          to,
+          measured,
+          gtsam::noiseModel::Gaussian::Information(
+              SwapRotationTranslation(information))));
+      num_edges_++;
+      n_edges++;
+      n_read++;
+    } else {
+      num_skipped_++;
+    }
+  }
+  return n_read > 0;
+}
+
+G2oWriter::~G2oWriter() {
+  Close();
+}
+
+bool G2oWriter::Open(const std::string& filename) {
+  Close();
+  file_.open(filename);
+  file_ << std::setprecision(17);
+  return file_.is_open();
+}
+
+void G2oWriter::Close() {
+  if (file_.is_open()) {
+    file_.close();
+  }
+}
+
+void G2oWriter::WriteVertex(gtsam::Key key, const gtsam::Pose3& pose) {
+  file_ << "VERTEX_SE3:QUAT " << key << " ";
+  WritePose(file_, pose);
+  file_ << "\n";
+}
+
+void G2oWriter::WriteEdge(gtsam::Key from,
+                          gtsam::Key to,
+                          const gtsam::Pose3& measured,
+                          const gtsam::Matrix6& information) {
+  const gtsam::Matrix6 info = SwapRotationTranslation(information);
+  file_ << "EDGE_SE3:QUAT " << from << " " << to << " ";
+  WritePose(file_, measured);
+  for (int i = 0; i < 6; i++) {
+    for (int j = i; j < 6; j++) {
+      file_ << " " << info(i, j);
+    }
+  }
+  file_ << "\n";
+}
+
+bool G2oWriter::WritePoseGraph(const pose_graph_msgs::PoseGraph& graph) {
+  for (const auto& node : graph.nodes) {
+    WriteVertex(node.key, MessageToPose(node));
+  }
+  for (const auto& edge : graph.edges) {
+    if (edge.type != pose_graph_msgs::PoseGraphEdge::ODOM &&
+        edge.type != pose_graph_msgs::PoseGraphEdge::LOOPCLOSE &&
+        edge.type != pose_graph_msgs::PoseGraphEdge::ARTIFACT &&
+        edge.type != pose_graph_msgs::PoseGraphEdge::UWB_BETWEEN) {
+      continue;
+    }
+    const gtsam::Matrix6 information =
+        MessageToCovarianceMatrix(edge).inverse();
+    if (!information.allFinite()) {
+      continue;
+    }
+    WriteEdge(edge.key_from, edge.key_to, MessageToPose(edge), information);
+  }
+  file_.flush();
+  return file_.good();
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,549 @@
+/*
+GraphStore.cc
+Columnar storage of the node and edge messages cached by the pose graph
+*/
+
+#include "lamp_utils/GraphStore.h"
+
+#include <algorithm>
+
+#include <gtsam/inference/Symbol.h>
+
+namespace lamp_utils {
+
+namespace {
+
+void RemoveFromIndex(std::unordered_multimap<gtsam::Key, size_t>* index,
+                     gtsam::Key key,
+                     size_t i) {
+  auto range = index->equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == i) {
+      index->erase(it);
+      return;
+    }
+  }
+}
+
+void ReplaceInIndex(std::unordered_multimap<gtsam::Key, size_t>* index,
+                    gtsam::Key key,
+                    size_t from,
+                    size_t to) {
+  auto range = index->equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == from) {
+      it->second = to;
+      return;
+    }
+  }
+}
+
+template <typename T>
+void CompactVector(std::vector<T>* v,
+                   const std::vector<bool>& keep,
+                   size_t stride = 1) {
+  size_t out = 0;
+  for (size_t i = 0; i < keep.size(); i++) {
+    if (!keep[i])
+      continue;
+    if (out != i) {
+      std::copy(v->begin() + i * stride,
+                v->begin() + (i + 1) * stride,
+                v->begin() + out * stride);
+    }
+    out++;
+  }
+  v->resize(out * stride);
+}
+
+template <typename T>
+void MoveLast(std::vector<T>* v, size_t i, size_t stride = 1) {
+  const size_t last = v->size() / stride - 1;
+  if (i != last) {
+    std::copy(v->begin() + last * stride,
+              v->end(),
+              v->begin() + i * stride);
+  }
+  v->resize(last * stride);
+}
+
+template <typename T>
+size_t VectorBytes(const std::vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+// Nodes of a node based hash container and its bucket array
+template <typename MapT>
+size_t HashBytes(const MapT& map) {
+  return map.size() * (sizeof(typename MapT::value_type) + 2 * sizeof(void*)) +
+      map.bucket_count() * sizeof(void*);
+}
+
+} // namespace
+
+// StringTable ----------------------------------------------------------------
+
+StringTable::StringTable() {
+  clear();
+}
+
+uint32_t StringTable::Intern(const std::string& str) {
+  auto it = index_.find(str);
+  if (it != index_.end())
+    return it->second;
+  const uint32_t index = strings_.size();
+  strings_.push_back(str);
+  index_.emplace(str, index);
+  return index;
+}
+
+uint32_t StringTable::Find(const std::string& str) const {
+  auto it = index_.find(str);
+  return it == index_.end() ? 0 : it->second;
+}
+
+void StringTable::clear() {
+  strings_.assign(1, std::string());
+  index_.clear();
+  index_.emplace(std::string(), 0);
+}
+
+size_t StringTable::MemoryBytes() const {
+  size_t bytes = VectorBytes(strings_) + HashBytes(index_);
+  // Stored twice, in the table and as the key of the index
+  for (const std::string& str : strings_)
+    bytes += 2 * str.capacity();
+  return bytes;
+}
+
+// PoseCovarianceColumns ------------------------------------------------------
+
+void PoseCovarianceColumns::ReserveColumns(size_t n) {
+  stamps_.reserve(n);
+  frame_ids_.reserve(n);
+  poses_.reserve(n * kPoseStride);
+  covariances_.reserve(n * kCovarianceStride);
+}
+
+void PoseCovarianceColumns::Append(const std_msgs::Header& header,
+                                   const geometry_msgs::Pose& pose,
+                                   const boost::array<double, 36>& covariance) {
+  stamps_.push_back(header.stamp);
+  frame_ids_.push_back(0);
+  poses_.resize(poses_.size() + kPoseStride);
+  covariances_.resize(covariances_.size() + kCovarianceStride);
+  Assign(stamps_.size() - 1, header, pose, covariance);
+}
+
+void PoseCovarianceColumns::Assign(size_t i,
+                                   const std_msgs::Header& header,
+                                   const geometry_msgs::Pose& pose,
+                                   const boost::array<double, 36>& covariance) {
+  stamps_[i] = header.stamp;
+  frame_ids_[i] = strings_.Intern(header.frame_id);
+  SetPose(i, pose);
+  std::copy(covariance.begin(),
+            covariance.end(),
+            covariances_.begin() + i * kCovarianceStride);
+}
+
+void PoseCovarianceColumns::SetPose(size_t i, const geometry_msgs::Pose& pose) {
+  double* p = &poses_[i * kPoseStride];
+  p[0] = pose.position.x;
+  p[1] = pose.position.y;
+  p[2] = pose.position.z;
+  p[3] = pose.orientation.x;
+  p[4] = pose.orientation.y;
+  p[5] = pose.orientation.z;
+  p[6] = pose.orientation.w;
+}
+
+void PoseCovarianceColumns::Read(size_t i,
+                                 std_msgs::Header* header,
+                                 geometry_msgs::Pose* pose,
+                                 boost::array<double, 36>* covariance) const {
+  header->stamp = stamps_[i];
+  header->frame_id = strings_.Get(frame_ids_[i]);
+  const double* p = &poses_[i * kPoseStride];
+  pose->position.x = p[0];
+  pose->position.y = p[1];
+  pose->position.z = p[2];
+  pose->orientation.x = p[3];
+  pose->orientation.y = p[4];
+  pose->orientation.z = p[5];
+  pose->orientation.w = p[6];
+  std::copy(covariances_.begin() + i * kCovarianceStride,
+            covariances_.begin() + (i + 1) * kCovarianceStride,
+            covariance->begin());
+}
+
+void PoseCovarianceColumns::MoveLastTo(size_t i) {
+  MoveLast(&stamps_, i);
+  MoveLast(&frame_ids_, i);
+  MoveLast(&poses_, i, kPoseStride);
+  MoveLast(&covariances_, i, kCovarianceStride);
+}
+
+void PoseCovarianceColumns::Compact(const std::vector<bool>& keep) {
+  CompactVector(&stamps_, keep);
+  CompactVector(&frame_ids_, keep);
+  CompactVector(&poses_, keep, kPoseStride);
+  CompactVector(&covariances_, keep, kCovarianceStride);
+}
+
+size_t PoseCovarianceColumns::ColumnBytes() const {
+  return VectorBytes(stamps_) + VectorBytes(frame_ids_) + VectorBytes(poses_) +
+      VectorBytes(covariances_) + strings_.MemoryBytes();
+}
+
+void PoseCovarianceColumns::ClearColumns() {
+  stamps_.clear();
+  frame_ids_.clear();
+  poses_.clear();
+  covariances_.clear();
+  strings_.clear();
+}
+
+// PrefixIndex ----------------------------------------------------------------
+
+void PrefixIndex::Add(gtsam::Key key, size_t i) {
+  slots_[gtsam::Symbol(key).chr()].insert(i);
+}
+
+void PrefixIndex::Remove(gtsam::Key key, size_t i) {
+  auto it = slots_.find(gtsam::Symbol(key).chr());
+  if (it != slots_.end())
+    it->second.erase(i);
+}
+
+void PrefixIndex::Move(gtsam::Key key, size_t from, size_t to) {
+  std::unordered_set<size_t>& slots = slots_[gtsam::Symbol(key).chr()];
+  slots.erase(from);
+  slots.insert(to);
+}
+
+std::vector<size_t> PrefixIndex::Slots(unsigned char prefix) const {
+  auto it = slots_.find(prefix);
+  if (it == slots_.end())
+    return std::vector<size_t>();
+  return std::vector<size_t>(it->second.begin(), it->second.end());
+}
+
+void PrefixIndex::clear() {
+  slots_.clear();
+}
+
+size_t PrefixIndex::MemoryBytes() const {
+  size_t bytes = HashBytes(slots_);
+  for (const auto& prefix : slots_)
+    bytes += HashBytes(prefix.second);
+  return bytes;
+}
+
+// NodeStore ------------------------------------------------------------------
+
+bool NodeStore::Insert(const NodeMessage& msg) {
+  if (Contains(msg.key))
+    return false;
+  index_.emplace(msg.key, keys_.size());
+  prefix_index_.Add(msg.key, keys_.size());
+  keys_.push_back(msg.key);
+  ids_.push_back(strings_.Intern(msg.ID));
+  Append(msg.header, msg.pose, msg.covariance);
+  return true;
+}
+
+bool NodeStore::Assign(const NodeMessage& msg) {
+  auto it = index_.find(msg.key);
+  if (it == index_.end())
+    return Insert(msg);
+  ids_[it->second] = strings_.Intern(msg.ID);
+  PoseCovarianceColumns::Assign(
+      it->second, msg.header, msg.pose, msg.covariance);
+  return false;
+}
+
+bool NodeStore::SetPose(gtsam::Key key, const geometry_msgs::Pose& pose) {
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return false;
+  PoseCovarianceColumns::SetPose(it->second, pose);
+  return true;
+}
+
+bool NodeStore::Erase(gtsam::Key key) {
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return false;
+  const size_t i = it->second;
+  index_.erase(it);
+  prefix_index_.Remove(key, i);
+  if (i + 1 != keys_.size()) {
+    index_[keys_.back()] = i;
+    prefix_index_.Move(keys_.back(), keys_.size() - 1, i);
+  }
+  MoveLast(&keys_, i);
+  MoveLast(&ids_, i);
+  MoveLastTo(i);
+  return true;
+}
+
+void NodeStore::ErasePrefix(unsigned char prefix) {
+  std::vector<gtsam::Key> keys;
+  for (size_t i : prefix_index_.Slots(prefix))
+    keys.push_back(keys_[i]);
+  for (gtsam::Key key : keys)
+    Erase(key);
+}
+
+boost::optional<NodeMessage> NodeStore::Find(gtsam::Key key) const {
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return boost::none;
+  return At(it->second);
+}
+
+NodeMessage NodeStore::At(size_t i) const {
+  NodeMessage msg;
+  msg.key = keys_[i];
+  msg.ID = strings_.Get(ids_[i]);
+  Read(i, &msg.header, &msg.pose, &msg.covariance);
+  return msg;
+}
+
+void NodeStore::AppendTo(NodeMessages* msgs) const {
+  msgs->reserve(msgs->size() + size());
+  for (size_t i = 0; i < size(); i++)
+    msgs->emplace_back(At(i));
+}
+
+void NodeStore::clear() {
+  keys_.clear();
+  ids_.clear();
+  index_.clear();
+  prefix_index_.clear();
+  ClearColumns();
+}
+
+size_t NodeStore::MemoryBytes() const {
+  return ColumnBytes() + VectorBytes(keys_) + VectorBytes(ids_) +
+      HashBytes(index_) + prefix_index_.MemoryBytes();
+}
+
+void NodeStore::CompactNodes(const std::vector<bool>& keep) {
+  CompactVector(&keys_, keep);
+  CompactVector(&ids_, keep);
+  Compact(keep);
+  index_.clear();
+  prefix_index_.clear();
+  for (size_t i = 0; i < keys_.size(); i++) {
+    index_.emplace(keys_[i], i);
+    prefix_index_.Add(keys_[i], i);
+  }
+}
+
+// EdgeStore ------------------------------------------------------------------
+
+size_t EdgeStore::EdgeKeyHash::operator()(const EdgeKey& key) const {
+  size_t seed = std::hash<gtsam::Key>()(key.key_from);
+  seed ^= std::hash<gtsam::Key>()(key.key_to) + 0x9e3779b9 + (seed << 6) +
+      (seed >> 2);
+  seed ^= std::hash<int>()(key.type) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  return seed;
+}
+
+bool EdgeStore::Contains(gtsam::Key key_from,
+                         gtsam::Key key_to,
+                         int type) const {
+  return index_.find(EdgeKey{key_from, key_to, type}) != index_.end();
+}
+
+bool EdgeStore::Insert(const EdgeMessage& msg) {
+  const EdgeKey key{msg.key_from, msg.key_to, msg.type};
+  if (index_.find(key) != index_.end())
+    return false;
+  const size_t i = keys_from_.size();
+  index_.emplace(key, i);
+  from_index_.emplace(msg.key_from, i);
+  to_index_.emplace(msg.key_to, i);
+  prefix_index_.Add(msg.key_from, i);
+  prefix_index_.Add(msg.key_to, i);
+  keys_from_.push_back(msg.key_from);
+  keys_to_.push_back(msg.key_to);
+  types_.push_back(msg.type);
+  ranges_.push_back(msg.range);
+  range_errors_.push_back(msg.range_error);
+  Append(msg.header, msg.pose, msg.covariance);
+  return true;
+}
+
+bool EdgeStore::Assign(const EdgeMessage& msg) {
+  auto it = index_.find(EdgeKey{msg.key_from, msg.key_to, msg.type});
+  if (it == index_.end())
+    return Insert(msg);
+  ranges_[it->second] = msg.range;
+  range_errors_[it->second] = msg.range_error;
+  PoseCovarianceColumns::Assign(
+      it->second, msg.header, msg.pose, msg.covariance);
+  return false;
+}
+
+void EdgeStore::Reserve(size_t n) {
+  keys_from_.reserve(n);
+  keys_to_.reserve(n);
+  types_.reserve(n);
+  ranges_.reserve(n);
+  range_errors_.reserve(n);
+  index_.reserve(n);
+  from_index_.reserve(n);
+  to_index_.reserve(n);
+  ReserveColumns(n);
+}
+
+bool EdgeStore::Erase(gtsam::Key key_from, gtsam::Key key_to, int type) {
+  auto it = index_.find(EdgeKey{key_from, key_to, type});
+  if (it == index_.end())
+    return false;
+  const size_t i = it->second;
+  index_.erase(it);
+  RemoveFromIndex(&from_index_, key_from, i);
+  RemoveFromIndex(&to_index_, key_to, i);
+  prefix_index_.Remove(key_from, i);
+  prefix_index_.Remove(key_to, i);
+
+  const size_t last = keys_from_.size() - 1;
+  if (i != last) {
+    index_[EdgeKey{keys_from_[last], keys_to_[last], types_[last]}] = i;
+    ReplaceInIndex(&from_index_, keys_from_[last], last, i);
+    ReplaceInIndex(&to_index_, keys_to_[last], last, i);
+    prefix_index_.Move(keys_from_[last], last, i);
+    prefix_index_.Move(keys_to_[last], last, i);
+  }
+  MoveLast(&keys_from_, i);
+  MoveLast(&keys_to_, i);
+  MoveLast(&types_, i);
+  MoveLast(&ranges_, i);
+  MoveLast(&range_errors_, i);
+  MoveLastTo(i);
+  return true;
+}
+
+void EdgeStore::ErasePrefix(unsigned char prefix) {
+  std::vector<EdgeKey> keys;
+  for (size_t i : prefix_index_.Slots(prefix))
+    keys.push_back(EdgeKey{keys_from_[i], keys_to_[i], types_[i]});
+  for (const EdgeKey& key : keys)
+    Erase(key.key_from, key.key_to, key.type);
+}
+
+boost::optional<EdgeMessage>
+EdgeStore::Find(gtsam::Key key_from, gtsam::Key key_to, int type) const {
+  auto it = index_.find(EdgeKey{key_from, key_to, type});
+  if (it == index_.end())
+    return boost::none;
+  return At(it->second);
+}
+
+boost::optional<EdgeMessage> EdgeStore::FindAnyType(gtsam::Key key_from,
+                                                    gtsam::Key key_to) const {
+  return FindSmallest(to_index_, key_to, true, key_from);
+}
+
+boost::optional<EdgeMessage> EdgeStore::FindKeyFrom(gtsam::Key key_from) const {
+  return FindSmallest(from_index_, key_from, false, 0);
+}
+
+boost::optional<EdgeMessage> EdgeStore::FindKeyTo(gtsam::Key key_to) const {
+  return FindSmallest(to_index_, key_to, false, 0);
+}
+
+bool EdgeStore::IsBefore(size_t lhs, size_t rhs) const {
+  if (keys_from_[lhs] != keys_from_[rhs])
+    return keys_from_[lhs] < keys_from_[rhs];
+  if (keys_to_[lhs] != keys_to_[rhs])
+    return keys_to_[lhs] < keys_to_[rhs];
+  return types_[lhs] < types_[rhs];
+}
+
+boost::optional<EdgeMessage> EdgeStore::FindSmallest(const KeyIndex& index,
+                                                     gtsam::Key key,
+                                                     bool match_from,
+                                                     gtsam::Key key_from) const {
+  auto range = index.equal_range(key);
+  bool b_found = false;
+  size_t best = 0;
+  for (auto it = range.first; it != range.second; ++it) {
+    if (match_from && keys_from_[it->second] != key_from)
+      continue;
+    if (!b_found || IsBefore(it->second, best)) {
+      best = it->second;
+      b_found = true;
+    }
+  }
+  if (!b_found)
+    return boost::none;
+  return At(best);
+}
+
+EdgeMessage EdgeStore::At(size_t i) const {
+  EdgeMessage msg;
+  msg.key_from = keys_from_[i];
+  msg.key_to = keys_to_[i];
+  msg.type = types_[i];
+  msg.range = ranges_[i];
+  msg.range_error = range_errors_[i];
+  Read(i, &msg.header, &msg.pose, &msg.covariance);
+  return msg;
+}
+
+void EdgeStore::AppendTo(EdgeMessages* msgs) const {
+  msgs->reserve(msgs->size() + size());
+  for (size_t i = 0; i < size(); i++)
+    msgs->emplace_back(At(i));
+}
+
+void EdgeStore::clear() {
+  keys_from_.clear();
+  keys_to_.clear();
+  types_.clear();
+  ranges_.clear();
+  range_errors_.clear();
+  index_.clear();
+  from_index_.clear();
+  to_index_.clear();
+  prefix_index_.clear();
+  ClearColumns();
+}
+
+size_t EdgeStore::MemoryBytes() const {
+  return ColumnBytes() + VectorBytes(keys_from_) + VectorBytes(keys_to_) +
+      VectorBytes(types_) + VectorBytes(ranges_) + VectorBytes(range_errors_) +
+      HashBytes(index_) + HashBytes(from_index_) + HashBytes(to_index_) +
+      prefix_index_.MemoryBytes();
+}
+
+void EdgeStore::CompactEdges(const std::vector<bool>& keep) {
+  CompactVector(&keys_from_, keep);
+  CompactVector(&keys_to_, keep);
+  CompactVector(&types_, keep);
+  CompactVector(&ranges_, keep);
+  CompactVector(&range_errors_, keep);
+  Compact(keep);
+  RebuildIndices();
+}
+
+void EdgeStore::RebuildIndices() {
+  index_.clear();
+  from_index_.clear();
+  to_index_.clear();
+  prefix_index_.clear();
+  for (size_t i = 0; i < keys_from_.size(); i++) {
+    index_.emplace(EdgeKey{keys_from_[i], keys_to_[i], types_[i]}, i);
+    from_index_.emplace(keys_from_[i], i);
+    to_index_.emplace(keys_to_[i], i);
+    prefix_index_.Add(keys_from_[i], i);
+    prefix_index_.Add(keys_to_[i], i);
+  }
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,152 @@
+/*
+KeyedScanLoader.cc
+Background loading of the keyed scans of a loaded pose graph
+*/
+
+#include "lamp_utils/KeyedScanLoader.h"
+
+#include <algorithm>
+
+#include "lamp_utils/ThreadGovernor.h"
+
+namespace lamp_utils {
+
+namespace {
+
+size_t ScanBytes(const PointCloudConstPtr& scan) {
+  return scan == nullptr
+      ? 0
+      : sizeof(PointCloud) + scan->points.capacity() * sizeof(Point);
+}
+
+} // namespace
+
+KeyedScanLoader::KeyedScanLoader(const std::vector<gtsam::Key>& keys,
+                                 const ReadFunction& read,
+                                 size_t num_threads)
+  : keys_(keys), read_(read) {
+  std::sort(keys_.begin(), keys_.end());
+  keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+  entries_.reserve(keys_.size());
+  for (const gtsam::Key& key : keys_)
+    entries_.emplace(key, Entry());
+
+  num_threads = ThreadGovernor::Instance().Threads(
+      "scan_loader", std::max<size_t>(num_threads, 1));
+  num_threads = std::min(num_threads, keys_.size());
+  for (size_t i = 0; i < num_threads; i++)
+    workers_.emplace_back(&KeyedScanLoader::WorkerLoop, this);
+}
+
+KeyedScanLoader::~KeyedScanLoader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    b_shutdown_ = true;
+  }
+  for (auto& worker : workers_)
+    worker.join();
+}
+
+void KeyedScanLoader::WorkerLoop() {
+  ThreadGovernor::Instance().RegisterThread("scan_loader");
+  while (true) {
+    gtsam::Key key;
+    Entry* entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Skip the keys read on demand
+      while (next_ < keys_.size() &&
+             entries_.at(keys_[next_]).state != State::PENDING)
+        next_++;
+      if (b_shutdown_ || next_ == keys_.size())
+        return;
+      key = keys_[next_++];
+      entry = &entries_.at(key);
+      entry->state = State::READING;
+    }
+    const PointCloudConstPtr scan = read_(key);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Finish(entry, scan, false);
+  }
+}
+
+bool KeyedScanLoader::Has(const gtsam::Key& key) const {
+  // Entries are only added by the constructor
+  return entries_.find(key) != entries_.end();
+}
+
+PointCloudConstPtr KeyedScanLoader::Get(const gtsam::Key& key) {
+  return Load(key, false);
+}
+
+PointCloudConstPtr KeyedScanLoader::Take(const gtsam::Key& key) {
+  return Load(key, true);
+}
+
+PointCloudConstPtr KeyedScanLoader::Load(const gtsam::Key& key, bool b_take) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return nullptr;
+  Entry& entry = it->second;
+  read_cv_.wait(lock, [&entry] { return entry.state != State::READING; });
+
+  if (entry.state == State::READ) {
+    PointCloudConstPtr scan = entry.scan;
+    if (b_take && scan != nullptr) {
+      resident_bytes_ -= ScanBytes(scan);
+      entry.scan.reset();
+      entry.state = State::TAKEN;
+    }
+    return scan;
+  }
+
+  // Read here, outside the lock. A taken scan is not kept again, its taker
+  // holds it.
+  const bool b_first = entry.state == State::PENDING;
+  if (b_first)
+    entry.state = State::READING;
+  lock.unlock();
+  const PointCloudConstPtr scan = read_(key);
+  if (b_first) {
+    lock.lock();
+    Finish(&entry, scan, b_take);
+  }
+  return scan;
+}
+
+void KeyedScanLoader::Finish(Entry* entry,
+                             const PointCloudConstPtr& scan,
+                             bool b_take) {
+  if (b_take) {
+    entry->state = State::TAKEN;
+  } else {
+    entry->state = State::READ;
+    entry->scan = scan;
+    resident_bytes_ += ScanBytes(scan);
+  }
+  num_read_++;
+  read_cv_.notify_all();
+}
+
+void KeyedScanLoader::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  read_cv_.wait(lock, [this] { return num_read_ == keys_.size(); });
+}
+
+bool KeyedScanLoader::IsDone() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_read_ == keys_.size();
+}
+
+size_t KeyedScanLoader::NumRead() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_read_;
+}
+
+size_t KeyedScanLoader::ResidentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return resident_bytes_;
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,319 @@
+/*
+KeyedScanStore.cc
+Memory bounded keyed scan storage with LRU eviction and on-disk spill
+*/
+
+#include "lamp_utils/KeyedScanStore.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <ros/console.h>
+
+namespace lamp_utils {
+
+namespace {
+
+// Fixed part of a spilled record, followed by the frame id and the points
+struct SpillHeader {
+  uint64_t stamp;
+  uint32_t seq;
+  uint32_t width;
+  uint32_t height;
+  uint32_t frame_id_size;
+  uint64_t num_points;
+  uint8_t is_dense;
+};
+
+} // namespace
+
+KeyedScanStore::KeyedScanStore() {}
+
+KeyedScanStore::~KeyedScanStore() {
+  CloseSpillFile();
+}
+
+bool KeyedScanStore::Configure(size_t ram_budget_bytes,
+                               const std::string& spill_directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ram_budget_bytes_ = ram_budget_bytes;
+  if (ram_budget_bytes_ == 0) {
+    return true;
+  }
+
+  if (spill_fd_ < 0) {
+    std::string path = spill_directory + "/keyed_scans_XXXXXX";
+    std::vector<char> path_buf(path.begin(), path.end());
+    path_buf.push_back('\0');
+    spill_fd_ = mkstemp(path_buf.data());
+    if (spill_fd_ < 0) {
+      ROS_ERROR_STREAM("KeyedScanStore: Could not create spill file in "
+                       << spill_directory);
+      ram_budget_bytes_ = 0;
+      return false;
+    }
+    // The file lives as long as the descriptor, nothing to clean up later
+    unlink(path_buf.data());
+  }
+
+  EvictToBudget();
+  return true;
+}
+
+void KeyedScanStore::SetEvictionCallback(
+    const std::function<void(const gtsam::Key&)>& callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  eviction_callback_ = callback;
+}
+
+bool KeyedScanStore::Insert(const gtsam::Key& key,
+                            const PointCloudConstPtr& scan) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (scan == nullptr || entries_.count(key) > 0) {
+    return false;
+  }
+
+  Entry& entry = entries_[key];
+  entry.scan = scan;
+  entry.bytes = ScanBytes(scan);
+  lru_.push_front(key);
+  entry.lru_it = lru_.begin();
+  stats_.resident_bytes += entry.bytes;
+
+  EvictToBudget();
+  return true;
+}
+
+PointCloudConstPtr KeyedScanStore::Get(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+
+  Entry& entry = it->second;
+  if (entry.scan != nullptr) {
+    stats_.hits++;
+    lru_.splice(lru_.begin(), lru_, entry.lru_it);
+    return entry.scan;
+  }
+
+  stats_.misses++;
+  PointCloudConstPtr scan = PageIn(&entry);
+  if (scan == nullptr) {
+    return nullptr;
+  }
+  entry.scan = scan;
+  lru_.push_front(key);
+  entry.lru_it = lru_.begin();
+  stats_.resident_bytes += entry.bytes;
+
+  EvictToBudget();
+  return scan;
+}
+
+bool KeyedScanStore::Has(const gtsam::Key& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.count(key) > 0;
+}
+
+bool KeyedScanStore::Erase(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  // Spilled records are not reclaimed, the file is append only
+  if (it->second.scan != nullptr) {
+    lru_.erase(it->second.lru_it);
+    stats_.resident_bytes -= it->second.bytes;
+  }
+  entries_.erase(it);
+  if (eviction_callback_) {
+    eviction_callback_(key);
+  }
+  return true;
+}
+
+void KeyedScanStore::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+  stats_ = Stats();
+  if (spill_fd_ >= 0) {
+    if (spill_map_ != nullptr) {
+      munmap(spill_map_, spill_map_size_);
+      spill_map_ = nullptr;
+      spill_map_size_ = 0;
+    }
+    if (ftruncate(spill_fd_, 0) != 0) {
+      ROS_WARN("KeyedScanStore: Could not truncate spill file");
+    }
+    spill_size_ = 0;
+  }
+}
+
+size_t KeyedScanStore::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+KeyedScanStore::Stats KeyedScanStore::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void KeyedScanStore::EvictToBudget() {
+  if (ram_budget_bytes_ == 0 || spill_fd_ < 0) {
+    return;
+  }
+  // Always keep the most recently used scan resident
+  while (stats_.resident_bytes > ram_budget_bytes_ && lru_.size() > 1) {
+    const gtsam::Key key = lru_.back();
+    Entry& entry = entries_.at(key);
+    if (!entry.b_on_disk && !Spill(&entry)) {
+      // Keep it in memory rather than losing the scan
+      return;
+    }
+    entry.scan = nullptr;
+    lru_.pop_back();
+    stats_.resident_bytes -= entry.bytes;
+    stats_.evictions++;
+    if (eviction_callback_) {
+      eviction_callback_(key);
+    }
+  }
+}
+
+bool KeyedScanStore::Spill(Entry* entry) {
+  const PointCloud& scan = *entry->scan;
+
+  SpillHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.stamp = scan.header.stamp;
+  header.seq = scan.header.seq;
+  header.width = scan.width;
+  header.height = scan.height;
+  header.frame_id_size = scan.header.frame_id.size();
+  header.num_points = scan.points.size();
+  header.is_dense = scan.is_dense ? 1 : 0;
+
+  const size_t points_bytes = scan.points.size() * sizeof(Point);
+  std::vector<char> raw(sizeof(header) + header.frame_id_size + points_bytes);
+  char* ptr = raw.data();
+  std::memcpy(ptr, &header, sizeof(header));
+  ptr += sizeof(header);
+  std::memcpy(ptr, scan.header.frame_id.data(), header.frame_id_size);
+  ptr += header.frame_id_size;
+  if (points_bytes > 0) {
+    std::memcpy(ptr, scan.points.data(), points_bytes);
+  }
+
+  uLongf compressed_size = compressBound(raw.size());
+  std::vector<Bytef> compressed(compressed_size);
+  if (compress2(compressed.data(),
+                &compressed_size,
+                reinterpret_cast<const Bytef*>(raw.data()),
+                raw.size(),
+                Z_BEST_SPEED) != Z_OK) {
+    ROS_WARN("KeyedScanStore: Failed to compress scan");
+    return false;
+  }
+
+  ssize_t written =
+      pwrite(spill_fd_, compressed.data(), compressed_size, spill_size_);
+  if (written != static_cast<ssize_t>(compressed_size)) {
+    ROS_WARN("KeyedScanStore: Failed to write spill file");
+    return false;
+  }
+
+  entry->b_on_disk = true;
+  entry->offset = spill_size_;
+  entry->raw_bytes = raw.size();
+  entry->compressed_bytes = compressed_size;
+  spill_size_ += compressed_size;
+  stats_.spilled_bytes = spill_size_;
+  return true;
+}
+
+bool KeyedScanStore::MapSpillFile(size_t min_size) {
+  if (spill_map_ != nullptr && spill_map_size_ >= min_size) {
+    return true;
+  }
+  if (spill_map_ != nullptr) {
+    munmap(spill_map_, spill_map_size_);
+    spill_map_ = nullptr;
+    spill_map_size_ = 0;
+  }
+  // Map the whole file so later page-ins rarely need a remap
+  void* map = mmap(nullptr, spill_size_, PROT_READ, MAP_SHARED, spill_fd_, 0);
+  if (map == MAP_FAILED) {
+    ROS_ERROR("KeyedScanStore: Failed to map spill file");
+    return false;
+  }
+  spill_map_ = static_cast<char*>(map);
+  spill_map_size_ = spill_size_;
+  return true;
+}
+
+PointCloudConstPtr KeyedScanStore::PageIn(Entry* entry) {
+  if (!entry->b_on_disk ||
+      !MapSpillFile(entry->offset + entry->compressed_bytes)) {
+    return nullptr;
+  }
+
+  std::vector<char> raw(entry->raw_bytes);
+  uLongf raw_size = raw.size();
+  if (uncompress(reinterpret_cast<Bytef*>(raw.data()),
+                 &raw_size,
+                 reinterpret_cast<const Bytef*>(spill_map_ + entry->offset),
+                 entry->compressed_bytes) != Z_OK ||
+      raw_size != raw.size()) {
+    ROS_ERROR("KeyedScanStore: Corrupted spilled scan");
+    return nullptr;
+  }
+
+  SpillHeader header;
+  const char* ptr = raw.data();
+  std::memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+
+  PointCloud::Ptr scan(new PointCloud);
+  scan->header.stamp = header.stamp;
+  scan->header.seq = header.seq;
+  scan->header.frame_id.assign(ptr, header.frame_id_size);
+  ptr += header.frame_id_size;
+  scan->points.resize(header.num_points);
+  if (header.num_points > 0) {
+    std::memcpy(scan->points.data(), ptr, header.num_points * sizeof(Point));
+  }
+  scan->width = header.width;
+  scan->height = header.height;
+  scan->is_dense = header.is_dense != 0;
+  return scan;
+}
+
+void KeyedScanStore::CloseSpillFile() {
+  if (spill_map_ != nullptr) {
+    munmap(spill_map_, spill_map_size_);
+    spill_map_ = nullptr;
+    spill_map_size_ = 0;
+  }
+  if (spill_fd_ >= 0) {
+    close(spill_fd_);
+    spill_fd_ = -1;
+  }
+}
+
+size_t KeyedScanStore::ScanBytes(const PointCloudConstPtr& scan) {
+  return sizeof(PointCloud) + scan->points.size() * sizeof(Point);
+}
+
+} // namespace lamp_utils
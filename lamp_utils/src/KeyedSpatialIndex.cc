@@ -0,0 +1,121 @@
+#include "lamp_utils/KeyedSpatialIndex.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace lamp_utils {
+
+KeyedSpatialIndex::KeyedSpatialIndex(double cell_size)
+  : cell_size_(cell_size > 0 ? cell_size : 1.0) {}
+
+void KeyedSpatialIndex::SetCellSize(double cell_size) {
+  if (cell_size <= 0 || cell_size == cell_size_)
+    return;
+  cell_size_ = cell_size;
+  Rebucket();
+}
+
+void KeyedSpatialIndex::Rebucket() {
+  cells_.clear();
+  for (const auto& keyed_position : positions_) {
+    cells_[ToCell(keyed_position.second)].push_back(keyed_position.first);
+  }
+}
+
+KeyedSpatialIndex::Cell
+KeyedSpatialIndex::ToCell(const gtsam::Point3& position) const {
+  return Cell{static_cast<int>(std::floor(position.x() / cell_size_)),
+              static_cast<int>(std::floor(position.y() / cell_size_)),
+              static_cast<int>(std::floor(position.z() / cell_size_))};
+}
+
+void KeyedSpatialIndex::RemoveFromCell(const Cell& cell,
+                                       const gtsam::Key& key) {
+  auto cell_it = cells_.find(cell);
+  if (cell_it == cells_.end())
+    return;
+  std::vector<gtsam::Key>& keys = cell_it->second;
+  keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+  if (keys.empty())
+    cells_.erase(cell_it);
+}
+
+void KeyedSpatialIndex::Insert(const gtsam::Key& key,
+                               const gtsam::Point3& position) {
+  const Cell new_cell = ToCell(position);
+
+  auto it = positions_.find(key);
+  if (it != positions_.end()) {
+    const Cell old_cell = ToCell(it->second);
+    it->second = position;
+    if (old_cell == new_cell)
+      return;
+    RemoveFromCell(old_cell, key);
+  } else {
+    positions_.emplace(key, position);
+  }
+  cells_[new_cell].push_back(key);
+}
+
+void KeyedSpatialIndex::InsertBatch(
+    const std::vector<std::pair<gtsam::Key, gtsam::Point3>>& keyed_positions) {
+  // Moving a key costs a scan of its old cell, rebuilding costs one pass
+  if (keyed_positions.size() * 4 < positions_.size()) {
+    for (const auto& keyed_position : keyed_positions) {
+      Insert(keyed_position.first, keyed_position.second);
+    }
+    return;
+  }
+  for (const auto& keyed_position : keyed_positions) {
+    positions_[keyed_position.first] = keyed_position.second;
+  }
+  Rebucket();
+}
+
+bool KeyedSpatialIndex::Erase(const gtsam::Key& key) {
+  auto it = positions_.find(key);
+  if (it == positions_.end())
+    return false;
+  RemoveFromCell(ToCell(it->second), key);
+  positions_.erase(it);
+  return true;
+}
+
+void KeyedSpatialIndex::Clear() {
+  cells_.clear();
+  positions_.clear();
+}
+
+std::vector<gtsam::Key>
+KeyedSpatialIndex::RadiusSearch(const gtsam::Point3& position,
+                                double radius) const {
+  std::vector<gtsam::Key> keys;
+  if (radius < 0 || positions_.empty())
+    return keys;
+
+  const Cell center = ToCell(position);
+  const int span = static_cast<int>(std::ceil(radius / cell_size_));
+  const double radius_sq = radius * radius;
+
+  for (int dx = -span; dx <= span; ++dx) {
+    for (int dy = -span; dy <= span; ++dy) {
+      for (int dz = -span; dz <= span; ++dz) {
+        auto cell_it =
+            cells_.find(Cell{center.x + dx, center.y + dy, center.z + dz});
+        if (cell_it == cells_.end())
+          continue;
+        for (const gtsam::Key& key : cell_it->second) {
+          const gtsam::Point3 delta = positions_.at(key) - position;
+          if (delta.x() * delta.x() + delta.y() * delta.y() +
+                  delta.z() * delta.z() <=
+              radius_sq) {
+            keys.push_back(key);
+          }
+        }
+      }
+    }
+  }
+  return keys;
+}
+
+} // namespace lamp_utils
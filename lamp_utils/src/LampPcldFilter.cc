@@ -4,10 +4,35 @@
  * Authors: Yun Chang (yunchang@mit.edu)
  */
 
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
 #include <pcl/filters/filter.h>
 #include <pcl/filters/random_sample.h>
-#include <pcl/filters/voxel_grid.h>
 #include <lamp_utils/LampPcldFilter.h>
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudPool.h>
+
+namespace {
+
+typedef std::unordered_set<lamp_utils::VoxelIndex, lamp_utils::VoxelIndexHash>
+    VoxelSet;
+
+// Voxels of the grid with twice the leaf size
+VoxelSet Coarsen(const VoxelSet& voxels) {
+  VoxelSet coarse;
+  coarse.reserve(voxels.size() / 4 + 1);
+  for (const auto& v : voxels) {
+    // Arithmetic shift, floor division for negative indices too
+    coarse.insert(lamp_utils::VoxelIndex{v.x >> 1, v.y >> 1, v.z >> 1});
+  }
+  return coarse;
+}
+
+} // namespace
 
 LampPcldFilter::LampPcldFilter(const LampPcldFilterParams& params)
   : params_(params), processed_first_cloud_(false) {
@@ -16,6 +41,7 @@ LampPcldFilter::LampPcldFilter(const LampPcldFilterParams& params)
 
 void LampPcldFilter::Filter(const PointCloud& original_cloud,
                             PointCloud::Ptr new_cloud) {
+  b_observability_ = false;
   AdaptiveGridFilter(params_.adaptive_grid_target,
                      params_.adaptive_min_grid,
                      params_.adaptive_max_grid,
@@ -30,43 +56,117 @@ void LampPcldFilter::Filter(const PointCloud& original_cloud,
     random_filter.setSample(n_points);
     random_filter.setInputCloud(new_cloud);
     random_filter.filter(*new_cloud);
+    b_observability_ = false;
   }
 }
 
+bool LampPcldFilter::GetObservability(
+    lamp_utils::ScanObservability* observability) const {
+  if (!b_observability_) {
+    return false;
+  }
+  *observability = observability_;
+  return true;
+}
+
 void LampPcldFilter::AdaptiveGridFilter(const double& target_pt_size,
                                         const double& min_leaf_size,
                                         const double& max_leaf_size,
                                         const PointCloud& original_cloud,
                                         PointCloud::Ptr new_cloud) {
   if (original_cloud.size() < target_pt_size) {
-    *new_cloud = original_cloud;
+    if (&original_cloud != new_cloud.get())
+      *new_cloud = original_cloud;
     return;
   }
 
-  *new_cloud = original_cloud;
-  pcl::VoxelGrid<Point> grid;
-  grid.setLeafSize(grid_leaf_size_, grid_leaf_size_, grid_leaf_size_);
-  grid.setInputCloud(new_cloud);
-  grid.filter(*new_cloud);
-
-  double size_factor = static_cast<double>(new_cloud->size()) /
-      static_cast<double>(target_pt_size);
-  double obs_factor = 0.0;
-  if (params_.observability_check) {
-    Eigen::Matrix<double, 3, 1> obs_eigenv;
-    lamp_utils::ComputeIcpObservability(new_cloud, &obs_eigenv);
-    double observability =
-        obs_eigenv.minCoeff() / static_cast<double>(new_cloud->size());
-    if (!processed_first_cloud_)
-      prev_observability_ = observability;
-
-    obs_factor = (prev_observability_ - observability) / prev_observability_;
+  // Keep more points while the scans lose observability
+  double target = target_pt_size;
+  if (params_.observability_check)
+    target *= std::min(2.0, std::max(0.5, 1.0 + obs_factor_));
+
+  grid_leaf_size_ =
+      SelectLeafSize(original_cloud, target, min_leaf_size, max_leaf_size);
+  if (&original_cloud == new_cloud.get()) {
+    // Filtered in place, into a recycled cloud which then takes the storage
+    // of the original points back to the pool
+    PointCloud::Ptr filtered = lamp_utils::PointCloudPool::Instance().Acquire();
+    lamp_utils::VoxelDownsample(original_cloud, grid_leaf_size_, filtered.get());
+    new_cloud->swap(*filtered);
+  } else {
+    lamp_utils::VoxelDownsample(
+        original_cloud, grid_leaf_size_, new_cloud.get());
+  }
+
+  if (!params_.observability_check || new_cloud->empty())
+    return;
+
+  // ComputeIcpObservability and ICP extract the stored normals
+  lamp_utils::EnsureNormals(new_cloud);
+  Eigen::Matrix<double, 3, 1> obs_eigenv;
+  lamp_utils::ComputeIcpObservability(new_cloud, &obs_eigenv);
+  double observability =
+      obs_eigenv.minCoeff() / static_cast<double>(new_cloud->size());
+  observability_.eigenvalues = obs_eigenv;
+  observability_.num_points = new_cloud->size();
+  b_observability_ = true;
+  if (!processed_first_cloud_) {
     prev_observability_ = observability;
+    processed_first_cloud_ = true;
   }
 
-  grid_leaf_size_ =
-      std::min(max_leaf_size,
-               std::max(min_leaf_size,
-                        grid_leaf_size_ *
-                            (size_factor - abs(size_factor - 1) * obs_factor)));
-}
\ No newline at end of file
+  obs_factor_ = prev_observability_ > 0
+      ? (prev_observability_ - observability) / prev_observability_
+      : 0.0;
+  prev_observability_ = observability;
+}
+
+double LampPcldFilter::SelectLeafSize(const PointCloud& cloud,
+                                      const double& target_pt_size,
+                                      const double& min_leaf_size,
+                                      const double& max_leaf_size) const {
+  // Two doubling ladders offset by sqrt(2), only the finest grid of each is
+  // built from the points, the coarser ones from its voxels
+  const double bases[2] = {min_leaf_size, min_leaf_size * std::sqrt(2.0)};
+  VoxelSet voxels[2];
+  for (auto& v : voxels)
+    v.reserve(cloud.size());
+  for (const Point& p : cloud.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    for (size_t b = 0; b < 2; b++)
+      voxels[b].insert(lamp_utils::ToVoxelIndex(p, 1.0 / bases[b]));
+  }
+
+  // (leaf size, occupied voxels)
+  std::vector<std::pair<double, double>> histogram;
+  for (size_t b = 0; b < 2; b++) {
+    for (double leaf = bases[b]; leaf <= max_leaf_size * (1 + 1e-6);
+         leaf *= 2) {
+      histogram.emplace_back(leaf, voxels[b].size());
+      voxels[b] = Coarsen(voxels[b]);
+    }
+  }
+  if (histogram.empty())
+    return min_leaf_size;
+  std::sort(histogram.begin(), histogram.end());
+
+  // First level at or below the target, the count falls with the leaf size
+  size_t i = 0;
+  while (i < histogram.size() && histogram[i].second > target_pt_size)
+    i++;
+  if (i == 0)
+    return histogram.front().first;
+  if (i == histogram.size())
+    return max_leaf_size;
+
+  // Count ~ leaf^-d in between, interpolate in log space
+  const double leaf_0 = histogram[i - 1].first, n_0 = histogram[i - 1].second;
+  const double leaf_1 = histogram[i].first, n_1 = histogram[i].second;
+  double leaf = leaf_1;
+  if (n_0 > n_1 && n_1 > 0) {
+    const double alpha = std::log(n_0 / target_pt_size) / std::log(n_0 / n_1);
+    leaf = leaf_0 * std::pow(leaf_1 / leaf_0, alpha);
+  }
+  return std::min(max_leaf_size, std::max(min_leaf_size, leaf));
+}
@@ -0,0 +1,197 @@
+/*
+MemoryAccounting.cc
+Live bytes and high-water marks of the stores of a process, by subsystem
+*/
+
+#include "lamp_utils/MemoryAccounting.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace lamp_utils {
+
+MemoryAccount::MemoryAccount(const std::string& name,
+                             const Sampler& sampler,
+                             const PressureCallback& pressure_callback)
+  : name_(name), sampler_(sampler), pressure_callback_(pressure_callback) {
+  Register();
+}
+
+MemoryAccount::MemoryAccount(const MemoryAccount& other)
+  : name_(other.name_) {
+  Register();
+}
+
+MemoryAccount& MemoryAccount::operator=(const MemoryAccount&) {
+  return *this;
+}
+
+MemoryAccount::~MemoryAccount() {
+  MemoryAccountant::Instance().Unregister(this);
+}
+
+void MemoryAccount::Register() {
+  MemoryAccountant::Instance().Register(this);
+}
+
+void MemoryAccount::Set(size_t bytes) {
+  MemoryAccountant::Instance().Set(this, bytes);
+}
+
+size_t MemoryAccount::Bytes() const {
+  return MemoryAccountant::Instance().Bytes(this);
+}
+
+MemoryAccountant& MemoryAccountant::Instance() {
+  // Never destroyed, static stores unregister during static destruction
+  static MemoryAccountant* accountant = new MemoryAccountant();
+  return *accountant;
+}
+
+MemoryAccountant::MemoryAccountant() {}
+
+bool MemoryAccountant::LoadParameters(const ros::NodeHandle& n) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (b_loaded_)
+      return true;
+    b_loaded_ = true;
+  }
+  double budget_mb = 0.0;
+  n.param<double>("memory/budget_mb", budget_mb, 0.0);
+  SetBudget(static_cast<size_t>(std::max(budget_mb, 0.0) * 1024 * 1024));
+  return true;
+}
+
+void MemoryAccountant::SetBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ = bytes;
+}
+
+size_t MemoryAccountant::Budget() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return budget_;
+}
+
+void MemoryAccountant::Register(MemoryAccount* account) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  subsystems_[account->name_].accounts.insert(account);
+}
+
+void MemoryAccountant::Unregister(MemoryAccount* account) {
+  std::lock_guard<std::mutex> update_lock(update_mutex_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Subsystem& subsystem = subsystems_[account->name_];
+  subsystem.accounts.erase(account);
+  subsystem.bytes -= account->bytes_;
+  total_bytes_ -= account->bytes_;
+}
+
+void MemoryAccountant::Set(MemoryAccount* account, size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Subsystem& subsystem = subsystems_[account->name_];
+  subsystem.bytes = subsystem.bytes - account->bytes_ + bytes;
+  total_bytes_ = total_bytes_ - account->bytes_ + bytes;
+  account->bytes_ = bytes;
+  subsystem.peak = std::max(subsystem.peak, subsystem.bytes);
+  total_peak_ = std::max(total_peak_, total_bytes_);
+}
+
+size_t MemoryAccountant::Bytes(const MemoryAccount* account) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return account->bytes_;
+}
+
+void MemoryAccountant::Update() {
+  static Counter& pressure_events =
+      MetricsRegistry::Instance().GetCounter("memory.pressure_events");
+  static Counter& released_bytes =
+      MetricsRegistry::Instance().GetCounter("memory.released_bytes");
+
+  std::lock_guard<std::mutex> update_lock(update_mutex_);
+  // Sampled and relieved outside mutex_, the stores set their own bytes
+  // under their locks
+  std::vector<MemoryAccount*> accounts;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& subsystem : subsystems_) {
+      accounts.insert(accounts.end(),
+                      subsystem.second.accounts.begin(),
+                      subsystem.second.accounts.end());
+    }
+  }
+  for (MemoryAccount* account : accounts) {
+    if (account->sampler_)
+      Set(account, account->sampler_());
+  }
+
+  size_t excess = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (budget_ > 0 && total_bytes_ > budget_)
+      excess = total_bytes_ - budget_;
+  }
+  if (excess > 0) {
+    std::vector<std::pair<size_t, MemoryAccount*>> relievable;
+    for (MemoryAccount* account : accounts) {
+      if (account->pressure_callback_)
+        relievable.emplace_back(Bytes(account), account);
+    }
+    std::sort(relievable.begin(),
+              relievable.end(),
+              [](const std::pair<size_t, MemoryAccount*>& a,
+                 const std::pair<size_t, MemoryAccount*>& b) {
+                return a.first > b.first;
+              });
+    pressure_events.Increment();
+    ROS_WARN("Memory: %lu MB over the budget of %lu MB",
+             excess >> 20,
+             Budget() >> 20);
+    for (const auto& entry : relievable) {
+      MemoryAccount* account = entry.second;
+      const size_t freed = account->pressure_callback_(excess);
+      released_bytes.Increment(static_cast<int64_t>(freed));
+      if (account->sampler_)
+        Set(account, account->sampler_());
+      if (freed >= excess)
+        break;
+      excess -= freed;
+    }
+  }
+
+  MetricsRegistry& metrics = MetricsRegistry::Instance();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& subsystem : subsystems_) {
+    const std::string prefix = "memory." + subsystem.first;
+    metrics.GetGauge(prefix + ".bytes").Set(subsystem.second.bytes);
+    metrics.GetGauge(prefix + ".peak").Set(subsystem.second.peak);
+  }
+  metrics.GetGauge("memory.total.bytes").Set(total_bytes_);
+  metrics.GetGauge("memory.total.peak").Set(total_peak_);
+  metrics.GetGauge("memory.budget").Set(budget_);
+}
+
+size_t MemoryAccountant::Bytes(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = subsystems_.find(name);
+  return it != subsystems_.end() ? it->second.bytes : 0;
+}
+
+size_t MemoryAccountant::Peak(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = subsystems_.find(name);
+  return it != subsystems_.end() ? it->second.peak : 0;
+}
+
+size_t MemoryAccountant::TotalBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return total_bytes_;
+}
+
+size_t MemoryAccountant::TotalPeak() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return total_peak_;
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,205 @@
+/*
+Metrics.cc
+Process-wide counters, gauges and histograms published as diagnostics
+*/
+
+#include "lamp_utils/Metrics.h"
+
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <sstream>
+
+#include "lamp_utils/MemoryAccounting.h"
+#include "lamp_utils/ThreadGovernor.h"
+
+namespace lamp_utils {
+
+namespace {
+
+// Only one MetricsPublisher per process publishes
+std::atomic<bool> b_publisher_started{false};
+
+size_t ShardIndex() {
+  static std::atomic<size_t> next_thread{0};
+  thread_local const size_t index =
+      next_thread.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return index;
+}
+
+void AtomicAdd(std::atomic<double>* target, double value) {
+  double current = target->load(std::memory_order_relaxed);
+  while (!target->compare_exchange_weak(
+      current, current + value, std::memory_order_relaxed)) {
+  }
+}
+
+} // namespace
+
+void Counter::Increment(int64_t n) {
+  shards_[ShardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+int64_t Counter::Value() const {
+  int64_t value = 0;
+  for (const auto& shard : shards_) {
+    value += shard.value.load(std::memory_order_relaxed);
+  }
+  return value;
+}
+
+Histogram::Histogram(const std::vector<double>& bounds) : bounds_(bounds) {
+  for (auto& shard : shards_) {
+    shard.counts.reset(new std::atomic<uint64_t>[bounds_.size() + 1]);
+    for (size_t i = 0; i <= bounds_.size(); i++) {
+      shard.counts[i].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+void Histogram::Observe(double value) {
+  // Few buckets, a linear scan beats a binary search
+  size_t bucket = 0;
+  while (bucket < bounds_.size() && value > bounds_[bucket]) {
+    bucket++;
+  }
+  Shard& shard = shards_[ShardIndex()];
+  shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  AtomicAdd(&shard.sum, value);
+}
+
+Histogram::Summary Histogram::Summarize() const {
+  std::vector<uint64_t> counts(bounds_.size() + 1, 0);
+  Summary summary;
+  for (const auto& shard : shards_) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+    }
+    summary.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  for (const auto count : counts) {
+    summary.count += count;
+  }
+  if (summary.count == 0 || bounds_.empty())
+    return summary;
+
+  auto quantile = [&](double q) {
+    const uint64_t rank = static_cast<uint64_t>(q * summary.count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bounds_.size(); i++) {
+      seen += counts[i];
+      if (seen > rank)
+        return bounds_[i];
+    }
+    return bounds_.back();
+  };
+  summary.p50 = quantile(0.5);
+  summary.p99 = quantile(0.99);
+  return summary;
+}
+
+std::vector<double> LatencyBucketsMs() {
+  return {0.1, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+}
+
+MetricsRegistry& MetricsRegistry::Instance() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+Counter& MetricsRegistry::GetCounter(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& counter = counters_[name];
+  if (!counter)
+    counter.reset(new Counter());
+  return *counter;
+}
+
+Gauge& MetricsRegistry::GetGauge(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& gauge = gauges_[name];
+  if (!gauge)
+    gauge.reset(new Gauge());
+  return *gauge;
+}
+
+Histogram& MetricsRegistry::GetHistogram(const std::string& name,
+                                         const std::vector<double>& bounds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& histogram = histograms_[name];
+  if (!histogram)
+    histogram.reset(new Histogram(bounds));
+  return *histogram;
+}
+
+std::vector<std::pair<std::string, double>> MetricsRegistry::Snapshot() const {
+  std::map<std::string, double> values;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& counter : counters_) {
+    values[counter.first] = counter.second->Value();
+  }
+  for (const auto& gauge : gauges_) {
+    values[gauge.first] = gauge.second->Value();
+  }
+  for (const auto& histogram : histograms_) {
+    const Histogram::Summary summary = histogram.second->Summarize();
+    values[histogram.first + ".count"] = summary.count;
+    values[histogram.first + ".mean"] =
+        summary.count > 0 ? summary.sum / summary.count : 0.0;
+    values[histogram.first + ".p50"] = summary.p50;
+    values[histogram.first + ".p99"] = summary.p99;
+  }
+  return std::vector<std::pair<std::string, double>>(values.begin(),
+                                                     values.end());
+}
+
+void MetricsRegistry::ToDiagnostic(
+    const std::string& name, diagnostic_msgs::DiagnosticStatus* status) const {
+  status->level = diagnostic_msgs::DiagnosticStatus::OK;
+  status->name = name;
+  status->values.clear();
+  for (const auto& metric : Snapshot()) {
+    diagnostic_msgs::KeyValue key_value;
+    key_value.key = metric.first;
+    std::ostringstream value;
+    value << metric.second;
+    key_value.value = value.str();
+    status->values.push_back(key_value);
+  }
+}
+
+MetricsPublisher::~MetricsPublisher() {
+  Stop();
+}
+
+void MetricsPublisher::Start(const ros::NodeHandle& n, double rate) {
+  if (b_publisher_started.exchange(true))
+    return;
+  b_started_ = true;
+  name_ = ros::this_node::getName();
+  ros::NodeHandle nl(n);
+  pub_ = nl.advertise<diagnostic_msgs::DiagnosticArray>("/lamp/metrics", 10);
+  timer_ = nl.createTimer(
+      ros::Duration(1.0 / rate), &MetricsPublisher::TimerCallback, this);
+}
+
+void MetricsPublisher::Stop() {
+  if (!b_started_)
+    return;
+  timer_.stop();
+  b_started_ = false;
+  b_publisher_started.store(false);
+}
+
+void MetricsPublisher::TimerCallback(const ros::TimerEvent& ev) {
+  // Relieves memory pressure whether or not anyone listens
+  MemoryAccountant::Instance().Update();
+  if (pub_.getNumSubscribers() == 0)
+    return;
+  ThreadGovernor::Instance().UpdateUsage();
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+  msg.status.resize(1);
+  MetricsRegistry::Instance().ToDiagnostic(name_, &msg.status[0]);
+  pub_.publish(msg);
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,98 @@
+/*
+NoiseModelCache.cc
+Process-wide interning of the Gaussian noise models of graph messages
+*/
+
+#include "lamp_utils/NoiseModelCache.h"
+
+#include <algorithm>
+#include <functional>
+
+#include <Eigen/Core>
+
+namespace lamp_utils {
+
+size_t NoiseModelCache::CovarianceHash::operator()(const Covariance& c) const {
+  size_t seed = 0;
+  std::hash<double> hash;
+  for (double v : c)
+    seed ^= hash(v) + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+  return seed;
+}
+
+NoiseModelCache& NoiseModelCache::Instance() {
+  static NoiseModelCache cache;
+  return cache;
+}
+
+gtsam::noiseModel::Gaussian::shared_ptr
+NoiseModelCache::Get(const double* covariance) {
+  Covariance key;
+  std::copy(covariance, covariance + key.size(), key.begin());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = models_.find(key);
+    if (it != models_.end()) {
+      num_hits_++;
+      return it->second;
+    }
+  }
+
+  // Factorized outside the lock, a racing thread may create the same model
+  const gtsam::noiseModel::Gaussian::shared_ptr model =
+      gtsam::noiseModel::Gaussian::Covariance(
+          Eigen::Map<const Eigen::Matrix<double, 6, 6, Eigen::RowMajor>>(
+              covariance));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (models_.size() >= capacity_)
+    models_.clear();
+  return models_.emplace(key, model).first->second;
+}
+
+gtsam::SharedNoiseModel
+NoiseModelCache::Intern(const gtsam::SharedNoiseModel& model) {
+  const auto gaussian =
+      boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(model);
+  if (!gaussian || gaussian->dim() != 6)
+    return model;
+  Covariance key;
+  Eigen::Map<Eigen::Matrix<double, 6, 6, Eigen::RowMajor>>(key.data()) =
+      gaussian->covariance();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = models_.find(key);
+  if (it != models_.end()) {
+    num_hits_++;
+    return it->second;
+  }
+  if (models_.size() >= capacity_)
+    models_.clear();
+  models_.emplace(key, gaussian);
+  return model;
+}
+
+void NoiseModelCache::SetCapacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = std::max<size_t>(capacity, 1);
+  if (models_.size() > capacity_)
+    models_.clear();
+}
+
+size_t NoiseModelCache::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return models_.size();
+}
+
+void NoiseModelCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  models_.clear();
+  num_hits_ = 0;
+}
+
+size_t NoiseModelCache::GetNumHits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_hits_;
+}
+
+} // namespace lamp_utils
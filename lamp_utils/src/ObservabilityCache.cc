@@ -0,0 +1,179 @@
+/*
+ObservabilityCache.cc
+Process-wide cache of the ICP observability of keyed scans
+*/
+
+#include "lamp_utils/ObservabilityCache.h"
+
+#include <algorithm>
+
+#include "lamp_utils/PointCloudUtils.h"
+#include "lamp_utils/ThreadGovernor.h"
+
+namespace lamp_utils {
+
+namespace {
+
+ScanObservability ComputeObservability(const PointCloudConstPtr& scan) {
+  ScanObservability observability;
+  observability.num_points = scan->size();
+  ComputeIcpObservability(scan, &observability.eigenvalues);
+  return observability;
+}
+
+} // namespace
+
+ObservabilityCache& ObservabilityCache::Instance() {
+  static ObservabilityCache cache;
+  return cache;
+}
+
+ObservabilityCache::~ObservabilityCache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    b_shutdown_ = true;
+  }
+  queue_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ObservabilityCache::SetNumThreads(size_t num_threads) {
+  num_threads =
+      ThreadGovernor::Instance().Threads("observability", num_threads);
+  std::lock_guard<std::mutex> lock(mutex_);
+  num_threads_ = std::max(num_threads_, num_threads);
+}
+
+void ObservabilityCache::Request(const gtsam::Key& key,
+                                 const PointCloudConstPtr& scan) {
+  if (!scan) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cache_.count(key) || !queued_.insert(key).second) {
+      return;
+    }
+    queue_.emplace_back(key, scan);
+    // Workers are started on demand
+    while (workers_.size() < num_threads_) {
+      workers_.emplace_back(&ObservabilityCache::WorkerLoop, this);
+    }
+  }
+  queue_cv_.notify_one();
+}
+
+void ObservabilityCache::WorkerLoop() {
+  ThreadGovernor::Instance().RegisterThread("observability");
+  while (true) {
+    std::pair<gtsam::Key, PointCloudConstPtr> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_cv_.wait(lock, [this] { return b_shutdown_ || !queue_.empty(); });
+      if (b_shutdown_) {
+        return;
+      }
+      job = queue_.front();
+      queue_.pop_front();
+    }
+
+    const ScanObservability observability = ComputeObservability(job.second);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Dropped if the key was erased meanwhile
+      if (!queued_.erase(job.first)) {
+        continue;
+      }
+      cache_.emplace(job.first, observability);
+    }
+    NotifyListeners(job.first);
+  }
+}
+
+size_t ObservabilityCache::AddListener(const Listener& listener) {
+  std::lock_guard<std::mutex> lock(listeners_mutex_);
+  listeners_.emplace(next_listener_id_, listener);
+  return next_listener_id_++;
+}
+
+void ObservabilityCache::RemoveListener(size_t id) {
+  std::lock_guard<std::mutex> lock(listeners_mutex_);
+  listeners_.erase(id);
+}
+
+void ObservabilityCache::NotifyListeners(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(listeners_mutex_);
+  for (const auto& listener : listeners_) {
+    listener.second(key);
+  }
+}
+
+ScanObservability
+ObservabilityCache::GetOrCompute(const gtsam::Key& key,
+                                 const PointCloudConstPtr& scan) {
+  ScanObservability observability;
+  if (Get(key, &observability)) {
+    return observability;
+  }
+  // Compute outside the lock so other consumers are not blocked
+  observability = ComputeObservability(scan);
+  Insert(key, observability);
+  return observability;
+}
+
+void ObservabilityCache::Insert(const gtsam::Key& key,
+                                const ScanObservability& observability) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!cache_.emplace(key, observability).second) {
+      return;
+    }
+  }
+  NotifyListeners(key);
+}
+
+bool ObservabilityCache::Get(const gtsam::Key& key,
+                             ScanObservability* observability) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = cache_.find(key);
+  if (it == cache_.end()) {
+    return false;
+  }
+  *observability = it->second;
+  return true;
+}
+
+bool ObservabilityCache::Has(const gtsam::Key& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cache_.count(key) > 0;
+}
+
+void ObservabilityCache::Erase(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cache_.erase(key);
+  queued_.erase(key);
+  queue_.erase(std::remove_if(queue_.begin(),
+                              queue_.end(),
+                              [&key](const std::pair<gtsam::Key,
+                                                     PointCloudConstPtr>& job) {
+                                return job.first == key;
+                              }),
+               queue_.end());
+}
+
+void ObservabilityCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cache_.clear();
+  queue_.clear();
+  queued_.clear();
+}
+
+size_t ObservabilityCache::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cache_.size();
+}
+
+} // namespace lamp_utils
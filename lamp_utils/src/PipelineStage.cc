@@ -0,0 +1,149 @@
+/*
+PipelineStage.cc
+Worker thread fed through a bounded task queue
+*/
+
+#include "lamp_utils/PipelineStage.h"
+
+#include <algorithm>
+
+#include "lamp_utils/ThreadGovernor.h"
+
+namespace lamp_utils {
+
+PipelineStage::PipelineStage(const std::string& name, size_t capacity)
+  : name_(name),
+    capacity_(std::max<size_t>(capacity, 1)),
+    queue_depth_(MetricsRegistry::Instance().GetGauge(name + ".queue")),
+    task_ms_(MetricsRegistry::Instance().GetHistogram(name + ".task_ms")),
+    blocked_(MetricsRegistry::Instance().GetCounter(name + ".blocked")) {}
+
+PipelineStage::~PipelineStage() {
+  Stop();
+}
+
+void PipelineStage::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (b_running_)
+    return;
+  b_running_ = true;
+  b_stop_ = false;
+  worker_ = std::thread(&PipelineStage::WorkerLoop, this);
+}
+
+void PipelineStage::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!b_running_)
+      return;
+    b_stop_ = true;
+  }
+  not_empty_.notify_all();
+  worker_.join();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  b_running_ = false;
+  // Producers blocked on the full queue run their task inline now
+  not_full_.notify_all();
+  idle_.notify_all();
+}
+
+bool PipelineStage::IsRunning() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return b_running_;
+}
+
+void PipelineStage::SetCapacity(size_t capacity) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = std::max<size_t>(capacity, 1);
+  }
+  not_full_.notify_all();
+}
+
+size_t PipelineStage::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tasks_.size();
+}
+
+void PipelineStage::Push(Task task) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (b_running_ && !b_stop_ && tasks_.size() >= capacity_) {
+      blocked_.Increment();
+      not_full_.wait(lock, [this] {
+        return !b_running_ || b_stop_ || tasks_.size() < capacity_;
+      });
+    }
+    if (b_running_ && !b_stop_) {
+      tasks_.push_back(std::move(task));
+      queue_depth_.Set(tasks_.size());
+      lock.unlock();
+      not_empty_.notify_one();
+      return;
+    }
+  }
+  // Not threaded
+  ScopedLatency latency(task_ms_);
+  task();
+}
+
+bool PipelineStage::TryPush(Task task) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (b_running_ && !b_stop_) {
+      if (tasks_.size() >= capacity_) {
+        return false;
+      }
+      tasks_.push_back(std::move(task));
+      queue_depth_.Set(tasks_.size());
+      lock.unlock();
+      not_empty_.notify_one();
+      return true;
+    }
+  }
+  ScopedLatency latency(task_ms_);
+  task();
+  return true;
+}
+
+void PipelineStage::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] {
+    return !b_running_ || (tasks_.empty() && !b_busy_);
+  });
+}
+
+void PipelineStage::WorkerLoop() {
+  ThreadGovernor::Instance().RegisterThread(name_);
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [this] { return b_stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        // Stopping with nothing left to run
+        idle_.notify_all();
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+      queue_depth_.Set(tasks_.size());
+      b_busy_ = true;
+    }
+    not_full_.notify_one();
+
+    {
+      ScopedLatency latency(task_ms_);
+      task();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    b_busy_ = false;
+    if (tasks_.empty()) {
+      idle_.notify_all();
+    }
+  }
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,177 @@
+/*
+PointCloudConversions.cc
+Direct conversions between PointCloud2 messages and PCL clouds
+*/
+
+#include "lamp_utils/PointCloudConversions.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <pcl/common/io.h>
+#include <pcl/conversions.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+namespace lamp_utils {
+
+namespace {
+
+// Bytes copied from each message point into each cloud point
+struct FieldCopy {
+  uint32_t src;
+  uint32_t dst;
+  uint32_t size;
+};
+
+template <typename PointT>
+const std::vector<pcl::PCLPointField>& PointFields() {
+  static const std::vector<pcl::PCLPointField> fields = [] {
+    std::vector<pcl::PCLPointField> f;
+    pcl::for_each_type<typename pcl::traits::fieldList<PointT>::type>(
+        pcl::detail::FieldAdder<PointT>(f));
+    return f;
+  }();
+  return fields;
+}
+
+inline bool IsLittleEndian() {
+  const uint16_t one = 1;
+  return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+
+// Copies filling the fields of PointT from a message point, false if a
+// field can not be copied byte for byte. b_same_layout when the message
+// points are laid out as PointT.
+template <typename PointT>
+bool PlanCopies(const sensor_msgs::PointCloud2& msg,
+                std::vector<FieldCopy>* copies,
+                bool* b_same_layout) {
+  if (msg.is_bigendian == IsLittleEndian()) {
+    return false;
+  }
+  *b_same_layout = msg.point_step == sizeof(PointT);
+  for (const pcl::PCLPointField& field : PointFields<PointT>()) {
+    const sensor_msgs::PointField* match = nullptr;
+    for (const sensor_msgs::PointField& f : msg.fields) {
+      if (f.name == field.name) {
+        match = &f;
+        break;
+      }
+    }
+    if (match == nullptr) {
+      // Left at its default
+      *b_same_layout = false;
+      continue;
+    }
+    if (match->datatype != field.datatype || match->count != field.count) {
+      return false;
+    }
+    const uint32_t size = pcl::getFieldSize(field.datatype) * field.count;
+    if (match->offset + size > msg.point_step) {
+      return false;
+    }
+    *b_same_layout = *b_same_layout && match->offset == field.offset;
+
+    // Merge with the previous copy when both sides continue it
+    if (!copies->empty() && copies->back().src + copies->back().size ==
+            match->offset &&
+        copies->back().dst + copies->back().size == field.offset) {
+      copies->back().size += size;
+    } else {
+      copies->push_back(FieldCopy{match->offset, field.offset, size});
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+template <typename PointT>
+void FromRosMsg(const sensor_msgs::PointCloud2& msg,
+                pcl::PointCloud<PointT>* cloud) {
+  std::vector<FieldCopy> copies;
+  bool b_same_layout = false;
+  if (!PlanCopies<PointT>(msg, &copies, &b_same_layout) ||
+      msg.row_step < msg.width * msg.point_step ||
+      msg.data.size() < static_cast<size_t>(msg.row_step) * msg.height) {
+    pcl::fromROSMsg(msg, *cloud);
+    return;
+  }
+
+  pcl_conversions::toPCL(msg.header, cloud->header);
+  cloud->width = msg.width;
+  cloud->height = msg.height;
+  cloud->is_dense = msg.is_dense == 1;
+  cloud->sensor_origin_.setZero();
+  cloud->sensor_orientation_.setIdentity();
+
+  const size_t n = static_cast<size_t>(msg.width) * msg.height;
+  if (n == 0) {
+    cloud->points.clear();
+    return;
+  }
+
+  const bool b_packed_rows = msg.row_step == msg.width * msg.point_step;
+  if (b_same_layout && b_packed_rows) {
+    cloud->points.resize(n);
+    std::memcpy(cloud->points.data(), msg.data.data(), n * sizeof(PointT));
+    return;
+  }
+
+  // Fields the message does not have keep the PointT defaults
+  cloud->points.assign(n, PointT());
+  uint8_t* dst = reinterpret_cast<uint8_t*>(cloud->points.data());
+  for (uint32_t row = 0; row < msg.height; row++) {
+    const uint8_t* src = msg.data.data() + row * msg.row_step;
+    for (uint32_t col = 0; col < msg.width; col++) {
+      for (const FieldCopy& copy : copies) {
+        std::memcpy(dst + copy.dst, src + copy.src, copy.size);
+      }
+      src += msg.point_step;
+      dst += sizeof(PointT);
+    }
+  }
+}
+
+template <typename PointT>
+void ToRosMsg(const pcl::PointCloud<PointT>& cloud,
+              sensor_msgs::PointCloud2* msg) {
+  pcl_conversions::fromPCL(cloud.header, msg->header);
+  if (cloud.width == 0 && cloud.height == 0) {
+    msg->width = cloud.size();
+    msg->height = 1;
+  } else {
+    msg->width = cloud.width;
+    msg->height = cloud.height;
+  }
+
+  const std::vector<pcl::PCLPointField>& fields = PointFields<PointT>();
+  msg->fields.resize(fields.size());
+  for (size_t i = 0; i < fields.size(); i++) {
+    msg->fields[i].name = fields[i].name;
+    msg->fields[i].offset = fields[i].offset;
+    msg->fields[i].datatype = fields[i].datatype;
+    msg->fields[i].count = fields[i].count;
+  }
+
+  msg->is_bigendian = !IsLittleEndian();
+  msg->point_step = sizeof(PointT);
+  msg->row_step = sizeof(PointT) * msg->width;
+  msg->is_dense = cloud.is_dense;
+  msg->data.resize(cloud.size() * sizeof(PointT));
+  if (!cloud.empty()) {
+    std::memcpy(msg->data.data(), cloud.points.data(), msg->data.size());
+  }
+}
+
+template void FromRosMsg<Point>(const sensor_msgs::PointCloud2& msg,
+                                pcl::PointCloud<Point>* cloud);
+template void FromRosMsg<PointXyzi>(const sensor_msgs::PointCloud2& msg,
+                                    pcl::PointCloud<PointXyzi>* cloud);
+template void ToRosMsg<Point>(const pcl::PointCloud<Point>& cloud,
+                              sensor_msgs::PointCloud2* msg);
+template void ToRosMsg<PointXyzi>(const pcl::PointCloud<PointXyzi>& cloud,
+                                  sensor_msgs::PointCloud2* msg);
+
+} // namespace lamp_utils
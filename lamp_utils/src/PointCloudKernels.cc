@@ -0,0 +1,168 @@
+/*
+PointCloudKernels.cc
+Transform and voxel downsampling kernels for the LAMP point clouds
+*/
+
+#include "lamp_utils/PointCloudKernels.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <Eigen/StdVector>
+
+namespace lamp_utils {
+
+namespace {
+
+// Floats per point, x y z are the first three
+const int kStride = sizeof(Point) / sizeof(float);
+// Points transformed per block, keeps the double precision scratch in cache
+const size_t kBlock = 256;
+
+typedef Eigen::Map<Eigen::Matrix<float, 3, Eigen::Dynamic>,
+                   Eigen::Unaligned,
+                   Eigen::OuterStride<kStride>>
+    PositionsMap;
+typedef Eigen::Matrix<double, kStride, 1> PointSum;
+
+} // namespace
+
+void TransformPoints(const Point* in,
+                     size_t n,
+                     const Eigen::Matrix4d& transform,
+                     Point* out) {
+  if (in != out) {
+    std::copy(in, in + n, out);
+  }
+  const Eigen::Matrix3d rotation = transform.topLeftCorner<3, 3>();
+  const Eigen::Vector3d translation = transform.topRightCorner<3, 1>();
+
+  Eigen::Matrix<double, 3, Eigen::Dynamic> block(3, kBlock);
+  for (size_t start = 0; start < n; start += kBlock) {
+    const size_t count = std::min(kBlock, n - start);
+    PositionsMap positions(reinterpret_cast<float*>(out + start), 3, count);
+    block.leftCols(count).noalias() = rotation * positions.cast<double>();
+    block.leftCols(count).colwise() += translation;
+    positions = block.leftCols(count).cast<float>();
+  }
+}
+
+void TransformPointCloud(const PointCloud& in,
+                         const Eigen::Matrix4d& transform,
+                         PointCloud* out) {
+  if (&in != out) {
+    out->header = in.header;
+    out->points.resize(in.size());
+    out->width = in.width;
+    out->height = in.height;
+    out->is_dense = in.is_dense;
+    out->sensor_origin_ = in.sensor_origin_;
+    out->sensor_orientation_ = in.sensor_orientation_;
+  }
+  TransformPoints(in.points.data(), in.size(), transform, out->points.data());
+}
+
+void TransformAndAppend(const PointCloud& in,
+                        const Eigen::Matrix4d& transform,
+                        PointCloud* out) {
+  const size_t offset = out->size();
+  out->points.resize(offset + in.size());
+  TransformPoints(
+      in.points.data(), in.size(), transform, out->points.data() + offset);
+  out->width = out->size();
+  out->height = 1;
+  out->is_dense = out->is_dense && in.is_dense;
+}
+
+void VoxelDownsample(const PointCloud& in, double leaf_size, PointCloud* out) {
+  const double inverse_leaf = 1.0 / leaf_size;
+
+  std::unordered_map<VoxelIndex, size_t, VoxelIndexHash> voxels;
+  voxels.reserve(in.size());
+  std::vector<PointSum, Eigen::aligned_allocator<PointSum>> sums;
+  std::vector<int> counts;
+  for (const Point& p : in.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {
+      continue;
+    }
+    auto voxel = voxels.emplace(ToVoxelIndex(p, inverse_leaf), sums.size());
+    if (voxel.second) {
+      sums.push_back(PointSum::Zero());
+      counts.push_back(0);
+    }
+    const size_t i = voxel.first->second;
+    sums[i] += Eigen::Map<const Eigen::Matrix<float, kStride, 1>>(
+                   reinterpret_cast<const float*>(&p))
+                   .cast<double>();
+    counts[i]++;
+  }
+
+  // Written straight into out, keeping its point storage, unless in is out
+  PointCloud result;
+  PointCloud* target = &in == out ? &result : out;
+  target->header = in.header;
+  target->points.resize(sums.size());
+  for (size_t i = 0; i < sums.size(); i++) {
+    Eigen::Map<Eigen::Matrix<float, kStride, 1>>(
+        reinterpret_cast<float*>(&target->points[i])) =
+        (sums[i] / counts[i]).cast<float>();
+  }
+  target->width = target->size();
+  target->height = 1;
+  target->is_dense = true;
+  target->sensor_origin_.setZero();
+  target->sensor_orientation_.setIdentity();
+  if (target != out)
+    out->swap(result);
+}
+
+void SplitIntoLayers(const PointCloud& in,
+                     double base_leaf,
+                     int num_layers,
+                     std::vector<PointCloud>* layers) {
+  num_layers = std::max(num_layers, 1);
+  layers->assign(num_layers, PointCloud());
+
+  std::vector<bool> taken(in.size(), false);
+  double leaf = base_leaf;
+  for (int l = 0; l + 1 < num_layers; l++, leaf /= 2) {
+    const double inverse_leaf = 1.0 / leaf;
+    std::unordered_set<VoxelIndex, VoxelIndexHash> occupied;
+    occupied.reserve(in.size());
+    // Voxels already represented by a coarser layer are not refined again
+    for (size_t i = 0; i < in.size(); i++) {
+      if (taken[i]) {
+        occupied.insert(ToVoxelIndex(in.points[i], inverse_leaf));
+      }
+    }
+    PointCloud& layer = (*layers)[l];
+    for (size_t i = 0; i < in.size(); i++) {
+      const Point& p = in.points[i];
+      if (taken[i] || !std::isfinite(p.x) || !std::isfinite(p.y) ||
+          !std::isfinite(p.z)) {
+        continue;
+      }
+      if (occupied.insert(ToVoxelIndex(p, inverse_leaf)).second) {
+        layer.points.push_back(p);
+        taken[i] = true;
+      }
+    }
+  }
+  PointCloud& rest = layers->back();
+  for (size_t i = 0; i < in.size(); i++) {
+    if (!taken[i]) {
+      rest.points.push_back(in.points[i]);
+    }
+  }
+
+  for (PointCloud& layer : *layers) {
+    layer.header = in.header;
+    layer.width = layer.size();
+    layer.height = 1;
+    layer.is_dense = in.is_dense;
+  }
+}
+
+} // namespace lamp_utils
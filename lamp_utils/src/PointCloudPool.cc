@@ -0,0 +1,139 @@
+/*
+PointCloudPool.cc
+Process-wide pool of recycled point clouds
+*/
+
+#include "lamp_utils/PointCloudPool.h"
+
+namespace lamp_utils {
+
+PointCloudPool::State::State()
+  : free_gauge(MetricsRegistry::Instance().GetGauge("point_cloud_pool.free")),
+    free_points_gauge(MetricsRegistry::Instance().GetGauge(
+        "point_cloud_pool.free_points")),
+    acquired_counter(MetricsRegistry::Instance().GetCounter(
+        "point_cloud_pool.acquired")),
+    reused_counter(
+        MetricsRegistry::Instance().GetCounter("point_cloud_pool.reused")),
+    dropped_counter(
+        MetricsRegistry::Instance().GetCounter("point_cloud_pool.dropped")) {}
+
+PointCloudPool::State::~State() {
+  for (PointCloud* cloud : free) {
+    delete cloud;
+  }
+}
+
+void PointCloudPool::State::Recycle(PointCloud* cloud) {
+  const size_t capacity = cloud->points.capacity();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free.size() < max_clouds &&
+        stats.free_points + capacity <= max_points) {
+      // Keeps the point storage, the rest is reset on Acquire
+      cloud->points.clear();
+      free.push_back(cloud);
+      stats.recycled++;
+      stats.free++;
+      stats.free_points += capacity;
+      UpdateGauges();
+      return;
+    }
+    stats.dropped++;
+  }
+  dropped_counter.Increment();
+  delete cloud;
+}
+
+void PointCloudPool::State::UpdateGauges() {
+  free_gauge.Set(stats.free);
+  free_points_gauge.Set(stats.free_points);
+}
+
+PointCloudPool& PointCloudPool::Instance() {
+  static PointCloudPool pool;
+  return pool;
+}
+
+PointCloudPool::PointCloudPool() : state_(std::make_shared<State>()) {}
+
+PointCloud::Ptr PointCloudPool::Acquire() {
+  PointCloud* cloud = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->stats.acquired++;
+    if (!state_->free.empty()) {
+      // Most recently returned, the likeliest to still be in cache
+      cloud = state_->free.back();
+      state_->free.pop_back();
+      state_->stats.reused++;
+      state_->stats.free--;
+      state_->stats.free_points -= cloud->points.capacity();
+      state_->UpdateGauges();
+    }
+  }
+  state_->acquired_counter.Increment();
+
+  if (cloud) {
+    state_->reused_counter.Increment();
+    cloud->header = pcl::PCLHeader();
+    cloud->width = 0;
+    cloud->height = 0;
+    cloud->is_dense = true;
+    cloud->sensor_origin_.setZero();
+    cloud->sensor_orientation_.setIdentity();
+  } else {
+    cloud = new PointCloud;
+  }
+  return PointCloud::Ptr(cloud, Recycler{state_});
+}
+
+PointCloud::Ptr PointCloudPool::Copy(const PointCloud& cloud) {
+  PointCloud::Ptr copy = Acquire();
+  *copy = cloud;
+  return copy;
+}
+
+void PointCloudPool::SetCapacity(size_t max_clouds, size_t max_points) {
+  std::vector<PointCloud*> dropped;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->max_clouds = max_clouds;
+    state_->max_points = max_points;
+    // Free the clouds past the new limits
+    while (!state_->free.empty() &&
+           (state_->free.size() > max_clouds ||
+            state_->stats.free_points > max_points)) {
+      PointCloud* cloud = state_->free.front();
+      state_->free.erase(state_->free.begin());
+      state_->stats.free--;
+      state_->stats.free_points -= cloud->points.capacity();
+      dropped.push_back(cloud);
+    }
+    state_->UpdateGauges();
+  }
+  for (PointCloud* cloud : dropped) {
+    delete cloud;
+  }
+}
+
+PointCloudPoolStats PointCloudPool::GetStats() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->stats;
+}
+
+void PointCloudPool::Clear() {
+  std::vector<PointCloud*> free;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    free.swap(state_->free);
+    state_->stats.free = 0;
+    state_->stats.free_points = 0;
+    state_->UpdateGauges();
+  }
+  for (PointCloud* cloud : free) {
+    delete cloud;
+  }
+}
+
+} // namespace lamp_utils
@@ -5,6 +5,10 @@ Some utility functions for wokring with Point Clouds
 */
 #include "lamp_utils/PointCloudUtils.h"
 
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
 #include <geometry_utils/Transform3.h>
 #include <pcl/features/fpfh_omp.h>
 #include <pcl/filters/voxel_grid.h>
@@ -14,6 +18,37 @@ Some utility functions for wokring with Point Clouds
 
 namespace lamp_utils {
 
+bool HasNormals(const PointCloud& cloud) {
+  for (const auto& p : cloud.points) {
+    if (p.normal_x != 0 || p.normal_y != 0 || p.normal_z != 0)
+      return true;
+  }
+  return false;
+}
+
+bool EnsureNormals(const PointCloud::Ptr& cloud,
+                   const NormalComputeParams& params) {
+  if (cloud->empty())
+    return false;
+  if (HasNormals(*cloud)) {
+    for (auto& p : cloud->points) {
+      const float norm = p.getNormalVector3fMap().norm();
+      if (norm > 0)
+        p.getNormalVector3fMap() /= norm;
+    }
+    return false;
+  }
+  Normals::Ptr normals(new Normals);
+  ComputeNormals<Point>(cloud, params, normals);
+  for (size_t i = 0; i < cloud->size(); i++) {
+    cloud->points[i].normal_x = normals->points[i].normal_x;
+    cloud->points[i].normal_y = normals->points[i].normal_y;
+    cloud->points[i].normal_z = normals->points[i].normal_z;
+    cloud->points[i].curvature = normals->points[i].curvature;
+  }
+  return true;
+}
+
 void ExtractNormals(const PointCloud::ConstPtr& input,
                     Normals::Ptr normals,
                     const NormalComputeParams& params) {
@@ -21,8 +56,7 @@ void ExtractNormals(const PointCloud::ConstPtr& input,
   if (input->size() == 0)
     return;
   // Check that there are normals to extract
-  if (input->points[0].normal_x == 0 && input->points[0].normal_y == 0 &&
-      input->points[0].normal_z == 0) {
+  if (!HasNormals(*input)) {
     return ComputeNormals<Point>(input, params, normals);
   }
   int enable_omp = (1 < params.num_threads);
@@ -112,82 +146,167 @@ void ComputeFeatures(const PointCloud::ConstPtr& keypoints,
   fpfh_est.compute(*features);
 }
 
+namespace {
+
+typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+// Sum of h * h' over the terms of the point to plane ICP, h = [a x n, n] for
+// the query point a and the rotated reference normal n given by term(k, &a,
+// &n), false to skip the term. Each thread sums a static block of the terms
+// in fixed size (vectorized) matrices, and the partial sums are added in
+// thread order so the result does not depend on the scheduling.
+template <typename TermFn>
+Matrix6d SumPoint2PlaneAp(size_t num_terms,
+                          int num_threads,
+                          const TermFn& term) {
+  num_threads = std::max(num_threads, 1);
+  std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d>> partial_sums(
+      num_threads, Matrix6d::Zero());
+#pragma omp parallel num_threads(num_threads) if (num_threads > 1)
+  {
+    Matrix6d sum = Matrix6d::Zero();
+    Eigen::Vector3d a_i, n_i;
+    Eigen::Matrix<double, 6, 1> h;
+#pragma omp for schedule(static)
+    for (long k = 0; k < static_cast<long>(num_terms); k++) {
+      if (!term(k, &a_i, &n_i))
+        continue;
+      h.head<3>() = a_i.cross(n_i);
+      h.tail<3>() = n_i;
+      sum.noalias() += h * h.transpose();
+    }
+    partial_sums[omp_get_thread_num()] = sum;
+  }
+  Matrix6d Ap = Matrix6d::Zero();
+  for (const Matrix6d& sum : partial_sums) {
+    Ap += sum;
+  }
+  return Ap;
+}
+
+} // namespace
+
 void ComputeAp_ForPoint2PlaneICP(const PointCloud::Ptr query_normalized,
                                  const Normals::Ptr reference_normals,
                                  const std::vector<size_t>& correspondences,
                                  const Eigen::Matrix4f& T,
-                                 Eigen::Matrix<double, 6, 6>& Ap) {
+                                 Eigen::Matrix<double, 6, 6>& Ap,
+                                 int num_threads) {
   Ap = Eigen::Matrix<double, 6, 6>::Zero();
-  double tol = 1e-10;
-  Eigen::Vector3d a_i, n_i;
-  bool reference_normals_null = false;
-  bool query_null = false;
-  for (uint32_t i = 0; i < query_normalized->size(); i++) {
-    if (i >= correspondences.size()) {
-      continue;
-    }
-    if (query_normalized != NULL) {
-      a_i << query_normalized->points[i].x, //////
-          query_normalized->points[i].y,    //////
-          query_normalized->points[i].z;
-    } else {
-      a_i << 0, 0, 0;
-      query_null = true;
-    }
-
-    if ((reference_normals != NULL) &&
-        (reference_normals->points.size() > correspondences[i])) {
-      n_i << reference_normals->points[correspondences[i]].normal_x, //////
-          reference_normals->points[correspondences[i]].normal_y,    //////
-          reference_normals->points[correspondences[i]].normal_z;
-    } else {
-      n_i << 0, 0, 0;
-      reference_normals_null = true;
-    }
-
-    if (a_i.hasNaN() || n_i.hasNaN())
-      continue;
-
-    Eigen::Matrix<double, 1, 6> H = Eigen::Matrix<double, 1, 6>::Zero();
-    Eigen::Matrix3d R = T.block<3, 3>(0, 0).cast<double>();
-    H.block(0, 0, 1, 3) = (a_i.cross(R * n_i)).transpose();
-    H.block(0, 3, 1, 3) = (R * n_i).transpose();
-    Ap += H.transpose() * H;
-  }
-  if (query_null) {
+  if (query_normalized == NULL) {
     ROS_WARN("Query was null, setting query 0");
+    return;
+  }
+  const size_t n = std::min(query_normalized->size(), correspondences.size());
+  // Terms without a reference normal are zero
+  bool reference_normals_null = reference_normals == NULL;
+  for (size_t i = 0; i < n && !reference_normals_null; i++) {
+    reference_normals_null = correspondences[i] >= reference_normals->size();
   }
   if (reference_normals_null) {
     ROS_WARN("Reference normal was null, setting normals to 0");
   }
+
+  const Eigen::Matrix3d R = T.block<3, 3>(0, 0).cast<double>();
+  Ap = SumPoint2PlaneAp(
+      n,
+      num_threads,
+      [&](size_t i, Eigen::Vector3d* a_i, Eigen::Vector3d* n_i) {
+        if (reference_normals == NULL ||
+            correspondences[i] >= reference_normals->size()) {
+          return false;
+        }
+        const Point& p = query_normalized->points[i];
+        const pcl::Normal& normal =
+            reference_normals->points[correspondences[i]];
+        *a_i << p.x, p.y, p.z;
+        *n_i << normal.normal_x, normal.normal_y, normal.normal_z;
+        if (a_i->hasNaN() || n_i->hasNaN())
+          return false;
+        *n_i = R * *n_i;
+        return true;
+      });
+}
+
+void ComputeAp_ForPoint2PlaneICP(const PointCloud& query,
+                                 const PointCloud& reference,
+                                 const std::vector<int>& query_indices,
+                                 const std::vector<int>& reference_indices,
+                                 const Eigen::Matrix4f& T,
+                                 int num_threads,
+                                 Eigen::Matrix<double, 6, 6>* Ap) {
+  // Normalization of NormalizePCloud, applied on the fly
+  Eigen::Vector4f centroid;
+  pcl::compute3DCentroid(query, centroid);
+  double dist = 0;
+  for (const Point& p : query.points) {
+    dist += (p.getVector3fMap() - centroid.head<3>()).norm();
+  }
+  const double factor = query.size() / dist;
+  const Eigen::Vector3d offset = centroid.head<3>().cast<double>();
+
+  const Eigen::Matrix3d R = T.block<3, 3>(0, 0).cast<double>();
+  const size_t n = std::min(query_indices.size(), reference_indices.size());
+  *Ap = SumPoint2PlaneAp(
+      n,
+      num_threads,
+      [&](size_t k, Eigen::Vector3d* a_i, Eigen::Vector3d* n_i) {
+        const Point& p = query.points[query_indices[k]];
+        const Point& r = reference.points[reference_indices[k]];
+        *a_i = factor * (Eigen::Vector3d(p.x, p.y, p.z) - offset);
+        *n_i << r.normal_x, r.normal_y, r.normal_z;
+        if (a_i->hasNaN() || n_i->hasNaN())
+          return false;
+        *n_i = R * *n_i;
+        return true;
+      });
 }
 
 void ComputeIcpObservability(PointCloud::ConstPtr cloud,
                              Eigen::Matrix<double, 3, 1>* eigenvalues,
                              const NormalComputeParams& params) {
-  // Get normals
-  Normals::Ptr normals(new Normals);          // pc with normals
-  PointCloud::Ptr normalized(new PointCloud); // pc whose points have been
-                                              // rearranged.
-  lamp_utils::ExtractNormals(cloud, normals, params);
-  lamp_utils::NormalizePCloud(cloud, normalized);
-
-  for (size_t i = 0; i < cloud->size(); i++) {
-    Point p = cloud->points[i];
-    pcl::Normal n = normals->points[i];
+  // Only the translation block of the point to plane Ap of the scan against
+  // itself is decomposed. It is the sum of n * n' over the points, so the
+  // positions (and their normalization) do not matter, only which points
+  // are finite. The normals stored with the scan are used when present.
+  Normals::Ptr normals;
+  if (!HasNormals(*cloud)) {
+    normals.reset(new Normals);
+    ComputeNormals<Point>(cloud, params, normals);
   }
 
-  // Correspondence with itself (not really used anyways)
-  std::vector<size_t> c(cloud->size());
-  std::iota(std::begin(c), std::end(c), 0); // Fill with 0, 1, ...
-
-  Eigen::Matrix4f T_unsued = Eigen::Matrix4f::Identity(); // Unused
+  // Per thread partial sums over static blocks, added in thread order so the
+  // result does not depend on the scheduling
+  const int num_threads = std::max(params.num_threads, 1);
+  std::vector<Eigen::Matrix3d> partial_sums(num_threads,
+                                            Eigen::Matrix3d::Zero());
+#pragma omp parallel num_threads(num_threads) if (num_threads > 1)
+  {
+    Eigen::Matrix3d sum = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d n_i;
+#pragma omp for schedule(static)
+    for (long i = 0; i < static_cast<long>(cloud->size()); i++) {
+      const Point& p = cloud->points[i];
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+        continue;
+      if (normals) {
+        const pcl::Normal& normal = normals->points[i];
+        n_i << normal.normal_x, normal.normal_y, normal.normal_z;
+      } else {
+        n_i << p.normal_x, p.normal_y, p.normal_z;
+      }
+      if (n_i.hasNaN())
+        continue;
+      sum.noalias() += n_i * n_i.transpose();
+    }
+    partial_sums[omp_get_thread_num()] = sum;
+  }
+  Eigen::Matrix3d Ap = Eigen::Matrix3d::Zero();
+  for (const Eigen::Matrix3d& sum : partial_sums) {
+    Ap += sum;
+  }
 
-  Eigen::Matrix<double, 6, 6> Ap;
-  // Compute Ap and its eigenvalues
-  lamp_utils::ComputeAp_ForPoint2PlaneICP(normalized, normals, c, T_unsued, Ap);
-  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 3, 3>> eigensolver(
-      Ap.block(3, 3, 3, 3));
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver(Ap);
   if (eigensolver.info() == Eigen::Success) {
     *eigenvalues = eigensolver.eigenvalues();
   } else {
@@ -0,0 +1,82 @@
+/*
+PoseExtrapolator.cc
+Constant twist extrapolation of the pose of a robot
+*/
+
+#include "lamp_utils/PoseExtrapolator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace lamp_utils {
+
+PoseExtrapolator::PoseExtrapolator(const PoseExtrapolatorParams& params)
+  : params_(params) {
+  params_.history_size = std::max<size_t>(params_.history_size, 2);
+}
+
+bool PoseExtrapolator::AddSample(const ros::Time& stamp,
+                                 const gtsam::Pose3& pose) {
+  Sample sample;
+  sample.stamp = stamp;
+  sample.pose = pose;
+  sample.twist.setZero();
+  if (!history_.empty()) {
+    const Sample& last = history_.back();
+    const double dt = (stamp - last.stamp).toSec();
+    if (dt <= 0)
+      return false;
+    sample.twist = gtsam::Pose3::Logmap(last.pose.between(pose)) / dt;
+  }
+  history_.push_back(sample);
+  while (history_.size() > params_.history_size)
+    history_.pop_front();
+  return true;
+}
+
+bool PoseExtrapolator::Predict(const ros::Time& stamp,
+                               PosePrediction* prediction) const {
+  if (history_.empty())
+    return false;
+  const Sample& last = history_.back();
+  prediction->stamp = stamp;
+  prediction->horizon = std::max(0.0, (stamp - last.stamp).toSec());
+  if (prediction->horizon == 0 || history_.size() < 2) {
+    prediction->pose = last.pose;
+    prediction->confidence = std::exp(-prediction->horizon /
+                                      params_.confidence_time_constant);
+    return true;
+  }
+
+  // Twist averaged over the history, weighted by the time each one lasted.
+  // The first sample only anchors the second.
+  gtsam::Vector6 twist = gtsam::Vector6::Zero();
+  double duration = 0;
+  for (size_t i = 1; i < history_.size(); i++) {
+    const double dt = (history_[i].stamp - history_[i - 1].stamp).toSec();
+    twist += history_[i].twist * dt;
+    duration += dt;
+  }
+  twist /= duration;
+
+  // Spread of the linear velocity, how far the robot strays from a constant
+  // twist per second of horizon
+  double variance = 0;
+  for (size_t i = 1; i < history_.size(); i++) {
+    variance += (history_[i].twist.tail<3>() - twist.tail<3>()).squaredNorm();
+  }
+  const double spread = std::sqrt(variance / (history_.size() - 1));
+
+  const double horizon = std::min(prediction->horizon, params_.max_horizon);
+  prediction->pose = last.pose.compose(gtsam::Pose3::Expmap(twist * horizon));
+  prediction->confidence =
+      std::exp(-prediction->horizon / params_.confidence_time_constant) /
+      (1 + spread * prediction->horizon);
+  return true;
+}
+
+void PoseExtrapolator::clear() {
+  history_.clear();
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,793 @@
+/*
+PoseGraphArchive.cc
+Chunked, indexed file format for saved pose graphs and their keyed scans
+*/
+
+#include "lamp_utils/PoseGraphArchive.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <gtsam/inference/Symbol.h>
+#include <ros/console.h>
+#include <ros/serialization.h>
+
+namespace lamp_utils {
+
+using namespace archive;
+
+namespace {
+
+// Fixed part of a scan payload, followed by the frame id and the points
+struct ScanHeader {
+  uint64_t stamp;
+  uint64_t num_points;
+  uint32_t seq;
+  uint32_t width;
+  uint32_t height;
+  uint32_t frame_id_size;
+  uint8_t is_dense;
+  uint8_t reserved[7];
+};
+
+// Trailer of an archive ending at end, false unless it points to an index
+// block ending right before it
+bool ReadTrailer(const char* map, size_t end, Trailer* trailer) {
+  if (end < sizeof(FileHeader) + sizeof(BlockHeader) + sizeof(Trailer)) {
+    return false;
+  }
+  std::memcpy(trailer, map + end - sizeof(Trailer), sizeof(Trailer));
+  if (std::memcmp(trailer->magic, kMagic, sizeof(kMagic)) != 0 ||
+      trailer->num_entries > end / sizeof(IndexEntry)) {
+    return false;
+  }
+  const size_t index_bytes = trailer->num_entries * sizeof(IndexEntry);
+  if (trailer->index_offset < sizeof(FileHeader) ||
+      trailer->index_offset + sizeof(BlockHeader) + index_bytes +
+              sizeof(Trailer) !=
+          end) {
+    return false;
+  }
+  BlockHeader index_header;
+  std::memcpy(&index_header, map + trailer->index_offset, sizeof(index_header));
+  return index_header.type == INDEX && index_header.stored_bytes == index_bytes;
+}
+
+typedef std::tuple<int32_t, int32_t, int32_t> Cell;
+
+Cell ToCell(const double position[3], double cell_size) {
+  return Cell(static_cast<int32_t>(std::floor(position[0] / cell_size)),
+              static_cast<int32_t>(std::floor(position[1] / cell_size)),
+              static_cast<int32_t>(std::floor(position[2] / cell_size)));
+}
+
+void SerializeScan(const PointCloud& scan, std::vector<char>* raw) {
+  ScanHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.stamp = scan.header.stamp;
+  header.num_points = scan.points.size();
+  header.seq = scan.header.seq;
+  header.width = scan.width;
+  header.height = scan.height;
+  header.frame_id_size = scan.header.frame_id.size();
+  header.is_dense = scan.is_dense ? 1 : 0;
+
+  const size_t points_bytes = scan.points.size() * sizeof(Point);
+  raw->resize(sizeof(header) + header.frame_id_size + points_bytes);
+  char* ptr = raw->data();
+  std::memcpy(ptr, &header, sizeof(header));
+  ptr += sizeof(header);
+  std::memcpy(ptr, scan.header.frame_id.data(), header.frame_id_size);
+  ptr += header.frame_id_size;
+  if (points_bytes > 0) {
+    std::memcpy(ptr, scan.points.data(), points_bytes);
+  }
+}
+
+PointCloud::Ptr DeserializeScan(const std::vector<char>& raw) {
+  if (raw.size() < sizeof(ScanHeader)) {
+    return nullptr;
+  }
+  ScanHeader header;
+  const char* ptr = raw.data();
+  std::memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+  if (raw.size() != sizeof(header) + header.frame_id_size +
+          header.num_points * sizeof(Point)) {
+    return nullptr;
+  }
+
+  PointCloud::Ptr scan(new PointCloud);
+  scan->header.stamp = header.stamp;
+  scan->header.seq = header.seq;
+  scan->header.frame_id.assign(ptr, header.frame_id_size);
+  ptr += header.frame_id_size;
+  scan->points.resize(header.num_points);
+  if (header.num_points > 0) {
+    std::memcpy(scan->points.data(), ptr, header.num_points * sizeof(Point));
+  }
+  scan->width = header.width;
+  scan->height = header.height;
+  scan->is_dense = header.is_dense != 0;
+  return scan;
+}
+
+} // namespace
+
+bool IsPoseGraphArchive(const std::string& filename) {
+  std::ifstream is(filename, std::ios::binary);
+  char magic[sizeof(kMagic)];
+  if (!is.read(magic, sizeof(magic)))
+    return false;
+  return std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+// Reader
+
+PoseGraphArchiveReader::~PoseGraphArchiveReader() {
+  Close();
+}
+
+bool PoseGraphArchiveReader::Open(const std::string& filename) {
+  Close();
+
+  fd_ = open(filename.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    ROS_ERROR_STREAM("PoseGraphArchive: Could not open " << filename);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(FileHeader) + sizeof(Trailer)) {
+    ROS_ERROR_STREAM("PoseGraphArchive: " << filename << " is truncated");
+    Close();
+    return false;
+  }
+  map_size_ = st.st_size;
+  void* map = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    ROS_ERROR_STREAM("PoseGraphArchive: Failed to map " << filename);
+    map_size_ = 0;
+    Close();
+    return false;
+  }
+  map_ = static_cast<char*>(map);
+
+  FileHeader file_header;
+  std::memcpy(&file_header, map_, sizeof(file_header));
+  if (std::memcmp(file_header.magic, kMagic, sizeof(kMagic)) != 0) {
+    ROS_ERROR_STREAM("PoseGraphArchive: " << filename
+                                          << " is not an archive");
+    Close();
+    return false;
+  }
+  if (file_header.version != kVersion ||
+      file_header.point_size != sizeof(Point)) {
+    ROS_ERROR_STREAM("PoseGraphArchive: " << filename
+                                          << " has an unsupported version");
+    Close();
+    return false;
+  }
+
+  // A commit cut short (e.g. by a crash while saving in the background)
+  // leaves blocks after the last trailer. The archive then ends at the last
+  // complete commit, the next writer overwrites the rest.
+  size_t end = map_size_;
+  Trailer trailer;
+  while (end > 0 && !ReadTrailer(map_, end, &trailer)) {
+    end--;
+  }
+  if (end == 0) {
+    ROS_ERROR_STREAM("PoseGraphArchive: " << filename
+                                          << " has no complete commit");
+    Close();
+    return false;
+  }
+  if (end < map_size_) {
+    ROS_WARN_STREAM("PoseGraphArchive: Ignoring " << map_size_ - end
+                                                  << " bytes after the last "
+                                                     "commit of "
+                                                  << filename);
+  }
+
+  // Index block, stored uncompressed
+  const size_t index_bytes = trailer.num_entries * sizeof(IndexEntry);
+  index_.resize(trailer.num_entries);
+  if (index_bytes > 0) {
+    std::memcpy(index_.data(),
+                map_ + trailer.index_offset + sizeof(BlockHeader),
+                index_bytes);
+  }
+  index_offset_ = trailer.index_offset;
+
+  IndexEntry poses_entry = {};
+  for (size_t i = 0; i < index_.size(); i++) {
+    const IndexEntry& entry = index_[i];
+    if (entry.offset + sizeof(BlockHeader) + entry.stored_bytes >
+        index_offset_) {
+      ROS_ERROR_STREAM("PoseGraphArchive: Corrupted index in " << filename);
+      Close();
+      return false;
+    }
+    if (entry.type == SCAN) {
+      scans_[entry.key] = i;
+    } else if (entry.type == GRAPH) {
+      b_has_graph_ = true;
+      graph_ = entry;
+    } else if (entry.type == POSES) {
+      b_has_poses_ = true;
+      poses_entry = entry;
+    }
+  }
+
+  // Searched in the mapping, the sizes have to add up
+  if (b_has_poses_) {
+    const char* payload = map_ + poses_entry.offset + sizeof(BlockHeader);
+    if (poses_entry.stored_bytes == poses_entry.raw_bytes &&
+        poses_entry.raw_bytes >= sizeof(PosesHeader)) {
+      std::memcpy(&poses_header_, payload, sizeof(PosesHeader));
+    } else {
+      poses_header_.num_poses = poses_header_.num_cells = 0;
+    }
+    const uint64_t np = poses_header_.num_poses;
+    const uint64_t nc = poses_header_.num_cells;
+    if (poses_entry.stored_bytes != poses_entry.raw_bytes ||
+        poses_entry.raw_bytes < sizeof(PosesHeader) ||
+        !(poses_header_.cell_size > 0.0) ||
+        np > poses_entry.raw_bytes || nc > poses_entry.raw_bytes ||
+        sizeof(PosesHeader) + np * sizeof(PoseEntry) +
+                nc * sizeof(CellEntry) + np * sizeof(uint64_t) !=
+            poses_entry.raw_bytes) {
+      ROS_WARN_STREAM("PoseGraphArchive: Ignoring the corrupted poses of "
+                      << filename);
+      b_has_poses_ = false;
+    } else {
+      poses_ = payload + sizeof(PosesHeader);
+      cells_ = poses_ + np * sizeof(PoseEntry);
+      members_ = cells_ + nc * sizeof(CellEntry);
+    }
+  }
+  filename_ = filename;
+  return true;
+}
+
+void PoseGraphArchiveReader::Close() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
+    map_size_ = 0;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  filename_.clear();
+  index_offset_ = 0;
+  index_.clear();
+  scans_.clear();
+  b_has_graph_ = false;
+  b_has_poses_ = false;
+  poses_ = cells_ = members_ = nullptr;
+}
+
+bool PoseGraphArchiveReader::ReadBlock(const IndexEntry& entry,
+                                       std::vector<char>* raw) const {
+  raw->resize(entry.raw_bytes);
+  uLongf raw_size = raw->size();
+  if (uncompress(reinterpret_cast<Bytef*>(raw->data()),
+                 &raw_size,
+                 reinterpret_cast<const Bytef*>(map_ + entry.offset +
+                                                sizeof(BlockHeader)),
+                 entry.stored_bytes) != Z_OK ||
+      raw_size != raw->size()) {
+    ROS_ERROR_STREAM("PoseGraphArchive: Corrupted block of key "
+                     << gtsam::DefaultKeyFormatter(entry.key) << " in "
+                     << filename_);
+    return false;
+  }
+  return true;
+}
+
+pose_graph_msgs::PoseGraphPtr PoseGraphArchiveReader::ReadGraph() const {
+  std::vector<char> raw;
+  if (!IsOpen() || !b_has_graph_ || !ReadBlock(graph_, &raw)) {
+    return nullptr;
+  }
+  pose_graph_msgs::PoseGraphPtr graph(new pose_graph_msgs::PoseGraph);
+  try {
+    ros::serialization::IStream stream(reinterpret_cast<uint8_t*>(raw.data()),
+                                       raw.size());
+    ros::serialization::deserialize(stream, *graph);
+  } catch (const ros::Exception& e) {
+    ROS_ERROR_STREAM("PoseGraphArchive: Corrupted graph in " << filename_);
+    return nullptr;
+  }
+  return graph;
+}
+
+PointCloud::Ptr PoseGraphArchiveReader::ReadScan(gtsam::Key key) const {
+  auto it = scans_.find(key);
+  std::vector<char> raw;
+  if (it == scans_.end() || !ReadBlock(index_[it->second], &raw)) {
+    return nullptr;
+  }
+  return DeserializeScan(raw);
+}
+
+bool PoseGraphArchiveReader::GetScanBlock(gtsam::Key key,
+                                          const char** data,
+                                          size_t* size,
+                                          ros::Time* stamp) const {
+  auto it = scans_.find(key);
+  if (it == scans_.end()) {
+    return false;
+  }
+  const IndexEntry& entry = index_[it->second];
+  *data = map_ + entry.offset;
+  *size = sizeof(BlockHeader) + entry.stored_bytes;
+  stamp->fromNSec(entry.stamp_ns);
+  return true;
+}
+
+std::vector<gtsam::Key> PoseGraphArchiveReader::ScanKeys() const {
+  std::vector<gtsam::Key> keys;
+  keys.reserve(scans_.size());
+  for (const auto& scan : scans_) {
+    keys.push_back(scan.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+ros::Time PoseGraphArchiveReader::ScanStamp(gtsam::Key key) const {
+  ros::Time stamp;
+  auto it = scans_.find(key);
+  if (it != scans_.end()) {
+    stamp.fromNSec(index_[it->second].stamp_ns);
+  }
+  return stamp;
+}
+
+PoseEntry PoseGraphArchiveReader::PoseAt(size_t i) const {
+  PoseEntry pose;
+  std::memcpy(&pose, poses_ + i * sizeof(PoseEntry), sizeof(pose));
+  return pose;
+}
+
+size_t PoseGraphArchiveReader::LowerBoundPose(gtsam::Key key) const {
+  size_t first = 0;
+  size_t count = poses_header_.num_poses;
+  while (count > 0) {
+    const size_t step = count / 2;
+    if (PoseAt(first + step).key < key) {
+      first += step + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  return first;
+}
+
+bool PoseGraphArchiveReader::FindPose(gtsam::Key key, PoseEntry* pose) const {
+  if (!b_has_poses_) {
+    return false;
+  }
+  const size_t i = LowerBoundPose(key);
+  if (i == poses_header_.num_poses) {
+    return false;
+  }
+  *pose = PoseAt(i);
+  return pose->key == key;
+}
+
+std::vector<PoseEntry>
+PoseGraphArchiveReader::PosesWithin(const double position[3],
+                                    double radius) const {
+  std::vector<PoseEntry> poses;
+  if (!b_has_poses_ || radius < 0.0) {
+    return poses;
+  }
+  const double cell_size = poses_header_.cell_size;
+  const double low[3] = {
+      position[0] - radius, position[1] - radius, position[2] - radius};
+  const double high[3] = {
+      position[0] + radius, position[1] + radius, position[2] + radius};
+  const Cell first = ToCell(low, cell_size);
+  const Cell last = ToCell(high, cell_size);
+
+  // The cells are sorted, each one of the box is looked up
+  auto cell_at = [this](size_t i) {
+    CellEntry cell;
+    std::memcpy(&cell, cells_ + i * sizeof(CellEntry), sizeof(cell));
+    return cell;
+  };
+  const double sq_radius = radius * radius;
+  for (int32_t x = std::get<0>(first); x <= std::get<0>(last); x++) {
+    for (int32_t y = std::get<1>(first); y <= std::get<1>(last); y++) {
+      for (int32_t z = std::get<2>(first); z <= std::get<2>(last); z++) {
+        const Cell wanted(x, y, z);
+        size_t lo = 0;
+        size_t count = poses_header_.num_cells;
+        while (count > 0) {
+          const size_t step = count / 2;
+          const CellEntry cell = cell_at(lo + step);
+          if (Cell(cell.x, cell.y, cell.z) < wanted) {
+            lo += step + 1;
+            count -= step + 1;
+          } else {
+            count = step;
+          }
+        }
+        if (lo == poses_header_.num_cells) {
+          continue;
+        }
+        const CellEntry cell = cell_at(lo);
+        if (Cell(cell.x, cell.y, cell.z) != wanted ||
+            cell.first_member + cell.num_members > poses_header_.num_poses) {
+          continue;
+        }
+        for (uint32_t m = 0; m < cell.num_members; m++) {
+          uint64_t i;
+          std::memcpy(&i,
+                      members_ + (cell.first_member + m) * sizeof(uint64_t),
+                      sizeof(i));
+          if (i >= poses_header_.num_poses) {
+            continue;
+          }
+          const PoseEntry pose = PoseAt(i);
+          const double dx = pose.position[0] - position[0];
+          const double dy = pose.position[1] - position[1];
+          const double dz = pose.position[2] - position[2];
+          if (dx * dx + dy * dy + dz * dz <= sq_radius) {
+            poses.push_back(pose);
+          }
+        }
+      }
+    }
+  }
+  std::sort(poses.begin(),
+            poses.end(),
+            [](const PoseEntry& a, const PoseEntry& b) { return a.key < b.key; });
+  return poses;
+}
+
+std::vector<unsigned char> PoseGraphArchiveReader::PosePrefixes() const {
+  std::vector<unsigned char> prefixes;
+  if (!b_has_poses_) {
+    return prefixes;
+  }
+  // Keys are sorted by prefix, one search per prefix present
+  size_t i = 0;
+  while (i < poses_header_.num_poses) {
+    const unsigned char prefix = gtsam::Symbol(PoseAt(i).key).chr();
+    prefixes.push_back(prefix);
+    if (prefix == 255) {
+      break;
+    }
+    i = LowerBoundPose(gtsam::Symbol(prefix + 1, 0));
+  }
+  return prefixes;
+}
+
+// Writer
+
+PoseGraphArchiveWriter::~PoseGraphArchiveWriter() {
+  Close();
+}
+
+bool PoseGraphArchiveWriter::Open(const std::string& filename, bool append) {
+  Close();
+
+  if (append && IsPoseGraphArchive(filename)) {
+    // Keep the scan blocks, the graph, index and trailer are written again
+    // on the next commit
+    PoseGraphArchiveReader reader;
+    if (!reader.Open(filename)) {
+      return false;
+    }
+    for (const IndexEntry& entry : reader.index()) {
+      if (entry.type == SCAN) {
+        scan_entries_[entry.key] = scan_index_.size();
+        scan_index_.push_back(entry);
+      }
+    }
+    offset_ = reader.index_offset();
+    reader.Close();
+
+    fd_ = open(filename.c_str(), O_RDWR);
+    if (fd_ < 0 || ftruncate(fd_, offset_) != 0) {
+      ROS_ERROR_STREAM("PoseGraphArchive: Could not append to " << filename);
+      Close();
+      return false;
+    }
+    filename_ = filename;
+    return true;
+  }
+
+  fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    ROS_ERROR_STREAM("PoseGraphArchive: Could not create " << filename);
+    return false;
+  }
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.point_size = sizeof(Point);
+  if (!Write(&header, sizeof(header))) {
+    Close();
+    return false;
+  }
+  filename_ = filename;
+  return true;
+}
+
+void PoseGraphArchiveWriter::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  filename_.clear();
+  offset_ = 0;
+  scan_index_.clear();
+  scan_entries_.clear();
+  scan_revisions_.clear();
+}
+
+bool PoseGraphArchiveWriter::Write(const void* data, size_t size) {
+  const char* ptr = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t written = pwrite(fd_, ptr, size, offset_);
+    if (written <= 0) {
+      ROS_ERROR_STREAM("PoseGraphArchive: Failed to write " << filename_);
+      return false;
+    }
+    ptr += written;
+    size -= written;
+    offset_ += written;
+  }
+  return true;
+}
+
+bool PoseGraphArchiveWriter::AppendBlock(const BlockHeader& header,
+                                         const std::vector<char>& raw,
+                                         IndexEntry* entry) {
+  uLongf stored_bytes = compressBound(raw.size());
+  std::vector<Bytef> stored(stored_bytes);
+  if (compress2(stored.data(),
+                &stored_bytes,
+                reinterpret_cast<const Bytef*>(raw.data()),
+                raw.size(),
+                Z_BEST_SPEED) != Z_OK) {
+    ROS_ERROR("PoseGraphArchive: Failed to compress block");
+    return false;
+  }
+
+  BlockHeader block = header;
+  block.raw_bytes = raw.size();
+  block.stored_bytes = stored_bytes;
+  entry->type = block.type;
+  entry->reserved = 0;
+  entry->key = block.key;
+  entry->stamp_ns = block.stamp_ns;
+  entry->offset = offset_;
+  entry->raw_bytes = block.raw_bytes;
+  entry->stored_bytes = block.stored_bytes;
+  return Write(&block, sizeof(block)) && Write(stored.data(), stored_bytes);
+}
+
+bool PoseGraphArchiveWriter::AppendPoses(const pose_graph_msgs::PoseGraph& graph,
+                                         IndexEntry* entry) {
+  // The last node message of each key
+  std::map<gtsam::Key, PoseEntry> by_key;
+  for (const auto& node : graph.nodes) {
+    PoseEntry& pose = by_key[node.key];
+    pose.key = node.key;
+    pose.stamp_ns = node.header.stamp.toNSec();
+    pose.position[0] = node.pose.position.x;
+    pose.position[1] = node.pose.position.y;
+    pose.position[2] = node.pose.position.z;
+    pose.orientation[0] = node.pose.orientation.w;
+    pose.orientation[1] = node.pose.orientation.x;
+    pose.orientation[2] = node.pose.orientation.y;
+    pose.orientation[3] = node.pose.orientation.z;
+  }
+
+  PosesHeader poses_header;
+  poses_header.cell_size = kPoseCellSize;
+  poses_header.num_poses = by_key.size();
+  std::vector<PoseEntry> poses;
+  poses.reserve(by_key.size());
+  std::vector<std::pair<Cell, uint64_t>> by_cell;
+  by_cell.reserve(by_key.size());
+  for (const auto& pose : by_key) {
+    by_cell.emplace_back(ToCell(pose.second.position, kPoseCellSize),
+                         poses.size());
+    poses.push_back(pose.second);
+  }
+  std::sort(by_cell.begin(), by_cell.end());
+  std::vector<CellEntry> cells;
+  std::vector<uint64_t> members;
+  members.reserve(by_cell.size());
+  for (const auto& member : by_cell) {
+    if (cells.empty() || Cell(cells.back().x, cells.back().y,
+                              cells.back().z) != member.first) {
+      CellEntry cell;
+      cell.x = std::get<0>(member.first);
+      cell.y = std::get<1>(member.first);
+      cell.z = std::get<2>(member.first);
+      cell.num_members = 0;
+      cell.first_member = members.size();
+      cells.push_back(cell);
+    }
+    cells.back().num_members++;
+    members.push_back(member.second);
+  }
+  poses_header.num_cells = cells.size();
+
+  std::vector<char> raw(sizeof(PosesHeader) +
+                        poses.size() * sizeof(PoseEntry) +
+                        cells.size() * sizeof(CellEntry) +
+                        members.size() * sizeof(uint64_t));
+  char* ptr = raw.data();
+  std::memcpy(ptr, &poses_header, sizeof(poses_header));
+  ptr += sizeof(poses_header);
+  if (!poses.empty()) {
+    std::memcpy(ptr, poses.data(), poses.size() * sizeof(PoseEntry));
+    ptr += poses.size() * sizeof(PoseEntry);
+    std::memcpy(ptr, cells.data(), cells.size() * sizeof(CellEntry));
+    ptr += cells.size() * sizeof(CellEntry);
+    std::memcpy(ptr, members.data(), members.size() * sizeof(uint64_t));
+  }
+
+  BlockHeader block;
+  std::memset(&block, 0, sizeof(block));
+  block.type = POSES;
+  block.stamp_ns = graph.header.stamp.toNSec();
+  block.raw_bytes = raw.size();
+  block.stored_bytes = raw.size();
+  entry->type = block.type;
+  entry->reserved = 0;
+  entry->key = 0;
+  entry->stamp_ns = block.stamp_ns;
+  entry->offset = offset_;
+  entry->raw_bytes = block.raw_bytes;
+  entry->stored_bytes = block.stored_bytes;
+  return Write(&block, sizeof(block)) && Write(raw.data(), raw.size());
+}
+
+bool PoseGraphArchiveWriter::AppendScan(gtsam::Key key,
+                                        const ros::Time& stamp,
+                                        const PointCloud& scan,
+                                        uint32_t revision) {
+  if (HasScan(key)) {
+    return false;
+  }
+  return ReplaceScan(key, stamp, scan, revision);
+}
+
+bool PoseGraphArchiveWriter::ReplaceScan(gtsam::Key key,
+                                         const ros::Time& stamp,
+                                         const PointCloud& scan,
+                                         uint32_t revision) {
+  if (!IsOpen()) {
+    return false;
+  }
+  std::vector<char> raw;
+  SerializeScan(scan, &raw);
+
+  BlockHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.type = SCAN;
+  header.key = key;
+  header.stamp_ns = stamp.toNSec();
+  IndexEntry entry;
+  if (!AppendBlock(header, raw, &entry)) {
+    return false;
+  }
+  // The block of the former revision stays in the file, unindexed
+  auto it = scan_entries_.find(key);
+  if (it != scan_entries_.end()) {
+    scan_index_[it->second] = entry;
+  } else {
+    scan_entries_[key] = scan_index_.size();
+    scan_index_.push_back(entry);
+  }
+  if (revision > 0) {
+    scan_revisions_[key] = revision;
+  }
+  return true;
+}
+
+bool PoseGraphArchiveWriter::AppendScanBlock(gtsam::Key key,
+                                             const char* data,
+                                             size_t size) {
+  if (!IsOpen() || HasScan(key) || size < sizeof(BlockHeader)) {
+    return false;
+  }
+  BlockHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (header.type != SCAN || header.key != key ||
+      sizeof(header) + header.stored_bytes != size) {
+    return false;
+  }
+  IndexEntry entry;
+  entry.type = SCAN;
+  entry.reserved = 0;
+  entry.key = key;
+  entry.stamp_ns = header.stamp_ns;
+  entry.offset = offset_;
+  entry.raw_bytes = header.raw_bytes;
+  entry.stored_bytes = header.stored_bytes;
+  if (!Write(data, size)) {
+    return false;
+  }
+  scan_entries_[key] = scan_index_.size();
+  scan_index_.push_back(entry);
+  return true;
+}
+
+bool PoseGraphArchiveWriter::Commit(const pose_graph_msgs::PoseGraph& graph) {
+  if (!IsOpen()) {
+    return false;
+  }
+  std::vector<char> raw(ros::serialization::serializationLength(graph));
+  ros::serialization::OStream stream(reinterpret_cast<uint8_t*>(raw.data()),
+                                     raw.size());
+  ros::serialization::serialize(stream, graph);
+
+  BlockHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.type = GRAPH;
+  header.stamp_ns = graph.header.stamp.toNSec();
+  IndexEntry graph_entry;
+  if (!AppendBlock(header, raw, &graph_entry)) {
+    return false;
+  }
+
+  IndexEntry poses_entry;
+  if (!AppendPoses(graph, &poses_entry)) {
+    return false;
+  }
+
+  std::vector<IndexEntry> index = scan_index_;
+  index.push_back(graph_entry);
+  index.push_back(poses_entry);
+  const size_t index_offset = offset_;
+  BlockHeader index_header;
+  std::memset(&index_header, 0, sizeof(index_header));
+  index_header.type = INDEX;
+  index_header.raw_bytes = index.size() * sizeof(IndexEntry);
+  index_header.stored_bytes = index_header.raw_bytes;
+
+  Trailer trailer;
+  trailer.index_offset = index_offset;
+  trailer.num_entries = index.size();
+  std::memcpy(trailer.magic, kMagic, sizeof(kMagic));
+  if (!Write(&index_header, sizeof(index_header)) ||
+      !Write(index.data(), index_header.raw_bytes) ||
+      !Write(&trailer, sizeof(trailer))) {
+    return false;
+  }
+  if (fdatasync(fd_) != 0) {
+    ROS_WARN_STREAM("PoseGraphArchive: Failed to sync " << filename_);
+  }
+
+  // Later blocks overwrite the index and trailer, the next commit writes
+  // them again
+  offset_ = index_offset;
+  return true;
+}
+
+} // namespace lamp_utils
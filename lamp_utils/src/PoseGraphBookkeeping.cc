@@ -1,6 +1,11 @@
 #include "lamp_utils/CommonFunctions.h"
+#include "lamp_utils/Metrics.h"
 #include "lamp_utils/PoseGraph.h"
 
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
 #include <gtsam/sam/RangeFactor.h>
 #include <gtsam/slam/BetweenFactor.h>
 #include <gtsam/slam/PriorFactor.h>
@@ -16,6 +21,11 @@ bool PoseGraph::TrackFactor(const Factor& factor) {
 }
 
 bool PoseGraph::TrackFactor(const EdgeMessage& msg) {
+  // Edges of marginalized nodes arriving late
+  if (IsMarginalized(msg.key_from) || IsMarginalized(msg.key_to)) {
+    return false;
+  }
+
   if (msg.type == pose_graph_msgs::PoseGraphEdge::PRIOR) {
     TrackPrior(msg);
     return false;
@@ -34,7 +44,7 @@ bool PoseGraph::TrackFactor(const EdgeMessage& msg) {
     return success;
   }
 
-  if (edges_.find(msg) != edges_.end()) {
+  if (edges_.Contains(msg)) {
     ROS_DEBUG_STREAM("Edge of type " << msg.type << " from key "
                                      << gtsam::DefaultKeyFormatter(msg.key_from)
                                      << " to key "
@@ -71,8 +81,8 @@ bool PoseGraph::TrackFactor(const EdgeMessage& msg) {
   }
 
   if (success) {
-    edges_.insert(msg);
-    edges_new_.insert(msg);
+    edges_.Insert(msg);
+    edges_new_.Insert(msg);
   }
   return success;
 }
@@ -81,8 +91,12 @@ bool PoseGraph::TrackFactor(const gtsam::Symbol& key_from,
                             const gtsam::Symbol& key_to,
                             int type,
                             const gtsam::Pose3& transform,
-                            const gtsam::SharedNoiseModel& covariance,
+                            const gtsam::SharedNoiseModel& noise,
                             bool create_msg) {
+  // Factors with the same covariance share one model
+  const gtsam::SharedNoiseModel covariance =
+      lamp_utils::NoiseModelCache::Instance().Intern(noise);
+
   if (type == pose_graph_msgs::PoseGraphEdge::PRIOR) {
     return TrackPrior(key, transform, covariance);
   }
@@ -95,7 +109,7 @@ bool PoseGraph::TrackFactor(const gtsam::Symbol& key_from,
   if (create_msg) {
     auto msg =
         lamp_utils::GtsamToRosMsg(key_from, key_to, type, transform, covariance);
-    if (edges_.find(msg) != edges_.end()) {
+    if (edges_.Contains(msg)) {
       // gtg
       ROS_DEBUG_STREAM("Edge of type " << type << " from key "
                                        << gtsam::DefaultKeyFormatter(key_from)
@@ -104,8 +118,8 @@ bool PoseGraph::TrackFactor(const gtsam::Symbol& key_from,
                                        << " already exists.");
       return false;
     }
-    edges_.insert(msg);
-    edges_new_.insert(msg);
+    edges_.Insert(msg);
+    edges_new_.Insert(msg);
   }
 
   if (type == pose_graph_msgs::PoseGraphEdge::ODOM) {
@@ -119,6 +133,7 @@ bool PoseGraph::TrackFactor(const gtsam::Symbol& key_from,
     ROS_DEBUG_STREAM("Adding loop closure edge for key "
                      << gtsam::DefaultKeyFormatter(key_from) << " to key "
                      << gtsam::DefaultKeyFormatter(key_to));
+    loop_closure_slots_[LoopClosureId(key_from, key_to)] = nfg_.size();
     nfg_.add(gtsam::BetweenFactor<gtsam::Pose3>(
         key_from, key_to, transform, covariance));
   } else if (type == pose_graph_msgs::PoseGraphEdge::ARTIFACT) {
@@ -170,7 +185,7 @@ bool PoseGraph::TrackUWBFactor(const gtsam::Symbol& key_from,
                                     gtsam::Pose3(),
                                     noise);
 
-    if (edges_.find(msg) != edges_.end()) {
+    if (edges_.Contains(msg)) {
       ROS_DEBUG_STREAM("UWB range factor from key "
                        << gtsam::DefaultKeyFormatter(key_from) << " to key "
                        << gtsam::DefaultKeyFormatter(key_to)
@@ -179,8 +194,8 @@ bool PoseGraph::TrackUWBFactor(const gtsam::Symbol& key_from,
     }
     msg.range = range;
     msg.range_error = range_error;
-    edges_.insert(msg);
-    edges_new_.insert(msg);
+    edges_.Insert(msg);
+    edges_new_.Insert(msg);
   }
 
   nfg_.add(gtsam::RangeFactor<gtsam::Pose3, gtsam::Pose3>(
@@ -209,7 +224,7 @@ bool PoseGraph::TrackIMUFactor(const gtsam::Symbol& key_to,
                                     gtsam::Pose3(),
                                     noise);
 
-    if (edges_.find(msg) != edges_.end()) {
+    if (edges_.Contains(msg)) {
       ROS_DEBUG_STREAM("IMU factor for key "
                        << gtsam::DefaultKeyFormatter(key_to)
                        << " already exists.");
@@ -217,8 +232,8 @@ bool PoseGraph::TrackIMUFactor(const gtsam::Symbol& key_to,
     }
     msg.pose.position = meas;
     // msg.covariance[0] =
-    edges_.insert(msg);
-    edges_new_.insert(msg);
+    edges_.Insert(msg);
+    edges_new_.Insert(msg);
   }
 
   nfg_.add(factor);
@@ -228,56 +243,31 @@ bool PoseGraph::TrackIMUFactor(const gtsam::Symbol& key_to,
 bool PoseGraph::TrackArtifactFactor(const gtsam::Symbol& key_from,
                                     const gtsam::Symbol& key_to,
                                     const gtsam::Pose3& transform,
-                                    const gtsam::SharedNoiseModel& covariance,
+                                    const gtsam::SharedNoiseModel& noise,
                                     bool create_msg,
                                     bool update_value) {
+  const gtsam::SharedNoiseModel covariance =
+      lamp_utils::NoiseModelCache::Instance().Intern(noise);
   int type = pose_graph_msgs::PoseGraphEdge::ARTIFACT;
   auto msg =
       lamp_utils::GtsamToRosMsg(key_from, key_to, type, transform, covariance);
-  auto msg_found = edges_.find(msg);
+  auto msg_found = edges_.Find(msg);
 
-  if (msg_found != edges_.end()) {
+  if (msg_found) {
     ROS_DEBUG_STREAM("TrackArtifactFactor: Edge of type "
                      << type << " from key "
                      << gtsam::DefaultKeyFormatter(key_from) << " to key "
                      << gtsam::DefaultKeyFormatter(key_to)
                      << " already exists.");
 
-    // Check if there is any changes in the updated factor
-    bool diff_position = true, diff_covariance = true;
-
-    if (std::sqrt(
-            std::pow(msg_found->pose.position.x - msg.pose.position.x, 2) +
-            std::pow(msg_found->pose.position.y - msg.pose.position.y, 2) +
-            std::pow(msg_found->pose.position.z - msg.pose.position.z, 2)) <
-        0.1) {
-      diff_position = false;
-    }
-
-    // Check the lower right diagonal value of the covariance,
-    // that corresponds to position
-    if (std::sqrt(std::pow(msg_found->covariance[35] - msg.covariance[35], 2) +
-                  std::pow(msg_found->covariance[28] - msg.covariance[28], 2) +
-                  std::pow(msg_found->covariance[21] - msg.covariance[21], 2)) <
-        0.001) {
-      diff_covariance = false;
-    }
-
     // Hack: Removing loop closure edge
-    auto loopclose_msg =
-        lamp_utils::GtsamToRosMsg(key_from,
-                             key_to,
-                             pose_graph_msgs::PoseGraphEdge::LOOPCLOSE,
-                             transform,
-                             covariance);
-    auto loopclose_msg_found = edges_.find(loopclose_msg);
-    if (loopclose_msg_found != edges_.end()) {
+    if (edges_.Erase(
+            key_from, key_to, pose_graph_msgs::PoseGraphEdge::LOOPCLOSE)) {
       ROS_DEBUG_STREAM(
           "TrackArtifactFactor: Found and Removing Loop CLosure Edge (Hack)");
-      edges_.erase(loopclose_msg_found);
     }
 
-    if (!diff_position && !diff_covariance) {
+    if (!IsArtifactEdgeChanged(*msg_found, msg)) {
       ROS_DEBUG_STREAM("TrackArtifactFactor: Not updating values because "
                        "position and covariance only have small changes");
       return true;
@@ -285,13 +275,10 @@ bool PoseGraph::TrackArtifactFactor(const gtsam::Symbol& key_from,
 
 
     // Remove existing artifact edge message in edge_
-    edges_.erase(msg_found);
+    edges_.Erase(msg);
 
     // Remove existing artifact edge message in edges_new
-    auto new_msg_found = edges_new_.find(msg);
-    if (new_msg_found != edges_new_.end()) {
-      edges_new_.erase(new_msg_found);
-    }
+    edges_new_.Erase(msg);
 
     // Remove edge factor
     gtsam::NonlinearFactorGraph new_nfg;
@@ -310,11 +297,12 @@ bool PoseGraph::TrackArtifactFactor(const gtsam::Symbol& key_from,
       f++;
     }
     nfg_ = new_nfg;
+    RebuildFactorIndices();
   }
 
   if (create_msg) {
-    edges_.insert(msg);
-    edges_new_.insert(msg);
+    edges_.Insert(msg);
+    edges_new_.Insert(msg);
   }
 
   // Add the updated edge factor
@@ -324,6 +312,98 @@ bool PoseGraph::TrackArtifactFactor(const gtsam::Symbol& key_from,
   return true;
 }
 
+bool PoseGraph::IsArtifactEdgeChanged(const EdgeMessage& stored,
+                                      const EdgeMessage& msg) {
+  // Check if there is any changes in the updated factor
+  bool diff_position = true, diff_covariance = true;
+
+  if (std::sqrt(std::pow(stored.pose.position.x - msg.pose.position.x, 2) +
+                std::pow(stored.pose.position.y - msg.pose.position.y, 2) +
+                std::pow(stored.pose.position.z - msg.pose.position.z, 2)) <
+      0.1) {
+    diff_position = false;
+  }
+
+  // Check the lower right diagonal value of the covariance,
+  // that corresponds to position
+  if (std::sqrt(std::pow(stored.covariance[35] - msg.covariance[35], 2) +
+                std::pow(stored.covariance[28] - msg.covariance[28], 2) +
+                std::pow(stored.covariance[21] - msg.covariance[21], 2)) <
+      0.001) {
+    diff_covariance = false;
+  }
+  return diff_position || diff_covariance;
+}
+
+size_t PoseGraph::TrackFactors(const EdgeMessages& msgs) {
+  static lamp_utils::Histogram& track_factors_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram(
+          "pose_graph.track_factors_ms");
+  lamp_utils::ScopedLatency latency(track_factors_ms);
+
+  // Only the last observation of an artifact in the batch is applied
+  std::unordered_map<LoopClosureId, size_t, LoopClosureIdHash> last_artifact;
+  for (size_t i = 0; i < msgs.size(); i++) {
+    if (msgs[i].type == pose_graph_msgs::PoseGraphEdge::ARTIFACT)
+      last_artifact[LoopClosureId(msgs[i].key_from, msgs[i].key_to)] = i;
+  }
+
+  edges_.Reserve(edges_.size() + msgs.size());
+  edges_new_.Reserve(edges_new_.size() + msgs.size());
+
+  // Update the stored artifact edges, the factors of the changed ones are
+  // replaced in a single pass over the graph below
+  std::vector<bool> b_add_artifact(msgs.size(), false);
+  std::unordered_set<LoopClosureId, LoopClosureIdHash> replaced;
+  for (const auto& kv : last_artifact) {
+    const EdgeMessage& msg = msgs[kv.second];
+    auto msg_found = edges_.Find(msg);
+    if (msg_found) {
+      // Hack: Removing loop closure edge, as in TrackArtifactFactor
+      edges_.Erase(
+          msg.key_from, msg.key_to, pose_graph_msgs::PoseGraphEdge::LOOPCLOSE);
+      if (!IsArtifactEdgeChanged(*msg_found, msg))
+        continue;
+      replaced.insert(kv.first);
+    }
+    edges_.Assign(msg);
+    edges_new_.Assign(msg);
+    b_add_artifact[kv.second] = true;
+  }
+
+  if (!replaced.empty()) {
+    gtsam::NonlinearFactorGraph new_nfg;
+    new_nfg.reserve(nfg_.size() + msgs.size());
+    for (const auto& factor : nfg_) {
+      if (factor && factor->size() >= 2 &&
+          replaced.count(LoopClosureId(factor->keys()[0], factor->keys()[1])))
+        continue;
+      new_nfg.add(factor);
+    }
+    nfg_ = new_nfg;
+    RebuildFactorIndices();
+  } else {
+    nfg_.reserve(nfg_.size() + msgs.size());
+  }
+
+  // Add the factors in message order
+  size_t num_tracked = 0;
+  for (size_t i = 0; i < msgs.size(); i++) {
+    const EdgeMessage& msg = msgs[i];
+    if (msg.type != pose_graph_msgs::PoseGraphEdge::ARTIFACT) {
+      num_tracked += TrackFactor(msg);
+    } else if (b_add_artifact[i]) {
+      nfg_.add(gtsam::BetweenFactor<gtsam::Pose3>(
+          msg.key_from,
+          msg.key_to,
+          lamp_utils::MessageToPose(msg),
+          lamp_utils::MessageToCovariance(msg)));
+      num_tracked++;
+    }
+  }
+  return num_tracked;
+}
+
 bool PoseGraph::TrackNode(const Node& node) {
   return TrackNode(node.stamp, node.key, node.pose, node.covariance);
 }
@@ -337,16 +417,14 @@ bool PoseGraph::TrackNode(const NodeMessage& msg) {
     return false;
 
   // make copy to modify ID
-  auto msg_found = nodes_.find(msg);
-  if (msg_found == nodes_.end()) {
+  if (!nodes_.Contains(msg.key)) {
     NodeMessage m = msg;
     if (m.ID.empty() && !symbol_id_map.empty())
       m.ID = symbol_id_map(msg.key);
-    nodes_.insert(m);
-    nodes_new_.insert(m);
+    nodes_.Insert(m);
+    nodes_new_.Insert(m);
   } else {
-    nodes_.erase(msg_found);
-    nodes_.insert(msg);
+    nodes_.Assign(msg);
   }
   return true;
 }
@@ -358,18 +436,25 @@ bool PoseGraph::TrackNode(const ros::Time& stamp,
                           const std::string& id,
                           bool create_msg) {
   // TODO use covariance?
+  if (IsMarginalized(key)) {
+    return false;
+  }
 
   if (values_.exists(key)) {
     values_.update(key, pose);
   } else {
     values_.insert(key, pose);
   }
+  robot_poses_.Assign(key, pose);
+  robot_chains_.Insert(key);
+  if (!id.empty() && lamp_utils::IsArtifactPrefix(key.chr()))
+    artifact_ids_.Link(key, id);
   if (values_new_.exists(key)) {
     values_new_.update(key, pose);
   } else {
     values_new_.insert(key, pose);
   }
-  keyed_stamps[key] = stamp;
+  keyed_stamps.Assign(key, stamp);
 
   if (create_msg) {
     NodeMessage msg =
@@ -378,26 +463,37 @@ bool PoseGraph::TrackNode(const ros::Time& stamp,
     if (msg.ID.empty() && !symbol_id_map.empty())
       msg.ID = symbol_id_map(msg.key);
 
-    // make copy to modify ID
-    auto msg_found = nodes_.find(msg);
-    if (msg_found == nodes_.end()) {
-      NodeMessage m = msg;
-      nodes_.insert(m);
-      nodes_new_.insert(m);
+    if (!nodes_.Contains(msg.key)) {
+      nodes_.Insert(msg);
+      nodes_new_.Insert(msg);
     } else {
-      nodes_.erase(msg_found);
-      nodes_.insert(msg);
+      nodes_.Assign(msg);
     }
   }
 
   return true;
 }
 
+bool PoseGraph::UpdateNodePose(const gtsam::Symbol& key,
+                               const gtsam::Pose3& pose) {
+  if (!HasKey(key))
+    return false;
+  values_.update(key, pose);
+  robot_poses_.Assign(key, pose);
+  if (values_new_.exists(key)) {
+    values_new_.update(key, pose);
+  } else {
+    values_new_.insert(key, pose);
+  }
+  nodes_.SetPose(key, lamp_utils::GtsamToRosMsg(pose));
+  return true;
+}
+
 bool PoseGraph::TrackPrior(const EdgeMessage& msg) {
   if (msg.type != pose_graph_msgs::PoseGraphEdge::PRIOR) {
     return TrackFactor(msg);
   }
-  if (priors_.find(msg) != priors_.end()) {
+  if (priors_.Contains(msg)) {
     // prior already exists
     ROS_DEBUG_STREAM("Prior at key " << gtsam::DefaultKeyFormatter(msg.key_from)
                                      << " already exists.");
@@ -419,8 +515,8 @@ bool PoseGraph::TrackPrior(const EdgeMessage& msg) {
   if (!TrackPrior(gtsam::Symbol(msg.key_from), delta, noise, false))
     return false;
 
-  priors_new_.insert(msg);
-  priors_.insert(msg);
+  priors_new_.Insert(msg);
+  priors_.Insert(msg);
   return true;
 }
 
@@ -434,20 +530,22 @@ bool PoseGraph::TrackPrior(const Node& node) {
 
 bool PoseGraph::TrackPrior(const gtsam::Symbol& key,
                            const gtsam::Pose3& pose,
-                           const gtsam::SharedNoiseModel& covariance,
+                           const gtsam::SharedNoiseModel& noise,
                            bool create_msg) {
+  const gtsam::SharedNoiseModel covariance =
+      lamp_utils::NoiseModelCache::Instance().Intern(noise);
   if (create_msg) {
     auto msg = lamp_utils::GtsamToRosMsg(
         key, key, pose_graph_msgs::PoseGraphEdge::PRIOR, pose, covariance);
 
-    if (priors_.find(msg) != priors_.end()) {
+    if (priors_.Contains(msg)) {
       // prior already exists
       ROS_DEBUG_STREAM("Prior at key " << gtsam::DefaultKeyFormatter(key)
                                        << " already exists.");
       return false;
     }
-    priors_new_.insert(msg);
-    priors_.insert(msg);
+    priors_new_.Insert(msg);
+    priors_.Insert(msg);
   }
   ROS_DEBUG_STREAM("Adding prior factor for key "
                    << gtsam::DefaultKeyFormatter(key));
@@ -476,125 +574,137 @@ void PoseGraph::RemoveRobotFromGraph(std::string robot_name){
 
 void PoseGraph::UpdateLoopClosures(const GraphMsgPtr& msg) {
   ROS_DEBUG("Update loop closures to reflect inliers");
-  // Remove edge loop closure messages
-  EdgeSet new_edges;
-  auto e = edges_.begin();
-  while (e != edges_.end()) {
-    if (e->type != pose_graph_msgs::PoseGraphEdge::LOOPCLOSE) {
-      new_edges.insert(*e);
-    }
-    e++;
+  // Insert the inlier loop closures the graph does not have yet
+  std::unordered_set<LoopClosureId, LoopClosureIdHash> inliers;
+  for (const auto& edge : msg->edges) {
+    if (edge.type != pose_graph_msgs::PoseGraphEdge::LOOPCLOSE)
+      continue;
+    const LoopClosureId id(edge.key_from, edge.key_to);
+    inliers.insert(id);
+    edges_.Insert(edge);
+    if (loop_closure_slots_.count(id))
+      continue;
+    loop_closure_slots_[id] = nfg_.size();
+    nfg_.add(
+        gtsam::BetweenFactor<gtsam::Pose3>(gtsam::Symbol(edge.key_from),
+                                           gtsam::Symbol(edge.key_to),
+                                           lamp_utils::MessageToPose(edge),
+                                           lamp_utils::MessageToCovariance(edge)));
   }
 
-  // Remove edge loop closure factors
-  gtsam::NonlinearFactorGraph new_nfg;
-  for (const auto& factor : nfg_) {
-    if (boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3>>(
-            factor)) {
-      if (factor->front() + 1 == factor->back()) {
-        new_nfg.add(factor);
-      }
-    } else {
-      new_nfg.add(factor);
-    }
+  // Remove the loop closures (edge messages and factors) that are outliers
+  std::vector<LoopClosureId> outliers;
+  for (const auto& slot : loop_closure_slots_) {
+    if (!inliers.count(slot.first))
+      outliers.push_back(slot.first);
   }
-  // Insert the inlier loop closures
-  for (const auto& edge : msg->edges) {
-    if (edge.type == pose_graph_msgs::PoseGraphEdge::LOOPCLOSE) {
-      new_edges.insert(edge);
-      new_nfg.add(
-          gtsam::BetweenFactor<gtsam::Pose3>(gtsam::Symbol(edge.key_from),
-                                             gtsam::Symbol(edge.key_to),
-                                             lamp_utils::MessageToPose(edge),
-                                             lamp_utils::MessageToCovariance(edge)));
-    }
+  for (const LoopClosureId& id : outliers) {
+    edges_.Erase(
+        id.first, id.second, pose_graph_msgs::PoseGraphEdge::LOOPCLOSE);
+    const size_t slot = loop_closure_slots_.at(id);
+    loop_closure_slots_.erase(id);
+    RemoveFactorSlot(slot);
   }
-
-  edges_ = new_edges;
-  nfg_ = new_nfg;
 }
 
-void PoseGraph::RemoveEdgesWithPrefix(unsigned char prefix){
-  ROS_DEBUG("Removing edges msg");
-  // Remove edge messages
-  EdgeSet new_edges;
-  auto e = edges_.begin();
-  while (e != edges_.end()) {
-    if (gtsam::Symbol(e->key_from).chr() != prefix &&
-        gtsam::Symbol(e->key_to).chr() != prefix) {
-      // Is an edge to remove
-      new_edges.insert(*e);
-    }
-    e++;
-  }
-  edges_ = new_edges;
-
-  // Remove prior messages
-  EdgeSet new_priors;
-  auto p = priors_.begin();
-  while (p != priors_.end()) {
-    if (gtsam::Symbol(p->key_from).chr() != prefix &&
-        gtsam::Symbol(p->key_to).chr() != prefix) {
-      // Is an edge to remove
-      new_priors.insert(*p);
+void PoseGraph::RemoveFactorSlot(size_t slot) {
+  IndexNewFactors();
+  const gtsam::NonlinearFactor::shared_ptr removed = nfg_.at(slot);
+  if (removed) {
+    for (gtsam::Key k : removed->keys())
+      factor_prefixes_.Remove(k, slot);
+    if (removed->size() == 2) {
+      auto it = loop_closure_slots_.find(
+          LoopClosureId(removed->front(), removed->back()));
+      if (it != loop_closure_slots_.end() && it->second == slot)
+        loop_closure_slots_.erase(it);
     }
-    p++;
   }
-  priors_ = new_priors;
 
-  ROS_DEBUG("Removing edges gtsam");
-  // Remove edge factors
-  gtsam::NonlinearFactorGraph new_nfg;
-  auto f = nfg_.begin();
-  while (f != nfg_.end()) {
-    auto factor = *f;
-    if (gtsam::Symbol(factor->front()).chr() != prefix &&
-        gtsam::Symbol(factor->back()).chr() != prefix) {
-      // If this factor does not connect to nodes with prefix
-      // Add to new nonlinear factor graph
-      new_nfg.add(factor);
+  const size_t last = nfg_.size() - 1;
+  if (slot != last) {
+    const gtsam::NonlinearFactor::shared_ptr moved = nfg_.at(last);
+    if (moved) {
+      for (gtsam::Key k : moved->keys())
+        factor_prefixes_.Move(k, last, slot);
+    }
+    if (moved && moved->size() == 2) {
+      auto it =
+          loop_closure_slots_.find(LoopClosureId(moved->front(), moved->back()));
+      if (it != loop_closure_slots_.end() && it->second == last)
+        it->second = slot;
     }
-    f++;
+    nfg_.replace(slot, moved);
   }
-  nfg_ = new_nfg;
+  nfg_.resize(last);
+  num_indexed_factors_ = last;
 }
 
-void PoseGraph::RemoveValuesWithPrefix(unsigned char prefix){
-  ROS_DEBUG("Removing values msg");
-  // Remove edge messages
-
-  NodeSet new_nodes;
-  auto n = nodes_.begin();
+void PoseGraph::IndexNewFactors() {
+  for (size_t i = num_indexed_factors_; i < nfg_.size(); i++) {
+    const auto& factor = nfg_.at(i);
+    if (!factor)
+      continue;
+    for (gtsam::Key k : factor->keys())
+      factor_prefixes_.Add(k, i);
+  }
+  num_indexed_factors_ = nfg_.size();
+}
 
-  while (n != nodes_.end()) {
-    if (gtsam::Symbol(n->key).chr() != prefix){
-      // Is an edge to keep
-      new_nodes.insert(*n);
+void PoseGraph::RebuildFactorIndices() {
+  loop_closure_slots_.clear();
+  for (size_t i = 0; i < nfg_.size(); i++) {
+    const auto& factor = nfg_.at(i);
+    if (factor && factor->size() == 2 &&
+        edges_.Contains(factor->front(),
+                        factor->back(),
+                        pose_graph_msgs::PoseGraphEdge::LOOPCLOSE)) {
+      loop_closure_slots_[LoopClosureId(factor->front(), factor->back())] = i;
     }
-    n++;
   }
+  factor_prefixes_.clear();
+  num_indexed_factors_ = 0;
+  IndexNewFactors();
+}
 
-  nodes_ = new_nodes;
+void PoseGraph::RemoveEdgesWithPrefix(unsigned char prefix){
+  ROS_DEBUG("Removing edges msg");
+  // Remove edge and prior messages touching the prefix
+  edges_.ErasePrefix(prefix);
+  priors_.ErasePrefix(prefix);
 
-  ROS_DEBUG("Removing values gtsam");
-  // Remove gtsam values
-  gtsam::Values new_values;
-  auto v = values_.begin();
-
-  while (v != values_.end()) {
-    auto value = *v;
-    if (gtsam::Symbol(value.key).chr() != prefix){
-      // Is an edge to keep
-      new_values.insert(value.key, value.value);
-
-      // Update the latest key
-      key = value.key;
-    }
-    v++;
-  }
+  ROS_DEBUG("Removing edges gtsam");
+  // Remove edge factors, from the back so the factor moved into a freed slot
+  // is never one still to remove
+  IndexNewFactors();
+  std::vector<size_t> slots = factor_prefixes_.Slots(prefix);
+  std::sort(slots.begin(), slots.end(), std::greater<size_t>());
+  for (size_t slot : slots)
+    RemoveFactorSlot(slot);
+}
 
-  values_ = new_values;
+void PoseGraph::RemoveValuesWithPrefix(unsigned char prefix){
+  ROS_DEBUG("Removing values msg");
+  // Remove node messages
+  nodes_.ErasePrefix(prefix);
 
+  ROS_DEBUG("Removing values gtsam");
+  // Remove gtsam values, the keys of a prefix are contiguous
+  std::vector<gtsam::Key> keys;
+  for (auto v = values_.lower_bound(gtsam::Symbol(prefix, 0));
+       v != values_.end() && gtsam::Symbol(v->key).chr() == prefix;
+       v++) {
+    keys.push_back(v->key);
+  }
+  for (gtsam::Key k : keys)
+    values_.erase(k);
+  robot_poses_.ErasePrefix(prefix);
+  robot_chains_.ErasePrefix(prefix);
+  artifact_ids_.ErasePrefix(prefix);
+
+  // Update the latest key
+  if (!values_.empty())
+    key = values_.rbegin()->key;
 }
 
 // DEPRECATED!!
@@ -604,6 +714,15 @@ void PoseGraph::AddNewValues(const gtsam::Values& new_values) {
     if (!values_.tryInsert(v.key, v.value).second) {
       values_.update(v.key, v.value);
     }
+    robot_chains_.Insert(v.key);
+    if (lamp_utils::RobotPoseIndex::IsIndexed(v.key)) {
+      auto pose =
+          dynamic_cast<const gtsam::GenericValue<gtsam::Pose3>*>(&v.value);
+      if (pose)
+        robot_poses_.Assign(v.key, pose->value());
+      else
+        robot_poses_.Erase(v.key);
+    }
     if (!values_new_.tryInsert(v.key, v.value).second) {
       values_new_.update(v.key, v.value);
     }
@@ -619,7 +738,14 @@ void PoseGraph::Initialize(const gtsam::Symbol& initial_key,
                            const gtsam::Pose3& pose,
                            const Diagonal::shared_ptr& covariance) {
   nfg_ = gtsam::NonlinearFactorGraph();
+  loop_closure_slots_.clear();
+  factor_prefixes_.clear();
+  num_indexed_factors_ = 0;
   values_ = gtsam::Values();
+  robot_poses_.clear();
+  robot_chains_.clear();
+  for (gtsam::Key marginalized : marginalized_)
+    robot_chains_.Insert(marginalized);
 
   b_first_ = true;
 
@@ -639,28 +765,117 @@ void PoseGraph::InsertKeyedScan(const gtsam::Symbol& key,
   keyed_scans.insert(std::pair<gtsam::Symbol, PointCloud::ConstPtr>(key, scan));
 }
 
-void PoseGraph::InsertKeyedStamp(const gtsam::Symbol& key, const ros::Time& stamp) {
-  if (HasStamp(key)) {
-    auto itr = keyed_stamps.find(key);
-    itr->second = stamp;
+PointCloud::ConstPtr PoseGraph::GetKeyedScan(const gtsam::Symbol& key) {
+  auto it = keyed_scans.find(key);
+  if (it != keyed_scans.end())
+    return it->second;
+  if (IsMarginalized(key))
+    return nullptr;
+  PointCloud::ConstPtr scan;
+  if (scan_archive_ && scan_archive_->HasScan(key))
+    scan = scan_archive_->ReadScan(key);
+  else if (scan_loader_)
+    scan = scan_loader_->Take(key);
+  if (scan != nullptr)
+    keyed_scans[key] = scan;
+  return scan;
+}
+
+PointCloud::ConstPtr PoseGraph::GetKeyedScan(const gtsam::Symbol& key) const {
+  auto it = keyed_scans.find(key);
+  if (it != keyed_scans.end())
+    return it->second;
+  if (IsMarginalized(key))
+    return nullptr;
+  if (scan_archive_ && scan_archive_->HasScan(key))
+    return scan_archive_->ReadScan(key);
+  return scan_loader_ ? scan_loader_->Get(key) : nullptr;
+}
+
+std::shared_ptr<const PoseGraph> PoseGraph::Snapshot() const {
+  static lamp_utils::Histogram& snapshot_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram(
+          "pose_graph.snapshot_ms");
+  lamp_utils::ScopedLatency latency(snapshot_ms);
+
+  auto snapshot = std::make_shared<PoseGraph>(*this);
+  snapshot->symbol_id_map = SymbolIdMapping();
+  snapshot->ClearIncrementalMessages();
+  return snapshot;
+}
+
+std::vector<gtsam::Symbol> PoseGraph::GetKeyedScanKeys() const {
+  std::vector<gtsam::Symbol> keys;
+  keys.reserve(keyed_scans.size());
+  for (const auto& scan : keyed_scans)
+    keys.push_back(scan.first);
+  if (scan_archive_ || scan_loader_) {
+    const size_t n_resident = keys.size();
+    std::vector<gtsam::Key> stored;
+    if (scan_archive_)
+      stored = scan_archive_->ScanKeys();
+    if (scan_loader_) {
+      stored.insert(stored.end(),
+                    scan_loader_->Keys().begin(),
+                    scan_loader_->Keys().end());
+      std::sort(stored.begin(), stored.end());
+      stored.erase(std::unique(stored.begin(), stored.end()), stored.end());
+    }
+    for (const gtsam::Key& key : stored) {
+      if (keyed_scans.find(key) == keyed_scans.end() && !IsMarginalized(key))
+        keys.push_back(key);
+    }
+    std::inplace_merge(keys.begin(), keys.begin() + n_resident, keys.end());
   }
-  keyed_stamps.insert(std::pair<gtsam::Symbol, ros::Time>(key, stamp));
+  return keys;
+}
+
+void PoseGraph::UpdateMemoryAccounts() {
+  size_t scan_bytes = 0;
+  for (const auto& scan : keyed_scans) {
+    if (scan.second != nullptr) {
+      scan_bytes += sizeof(PointCloud) +
+          scan.second->points.capacity() * sizeof(PointCloud::PointType);
+    }
+  }
+  // Read in the background and not taken yet
+  if (scan_loader_)
+    scan_bytes += scan_loader_->ResidentBytes();
+  scans_account_.Set(scan_bytes);
+  nodes_account_.Set(nodes_.MemoryBytes() + nodes_new_.MemoryBytes());
+  edges_account_.Set(edges_.MemoryBytes() + priors_.MemoryBytes() +
+                     edges_new_.MemoryBytes() + priors_new_.MemoryBytes());
+}
+
+void PoseGraph::InsertKeyedStamp(const gtsam::Symbol& key, const ros::Time& stamp) {
+  keyed_stamps.Assign(key, stamp);
 }
 
 void PoseGraph::InsertStampedOdomKey(double seconds, const gtsam::Symbol& key) {
-  stamp_to_odom_key.insert(std::pair<double, gtsam::Symbol>(seconds, key));
+  stamp_to_odom_key.Insert(seconds, key);
 }
 
 bool PoseGraph::CheckGraphValid() const {
   // Check that pose graph is valid (i.e. no missing odom edges)
-  for (const gtsam::Symbol& k : values_.keys()) {
-    if (lamp_utils::IsRobotPrefix(k.chr())) {
-      if (k.index() > 0 && !values_.exists(k - 1)) {
-        ROS_ERROR("Missing node %s in pose graph. ",
-                  gtsam::DefaultKeyFormatter(k - 1));
-        return false;
-      }
-    }
+  if (robot_chains_.IsContiguous())
+    return true;
+  for (const auto& gap : robot_chains_.Gaps(5)) {
+    ROS_ERROR("Missing nodes %s to %s in pose graph. ",
+              gtsam::DefaultKeyFormatter(gap.first).c_str(),
+              gtsam::DefaultKeyFormatter(gap.second).c_str());
   }
+  ROS_ERROR("%lu nodes missing in pose graph.", robot_chains_.NumMissing());
+  return false;
+}
+
+bool PoseGraph::EraseValue(const gtsam::Symbol& key) {
+  if (!values_.exists(key))
+    return false;
+  values_.erase(key);
+  if (values_new_.exists(key))
+    values_new_.erase(key);
+  robot_poses_.Erase(key);
+  if (!IsMarginalized(key))
+    robot_chains_.Erase(key);
   return true;
 }
@@ -0,0 +1,214 @@
+/*
+PoseGraphDelta.cc
+Sequence numbered delta encoding of the incremental pose graph stream
+*/
+
+#include "lamp_utils/PoseGraphDelta.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+#include "lamp_utils/CommonFunctions.h"
+
+namespace lamp_utils {
+
+namespace {
+
+const double kOrientationScale = 32767.0 * std::sqrt(2.0);
+
+bool SameQuantizedPose(const pose_graph_msgs::QuantizedPose& lhs,
+                       const pose_graph_msgs::QuantizedPose& rhs) {
+  return lhs.largest == rhs.largest &&
+      std::equal(lhs.position.begin(), lhs.position.end(),
+                 rhs.position.begin()) &&
+      std::equal(lhs.orientation.begin(), lhs.orientation.end(),
+                 rhs.orientation.begin());
+}
+
+} // namespace
+
+pose_graph_msgs::QuantizedPose QuantizePose(gtsam::Key key,
+                                            const geometry_msgs::Pose& pose,
+                                            double position_resolution) {
+  pose_graph_msgs::QuantizedPose q;
+  q.key = key;
+  q.position[0] = std::lround(pose.position.x / position_resolution);
+  q.position[1] = std::lround(pose.position.y / position_resolution);
+  q.position[2] = std::lround(pose.position.z / position_resolution);
+
+  double c[4] = {pose.orientation.x,
+                 pose.orientation.y,
+                 pose.orientation.z,
+                 pose.orientation.w};
+  double norm = std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2] +
+                          c[3] * c[3]);
+  if (norm < 1e-12) {
+    c[3] = norm = 1;
+  }
+  int largest = 0;
+  for (int i = 1; i < 4; i++) {
+    if (std::abs(c[i]) > std::abs(c[largest]))
+      largest = i;
+  }
+  // q and -q are the same rotation, keep the largest component positive
+  const double sign = c[largest] < 0 ? -1.0 : 1.0;
+  q.largest = largest;
+  for (int i = 0, j = 0; i < 4; i++) {
+    if (i == largest)
+      continue;
+    const double v = std::round(sign * c[i] / norm * kOrientationScale);
+    q.orientation[j++] =
+        static_cast<int16_t>(std::max(-32767.0, std::min(32767.0, v)));
+  }
+  return q;
+}
+
+geometry_msgs::Pose DequantizePose(const pose_graph_msgs::QuantizedPose& q,
+                                   double position_resolution) {
+  geometry_msgs::Pose pose;
+  pose.position.x = q.position[0] * position_resolution;
+  pose.position.y = q.position[1] * position_resolution;
+  pose.position.z = q.position[2] * position_resolution;
+
+  double c[4];
+  double sum_sq = 0;
+  for (int i = 0, j = 0; i < 4; i++) {
+    if (i == q.largest)
+      continue;
+    c[i] = q.orientation[j++] / kOrientationScale;
+    sum_sq += c[i] * c[i];
+  }
+  c[q.largest] = std::sqrt(std::max(0.0, 1.0 - sum_sq));
+  const double norm = std::sqrt(sum_sq + c[q.largest] * c[q.largest]);
+  pose.orientation.x = c[0] / norm;
+  pose.orientation.y = c[1] / norm;
+  pose.orientation.z = c[2] / norm;
+  pose.orientation.w = c[3] / norm;
+  return pose;
+}
+
+pose_graph_msgs::PoseGraph::Ptr
+PoseGraphDeltaEncoder::Encode(const PoseGraph& graph) {
+  const bool b_keyframe = b_keyframe_requested_ ||
+      (params_.keyframe_interval > 0 &&
+       messages_since_keyframe_ >= params_.keyframe_interval);
+
+  pose_graph_msgs::PoseGraph::Ptr msg(new pose_graph_msgs::PoseGraph);
+  msg->header.frame_id = graph.fixed_frame_id;
+  msg->header.stamp = ros::Time::now();
+  msg->incremental = !b_keyframe;
+  msg->keyframe = b_keyframe;
+  msg->position_resolution = params_.position_resolution;
+
+  const NodeStore& nodes = b_keyframe ? graph.GetNodes() : graph.GetNewNodes();
+  const EdgeStore& edges = b_keyframe ? graph.GetEdges() : graph.GetNewEdges();
+  const EdgeStore& priors =
+      b_keyframe ? graph.GetPriors() : graph.GetNewPriors();
+  nodes.AppendTo(&msg->nodes);
+  msg->edges.reserve(edges.size() + priors.size());
+  edges.AppendTo(&msg->edges);
+  priors.AppendTo(&msg->edges);
+  msg->marginalized_keys = b_keyframe ? graph.GetMarginalizedKeys()
+                                      : graph.GetNewMarginalizedKeys();
+
+  if (b_keyframe)
+    sent_poses_.clear();
+  for (gtsam::Key marginalized : msg->marginalized_keys) {
+    sent_poses_.erase(marginalized);
+  }
+  std::unordered_set<gtsam::Key> sent_in_full;
+  for (const auto& node : msg->nodes) {
+    sent_poses_[node.key] =
+        QuantizePose(node.key, node.pose, params_.position_resolution);
+    sent_in_full.insert(node.key);
+  }
+
+  // Values modified since the last publish (tracked, merged or republished
+  // after optimization), only send those that moved by a quantization step
+  if (!b_keyframe) {
+    for (const auto& key_value : graph.GetNewValues()) {
+      const auto* value =
+          dynamic_cast<const gtsam::GenericValue<gtsam::Pose3>*>(
+              &key_value.value);
+      if (value == nullptr || sent_in_full.count(key_value.key))
+        continue;
+      auto sent = sent_poses_.find(key_value.key);
+      // Nodes not sent yet arrive with their node message
+      if (sent == sent_poses_.end())
+        continue;
+      auto update = QuantizePose(key_value.key,
+                                 GtsamToRosMsg(value->value()),
+                                 params_.position_resolution);
+      if (SameQuantizedPose(update, sent->second))
+        continue;
+      sent->second = update;
+      msg->pose_updates.push_back(update);
+    }
+  }
+
+  if (!b_keyframe && msg->nodes.empty() && msg->edges.empty() &&
+      msg->pose_updates.empty() && msg->marginalized_keys.empty()) {
+    return nullptr;
+  }
+
+  msg->sequence = sequence_++;
+  if (b_keyframe) {
+    b_keyframe_requested_ = false;
+    messages_since_keyframe_ = 0;
+  } else {
+    messages_since_keyframe_++;
+  }
+  return msg;
+}
+
+PoseGraphDeltaDecoder::Status
+PoseGraphDeltaDecoder::Decode(const GraphMsgPtr& msg, GraphMsgPtr* decoded) {
+  if (msg->position_resolution <= 0) {
+    *decoded = msg;
+    return Status::ACCEPTED;
+  }
+
+  if (msg->keyframe) {
+    nodes_.clear();
+    b_synchronized_ = true;
+  } else if (!b_synchronized_) {
+    return Status::GAP;
+  } else if (msg->sequence != next_sequence_) {
+    // Sequences only move forward, a smaller one was already applied
+    if (static_cast<int32_t>(msg->sequence - next_sequence_) < 0)
+      return Status::STALE;
+    b_synchronized_ = false;
+    return Status::GAP;
+  }
+  next_sequence_ = msg->sequence + 1;
+
+  for (const auto& node : msg->nodes) {
+    nodes_[node.key] = node;
+  }
+  for (gtsam::Key marginalized : msg->marginalized_keys) {
+    nodes_.erase(marginalized);
+  }
+  if (msg->pose_updates.empty()) {
+    *decoded = msg;
+    return Status::ACCEPTED;
+  }
+
+  pose_graph_msgs::PoseGraph::Ptr expanded(
+      new pose_graph_msgs::PoseGraph(*msg));
+  expanded->pose_updates.clear();
+  for (const auto& update : msg->pose_updates) {
+    auto node = nodes_.find(update.key);
+    if (node == nodes_.end()) {
+      ROS_WARN_STREAM("PoseGraphDeltaDecoder: Pose update for unknown node "
+                      << gtsam::DefaultKeyFormatter(update.key));
+      continue;
+    }
+    node->second.pose = DequantizePose(update, msg->position_resolution);
+    expanded->nodes.push_back(node->second);
+  }
+  *decoded = expanded;
+  return Status::ACCEPTED;
+}
+
+} // namespace lamp_utils
@@ -1,174 +1,163 @@
 #pragma once
 
-#include <fstream>
-
-#include <minizip/unzip.h>
-#include <minizip/zip.h>
+#include <algorithm>
+#include <sstream>
+#include <thread>
 
 #include <rosbag/bag.h>
 #include <rosbag/query.h>
 #include <rosbag/view.h>
 
 #include "lamp_utils/PoseGraph.h"
+#include "lamp_utils/ZipScanReader.h"
 
 std::string absPath(const std::string& relPath) {
   return boost::filesystem::canonical(boost::filesystem::path(relPath))
       .string();
 }
 
-bool writeFileToZip(zipFile& zip, const std::string& filename) {
-  // this code is inspired by
-  // http://www.vilipetek.com/2013/11/22/zippingunzipping-files-in-c/
-  static const unsigned int BUFSIZE = 2048;
-
-  zip_fileinfo zi = {0};
-  tm_zip& tmZip = zi.tmz_date;
-  time_t rawtime;
-  time(&rawtime);
-  auto timeinfo = localtime(&rawtime);
-  tmZip.tm_sec = timeinfo->tm_sec;
-  tmZip.tm_min = timeinfo->tm_min;
-  tmZip.tm_hour = timeinfo->tm_hour;
-  tmZip.tm_mday = timeinfo->tm_mday;
-  tmZip.tm_mon = timeinfo->tm_mon;
-  tmZip.tm_year = timeinfo->tm_year;
+bool PoseGraph::Save(const std::string& filename) const {
+  std::lock_guard<std::mutex> lock(archive_writer_->mutex);
+  std::shared_ptr<lamp_utils::PoseGraphArchiveWriter>& archive_writer =
+      archive_writer_->writers[filename];
+
+  // Continue the archive of the last save to this file
+  if (!archive_writer) {
+    archive_writer = std::make_shared<lamp_utils::PoseGraphArchiveWriter>();
+    // Saving over the loaded archive keeps its scans, they are still mapped
+    const bool b_append =
+        scan_archive_ && scan_archive_->filename() == filename;
+    if (!archive_writer->Open(filename, b_append)) {
+      ROS_ERROR_STREAM("PoseGraph::Save: Failed to open " << filename);
+      archive_writer_->writers.erase(filename);
+      return false;
+    }
+  }
 
-  int err = zipOpenNewFileInZip(zip,
-                                filename.c_str(),
-                                &zi,
-                                nullptr,
-                                0,
-                                nullptr,
-                                0,
-                                nullptr,
-                                Z_DEFLATED,
-                                Z_DEFAULT_COMPRESSION);
+  int n_appended = 0;
+  for (const gtsam::Symbol& key : GetKeyedScanKeys()) {
+    // Scans that took over those of marginalized nodes since they were
+    // written are written again
+    const uint32_t revision = GetScanRevision(key);
+    const bool b_replace = archive_writer->HasScan(key) &&
+        archive_writer->ScanRevision(key) != revision;
+    if (archive_writer->HasScan(key) && !b_replace)
+      continue;
+    if (!values_.exists(key)) {
+      ROS_WARN("PoseGraph::Save: Key %lu associated with a scan does not exist "
+               "in values.",
+               gtsam::Key(key));
+      return false;
+    }
 
-  if (err != ZIP_OK) {
-    ROS_ERROR_STREAM("Failed to add entry \"" << filename << "\" to zip file.");
-    return false;
+    bool b_appended = false;
+    auto scan = keyed_scans.find(key);
+    if (scan != keyed_scans.end() && b_replace) {
+      b_appended = archive_writer->ReplaceScan(
+          key,
+          keyed_stamps.Find(key).value_or(ros::Time()),
+          *scan->second,
+          revision);
+    } else if (scan != keyed_scans.end()) {
+      b_appended = archive_writer->AppendScan(
+          key,
+          keyed_stamps.Find(key).value_or(ros::Time()),
+          *scan->second,
+          revision);
+    } else if (scan_archive_ && scan_archive_->HasScan(key)) {
+      // Not paged in yet, copy the compressed block from the loaded archive
+      const char* block;
+      size_t block_size;
+      ros::Time stamp;
+      b_appended =
+          scan_archive_->GetScanBlock(key, &block, &block_size, &stamp) &&
+          archive_writer->AppendScanBlock(key, block, block_size);
+    } else {
+      // Not taken from the loaded zip yet
+      PointCloud::ConstPtr loaded = GetKeyedScan(key);
+      b_appended = loaded != nullptr &&
+          archive_writer->AppendScan(
+              key,
+              keyed_stamps.Find(key).value_or(ros::Time()),
+              *loaded,
+              revision);
+    }
+    if (!b_appended) {
+      ROS_ERROR("PoseGraph::Save: Failed to save the scan of key %lu.",
+                gtsam::Key(key));
+      return false;
+    }
+    ++n_appended;
   }
-  char buf[BUFSIZE];
-  unsigned long nRead = 0;
 
-  std::ifstream is(filename);
-  if (is.bad()) {
-    ROS_ERROR_STREAM("Could not read file \"" << filename
-                                              << "\" to be added to zip file.");
-    return false;
-  }
-  while (err == ZIP_OK && is.good()) {
-    is.read(buf, BUFSIZE);
-    unsigned int nRead = (unsigned int)is.gcount();
-    if (nRead)
-      err = zipWriteInFileInZip(zip, buf, nRead);
-    else
-      break;
-  }
-  is.close();
-  if (err != ZIP_OK) {
-    ROS_ERROR_STREAM("Failed to write file \"" << filename
-                                               << "\" to zip file.");
+  if (!archive_writer->Commit(*ToMsg())) {
+    ROS_ERROR_STREAM("PoseGraph::Save: Failed to write graph to " << filename);
     return false;
   }
+  ROS_INFO_STREAM("Successfully saved pose graph to "
+                  << absPath(filename) << " (" << n_appended
+                  << " new point clouds).");
   return true;
 }
 
-bool PoseGraph::Save(const std::string& zipFilename) const {
-  const std::string path = "pose_graph";
-  const boost::filesystem::path directory(path);
-  boost::filesystem::create_directory(directory);
-
-  // nfg_.print("PoseGraph::Save: nfg is: ");
+bool PoseGraph::Load(const std::string& filename,
+                     const std::string& pose_graph_topic_name) {
+  if (!lamp_utils::IsPoseGraphArchive(filename))
+    return LoadZip(filename, pose_graph_topic_name);
 
-  // keys.csv stores factor key, point cloud filename, and time stamp
-  std::ofstream keys_file(path + "/keys.csv");
-  if (keys_file.bad()) {
-    ROS_ERROR("PoseGraph::Save: Failed to write keys file.");
+  auto archive = std::make_shared<lamp_utils::PoseGraphArchiveReader>();
+  if (!archive->Open(filename)) {
+    ROS_ERROR_STREAM("PoseGraph::Load: Failed to open " << filename);
     return false;
   }
-
-  auto zipFile = zipOpen64(zipFilename.c_str(), 0);
-
-  int i = 0;
-  for (const auto& entry : keyed_scans) {
-    keys_file << gtsam::Key(entry.first) << ",";
-    // save point cloud as binary PCD file
-    const std::string pcd_filename = path + "/pc_" + std::to_string(i) + ".pcd";
-    pcl::io::savePCDFile(pcd_filename, *entry.second, true);
-    writeFileToZip(zipFile, pcd_filename);
-    ROS_INFO("PoseGraph::Save: Saved point cloud %i/%lu.",
-             i + 1,
-             keyed_scans.size());
-    keys_file << pcd_filename << ",";
-    if (!values_.exists(entry.first)) {
-      ROS_WARN("PoseGraph::Save: Key %lu associated with a scan does not exist "
-               "in values.",
-               entry.first);
-      return false;
-    }
-    keys_file << keyed_stamps.at(entry.first).toNSec() << "\n";
-    ++i;
+  GraphMsgPtr pg_msg = archive->ReadGraph();
+  if (pg_msg == nullptr) {
+    ROS_ERROR_STREAM("Could not read pose graph message from " << filename);
+    return false;
   }
-  keys_file.close();
-  writeFileToZip(zipFile, path + "/keys.csv");
 
-  // convert pose graph to message and save to file
-  auto pg_msg = ToMsg();
+  // Scans are only read from the mapped archive when requested. Those of
+  // marginalized nodes stay in the archive until it is written anew.
+  marginalized_.insert(pg_msg->marginalized_keys.begin(),
+                       pg_msg->marginalized_keys.end());
+  for (gtsam::Key marginalized : pg_msg->marginalized_keys)
+    robot_chains_.Insert(marginalized);
+  const std::vector<gtsam::Key> scan_keys = archive->ScanKeys();
+  for (const gtsam::Key& scan_key : scan_keys) {
+    if (!IsMarginalized(scan_key))
+      keyed_stamps.Assign(scan_key, archive->ScanStamp(scan_key));
+  }
+  // Increment key to be ready for more scans
+  if (!scan_keys.empty())
+    key = gtsam::Symbol(scan_keys.back() + 1);
+  scan_archive_ = archive;
+  ROS_INFO("PoseGraph::Load: Indexed %lu point clouds.", scan_keys.size());
 
-  rosbag::Bag bag;
-  bag.open(path + "/pose_graph.bag", rosbag::bagmode::Write);
-  bag.write("pose_graph", ros::Time::now(), *pg_msg);
-  bag.close();
-  writeFileToZip(zipFile, path + "/pose_graph.bag");
+  this->UpdateFromMsg(pg_msg);
 
-  zipClose(zipFile, 0);
-  boost::filesystem::remove_all(directory);
-  ROS_INFO_STREAM("Successfully saved pose graph to " << absPath(zipFilename)
-                                                      << ".");
+  ROS_INFO_STREAM("Successfully loaded pose graph from " << absPath(filename)
+                                                         << ".");
   return true;
 }
 
-bool PoseGraph::Load(const std::string& zipFilename,
-                     const std::string& pose_graph_topic_name) {
+// Former format: zip of the scans as PCD files, keys.csv with their keys and
+// stamps, and a bag with the graph message
+bool PoseGraph::LoadZip(const std::string& zipFilename,
+                        const std::string& pose_graph_topic_name) {
   const std::string absFilename = absPath(zipFilename);
-  auto zipFile = unzOpen64(zipFilename.c_str());
-  // TODO: Storing current key before loading graph to set key to this after
-  // stored_key = key;
-  if (!zipFile) {
+  auto zip = std::make_shared<lamp_utils::ZipScanReader>();
+  if (!zip->Open(zipFilename)) {
     ROS_ERROR_STREAM("PoseGraph::Load: Failed to open zip file "
                      << absFilename);
     return false;
   }
 
-  unz_global_info64 oGlobalInfo;
-  int err = unzGetGlobalInfo64(zipFile, &oGlobalInfo);
-  std::vector<std::string> files; // files to be extracted
-
   std::string keysFilename{""}, pgFilename{""};
-
-  for (unsigned long i = 0; i < oGlobalInfo.number_entry && err == UNZ_OK;
-       ++i) {
-    char filename[256];
-    unz_file_info64 oFileInfo;
-    err = unzGetCurrentFileInfo64(zipFile,
-                                  &oFileInfo,
-                                  filename,
-                                  sizeof(filename),
-                                  nullptr,
-                                  0,
-                                  nullptr,
-                                  0);
-    if (err == UNZ_OK) {
-      char nLast = filename[oFileInfo.size_filename - 1];
-      // this entry is a file, extract it later
-      files.emplace_back(filename);
-      if (files.back().find("keys.csv") != std::string::npos) {
-        keysFilename = files.back();
-      } else if (files.back().find("pose_graph.bag") != std::string::npos) {
-        pgFilename = files.back();
-      }
-      err = unzGoToNextFile(zipFile);
+  for (const std::string& filename : zip->entries()) {
+    if (filename.find("keys.csv") != std::string::npos) {
+      keysFilename = filename;
+    } else if (filename.find("pose_graph.bag") != std::string::npos) {
+      pgFilename = filename;
     }
   }
   if (keysFilename.empty()) {
@@ -177,64 +166,17 @@ bool PoseGraph::Load(const std::string& zipFilename,
     return false;
   }
 
-  // extract files
-  int i = 1;
-  std::vector<boost::filesystem::path> folders;
-  for (const auto& filename : files) {
-    if (unzLocateFile(zipFile, filename.c_str(), 0) != UNZ_OK) {
-      ROS_ERROR_STREAM("PoseGraph::Load: Could not locate file "
-                       << filename << " from " << absFilename);
-      return false;
-    }
-    if (unzOpenCurrentFile(zipFile) != UNZ_OK) {
-      ROS_ERROR_STREAM("PoseGraph::Load: Could not open file "
-                       << filename << " from " << absFilename);
-      return false;
-    }
-    unz_file_info64 oFileInfo;
-    if (unzGetCurrentFileInfo64(zipFile, &oFileInfo, 0, 0, 0, 0, 0, 0) !=
-        UNZ_OK) {
-      ROS_ERROR_STREAM(
-          "PoseGraph::Load: Could not determine file size of entry "
-          << filename << " in " << absFilename);
-      return false;
-    }
-
-    boost::filesystem::path dir(filename);
-    dir = dir.parent_path();
-    if (boost::filesystem::create_directory(dir))
-      folders.emplace_back(dir);
-
-    auto size = (unsigned int)oFileInfo.uncompressed_size;
-    char* buf = new char[size];
-    size = unzReadCurrentFile(zipFile, buf, size);
-    std::ofstream os(filename);
-    if (os.bad()) {
-      ROS_ERROR_STREAM("PoseGraph::Load: Could not create file "
-                       << filename << " for extraction.");
-      return false;
-    }
-    if (size > 0) {
-      os.write(buf, size);
-      os.flush();
-    } else {
-      ROS_ERROR_STREAM("PoseGraph::Load: Entry "
-                       << filename << " from " << absFilename << " is empty.");
-    }
-    os.close();
-    delete[] buf;
-    ROS_INFO_STREAM("PoseGraph::Load: Extracted file "
-                    << i << "/" << (int)files.size() << " -- " << filename);
-    ++i;
-  }
-  unzClose(zipFile);
-
-  // info_file stores factor key, point cloud filename, and time stamp
-  std::ifstream info_file(keysFilename);
-  if (info_file.bad()) {
-    ROS_ERROR_STREAM("PoseGraph::Load: Failed to open " << keysFilename);
+  // keys.csv stores factor key, point cloud filename, and time stamp. The
+  // point clouds are only indexed here.
+  std::vector<char> keysData;
+  if (!zip->ReadEntry(keysFilename, &keysData)) {
+    ROS_ERROR_STREAM("PoseGraph::Load: Failed to read " << keysFilename);
     return false;
   }
+  std::istringstream info_file(std::string(keysData.begin(), keysData.end()));
+  auto pcd_filenames =
+      std::make_shared<std::unordered_map<gtsam::Key, std::string>>();
+  std::vector<gtsam::Key> scan_keys;
   std::string keyStr, pcd_filename, timeStr;
   while (info_file.good()) {
     std::getline(info_file, keyStr, ',');
@@ -242,27 +184,24 @@ bool PoseGraph::Load(const std::string& zipFilename,
       break;
     key = gtsam::Symbol(std::stoull(keyStr));
     std::getline(info_file, pcd_filename, ',');
-    PointCloud::Ptr pc(new PointCloud);
-    if (pcl::io::loadPCDFile(pcd_filename, *pc) == -1) {
-      ROS_ERROR_STREAM("PoseGraph::Load: Failed to load point cloud "
-                       << pcd_filename << " from " << absFilename);
-      return false;
-    }
-    ROS_INFO_STREAM("PoseGraph::Load: Loaded point cloud " << pcd_filename);
-    keyed_scans[key] = pc;
+    (*pcd_filenames)[key] = pcd_filename;
+    scan_keys.push_back(key);
     std::getline(info_file, timeStr);
     ros::Time t;
     t.fromNSec(std::stol(timeStr));
-    keyed_stamps[key] = t;
+    keyed_stamps.Assign(key, t);
   }
   // Increment key to be ready for more scans
   key = key + 1;
-  ROS_INFO("PoseGraph::Load: Restored all %lu point clouds.",
-           keyed_scans.size());
-  info_file.close();
 
+  std::string bagFilename;
+  if (pgFilename.empty() || !zip->ExtractEntry(pgFilename, &bagFilename)) {
+    ROS_ERROR_STREAM("PoseGraph::Load: Could not extract pose_graph.bag from "
+                     << absFilename);
+    return false;
+  }
   rosbag::Bag bag;
-  bag.open(pgFilename);
+  bag.open(bagFilename);
   std::string topic = pose_graph_topic_name;
   if (topic.empty())
     topic = "pose_graph";
@@ -274,16 +213,28 @@ bool PoseGraph::Load(const std::string& zipFilename,
     if (current_msg != nullptr)
       pg_msg = current_msg;
   }
+  bag.close();
+  boost::filesystem::remove(bagFilename);
   if (pg_msg == nullptr) {
     ROS_ERROR_STREAM("Could not read pose graph message from " << pgFilename);
     return false;
   }
-  this->UpdateFromMsg(pg_msg);
-  bag.close();
 
-  // remove all extracted folders
-  for (const auto& folder : folders)
-    boost::filesystem::remove_all(folder);
+  // The loader keeps the zip open until it is dropped with the last graph
+  // sharing it
+  scan_loader_ = std::make_shared<lamp_utils::KeyedScanLoader>(
+      scan_keys,
+      [zip, pcd_filenames](const gtsam::Key& scan_key) -> PointCloud::Ptr {
+        auto it = pcd_filenames->find(scan_key);
+        if (it == pcd_filenames->end())
+          return nullptr;
+        return zip->ReadPointCloud(it->second);
+      },
+      std::max(1u, std::thread::hardware_concurrency()));
+  ROS_INFO("PoseGraph::Load: Loading %lu point clouds in the background.",
+           scan_keys.size());
+
+  this->UpdateFromMsg(pg_msg);
 
   ROS_INFO_STREAM("Successfully loaded pose graph from " << absPath(zipFilename)
                                                          << ".");
@@ -1,14 +1,17 @@
 #include "lamp_utils/PoseGraph.h"
 #include "lamp_utils/PrefixHandling.h"
 
+#include <algorithm>
+
 double PoseGraph::time_threshold = 1.0;
 
 gtsam::Symbol PoseGraph::GetKeyAtTime(const ros::Time& stamp) const {
-  if (stamp_to_odom_key.find(stamp.toSec()) == stamp_to_odom_key.end()) {
+  boost::optional<gtsam::Key> key = stamp_to_odom_key.Find(stamp.toSec());
+  if (!key) {
     ROS_ERROR("No key exists at given time");
     return lamp_utils::GTSAM_ERROR_SYMBOL;
   }
-  return stamp_to_odom_key.at(stamp.toSec());
+  return *key;
 }
 
 gtsam::Symbol PoseGraph::GetClosestKeyAtTime(const ros::Time& stamp,
@@ -22,24 +25,25 @@ gtsam::Symbol PoseGraph::GetClosestKeyAtTime(const ros::Time& stamp,
   // Output key
   gtsam::Symbol key_out;
 
-  // Iterators pointing immediately before and after the target time
-  auto iterAfter = stamp_to_odom_key.lower_bound(stamp.toSec());
-  auto iterBefore = std::prev(iterAfter);
-  double t1 = iterBefore->first;
-  double t2 = iterAfter->first;
+  // Entries immediately before and after the target time
+  const size_t after = stamp_to_odom_key.LowerBound(stamp.toSec());
+  const size_t before = after > 0 ? after - 1 : 0;
+  double t1 = stamp_to_odom_key.StampAt(before);
+  double t2 = stamp_to_odom_key.StampAt(
+      std::min(after, stamp_to_odom_key.size() - 1));
   double t_closest;
 
   bool b_is_end_case = false;
 
   // If time is before the start or after the end, return first/last key
-  if (iterAfter == stamp_to_odom_key.begin()) {
+  if (after == 0) {
     ROS_ERROR("Time stamp before start of range (GetClosestKeyAtTime)");
-    key_out = iterAfter->second;
+    key_out = stamp_to_odom_key.KeyAt(after);
     t_closest = t2;
     b_is_end_case = true;
-  } else if (iterAfter == stamp_to_odom_key.end()) {
+  } else if (after == stamp_to_odom_key.size()) {
     ROS_ERROR("Time past end of the range (GetClosestKeyAtTime)");
-    key_out = iterBefore->second;
+    key_out = stamp_to_odom_key.KeyAt(before);
     t_closest = t1;
     b_is_end_case = true;
   }
@@ -47,10 +51,10 @@ gtsam::Symbol PoseGraph::GetClosestKeyAtTime(const ros::Time& stamp,
   if (!b_is_end_case) {
     // Otherwise return the closer key
     if (stamp.toSec() - t1 < t2 - stamp.toSec()) {
-      key_out = iterBefore->second;
+      key_out = stamp_to_odom_key.KeyAt(before);
       t_closest = t1;
     } else {
-      key_out = iterAfter->second;
+      key_out = stamp_to_odom_key.KeyAt(after);
       t_closest = t2;
     }
   }
@@ -76,6 +80,12 @@ gtsam::Symbol PoseGraph::GetClosestKeyAtTime(const ros::Time& stamp,
 }
 
 gtsam::Pose3 PoseGraph::LastPose(char c) const {
+  // Robot poses are indexed densely, their last key is known
+  boost::optional<gtsam::Key> last = robot_poses_.LastKey(c);
+  if (last) {
+    return *robot_poses_.Find(*last);
+  }
+
   gtsam::Key latest = lamp_utils::GTSAM_ERROR_SYMBOL;
 
   // Get the most recent pose from the given robot
@@ -98,39 +108,20 @@ gtsam::Pose3 PoseGraph::LastPose(char c) const {
     return values_.at<gtsam::Pose3>(latest);;
 }
 
-const NodeMessage* PoseGraph::FindNode(const gtsam::Key& key) const {
-  for (const auto& node : nodes_) {
-    if (node.key == key) {
-      return &node;
-    }
-  }
-  return nullptr;
+boost::optional<NodeMessage> PoseGraph::FindNode(const gtsam::Key& key) const {
+  return nodes_.Find(key);
 }
 
-const EdgeMessage* PoseGraph::FindEdge(const gtsam::Key& key_from,
-                                       const gtsam::Key& key_to) const {
-  for (const auto& edge : edges_) {
-    if (edge.key_from == key_from && edge.key_to == key_to) {
-      return &edge;
-    }
-  }
-  return nullptr;
+boost::optional<EdgeMessage> PoseGraph::FindEdge(const gtsam::Key& key_from,
+                                                 const gtsam::Key& key_to) const {
+  return edges_.FindAnyType(key_from, key_to);
 }
 
-const EdgeMessage* PoseGraph::FindEdgeKeyTo(const gtsam::Key& key_to) const {
-  for (const auto& edge : edges_) {
-    if (edge.key_to == key_to) {
-      return &edge;
-    }
-  }
-  return nullptr;
+boost::optional<EdgeMessage>
+PoseGraph::FindEdgeKeyTo(const gtsam::Key& key_to) const {
+  return edges_.FindKeyTo(key_to);
 }
 
-const EdgeMessage* PoseGraph::FindPrior(const gtsam::Key& key) const {
-  for (const auto& edge : priors_) {
-    if (edge.key_from == key) {
-      return &edge;
-    }
-  }
-  return nullptr;
+boost::optional<EdgeMessage> PoseGraph::FindPrior(const gtsam::Key& key) const {
+  return priors_.FindKeyFrom(key);
 }
@@ -9,16 +9,17 @@ namespace gu = geometry_utils;
 namespace gr = gu::ros;
 
 GraphMsgPtr PoseGraph::ToMsg() const {
-  return ToMsg_(edges_, nodes_, priors_);
+  return ToMsg_(edges_, nodes_, priors_, GetMarginalizedKeys());
 }
 
 GraphMsgPtr PoseGraph::ToIncrementalMsg() const {
-  return ToMsg_(edges_new_, nodes_new_, priors_new_);
+  return ToMsg_(edges_new_, nodes_new_, priors_new_, marginalized_new_);
 }
 
-GraphMsgPtr PoseGraph::ToMsg_(const EdgeSet& edges,
-                              const NodeSet& nodes,
-                              const EdgeSet& priors) const {
+GraphMsgPtr PoseGraph::ToMsg_(const lamp_utils::EdgeStore& edges,
+                              const lamp_utils::NodeStore& nodes,
+                              const lamp_utils::EdgeStore& priors,
+                              const std::vector<gtsam::Key>& marginalized) const {
   // Create the Pose Graph Message
   auto* msg = new pose_graph_msgs::PoseGraph;
   msg->header.frame_id = fixed_frame_id;
@@ -33,25 +34,24 @@ GraphMsgPtr PoseGraph::ToMsg_(const EdgeSet& edges,
   //                   << ") while converting pose graph to message.");
   // }
 
-  msg->nodes.reserve(nodes.size());
-  for (const auto& node : nodes)
-    msg->nodes.emplace_back(node);
+  nodes.AppendTo(&msg->nodes);
 
   // Add the factors  // TODO: check integration of this tracking with all
   // handlers
   msg->edges.reserve(edges.size() + priors.size());
-  for (const auto& edge : edges)
-    msg->edges.emplace_back(edge);
-  for (const auto& prior : priors)
-    msg->edges.emplace_back(prior);
+  edges.AppendTo(&msg->edges);
+  priors.AppendTo(&msg->edges);
+  msg->marginalized_keys = marginalized;
 
   return GraphMsgPtr(msg);
 }
 
 void PoseGraph::UpdateFromMsg(const GraphMsgPtr& msg) {
-  for (const auto& edge : msg->edges) {
-    TrackFactor(edge);
-  }
+  // Marginalizations first, so the odometry replacing the nodes is tracked
+  // onto a chain without them
+  EdgeMessages edges = msg->edges;
+  ApplyMarginalizations(msg->marginalized_keys, &edges);
+  TrackFactors(edges);
   for (const auto& node : msg->nodes) {
     TrackNode(node);
   }
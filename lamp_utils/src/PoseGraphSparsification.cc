@@ -0,0 +1,276 @@
+#include "lamp_utils/CommonFunctions.h"
+#include "lamp_utils/Metrics.h"
+#include "lamp_utils/PointCloudKernels.h"
+#include "lamp_utils/PoseGraph.h"
+
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <unordered_set>
+
+#include <Eigen/Cholesky>
+
+namespace {
+
+// Odometry edge along the chain of one robot
+bool IsChainOdometry(const EdgeMessage& edge) {
+  return edge.type == pose_graph_msgs::PoseGraphEdge::ODOM &&
+      gtsam::Symbol(edge.key_from).chr() == gtsam::Symbol(edge.key_to).chr();
+}
+
+} // namespace
+
+bool PoseGraph::GetChainEdges(gtsam::Key key,
+                              EdgeMessage* in,
+                              EdgeMessage* out) const {
+  // No loop closure, artifact, IMU, UWB or prior on the node
+  if (!nodes_.Contains(key) || edges_.Degree(key) != 2 ||
+      priors_.Degree(key) != 0) {
+    return false;
+  }
+  auto edge_in = edges_.FindKeyTo(key);
+  auto edge_out = edges_.FindKeyFrom(key);
+  if (!edge_in || !edge_out || !IsChainOdometry(*edge_in) ||
+      !IsChainOdometry(*edge_out) || !HasKey(edge_in->key_from) ||
+      !HasKey(edge_out->key_to)) {
+    return false;
+  }
+  *in = *edge_in;
+  *out = *edge_out;
+  return true;
+}
+
+bool PoseGraph::BridgesNode(const EdgeMessage& edge) const {
+  if (!IsChainOdometry(edge)) {
+    return false;
+  }
+  const gtsam::Symbol from(edge.key_from);
+  const gtsam::Symbol to(edge.key_to);
+  for (uint64_t index = from.index() + 1; index < to.index(); index++) {
+    if (HasKey(gtsam::Symbol(from.chr(), index))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PoseGraph::EraseMarginalizedNode(gtsam::Key key,
+                                      gtsam::Key key_to,
+                                      const gtsam::Pose3& pose_in_key_to) {
+  // The scan goes into the frame of the kept node, a new cloud as keyed
+  // scans are shared with the snapshots
+  const gtsam::Symbol symbol(key);
+  PointCloud::ConstPtr scan = GetKeyedScan(symbol);
+  if (scan != nullptr) {
+    const gtsam::Symbol symbol_to(key_to);
+    PointCloud::ConstPtr kept = GetKeyedScan(symbol_to);
+    PointCloud::Ptr merged(new PointCloud);
+    if (kept != nullptr) {
+      *merged = *kept;
+    } else {
+      merged->header = scan->header;
+    }
+    const size_t n_kept = merged->size();
+    lamp_utils::TransformAndAppend(
+        *scan, pose_in_key_to.matrix(), merged.get());
+    const Eigen::Matrix3f rotation =
+        pose_in_key_to.rotation().matrix().cast<float>();
+    for (size_t i = n_kept; i < merged->size(); i++) {
+      merged->points[i].getNormalVector3fMap() =
+          rotation * merged->points[i].getNormalVector3fMap();
+    }
+    keyed_scans[symbol_to] = merged;
+    scan_revisions_[key_to]++;
+  }
+  keyed_scans.erase(symbol);
+
+  boost::optional<ros::Time> stamp = keyed_stamps.Find(key);
+  if (stamp) {
+    stamp_to_odom_key.Erase(stamp->toSec(), key);
+  }
+  keyed_stamps.Erase(key);
+
+  if (values_.exists(key)) {
+    values_.erase(key);
+  }
+  if (values_new_.exists(key)) {
+    values_new_.erase(key);
+  }
+  robot_poses_.Erase(key);
+  nodes_.Erase(key);
+  nodes_new_.Erase(key);
+
+  marginalized_.insert(key);
+  marginalized_new_.push_back(key);
+}
+
+size_t PoseGraph::MarginalizeNodes(std::vector<gtsam::Key> keys) {
+  static lamp_utils::Counter& marginalized_nodes =
+      lamp_utils::MetricsRegistry::Instance().GetCounter(
+          "pose_graph.marginalized_nodes");
+
+  // In key order, so a node is chained onto the edge replacing its
+  // marginalized predecessor
+  std::sort(keys.begin(), keys.end());
+  std::unordered_set<gtsam::Key> removed;
+  std::set<unsigned char> prefixes;
+  for (gtsam::Key key : keys) {
+    EdgeMessage in, out;
+    if (IsMarginalized(key) || !GetChainEdges(key, &in, &out)) {
+      continue;
+    }
+
+    // Composed measurement, the covariance propagated to the tangent space
+    // at the far end
+    gtsam::Matrix H_in, H_out;
+    const gtsam::Pose3 pose_in = lamp_utils::MessageToPose(in);
+    const gtsam::Pose3 delta =
+        pose_in.compose(lamp_utils::MessageToPose(out), H_in, H_out);
+    const gtsam::Matrix66 covariance = H_in *
+            lamp_utils::MessageToCovarianceMatrix(in) * H_in.transpose() +
+        H_out * lamp_utils::MessageToCovarianceMatrix(out) *
+            H_out.transpose();
+    if (covariance.llt().info() != Eigen::Success) {
+      ROS_WARN_STREAM("Not marginalizing " << gtsam::DefaultKeyFormatter(key)
+                                           << ", its odometry has no valid "
+                                              "covariance");
+      continue;
+    }
+
+    edges_.Erase(in);
+    edges_new_.Erase(in);
+    edges_.Erase(out);
+    edges_new_.Erase(out);
+    EraseMarginalizedNode(key, in.key_from, pose_in);
+    TrackFactor(gtsam::Symbol(in.key_from),
+                gtsam::Symbol(out.key_to),
+                pose_graph_msgs::PoseGraphEdge::ODOM,
+                delta,
+                gtsam::noiseModel::Gaussian::Covariance(covariance));
+    removed.insert(key);
+    prefixes.insert(gtsam::Symbol(key).chr());
+  }
+  if (removed.empty()) {
+    return 0;
+  }
+
+  // Factors of the marginalized nodes, also those of edges added above and
+  // marginalized in turn, from the back so the factor moved into a freed
+  // slot is never one still to remove
+  IndexNewFactors();
+  std::vector<size_t> slots;
+  for (unsigned char prefix : prefixes) {
+    for (size_t slot : factor_prefixes_.Slots(prefix)) {
+      const auto& factor = nfg_.at(slot);
+      if (!factor) {
+        continue;
+      }
+      for (gtsam::Key k : factor->keys()) {
+        if (removed.count(k)) {
+          slots.push_back(slot);
+          break;
+        }
+      }
+    }
+  }
+  std::sort(slots.begin(), slots.end(), std::greater<size_t>());
+  slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+  for (size_t slot : slots) {
+    RemoveFactorSlot(slot);
+  }
+
+  marginalized_nodes.Increment(removed.size());
+  ROS_DEBUG_STREAM("Marginalized " << removed.size() << " odometry nodes");
+  return removed.size();
+}
+
+std::vector<gtsam::Key>
+PoseGraph::Sparsify(unsigned char prefix,
+                    const lamp_utils::SparsificationParams& params) {
+  std::vector<gtsam::Key> keys;
+  boost::optional<gtsam::Key> last_key = robot_poses_.LastKey(prefix);
+  if (!params.b_enabled || !last_key) {
+    return keys;
+  }
+  // The newest min_age nodes may still get loop closures of their own
+  const uint64_t last_index = gtsam::Symbol(*last_key).index();
+  const uint64_t min_age = std::max(params.min_age, 0);
+  if (last_index < min_age) {
+    return keys;
+  }
+  const uint64_t end = last_index - min_age;
+  uint64_t& begin = sparsified_until_[prefix];
+  if (begin >= end) {
+    return keys;
+  }
+
+  // Nodes within reach of the last kept one go, a node beyond it is kept
+  // and becomes the reference for the next ones
+  boost::optional<gtsam::Pose3> anchor;
+  for (uint64_t index = begin; index > 0 && !anchor; index--) {
+    const gtsam::Symbol key(prefix, index - 1);
+    if (HasKey(key)) {
+      anchor = GetPose(key);
+    }
+  }
+  for (uint64_t index = begin; index < end; index++) {
+    const gtsam::Symbol key(prefix, index);
+    if (!HasKey(key)) {
+      continue;
+    }
+    const gtsam::Pose3 pose = GetPose(key);
+    EdgeMessage in, out;
+    if (anchor && GetChainEdges(key, &in, &out)) {
+      const gtsam::Pose3 delta = anchor->between(pose);
+      if (delta.translation().norm() <= params.max_translation &&
+          gtsam::Rot3::Logmap(delta.rotation()).norm() <=
+              params.max_rotation) {
+        keys.push_back(key);
+        continue;
+      }
+    }
+    anchor = pose;
+  }
+  begin = end;
+
+  MarginalizeNodes(keys);
+  keys.erase(std::remove_if(keys.begin(),
+                            keys.end(),
+                            [this](gtsam::Key key) {
+                              return !IsMarginalized(key);
+                            }),
+             keys.end());
+  return keys;
+}
+
+std::vector<gtsam::Key> PoseGraph::GetMarginalizedKeys() const {
+  std::vector<gtsam::Key> keys(marginalized_.begin(), marginalized_.end());
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+void PoseGraph::ApplyMarginalizations(const std::vector<gtsam::Key>& keys,
+                                      EdgeMessages* edges) {
+  if (keys.empty()) {
+    return;
+  }
+  // Nodes never received are only remembered, so they are not tracked
+  // when they arrive late
+  std::vector<gtsam::Key> held;
+  for (gtsam::Key key : keys) {
+    if (HasKey(key)) {
+      held.push_back(key);
+    } else {
+      marginalized_.insert(key);
+      robot_chains_.Insert(key);
+    }
+  }
+  MarginalizeNodes(held);
+
+  edges->erase(std::remove_if(edges->begin(),
+                              edges->end(),
+                              [this](const EdgeMessage& edge) {
+                                return BridgesNode(edge);
+                              }),
+               edges->end());
+}
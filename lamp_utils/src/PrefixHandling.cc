@@ -0,0 +1,124 @@
+/*
+PrefixHandling.cc
+Registry of the robots and their node and artifact prefixes
+*/
+
+#include "lamp_utils/PrefixHandling.h"
+
+#include <mutex>
+
+namespace lamp_utils {
+
+// Constant initialised, so valid before any static constructor runs
+uint8_t RobotRegistry::classes_[256] = {LAMP_PREFIX_CLASSES_64(0),
+                                        LAMP_PREFIX_CLASSES_64(64),
+                                        LAMP_PREFIX_CLASSES_64(128),
+                                        LAMP_PREFIX_CLASSES_64(192)};
+
+namespace {
+
+struct RobotNames {
+  std::mutex mutex;
+  std::map<std::string, char> robot_prefixes{ROBOT_PREFIXES};
+  std::map<std::string, char> artifact_prefixes{ARTIFACT_PREFIXES};
+};
+
+RobotNames& Names() {
+  static RobotNames names;
+  return names;
+}
+
+bool IsPrefixTaken(const std::map<std::string, char>& prefixes,
+                   const std::string& robot,
+                   unsigned char prefix) {
+  for (const auto& p : prefixes) {
+    if (static_cast<unsigned char>(p.second) == prefix && p.first != robot) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+bool RobotRegistry::Register(const std::string& robot,
+                             unsigned char prefix,
+                             unsigned char artifact_prefix) {
+  if (robot.empty() || prefix == 0 || prefix == artifact_prefix) {
+    return false;
+  }
+  RobotNames& names = Names();
+  std::lock_guard<std::mutex> lock(names.mutex);
+
+  // A prefix identifies a single robot across every key of the graph
+  const uint8_t reserved = PREFIX_ARTIFACT | PREFIX_UWB;
+  if ((classes_[prefix] & reserved) ||
+      IsPrefixTaken(names.robot_prefixes, robot, prefix)) {
+    return false;
+  }
+  if (artifact_prefix != 0 &&
+      ((classes_[artifact_prefix] & ~PREFIX_ARTIFACT) ||
+       IsPrefixTaken(names.artifact_prefixes, robot, artifact_prefix))) {
+    return false;
+  }
+
+  names.robot_prefixes[robot] = prefix;
+  classes_[prefix] |= PREFIX_ROBOT;
+  if (artifact_prefix != 0) {
+    names.artifact_prefixes[robot] = artifact_prefix;
+    classes_[artifact_prefix] |= PREFIX_ARTIFACT;
+  }
+  return true;
+}
+
+bool RobotRegistry::LoadFromParam(const std::string& param) {
+  std::map<std::string, std::string> robots;
+  if (!ros::param::get(param, robots)) {
+    return false;
+  }
+
+  bool success = true;
+  for (const auto& robot : robots) {
+    const std::string& prefixes = robot.second;
+    if (prefixes.empty() || prefixes.size() > 2 ||
+        !Register(robot.first,
+                  prefixes[0],
+                  prefixes.size() > 1 ? prefixes[1] : 0)) {
+      ROS_ERROR_STREAM("Could not register robot " << robot.first
+                                                   << " with prefixes "
+                                                   << prefixes);
+      success = false;
+    }
+  }
+  return success;
+}
+
+unsigned char RobotRegistry::GetRobotPrefix(const std::string& robot) {
+  RobotNames& names = Names();
+  std::lock_guard<std::mutex> lock(names.mutex);
+  auto it = names.robot_prefixes.find(robot);
+  return it == names.robot_prefixes.end() ? 0 : it->second;
+}
+
+unsigned char RobotRegistry::GetArtifactPrefix(const std::string& robot) {
+  RobotNames& names = Names();
+  std::lock_guard<std::mutex> lock(names.mutex);
+  auto it = names.artifact_prefixes.find(robot);
+  return it == names.artifact_prefixes.end() ? 0 : it->second;
+}
+
+std::string RobotRegistry::GetRobotName(unsigned char prefix) {
+  if (!(classes_[prefix] & PREFIX_ROBOT)) {
+    return "";
+  }
+  RobotNames& names = Names();
+  std::lock_guard<std::mutex> lock(names.mutex);
+  for (const auto& p : names.robot_prefixes) {
+    if (static_cast<unsigned char>(p.second) == prefix) {
+      return p.first;
+    }
+  }
+  return "";
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,136 @@
+/*
+PriorMap.cc
+Read only pose graph of a former session, queried by region
+*/
+
+#include "lamp_utils/PriorMap.h"
+
+#include <algorithm>
+#include <set>
+
+#include <gtsam/inference/Symbol.h>
+#include <ros/console.h>
+
+#include "lamp_utils/PrefixHandling.h"
+
+namespace lamp_utils {
+
+namespace {
+
+gtsam::Pose3 ToPose(const archive::PoseEntry& entry) {
+  return gtsam::Pose3(gtsam::Rot3::Quaternion(entry.orientation[0],
+                                              entry.orientation[1],
+                                              entry.orientation[2],
+                                              entry.orientation[3]),
+                      gtsam::Point3(entry.position[0],
+                                    entry.position[1],
+                                    entry.position[2]));
+}
+
+} // namespace
+
+bool PriorMap::Open(const std::string& filename) {
+  Close();
+  if (!IsPoseGraphArchive(filename)) {
+    ROS_ERROR_STREAM("PriorMap: " << filename
+                                  << " is not an archive, save it again to "
+                                     "use it as a prior map");
+    return false;
+  }
+  if (!archive_.Open(filename)) {
+    return false;
+  }
+  if (archive_.HasPoseIndex()) {
+    return true;
+  }
+
+  ROS_WARN_STREAM("PriorMap: " << filename
+                               << " has no poses block, holding its poses");
+  const pose_graph_msgs::PoseGraphPtr graph = archive_.ReadGraph();
+  if (!graph) {
+    Close();
+    return false;
+  }
+  for (const auto& node : graph->nodes) {
+    const gtsam::Pose3 pose(
+        gtsam::Rot3::Quaternion(node.pose.orientation.w,
+                                node.pose.orientation.x,
+                                node.pose.orientation.y,
+                                node.pose.orientation.z),
+        gtsam::Point3(
+            node.pose.position.x, node.pose.position.y, node.pose.position.z));
+    poses_[node.key] = std::make_pair(pose, node.header.stamp);
+    positions_.Insert(node.key, pose.translation());
+  }
+  return true;
+}
+
+void PriorMap::Close() {
+  archive_.Close();
+  poses_.clear();
+  positions_.Clear();
+}
+
+std::vector<std::pair<gtsam::Key, gtsam::Pose3>>
+PriorMap::Query(const gtsam::Point3& position, double radius) const {
+  std::vector<std::pair<gtsam::Key, gtsam::Pose3>> nodes;
+  if (!IsOpen()) {
+    return nodes;
+  }
+  auto wanted = [this](gtsam::Key key) {
+    return IsRobotPrefix(gtsam::Symbol(key).chr()) && archive_.HasScan(key);
+  };
+  if (archive_.HasPoseIndex()) {
+    const double center[3] = {position.x(), position.y(), position.z()};
+    for (const archive::PoseEntry& entry :
+         archive_.PosesWithin(center, radius)) {
+      if (wanted(entry.key))
+        nodes.emplace_back(entry.key, ToPose(entry));
+    }
+    return nodes;
+  }
+  for (gtsam::Key key : positions_.RadiusSearch(position, radius)) {
+    if (wanted(key))
+      nodes.emplace_back(key, poses_.at(key).first);
+  }
+  std::sort(nodes.begin(),
+            nodes.end(),
+            [](const std::pair<gtsam::Key, gtsam::Pose3>& a,
+               const std::pair<gtsam::Key, gtsam::Pose3>& b) {
+              return a.first < b.first;
+            });
+  return nodes;
+}
+
+bool PriorMap::GetPose(gtsam::Key key,
+                       gtsam::Pose3* pose,
+                       ros::Time* stamp) const {
+  if (archive_.HasPoseIndex()) {
+    archive::PoseEntry entry;
+    if (!archive_.FindPose(key, &entry))
+      return false;
+    *pose = ToPose(entry);
+    if (stamp)
+      stamp->fromNSec(entry.stamp_ns);
+    return true;
+  }
+  auto it = poses_.find(key);
+  if (it == poses_.end())
+    return false;
+  *pose = it->second.first;
+  if (stamp)
+    *stamp = it->second.second;
+  return true;
+}
+
+std::vector<unsigned char> PriorMap::Prefixes() const {
+  if (archive_.HasPoseIndex())
+    return archive_.PosePrefixes();
+  std::set<unsigned char> prefixes;
+  for (const auto& pose : poses_) {
+    prefixes.insert(gtsam::Symbol(pose.first).chr());
+  }
+  return std::vector<unsigned char>(prefixes.begin(), prefixes.end());
+}
+
+} // namespace lamp_utils
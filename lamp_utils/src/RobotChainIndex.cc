@@ -0,0 +1,127 @@
+/*
+RobotChainIndex.cc
+Continuity of the odometry chains of the robot keys of the pose graph
+*/
+
+#include "lamp_utils/RobotChainIndex.h"
+
+#include <iterator>
+
+namespace lamp_utils {
+
+bool RobotChainIndex::Insert(gtsam::Key key) {
+  const gtsam::Symbol symbol(key);
+  if (!IsRobotPrefix(symbol.chr()) || excluded_.count(symbol.chr()))
+    return false;
+  Chain& chain = chains_[symbol.chr()];
+  const uint64_t index = symbol.index();
+  if (index >= chain.end) {
+    if (index > chain.end) {
+      chain.gaps.emplace(chain.end, index);
+      num_missing_ += index - chain.end;
+    }
+    chain.end = index + 1;
+    return true;
+  }
+
+  // Below the end only a missing key is new, it splits its gap
+  auto gap = chain.gaps.upper_bound(index);
+  if (gap == chain.gaps.begin())
+    return false;
+  --gap;
+  if (gap->second <= index)
+    return false;
+  const uint64_t begin = gap->first;
+  const uint64_t end = gap->second;
+  chain.gaps.erase(gap);
+  if (begin < index)
+    chain.gaps.emplace(begin, index);
+  if (index + 1 < end)
+    chain.gaps.emplace(index + 1, end);
+  num_missing_--;
+  return true;
+}
+
+bool RobotChainIndex::Erase(gtsam::Key key) {
+  const gtsam::Symbol symbol(key);
+  auto it = chains_.find(symbol.chr());
+  if (it == chains_.end())
+    return false;
+  Chain& chain = it->second;
+  const uint64_t index = symbol.index();
+  if (index >= chain.end)
+    return false;
+  auto next = chain.gaps.upper_bound(index);
+  if (next != chain.gaps.begin()) {
+    auto gap = std::prev(next);
+    if (gap->second > index)
+      return false;
+  }
+
+  if (index + 1 == chain.end) {
+    // The chain ends before the gap the last key closed
+    chain.end = index;
+    if (!chain.gaps.empty() && chain.gaps.rbegin()->second == chain.end) {
+      auto last = std::prev(chain.gaps.end());
+      num_missing_ -= last->second - last->first;
+      chain.end = last->first;
+      chain.gaps.erase(last);
+    }
+    if (chain.end == 0)
+      chains_.erase(it);
+    return true;
+  }
+
+  // Merged with the gaps ending and starting next to it
+  uint64_t begin = index;
+  uint64_t end = index + 1;
+  if (next != chain.gaps.end() && next->first == end) {
+    end = next->second;
+    next = chain.gaps.erase(next);
+  }
+  if (next != chain.gaps.begin()) {
+    auto previous = std::prev(next);
+    if (previous->second == begin) {
+      begin = previous->first;
+      chain.gaps.erase(previous);
+    }
+  }
+  chain.gaps.emplace(begin, end);
+  num_missing_++;
+  return true;
+}
+
+void RobotChainIndex::ErasePrefix(unsigned char prefix) {
+  auto it = chains_.find(prefix);
+  if (it == chains_.end())
+    return;
+  for (const auto& gap : it->second.gaps)
+    num_missing_ -= gap.second - gap.first;
+  chains_.erase(it);
+}
+
+void RobotChainIndex::Exclude(unsigned char prefix) {
+  excluded_.insert(prefix);
+  ErasePrefix(prefix);
+}
+
+void RobotChainIndex::clear() {
+  chains_.clear();
+  num_missing_ = 0;
+}
+
+std::vector<std::pair<gtsam::Key, gtsam::Key>>
+RobotChainIndex::Gaps(size_t max_gaps) const {
+  std::vector<std::pair<gtsam::Key, gtsam::Key>> gaps;
+  for (const auto& chain : chains_) {
+    for (const auto& gap : chain.second.gaps) {
+      if (gaps.size() >= max_gaps)
+        return gaps;
+      gaps.emplace_back(gtsam::Symbol(chain.first, gap.first),
+                        gtsam::Symbol(chain.first, gap.second - 1));
+    }
+  }
+  return gaps;
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,118 @@
+/*
+RobotPoseIndex.cc
+Dense poses of the robot keys of the pose graph
+*/
+
+#include "lamp_utils/RobotPoseIndex.h"
+
+#include <algorithm>
+
+namespace lamp_utils {
+
+const gtsam::Pose3* RobotPoseIndex::FindSparse(gtsam::Key key) const {
+  if (sparse_.empty())
+    return nullptr;
+  auto it = sparse_.find(key);
+  return it == sparse_.end() ? nullptr : &it->second;
+}
+
+bool RobotPoseIndex::Assign(gtsam::Key key, const gtsam::Pose3& pose) {
+  if (!IsIndexed(key))
+    return false;
+  auto sparse = sparse_.find(key);
+  if (sparse != sparse_.end()) {
+    sparse->second = pose;
+    return true;
+  }
+
+  const gtsam::Symbol symbol(key);
+  if (columns_.empty())
+    columns_.resize(256);
+  Column& column = columns_[symbol.chr()];
+  const size_t index = symbol.index();
+  if (index >= column.poses.size()) {
+    if (index - column.poses.size() > kMaxGap) {
+      sparse_.emplace(key, pose);
+      size_++;
+      return true;
+    }
+    // Grow geometrically, a robot adds one key at a time
+    const size_t capacity = std::max(index + 1, 2 * column.poses.size());
+    column.poses.resize(capacity);
+    column.b_set.resize(capacity, 0);
+  }
+  if (!column.b_set[index]) {
+    column.b_set[index] = 1;
+    column.end = std::max(column.end, index + 1);
+    size_++;
+  }
+  column.poses[index] = pose;
+  return true;
+}
+
+bool RobotPoseIndex::Erase(gtsam::Key key) {
+  if (sparse_.erase(key)) {
+    size_--;
+    return true;
+  }
+  const gtsam::Symbol symbol(key);
+  if (symbol.chr() >= columns_.size())
+    return false;
+  Column& column = columns_[symbol.chr()];
+  const size_t index = symbol.index();
+  if (index >= column.end || !column.b_set[index])
+    return false;
+  column.b_set[index] = 0;
+  while (column.end > 0 && !column.b_set[column.end - 1])
+    column.end--;
+  size_--;
+  return true;
+}
+
+void RobotPoseIndex::ErasePrefix(unsigned char prefix) {
+  if (prefix < columns_.size()) {
+    Column& column = columns_[prefix];
+    for (size_t i = 0; i < column.end; i++)
+      size_ -= column.b_set[i];
+    column = Column();
+  }
+  auto begin = sparse_.lower_bound(gtsam::Symbol(prefix, 0));
+  auto end = begin;
+  while (end != sparse_.end() && gtsam::Symbol(end->first).chr() == prefix) {
+    end++;
+    size_--;
+  }
+  sparse_.erase(begin, end);
+}
+
+boost::optional<gtsam::Key>
+RobotPoseIndex::LastKey(unsigned char prefix) const {
+  boost::optional<gtsam::Key> last;
+  if (prefix < columns_.size() && columns_[prefix].end > 0)
+    last = gtsam::Key(gtsam::Symbol(prefix, columns_[prefix].end - 1));
+  auto it = sparse_.upper_bound(
+      gtsam::Symbol(prefix, gtsam::Symbol(~gtsam::Key(0)).index()));
+  if (it != sparse_.begin() && gtsam::Symbol((--it)->first).chr() == prefix &&
+      (!last || it->first > *last))
+    last = it->first;
+  return last;
+}
+
+void RobotPoseIndex::Rebuild(const gtsam::Values& values) {
+  clear();
+  for (const auto& v : values) {
+    if (!IsIndexed(v.key))
+      continue;
+    auto pose = dynamic_cast<const gtsam::GenericValue<gtsam::Pose3>*>(&v.value);
+    if (pose)
+      Assign(v.key, pose->value());
+  }
+}
+
+void RobotPoseIndex::clear() {
+  columns_.clear();
+  sparse_.clear();
+  size_ = 0;
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,292 @@
+/*
+ScanCompression.cc
+Compact encoding of keyed scans for the radio link
+*/
+
+#include "lamp_utils/ScanCompression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <pcl/common/io.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <zlib.h>
+
+#include "lamp_utils/PointCloudConversions.h"
+
+namespace lamp_utils {
+
+namespace {
+
+const char kMagic[4] = {'L', 'S', 'C', '1'};
+const uint32_t kHasNormals = 1;
+// Octahedral value of points without a valid normal
+const int8_t kNoNormal = -128;
+
+struct EncodedHeader {
+  char magic[4];
+  uint32_t flags;
+  uint32_t num_points;
+  uint32_t raw_bytes;
+  uint64_t stamp;
+  uint32_t seq;
+  uint32_t frame_id_size;
+  float position_step;
+  float intensity_step;
+  float origin[3];
+};
+
+inline float SignNotZero(float v) {
+  return v < 0.0f ? -1.0f : 1.0f;
+}
+
+inline int8_t ToSnorm8(float v) {
+  return static_cast<int8_t>(
+      std::lround(std::min(1.0f, std::max(-1.0f, v)) * 127.0f));
+}
+
+// Normal on the octahedron, folded onto the upper half
+void EncodeOctahedral(const Point& p, int8_t* u, int8_t* v) {
+  const float l1 =
+      std::fabs(p.normal_x) + std::fabs(p.normal_y) + std::fabs(p.normal_z);
+  if (!std::isfinite(l1) || l1 <= 0.0f) {
+    *u = kNoNormal;
+    *v = kNoNormal;
+    return;
+  }
+  float x = p.normal_x / l1;
+  float y = p.normal_y / l1;
+  if (p.normal_z < 0.0f) {
+    const float fx = (1.0f - std::fabs(y)) * SignNotZero(x);
+    const float fy = (1.0f - std::fabs(x)) * SignNotZero(y);
+    x = fx;
+    y = fy;
+  }
+  *u = ToSnorm8(x);
+  *v = ToSnorm8(y);
+}
+
+void DecodeOctahedral(int8_t u, int8_t v, Point* p) {
+  if (u == kNoNormal) {
+    p->normal_x = p->normal_y = p->normal_z = 0.0f;
+    return;
+  }
+  float x = u / 127.0f;
+  float y = v / 127.0f;
+  const float z = 1.0f - std::fabs(x) - std::fabs(y);
+  if (z < 0.0f) {
+    const float fx = (1.0f - std::fabs(y)) * SignNotZero(x);
+    const float fy = (1.0f - std::fabs(x)) * SignNotZero(y);
+    x = fx;
+    y = fy;
+  }
+  const float inverse_norm = 1.0f / std::sqrt(x * x + y * y + z * z);
+  p->normal_x = x * inverse_norm;
+  p->normal_y = y * inverse_norm;
+  p->normal_z = z * inverse_norm;
+}
+
+// Low bytes of the n values, then the high bytes
+inline void SplitPlanes(const uint16_t* values, size_t n, uint8_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = values[i] & 0xff;
+    out[n + i] = values[i] >> 8;
+  }
+}
+
+inline void JoinPlanes(const uint8_t* in, size_t n, uint16_t* values) {
+  for (size_t i = 0; i < n; i++) {
+    values[i] = in[i] | (in[n + i] << 8);
+  }
+}
+
+} // namespace
+
+bool EncodeScan(const PointCloud& scan,
+                const ScanCompressionParams& params,
+                std::vector<uint8_t>* out) {
+  out->clear();
+  if (params.position_step <= 0 || params.intensity_step <= 0) {
+    return false;
+  }
+
+  std::vector<const Point*> points;
+  points.reserve(scan.size());
+  float origin[3] = {std::numeric_limits<float>::max(),
+                     std::numeric_limits<float>::max(),
+                     std::numeric_limits<float>::max()};
+  float corner[3] = {std::numeric_limits<float>::lowest(),
+                     std::numeric_limits<float>::lowest(),
+                     std::numeric_limits<float>::lowest()};
+  for (const Point& p : scan.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {
+      continue;
+    }
+    points.push_back(&p);
+    const float xyz[3] = {p.x, p.y, p.z};
+    for (int a = 0; a < 3; a++) {
+      origin[a] = std::min(origin[a], xyz[a]);
+      corner[a] = std::max(corner[a], xyz[a]);
+    }
+  }
+  const size_t n = points.size();
+  const double inverse_step = 1.0 / params.position_step;
+  for (int a = 0; n > 0 && a < 3; a++) {
+    if ((corner[a] - origin[a]) * inverse_step > 65535.0) {
+      return false;
+    }
+  }
+  if (n == 0) {
+    std::fill(origin, origin + 3, 0.0f);
+  }
+
+  // Quantized and delta coded streams
+  const size_t normal_bytes = params.b_normals ? 2 * n : 0;
+  std::vector<uint8_t> raw(8 * n + normal_bytes);
+  std::vector<uint16_t> stream(n);
+  for (int a = 0; a < 3; a++) {
+    uint16_t previous = 0;
+    for (size_t i = 0; i < n; i++) {
+      const float xyz[3] = {points[i]->x, points[i]->y, points[i]->z};
+      const uint16_t q = static_cast<uint16_t>(
+          std::lround((xyz[a] - origin[a]) * inverse_step));
+      stream[i] = q - previous;
+      previous = q;
+    }
+    SplitPlanes(stream.data(), n, raw.data() + 2 * n * a);
+  }
+  const double inverse_intensity_step = 1.0 / params.intensity_step;
+  for (size_t i = 0; i < n; i++) {
+    const double q =
+        std::round(points[i]->intensity * inverse_intensity_step);
+    stream[i] = static_cast<uint16_t>(std::min(65535.0, std::max(0.0, q)));
+  }
+  SplitPlanes(stream.data(), n, raw.data() + 6 * n);
+  if (params.b_normals) {
+    int8_t* u = reinterpret_cast<int8_t*>(raw.data() + 8 * n);
+    for (size_t i = 0; i < n; i++) {
+      EncodeOctahedral(*points[i], u + i, u + n + i);
+    }
+  }
+
+  EncodedHeader header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.flags = params.b_normals ? kHasNormals : 0;
+  header.num_points = n;
+  header.raw_bytes = raw.size();
+  header.stamp = scan.header.stamp;
+  header.seq = scan.header.seq;
+  header.frame_id_size = scan.header.frame_id.size();
+  header.position_step = params.position_step;
+  header.intensity_step = params.intensity_step;
+  std::copy(origin, origin + 3, header.origin);
+
+  const size_t prefix = sizeof(header) + header.frame_id_size;
+  uLongf compressed_size = compressBound(raw.size());
+  out->resize(prefix + compressed_size);
+  std::memcpy(out->data(), &header, sizeof(header));
+  std::memcpy(out->data() + sizeof(header),
+              scan.header.frame_id.data(),
+              header.frame_id_size);
+  if (compress2(out->data() + prefix,
+                &compressed_size,
+                raw.data(),
+                raw.size(),
+                params.level) != Z_OK) {
+    out->clear();
+    return false;
+  }
+  out->resize(prefix + compressed_size);
+  return true;
+}
+
+bool DecodeScan(const uint8_t* data, size_t size, PointCloud* scan) {
+  EncodedHeader header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  const size_t n = header.num_points;
+  const bool b_normals = header.flags & kHasNormals;
+  const size_t prefix = sizeof(header) + header.frame_id_size;
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      size < prefix || header.raw_bytes != 8 * n + (b_normals ? 2 * n : 0)) {
+    return false;
+  }
+
+  std::vector<uint8_t> raw(header.raw_bytes);
+  uLongf raw_size = raw.size();
+  if (uncompress(raw.data(), &raw_size, data + prefix, size - prefix) !=
+          Z_OK ||
+      raw_size != raw.size()) {
+    return false;
+  }
+
+  scan->header.stamp = header.stamp;
+  scan->header.seq = header.seq;
+  scan->header.frame_id.assign(
+      reinterpret_cast<const char*>(data + sizeof(header)),
+      header.frame_id_size);
+  scan->points.resize(n);
+  scan->width = n;
+  scan->height = 1;
+  scan->is_dense = true;
+
+  // Undo the delta coding and place the values. Only the running sum is
+  // serial, the other per point loops are plain enough to be vectorized.
+  std::vector<uint16_t> stream(n);
+  Point* points = scan->points.data();
+  for (int a = 0; a < 3; a++) {
+    JoinPlanes(raw.data() + 2 * n * a, n, stream.data());
+    uint16_t q = 0;
+    const float step = header.position_step;
+    const float origin = header.origin[a];
+    for (size_t i = 0; i < n; i++) {
+      q += stream[i];
+      points[i].data[a] = origin + q * step;
+    }
+  }
+  JoinPlanes(raw.data() + 6 * n, n, stream.data());
+  for (size_t i = 0; i < n; i++) {
+    points[i].data[3] = 1.0f;
+    points[i].intensity = stream[i] * header.intensity_step;
+    points[i].curvature = 0.0f;
+  }
+  const int8_t* u = reinterpret_cast<const int8_t*>(raw.data() + 8 * n);
+  for (size_t i = 0; i < n; i++) {
+    if (b_normals) {
+      DecodeOctahedral(u[i], u[n + i], &points[i]);
+    } else {
+      points[i].normal_x = points[i].normal_y = points[i].normal_z = 0.0f;
+    }
+    points[i].data_n[3] = 0.0f;
+  }
+  return true;
+}
+
+void ScanToKeyedScanMsg(const PointCloud& scan,
+                        const ScanCompressionParams* params,
+                        pose_graph_msgs::KeyedScan* msg) {
+  msg->compressed_scan.clear();
+  if (params != nullptr && EncodeScan(scan, *params, &msg->compressed_scan)) {
+    msg->scan = sensor_msgs::PointCloud2();
+    return;
+  }
+  PointXyziCloud pub_scan;
+  pcl::copyPointCloud(scan, pub_scan);
+  ToRosMsg(pub_scan, &msg->scan);
+}
+
+bool KeyedScanMsgToScan(const pose_graph_msgs::KeyedScan& msg,
+                        PointCloud* scan) {
+  if (msg.compressed_scan.empty()) {
+    FromRosMsg(msg.scan, scan);
+    return true;
+  }
+  return DecodeScan(
+      msg.compressed_scan.data(), msg.compressed_scan.size(), scan);
+}
+
+} // namespace lamp_utils
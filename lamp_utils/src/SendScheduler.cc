@@ -0,0 +1,91 @@
+/*
+SendScheduler.cc
+Priority queues with a byte budget for the robot to base traffic
+*/
+
+#include "lamp_utils/SendScheduler.h"
+
+#include <algorithm>
+
+namespace lamp_utils {
+
+SendScheduler::SendScheduler(double rate, double burst)
+  : rate_(rate), burst_(burst), budget_(burst) {}
+
+void SendScheduler::SetRate(double rate) {
+  rate_ = std::max(0.0, rate);
+}
+
+void SendScheduler::SetBurst(double burst) {
+  burst_ = std::max(0.0, burst);
+  budget_ = std::min(budget_, burst_);
+}
+
+void SendScheduler::Refill(double now) {
+  if (last_refill_ >= 0.0 && now > last_refill_) {
+    budget_ = std::min(burst_, budget_ + rate_ * (now - last_refill_));
+  }
+  last_refill_ = std::max(last_refill_, now);
+}
+
+void SendScheduler::Charge(size_t bytes) {
+  budget_ -= bytes;
+}
+
+void SendScheduler::Push(Priority priority, const Message& message) {
+  queues_[priority].push_back(message);
+}
+
+size_t SendScheduler::Dispatch() {
+  size_t sent = 0;
+  for (int p = 0; p < NUM_PRIORITIES; p++) {
+    auto& queue = queues_[p];
+    while (!queue.empty()) {
+      const Message& message = queue.front();
+      // A message larger than the burst goes once the budget is full
+      bool b_fits = message.bytes <= budget_ || budget_ >= burst_;
+      if (p != GRAPH && !b_fits) {
+        return sent;
+      }
+      Message next = message;
+      queue.pop_front();
+      budget_ -= next.bytes;
+      sent += next.bytes;
+      if (next.send) {
+        next.send();
+      }
+    }
+  }
+  return sent;
+}
+
+std::vector<SendScheduler::Message>
+SendScheduler::TakeExpired(Priority priority, double t) {
+  std::vector<Message> expired;
+  auto& queue = queues_[priority];
+  auto it = std::stable_partition(
+      queue.begin(), queue.end(), [t](const Message& m) {
+        return !(m.b_expires && m.stamp < t);
+      });
+  expired.assign(it, queue.end());
+  queue.erase(it, queue.end());
+  return expired;
+}
+
+size_t SendScheduler::QueuedBytes() const {
+  size_t bytes = 0;
+  for (const auto& queue : queues_) {
+    for (const auto& message : queue) {
+      bytes += message.bytes;
+    }
+  }
+  return bytes;
+}
+
+void SendScheduler::Clear() {
+  for (auto& queue : queues_) {
+    queue.clear();
+  }
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,81 @@
+/*
+SharedScanStore.cc
+Process-wide store of deserialized keyed scans
+*/
+
+#include "lamp_utils/SharedScanStore.h"
+
+#include "lamp_utils/PointCloudPool.h"
+#include "lamp_utils/ScanCompression.h"
+
+namespace lamp_utils {
+
+SharedScanStore& SharedScanStore::Instance() {
+  static SharedScanStore store;
+  return store;
+}
+
+PointCloudConstPtr
+SharedScanStore::GetOrConvert(const pose_graph_msgs::KeyedScan& msg) {
+  if (b_enabled_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = scans_.find(msg.key);
+    if (it != scans_.end()) {
+      num_shared_++;
+      return it->second;
+    }
+  }
+
+  // Convert outside the lock so other consumers are not blocked
+  PointCloud::Ptr scan = PointCloudPool::Instance().Acquire();
+  KeyedScanMsgToScan(msg, scan.get());
+  if (!b_enabled_) {
+    return scan;
+  }
+  return Insert(msg.key, scan);
+}
+
+PointCloudConstPtr SharedScanStore::Insert(const gtsam::Key& key,
+                                           const PointCloudConstPtr& scan) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // If another consumer converted the same key meanwhile keep the first copy
+  auto result = scans_.emplace(key, scan);
+  return result.first->second;
+}
+
+PointCloudConstPtr SharedScanStore::Get(const gtsam::Key& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = scans_.find(key);
+  if (it == scans_.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+bool SharedScanStore::Has(const gtsam::Key& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return scans_.count(key) > 0;
+}
+
+void SharedScanStore::Erase(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  scans_.erase(key);
+}
+
+void SharedScanStore::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  scans_.clear();
+  num_shared_ = 0;
+}
+
+size_t SharedScanStore::GetNumShared() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_shared_;
+}
+
+size_t SharedScanStore::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return scans_.size();
+}
+
+} // namespace lamp_utils
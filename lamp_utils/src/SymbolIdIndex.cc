@@ -0,0 +1,66 @@
+/*
+SymbolIdIndex.cc
+Bidirectional index between graph keys and the IDs of artifacts
+*/
+
+#include "lamp_utils/SymbolIdIndex.h"
+
+#include <gtsam/inference/Symbol.h>
+
+namespace lamp_utils {
+
+constexpr SymbolIdIndex::Handle SymbolIdIndex::kNoId;
+
+void SymbolIdIndex::Link(gtsam::Key key, Handle id) {
+  Erase(key);
+  if (id == kNoId)
+    return;
+  if (id >= id_keys_.size()) {
+    id_keys_.resize(ids_.size());
+    b_linked_.resize(ids_.size(), false);
+  }
+  if (b_linked_[id])
+    key_ids_.erase(id_keys_[id]);
+  id_keys_[id] = key;
+  b_linked_[id] = true;
+  key_ids_[key] = id;
+}
+
+bool SymbolIdIndex::Erase(gtsam::Key key) {
+  auto it = key_ids_.find(key);
+  if (it == key_ids_.end())
+    return false;
+  b_linked_[it->second] = false;
+  key_ids_.erase(it);
+  return true;
+}
+
+void SymbolIdIndex::ErasePrefix(unsigned char prefix) {
+  for (auto it = key_ids_.begin(); it != key_ids_.end();) {
+    if (gtsam::Symbol(it->first).chr() != prefix) {
+      it++;
+      continue;
+    }
+    b_linked_[it->second] = false;
+    it = key_ids_.erase(it);
+  }
+}
+
+SymbolIdIndex::Handle SymbolIdIndex::IdOf(gtsam::Key key) const {
+  auto it = key_ids_.find(key);
+  return it == key_ids_.end() ? kNoId : it->second;
+}
+
+bool SymbolIdIndex::KeyOf(Handle id, gtsam::Key* key) const {
+  if (id >= b_linked_.size() || !b_linked_[id])
+    return false;
+  *key = id_keys_[id];
+  return true;
+}
+
+void SymbolIdIndex::clear() {
+  key_ids_.clear();
+  b_linked_.assign(b_linked_.size(), false);
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,254 @@
+/*
+ThreadGovernor.cc
+Named thread groups of a process with their cores, priority and budget
+*/
+
+#include "lamp_utils/ThreadGovernor.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+namespace lamp_utils {
+
+namespace {
+
+double ClockSeconds(clockid_t clock) {
+  timespec ts;
+  if (clock_gettime(clock, &ts) != 0)
+    return 0.0;
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+double WallSeconds() {
+  return ClockSeconds(CLOCK_MONOTONIC);
+}
+
+} // namespace
+
+// Group of the calling thread, leaves it when the thread exits so its CPU
+// time is kept after its clock is gone
+struct ThreadRegistration {
+  ~ThreadRegistration() {
+    if (governor != nullptr)
+      governor->UnregisterThread(group, tid, clock);
+  }
+
+  ThreadGovernor* governor{nullptr};
+  std::string group;
+  long tid{0};
+  clockid_t clock;
+};
+
+namespace {
+
+thread_local ThreadRegistration registration;
+
+} // namespace
+
+ThreadGovernor& ThreadGovernor::Instance() {
+  // Never destroyed, pool threads leave their groups during static
+  // destruction
+  static ThreadGovernor* governor = new ThreadGovernor();
+  return *governor;
+}
+
+ThreadGovernor::ThreadGovernor() {
+  last_update_ = WallSeconds();
+  last_process_cpu_ = ClockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+ThreadGovernor::~ThreadGovernor() {
+  // Threads still registered outlive the governor only at process exit
+  if (registration.governor == this)
+    registration.governor = nullptr;
+}
+
+bool ThreadGovernor::LoadParameters(const ros::NodeHandle& n) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (b_loaded_)
+      return true;
+    b_loaded_ = true;
+  }
+  int core_budget = 0;
+  n.param<int>("thread_governor/core_budget", core_budget, 0);
+  SetCoreBudget(static_cast<size_t>(std::max(core_budget, 0)));
+
+  XmlRpc::XmlRpcValue groups;
+  if (!n.getParam("thread_governor/groups", groups))
+    return true;
+  if (groups.getType() != XmlRpc::XmlRpcValue::TypeStruct) {
+    ROS_ERROR("thread_governor/groups must map group names to settings");
+    return false;
+  }
+  for (auto it = groups.begin(); it != groups.end(); ++it) {
+    const std::string ns = "thread_governor/groups/" + it->first + "/";
+    ThreadGroupConfig config;
+    n.param<std::vector<int>>(ns + "cpus", config.cpus, std::vector<int>());
+    n.param<int>(ns + "nice", config.nice, 0);
+    n.param<int>(ns + "max_threads", config.max_threads, 0);
+    Configure(it->first, config);
+  }
+  return true;
+}
+
+void ThreadGovernor::Configure(const std::string& group,
+                               const ThreadGroupConfig& config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  groups_[group].config = config;
+}
+
+ThreadGroupConfig ThreadGovernor::Config(const std::string& group) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = groups_.find(group);
+  return it != groups_.end() ? it->second.config : ThreadGroupConfig();
+}
+
+void ThreadGovernor::SetCoreBudget(size_t cores) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  core_budget_ = cores;
+}
+
+size_t ThreadGovernor::CoreBudget() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return core_budget_ > 0
+      ? core_budget_
+      : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+size_t ThreadGovernor::Threads(const std::string& group, size_t requested) {
+  const size_t budget = CoreBudget();
+  std::lock_guard<std::mutex> lock(mutex_);
+  Group& g = groups_[group];
+  size_t granted = requested;
+  if (g.config.max_threads > 0)
+    granted = std::min<size_t>(granted, g.config.max_threads);
+  size_t others = 0;
+  for (const auto& other : groups_) {
+    if (&other.second != &g)
+      others += other.second.granted;
+  }
+  granted = std::min(granted, others < budget ? budget - others : 0);
+  g.granted = std::max<size_t>(granted, 1);
+  if (g.granted < requested) {
+    ROS_INFO("Thread group %s runs %lu of the %lu threads requested",
+             group.c_str(),
+             g.granted,
+             requested);
+  }
+  return g.granted;
+}
+
+void ThreadGovernor::RegisterThread(const std::string& group) {
+  if (registration.governor == this && registration.group == group)
+    return;
+  if (registration.governor != nullptr) {
+    registration.governor->UnregisterThread(
+        registration.group, registration.tid, registration.clock);
+  }
+
+  const ThreadGroupConfig config = Config(group);
+  if (!config.cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : config.cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE)
+        CPU_SET(cpu, &set);
+    }
+    const int error =
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (error != 0) {
+      ROS_WARN("Thread group %s: failed to set the CPU affinity: %s",
+               group.c_str(),
+               std::strerror(error));
+    }
+  }
+  const long tid = syscall(SYS_gettid);
+  if (config.nice != 0 &&
+      setpriority(PRIO_PROCESS, static_cast<id_t>(tid), config.nice) != 0) {
+    ROS_WARN("Thread group %s: failed to set nice %d: %s",
+             group.c_str(),
+             config.nice,
+             std::strerror(errno));
+  }
+
+  clockid_t clock;
+  if (pthread_getcpuclockid(pthread_self(), &clock) != 0)
+    clock = CLOCK_THREAD_CPUTIME_ID;
+  registration.governor = this;
+  registration.group = group;
+  registration.tid = tid;
+  registration.clock = clock;
+
+  const double cpu = ClockSeconds(clock);
+  std::lock_guard<std::mutex> lock(mutex_);
+  groups_[group].threads[tid] = std::make_pair(clock, cpu);
+}
+
+void ThreadGovernor::UnregisterThread(const std::string& group,
+                                      long tid,
+                                      clockid_t clock) {
+  // From the thread itself, its clock is still valid
+  const double cpu = ClockSeconds(clock);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Group& g = groups_[group];
+  auto it = g.threads.find(tid);
+  if (it == g.threads.end())
+    return;
+  g.exited_cpu += cpu - it->second.second;
+  g.threads.erase(it);
+}
+
+double ThreadGovernor::CpuTimeLocked(const Group& group) const {
+  double cpu = group.exited_cpu;
+  for (const auto& thread : group.threads) {
+    cpu += ClockSeconds(thread.second.first) - thread.second.second;
+  }
+  return cpu;
+}
+
+double ThreadGovernor::CpuTime(const std::string& group) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = groups_.find(group);
+  return it != groups_.end() ? CpuTimeLocked(it->second) : 0.0;
+}
+
+size_t ThreadGovernor::NumThreads(const std::string& group) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = groups_.find(group);
+  return it != groups_.end() ? it->second.threads.size() : 0;
+}
+
+void ThreadGovernor::UpdateUsage() {
+  MetricsRegistry& metrics = MetricsRegistry::Instance();
+  const double now = WallSeconds();
+  const double process_cpu = ClockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const double elapsed = now - last_update_;
+  if (elapsed <= 0)
+    return;
+  for (auto& group : groups_) {
+    const std::string prefix = "threads." + group.first;
+    const double cpu = CpuTimeLocked(group.second);
+    metrics.GetGauge(prefix + ".cpu")
+        .Set((cpu - group.second.reported_cpu) / elapsed);
+    metrics.GetGauge(prefix + ".count").Set(group.second.threads.size());
+    metrics.GetGauge(prefix + ".granted").Set(group.second.granted);
+    group.second.reported_cpu = cpu;
+  }
+  metrics.GetGauge("threads.process.cpu")
+      .Set((process_cpu - last_process_cpu_) / elapsed);
+  last_update_ = now;
+  last_process_cpu_ = process_cpu;
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,147 @@
+/*
+TimeKeyIndex.cc
+Flat time stamp indices of the pose graph keys
+*/
+
+#include "lamp_utils/TimeKeyIndex.h"
+
+#include <gtsam/inference/Symbol.h>
+
+#include <stdexcept>
+
+namespace lamp_utils {
+
+bool StampKeyIndex::Insert(double t, gtsam::Key key) {
+  // Appending, the common case
+  if (stamps_.empty() || t > stamps_.back()) {
+    stamps_.push_back(t);
+    keys_.push_back(key);
+    return true;
+  }
+  const size_t pos = LowerBound(t);
+  if (pos < stamps_.size() && stamps_[pos] == t) {
+    return false;
+  }
+  stamps_.insert(stamps_.begin() + pos, t);
+  keys_.insert(keys_.begin() + pos, key);
+  return true;
+}
+
+void StampKeyIndex::Assign(double t, gtsam::Key key) {
+  if (!Insert(t, key)) {
+    keys_[LowerBound(t)] = key;
+  }
+}
+
+boost::optional<gtsam::Key> StampKeyIndex::Find(double t) const {
+  const size_t pos = LowerBound(t);
+  if (pos < stamps_.size() && stamps_[pos] == t) {
+    return keys_[pos];
+  }
+  return boost::none;
+}
+
+bool StampKeyIndex::Erase(double t, gtsam::Key key) {
+  const size_t pos = LowerBound(t);
+  if (pos == stamps_.size() || stamps_[pos] != t || keys_[pos] != key) {
+    return false;
+  }
+  stamps_.erase(stamps_.begin() + pos);
+  keys_.erase(keys_.begin() + pos);
+  return true;
+}
+
+size_t StampKeyIndex::LowerBound(double t) const {
+  size_t n = stamps_.size();
+  if (n == 0) {
+    return 0;
+  }
+  // Halves the range with a conditional move instead of a branch
+  const double* base = stamps_.data();
+  while (n > 1) {
+    const size_t half = n / 2;
+    base = base[half] < t ? base + half : base;
+    n -= half;
+  }
+  return (base - stamps_.data()) + (*base < t);
+}
+
+void StampKeyIndex::clear() {
+  stamps_.clear();
+  keys_.clear();
+}
+
+gtsam::Key KeyedStampStore::ColumnKey(unsigned char chr, size_t index) {
+  return gtsam::Symbol(chr, index);
+}
+
+boost::optional<ros::Time> KeyedStampStore::Find(gtsam::Key key) const {
+  const gtsam::Symbol symbol(key);
+  auto column = columns_.find(symbol.chr());
+  if (column != columns_.end() && symbol.index() < column->second.b_set.size() &&
+      column->second.b_set[symbol.index()]) {
+    return column->second.stamps[symbol.index()];
+  }
+  auto sparse = sparse_.find(key);
+  if (sparse != sparse_.end()) {
+    return sparse->second;
+  }
+  return boost::none;
+}
+
+ros::Time KeyedStampStore::At(gtsam::Key key) const {
+  boost::optional<ros::Time> stamp = Find(key);
+  if (!stamp) {
+    throw std::out_of_range("KeyedStampStore: no stamp for key");
+  }
+  return *stamp;
+}
+
+void KeyedStampStore::Assign(gtsam::Key key, const ros::Time& stamp) {
+  auto sparse = sparse_.find(key);
+  if (sparse != sparse_.end()) {
+    sparse->second = stamp;
+    return;
+  }
+  const gtsam::Symbol symbol(key);
+  Column& column = columns_[symbol.chr()];
+  const size_t index = symbol.index();
+  if (index >= column.stamps.size()) {
+    if (index - column.stamps.size() > kMaxGap) {
+      sparse_[key] = stamp;
+      size_++;
+      return;
+    }
+    column.stamps.resize(index + 1);
+    column.b_set.resize(index + 1, false);
+  }
+  if (!column.b_set[index]) {
+    column.b_set[index] = true;
+    size_++;
+  }
+  column.stamps[index] = stamp;
+}
+
+bool KeyedStampStore::Erase(gtsam::Key key) {
+  if (sparse_.erase(key) > 0) {
+    size_--;
+    return true;
+  }
+  const gtsam::Symbol symbol(key);
+  auto column = columns_.find(symbol.chr());
+  if (column == columns_.end() || symbol.index() >= column->second.b_set.size() ||
+      !column->second.b_set[symbol.index()]) {
+    return false;
+  }
+  column->second.b_set[symbol.index()] = false;
+  size_--;
+  return true;
+}
+
+void KeyedStampStore::clear() {
+  columns_.clear();
+  sparse_.clear();
+  size_ = 0;
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,151 @@
+/*
+Tracing.cc
+Scoped timing spans per key, exported as a Chrome trace
+*/
+
+#include "lamp_utils/Tracing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <gtsam/inference/Symbol.h>
+
+namespace lamp_utils {
+
+namespace {
+
+const size_t kDefaultCapacity = 1 << 16;
+
+uint32_t CurrentThreadId() {
+  thread_local const uint32_t tid =
+      static_cast<uint32_t>(syscall(SYS_gettid));
+  return tid;
+}
+
+} // namespace
+
+Tracer& Tracer::Instance() {
+  static Tracer tracer;
+  return tracer;
+}
+
+Tracer::Tracer() {
+  SetCapacity(kDefaultCapacity);
+  const char* output_file = std::getenv("LAMP_TRACE_FILE");
+  if (output_file && *output_file) {
+    // One file per process, the nodes of a launch share the variable
+    output_file_ = std::string(output_file) + "." + std::to_string(getpid()) +
+        ".json";
+    Enable(true);
+  }
+}
+
+Tracer::~Tracer() {
+  if (!output_file_.empty()) {
+    WriteChromeTrace(output_file_);
+  }
+}
+
+void Tracer::Enable(bool b_enable) {
+  b_enabled_.store(b_enable, std::memory_order_relaxed);
+}
+
+void Tracer::SetCapacity(size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  slots_.reset(new Slot[size]);
+  mask_ = size - 1;
+  next_.store(0);
+}
+
+void Tracer::Record(const TraceEvent& event) {
+  const uint64_t index = next_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[index & mask_];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.event = event;
+  slot.event.thread_id = CurrentThreadId();
+  slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+std::vector<TraceEvent> Tracer::Snapshot() const {
+  std::vector<std::pair<uint64_t, TraceEvent>> recorded;
+  recorded.reserve(mask_ + 1);
+  for (size_t i = 0; i <= mask_; i++) {
+    const Slot& slot = slots_[i];
+    const uint64_t before = slot.sequence.load(std::memory_order_acquire);
+    if (before == 0)
+      continue;
+    const TraceEvent event = slot.event;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Overwritten while copying
+    if (slot.sequence.load(std::memory_order_relaxed) != before)
+      continue;
+    recorded.emplace_back(before, event);
+  }
+  std::sort(recorded.begin(),
+            recorded.end(),
+            [](const std::pair<uint64_t, TraceEvent>& a,
+               const std::pair<uint64_t, TraceEvent>& b) {
+              return a.first < b.first;
+            });
+
+  std::vector<TraceEvent> events;
+  events.reserve(recorded.size());
+  for (const auto& entry : recorded) {
+    events.push_back(entry.second);
+  }
+  return events;
+}
+
+void Tracer::Clear() {
+  for (size_t i = 0; i <= mask_; i++) {
+    slots_[i].sequence.store(0, std::memory_order_relaxed);
+  }
+}
+
+std::string Tracer::ToChromeTrace() const {
+  const int pid = getpid();
+  std::ostringstream out;
+  out << "{\"traceEvents\":[";
+  bool b_first = true;
+  for (const auto& event : Snapshot()) {
+    if (!b_first)
+      out << ",";
+    b_first = false;
+    out << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"ts\":"
+        << event.start_us << ",\"dur\":" << event.duration_us
+        << ",\"pid\":" << pid << ",\"tid\":" << event.thread_id;
+    if (event.key != 0) {
+      out << ",\"args\":{\"key\":\""
+          << gtsam::DefaultKeyFormatter(event.key) << "\"}";
+    }
+    out << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return out.str();
+}
+
+bool Tracer::WriteChromeTrace(const std::string& filename) const {
+  std::ofstream file(filename);
+  if (!file.is_open())
+    return false;
+  file << ToChromeTrace();
+  return file.good();
+}
+
+int64_t Tracer::NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+} // namespace lamp_utils
@@ -0,0 +1,53 @@
+/*
+VoxelMap.cc
+Voxel downsampled copy of a map kept up to date as points are inserted
+*/
+
+#include "lamp_utils/VoxelMap.h"
+
+#include <cmath>
+
+namespace lamp_utils {
+
+VoxelMap::VoxelMap(double leaf_size)
+  : leaf_size_(leaf_size), inverse_leaf_(1.0 / leaf_size) {}
+
+void VoxelMap::Insert(const PointCloud& points) {
+  for (const Point& p : points.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {
+      continue;
+    }
+    auto voxel = voxels_.emplace(ToVoxelIndex(p, inverse_leaf_), sums_.size());
+    if (voxel.second) {
+      sums_.push_back(PointSum::Zero());
+      counts_.push_back(0);
+    }
+    const size_t i = voxel.first->second;
+    sums_[i] += Eigen::Map<const Eigen::Matrix<float, kStride, 1>>(
+                    reinterpret_cast<const float*>(&p))
+                    .cast<double>();
+    counts_[i]++;
+  }
+}
+
+void VoxelMap::GetCloud(PointCloud* out) const {
+  out->points.resize(sums_.size());
+  for (size_t i = 0; i < sums_.size(); i++) {
+    Eigen::Map<Eigen::Matrix<float, kStride, 1>>(
+        reinterpret_cast<float*>(&out->points[i])) =
+        (sums_[i] / counts_[i]).cast<float>();
+  }
+  out->width = out->size();
+  out->height = 1;
+  out->is_dense = true;
+  out->sensor_origin_.setZero();
+  out->sensor_orientation_.setIdentity();
+}
+
+void VoxelMap::clear() {
+  voxels_.clear();
+  sums_.clear();
+  counts_.clear();
+}
+
+} // namespace lamp_utils
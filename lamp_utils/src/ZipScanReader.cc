@@ -0,0 +1,159 @@
+/*
+ZipScanReader.cc
+Reads the entries of a pose graph zip of the former format on demand
+*/
+
+#include "lamp_utils/ZipScanReader.h"
+
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <pcl/io/pcd_io.h>
+#include <ros/console.h>
+
+namespace lamp_utils {
+
+ZipScanReader::~ZipScanReader() {
+  for (unzFile handle : handles_)
+    unzClose(handle);
+  if (!directory_.empty()) {
+    boost::system::error_code error;
+    boost::filesystem::remove_all(directory_, error);
+  }
+}
+
+bool ZipScanReader::Open(const std::string& filename) {
+  filename_ = filename;
+  unzFile handle = AcquireHandle();
+  if (!handle)
+    return false;
+
+  unz_global_info64 global_info;
+  int err = unzGetGlobalInfo64(handle, &global_info);
+  if (err == UNZ_OK)
+    err = unzGoToFirstFile(handle);
+  for (unsigned long i = 0; i < global_info.number_entry && err == UNZ_OK;
+       ++i) {
+    char name[256];
+    unz_file_info64 file_info;
+    err = unzGetCurrentFileInfo64(
+        handle, &file_info, name, sizeof(name), nullptr, 0, nullptr, 0);
+    if (err == UNZ_OK) {
+      entries_.emplace_back(name);
+      err = unzGoToNextFile(handle);
+    }
+  }
+  ReleaseHandle(handle);
+  if (err != UNZ_OK && err != UNZ_END_OF_LIST_OF_FILE) {
+    ROS_ERROR_STREAM("ZipScanReader: Failed to list the entries of "
+                     << filename);
+    return false;
+  }
+
+  boost::system::error_code error;
+  const boost::filesystem::path directory =
+      boost::filesystem::temp_directory_path(error) /
+      boost::filesystem::unique_path("lamp_zip_%%%%-%%%%-%%%%");
+  if (error || !boost::filesystem::create_directories(directory, error)) {
+    ROS_ERROR("ZipScanReader: Failed to create a temporary directory");
+    return false;
+  }
+  directory_ = directory.string();
+  return true;
+}
+
+unzFile ZipScanReader::AcquireHandle() {
+  {
+    std::lock_guard<std::mutex> lock(handles_mutex_);
+    if (!handles_.empty()) {
+      unzFile handle = handles_.back();
+      handles_.pop_back();
+      return handle;
+    }
+  }
+  unzFile handle = unzOpen64(filename_.c_str());
+  if (!handle) {
+    ROS_ERROR_STREAM("ZipScanReader: Failed to open zip file " << filename_);
+  }
+  return handle;
+}
+
+void ZipScanReader::ReleaseHandle(unzFile handle) {
+  std::lock_guard<std::mutex> lock(handles_mutex_);
+  handles_.push_back(handle);
+}
+
+bool ZipScanReader::ReadEntry(const std::string& entry,
+                              std::vector<char>* data) {
+  unzFile handle = AcquireHandle();
+  if (!handle)
+    return false;
+
+  bool b_read = false;
+  unz_file_info64 file_info;
+  if (unzLocateFile(handle, entry.c_str(), 0) != UNZ_OK) {
+    ROS_ERROR_STREAM("ZipScanReader: Could not locate file "
+                     << entry << " in " << filename_);
+  } else if (unzGetCurrentFileInfo64(
+                 handle, &file_info, nullptr, 0, nullptr, 0, nullptr, 0) !=
+                 UNZ_OK ||
+             unzOpenCurrentFile(handle) != UNZ_OK) {
+    ROS_ERROR_STREAM("ZipScanReader: Could not open file "
+                     << entry << " in " << filename_);
+  } else {
+    data->resize(file_info.uncompressed_size);
+    const int size = data->empty()
+        ? 0
+        : unzReadCurrentFile(handle, data->data(), data->size());
+    b_read = size >= 0 && static_cast<size_t>(size) == data->size();
+    // Also checks the CRC once the entry is read to its end
+    b_read = unzCloseCurrentFile(handle) == UNZ_OK && b_read;
+    if (!b_read) {
+      ROS_ERROR_STREAM("ZipScanReader: Entry " << entry << " in " << filename_
+                                               << " is corrupted.");
+    }
+  }
+  ReleaseHandle(handle);
+  return b_read;
+}
+
+bool ZipScanReader::ExtractEntry(const std::string& entry,
+                                 std::string* path) {
+  std::vector<char> data;
+  if (!ReadEntry(entry, &data))
+    return false;
+  // Entries are named as extracted files of their own, numbered instead so
+  // concurrent extractions of the same entry do not collide
+  const boost::filesystem::path extracted =
+      boost::filesystem::path(directory_) /
+      (std::to_string(num_extracted_++) +
+       boost::filesystem::path(entry).extension().string());
+  std::ofstream os(extracted.string(), std::ios::binary);
+  os.write(data.data(), data.size());
+  os.close();
+  if (!os) {
+    ROS_ERROR_STREAM("ZipScanReader: Could not create file "
+                     << extracted.string() << " for extraction.");
+    return false;
+  }
+  *path = extracted.string();
+  return true;
+}
+
+PointCloud::Ptr ZipScanReader::ReadPointCloud(const std::string& entry) {
+  std::string path;
+  if (!ExtractEntry(entry, &path))
+    return nullptr;
+  PointCloud::Ptr scan(new PointCloud);
+  const bool b_loaded = pcl::io::loadPCDFile(path, *scan) != -1;
+  boost::system::error_code error;
+  boost::filesystem::remove(path, error);
+  if (!b_loaded) {
+    ROS_ERROR_STREAM("ZipScanReader: Failed to load point cloud "
+                     << entry << " from " << filename_);
+    return nullptr;
+  }
+  return scan;
+}
+
+} // namespace lamp_utils
@@ -5,3 +5,24 @@
  */
 #define GICP_IMPLEMENTATION
 #include <lamp_utils/gicp.h>
+
+template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    double,
+    Eigen::Matrix3d>;
+template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    double,
+    PlaneCovariance<double>>;
+template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    float,
+    Eigen::Matrix3f>;
+template class pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    Point,
+    Point,
+    float,
+    PlaneCovariance<float>>;
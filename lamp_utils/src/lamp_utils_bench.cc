@@ -0,0 +1,409 @@
+/*
+ * Copyright Notes
+ *
+ * Microbenchmarks of the lamp_utils hot primitives: the point cloud
+ * utilities and the filter at several cloud sizes, and the pose graph
+ * bookkeeping, messages, lookups and archive at several graph sizes. Every
+ * case runs repeatedly until --min_time, the timings per item go to stdout
+ * and, with --output, to a JSON file that can be kept as a baseline.
+ *
+ * lamp_utils_bench [--filter=substring] [--min_time=s] [--output=file.json]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/linear/NoiseModel.h>
+#include <pose_graph_msgs/PoseGraphEdge.h>
+#include <ros/ros.h>
+
+#include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/LampPcldFilter.h>
+#include <lamp_utils/PointCloudUtils.h>
+#include <lamp_utils/PoseGraph.h>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(const Clock::time_point& start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Options {
+  std::string filter;
+  std::string output;
+  double min_time{0.5};
+  size_t min_samples{3};
+};
+
+struct Result {
+  std::string name;
+  // Items (points, nodes, lookups...) processed per sample
+  size_t items{1};
+  std::vector<double> samples;
+};
+
+// A case measures one sample and returns its duration (s), so that the
+// setup of every sample stays out of the timing
+typedef std::function<double()> Sample;
+
+class Bench {
+public:
+  explicit Bench(const Options& options) : options_(options) {}
+
+  void Run(const std::string& name, size_t items, const Sample& sample) {
+    if (!options_.filter.empty() &&
+        name.find(options_.filter) == std::string::npos)
+      return;
+    Result result;
+    result.name = name;
+    result.items = std::max<size_t>(items, 1);
+    // One warm up sample, not recorded
+    sample();
+    double total = 0;
+    while (total < options_.min_time ||
+           result.samples.size() < options_.min_samples) {
+      const double s = sample();
+      result.samples.push_back(s);
+      total += s;
+    }
+    std::sort(result.samples.begin(), result.samples.end());
+    std::printf("%-48s %8zu samples %14.1f ns/item (p50) %14.1f ns/item (min)\n",
+                name.c_str(),
+                result.samples.size(),
+                1e9 * Median(result.samples) / result.items,
+                1e9 * result.samples.front() / result.items);
+    std::fflush(stdout);
+    results_.push_back(result);
+  }
+
+  void Write() const {
+    if (options_.output.empty())
+      return;
+    std::ofstream out(options_.output);
+    std::time_t now = std::time(nullptr);
+    char date[32];
+    std::strftime(
+        date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    out << "{\n  \"context\": {\"date\": \"" << date << "\", \"num_cpus\": "
+        << std::thread::hardware_concurrency()
+        << ", \"min_time_s\": " << options_.min_time
+        << "},\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results_.size(); i++) {
+      const Result& r = results_[i];
+      double sum = 0;
+      for (double s : r.samples)
+        sum += s;
+      out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << r.name
+          << "\", \"samples\": " << r.samples.size()
+          << ", \"items_per_sample\": " << r.items
+          << ", \"ns_per_item\": {\"mean\": "
+          << 1e9 * sum / r.samples.size() / r.items
+          << ", \"p50\": " << 1e9 * Median(r.samples) / r.items
+          << ", \"min\": " << 1e9 * r.samples.front() / r.items
+          << ", \"max\": " << 1e9 * r.samples.back() / r.items << "}}";
+    }
+    out << "\n  ]\n}\n";
+    std::cout << "Wrote benchmark results to " << options_.output << "\n";
+  }
+
+private:
+  static double Median(const std::vector<double>& sorted) {
+    return sorted[sorted.size() / 2];
+  }
+
+  Options options_;
+  std::vector<Result> results_;
+};
+
+// Ground, two walls and a box with sensor noise, the same for every run
+PointCloud::Ptr MakeCloud(size_t num_points) {
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> u(-10.f, 10.f);
+  std::normal_distribution<float> noise(0.f, 0.02f);
+  PointCloud::Ptr cloud(new PointCloud);
+  cloud->reserve(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    Point p;
+    const float a = u(rng), b = u(rng);
+    switch (i % 4) {
+    case 0:
+      p.x = a, p.y = b, p.z = -1.f + noise(rng);
+      break;
+    case 1:
+      p.x = 10.f + noise(rng), p.y = a, p.z = 0.2f * b + 1.f;
+      break;
+    case 2:
+      p.x = a, p.y = 10.f + noise(rng), p.z = 0.2f * b + 1.f;
+      break;
+    default:
+      // Box of 2 m at (3, -4)
+      p.x = 3.f + 0.1f * a, p.y = -4.f + 0.1f * b, p.z = 1.f + noise(rng);
+      break;
+    }
+    p.intensity = static_cast<float>(i % 100);
+    cloud->push_back(p);
+  }
+  return cloud;
+}
+
+gtsam::SharedNoiseModel Sigmas() {
+  gtsam::Vector6 sigmas;
+  sigmas << 0.01, 0.01, 0.01, 0.1, 0.1, 0.1;
+  return gtsam::noiseModel::Diagonal::Sigmas(sigmas);
+}
+
+gtsam::Pose3 OdomStep() {
+  return gtsam::Pose3(gtsam::Rot3::Yaw(0.01), gtsam::Point3(1.0, 0, 0));
+}
+
+// Chain of num_nodes odometry nodes of robot a, a node every second
+void BuildGraph(size_t num_nodes, PoseGraph* graph) {
+  const gtsam::SharedNoiseModel noise = Sigmas();
+  graph->Initialize(gtsam::Symbol('a', 0), gtsam::Pose3(), Sigmas());
+  gtsam::Pose3 pose;
+  for (size_t i = 1; i < num_nodes; i++) {
+    pose = pose * OdomStep();
+    const gtsam::Symbol key('a', i);
+    graph->TrackNode(ros::Time(1.0 + i), key, pose, noise);
+    graph->TrackFactor(gtsam::Symbol('a', i - 1),
+                       key,
+                       pose_graph_msgs::PoseGraphEdge::ODOM,
+                       OdomStep(),
+                       noise);
+    graph->InsertStampedOdomKey(1.0 + i, key);
+  }
+}
+
+void PointCloudBenchmarks(Bench* bench) {
+  for (size_t num_points : {1000, 10000, 50000}) {
+    const std::string size = "/" + std::to_string(num_points);
+    PointCloud::Ptr cloud = MakeCloud(num_points);
+    lamp_utils::NormalComputeParams normal_params;
+
+    bench->Run("ComputeNormals" + size, num_points, [&]() {
+      lamp_utils::Normals::Ptr normals(new lamp_utils::Normals);
+      auto start = Clock::now();
+      lamp_utils::ComputeNormals<Point>(cloud, normal_params, normals);
+      return Seconds(start);
+    });
+
+    bench->Run("ComputeIcpObservability" + size, num_points, [&]() {
+      Eigen::Matrix<double, 3, 1> eigenvalues;
+      auto start = Clock::now();
+      lamp_utils::ComputeIcpObservability(cloud, &eigenvalues);
+      return Seconds(start);
+    });
+
+    // As on the robot, where the filter stores the normals first
+    PointCloud::Ptr with_normals(new PointCloud(*cloud));
+    lamp_utils::EnsureNormals(with_normals, normal_params);
+    bench->Run("ComputeIcpObservabilityStoredNormals" + size,
+               num_points,
+               [&]() {
+                 Eigen::Matrix<double, 3, 1> eigenvalues;
+                 auto start = Clock::now();
+                 lamp_utils::ComputeIcpObservability(with_normals,
+                                                     &eigenvalues);
+                 return Seconds(start);
+               });
+
+    lamp_utils::HarrisParams harris;
+    harris.harris_threshold_ = 1e-6;
+    harris.harris_suppression_ = true;
+    harris.harris_radius_ = 0.5;
+    harris.harris_refine_ = false;
+    harris.harris_response_ = 1;
+    bench->Run("ComputeKeypoints" + size, num_points, [&]() {
+      PointCloud::Ptr keypoints(new PointCloud);
+      auto start = Clock::now();
+      lamp_utils::ComputeKeypoints(cloud, harris, 4, keypoints);
+      return Seconds(start);
+    });
+
+    lamp_utils::Normals::Ptr normals(new lamp_utils::Normals);
+    lamp_utils::ComputeNormals<Point>(cloud, normal_params, normals);
+    PointCloud::Ptr keypoints(new PointCloud);
+    lamp_utils::ComputeKeypoints(cloud, normals, harris, 4, keypoints);
+    bench->Run("ComputeFeatures" + size,
+               std::max<size_t>(keypoints->size(), 1),
+               [&]() {
+                 lamp_utils::Features::Ptr features(new lamp_utils::Features);
+                 auto start = Clock::now();
+                 lamp_utils::ComputeFeatures(
+                     keypoints, cloud, normals, 1.0, 4, features);
+                 return Seconds(start);
+               });
+
+    LampPcldFilterParams random_params;
+    LampPcldFilter random_filter(random_params);
+    bench->Run("LampPcldFilter/random" + size, num_points, [&]() {
+      PointCloud::Ptr filtered(new PointCloud);
+      auto start = Clock::now();
+      random_filter.Filter(*cloud, filtered);
+      return Seconds(start);
+    });
+
+    LampPcldFilterParams adaptive_params;
+    adaptive_params.random_filter = false;
+    adaptive_params.adaptive_grid_filter = true;
+    adaptive_params.observability_check = true;
+    LampPcldFilter adaptive_filter(adaptive_params);
+    bench->Run("LampPcldFilter/adaptive_grid" + size, num_points, [&]() {
+      PointCloud::Ptr filtered(new PointCloud);
+      auto start = Clock::now();
+      adaptive_filter.Filter(*cloud, filtered);
+      return Seconds(start);
+    });
+  }
+}
+
+void PoseGraphBenchmarks(Bench* bench) {
+  const gtsam::SharedNoiseModel noise = Sigmas();
+  for (size_t num_nodes : {1000, 10000, 100000}) {
+    const std::string size = "/" + std::to_string(num_nodes);
+
+    bench->Run("PoseGraph/TrackNode" + size, num_nodes, [&]() {
+      PoseGraph graph;
+      graph.Initialize(gtsam::Symbol('a', 0), gtsam::Pose3(), noise);
+      gtsam::Pose3 pose;
+      auto start = Clock::now();
+      for (size_t i = 1; i < num_nodes; i++) {
+        pose = pose * OdomStep();
+        graph.TrackNode(ros::Time(1.0 + i), gtsam::Symbol('a', i), pose, noise);
+      }
+      return Seconds(start);
+    });
+
+    bench->Run("PoseGraph/TrackFactor" + size, num_nodes, [&]() {
+      PoseGraph graph;
+      graph.Initialize(gtsam::Symbol('a', 0), gtsam::Pose3(), noise);
+      gtsam::Pose3 pose;
+      for (size_t i = 1; i < num_nodes; i++) {
+        pose = pose * OdomStep();
+        graph.TrackNode(ros::Time(1.0 + i), gtsam::Symbol('a', i), pose, noise);
+      }
+      auto start = Clock::now();
+      for (size_t i = 1; i < num_nodes; i++) {
+        graph.TrackFactor(gtsam::Symbol('a', i - 1),
+                          gtsam::Symbol('a', i),
+                          pose_graph_msgs::PoseGraphEdge::ODOM,
+                          OdomStep(),
+                          noise);
+      }
+      return Seconds(start);
+    });
+
+    PoseGraph graph;
+    BuildGraph(num_nodes, &graph);
+
+    bench->Run("PoseGraph/ToMsg" + size, num_nodes, [&]() {
+      auto start = Clock::now();
+      GraphMsgPtr msg = graph.ToMsg();
+      return Seconds(start);
+    });
+
+    const GraphMsgPtr msg = graph.ToMsg();
+    bench->Run("PoseGraph/UpdateFromMsg" + size, num_nodes, [&]() {
+      PoseGraph updated;
+      auto start = Clock::now();
+      updated.UpdateFromMsg(msg);
+      return Seconds(start);
+    });
+
+    const size_t num_lookups = 10000;
+    std::vector<ros::Time> stamps;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> u(2.0, 1.0 + num_nodes - 1);
+    for (size_t i = 0; i < num_lookups; i++) {
+      stamps.push_back(ros::Time(u(rng)));
+    }
+    bench->Run("PoseGraph/GetClosestKeyAtTime" + size, num_lookups, [&]() {
+      size_t found = 0;
+      auto start = Clock::now();
+      for (const ros::Time& stamp : stamps) {
+        found += graph.GetClosestKeyAtTime(stamp, false).index() > 0;
+      }
+      const double s = Seconds(start);
+      // Keeps the lookups from being optimized away
+      if (found == 0)
+        std::cerr << "No key found\n";
+      return s;
+    });
+
+    // A scan every 10 keys
+    PoseGraph archived;
+    BuildGraph(num_nodes, &archived);
+    PointCloud::Ptr scan = MakeCloud(1000);
+    for (size_t i = 0; i < num_nodes; i += 10) {
+      archived.InsertKeyedScan(gtsam::Symbol('a', i), scan);
+      archived.InsertKeyedStamp(gtsam::Symbol('a', i), ros::Time(1.0 + i));
+    }
+    const std::string file = "/tmp/lamp_utils_bench_" +
+        std::to_string(getpid()) + size.substr(1) + ".lpg";
+    bench->Run("PoseGraph/Save" + size, num_nodes, [&]() {
+      std::remove(file.c_str());
+      auto start = Clock::now();
+      archived.Save(file);
+      return Seconds(start);
+    });
+    bench->Run("PoseGraph/Load" + size, num_nodes, [&]() {
+      PoseGraph loaded;
+      auto start = Clock::now();
+      loaded.Load(file);
+      return Seconds(start);
+    });
+    std::remove(file.c_str());
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg(argv[i]);
+    auto value = [&arg](const std::string& flag, std::string* out) {
+      if (arg.compare(0, flag.size(), flag) != 0)
+        return false;
+      *out = arg.substr(flag.size());
+      return true;
+    };
+    std::string min_time;
+    if (value("--filter=", &options.filter) ||
+        value("--output=", &options.output)) {
+      continue;
+    } else if (value("--min_time=", &min_time)) {
+      options.min_time = std::stod(min_time);
+    } else {
+      std::cerr << "Usage: lamp_utils_bench [--filter=substring] "
+                   "[--min_time=s] [--output=file.json]\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Graph stamps without a ROS master
+  ros::Time::init();
+  // The expected end cases of the lookups log errors
+  ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME,
+                                 ros::console::levels::Fatal);
+  ros::console::notifyLoggerLevelsChanged();
+
+  Bench bench(options);
+  PointCloudBenchmarks(&bench);
+  PoseGraphBenchmarks(&bench);
+  bench.Write();
+  return EXIT_SUCCESS;
+}
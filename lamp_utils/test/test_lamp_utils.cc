@@ -5,7 +5,11 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <map>
 #include <math.h>
+#include <mutex>
+#include <thread>
 #include <ros/ros.h>
 
 #include <pose_graph_msgs/KeyedScan.h>
@@ -16,9 +20,37 @@
 #include <gtsam/inference/Key.h>
 #include <gtsam/inference/Symbol.h>
 #include <gtsam/linear/NoiseModel.h>
+#include <gtsam/slam/BetweenFactor.h>
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/DoubleBuffer.h>
+#include <lamp_utils/FlatHashMap.h>
+#include <lamp_utils/G2oStream.h>
+#include <lamp_utils/KeyedScanLoader.h>
+#include <lamp_utils/KeyedScanStore.h>
+#include <lamp_utils/KeyedSpatialIndex.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/Metrics.h>
+#include <lamp_utils/ObservabilityCache.h>
+#include <lamp_utils/PipelineStage.h>
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudPool.h>
+#include <lamp_utils/PoseExtrapolator.h>
+#include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/RobotChainIndex.h>
+#include <lamp_utils/ScanCompression.h>
+#include <lamp_utils/SendScheduler.h>
+#include <lamp_utils/SharedScanStore.h>
+#include <lamp_utils/SymbolIdIndex.h>
+#include <lamp_utils/SpscRing.h>
+#include <lamp_utils/ThreadGovernor.h>
+#include <lamp_utils/TimeIndexedBuffer.h>
+#include <lamp_utils/TimeKeyIndex.h>
+#include <lamp_utils/Tracing.h>
+#include <lamp_utils/gicp.h>
+#include <pcl/common/io.h>
+#include <pcl_conversions/pcl_conversions.h>
 
 class TestUtils : public ::testing::Test {
   public:
@@ -146,6 +178,77 @@ TEST(TestCommonFunctions, TestGtsamToRosPose) {
   EXPECT_NEAR(ros_pose.orientation.w, 1.0, 1e-7);
 }
 
+TEST(TestCommonFunctions, MessageConversionsShareNoiseModels) {
+  lamp_utils::NoiseModelCache::Instance().Clear();
+
+  // Two odometry edges with the same covariance, one loop closure
+  std::vector<pose_graph_msgs::PoseGraphEdge> edges(3);
+  for (size_t i = 0; i < edges.size(); i++) {
+    edges[i].pose.position.x = i;
+    // Not normalized, the conversion normalizes it
+    edges[i].pose.orientation.w = 2.0;
+    for (int j = 0; j < 6; j++)
+      edges[i].covariance[7 * j] = i < 2 ? 0.01 : 0.5;
+  }
+  edges[2].covariance[1] = edges[2].covariance[6] = 0.1;
+
+  std::vector<gtsam::Pose3> poses;
+  std::vector<Gaussian::shared_ptr> noises;
+  lamp_utils::MessagesToGtsam(edges, &poses, &noises);
+  ASSERT_EQ(poses.size(), 3);
+  EXPECT_TRUE(poses[1].equals(
+      gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(1, 0, 0)), 1e-9));
+  EXPECT_EQ(noises[0], noises[1]);
+  EXPECT_NE(noises[0], noises[2]);
+  EXPECT_EQ(lamp_utils::NoiseModelCache::Instance().Size(), 2);
+  EXPECT_EQ(lamp_utils::NoiseModelCache::Instance().GetNumHits(), 1);
+  EXPECT_TRUE(gtsam::assert_equal(
+      lamp_utils::MessageToCovarianceMatrix(edges[2]), noises[2]->covariance()));
+
+  // Round trip of the covariance through the row major view
+  pose_graph_msgs::PoseGraphEdge copy;
+  lamp_utils::UpdateCovariance(copy, noises[2]->covariance());
+  for (size_t i = 0; i < copy.covariance.size(); i++)
+    EXPECT_NEAR(copy.covariance[i], edges[2].covariance[i], 1e-9);
+
+  // Contiguous buffers in the graph store layout
+  std::vector<double> pose_buffer, covariance_buffer;
+  lamp_utils::MessagesToPoseBuffer(edges, &pose_buffer);
+  lamp_utils::MessagesToCovarianceBuffer(edges, &covariance_buffer);
+  ASSERT_EQ(pose_buffer.size(), 21);
+  ASSERT_EQ(covariance_buffer.size(), 108);
+  EXPECT_EQ(pose_buffer[7], 1.0);
+  EXPECT_EQ(pose_buffer[13], 2.0);
+  EXPECT_EQ(covariance_buffer[72 + 1], 0.1);
+}
+
+TEST(TestCommonFunctions, InternNoiseModels) {
+  lamp_utils::NoiseModelCache& cache = lamp_utils::NoiseModelCache::Instance();
+  cache.Clear();
+
+  gtsam::Vector6 sigmas;
+  sigmas << 0.1, 0.1, 0.1, 0.5, 0.5, 0.5;
+  const gtsam::SharedNoiseModel first = cache.Intern(
+      gtsam::noiseModel::Diagonal::Sigmas(sigmas));
+  const gtsam::SharedNoiseModel second = cache.Intern(
+      gtsam::noiseModel::Diagonal::Sigmas(sigmas));
+  EXPECT_EQ(first, second);
+  // The type of the first model is kept
+  EXPECT_TRUE(boost::dynamic_pointer_cast<Diagonal>(first));
+
+  // Messages with that covariance get the same model
+  pose_graph_msgs::PoseGraphEdge edge;
+  lamp_utils::UpdateCovariance(edge, first);
+  EXPECT_EQ(gtsam::SharedNoiseModel(lamp_utils::MessageToCovariance(edge)),
+            first);
+
+  // Other dimensions are not interned
+  const gtsam::SharedNoiseModel range =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.3);
+  EXPECT_EQ(cache.Intern(range), range);
+  EXPECT_EQ(cache.Size(), 1);
+}
+
 TEST(TestCommonFunctions, TestGtsamToRosPoseCovar) {
   // Create gtsam pose3
   double x = 1.0;
@@ -172,6 +275,1102 @@ TEST(TestCommonFunctions, TestGtsamToRosPoseCovar) {
   EXPECT_NEAR(ros_pose.covariance[0], 1.0, 1e-7);
 }
 
+TEST(TestKeyedSpatialIndex, RadiusSearch) {
+  lamp_utils::KeyedSpatialIndex index(2.0);
+  index.Insert(gtsam::Symbol('a', 0), gtsam::Point3(0, 0, 0));
+  index.Insert(gtsam::Symbol('a', 1), gtsam::Point3(1.5, 0, 0));
+  index.Insert(gtsam::Symbol('b', 0), gtsam::Point3(-3.0, 0, 0));
+  index.Insert(gtsam::Symbol('c', 0), gtsam::Point3(100, 0, 0));
+  EXPECT_EQ(4, index.Size());
+
+  std::vector<gtsam::Key> keys =
+      index.RadiusSearch(gtsam::Point3(0, 0, 0), 3.0);
+  std::sort(keys.begin(), keys.end());
+  ASSERT_EQ(3, keys.size());
+  EXPECT_EQ(gtsam::Symbol('a', 0), keys[0]);
+  EXPECT_EQ(gtsam::Symbol('a', 1), keys[1]);
+  EXPECT_EQ(gtsam::Symbol('b', 0), keys[2]);
+
+  EXPECT_EQ(1, index.RadiusSearch(gtsam::Point3(0, 0, 0), 1.0).size());
+}
+
+TEST(TestKeyedSpatialIndex, InsertBatch) {
+  lamp_utils::KeyedSpatialIndex index(2.0);
+  for (int i = 0; i < 8; i++) {
+    index.Insert(gtsam::Symbol('a', i), gtsam::Point3(i, 0, 0));
+  }
+  // Small batch moves keys one by one, a large one re-buckets
+  index.InsertBatch({{gtsam::Symbol('a', 0), gtsam::Point3(50, 0, 0)}});
+  EXPECT_EQ(8, index.Size());
+  EXPECT_EQ(1, index.RadiusSearch(gtsam::Point3(50, 0, 0), 1.0).size());
+
+  std::vector<std::pair<gtsam::Key, gtsam::Point3>> batch;
+  for (int i = 0; i < 8; i++) {
+    batch.emplace_back(gtsam::Symbol('a', i), gtsam::Point3(0, i, 100));
+  }
+  batch.emplace_back(gtsam::Symbol('b', 0), gtsam::Point3(0, 0, 100));
+  index.InsertBatch(batch);
+  EXPECT_EQ(9, index.Size());
+  EXPECT_TRUE(index.RadiusSearch(gtsam::Point3(50, 0, 0), 1.0).empty());
+  EXPECT_EQ(9, index.RadiusSearch(gtsam::Point3(0, 3.5, 100), 4.0).size());
+}
+
+TEST(TestKeyedSpatialIndex, UpdateAndErase) {
+  lamp_utils::KeyedSpatialIndex index(1.0);
+  gtsam::Symbol key('a', 0);
+  index.Insert(key, gtsam::Point3(0, 0, 0));
+
+  // Move the key far away
+  index.Insert(key, gtsam::Point3(50, 50, 0));
+  EXPECT_EQ(1, index.Size());
+  EXPECT_EQ(0, index.RadiusSearch(gtsam::Point3(0, 0, 0), 5.0).size());
+  EXPECT_EQ(1, index.RadiusSearch(gtsam::Point3(50, 50, 0), 5.0).size());
+
+  // Changing the cell size keeps the keys
+  index.SetCellSize(20.0);
+  EXPECT_EQ(1, index.RadiusSearch(gtsam::Point3(50, 50, 0), 5.0).size());
+
+  EXPECT_TRUE(index.Erase(key));
+  EXPECT_FALSE(index.Erase(key));
+  EXPECT_FALSE(index.Has(key));
+  EXPECT_EQ(0, index.RadiusSearch(gtsam::Point3(50, 50, 0), 5.0).size());
+}
+
+TEST(TestSharedScanStore, ShareConvertedScans) {
+  lamp_utils::SharedScanStore& store = lamp_utils::SharedScanStore::Instance();
+  PointCloud cloud;
+  Point p;
+  p.x = 1.0;
+  cloud.push_back(p);
+  pose_graph_msgs::KeyedScan msg;
+  msg.key = gtsam::Symbol('a', 0);
+  pcl::toROSMsg(cloud, msg.scan);
+
+  // Disabled store converts every time and keeps nothing
+  store.SetEnabled(false);
+  EXPECT_NE(store.GetOrConvert(msg), store.GetOrConvert(msg));
+  EXPECT_EQ(0, store.Size());
+
+  // Enabled store hands out the same cloud to every consumer
+  store.SetEnabled(true);
+  PointCloudConstPtr first = store.GetOrConvert(msg);
+  PointCloudConstPtr second = store.GetOrConvert(msg);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(1, first->size());
+  EXPECT_EQ(1, store.GetNumShared());
+  EXPECT_EQ(first, store.Get(msg.key));
+
+  store.Erase(msg.key);
+  EXPECT_FALSE(store.Has(msg.key));
+  EXPECT_EQ(nullptr, store.Get(msg.key));
+  store.Clear();
+  store.SetEnabled(false);
+}
+
+TEST(TestKeyedScanStore, EvictAndPageIn) {
+  const size_t num_points = 100;
+  const size_t scan_bytes = sizeof(PointCloud) + num_points * sizeof(Point);
+  lamp_utils::KeyedScanStore store;
+  // Room for two scans
+  ASSERT_TRUE(store.Configure(2 * scan_bytes, "/tmp"));
+
+  for (size_t k = 0; k < 5; k++) {
+    PointCloud::Ptr scan(new PointCloud);
+    scan->header.frame_id = "world";
+    for (size_t i = 0; i < num_points; i++) {
+      Point p;
+      p.x = k;
+      p.y = i;
+      scan->push_back(p);
+    }
+    EXPECT_TRUE(store.Insert(gtsam::Symbol('a', k), scan));
+  }
+  EXPECT_FALSE(store.Insert(gtsam::Symbol('a', 0), PointCloud::Ptr(new PointCloud)));
+
+  lamp_utils::KeyedScanStore::Stats stats = store.GetStats();
+  EXPECT_EQ(5, store.Size());
+  EXPECT_EQ(3, stats.evictions);
+  EXPECT_LE(stats.resident_bytes, 2 * scan_bytes);
+  EXPECT_GT(stats.spilled_bytes, 0);
+
+  // Oldest scan comes back from the spill file intact
+  PointCloudConstPtr scan0 = store.Get(gtsam::Symbol('a', 0));
+  ASSERT_TRUE(scan0 != nullptr);
+  ASSERT_EQ(num_points, scan0->size());
+  EXPECT_EQ(0, scan0->points[10].x);
+  EXPECT_EQ(10, scan0->points[10].y);
+  EXPECT_EQ("world", scan0->header.frame_id);
+
+  // Newest scan is still resident
+  PointCloudConstPtr scan4 = store.Get(gtsam::Symbol('a', 4));
+  ASSERT_TRUE(scan4 != nullptr);
+  EXPECT_EQ(4, scan4->points[0].x);
+
+  stats = store.GetStats();
+  EXPECT_EQ(1, stats.misses);
+  EXPECT_EQ(1, stats.hits);
+
+  EXPECT_TRUE(store.Erase(gtsam::Symbol('a', 1)));
+  EXPECT_FALSE(store.Has(gtsam::Symbol('a', 1)));
+  EXPECT_EQ(nullptr, store.Get(gtsam::Symbol('a', 1)));
+}
+
+TEST(TestKeyedScanLoader, BackgroundAndOnDemand) {
+  std::mutex mutex;
+  std::map<gtsam::Key, int> reads;
+  auto read = [&mutex, &reads](const gtsam::Key& key) -> PointCloud::Ptr {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      reads[key]++;
+    }
+    if (gtsam::Symbol(key).index() == 3)
+      return nullptr;
+    PointCloud::Ptr scan(new PointCloud);
+    Point p;
+    p.x = gtsam::Symbol(key).index();
+    scan->push_back(p);
+    return scan;
+  };
+
+  std::vector<gtsam::Key> keys;
+  for (int i = 9; i >= 0; i--)
+    keys.push_back(gtsam::Symbol('a', i));
+  lamp_utils::KeyedScanLoader loader(keys, read, 2);
+  EXPECT_EQ(10, loader.Keys().size());
+  EXPECT_TRUE(std::is_sorted(loader.Keys().begin(), loader.Keys().end()));
+  EXPECT_TRUE(loader.Has(gtsam::Symbol('a', 5)));
+  EXPECT_FALSE(loader.Has(gtsam::Symbol('a', 10)));
+  EXPECT_EQ(nullptr, loader.Get(gtsam::Symbol('a', 10)));
+
+  // Asked for while the workers run, read or awaited once
+  PointCloudConstPtr scan = loader.Get(gtsam::Symbol('a', 7));
+  ASSERT_TRUE(scan != nullptr);
+  EXPECT_EQ(7, scan->points[0].x);
+
+  loader.Wait();
+  EXPECT_TRUE(loader.IsDone());
+  EXPECT_EQ(10, loader.NumRead());
+  for (const gtsam::Key& key : keys)
+    EXPECT_EQ(1, reads[key]);
+  EXPECT_EQ(nullptr, loader.Get(gtsam::Symbol('a', 3)));
+  EXPECT_EQ(scan, loader.Get(gtsam::Symbol('a', 7)));
+  const size_t resident = loader.ResidentBytes();
+  EXPECT_GT(resident, 0);
+
+  // A taken scan leaves the loader and is read again when asked for
+  EXPECT_EQ(scan, loader.Take(gtsam::Symbol('a', 7)));
+  EXPECT_LT(loader.ResidentBytes(), resident);
+  PointCloudConstPtr again = loader.Get(gtsam::Symbol('a', 7));
+  ASSERT_TRUE(again != nullptr);
+  EXPECT_NE(scan, again);
+  EXPECT_EQ(7, again->points[0].x);
+  EXPECT_EQ(2, reads[gtsam::Symbol('a', 7)]);
+}
+
+TEST(TestTimeIndexedBuffer, RingOrderAndLookup) {
+  lamp_utils::TimeIndexedBuffer<int> buffer(3);
+
+  EXPECT_TRUE(buffer.Insert(1.0, 1));
+  EXPECT_TRUE(buffer.Insert(3.0, 3));
+  // Out of order entries are sorted in, duplicate stamps rejected
+  EXPECT_TRUE(buffer.Insert(2.0, 2));
+  EXPECT_FALSE(buffer.Insert(2.0, 5));
+  EXPECT_EQ(3, buffer.size());
+  EXPECT_EQ(2, buffer.At(1));
+
+  // Full, the oldest entry is dropped
+  EXPECT_TRUE(buffer.Insert(4.0, 4));
+  EXPECT_EQ(3, buffer.size());
+  EXPECT_DOUBLE_EQ(2.0, buffer.FrontTime());
+  EXPECT_DOUBLE_EQ(4.0, buffer.BackTime());
+  EXPECT_FALSE(buffer.Insert(0.5, 0));
+
+  EXPECT_EQ(0, buffer.LowerBound(1.0));
+  EXPECT_EQ(1, buffer.LowerBound(2.5));
+  EXPECT_EQ(3, buffer.LowerBound(5.0));
+  EXPECT_EQ(0, buffer.Closest(2.4));
+  EXPECT_EQ(1, buffer.Closest(2.6));
+  // Ties go to the older entry
+  EXPECT_EQ(0, buffer.Closest(2.5));
+  EXPECT_EQ(2, buffer.Closest(10.0));
+
+  buffer.EraseBefore(2);
+  EXPECT_EQ(1, buffer.size());
+  EXPECT_EQ(4, buffer.Front());
+}
+
+TEST(TestSendScheduler, PriorityWithinBudget) {
+  lamp_utils::SendScheduler scheduler(1000.0, 2000.0);
+  std::string sent;
+  auto message = [&sent](char id, size_t bytes, double stamp, bool expires) {
+    lamp_utils::SendScheduler::Message m;
+    m.bytes = bytes;
+    m.stamp = stamp;
+    m.b_expires = expires;
+    m.send = [&sent, id]() { sent += id; };
+    return m;
+  };
+
+  scheduler.Refill(0.0);
+  scheduler.Push(lamp_utils::SendScheduler::SCAN_FULL,
+                 message('f', 1500, 0.0, true));
+  scheduler.Push(lamp_utils::SendScheduler::SCAN_COARSE,
+                 message('c', 300, 0.0, false));
+  scheduler.Push(lamp_utils::SendScheduler::GRAPH,
+                 message('g', 100, 0.0, false));
+  scheduler.Push(lamp_utils::SendScheduler::SCAN_FULL,
+                 message('F', 1500, 0.5, true));
+
+  // Graph, then coarse, then full scans until the budget runs out
+  EXPECT_EQ(1900, scheduler.Dispatch());
+  EXPECT_EQ("gcf", sent);
+  EXPECT_NEAR(100.0, scheduler.budget(), 1e-9);
+
+  // One second of refill is not enough for the next full scan
+  scheduler.Refill(1.0);
+  EXPECT_EQ(0, scheduler.Dispatch());
+  EXPECT_EQ(1, scheduler.Queued(lamp_utils::SendScheduler::SCAN_FULL));
+
+  // Graphs go out regardless and delay the scans
+  scheduler.Push(lamp_utils::SendScheduler::GRAPH,
+                 message('G', 500, 1.0, false));
+  scheduler.Refill(1.5);
+  EXPECT_EQ(500, scheduler.Dispatch());
+  EXPECT_EQ("gcfG", sent);
+
+  auto expired =
+      scheduler.TakeExpired(lamp_utils::SendScheduler::SCAN_FULL, 1.0);
+  ASSERT_EQ(1, expired.size());
+  EXPECT_EQ(1500, expired[0].bytes);
+  EXPECT_EQ(0, scheduler.QueuedBytes());
+}
+
+TEST(TestScanCompression, RoundTrip) {
+  PointCloud cloud;
+  cloud.header.frame_id = "velodyne";
+  cloud.header.stamp = 1234;
+  for (int i = 0; i < 1000; i++) {
+    const double angle = 0.01 * i;
+    Point p;
+    p.x = 10 * std::cos(angle);
+    p.y = 10 * std::sin(angle);
+    p.z = 0.001 * i - 0.5;
+    p.intensity = i % 256;
+    p.normal_x = std::cos(angle);
+    p.normal_y = std::sin(angle);
+    p.normal_z = 0;
+    cloud.push_back(p);
+  }
+
+  lamp_utils::ScanCompressionParams params;
+  params.b_normals = true;
+  std::vector<uint8_t> encoded;
+  ASSERT_TRUE(lamp_utils::EncodeScan(cloud, params, &encoded));
+  EXPECT_LT(encoded.size(), cloud.size() * sizeof(Point) / 5);
+
+  PointCloud decoded;
+  ASSERT_TRUE(
+      lamp_utils::DecodeScan(encoded.data(), encoded.size(), &decoded));
+  ASSERT_EQ(cloud.size(), decoded.size());
+  EXPECT_EQ("velodyne", decoded.header.frame_id);
+  EXPECT_EQ(1234, decoded.header.stamp);
+  for (size_t i = 0; i < cloud.size(); i++) {
+    EXPECT_NEAR(cloud.points[i].x, decoded.points[i].x, 0.006);
+    EXPECT_NEAR(cloud.points[i].y, decoded.points[i].y, 0.006);
+    EXPECT_NEAR(cloud.points[i].z, decoded.points[i].z, 0.006);
+    EXPECT_NEAR(cloud.points[i].intensity, decoded.points[i].intensity, 0.5);
+    EXPECT_NEAR(cloud.points[i].normal_x, decoded.points[i].normal_x, 0.02);
+    EXPECT_NEAR(cloud.points[i].normal_y, decoded.points[i].normal_y, 0.02);
+  }
+
+  // Through the message and the shared scan store
+  pose_graph_msgs::KeyedScan msg;
+  lamp_utils::ScanToKeyedScanMsg(cloud, &params, &msg);
+  EXPECT_FALSE(msg.compressed_scan.empty());
+  EXPECT_EQ(0, msg.scan.data.size());
+  EXPECT_EQ(cloud.size(),
+            lamp_utils::SharedScanStore::Instance().GetOrConvert(msg)->size());
+
+  // Too large for 16 bits at the step, stays uncompressed
+  cloud.points[0].x = 1000;
+  lamp_utils::ScanToKeyedScanMsg(cloud, &params, &msg);
+  EXPECT_TRUE(msg.compressed_scan.empty());
+  EXPECT_EQ(cloud.size(), msg.scan.width * msg.scan.height);
+
+  // Corrupted data is rejected
+  encoded.resize(encoded.size() / 2);
+  EXPECT_FALSE(
+      lamp_utils::DecodeScan(encoded.data(), encoded.size(), &decoded));
+}
+
+TEST(TestG2oStream, WriteAndReadInChunks) {
+  const std::string filename = "/tmp/test_g2o_stream.g2o";
+  gtsam::Pose3 pose(gtsam::Rot3::RzRyRx(0.1, 0.2, 0.3),
+                    gtsam::Point3(1.0, 2.0, 3.0));
+  gtsam::Matrix6 information = gtsam::Matrix6::Identity();
+  information(0, 0) = 100; // rotation
+  information(5, 5) = 4;   // translation
+  {
+    lamp_utils::G2oWriter writer;
+    ASSERT_TRUE(writer.Open(filename));
+    for (int i = 0; i < 3; i++) {
+      writer.WriteVertex(gtsam::Symbol('a', i), pose);
+    }
+    writer.WriteEdge(
+        gtsam::Symbol('a', 0), gtsam::Symbol('a', 1), pose, information);
+    writer.WriteEdge(
+        gtsam::Symbol('a', 1), gtsam::Symbol('a', 2), pose, information);
+  }
+
+  lamp_utils::G2oReader reader;
+  ASSERT_TRUE(reader.Open(filename));
+  gtsam::NonlinearFactorGraph factors;
+  gtsam::Values values;
+  // The first chunk stops after one edge, with all the vertices before it
+  ASSERT_TRUE(reader.ReadChunk(1, &factors, &values));
+  EXPECT_EQ(1, factors.size());
+  EXPECT_EQ(3, values.size());
+  EXPECT_TRUE(pose.equals(values.at<gtsam::Pose3>(gtsam::Symbol('a', 2))));
+  auto between =
+      boost::dynamic_pointer_cast<gtsam::BetweenFactor<gtsam::Pose3>>(
+          factors[0]);
+  ASSERT_TRUE(between != nullptr);
+  EXPECT_TRUE(pose.equals(between->measured(), 1e-9));
+  auto noise = boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(
+      between->noiseModel());
+  ASSERT_TRUE(noise != nullptr);
+  EXPECT_TRUE(information.isApprox(noise->information(), 1e-9));
+
+  ASSERT_TRUE(reader.ReadChunk(1, &factors, &values));
+  EXPECT_EQ(2, factors.size());
+  EXPECT_FALSE(reader.ReadChunk(1, &factors, &values));
+  EXPECT_EQ(2, reader.NumEdges());
+  EXPECT_EQ(3, reader.NumVertices());
+}
+
+TEST(TestObservabilityCache, InsertGetErase) {
+  lamp_utils::ObservabilityCache& cache =
+      lamp_utils::ObservabilityCache::Instance();
+  cache.Clear();
+  const gtsam::Key key = gtsam::Symbol('a', 7);
+
+  lamp_utils::ScanObservability observability;
+  EXPECT_FALSE(cache.Get(key, &observability));
+
+  lamp_utils::ScanObservability inserted;
+  inserted.eigenvalues << 1.0, 2.0, 3.0;
+  inserted.num_points = 100;
+  cache.Insert(key, inserted);
+  ASSERT_TRUE(cache.Get(key, &observability));
+  EXPECT_EQ(100, observability.num_points);
+  EXPECT_DOUBLE_EQ(1.0, observability.eigenvalues.minCoeff());
+
+  // The first value of a key is kept
+  lamp_utils::ScanObservability other = inserted;
+  other.num_points = 5;
+  cache.Insert(key, other);
+  ASSERT_TRUE(cache.Get(key, &observability));
+  EXPECT_EQ(100, observability.num_points);
+  EXPECT_EQ(1, cache.Size());
+
+  cache.Erase(key);
+  EXPECT_FALSE(cache.Has(key));
+  cache.Clear();
+}
+
+TEST(TestTracing, RingAndChromeTrace) {
+  lamp_utils::Tracer& tracer = lamp_utils::Tracer::Instance();
+  tracer.SetCapacity(4);
+  tracer.Enable(false);
+  { lamp_utils::TraceSpan span("disabled"); }
+  EXPECT_TRUE(tracer.Snapshot().empty());
+
+  tracer.Enable(true);
+  const gtsam::Key key = gtsam::Symbol('a', 7);
+  for (int i = 0; i < 6; i++) {
+    lamp_utils::TraceSpan span("robot.keyed_scan", key);
+  }
+  // Only the latest spans are kept
+  std::vector<lamp_utils::TraceEvent> events = tracer.Snapshot();
+  ASSERT_EQ(4, events.size());
+  EXPECT_EQ(key, events.back().key);
+  EXPECT_GE(events.back().duration_us, 0);
+
+  std::string trace = tracer.ToChromeTrace();
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"robot.keyed_scan\""));
+  EXPECT_NE(std::string::npos, trace.find("\"key\":\"a7\""));
+
+  tracer.Clear();
+  EXPECT_TRUE(tracer.Snapshot().empty());
+  tracer.Enable(false);
+}
+
+TEST(TestMetrics, CountersGaugesHistograms) {
+  lamp_utils::MetricsRegistry& metrics = lamp_utils::MetricsRegistry::Instance();
+  lamp_utils::Counter& counter = metrics.GetCounter("test.counter");
+  EXPECT_EQ(&counter, &metrics.GetCounter("test.counter"));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&counter]() {
+      for (int i = 0; i < 1000; i++) {
+        counter.Increment();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(4000, counter.Value());
+
+  metrics.GetGauge("test.gauge").Set(3.5);
+
+  lamp_utils::Histogram& histogram =
+      metrics.GetHistogram("test.histogram", {1.0, 10.0, 100.0});
+  for (int i = 0; i < 98; i++) {
+    histogram.Observe(0.5);
+  }
+  histogram.Observe(50.0);
+  histogram.Observe(500.0);
+  const lamp_utils::Histogram::Summary summary = histogram.Summarize();
+  EXPECT_EQ(100, summary.count);
+  EXPECT_NEAR(599.0, summary.sum, 1e-9);
+  EXPECT_EQ(1.0, summary.p50);
+  EXPECT_EQ(100.0, summary.p99);
+
+  std::map<std::string, double> snapshot;
+  for (const auto& metric : metrics.Snapshot()) {
+    snapshot.insert(metric);
+  }
+  EXPECT_EQ(4000, snapshot["test.counter"]);
+  EXPECT_EQ(3.5, snapshot["test.gauge"]);
+  EXPECT_EQ(100, snapshot["test.histogram.count"]);
+  EXPECT_NEAR(5.99, snapshot["test.histogram.mean"], 1e-9);
+}
+
+TEST(TestDoubleBuffer, SwapAndReuse) {
+  lamp_utils::DoubleBuffer<std::vector<int>> buffer;
+  EXPECT_FALSE(buffer.Front());
+
+  buffer.Back().assign(3, 1);
+  buffer.Swap();
+  std::shared_ptr<const std::vector<int>> first = buffer.Front();
+  ASSERT_TRUE(first);
+  EXPECT_EQ(3, first->size());
+
+  // The reader keeps its version while the next one is written
+  buffer.Back().assign(5, 2);
+  buffer.Swap();
+  EXPECT_EQ(3, first->size());
+  EXPECT_EQ(5, buffer.Front()->size());
+
+  // The old front is still held, so it is not written to
+  const std::vector<int>* held = first.get();
+  EXPECT_NE(held, &buffer.Back());
+
+  // Released buffers are reused
+  first.reset();
+  buffer.Back().assign(1, 3);
+  buffer.Swap();
+  std::vector<int>* back = &buffer.Back();
+  buffer.Swap();
+  EXPECT_EQ(back, buffer.Front().get());
+}
+
+TEST(TestPipelineStage, OrderedBoundedAndInline) {
+  lamp_utils::PipelineStage stage("test.stage", 2);
+  std::vector<int> ran;
+
+  // Inline until started
+  stage.Push([&ran]() { ran.push_back(0); });
+  EXPECT_EQ(1, ran.size());
+
+  stage.Start();
+  EXPECT_TRUE(stage.IsRunning());
+  std::mutex gate;
+  gate.lock();
+  stage.Push([&gate]() { std::lock_guard<std::mutex> lock(gate); });
+  // Wait for the worker to pick up the blocking task
+  while (stage.Size() > 0) {
+    std::this_thread::yield();
+  }
+  stage.Push([&ran]() { ran.push_back(1); });
+  stage.Push([&ran]() { ran.push_back(2); });
+  EXPECT_FALSE(stage.TryPush([&ran]() { ran.push_back(-1); }));
+  EXPECT_EQ(2, stage.Size());
+  gate.unlock();
+  stage.Flush();
+  EXPECT_EQ(0, stage.Size());
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), ran);
+
+  // Queued tasks still run on stop
+  stage.Push([&ran]() { ran.push_back(3); });
+  stage.Stop();
+  EXPECT_FALSE(stage.IsRunning());
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), ran);
+}
+
+TEST(TestThreadGovernor, BudgetAndUsage) {
+  lamp_utils::ThreadGovernor governor;
+  governor.SetCoreBudget(6);
+  lamp_utils::ThreadGroupConfig config;
+  config.max_threads = 4;
+  governor.Configure("test.pool", config);
+
+  // The group limit, then what the other groups leave of the budget
+  EXPECT_EQ(4, governor.Threads("test.pool", 8));
+  EXPECT_EQ(2, governor.Threads("test.other", 3));
+  EXPECT_EQ(1, governor.Threads("test.third", 2));
+  // A new grant replaces the earlier one of the group
+  EXPECT_EQ(2, governor.Threads("test.pool", 2));
+  EXPECT_EQ(3, governor.Threads("test.other", 3));
+
+  // CPU time stays with the group after its threads exit
+  std::thread worker([&governor]() {
+    governor.RegisterThread("test.pool");
+    EXPECT_EQ(1, governor.NumThreads("test.pool"));
+    volatile double sum = 0;
+    for (int i = 0; i < 10000000; i++) {
+      sum += i;
+    }
+  });
+  worker.join();
+  EXPECT_EQ(0, governor.NumThreads("test.pool"));
+  EXPECT_GT(governor.CpuTime("test.pool"), 0.0);
+  EXPECT_EQ(0.0, governor.CpuTime("test.other"));
+}
+
+TEST(TestMemoryAccounting, PeaksAndPressure) {
+  lamp_utils::MemoryAccountant& accountant =
+      lamp_utils::MemoryAccountant::Instance();
+  {
+    // Stores of a subsystem add up
+    lamp_utils::MemoryAccount a("test.store");
+    lamp_utils::MemoryAccount b("test.store");
+    a.Set(1000);
+    b.Set(500);
+    EXPECT_EQ(1500, accountant.Bytes("test.store"));
+    a.Set(200);
+    EXPECT_EQ(700, accountant.Bytes("test.store"));
+    EXPECT_EQ(1500, accountant.Peak("test.store"));
+
+    // A copy joins the subsystem empty
+    lamp_utils::MemoryAccount c(a);
+    EXPECT_EQ(0, c.Bytes());
+    EXPECT_EQ(700, accountant.Bytes("test.store"));
+  }
+  // The bytes leave with the stores, the high-water mark stays
+  EXPECT_EQ(0, accountant.Bytes("test.store"));
+  EXPECT_EQ(1500, accountant.Peak("test.store"));
+
+  // Sampled on update, relieved above the budget
+  size_t cache_bytes = 4000;
+  lamp_utils::MemoryAccount cache(
+      "test.cache",
+      [&cache_bytes]() { return cache_bytes; },
+      [&cache_bytes](size_t bytes) {
+        const size_t freed = std::min(bytes, cache_bytes);
+        cache_bytes -= freed;
+        return freed;
+      });
+  accountant.Update();
+  EXPECT_EQ(4000, accountant.Bytes("test.cache"));
+  accountant.SetBudget(accountant.TotalBytes() - 1000);
+  accountant.Update();
+  EXPECT_EQ(3000, cache_bytes);
+  EXPECT_EQ(3000, accountant.Bytes("test.cache"));
+  EXPECT_EQ(4000, accountant.Peak("test.cache"));
+  accountant.SetBudget(0);
+}
+
+TEST(TestSpscRing, OrderedWithOverflow) {
+  lamp_utils::SpscRing<std::shared_ptr<int>> ring(3);
+  EXPECT_EQ(4, ring.capacity());
+  EXPECT_TRUE(ring.Empty());
+
+  // Past the capacity values spill over and still come out in order
+  for (int i = 0; i < 6; i++) {
+    ring.Push(std::make_shared<int>(i));
+  }
+  EXPECT_FALSE(ring.Empty());
+  std::shared_ptr<int> value;
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(ring.Pop(value));
+    EXPECT_EQ(i, *value);
+  }
+  ring.Push(std::make_shared<int>(6));
+  for (int i = 3; i < 7; i++) {
+    ASSERT_TRUE(ring.Pop(value));
+    EXPECT_EQ(i, *value);
+  }
+  EXPECT_FALSE(ring.Pop(value));
+  EXPECT_TRUE(ring.Empty());
+
+  // Consumed slots release what they held
+  std::shared_ptr<int> held = std::make_shared<int>(7);
+  ring.Push(held);
+  ASSERT_TRUE(ring.Pop(value));
+  value.reset();
+  EXPECT_EQ(1, held.use_count());
+
+  // One producer and one consumer thread
+  lamp_utils::SpscRing<int> ints(16);
+  const int n = 100000;
+  std::thread producer([&ints]() {
+    for (int i = 0; i < n; i++) {
+      ints.Push(i);
+    }
+  });
+  int expected = 0;
+  int popped;
+  while (expected < n) {
+    if (ints.Pop(popped)) {
+      ASSERT_EQ(expected, popped);
+      expected++;
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(ints.Empty());
+}
+
+TEST(TestTimeKeyIndex, StampKeyIndexAndKeyedStamps) {
+  lamp_utils::StampKeyIndex index;
+  EXPECT_EQ(0, index.LowerBound(1.0));
+  EXPECT_TRUE(index.Insert(1.0, gtsam::Symbol('a', 0)));
+  EXPECT_TRUE(index.Insert(3.0, gtsam::Symbol('a', 2)));
+  // Out of order and repeated stamps
+  EXPECT_TRUE(index.Insert(2.0, gtsam::Symbol('a', 1)));
+  EXPECT_FALSE(index.Insert(2.0, gtsam::Symbol('a', 5)));
+  ASSERT_EQ(3, index.size());
+  EXPECT_EQ(2.0, index.StampAt(1));
+  EXPECT_EQ(gtsam::Symbol('a', 1), index.KeyAt(1));
+  EXPECT_EQ(0, index.LowerBound(0.5));
+  EXPECT_EQ(1, index.LowerBound(1.5));
+  EXPECT_EQ(1, index.LowerBound(2.0));
+  EXPECT_EQ(3, index.LowerBound(3.5));
+  EXPECT_EQ(gtsam::Symbol('a', 2), *index.Find(3.0));
+  EXPECT_FALSE(index.Find(2.9999));
+  index.Assign(2.0, gtsam::Symbol('a', 5));
+  EXPECT_EQ(gtsam::Symbol('a', 5), *index.Find(2.0));
+
+  lamp_utils::KeyedStampStore stamps;
+  stamps.Assign(gtsam::Symbol('a', 0), ros::Time(1.0));
+  stamps.Assign(gtsam::Symbol('a', 2), ros::Time(2.0));
+  stamps.Assign(gtsam::Symbol('a', 2), ros::Time(3.0));
+  // Far past the end of its column
+  stamps.Assign(gtsam::Symbol('b', 1000000), ros::Time(4.0));
+  EXPECT_EQ(3, stamps.size());
+  EXPECT_FALSE(stamps.Contains(gtsam::Symbol('a', 1)));
+  EXPECT_EQ(ros::Time(3.0), stamps.At(gtsam::Symbol('a', 2)));
+  EXPECT_EQ(ros::Time(4.0), *stamps.Find(gtsam::Symbol('b', 1000000)));
+  EXPECT_THROW(stamps.At(gtsam::Symbol('c', 0)), std::out_of_range);
+  std::map<gtsam::Key, ros::Time> visited;
+  stamps.ForEach([&visited](gtsam::Key key, const ros::Time& stamp) {
+    visited[key] = stamp;
+  });
+  EXPECT_EQ(3, visited.size());
+  EXPECT_EQ(ros::Time(1.0), visited[gtsam::Symbol('a', 0)]);
+  stamps.clear();
+  EXPECT_TRUE(stamps.empty());
+}
+
+TEST(TestFlatHashMap, InsertFindAndGrow) {
+  lamp_utils::FlatHashMap<gtsam::Key, size_t> map(2);
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(nullptr, map.Find(gtsam::Symbol('a', 0)));
+
+  // Sequential keys of two prefixes, past the initial capacity
+  for (size_t i = 0; i < 100; i++) {
+    EXPECT_TRUE(map.Insert(gtsam::Symbol('a', i), i).second);
+    EXPECT_TRUE(map.Insert(gtsam::Symbol('b', i), 100 + i).second);
+  }
+  ASSERT_EQ(200, map.size());
+  for (size_t i = 0; i < 100; i++) {
+    ASSERT_TRUE(map.Contains(gtsam::Symbol('a', i)));
+    EXPECT_EQ(i, *map.Find(gtsam::Symbol('a', i)));
+    EXPECT_EQ(100 + i, *map.Find(gtsam::Symbol('b', i)));
+  }
+  EXPECT_FALSE(map.Contains(gtsam::Symbol('c', 0)));
+
+  // Stored keys keep their value, the returned pointer updates it in place
+  auto inserted = map.Insert(gtsam::Symbol('a', 3), 42);
+  EXPECT_FALSE(inserted.second);
+  EXPECT_EQ(3, *inserted.first);
+  *inserted.first = 42;
+  EXPECT_EQ(42, *map.Find(gtsam::Symbol('a', 3)));
+  map[gtsam::Symbol('c', 0)] = 7;
+  EXPECT_EQ(7, *map.Find(gtsam::Symbol('c', 0)));
+  EXPECT_EQ(201, map.size());
+
+  size_t visited = 0;
+  map.ForEach([&visited](gtsam::Key, size_t) { visited++; });
+  EXPECT_EQ(201, visited);
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_FALSE(map.Contains(gtsam::Symbol('a', 0)));
+}
+
+TEST(TestSymbolIdIndex, LinkBothWays) {
+  typedef lamp_utils::SymbolIdIndex::Handle Handle;
+  lamp_utils::SymbolIdIndex index;
+  EXPECT_EQ(lamp_utils::SymbolIdIndex::kNoId, index.Intern(""));
+  EXPECT_EQ(lamp_utils::SymbolIdIndex::kNoId, index.Find("uuid_a"));
+
+  const Handle a = index.Intern("uuid_a");
+  EXPECT_EQ(a, index.Intern("uuid_a"));
+  EXPECT_EQ(a, index.Find("uuid_a"));
+  EXPECT_EQ("uuid_a", index.Id(a));
+
+  // IDs may be interned before their node is linked
+  gtsam::Key key;
+  EXPECT_FALSE(index.KeyOf(a, &key));
+  index.Link(gtsam::Symbol('A', 0), a);
+  index.Link(gtsam::Symbol('B', 0), "uuid_b");
+  ASSERT_TRUE(index.KeyOf(a, &key));
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('A', 0)), key);
+  EXPECT_EQ(a, index.IdOf(gtsam::Symbol('A', 0)));
+  EXPECT_EQ("uuid_b", index.Id(index.IdOf(gtsam::Symbol('B', 0))));
+  EXPECT_EQ(2, index.size());
+
+  // Relinking a key or an ID drops its earlier link
+  index.Link(gtsam::Symbol('A', 1), a);
+  EXPECT_EQ(lamp_utils::SymbolIdIndex::kNoId,
+            index.IdOf(gtsam::Symbol('A', 0)));
+  ASSERT_TRUE(index.KeyOf(a, &key));
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('A', 1)), key);
+  index.Link(gtsam::Symbol('A', 1), "uuid_c");
+  EXPECT_FALSE(index.KeyOf(a, &key));
+  EXPECT_EQ(2, index.size());
+
+  index.ErasePrefix('B');
+  EXPECT_EQ(lamp_utils::SymbolIdIndex::kNoId,
+            index.IdOf(gtsam::Symbol('B', 0)));
+  EXPECT_EQ(1, index.size());
+
+  // Handles stay valid when the links are cleared
+  index.clear();
+  EXPECT_TRUE(index.empty());
+  EXPECT_EQ(a, index.Find("uuid_a"));
+  EXPECT_FALSE(index.KeyOf(a, &key));
+}
+
+TEST(TestRobotChainIndex, GapsFollowInsertAndErase) {
+  lamp_utils::RobotChainIndex chains;
+  for (int i = 0; i < 5; i++) {
+    EXPECT_TRUE(chains.Insert(gtsam::Symbol('a', i)));
+  }
+  EXPECT_FALSE(chains.Insert(gtsam::Symbol('a', 2)));
+  // Other than robot keys are not chained
+  EXPECT_FALSE(chains.Insert(gtsam::Symbol('A', 7)));
+  EXPECT_TRUE(chains.IsContiguous());
+
+  // A key past the end leaves a gap until it is filled
+  chains.Insert(gtsam::Symbol('b', 0));
+  chains.Insert(gtsam::Symbol('b', 4));
+  EXPECT_EQ(3, chains.NumMissing());
+  chains.Insert(gtsam::Symbol('b', 2));
+  EXPECT_EQ(2, chains.NumMissing());
+  auto gaps = chains.Gaps();
+  ASSERT_EQ(2, gaps.size());
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('b', 1)), gaps[0].first);
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('b', 1)), gaps[0].second);
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('b', 3)), gaps[1].first);
+
+  // Erasing inside merges with the gaps around, erasing the last key drops
+  // the gap before it
+  EXPECT_TRUE(chains.Erase(gtsam::Symbol('b', 2)));
+  gaps = chains.Gaps();
+  ASSERT_EQ(1, gaps.size());
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('b', 1)), gaps[0].first);
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('b', 3)), gaps[0].second);
+  EXPECT_FALSE(chains.Erase(gtsam::Symbol('b', 2)));
+  EXPECT_TRUE(chains.Erase(gtsam::Symbol('b', 4)));
+  EXPECT_TRUE(chains.IsContiguous());
+
+  chains.Erase(gtsam::Symbol('a', 1));
+  EXPECT_EQ(1, chains.NumMissing());
+  chains.ErasePrefix('a');
+  EXPECT_TRUE(chains.IsContiguous());
+  EXPECT_TRUE(chains.Gaps().empty());
+}
+
+TEST(TestPointCloudPool, RecycleWithCapacity) {
+  lamp_utils::PointCloudPool& pool = lamp_utils::PointCloudPool::Instance();
+  pool.Clear();
+  pool.SetCapacity(1, 1000);
+  const lamp_utils::PointCloudPoolStats start = pool.GetStats();
+
+  PointCloud::Ptr a = pool.Acquire();
+  a->points.resize(100);
+  a->header.stamp = 10;
+  const Point* storage = a->points.data();
+  PointCloud::Ptr b = pool.Acquire();
+  b->points.resize(10);
+
+  // One cloud is kept, the second does not fit
+  a.reset();
+  b.reset();
+  lamp_utils::PointCloudPoolStats stats = pool.GetStats();
+  EXPECT_EQ(1, stats.free);
+  EXPECT_EQ(100, stats.free_points);
+  EXPECT_EQ(start.dropped + 1, stats.dropped);
+
+  // Handed out again empty, with its storage
+  PointCloud::Ptr c = pool.Acquire();
+  EXPECT_TRUE(c->empty());
+  EXPECT_EQ(0, c->header.stamp);
+  EXPECT_GE(c->points.capacity(), 100);
+  EXPECT_EQ(storage, c->points.data());
+  stats = pool.GetStats();
+  EXPECT_EQ(start.acquired + 3, stats.acquired);
+  EXPECT_EQ(start.reused + 1, stats.reused);
+  EXPECT_EQ(0, stats.free);
+
+  // Copies keep the points, too large clouds are not kept
+  c->points.resize(2000);
+  PointCloud::Ptr copy = pool.Copy(*c);
+  EXPECT_EQ(2000, copy->size());
+  c.reset();
+  EXPECT_EQ(0, pool.GetStats().free);
+
+  pool.SetCapacity(64, 2000000);
+}
+
+TEST(TestPointCloudConversions, MatchPclConversions) {
+  PointCloud cloud;
+  for (int i = 0; i < 10; i++) {
+    Point p;
+    p.x = i;
+    p.y = 2 * i;
+    p.z = -i;
+    p.intensity = 100 + i;
+    p.normal_x = 1.0;
+    p.normal_y = 0.0;
+    p.normal_z = 0.0;
+    p.curvature = 0.5;
+    cloud.push_back(p);
+  }
+  cloud.header.frame_id = "world";
+
+  // Same layout, one copy each way
+  sensor_msgs::PointCloud2 msg;
+  lamp_utils::ToRosMsg(cloud, &msg);
+  sensor_msgs::PointCloud2 pcl_msg;
+  pcl::toROSMsg(cloud, pcl_msg);
+  EXPECT_EQ(pcl_msg.data, msg.data);
+  EXPECT_EQ(pcl_msg.fields.size(), msg.fields.size());
+  EXPECT_EQ(pcl_msg.point_step, msg.point_step);
+  EXPECT_EQ("world", msg.header.frame_id);
+
+  PointCloud round_trip;
+  lamp_utils::FromRosMsg(msg, &round_trip);
+  ASSERT_EQ(cloud.size(), round_trip.size());
+  EXPECT_EQ(cloud.width, round_trip.width);
+  for (size_t i = 0; i < cloud.size(); i++) {
+    EXPECT_EQ(cloud[i].y, round_trip[i].y);
+    EXPECT_EQ(cloud[i].intensity, round_trip[i].intensity);
+    EXPECT_EQ(cloud[i].normal_x, round_trip[i].normal_x);
+    EXPECT_EQ(cloud[i].curvature, round_trip[i].curvature);
+  }
+
+  // Keyed scans are sent as x, y, z, intensity
+  PointXyziCloud xyzi;
+  pcl::copyPointCloud(cloud, xyzi);
+  lamp_utils::ToRosMsg(xyzi, &msg);
+  PointCloud gathered, expected;
+  lamp_utils::FromRosMsg(msg, &gathered);
+  pcl::fromROSMsg(msg, expected);
+  ASSERT_EQ(expected.size(), gathered.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].x, gathered[i].x);
+    EXPECT_EQ(expected[i].z, gathered[i].z);
+    EXPECT_EQ(expected[i].intensity, gathered[i].intensity);
+    EXPECT_EQ(expected[i].normal_x, gathered[i].normal_x);
+    EXPECT_EQ(expected[i].curvature, gathered[i].curvature);
+  }
+}
+
+TEST(TestGicp, FloatPlaneCovariancesMatchDouble) {
+  // Three orthogonal planes with their normals constrain every direction
+  PointCloud::Ptr target(new PointCloud);
+  for (int i = 0; i < 20; i++) {
+    for (int j = 0; j < 20; j++) {
+      const float u = 0.1 * i, v = 0.1 * j;
+      Point p;
+      p.intensity = 0;
+      p.x = u, p.y = v, p.z = 0;
+      p.normal_x = 0, p.normal_y = 0, p.normal_z = 1;
+      target->push_back(p);
+      p.x = u, p.y = 0, p.z = v;
+      p.normal_x = 0, p.normal_y = 1, p.normal_z = 0;
+      target->push_back(p);
+      p.x = 0, p.y = u, p.z = v;
+      p.normal_x = 1, p.normal_y = 0, p.normal_z = 0;
+      target->push_back(p);
+    }
+  }
+  PointCloud::Ptr source(new PointCloud(*target));
+  for (Point& p : source->points) {
+    p.x += 0.05;
+    p.y -= 0.03;
+    p.z += 0.02;
+  }
+
+  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point> icp;
+  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point,
+                                                     Point,
+                                                     float,
+                                                     PlaneCovariance<float>>
+      icp_float;
+  PointCloud aligned;
+  icp.setInputSource(source);
+  icp.setInputTarget(target);
+  icp.align(aligned);
+  icp_float.setInputSource(source);
+  icp_float.setInputTarget(target);
+  icp_float.align(aligned);
+  ASSERT_TRUE(icp.hasConverged());
+  ASSERT_TRUE(icp_float.hasConverged());
+
+  const Eigen::Matrix4f T = icp.getFinalTransformation();
+  const Eigen::Matrix4f T_float = icp_float.getFinalTransformation();
+  EXPECT_NEAR(-0.05, T(0, 3), 1e-3);
+  EXPECT_NEAR(0.03, T(1, 3), 1e-3);
+  EXPECT_NEAR(-0.02, T(2, 3), 1e-3);
+  EXPECT_TRUE(T.isApprox(T_float, 1e-3));
+}
+
+TEST(TestGicp, IterationCallbackAborts) {
+  PointCloud::Ptr target(new PointCloud);
+  for (int i = 0; i < 20; i++) {
+    for (int j = 0; j < 20; j++) {
+      Point p;
+      p.intensity = 0;
+      p.x = 0.1 * i, p.y = 0.1 * j, p.z = 0;
+      p.normal_x = 0, p.normal_y = 0, p.normal_z = 1;
+      target->push_back(p);
+      p.x = 0.1 * i, p.y = 0, p.z = 0.1 * j;
+      p.normal_x = 0, p.normal_y = 1, p.normal_z = 0;
+      target->push_back(p);
+      p.x = 0, p.y = 0.1 * i, p.z = 0.1 * j;
+      p.normal_x = 1, p.normal_y = 0, p.normal_z = 0;
+      target->push_back(p);
+    }
+  }
+  PointCloud::Ptr source(new PointCloud(*target));
+  for (Point& p : source->points) {
+    p.x += 0.05;
+    p.z -= 0.05;
+  }
+
+  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point> icp;
+  std::vector<pcl::GicpIterationState> states;
+  icp.setIterationCallback([&states](const pcl::GicpIterationState& state) {
+    states.push_back(state);
+    return state.iteration < 2;
+  });
+  icp.setMaximumIterations(50);
+  icp.setTransformationEpsilon(1e-12);
+  icp.setInputSource(source);
+  icp.setInputTarget(target);
+  PointCloud aligned;
+  icp.align(aligned);
+
+  ASSERT_EQ(2, states.size());
+  EXPECT_EQ(1, states[0].iteration);
+  EXPECT_EQ(source->size(), states[0].num_points);
+  EXPECT_EQ(source->size(), states[0].num_correspondences);
+  EXPECT_GT(states[0].mean_sq_distance, 0);
+  EXPECT_TRUE(icp.wasAborted());
+  EXPECT_FALSE(icp.hasConverged());
+  EXPECT_EQ(2, icp.getNumIterations());
+
+  // A new alignment starts without the abort
+  icp.setIterationCallback(pcl::GicpIterationCallback());
+  icp.align(aligned);
+  EXPECT_FALSE(icp.wasAborted());
+}
+
+TEST(TestPrefixHandling, TableMatchesPrefixMaps) {
+  for (int c = 0; c < 256; c++) {
+    bool robot = false, artifact = false;
+    for (const auto& p : lamp_utils::ROBOT_PREFIXES) {
+      robot |= static_cast<unsigned char>(p.second) == c;
+    }
+    for (const auto& p : lamp_utils::ARTIFACT_PREFIXES) {
+      artifact |= static_cast<unsigned char>(p.second) == c;
+    }
+    EXPECT_EQ(robot, lamp_utils::IsRobotPrefix(c)) << c;
+    EXPECT_EQ(artifact, lamp_utils::IsArtifactPrefix(c)) << c;
+    EXPECT_EQ(artifact || c == lamp_utils::UWB_PREFIX,
+              lamp_utils::IsSpecialSymbol(c))
+        << c;
+    EXPECT_EQ(c == lamp_utils::BASE_PREFIX, lamp_utils::IsBasePrefix(c)) << c;
+  }
+  EXPECT_EQ('e', lamp_utils::GetRobotPrefix("spot1"));
+  EXPECT_EQ('E', lamp_utils::GetArtifactPrefix("spot1"));
+  EXPECT_EQ(0, lamp_utils::GetRobotPrefix("spot9"));
+  EXPECT_EQ("spot1", lamp_utils::RobotRegistry::GetRobotName('e'));
+}
+
+TEST(TestPrefixHandling, RegisterRobot) {
+  EXPECT_FALSE(lamp_utils::IsRobotPrefix('n'));
+  EXPECT_FALSE(lamp_utils::IsArtifactPrefix('N'));
+  EXPECT_TRUE(lamp_utils::RobotRegistry::Register("husky5", 'n', 'N'));
+  EXPECT_TRUE(lamp_utils::IsRobotPrefix('n'));
+  EXPECT_TRUE(lamp_utils::IsArtifactPrefix('N'));
+  EXPECT_TRUE(lamp_utils::IsSpecialSymbol('N'));
+  EXPECT_EQ('n', lamp_utils::GetRobotPrefix("husky5"));
+  EXPECT_EQ('N', lamp_utils::GetArtifactPrefix("husky5"));
+  EXPECT_EQ("husky5", lamp_utils::RobotRegistry::GetRobotName('n'));
+  auto robots = lamp_utils::GetAllRobotPrefixes();
+  EXPECT_EQ(lamp_utils::ROBOT_PREFIXES.size() + 1, robots.size());
+
+  // Prefixes of other robots and reserved prefixes are refused
+  EXPECT_FALSE(lamp_utils::RobotRegistry::Register("husky6", 'a'));
+  EXPECT_FALSE(lamp_utils::RobotRegistry::Register("husky6", 'o', 'N'));
+  EXPECT_FALSE(lamp_utils::RobotRegistry::Register("husky6", 'u'));
+  EXPECT_FALSE(lamp_utils::RobotRegistry::Register("husky6", 'A'));
+  EXPECT_FALSE(lamp_utils::IsRobotPrefix('o'));
+  EXPECT_EQ(0, lamp_utils::GetRobotPrefix("husky6"));
+}
+
+TEST(TestPoseExtrapolator, ConstantTurnRate) {
+  lamp_utils::PoseExtrapolator extrapolator;
+  lamp_utils::PosePrediction prediction;
+  EXPECT_FALSE(extrapolator.Predict(ros::Time(1.0), &prediction));
+
+  // 1 m/s forward while turning at 0.1 rad/s
+  gtsam::Vector6 twist;
+  twist << 0, 0, 0.1, 1, 0, 0;
+  for (int i = 0; i < 5; i++) {
+    EXPECT_TRUE(extrapolator.AddSample(
+        ros::Time(10.0 + i), gtsam::Pose3::Expmap(twist * i)));
+  }
+  EXPECT_FALSE(extrapolator.AddSample(ros::Time(12.0), gtsam::Pose3()));
+
+  ASSERT_TRUE(extrapolator.Predict(ros::Time(16.0), &prediction));
+  EXPECT_NEAR(prediction.horizon, 2.0, 1e-6);
+  EXPECT_TRUE(prediction.pose.equals(gtsam::Pose3::Expmap(twist * 6), 1e-6));
+  EXPECT_NEAR(prediction.confidence, std::exp(-1.0), 1e-6);
+
+  // At the newest sample and before it
+  ASSERT_TRUE(extrapolator.Predict(ros::Time(13.0), &prediction));
+  EXPECT_TRUE(prediction.pose.equals(gtsam::Pose3::Expmap(twist * 4), 1e-6));
+  EXPECT_NEAR(prediction.confidence, 1.0, 1e-6);
+
+  // Erratic motion lowers the confidence, the pose is held past the horizon
+  EXPECT_TRUE(extrapolator.AddSample(ros::Time(15.0),
+                                     gtsam::Pose3::Expmap(twist * 4)));
+  lamp_utils::PosePrediction far;
+  ASSERT_TRUE(extrapolator.Predict(ros::Time(17.0), &prediction));
+  ASSERT_TRUE(extrapolator.Predict(ros::Time(30.0), &far));
+  EXPECT_LT(prediction.confidence, std::exp(-1.0));
+  EXPECT_LT(far.confidence, prediction.confidence);
+  ASSERT_TRUE(extrapolator.Predict(ros::Time(18.0), &prediction));
+  EXPECT_TRUE(prediction.pose.equals(far.pose, 1e-6));
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_utils");
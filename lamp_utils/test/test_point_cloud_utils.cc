@@ -5,12 +5,16 @@
 
 #include <gtest/gtest.h>
 
+#include <limits>
 #include <math.h>
 #include <pcl/common/transforms.h>
 #include <pcl/io/pcd_io.h>
 #include <ros/ros.h>
 
+#include <lamp_utils/LampPcldFilter.h>
+#include <lamp_utils/PointCloudKernels.h>
 #include <lamp_utils/PointCloudUtils.h>
+#include <lamp_utils/VoxelMap.h>
 
 #include "test_artifacts.h"
 
@@ -66,6 +70,34 @@ TEST_F(TestPointCloudUtils, ExtractNormals) {
   }
 }
 
+TEST_F(TestPointCloudUtils, EnsureNormals) {
+  PointCloud::Ptr plane = GeneratePlane();
+  EXPECT_TRUE(HasNormals(*plane));
+  for (auto& p : plane->points) {
+    p.getNormalVector3fMap().setZero();
+  }
+  EXPECT_FALSE(HasNormals(*plane));
+
+  // Estimated once
+  EXPECT_TRUE(EnsureNormals(plane));
+  EXPECT_TRUE(HasNormals(*plane));
+  for (size_t i = 0; i < 100; i++) {
+    EXPECT_NEAR(1, plane->points[i].normal_z, tolerance_);
+  }
+
+  // Stored normals are kept, only scaled back to unit length
+  for (auto& p : plane->points) {
+    p.normal_z = 0.5;
+  }
+  plane->points[0].normal_z = 0;
+  EXPECT_FALSE(EnsureNormals(plane));
+  EXPECT_EQ(0, plane->points[0].normal_z);
+  for (size_t i = 1; i < 100; i++) {
+    EXPECT_NEAR(0, plane->points[i].normal_x, tolerance_);
+    EXPECT_NEAR(1, plane->points[i].normal_z, tolerance_);
+  }
+}
+
 TEST_F(TestPointCloudUtils, AddNormals) {
   PointXyziCloud::Ptr plane(new PointXyziCloud);
   PointCloud::Ptr plane_w_normals(new PointCloud);
@@ -180,6 +212,26 @@ TEST_F(TestPointCloudUtils, ComputeIcpObservability) {
   EXPECT_NEAR(eigenvalues_new(2), 100, tolerance_);
 }
 
+TEST_F(TestPointCloudUtils, ComputeIcpObservabilityStoredNormals) {
+  // Normals of two perpendicular planes, 60 along z and 40 along x
+  PointCloud::Ptr cloud = GeneratePlane();
+  for (size_t i = 0; i < 40; i++) {
+    cloud->points[i].normal_x = 1;
+    cloud->points[i].normal_z = 0;
+  }
+  NormalComputeParams params;
+  params.num_threads = 1;
+  Eigen::Matrix<double, 3, 1> serial, parallel;
+  ComputeIcpObservability(cloud, &serial, params);
+  params.num_threads = 4;
+  ComputeIcpObservability(cloud, &parallel, params);
+
+  EXPECT_NEAR(0, serial(0), tolerance_);
+  EXPECT_NEAR(40, serial(1), tolerance_);
+  EXPECT_NEAR(60, serial(2), tolerance_);
+  EXPECT_TRUE(serial.isApprox(parallel));
+}
+
 TEST_F(TestPointCloudUtils, ComputeAp_ForPoint2PlaneICP) {
   PointCloud::Ptr plane(new PointCloud);
   plane = GeneratePlane();
@@ -230,6 +282,223 @@ TEST_F(TestPointCloudUtils, ComputeAp_ForPoint2PlaneICP) {
   EXPECT_NEAR(Ap(5, 5), 100, tolerance_);
 }
 
+TEST_F(TestPointCloudUtils, ComputeAp_ForPoint2PlaneICPPairs) {
+  PointCloud::Ptr plane = GeneratePlane();
+  Normals::Ptr plane_normals(new Normals);
+  PointCloud::Ptr plane_normalized(new PointCloud);
+  ExtractNormals(plane, plane_normals);
+  NormalizePCloud(plane, plane_normalized);
+  for (size_t i = 0; i < plane->size(); i++) {
+    plane->points[i].normal_x = plane_normals->points[i].normal_x;
+    plane->points[i].normal_y = plane_normals->points[i].normal_y;
+    plane->points[i].normal_z = plane_normals->points[i].normal_z;
+  }
+  std::vector<size_t> correspondences(plane->size());
+  std::iota(std::begin(correspondences), std::end(correspondences), 0);
+  std::vector<int> indices(plane->size());
+  std::iota(std::begin(indices), std::end(indices), 0);
+
+  const Eigen::Matrix4f T =
+      (Eigen::Translation3f(1, 2, 3) *
+       Eigen::AngleAxisf(0.3, Eigen::Vector3f(1, 1, 0).normalized()))
+          .matrix();
+  Eigen::Matrix<double, 6, 6> Ap, Ap_parallel, Ap_pairs;
+  ComputeAp_ForPoint2PlaneICP(
+      plane_normalized, plane_normals, correspondences, T, Ap);
+  ComputeAp_ForPoint2PlaneICP(
+      plane_normalized, plane_normals, correspondences, T, Ap_parallel, 4);
+  ComputeAp_ForPoint2PlaneICP(*plane, *plane, indices, indices, T, 4, &Ap_pairs);
+
+  // The pairs normalize the query in double instead of float
+  const double pairs_tolerance = 1e-4 * Ap.cwiseAbs().maxCoeff();
+  for (size_t i = 0; i < 6; i++) {
+    for (size_t j = 0; j < 6; j++) {
+      EXPECT_NEAR(Ap(i, j), Ap_parallel(i, j), tolerance_);
+      EXPECT_NEAR(Ap(i, j), Ap_pairs(i, j), pairs_tolerance);
+    }
+  }
+}
+
+TEST_F(TestPointCloudUtils, TransformPointCloudKernels) {
+  PointCloud::Ptr cloud(new PointCloud);
+  for (size_t i = 0; i < 1000; i++) {
+    Point p;
+    p.x = 0.01 * i;
+    p.y = -0.02 * i + 3;
+    p.z = 0.5 * std::sin(0.1 * i);
+    p.intensity = i;
+    p.normal_x = 1;
+    cloud->push_back(p);
+  }
+  Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+  T.block<3, 3>(0, 0) =
+      Eigen::AngleAxisd(0.7, Eigen::Vector3d(1, 2, 3).normalized()).matrix();
+  T.block<3, 1>(0, 3) = Eigen::Vector3d(10, -5, 2);
+
+  PointCloud reference;
+  pcl::transformPointCloud(*cloud, reference, T);
+  PointCloud transformed;
+  TransformPointCloud(*cloud, T, &transformed);
+  ASSERT_EQ(transformed.size(), reference.size());
+  for (size_t i = 0; i < reference.size(); i++) {
+    EXPECT_NEAR(transformed.points[i].x, reference.points[i].x, tolerance_);
+    EXPECT_NEAR(transformed.points[i].y, reference.points[i].y, tolerance_);
+    EXPECT_NEAR(transformed.points[i].z, reference.points[i].z, tolerance_);
+    EXPECT_EQ(transformed.points[i].intensity, cloud->points[i].intensity);
+  }
+
+  // Appending keeps the existing points
+  PointCloud appended = *cloud;
+  TransformAndAppend(*cloud, T, &appended);
+  ASSERT_EQ(appended.size(), 2 * cloud->size());
+  EXPECT_EQ(appended.width, appended.size());
+  EXPECT_EQ(appended.points[0].x, cloud->points[0].x);
+  EXPECT_NEAR(appended.points[cloud->size()].x, reference.points[0].x,
+              tolerance_);
+
+  // In place
+  TransformPointCloud(*cloud, T, cloud.get());
+  for (size_t i = 0; i < reference.size(); i++) {
+    EXPECT_NEAR(cloud->points[i].z, reference.points[i].z, tolerance_);
+  }
+}
+
+TEST_F(TestPointCloudUtils, VoxelDownsample) {
+  PointCloud cloud;
+  const double leaf = 1.0;
+  // Two points in voxel (0, 0, 0), one in (-1, 0, 0) and one non finite
+  Point p;
+  p.x = 0.2, p.y = 0.2, p.z = 0.2, p.intensity = 1;
+  cloud.push_back(p);
+  p.x = -0.5, p.intensity = 5;
+  cloud.push_back(p);
+  p.x = 0.6, p.y = 0.8, p.z = 0.4, p.intensity = 3;
+  cloud.push_back(p);
+  p.x = std::numeric_limits<float>::quiet_NaN();
+  cloud.push_back(p);
+
+  PointCloud filtered;
+  VoxelDownsample(cloud, leaf, &filtered);
+  ASSERT_EQ(filtered.size(), 2);
+  EXPECT_TRUE(filtered.is_dense);
+  EXPECT_NEAR(filtered.points[0].x, 0.4, tolerance_);
+  EXPECT_NEAR(filtered.points[0].y, 0.5, tolerance_);
+  EXPECT_NEAR(filtered.points[0].z, 0.3, tolerance_);
+  EXPECT_NEAR(filtered.points[0].intensity, 2, tolerance_);
+  EXPECT_NEAR(filtered.points[1].x, -0.5, tolerance_);
+  EXPECT_NEAR(filtered.points[1].intensity, 5, tolerance_);
+
+  // In place
+  VoxelDownsample(cloud, leaf, &cloud);
+  EXPECT_EQ(cloud.size(), 2);
+}
+
+TEST_F(TestPointCloudUtils, SplitIntoLayers) {
+  // 4 m line sampled every cm, plus a non finite point
+  PointCloud cloud;
+  for (int i = 0; i < 400; i++) {
+    Point p;
+    p.x = 0.01 * i + 0.005;
+    p.y = 0.5, p.z = 0.5, p.intensity = i;
+    cloud.push_back(p);
+  }
+  Point nan_point;
+  nan_point.x = std::numeric_limits<float>::quiet_NaN();
+  cloud.push_back(nan_point);
+
+  std::vector<PointCloud> layers;
+  SplitIntoLayers(cloud, 1.0, 3, &layers);
+  ASSERT_EQ(layers.size(), 3);
+  // One point per 1 m voxel, then one per 0.5 m voxel not yet represented
+  EXPECT_EQ(layers[0].size(), 4);
+  EXPECT_EQ(layers[1].size(), 4);
+  EXPECT_EQ(layers[2].size(), cloud.size() - 8);
+
+  // Every point appears in exactly one layer
+  std::vector<int> count(cloud.size() - 1, 0);
+  for (const PointCloud& layer : layers) {
+    EXPECT_EQ(layer.width, layer.size());
+    for (const Point& p : layer.points) {
+      if (std::isfinite(p.x)) {
+        count[static_cast<int>(p.intensity)]++;
+      }
+    }
+  }
+  for (int c : count) {
+    EXPECT_EQ(c, 1);
+  }
+
+  // A single layer is the whole scan
+  SplitIntoLayers(cloud, 1.0, 1, &layers);
+  ASSERT_EQ(layers.size(), 1);
+  EXPECT_EQ(layers[0].size(), cloud.size());
+}
+
+TEST_F(TestPointCloudUtils, VoxelMapMatchesVoxelDownsample) {
+  // 3 m line sampled every cm, inserted in two halves
+  PointCloud cloud, first, second;
+  for (int i = 0; i < 300; i++) {
+    Point p;
+    p.x = 0.01 * i + 0.005;
+    p.y = 0.5, p.z = 0.5, p.intensity = i;
+    cloud.push_back(p);
+    (i < 150 ? first : second).push_back(p);
+  }
+  Point nan_point;
+  nan_point.x = std::numeric_limits<float>::quiet_NaN();
+  second.push_back(nan_point);
+
+  VoxelMap map(0.4);
+  map.Insert(first);
+  EXPECT_EQ(map.size(), 4);
+  map.Insert(second);
+
+  PointCloud expected, result;
+  VoxelDownsample(cloud, 0.4, &expected);
+  map.GetCloud(&result);
+  ASSERT_EQ(result.size(), expected.size());
+  EXPECT_EQ(result.width, result.size());
+  for (size_t i = 0; i < result.size(); i++) {
+    EXPECT_NEAR(result.points[i].x, expected.points[i].x, tolerance_);
+    EXPECT_NEAR(result.points[i].intensity,
+                expected.points[i].intensity,
+                tolerance_);
+  }
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+}
+
+TEST_F(TestPointCloudUtils, AdaptiveGridFilterHitsTarget) {
+  // 2 m x 2 m wavy surface sampled every cm
+  PointCloud::Ptr cloud(new PointCloud);
+  for (int i = 0; i < 200; i++) {
+    for (int j = 0; j < 200; j++) {
+      Point p;
+      p.x = 0.01 * i - 1;
+      p.y = 0.01 * j - 1;
+      p.z = 0.1 * std::sin(3 * p.x);
+      cloud->push_back(p);
+    }
+  }
+
+  LampPcldFilterParams params;
+  params.random_filter = false;
+  params.adaptive_grid_target = 1000;
+  params.adaptive_min_grid = 0.01;
+  params.adaptive_max_grid = 1.0;
+  LampPcldFilter filter(params);
+
+  // The first scan is already sized to the target
+  PointCloud::Ptr filtered(new PointCloud);
+  filter.Filter(*cloud, filtered);
+  EXPECT_NEAR(filtered->size(), 1000, 150);
+
+  // In place, as LampRobot filters the keyed scans
+  filter.Filter(*cloud, cloud);
+  EXPECT_EQ(cloud->size(), filtered->size());
+}
+
 } // namespace lamp_utils
 
 int main(int argc, char** argv) {
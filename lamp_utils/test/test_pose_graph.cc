@@ -5,6 +5,7 @@
 
 #include <gtest/gtest.h>
 
+#include <fstream>
 #include <math.h>
 #include <ros/ros.h>
 
@@ -20,6 +21,8 @@
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
 #include <lamp_utils/PoseGraph.h>
+#include <lamp_utils/PoseGraphDelta.h>
+#include <lamp_utils/PriorMap.h>
 
 class TestPoseGraphClass : public ::testing::Test {
   public:
@@ -243,6 +246,544 @@ TEST_F(TestPoseGraphClass, RemoveRobotFromGraph){
   EXPECT_EQ(pose_graph_back.GetPriors().size(), 1);
 }
 
+TEST_F(TestPoseGraphClass, RemoveEdgesWithPrefix){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  for (int i = 0; i < 3; i++) {
+    pose_graph_.TrackFactor(gtsam::Symbol('a', i), gtsam::Symbol('a', i + 1), pose_graph_msgs::PoseGraphEdge::ODOM, gtsam::Pose3(), noise);
+    pose_graph_.TrackFactor(gtsam::Symbol('b', i), gtsam::Symbol('b', i + 1), pose_graph_msgs::PoseGraphEdge::ODOM, gtsam::Pose3(), noise);
+  }
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 3), gtsam::Symbol('b', 3), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE, gtsam::Pose3(), noise);
+  pose_graph_.TrackFactor(gtsam::Symbol('c', 0), gtsam::Symbol('c', 1), pose_graph_msgs::PoseGraphEdge::ODOM, gtsam::Pose3(), noise);
+  EXPECT_EQ(pose_graph_.GetNfg().size(), 9);
+
+  // The loop closure goes with either robot
+  pose_graph_.RemoveEdgesWithPrefix('b');
+  EXPECT_EQ(pose_graph_.GetNfg().size(), 5);
+  EXPECT_EQ(pose_graph_.GetEdges().size(), 4);
+  EXPECT_FALSE(pose_graph_.GetEdges().Contains(gtsam::Symbol('a', 3), gtsam::Symbol('b', 3), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+
+  // Factors added after a removal and the moved ones are still found
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 3), gtsam::Symbol('a', 4), pose_graph_msgs::PoseGraphEdge::ODOM, gtsam::Pose3(), noise);
+  pose_graph_.RemoveEdgesWithPrefix('a');
+  EXPECT_EQ(pose_graph_.GetNfg().size(), 1);
+  EXPECT_EQ(pose_graph_.GetEdges().size(), 1);
+  EXPECT_EQ(pose_graph_.GetPriors().size(), 0);
+  for (const auto& factor : pose_graph_.GetNfg()) {
+    EXPECT_EQ(gtsam::Symbol(factor->front()).chr(), 'c');
+  }
+}
+
+TEST_F(TestPoseGraphClass, UpdateLoopClosures){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  for (int i = 0; i < 4; i++) {
+    pose_graph_.TrackFactor(gtsam::Symbol('a', i), gtsam::Symbol('a', i + 1), pose_graph_msgs::PoseGraphEdge::ODOM, gtsam::Pose3(), noise);
+  }
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 4), gtsam::Symbol('a', 0), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE, gtsam::Pose3(), noise);
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 3), gtsam::Symbol('a', 1), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE, gtsam::Pose3(), noise);
+  pose_graph_.TrackFactor(gtsam::Symbol('a', 2), gtsam::Symbol('A', 0), pose_graph_msgs::PoseGraphEdge::UWB_BETWEEN, gtsam::Pose3(), noise);
+  EXPECT_EQ(pose_graph_.GetNfg().size(), 8);
+
+  // PGO keeps the first loop closure and finds a new one
+  pose_graph_msgs::PoseGraph::Ptr msg(new pose_graph_msgs::PoseGraph);
+  msg->edges.push_back(*pose_graph_.GetEdges().Find(
+      gtsam::Symbol('a', 4), gtsam::Symbol('a', 0), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  pose_graph_msgs::PoseGraphEdge new_loop_closure = msg->edges[0];
+  new_loop_closure.key_from = gtsam::Symbol('a', 4);
+  new_loop_closure.key_to = gtsam::Symbol('a', 2);
+  msg->edges.push_back(new_loop_closure);
+  pose_graph_.UpdateLoopClosures(msg);
+
+  EXPECT_EQ(pose_graph_.GetNfg().size(), 8);
+  EXPECT_EQ(pose_graph_.GetEdges().size(), 7);
+  EXPECT_FALSE(pose_graph_.GetEdges().Contains(gtsam::Symbol('a', 3), gtsam::Symbol('a', 1), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  EXPECT_TRUE(pose_graph_.GetEdges().Contains(gtsam::Symbol('a', 4), gtsam::Symbol('a', 2), pose_graph_msgs::PoseGraphEdge::LOOPCLOSE));
+  size_t loop_closures = 0, uwb = 0;
+  for (const auto& factor : pose_graph_.GetNfg()) {
+    ASSERT_TRUE(factor != nullptr);
+    if (factor->front() == gtsam::Symbol('a', 3) && factor->back() == gtsam::Symbol('a', 1))
+      ADD_FAILURE() << "Outlier factor left in the graph";
+    if (factor->front() == gtsam::Symbol('a', 4))
+      loop_closures++;
+    if (factor->back() == gtsam::Symbol('A', 0))
+      uwb++;
+  }
+  EXPECT_EQ(loop_closures, 2);
+  EXPECT_EQ(uwb, 1);
+
+  // The slots of the moved factors are kept up to date
+  msg->edges.clear();
+  pose_graph_.UpdateLoopClosures(msg);
+  EXPECT_EQ(pose_graph_.GetNfg().size(), 6);
+  EXPECT_EQ(pose_graph_.GetEdges().size(), 5);
+  for (const auto& factor : pose_graph_.GetNfg()) {
+    EXPECT_NE(factor->front(), gtsam::Symbol('a', 4));
+  }
+}
+
+TEST_F(TestPoseGraphClass, EdgeStoreLookups){
+  lamp_utils::EdgeStore edges;
+
+  pose_graph_msgs::PoseGraphEdge e1 = e0;
+  e1.type = pose_graph_msgs::PoseGraphEdge::LOOPCLOSE;
+  e1.pose.position.x = 2.0;
+  pose_graph_msgs::PoseGraphEdge e2 = e0;
+  e2.key_from = gtsam::Symbol('b', 0);
+  e2.header.frame_id = "world";
+
+  EXPECT_TRUE(edges.Insert(e0));
+  EXPECT_TRUE(edges.Insert(e1));
+  EXPECT_TRUE(edges.Insert(e2));
+  EXPECT_FALSE(edges.Insert(e0));
+  EXPECT_EQ(edges.size(), 3);
+
+  // Partial key lookups return the smallest type
+  auto found = edges.FindAnyType(e0.key_from, e0.key_to);
+  ASSERT_TRUE(found);
+  EXPECT_EQ(found->type, pose_graph_msgs::PoseGraphEdge::ODOM);
+  EXPECT_EQ(edges.FindKeyTo(e0.key_to)->key_from, e0.key_from);
+
+  // Erasing keeps the other entries reachable
+  EXPECT_TRUE(edges.Erase(e0));
+  EXPECT_FALSE(edges.Contains(e0));
+  found = edges.FindAnyType(e0.key_from, e0.key_to);
+  ASSERT_TRUE(found);
+  EXPECT_NEAR(found->pose.position.x, 2.0, tolerance_);
+  found = edges.Find(e2);
+  ASSERT_TRUE(found);
+  EXPECT_EQ(found->header.frame_id, "world");
+
+  edges.EraseIf([](gtsam::Key, gtsam::Key, int type) {
+    return type == pose_graph_msgs::PoseGraphEdge::LOOPCLOSE;
+  });
+  EXPECT_EQ(edges.size(), 1);
+  EXPECT_TRUE(edges.Contains(e2));
+  EXPECT_FALSE(edges.FindKeyFrom(e0.key_from));
+}
+
+TEST_F(TestPoseGraphClass, NodeStoreAssign){
+  lamp_utils::NodeStore nodes;
+
+  n0.ID = "artifact";
+  EXPECT_TRUE(nodes.Insert(n0));
+  EXPECT_TRUE(nodes.Insert(n1));
+
+  pose_graph_msgs::PoseGraphNode moved = n0;
+  moved.pose.position.z = 5.0;
+  EXPECT_FALSE(nodes.Insert(moved));
+  EXPECT_NEAR(nodes.Find(n0.key)->pose.position.z, 0.0, tolerance_);
+  EXPECT_FALSE(nodes.Assign(moved));
+  EXPECT_NEAR(nodes.Find(n0.key)->pose.position.z, 5.0, tolerance_);
+  EXPECT_EQ(nodes.Find(n0.key)->ID, "artifact");
+
+  EXPECT_TRUE(nodes.Erase(n0.key));
+  EXPECT_FALSE(nodes.Find(n0.key));
+  EXPECT_NEAR(nodes.Find(n1.key)->pose.position.x, 1.0, tolerance_);
+  EXPECT_EQ(nodes.size(), 1);
+}
+
+TEST_F(TestPoseGraphClass, TrackFactorsBatch){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  const size_t num_factors = pose_graph_.GetNfg().size();
+
+  for (size_t i = 0; i < 36; i += 7)
+    e0.covariance[i] = 0.1;
+  e0.type = pose_graph_msgs::PoseGraphEdge::ODOM;
+  pose_graph_msgs::PoseGraphEdge artifact = e0;
+  artifact.type = pose_graph_msgs::PoseGraphEdge::ARTIFACT;
+  artifact.key_to = gtsam::Symbol('A', 0);
+
+  // Repeated observations in a batch add a single factor, the last one
+  EdgeMessages edges{e0, artifact, artifact};
+  edges.back().pose.position.x = 3.0;
+  EXPECT_EQ(pose_graph_.TrackFactors(edges), 2);
+  EXPECT_EQ(pose_graph_.GetNfg().size(), num_factors + 2);
+  EXPECT_EQ(pose_graph_.GetEdges().size(), 2);
+  EXPECT_NEAR(pose_graph_.GetEdges().Find(artifact)->pose.position.x, 3.0, tolerance_);
+
+  // Small changes are ignored, a moved artifact replaces its factor
+  edges = {e0, artifact};
+  edges.back().pose.position.x = 3.05;
+  EXPECT_EQ(pose_graph_.TrackFactors(edges), 0);
+  edges.back().pose.position.x = 5.0;
+  EXPECT_EQ(pose_graph_.TrackFactors(edges), 1);
+  EXPECT_EQ(pose_graph_.GetNfg().size(), num_factors + 2);
+  EXPECT_EQ(pose_graph_.GetEdges().size(), 2);
+  EXPECT_NEAR(pose_graph_.GetEdges().Find(artifact)->pose.position.x, 5.0, tolerance_);
+  size_t artifact_factors = 0;
+  for (const auto& factor : pose_graph_.GetNfg()) {
+    if (factor->back() == gtsam::Symbol('A', 0))
+      artifact_factors++;
+  }
+  EXPECT_EQ(artifact_factors, 1);
+}
+
+
+TEST_F(TestPoseGraphClass, RobotPoseIndex){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  for (int i = 1; i < 5; i++) {
+    pose_graph_.TrackNode(ros::Time(i),
+                          gtsam::Symbol('a', i),
+                          gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(i, 0, 0)),
+                          noise);
+  }
+  pose_graph_.TrackNode(ros::Time(5.0), gtsam::Symbol('b', 100000),
+                        gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(0, 7, 0)),
+                        noise);
+  pose_graph_.TrackNode(ros::Time(6.0), gtsam::Symbol('A', 0),
+                        gtsam::Pose3(), noise);
+
+  // Artifacts stay in the values only, far keys are kept sparse
+  const lamp_utils::RobotPoseIndex& poses = pose_graph_.GetRobotPoses();
+  EXPECT_EQ(poses.size(), 6);
+  EXPECT_FALSE(poses.Find(gtsam::Symbol('A', 0)));
+  EXPECT_TRUE(pose_graph_.HasKey(gtsam::Symbol('A', 0)));
+  EXPECT_NEAR(pose_graph_.GetPose(gtsam::Symbol('a', 3)).x(), 3.0, tolerance_);
+  EXPECT_NEAR(pose_graph_.LastPose('a').x(), 4.0, tolerance_);
+  EXPECT_NEAR(pose_graph_.LastPose('b').y(), 7.0, tolerance_);
+  EXPECT_FALSE(pose_graph_.CheckGraphValid());
+
+  pose_graph_.UpdateNodePose(gtsam::Symbol('a', 3),
+                             gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(9, 0, 0)));
+  EXPECT_NEAR(pose_graph_.GetPose(gtsam::Symbol('a', 3)).x(), 9.0, tolerance_);
+  EXPECT_NEAR(pose_graph_.GetValues().at<gtsam::Pose3>(gtsam::Symbol('a', 3)).x(),
+              9.0, tolerance_);
+
+  pose_graph_.RemoveValuesWithPrefix('b');
+  EXPECT_EQ(poses.size(), 5);
+  EXPECT_FALSE(pose_graph_.HasKey(gtsam::Symbol('b', 100000)));
+  EXPECT_TRUE(pose_graph_.CheckGraphValid());
+
+  size_t n_visited = 0;
+  poses.ForEach('a', [&](gtsam::Key key, const gtsam::Pose3& pose) {
+    EXPECT_EQ(gtsam::Symbol(key).index(), n_visited++);
+  });
+  EXPECT_EQ(n_visited, 5);
+}
+
+TEST_F(TestPoseGraphClass, SnapshotIsolation){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  pose_graph_.TrackNode(n0);
+  pose_graph_.TrackFactor(e0);
+  PointCloud::Ptr scan(new PointCloud);
+  scan->push_back(PointCloud::PointType());
+  pose_graph_.InsertKeyedScan(gtsam::Symbol(n0.key), scan);
+
+  std::shared_ptr<const PoseGraph> snapshot = pose_graph_.Snapshot();
+  EXPECT_TRUE(snapshot->GetNewNodes().empty());
+
+  // The graph keeps changing, the snapshot does not
+  pose_graph_.TrackNode(n1);
+  pose_graph_.UpdateNodePose(gtsam::Symbol(n0.key),
+                             gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(5, 0, 0)));
+  pose_graph_.TrackNode(ros::Time(3.0), gtsam::Symbol('a', 3), gtsam::Pose3(),
+                        noise);
+  EXPECT_EQ(snapshot->GetValues().size(), 2);
+  EXPECT_FALSE(snapshot->HasKey(gtsam::Symbol('a', 3)));
+  EXPECT_NEAR(snapshot->GetPose(gtsam::Symbol(n0.key)).x(), 0.0, tolerance_);
+  EXPECT_EQ(snapshot->GetEdges().size(), pose_graph_.GetEdges().size());
+  EXPECT_EQ(snapshot->ToMsg()->nodes.size(), 2);
+
+  // Scans are shared rather than copied
+  EXPECT_EQ(snapshot->GetKeyedScan(gtsam::Symbol(n0.key)), scan);
+}
+
+TEST_F(TestPoseGraphClass, DeltaEncoding){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  pose_graph_.TrackNode(n0);
+
+  lamp_utils::DeltaPublicationParams params;
+  params.b_enabled = true;
+  params.position_resolution = 0.01;
+  lamp_utils::PoseGraphDeltaEncoder encoder;
+  encoder.SetParams(params);
+  lamp_utils::PoseGraphDeltaDecoder decoder;
+  GraphMsgPtr decoded;
+
+  // First message is a keyframe with the whole graph
+  GraphMsgPtr keyframe = encoder.Encode(pose_graph_);
+  ASSERT_TRUE(keyframe != nullptr);
+  EXPECT_TRUE(keyframe->keyframe);
+  EXPECT_EQ(keyframe->nodes.size(), 2);
+  EXPECT_EQ(decoder.Decode(keyframe, &decoded),
+            lamp_utils::PoseGraphDeltaDecoder::Status::ACCEPTED);
+  pose_graph_.ClearIncrementalMessages();
+  EXPECT_TRUE(encoder.Encode(pose_graph_) == nullptr);
+
+  // Moves below the resolution are not sent
+  pose_graph_.TrackNode(ros::Time(1.0), gtsam::Symbol(n0.key),
+                        gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(0.001, 0, 0)),
+                        covariance);
+  EXPECT_TRUE(encoder.Encode(pose_graph_) == nullptr);
+  pose_graph_.ClearIncrementalMessages();
+
+  pose_graph_.TrackNode(ros::Time(1.0), gtsam::Symbol(n0.key),
+                        gtsam::Pose3(gtsam::Rot3::Yaw(0.5), gtsam::Point3(2.0, 0, 0)),
+                        covariance);
+  GraphMsgPtr delta = encoder.Encode(pose_graph_);
+  ASSERT_TRUE(delta != nullptr);
+  EXPECT_FALSE(delta->keyframe);
+  EXPECT_EQ(delta->sequence, keyframe->sequence + 1);
+  EXPECT_EQ(delta->nodes.size(), 0);
+  ASSERT_EQ(delta->pose_updates.size(), 1);
+  pose_graph_.ClearIncrementalMessages();
+
+  // The decoder expands the update into a full node message
+  EXPECT_EQ(decoder.Decode(delta, &decoded),
+            lamp_utils::PoseGraphDeltaDecoder::Status::ACCEPTED);
+  ASSERT_EQ(decoded->nodes.size(), 1);
+  gtsam::Pose3 pose = lamp_utils::MessageToPose(decoded->nodes[0]);
+  EXPECT_NEAR(pose.x(), 2.0, tolerance_);
+  EXPECT_NEAR(pose.rotation().yaw(), 0.5, 1e-4);
+  EXPECT_EQ(decoder.Decode(delta, &decoded),
+            lamp_utils::PoseGraphDeltaDecoder::Status::STALE);
+
+  // A missing message needs a keyframe to recover
+  pose_graph_.TrackNode(n1);
+  encoder.Encode(pose_graph_);
+  pose_graph_.ClearIncrementalMessages();
+  pose_graph_.TrackNode(ros::Time(2.0), gtsam::Symbol('a', 3), gtsam::Pose3(),
+                        covariance);
+  GraphMsgPtr after_gap = encoder.Encode(pose_graph_);
+  EXPECT_EQ(decoder.Decode(after_gap, &decoded),
+            lamp_utils::PoseGraphDeltaDecoder::Status::GAP);
+  encoder.RequestKeyframe();
+  keyframe = encoder.Encode(pose_graph_);
+  EXPECT_TRUE(keyframe->keyframe);
+  EXPECT_EQ(keyframe->nodes.size(), 4);
+  EXPECT_EQ(decoder.Decode(keyframe, &decoded),
+            lamp_utils::PoseGraphDeltaDecoder::Status::ACCEPTED);
+}
+
+TEST_F(TestPoseGraphClass, MarginalizeOdometryNodes){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+
+  // Chain a0..a4, one meter apart, each node with a one point scan
+  const gtsam::Pose3 step(gtsam::Rot3(), gtsam::Point3(1, 0, 0));
+  for (int i = 0; i < 5; i++) {
+    const gtsam::Symbol key('a', i);
+    if (i > 0) {
+      pose_graph_.TrackNode(ros::Time(i), key,
+                            gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(i, 0, 0)),
+                            covariance);
+      pose_graph_.TrackFactor(gtsam::Symbol('a', i - 1), key,
+                              pose_graph_msgs::PoseGraphEdge::ODOM, step,
+                              covariance);
+    }
+    PointCloud::Ptr scan(new PointCloud);
+    Point p;
+    p.x = 0.5;
+    p.normal_x = 1;
+    scan->push_back(p);
+    pose_graph_.InsertKeyedScan(key, scan);
+    pose_graph_.InsertKeyedStamp(key, ros::Time(i));
+  }
+  const size_t num_factors = pose_graph_.GetNfg().size();
+
+  // The first node has a prior and the last one no successor
+  EXPECT_EQ(pose_graph_.MarginalizeNodes({initial_key_, gtsam::Symbol('a', 4)}), 0);
+  EXPECT_EQ(pose_graph_.MarginalizeNodes({gtsam::Symbol('a', 2)}), 1);
+  EXPECT_FALSE(pose_graph_.HasKey(gtsam::Symbol('a', 2)));
+  EXPECT_TRUE(pose_graph_.IsMarginalized(gtsam::Symbol('a', 2)));
+  EXPECT_EQ(pose_graph_.GetNfg().size(), num_factors - 1);
+  EXPECT_TRUE(pose_graph_.CheckGraphValid());
+
+  // Composed odometry, its covariance the sum of both
+  auto edge = pose_graph_.GetEdges().FindKeyFrom(gtsam::Symbol('a', 1));
+  ASSERT_TRUE(edge);
+  EXPECT_EQ(edge->key_to, gtsam::Symbol('a', 3));
+  EXPECT_NEAR(edge->pose.position.x, 2.0, tolerance_);
+  EXPECT_NEAR(lamp_utils::MessageToCovarianceMatrix(*edge)(3, 3), 0.02, tolerance_);
+
+  // The scan is taken over by a1 in its frame
+  EXPECT_TRUE(pose_graph_.GetKeyedScan(gtsam::Symbol('a', 2)) == nullptr);
+  PointCloud::ConstPtr scan = pose_graph_.GetKeyedScan(gtsam::Symbol('a', 1));
+  ASSERT_EQ(scan->size(), 2);
+  EXPECT_NEAR(scan->points[1].x, 1.5, tolerance_);
+  EXPECT_NEAR(scan->points[1].normal_x, 1.0, tolerance_);
+  EXPECT_EQ(pose_graph_.GetScanRevision(gtsam::Symbol('a', 1)), 1);
+
+  // Sent with the incremental graph, the receiver drops the nodes and the
+  // odometry over nodes it still holds
+  GraphMsgPtr msg = pose_graph_.ToIncrementalMsg();
+  ASSERT_EQ(msg->marginalized_keys.size(), 1);
+  EXPECT_EQ(msg->marginalized_keys[0], gtsam::Symbol('a', 2));
+
+  PoseGraph receiver;
+  receiver.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  for (int i = 1; i < 5; i++) {
+    receiver.TrackNode(ros::Time(i), gtsam::Symbol('a', i),
+                       gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(i, 0, 0)),
+                       covariance);
+    receiver.TrackFactor(gtsam::Symbol('a', i - 1), gtsam::Symbol('a', i),
+                         pose_graph_msgs::PoseGraphEdge::ODOM, step,
+                         covariance);
+  }
+  EdgeMessages edges{*edge};
+  receiver.ApplyMarginalizations({gtsam::Symbol('a', 3)}, &edges);
+  EXPECT_TRUE(receiver.IsMarginalized(gtsam::Symbol('a', 3)));
+  EXPECT_TRUE(edges.empty());
+  receiver.ApplyMarginalizations(msg->marginalized_keys, &edges);
+  EXPECT_FALSE(receiver.HasKey(gtsam::Symbol('a', 2)));
+  EXPECT_EQ(receiver.GetEdges().FindKeyFrom(gtsam::Symbol('a', 1))->key_to,
+            gtsam::Symbol('a', 4));
+}
+
+TEST_F(TestPoseGraphClass, ArchiveSaveAndLazyLoad){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  pose_graph_.TrackNode(n0);
+  pose_graph_.TrackNode(n1);
+
+  auto make_scan = [](int n) {
+    PointCloud::Ptr scan(new PointCloud);
+    for (int i = 0; i < n; i++) {
+      Point p;
+      p.x = i;
+      p.intensity = n;
+      scan->push_back(p);
+    }
+    return scan;
+  };
+  pose_graph_.InsertKeyedScan(initial_key_, make_scan(10));
+  pose_graph_.InsertKeyedStamp(initial_key_, ros::Time(1.0));
+  pose_graph_.InsertKeyedScan(gtsam::Symbol(n0.key), make_scan(20));
+  pose_graph_.InsertKeyedStamp(gtsam::Symbol(n0.key), ros::Time(2.0));
+  EXPECT_TRUE(pose_graph_.Save("test_archive.lpg"));
+
+  // A second save appends the new scan only
+  pose_graph_.InsertKeyedScan(gtsam::Symbol(n1.key), make_scan(30));
+  pose_graph_.InsertKeyedStamp(gtsam::Symbol(n1.key), ros::Time(3.0));
+  EXPECT_TRUE(pose_graph_.Save("test_archive.lpg"));
+
+  PoseGraph loaded;
+  ASSERT_TRUE(loaded.Load("test_archive.lpg"));
+  EXPECT_EQ(loaded.GetNodes().size(), 3);
+  EXPECT_EQ(loaded.keyed_scans.size(), 0);
+  EXPECT_TRUE(loaded.HasScan(gtsam::Symbol(n1.key)));
+  EXPECT_EQ(loaded.GetKeyedScanKeys().size(), 3);
+  EXPECT_EQ(loaded.keyed_stamps.At(gtsam::Symbol(n0.key)), ros::Time(2.0));
+
+  // Paged in on first access
+  PointCloud::ConstPtr scan = loaded.GetKeyedScan(gtsam::Symbol(n1.key));
+  ASSERT_TRUE(scan != nullptr);
+  EXPECT_EQ(scan->size(), 30);
+  EXPECT_EQ(scan->points[29].x, 29);
+  EXPECT_EQ(loaded.keyed_scans.size(), 1);
+  EXPECT_TRUE(loaded.GetKeyedScan(gtsam::Symbol('z', 0)) == nullptr);
+}
+
+TEST_F(TestPoseGraphClass, ArchiveRecoversLastCommit){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  pose_graph_.TrackNode(n0);
+  PointCloud::Ptr scan(new PointCloud);
+  scan->push_back(Point());
+  pose_graph_.InsertKeyedScan(gtsam::Symbol(n0.key), scan);
+
+  // Saved from a snapshot, with a save to another file in between
+  EXPECT_TRUE(pose_graph_.Snapshot()->Save("test_recover.lpg"));
+  EXPECT_TRUE(pose_graph_.Save("test_recover_other.lpg"));
+  pose_graph_.TrackNode(n1);
+  EXPECT_TRUE(pose_graph_.Snapshot()->Save("test_recover.lpg"));
+
+  // A commit cut short leaves a partial block after the trailer
+  {
+    std::ofstream os("test_recover.lpg", std::ios::binary | std::ios::app);
+    const std::string partial(100, 'x');
+    os.write(partial.data(), partial.size());
+  }
+  PoseGraph loaded;
+  ASSERT_TRUE(loaded.Load("test_recover.lpg"));
+  EXPECT_EQ(loaded.GetNodes().size(), 3);
+  EXPECT_TRUE(loaded.HasScan(gtsam::Symbol(n0.key)));
+
+  // The next save continues from the last commit
+  EXPECT_TRUE(loaded.Save("test_recover.lpg"));
+  PoseGraph reloaded;
+  ASSERT_TRUE(reloaded.Load("test_recover.lpg"));
+  EXPECT_EQ(reloaded.GetNodes().size(), 3);
+  EXPECT_TRUE(reloaded.GetKeyedScan(gtsam::Symbol(n0.key)) != nullptr);
+}
+
+TEST_F(TestPoseGraphClass, PriorMapQueriesRegion){
+  ros::Time::init();
+  gtsam::noiseModel::Diagonal::shared_ptr covariance(
+    gtsam::noiseModel::Diagonal::Sigmas(initial_noise_));
+  pose_graph_.Initialize(initial_key_, gtsam::Pose3(), covariance);
+  pose_graph_.TrackNode(n0);
+  pose_graph_.TrackNode(n1);
+  PointCloud::Ptr scan(new PointCloud);
+  scan->push_back(Point());
+  pose_graph_.InsertKeyedScan(gtsam::Symbol(n0.key), scan);
+  pose_graph_.InsertKeyedScan(gtsam::Symbol(n1.key), scan);
+  pose_graph_.InsertKeyedStamp(gtsam::Symbol(n1.key), ros::Time(3.0));
+  EXPECT_TRUE(pose_graph_.Save("test_prior_map.lpg"));
+
+  PriorMap prior_map;
+  ASSERT_TRUE(prior_map.Open("test_prior_map.lpg"));
+  EXPECT_EQ(prior_map.NumScans(), 2);
+
+  // Nodes without a scan are left out
+  auto nodes = prior_map.Query(gtsam::Point3(0.0, 0.0, 0.0), 5.0);
+  ASSERT_EQ(nodes.size(), 2);
+  EXPECT_EQ(nodes[0].first, gtsam::Key(n0.key));
+  EXPECT_EQ(nodes[1].first, gtsam::Key(n1.key));
+  nodes = prior_map.Query(gtsam::Point3(1.2, 0.0, 0.0), 0.5);
+  ASSERT_EQ(nodes.size(), 1);
+  EXPECT_EQ(nodes[0].first, gtsam::Key(n1.key));
+  EXPECT_NEAR(nodes[0].second.translation().x(), 1.0, 1e-9);
+  EXPECT_TRUE(prior_map.Query(gtsam::Point3(50.0, 0.0, 0.0), 5.0).empty());
+
+  gtsam::Pose3 pose;
+  ros::Time stamp;
+  ASSERT_TRUE(prior_map.GetPose(gtsam::Symbol(n1.key), &pose, &stamp));
+  EXPECT_EQ(stamp, ros::Time(3.0));
+  EXPECT_FALSE(prior_map.GetPose(gtsam::Symbol('a', 9), &pose));
+  EXPECT_TRUE(prior_map.ReadScan(gtsam::Symbol(n1.key)) != nullptr);
+
+  auto prefixes = prior_map.Prefixes();
+  ASSERT_EQ(prefixes.size(), 1);
+  EXPECT_EQ(prefixes[0], 'a');
+}
 
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
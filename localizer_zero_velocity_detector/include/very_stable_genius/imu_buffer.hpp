@@ -0,0 +1,150 @@
+#ifndef __IMU_BUFFER_H__
+#define __IMU_BUFFER_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include <very_stable_genius/vec3.hpp>
+
+namespace very_stable_genius {
+
+  static const int kNumImuAxes = 6; /// Accelerometer x, y, z then gyroscope x, y, z
+
+  /// Reduction kernels over a contiguous array. Four independent lanes break the dependency
+  /// chain so the compiler maps the loop onto SIMD registers (SSE/AVX, NEON) without intrinsics.
+  template <typename Scalar>
+  Scalar sumKernel(const Scalar *x, size_t n) {
+    Scalar lane[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      lane[0] += x[i];
+      lane[1] += x[i + 1];
+      lane[2] += x[i + 2];
+      lane[3] += x[i + 3];
+    }
+    for (; i < n; i++) {
+      lane[0] += x[i];
+    }
+    return (lane[0] + lane[1]) + (lane[2] + lane[3]);
+  }
+
+  /// Folds the minimum and maximum of x into min and max
+  template <typename Scalar>
+  void minMaxKernel(const Scalar *x, size_t n, Scalar *min, Scalar *max) {
+    Scalar lane_min[4] = {*min, *min, *min, *min};
+    Scalar lane_max[4] = {*max, *max, *max, *max};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      for (int k = 0; k < 4; k++) {
+        lane_min[k] = x[i + k] < lane_min[k] ? x[i + k] : lane_min[k];
+        lane_max[k] = x[i + k] > lane_max[k] ? x[i + k] : lane_max[k];
+      }
+    }
+    for (; i < n; i++) {
+      lane_min[0] = x[i] < lane_min[0] ? x[i] : lane_min[0];
+      lane_max[0] = x[i] > lane_max[0] ? x[i] : lane_max[0];
+    }
+    *min = std::min(std::min(lane_min[0], lane_min[1]), std::min(lane_min[2], lane_min[3]));
+    *max = std::max(std::max(lane_max[0], lane_max[1]), std::max(lane_max[2], lane_max[3]));
+  }
+
+  /// Ring buffer of IMU samples stored as structure of arrays: one contiguous array per axis, so a
+  /// window of one axis is at most two contiguous runs the kernels stream through. With float a
+  /// 5 s window at 400 Hz is 8 KB per axis.
+  template <typename Scalar>
+  class ImuBuffer {
+  public:
+    ImuBuffer() : capacity_(0), head_(0), size_(0) {}
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const { return size_; }
+    bool full() const { return size_ == capacity_; }
+    void clear() { head_ = 0; size_ = 0; }
+
+    /// Keeps the newest samples that still fit
+    void setCapacity(size_t capacity) {
+      std::vector<Scalar> data(capacity * kNumImuAxes);
+      const size_t kept = std::min(size_, capacity);
+      for (int axis = 0; axis < kNumImuAxes; axis++) {
+        for (size_t i = 0; i < kept; i++) {
+          data[axis * capacity + i] = at(axis, size_ - kept + i);
+        }
+      }
+      data_.swap(data);
+      capacity_ = capacity;
+      size_ = kept;
+      head_ = capacity_ > 0 ? kept % capacity_ : 0;
+    }
+
+    /// Adds a sample, overwriting the oldest one when full
+    void push(const Vec3T<Scalar> &accel, const Vec3T<Scalar> &gyro) {
+      if (0 == capacity_) {
+        return;
+      }
+      for (int axis = 0; axis < 3; axis++) {
+        data_[axis * capacity_ + head_] = accel[axis];
+        data_[(axis + 3) * capacity_ + head_] = gyro[axis];
+      }
+      head_ = head_ + 1 == capacity_ ? 0 : head_ + 1;
+      size_ = std::min(size_ + 1, capacity_);
+    }
+
+    /// Sample i of an axis, 0 is the oldest
+    Scalar at(int axis, size_t i) const {
+      size_t slot = head_ + capacity_ - size_ + i;
+      if (slot >= capacity_) {
+        slot -= capacity_;
+      }
+      return data_[axis * capacity_ + slot];
+    }
+
+    /// Sample i of each axis, 0 is the oldest
+    void sample(size_t i, Scalar values[kNumImuAxes]) const {
+      for (int axis = 0; axis < kNumImuAxes; axis++) {
+        values[axis] = at(axis, i);
+      }
+    }
+
+    /// Sum of the newest n samples of each axis
+    void sumNewest(size_t n, Scalar sums[kNumImuAxes]) const {
+      for (int axis = 0; axis < kNumImuAxes; axis++) {
+        sums[axis] = 0;
+        forEachRun(axis, n, [&sums, axis](const Scalar *x, size_t len) {
+          sums[axis] += sumKernel(x, len);
+        });
+      }
+    }
+
+    /// Minimum and maximum of the newest n (> 0) samples of each axis
+    void minMaxNewest(size_t n, Scalar min[kNumImuAxes], Scalar max[kNumImuAxes]) const {
+      for (int axis = 0; axis < kNumImuAxes; axis++) {
+        min[axis] = max[axis] = at(axis, size_ - 1);
+        forEachRun(axis, n, [&min, &max, axis](const Scalar *x, size_t len) {
+          minMaxKernel(x, len, &min[axis], &max[axis]);
+        });
+      }
+    }
+
+  private:
+    /// Calls f(pointer, length) on the contiguous runs holding the newest n samples of an axis
+    template <typename F>
+    void forEachRun(int axis, size_t n, F f) const {
+      n = std::min(n, size_);
+      const Scalar *column = data_.data() + axis * capacity_;
+      if (n <= head_) {
+        f(column + head_ - n, n);
+      } else {
+        f(column + capacity_ - (n - head_), n - head_);
+        f(column, head_);
+      }
+    }
+
+    std::vector<Scalar> data_; /// Axis-major, capacity_ samples per axis
+    size_t capacity_;
+    size_t head_;              /// Slot of the next sample
+    size_t size_;
+  };
+
+}
+
+#endif // __IMU_BUFFER_H__
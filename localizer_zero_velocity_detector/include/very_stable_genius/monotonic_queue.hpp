@@ -0,0 +1,45 @@
+#ifndef __MONOTONIC_QUEUE_H__
+#define __MONOTONIC_QUEUE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <boost/circular_buffer.hpp>
+
+namespace very_stable_genius {
+
+  /// Minimum (Compare = std::less) or maximum (Compare = std::greater) of a sliding window of samples.
+  /// Only samples that can still become the extreme are kept, in order, so each sample is pushed and
+  /// popped at most once and the extreme is always at the front.
+  template <typename Compare>
+  class MonotonicQueue {
+  public:
+    void setCapacity(size_t capacity) { queue_.set_capacity(capacity); } /// Window length in samples
+    void clear() { queue_.clear(); }
+    bool empty() const { return queue_.empty(); }
+
+    /// Add the sample with sequence number seq. Call expire() first so the queue never holds more than the window.
+    void push(uint64_t seq, double value) {
+      while (!queue_.empty() && !compare_(queue_.back().second, value)) {
+        queue_.pop_back();
+      }
+      queue_.push_back(std::make_pair(seq, value));
+    }
+
+    /// Drop the samples older than first_seq
+    void expire(uint64_t first_seq) {
+      while (!queue_.empty() && queue_.front().first < first_seq) {
+        queue_.pop_front();
+      }
+    }
+
+    double front() const { return queue_.front().second; } /// Extreme of the window, queue must not be empty
+
+  private:
+    Compare compare_;
+    boost::circular_buffer<std::pair<uint64_t, double> > queue_;
+  };
+
+}
+
+#endif // __MONOTONIC_QUEUE_H__
@@ -1,63 +1,76 @@
 #ifndef __VEC3_H__
 #define __VEC3_H__
 
-struct Vec3 {
-  Vec3() : x(0), y(0), z(0) {}
+#include <algorithm>
+#include <cmath>
+
+template <typename Scalar>
+struct Vec3T {
+  Vec3T() : x(0), y(0), z(0) {}
   
-  Vec3(double x, double y, double z)
+  Vec3T(Scalar x, Scalar y, Scalar z)
     : x(x), y(y), z(z) {}
-  union {
-    struct {
-      double x;
-      double y;
-      double z;
-    };
-    float v[3];
-  };
+
+  Scalar x;
+  Scalar y;
+  Scalar z;
+
+  Scalar& operator[](int i) { return (&x)[i]; }
+  const Scalar& operator[](int i) const { return (&x)[i]; }
   
-  Vec3& operator+=(Vec3 const &v2) {
+  Vec3T& operator+=(Vec3T const &v2) {
     x += v2.x;
     y += v2.y;
     z += v2.z;
     return *this;
   }
 
-  Vec3 operator-(Vec3 const &v2) {
-    return Vec3(x - v2.x,
-                y - v2.y,
-                z - v2.z);
+  Vec3T& operator-=(Vec3T const &v2) {
+    x -= v2.x;
+    y -= v2.y;
+    z -= v2.z;
+    return *this;
+  }
+
+  Vec3T operator-(Vec3T const &v2) const {
+    return Vec3T(x - v2.x,
+                 y - v2.y,
+                 z - v2.z);
   }
   
-  Vec3 operator+(Vec3 const &v2) {
-    return Vec3(x + v2.x,
-                y + v2.y,
-                z + v2.z);
+  Vec3T operator+(Vec3T const &v2) const {
+    return Vec3T(x + v2.x,
+                 y + v2.y,
+                 z + v2.z);
   }
   
-  Vec3 operator/(double const &d) {
-    return Vec3(x/d, y/d, z/d);
+  Vec3T operator/(Scalar const &d) const {
+    return Vec3T(x/d, y/d, z/d);
   }
-  Vec3 operator*(double const &d) {
-    return Vec3(x*d, y*d, z*d);
+  Vec3T operator*(Scalar const &d) const {
+    return Vec3T(x*d, y*d, z*d);
   }
 
-  static Vec3 min(Vec3 v1, Vec3 v2) {
-    return Vec3(std::min(v1.x, v2.x),
-                std::min(v1.y, v2.y),
-                std::min(v1.z, v2.z));
+  static Vec3T min(Vec3T v1, Vec3T v2) {
+    return Vec3T(std::min(v1.x, v2.x),
+                 std::min(v1.y, v2.y),
+                 std::min(v1.z, v2.z));
   }
 
-  static Vec3 max(Vec3 v1, Vec3 v2) {
-    return Vec3(std::max(v1.x, v2.x),
-                std::max(v1.y, v2.y),
-                std::max(v1.z, v2.z));
+  static Vec3T max(Vec3T v1, Vec3T v2) {
+    return Vec3T(std::max(v1.x, v2.x),
+                 std::max(v1.y, v2.y),
+                 std::max(v1.z, v2.z));
   }
 
-  static Vec3 abs(Vec3 v1) {
-    return Vec3(fabs(v1.x),
-                fabs(v1.y),
-                fabs(v1.z));
+  static Vec3T abs(Vec3T v1) {
+    return Vec3T(std::abs(v1.x),
+                 std::abs(v1.y),
+                 std::abs(v1.z));
   }
 };
 
+typedef Vec3T<double> Vec3;
+typedef Vec3T<float> Vec3f;
+
 #endif // __VEC3_H__
@@ -1,10 +1,14 @@
 #ifndef __VERY_STABLE_GENIUS_H__
 #define __VERY_STABLE_GENIUS_H__
 
+#include <cstdint>
 #include <iostream>
-#include <boost/circular_buffer.hpp>
+#include <functional>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 #include <sensor_msgs/Imu.h>
+#include <very_stable_genius/imu_buffer.hpp>
+#include <very_stable_genius/monotonic_queue.hpp>
 #include <very_stable_genius/vec3.hpp>
 
 namespace very_stable_genius {
@@ -29,6 +33,38 @@ namespace very_stable_genius {
     Vec3 gyro;
   };
 
+  /// Running statistics over the last N IMU measurements. Sums and per-axis min/max are updated as
+  /// measurements enter and leave the window, so adding a measurement is amortized O(1) and reading
+  /// the statistics is O(1).
+  class ObservationWindow {
+  public:
+    explicit ObservationWindow(size_t capacity = 1);
+    void push(uint64_t seq, const double in[kNumImuAxes], const double *out); /// Add measurement seq (one value per axis), out is the measurement leaving a full window
+    void resync(const double sums[kNumImuAxes]); /// Replace the running sums with ones recomputed from the buffer, bounds rounding drift
+    bool needsResync() const { return full() && pushes_since_resync_ >= capacity_; }
+    void clear();
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const { return count_; }
+    bool full() const { return count_ == capacity_; }
+
+    Vec3 accelAverage() const { return average(0); }
+    Vec3 gyroAverage() const { return average(3); }
+    Vec3 accelMaxDiff() const { return maxDiff(0); } /// Largest difference between a measurement and the average, per axis
+    Vec3 gyroMaxDiff() const { return maxDiff(3); }  /// Largest difference between a measurement and the average, per axis
+
+  private:
+    Vec3 average(int first_axis) const;
+    Vec3 maxDiff(int first_axis) const;
+
+    size_t capacity_;
+    size_t count_;
+    size_t pushes_since_resync_;
+    double sums_[kNumImuAxes];
+    MonotonicQueue<std::less<double> > min_[kNumImuAxes];
+    MonotonicQueue<std::greater<double> > max_[kNumImuAxes];
+  };
+
   class VeryStableGenius {
   public:
     VeryStableGenius(const std::string &yaml_cfg_filename); /// Reads parameters from a yaml config file
@@ -38,8 +74,14 @@ namespace very_stable_genius {
     void addImuMeasurement(const sensor_msgs::Imu::ConstPtr &msg); /// Add an IMU measurement to the circular buffer
     int getStatus(); /// Compute and return a Status code
     int getStatus(Vec3 *accel_avg_in); /// Compute and return a Status code and an averaged accelerometer reading
+    int getStatus(size_t window, Vec3 *accel_avg_in); /// Status code and averaged accelerometer reading over one observation window
+    size_t addObservationPeriod(double observation_period_s); /// Evaluate another window length in parallel, returns its window index
+    size_t numWindows() const { return windows_.size(); } /// Window 0 is observation_period_s
+    int evaluateStatus(size_t window, Vec3 *accel_avg_in) const; /// Same as getStatus, recomputed over the whole window from the buffer
 
   private:
+    int classify(const Vec3 &accel_max_diff, const Vec3 &gyro_max_diff) const;
+
     double imu_rate_hz_;          /// IMU message publishing rate, in Hz. Currently 50Hz on Husky2
     double observation_period_s_; /// How long does the robot need to be stationary to be declared stationary?
     double imu_max_rate_x_;       /// Maximum allowed difference between measurement and average until considered moving
@@ -48,7 +90,9 @@ namespace very_stable_genius {
     double imu_max_accel_x_;      /// Maximum allowed difference between measurement and average until considered moving
     double imu_max_accel_y_;      /// Maximum allowed difference between measurement and average until considered moving
     double imu_max_accel_z_;      /// Maximum allowed difference between measurement and average until considered moving
-    boost::circular_buffer<ImuMeasurement> imu_circular_buffer_;  /// Circular buffer where IMU messages are stored
+    uint64_t num_measurements_;   /// Sequence number of the next measurement
+    ImuBuffer<double> imu_buffer_; /// Circular buffer where IMU measurements are stored per axis, as long as the longest window
+    std::vector<ObservationWindow> windows_; /// Running statistics per observation period
   };
 
 }
@@ -0,0 +1,32 @@
+#ifndef __VERY_STABLE_GENIUS_NODE_H__
+#define __VERY_STABLE_GENIUS_NODE_H__
+
+#include <ros/ros.h>
+#include <sensor_msgs/Imu.h>
+#include <std_msgs/Header.h>
+#include <very_stable_genius/very_stable_genius.hpp>
+
+namespace very_stable_genius {
+
+  /// ROS interface of the detector, shared by very_stable_genius_node and the nodelet
+  class VeryStableGeniusNode {
+  public:
+    VeryStableGeniusNode(ros::NodeHandle &nh, ros::NodeHandle &pnh); /// Reads the config from the private node handle, throws if it is missing
+    void imuCallback(const sensor_msgs::Imu::ConstPtr &msg); /// Adds the measurement, evaluates and publishes the status when it is due
+
+  private:
+    void publishStatus(int status, const Vec3 &accel_avg, const std_msgs::Header &header);
+
+    VeryStableGenius vsg_;
+    double status_period_s_;  /// Status is evaluated at most once per period of IMU time, 0 evaluates every message
+    bool publish_on_change_;  /// Only publish when the status differs from the last published one
+    ros::Time last_evaluation_stamp_;
+    int last_status_;         /// Last published status, ERROR before the first
+    ros::Subscriber imu_sub_;
+    ros::Publisher bool_status_pub_;
+    ros::Publisher full_status_pub_;
+  };
+
+}
+
+#endif // __VERY_STABLE_GENIUS_NODE_H__
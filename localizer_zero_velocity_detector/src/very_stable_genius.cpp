@@ -1,19 +1,73 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
-#include <boost/circular_buffer.hpp>
 #include <yaml-cpp/yaml.h>
 #include <sensor_msgs/Imu.h>
 #include <very_stable_genius/vec3.hpp>
 #include <very_stable_genius/very_stable_genius.hpp>
 
 namespace very_stable_genius {
+
+  ObservationWindow::ObservationWindow(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)), count_(0), pushes_since_resync_(0) {
+    for (int i = 0; i < kNumImuAxes; i++) {
+      sums_[i] = 0.0;
+      min_[i].setCapacity(capacity_);
+      max_[i].setCapacity(capacity_);
+    }
+  }
+
+  void ObservationWindow::push(uint64_t seq, const double in[kNumImuAxes], const double *out) {
+    if (NULL == out) {
+      count_++;
+    }
+    pushes_since_resync_++;
+
+    // Oldest sequence number still in the window once seq is in
+    const uint64_t first_seq = seq + 1 >= capacity_ ? seq + 1 - capacity_ : 0;
+    for (int i = 0; i < kNumImuAxes; i++) {
+      sums_[i] += NULL != out ? in[i] - out[i] : in[i];
+      min_[i].expire(first_seq);
+      min_[i].push(seq, in[i]);
+      max_[i].expire(first_seq);
+      max_[i].push(seq, in[i]);
+    }
+  }
+
+  void ObservationWindow::resync(const double sums[kNumImuAxes]) {
+    std::copy(sums, sums + kNumImuAxes, sums_);
+    pushes_since_resync_ = 0;
+  }
+
+  void ObservationWindow::clear() {
+    count_ = 0;
+    pushes_since_resync_ = 0;
+    for (int i = 0; i < kNumImuAxes; i++) {
+      sums_[i] = 0.0;
+      min_[i].clear();
+      max_[i].clear();
+    }
+  }
+
+  Vec3 ObservationWindow::average(int first_axis) const {
+    return Vec3(sums_[first_axis], sums_[first_axis + 1], sums_[first_axis + 2]) / static_cast<double>(count_);
+  }
+
+  Vec3 ObservationWindow::maxDiff(int first_axis) const {
+    const Vec3 avg = average(first_axis);
+    const Vec3 max(max_[first_axis].front(), max_[first_axis + 1].front(), max_[first_axis + 2].front());
+    const Vec3 min(min_[first_axis].front(), min_[first_axis + 1].front(), min_[first_axis + 2].front());
+    return Vec3::max(Vec3::abs(max - avg), Vec3::abs(avg - min));
+  }
   
-  VeryStableGenius::VeryStableGenius(const std::string &yaml_cfg_filename) {
+  VeryStableGenius::VeryStableGenius(const std::string &yaml_cfg_filename)
+    : num_measurements_(0) {
     // Read parameters from yaml file
     parseConfig(yaml_cfg_filename);
-    imu_circular_buffer_.set_capacity(imu_rate_hz_ * observation_period_s_);
   }
 
-  VeryStableGenius::VeryStableGenius() {
+  VeryStableGenius::VeryStableGenius()
+    : num_measurements_(0) {
     // Default parameters if a yaml file is not provided
     imu_rate_hz_ = 50.0; 
     observation_period_s_ = 3.0; 
@@ -23,7 +77,7 @@ namespace very_stable_genius {
     imu_max_accel_x_ = 0.75;
     imu_max_accel_y_ = 0.5;
     imu_max_accel_z_ = 0.5;
-    imu_circular_buffer_.set_capacity(imu_rate_hz_ * observation_period_s_);
+    addObservationPeriod(observation_period_s_);
   }
   
   int VeryStableGenius::parseConfig(const std::string &filename) {
@@ -43,14 +97,56 @@ namespace very_stable_genius {
       throw std::runtime_error("Unrecognized yaml version number in " +
                                filename + ": " + std::to_string(version));
     }
+
+    windows_.clear();
+    imu_buffer_.clear();
+    num_measurements_ = 0;
+    addObservationPeriod(observation_period_s_);
+    // Optional, windows evaluated alongside observation_period_s
+    if (config["extra_observation_periods_s"]) {
+      for (const auto &period : config["extra_observation_periods_s"]) {
+        addObservationPeriod(period.as<double>());
+      }
+    }
+    return SUCCESS;
+  }
+
+  size_t VeryStableGenius::addObservationPeriod(double observation_period_s) {
+    windows_.push_back(ObservationWindow(static_cast<size_t>(imu_rate_hz_ * observation_period_s)));
+    if (windows_.back().capacity() > imu_buffer_.capacity()) {
+      imu_buffer_.setCapacity(windows_.back().capacity());
+    }
+    return windows_.size() - 1;
   }
 
   void VeryStableGenius::addImuMeasurement(const ImuMeasurement &measurement) {
-    imu_circular_buffer_.push_back(measurement);
+    const double in[kNumImuAxes] = {measurement.accel.x, measurement.accel.y, measurement.accel.z,
+                                    measurement.gyro.x, measurement.gyro.y, measurement.gyro.z};
+    double out[kNumImuAxes];
+    const size_t size = imu_buffer_.size();
+    for (auto &window : windows_) {
+      // A window holds the newest measurements of the buffer, its oldest one leaves once it is full
+      if (window.full()) {
+        imu_buffer_.sample(size - window.capacity(), out);
+        window.push(num_measurements_, in, out);
+      } else {
+        window.push(num_measurements_, in, NULL);
+      }
+    }
+    imu_buffer_.push(measurement.accel, measurement.gyro);
+    num_measurements_++;
+
+    for (auto &window : windows_) {
+      if (window.needsResync()) {
+        double sums[kNumImuAxes];
+        imu_buffer_.sumNewest(window.capacity(), sums);
+        window.resync(sums);
+      }
+    }
   }
   
   void VeryStableGenius::addImuMeasurement(const sensor_msgs::Imu::ConstPtr &msg) {
-    imu_circular_buffer_.push_back(ImuMeasurement(msg->header.stamp.toSec(),
+    addImuMeasurement(ImuMeasurement(msg->header.stamp.toSec(),
                                                   Vec3(msg->linear_acceleration.x,
                                                        msg->linear_acceleration.y,
                                                        msg->linear_acceleration.z),
@@ -64,54 +160,56 @@ namespace very_stable_genius {
   }
 
   int VeryStableGenius::getStatus(Vec3 *accel_avg_in) {
-    if (!imu_circular_buffer_.full()) {
+    return getStatus(0, accel_avg_in);
+  }
+
+  int VeryStableGenius::getStatus(size_t window, Vec3 *accel_avg_in) {
+    const ObservationWindow &observation = windows_.at(window);
+    if (!observation.full()) {
       // We haven't received observation_period_s worth of measurements, so return initializing state
-      // ROS_INFO_STREAM("Buffer has " << imu_circular_buffer_.size() << " elements out of " << imu_circular_buffer_.capacity());
       return INITIALIZING;
     } else {
-      // Take average of all measurements in the circular buffer
-      // Determine maximum difference from average. If any measurement exceeds our difference threshold, we consider the robot to be moving (nonstationary)
-      Vec3 accel_avg;
-      Vec3 accel_max = imu_circular_buffer_[0].accel;
-      Vec3 accel_min = imu_circular_buffer_[0].accel;
-      Vec3 accel_max_diff;
-      Vec3 gyro_avg;
-      Vec3 gyro_max = imu_circular_buffer_[0].gyro;
-      Vec3 gyro_min = imu_circular_buffer_[0].gyro;
-      Vec3 gyro_max_diff;
-      
-      for (auto &measurement : imu_circular_buffer_) {
-        accel_avg += measurement.accel;
-        gyro_avg += measurement.gyro;
-        accel_max = Vec3::max(accel_max, measurement.accel);
-        accel_min = Vec3::min(accel_min, measurement.accel);
-        gyro_max = Vec3::max(gyro_max, measurement.gyro);
-        gyro_min = Vec3::min(gyro_min, measurement.gyro);
+      // Average of all measurements in the window, and the maximum difference from it.
+      // If any measurement exceeds our difference threshold, we consider the robot to be moving (nonstationary)
+      if (NULL != accel_avg_in) {
+        *accel_avg_in = observation.accelAverage();
       }
-      accel_avg = accel_avg / static_cast<double>(imu_circular_buffer_.size());
-      gyro_avg = gyro_avg / static_cast<double>(imu_circular_buffer_.size());
+      return classify(observation.accelMaxDiff(), observation.gyroMaxDiff());
+    }
+  }
 
-      accel_max_diff = Vec3::max(Vec3::abs(accel_max - accel_avg),
-                                 Vec3::abs(accel_avg - accel_min));
-      gyro_max_diff = Vec3::max(Vec3::abs(gyro_max - gyro_avg),
-                                Vec3::abs(gyro_avg - gyro_min));
+  int VeryStableGenius::evaluateStatus(size_t window, Vec3 *accel_avg_in) const {
+    const ObservationWindow &observation = windows_.at(window);
+    if (!observation.full()) {
+      return INITIALIZING;
+    }
+    double sums[kNumImuAxes], min[kNumImuAxes], max[kNumImuAxes];
+    imu_buffer_.sumNewest(observation.capacity(), sums);
+    imu_buffer_.minMaxNewest(observation.capacity(), min, max);
 
-      if (NULL != accel_avg_in) {
-        *accel_avg_in = accel_avg;
-      }
-      
-      // If any differences exceed our threshold, we consider it nonstationary
-      if ((accel_max_diff.x > imu_max_accel_x_) ||
-          (accel_max_diff.y > imu_max_accel_y_) ||
-          (accel_max_diff.z > imu_max_accel_z_) ||
-          (gyro_max_diff.x >  imu_max_rate_x_) ||
-          (gyro_max_diff.y >  imu_max_rate_y_) ||
-          (gyro_max_diff.z >  imu_max_rate_z_)) {
-        return NONSTATIONARY;
-      } else {
-        return STATIONARY;        
+    Vec3 max_diff[2];
+    for (int i = 0; i < kNumImuAxes; i++) {
+      const double avg = sums[i] / static_cast<double>(observation.capacity());
+      max_diff[i / 3][i % 3] = std::max(std::abs(max[i] - avg), std::abs(avg - min[i]));
+      if (i < 3 && NULL != accel_avg_in) {
+        (*accel_avg_in)[i] = avg;
       }
     }
+    return classify(max_diff[0], max_diff[1]);
+  }
+
+  int VeryStableGenius::classify(const Vec3 &accel_max_diff, const Vec3 &gyro_max_diff) const {
+    // If any differences exceed our threshold, we consider it nonstationary
+    if ((accel_max_diff.x > imu_max_accel_x_) ||
+        (accel_max_diff.y > imu_max_accel_y_) ||
+        (accel_max_diff.z > imu_max_accel_z_) ||
+        (gyro_max_diff.x >  imu_max_rate_x_) ||
+        (gyro_max_diff.y >  imu_max_rate_y_) ||
+        (gyro_max_diff.z >  imu_max_rate_z_)) {
+      return NONSTATIONARY;
+    } else {
+      return STATIONARY;        
+    }
   }
 
 }
@@ -0,0 +1,27 @@
+#include <memory>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <very_stable_genius/very_stable_genius_node.hpp>
+
+namespace very_stable_genius {
+
+  /// Loaded into the manager of the IMU driver, the IMU messages are handed over as shared pointers without serialization
+  class VeryStableGeniusNodelet : public nodelet::Nodelet {
+  private:
+    void onInit() override {
+      ros::NodeHandle nh = getNodeHandle();
+      ros::NodeHandle pnh = getPrivateNodeHandle();
+      try {
+        vsg_node_.reset(new VeryStableGeniusNode(nh, pnh));
+      } catch (const std::exception &e) {
+        NODELET_ERROR_STREAM("Failed to start the zero velocity detector: " << e.what());
+      }
+    }
+
+    std::unique_ptr<VeryStableGeniusNode> vsg_node_;
+  };
+
+}
+
+PLUGINLIB_EXPORT_CLASS(very_stable_genius::VeryStableGeniusNodelet,
+                       nodelet::Nodelet)
@@ -0,0 +1,97 @@
+#include <limits>
+#include <std_msgs/Bool.h>
+#include <very_stable_genius/very_stable_genius_node.hpp>
+#include <localizer_zero_velocity_detector/Stationary.h>
+
+using namespace localizer_zero_velocity_detector;
+
+namespace very_stable_genius {
+
+  VeryStableGeniusNode::VeryStableGeniusNode(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    : status_period_s_(0.0), publish_on_change_(false), last_status_(ERROR) {
+    // Obtain YAML config filename
+    std::string cfg_filename;
+    if (!pnh.getParam("config", cfg_filename)) {
+      throw std::runtime_error("Yaml config filename not provided");
+    }
+
+    // Set up circular buffer
+    vsg_ = VeryStableGenius(cfg_filename);
+
+    // Status rate decimated from the IMU rate, 0 evaluates on every IMU message
+    double status_rate_hz = 0.0;
+    pnh.param("status_rate_hz", status_rate_hz, 0.0);
+    status_period_s_ = status_rate_hz > 0.0 ? 1.0 / status_rate_hz : 0.0;
+    pnh.param("publish_on_change", publish_on_change_, false);
+
+    // Set up ROS publishers and subscribers. Latched, with publish_on_change a late subscriber still gets the current status
+    int imu_queue_size = 200;
+    pnh.param("imu_queue_size", imu_queue_size, 200);
+    imu_sub_ = nh.subscribe("imu", imu_queue_size, &VeryStableGeniusNode::imuCallback, this,
+                            ros::TransportHints().tcpNoDelay());
+    bool_status_pub_ = nh.advertise<std_msgs::Bool>("stationary", 10, publish_on_change_);
+    full_status_pub_ = nh.advertise<Stationary>("stationary_accel", 10, publish_on_change_);
+  }
+
+  void VeryStableGeniusNode::imuCallback(const sensor_msgs::Imu::ConstPtr &msg) {
+    vsg_.addImuMeasurement(msg);
+
+    // Decimate by IMU time, so a bag played back faster still evaluates at the same points
+    if (status_period_s_ > 0.0 && !last_evaluation_stamp_.isZero() &&
+        msg->header.stamp >= last_evaluation_stamp_ &&
+        (msg->header.stamp - last_evaluation_stamp_).toSec() < status_period_s_) {
+      return;
+    }
+    last_evaluation_stamp_ = msg->header.stamp;
+
+    Vec3 accel_avg;
+    int status = vsg_.getStatus(&accel_avg);
+    if (publish_on_change_ && status == last_status_) {
+      return;
+    }
+    publishStatus(status, accel_avg, msg->header);
+  }
+
+  void VeryStableGeniusNode::publishStatus(int status, const Vec3 &accel_avg, const std_msgs::Header &header) {
+    std_msgs::Bool bool_msg;
+    
+    Stationary full_msg;
+    full_msg.header.stamp = header.stamp;
+    full_msg.header.frame_id = header.frame_id;
+    
+    if (INITIALIZING == status) {
+      ROS_INFO_STREAM_ONCE("Initializing: requires a few seconds of data");
+      full_msg.status = Stationary::INITIALIZING;
+      full_msg.average_acceleration.x = std::numeric_limits<double>::quiet_NaN();
+      full_msg.average_acceleration.y = std::numeric_limits<double>::quiet_NaN();
+      full_msg.average_acceleration.z = std::numeric_limits<double>::quiet_NaN();
+      full_status_pub_.publish(full_msg);      
+    }
+    else if (STATIONARY == status) {
+      full_msg.status = Stationary::STATIONARY;
+      full_msg.average_acceleration.x = accel_avg.x;
+      full_msg.average_acceleration.y = accel_avg.y;
+      full_msg.average_acceleration.z = accel_avg.z;
+      full_status_pub_.publish(full_msg);
+      
+      bool_msg.data = true;      
+      bool_status_pub_.publish(bool_msg);
+    }
+    else if (NONSTATIONARY == status) {
+      full_msg.status = Stationary::NONSTATIONARY;
+      full_msg.average_acceleration.x = std::numeric_limits<double>::quiet_NaN();
+      full_msg.average_acceleration.y = std::numeric_limits<double>::quiet_NaN();
+      full_msg.average_acceleration.z = std::numeric_limits<double>::quiet_NaN();
+      full_status_pub_.publish(full_msg);
+      
+      bool_msg.data = false;
+      bool_status_pub_.publish(bool_msg); 
+    }
+    else {
+      ROS_ERROR_STREAM("Unrecognized status: " << status);
+      return;
+    }
+    last_status_ = status;
+  }
+
+}
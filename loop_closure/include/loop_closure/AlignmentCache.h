@@ -0,0 +1,91 @@
+/**
+ * @file   AlignmentCache.h
+ * @brief  Loop closure alignments kept on disk across restarts
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <geometry_utils/Transform3.h>
+#include <gtsam/base/Matrix.h>
+
+namespace lamp_loop_closure {
+
+// What an alignment depends on. content_hash covers the (accumulated) clouds
+// and the initial guess, params_hash the settings of the alignment, so a
+// cached result is only reused for the very same computation.
+struct AlignmentCacheKey {
+  uint64_t key_from{0};
+  uint64_t key_to{0};
+  uint64_t content_hash{0};
+  uint64_t params_hash{0};
+
+  bool operator==(const AlignmentCacheKey& other) const {
+    return key_from == other.key_from && key_to == other.key_to &&
+        content_hash == other.content_hash && params_hash == other.params_hash;
+  }
+};
+
+struct AlignmentCacheKeyHash {
+  size_t operator()(const AlignmentCacheKey& key) const;
+};
+
+// Outcome of an alignment, rejected ones included
+struct AlignmentCacheEntry {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  bool b_accepted{false};
+  double fitness{0};
+  geometry_utils::Transform3 delta;
+  gtsam::Matrix66 covariance = gtsam::Matrix66::Zero();
+};
+
+// Alignment results in a memory mapped file of fixed size records, indexed
+// in memory when opened. Records are appended in place and the record count
+// in the file header is bumped after the record is written, a record with a
+// bad checksum (cut short by a crash) ends the readable part. A file of
+// another format version is started over. Thread safe.
+class AlignmentCache {
+public:
+  AlignmentCache() = default;
+  ~AlignmentCache();
+  AlignmentCache(const AlignmentCache&) = delete;
+  AlignmentCache& operator=(const AlignmentCache&) = delete;
+
+  // Maps filename, created if missing, false if it can not be used
+  bool Open(const std::string& filename);
+  void Close();
+  bool IsOpen() const;
+
+  bool Lookup(const AlignmentCacheKey& key, AlignmentCacheEntry* entry) const;
+  // Keeps the first result of a key
+  void Insert(const AlignmentCacheKey& key, const AlignmentCacheEntry& entry);
+
+  size_t Size() const;
+
+  // FNV-1a of size bytes, chained through seed
+  static uint64_t Hash(const void* data,
+                       size_t size,
+                       uint64_t seed = 0xcbf29ce484222325ull);
+
+private:
+  struct Record;
+
+  // Maps capacity records, the file grown to fit
+  bool Map(size_t capacity);
+  void Unmap();
+  Record* RecordAt(size_t index) const;
+
+  mutable std::mutex mutex_;
+  int fd_{-1};
+  char* map_{nullptr};
+  size_t map_size_{0};
+  size_t capacity_{0};
+  size_t num_records_{0};
+  std::unordered_map<AlignmentCacheKey, size_t, AlignmentCacheKeyHash> index_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,89 @@
+/**
+ * @file   ArtifactLoopGeneration.h
+ * @brief  Find potential loop closures between the nodes observing the same
+ * artifact
+ */
+#pragma once
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/inference/Symbol.h>
+#include <lamp_utils/KeyedSpatialIndex.h>
+
+#include "loop_closure/LoopGeneration.h"
+
+namespace lamp_loop_closure {
+
+// Two sightings of one artifact, by the same ID or by artifact nodes within
+// match_radius, put their nodes close to each other. Instead of searching
+// the neighbourhood of every new key, candidates are only made between the
+// nodes of the artifact factors of a group, at most max_candidates per
+// sighting (the closest sightings of the group first). The initial guess
+// lines up the artifact positions seen from both nodes, keeping the
+// odometric rotations since the artifact orientation is not observed.
+class ArtifactLoopGeneration : public LoopGeneration {
+  friend class TestLoopGeneration;
+
+public:
+  ArtifactLoopGeneration();
+  ~ArtifactLoopGeneration();
+
+  bool Initialize(const ros::NodeHandle& n) override;
+
+  bool LoadParameters(const ros::NodeHandle& n) override;
+
+  bool CreatePublishers(const ros::NodeHandle& n) override;
+
+  bool RegisterCallbacks(const ros::NodeHandle& n) override;
+
+protected:
+  // Artifact factor between a robot node and an artifact node
+  struct Sighting {
+    gtsam::Key node;
+    gtsam::Key artifact;
+    // Artifact in the frame of the node
+    gtsam::Point3 position;
+  };
+
+  void GenerateLoops(size_t sighting);
+
+  void KeyedPoseCallback(
+      const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) override;
+
+  // Group of the artifact, the artifact itself if it was never matched
+  gtsam::Key FindGroup(gtsam::Key artifact);
+  // Merges the groups of two artifacts. The sightings of the smaller group
+  // are added to pending to be paired with the other group
+  void MergeGroups(gtsam::Key artifact,
+                   gtsam::Key other,
+                   std::vector<size_t>* pending);
+
+  bool IsPair(const Sighting& sighting, const Sighting& other) const;
+
+  std::vector<Sighting> sightings_;
+  // Artifact factors seen, as (node, artifact)
+  std::set<std::pair<gtsam::Key, gtsam::Key>> sighted_;
+  // Union-find over the artifact keys, the sightings of each artifact and
+  // the artifacts of each group (by group key)
+  std::unordered_map<gtsam::Key, gtsam::Key> groups_;
+  std::unordered_map<gtsam::Key, std::vector<size_t>> artifact_sightings_;
+  std::unordered_map<gtsam::Key, std::vector<gtsam::Key>> group_members_;
+  // First artifact key of each ID
+  std::unordered_map<std::string, gtsam::Key> id_artifacts_;
+  lamp_utils::KeyedSpatialIndex artifact_positions_;
+  // Node pairs made candidates, lower key first
+  std::set<std::pair<gtsam::Key, gtsam::Key>> paired_;
+
+  double match_radius_;
+  double max_sighting_distance_;
+  size_t max_candidates_;
+  size_t skip_recent_poses_;
+  bool b_intra_robot_{true};
+  bool b_inter_robot_{true};
+};
+
+} // namespace lamp_loop_closure
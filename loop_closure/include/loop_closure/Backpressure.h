@@ -0,0 +1,59 @@
+/**
+ * @file   Backpressure.h
+ * @brief  Saturation of loop computation as seen by the upstream stages
+ */
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+#include <pose_graph_msgs/LoopComputationStatus.h>
+
+namespace lamp_loop_closure {
+
+struct BackpressureParams {
+  bool b_enabled{false};
+  // Queueing delay (s) of loop computation beyond which it is saturated
+  double max_latency{10.0};
+  // Statuses older than this (s) no longer throttle
+  double status_timeout{5.0};
+};
+
+bool LoadBackpressureParams(const std::string& param_ns,
+                            BackpressureParams* params);
+
+// Load of loop computation from its statuses: the time its queue takes to
+// drain at the measured throughput over the latency allowed. Above 1 the
+// computation is saturated and the stages feeding it keep only a share of
+// their candidates, the best ones, so the queue and the end-to-end latency
+// stay bounded during candidate storms. Thread safe.
+class Backpressure {
+public:
+  explicit Backpressure(const BackpressureParams& params = BackpressureParams());
+
+  void SetParams(const BackpressureParams& params);
+
+  void Update(const pose_graph_msgs::LoopComputationStatus& status);
+
+  // 0 when disabled, without throughput measured yet or when the last status
+  // is older than the timeout
+  double Load(double now) const;
+
+  inline bool IsSaturated(double now) const {
+    return Load(now) > 1.0;
+  }
+
+  // How many of n candidates to keep at the current load, at least min_keep
+  size_t Keep(size_t n, size_t min_keep, double now) const;
+
+private:
+  mutable std::mutex mutex_;
+  BackpressureParams params_;
+  int queue_depth_{0};
+  // Smoothed over the statuses that computed anything
+  double throughput_{0};
+  double stamp_{0};
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,108 @@
+/**
+ * @file   CandidateChannel.h
+ * @brief  In-process handoff of loop candidates between the nodelets of one
+ * manager
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <pose_graph_msgs/LoopCandidateArray.h>
+#include <ros/ros.h>
+
+namespace lamp_loop_closure {
+
+// Bounded lock-free multi producer, multi consumer queue of candidate
+// arrays (D. Vyukov's bounded MPMC queue). Each cell carries a sequence
+// number that tells producers and consumers whether it is free or full, so
+// Push and Pop are a single compare-and-swap on their position. Messages
+// are handed over as shared pointers, never serialized nor copied.
+class CandidateChannel {
+public:
+  typedef pose_graph_msgs::LoopCandidateArray::ConstPtr Message;
+
+  // Capacity is rounded up to a power of two
+  explicit CandidateChannel(size_t capacity);
+
+  // Channel of a resolved topic name, shared by every stage of the process.
+  // The capacity only applies to the stage that creates it.
+  static std::shared_ptr<CandidateChannel> Get(const std::string& topic,
+                                               size_t capacity);
+
+  // False if the channel is full
+  bool Push(const Message& message);
+  // False if the channel is empty
+  bool Pop(Message* message);
+
+  // Producers only hand over through the channel while a consumer reads it
+  inline bool HasConsumer() const { return num_consumers_.load() > 0; }
+
+private:
+  friend class CandidateChannelReader;
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Message message;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> enqueue_pos_;
+  alignas(64) std::atomic<size_t> dequeue_pos_;
+  std::atomic<int> num_consumers_;
+};
+
+// Consumer end of a channel, registered for as long as it lives
+class CandidateChannelReader {
+public:
+  explicit CandidateChannelReader(
+      const std::shared_ptr<CandidateChannel>& channel);
+  ~CandidateChannelReader();
+
+  inline bool Pop(CandidateChannel::Message* message) {
+    return channel_->Pop(message);
+  }
+
+private:
+  std::shared_ptr<CandidateChannel> channel_;
+};
+
+struct CandidateChannelParams {
+  bool b_enabled{false};
+  // Candidate arrays buffered per channel
+  int capacity{64};
+  // Period (s) at which stages without a processing timer read the channel
+  double poll_period{0.1};
+};
+
+bool LoadCandidateChannelParams(const std::string& param_ns,
+                                CandidateChannelParams* params);
+
+// Channels of the topic, as remapped for the node handle. Null if channels
+// are disabled.
+std::shared_ptr<CandidateChannel>
+OpenCandidateOutput(const ros::NodeHandle& n,
+                    const std::string& topic,
+                    const CandidateChannelParams& params);
+std::unique_ptr<CandidateChannelReader>
+OpenCandidateInput(const ros::NodeHandle& n,
+                   const std::string& topic,
+                   const CandidateChannelParams& params);
+
+// Hands the candidates to the in-process consumer of the channel if there is
+// one, otherwise (or when the channel is full) publishes them on the topic
+void PublishCandidates(const ros::Publisher& pub,
+                       CandidateChannel* channel,
+                       const pose_graph_msgs::LoopCandidateArray& candidates);
+
+// True if anyone receives what PublishCandidates sends
+inline bool HasCandidateSubscribers(const ros::Publisher& pub,
+                                    const CandidateChannel* channel) {
+  return pub.getNumSubscribers() > 0 ||
+      (channel != nullptr && channel->HasConsumer());
+}
+
+} // namespace lamp_loop_closure
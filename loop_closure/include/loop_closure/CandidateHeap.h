@@ -0,0 +1,61 @@
+/**
+ * @file   CandidateHeap.h
+ * @brief  Loop candidates ordered by score, with expiry
+ */
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <pose_graph_msgs/LoopCandidate.h>
+
+namespace lamp_loop_closure {
+
+// Two indexed binary heaps over the same entries: a max heap on the score
+// and a min heap on the expiry time. Every entry knows its position in both,
+// so popping the best candidate and discarding the expired ones are both
+// O(log n) per candidate, without ever rebuilding the queue.
+// Not thread safe, the owner holds its queue mutex.
+class CandidateHeap {
+public:
+  void Push(const pose_graph_msgs::LoopCandidate& candidate,
+            double score,
+            double expiry);
+
+  // Highest score first, false if empty
+  bool Pop(pose_graph_msgs::LoopCandidate* candidate);
+
+  // Drop the candidates with an expiry before now, returns how many
+  size_t Expire(double now);
+
+  inline size_t Size() const { return by_score_.size(); }
+  inline bool Empty() const { return by_score_.empty(); }
+  void Clear();
+
+private:
+  struct Entry {
+    pose_graph_msgs::LoopCandidate candidate;
+    double score;
+    double expiry;
+    size_t score_pos;
+    size_t expiry_pos;
+  };
+
+  void Remove(size_t slot);
+  bool ScoreBefore(size_t a, size_t b) const;
+  bool ExpiryBefore(size_t a, size_t b) const;
+  void SiftUpScore(size_t pos);
+  void SiftDownScore(size_t pos);
+  void SiftUpExpiry(size_t pos);
+  void SiftDownExpiry(size_t pos);
+  void SwapScore(size_t i, size_t j);
+  void SwapExpiry(size_t i, size_t j);
+
+  // Entry slots, indexed by both heaps and reused through free_slots_
+  std::vector<Entry> entries_;
+  std::vector<size_t> free_slots_;
+  std::vector<size_t> by_score_;
+  std::vector<size_t> by_expiry_;
+};
+
+} // namespace lamp_loop_closure
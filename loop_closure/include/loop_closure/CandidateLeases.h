@@ -0,0 +1,97 @@
+/**
+ * @file   CandidateLeases.h
+ * @brief  Loop candidates leased to remote computation workers
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pose_graph_msgs/LoopCandidate.h>
+
+namespace lamp_loop_closure {
+
+struct CandidateLeasesParams {
+  // Candidates per lease at most
+  size_t batch_size{8};
+  // Time (s) a worker has to return a lease before its candidates are
+  // requeued
+  double lease_timeout{10};
+  // Time (s) without a heartbeat after which a worker is dropped, with its
+  // leases requeued
+  double worker_timeout{5};
+};
+
+// Bookkeeping of the coordinator side of distributed loop computation.
+// Workers announce themselves with heartbeats giving their free capacity and
+// the robots whose keyed scans they hold. Candidates are leased in batches to
+// the workers holding the scans of both keys first (robots at comm nodes,
+// without any scan transfer), then to the workers receiving every scan. A
+// lease is closed by its result, or its candidates handed back once it timed
+// out or its worker went silent. Thread safe, heartbeats and results come
+// from the subscriber callbacks.
+class CandidateLeases {
+public:
+  struct Lease {
+    uint64_t id;
+    std::string worker;
+    double deadline;
+    std::vector<pose_graph_msgs::LoopCandidate> candidates;
+  };
+
+  void SetParams(const CandidateLeasesParams& params);
+
+  // Worker alive at now, taking up to capacity candidates on lease and
+  // holding the keyed scans of robot_prefixes (every robot if empty)
+  void Heartbeat(const std::string& worker,
+                 size_t capacity,
+                 const std::vector<uint8_t>& robot_prefixes,
+                 double now);
+
+  // Moves the candidates the workers have room for into new leases, the
+  // ones left stay in candidates in their order
+  void Assign(std::vector<pose_graph_msgs::LoopCandidate>* candidates,
+              double now,
+              std::vector<Lease>* leases);
+
+  // Closes the lease and hands back its candidates, false if it is unknown
+  // (already expired) or was leased to another worker
+  bool Complete(uint64_t id,
+                const std::string& worker,
+                std::vector<pose_graph_msgs::LoopCandidate>* candidates);
+
+  // Appends to requeued the candidates of the leases past their deadline and
+  // of the workers silent for worker_timeout, returns how many leases expired
+  size_t Expire(double now,
+                std::vector<pose_graph_msgs::LoopCandidate>* requeued);
+
+  size_t NumWorkers() const;
+  // Candidates out on lease
+  size_t NumLeased() const;
+  void Clear();
+
+private:
+  struct Worker {
+    double last_heartbeat;
+    size_t capacity;
+    // Leased and not returned yet
+    size_t num_leased;
+    std::vector<uint8_t> robot_prefixes;
+  };
+
+  // Whether worker holds the keyed scans of both keys of candidate
+  static bool Holds(const Worker& worker,
+                    const pose_graph_msgs::LoopCandidate& candidate);
+
+  CandidateLeasesParams params_;
+  mutable std::mutex mutex_;
+  uint64_t next_id_{1};
+  std::unordered_map<std::string, Worker> workers_;
+  std::unordered_map<uint64_t, Lease> leases_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,74 @@
+/**
+ * @file   CandidateScorer.h
+ * @brief  Native runtime of a learned loop candidate score
+ */
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+#include <pose_graph_msgs/LoopCandidate.h>
+
+namespace lamp_loop_closure {
+
+// Small fully connected network over per candidate features, evaluated for
+// a whole batch of candidates as one matrix product per layer. The weights
+// are exported offline (script/export_candidate_scorer.py) to a text file:
+//
+//   features <n>
+//   mean <n values>
+//   scale <n values>
+//   layer <inputs> <outputs> <linear|tanh|relu|sigmoid>
+//   <outputs rows of inputs weights>
+//   <outputs biases>
+//   layer ...
+//
+// Lines starting with # are comments. The last layer has one output, the
+// score of the candidate (higher is better).
+class CandidateScorer {
+public:
+  enum Feature {
+    OBSERVABILITY_FROM = 0,
+    OBSERVABILITY_TO,
+    LOG_POINTS_FROM,
+    LOG_POINTS_TO,
+    ODOMETRIC_DISTANCE,
+    SAME_ROBOT,
+    LOG_KEY_GAP,
+    NUM_FEATURES
+  };
+
+  // Cached per key inputs of the features
+  struct KeyFeatures {
+    double observability{0};
+    size_t num_points{0};
+  };
+
+  // False, leaving the scorer unloaded, if the file is missing or malformed
+  bool Load(const std::string& filename);
+  inline bool IsLoaded() const { return !layers_.empty(); }
+
+  static void ComputeFeatures(const pose_graph_msgs::LoopCandidate& candidate,
+                              const KeyFeatures& from,
+                              const KeyFeatures& to,
+                              double* features);
+
+  // features has one row per candidate and NUM_FEATURES columns
+  void Score(const Eigen::MatrixXd& features, Eigen::VectorXd* scores) const;
+
+private:
+  enum class Activation { LINEAR, TANH, RELU, SIGMOID };
+  struct Layer {
+    Eigen::MatrixXd weights; // outputs x inputs
+    Eigen::VectorXd bias;
+    Activation activation;
+  };
+
+  Eigen::RowVectorXd mean_;
+  Eigen::RowVectorXd inverse_scale_;
+  std::vector<Layer> layers_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,70 @@
+/**
+ * @file   CandidateWaitList.h
+ * @brief  Loop candidates parked until the data of their keys arrives
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/LoopCandidate.h>
+
+namespace lamp_loop_closure {
+
+// Candidates whose keyed scans (or data derived from them) are missing wait
+// here, listed under every missing key, instead of being requeued and
+// checked again on every tick. Releasing a key only visits the candidates
+// waiting on it; once a candidate misses nothing it is handed back through
+// TakeReady. Expiry goes through a timer wheel of num_slots slots of tick
+// seconds, so each Expire only visits the slots the clock went through.
+// Thread safe, Release is typically called from the scan callbacks.
+class CandidateWaitList {
+public:
+  explicit CandidateWaitList(double tick = 0.5, size_t num_slots = 64);
+
+  // Parks candidate until every key of missing is released, dropped at
+  // expiry (s)
+  void Park(const pose_graph_msgs::LoopCandidate& candidate,
+            const std::vector<gtsam::Key>& missing,
+            double expiry);
+
+  // The data of key arrived
+  void Release(gtsam::Key key);
+
+  // Appends the candidates that no longer miss anything to ready
+  void TakeReady(std::vector<pose_graph_msgs::LoopCandidate>* ready);
+
+  // Drop the candidates with an expiry before now, returns how many
+  size_t Expire(double now);
+
+  // Parked candidates, ready ones not taken yet included
+  size_t Size() const;
+  void Clear();
+
+private:
+  struct Entry {
+    pose_graph_msgs::LoopCandidate candidate;
+    size_t num_missing;
+    double expiry;
+  };
+
+  int64_t Tick(double time) const;
+
+  const double tick_;
+  mutable std::mutex mutex_;
+  uint64_t next_id_{0};
+  std::unordered_map<uint64_t, Entry> entries_;
+  // Ids waiting on each key, ids of entries gone meanwhile are skipped
+  std::unordered_map<gtsam::Key, std::vector<uint64_t>> waiting_;
+  std::vector<uint64_t> ready_;
+  // Ids by slot of their expiry tick, the slots up to last_tick_ are expired
+  std::vector<std::vector<uint64_t>> wheel_;
+  int64_t last_tick_;
+  bool b_started_{false};
+};
+
+} // namespace lamp_loop_closure
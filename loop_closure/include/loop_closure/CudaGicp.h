@@ -0,0 +1,55 @@
+/**
+ * @file   CudaGicp.h
+ * @brief  GICP running correspondence search, covariance estimation and the
+ *         Gauss-Newton iterations on the GPU
+ */
+#pragma once
+
+#include <Eigen/Core>
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_loop_closure {
+
+struct CudaGicpParams {
+  double max_correspondence_distance = 5.0;
+  int max_iterations = 20;
+  double transformation_epsilon = 1e-10;
+  double rotation_epsilon = 2e-3;
+  double gicp_epsilon = 0.001;
+};
+
+// Plane to plane GICP with the same covariances (from the point normals),
+// stopping criteria and fitness score as
+// pcl::MultithreadedGeneralizedIterativeClosestPoint. Only available when
+// built with CUDA, Align fails otherwise
+class CudaGicp {
+public:
+  CudaGicp();
+  ~CudaGicp();
+
+  // Built with CUDA and a device is present
+  static bool IsAvailable();
+
+  void SetParams(const CudaGicpParams& params);
+
+  bool Align(const PointCloudConstPtr& source,
+             const PointCloudConstPtr& target,
+             const Eigen::Matrix4f& guess);
+
+  const Eigen::Matrix4f& GetFinalTransformation() const {
+    return final_transformation_;
+  }
+  bool HasConverged() const { return b_converged_; }
+  double GetFitnessScore() const { return fitness_score_; }
+  int GetNumIterations() const { return num_iterations_; }
+
+private:
+  CudaGicpParams params_;
+
+  Eigen::Matrix4f final_transformation_;
+  bool b_converged_;
+  double fitness_score_;
+  int num_iterations_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,48 @@
+/**
+ * @file   CudaGicpKernels.h
+ * @brief  Device side of the CUDA GICP backend (see CudaGicp.h)
+ */
+#pragma once
+
+#include <cstddef>
+
+namespace lamp_loop_closure {
+namespace cuda_gicp {
+
+// Per iteration sums: upper triangle of the 6x6 Gauss-Newton matrix (21),
+// gradient (6), Mahalanobis error, number of correspondences and sum of the
+// squared nearest neighbour distances over every source point
+const int kNumHessianSums = 21;
+const int kGradientOffset = 21;
+const int kErrorOffset = 27;
+const int kCountOffset = 28;
+const int kSqDistOffset = 29;
+const int kNumSums = 30;
+
+// Points are packed as x y z nx ny nz
+const int kPointStride = 6;
+
+struct DeviceClouds;
+
+bool HasDevice();
+
+// Copies both clouds to the device and computes the plane covariances from
+// the normals there. Returns nullptr on failure
+DeviceClouds* Upload(const float* source,
+                     size_t num_source,
+                     const float* target,
+                     size_t num_target,
+                     float gicp_epsilon);
+
+// Matches every source point transformed by the row major 3x4 transform to
+// its nearest target point and linearizes the GICP cost at the matches
+// closer than max_sq_dist
+bool Linearize(DeviceClouds* clouds,
+               const float transform[12],
+               float max_sq_dist,
+               double sums[kNumSums]);
+
+void Release(DeviceClouds* clouds);
+
+} // namespace cuda_gicp
+} // namespace lamp_loop_closure
@@ -12,8 +12,10 @@
 #include <ros/console.h>
 #include <ros/ros.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <lamp_utils/CommonStructs.h>
 
+#include "loop_closure/CandidateScorer.h"
 #include "loop_closure/LoopPrioritization.h"
 
 namespace lamp_loop_closure {
@@ -44,10 +46,18 @@ protected:
 
   void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
 
+  // Features of a keyed scan, false if the shared observability cache has
+  // not computed them yet
+  bool GetKeyFeatures(const gtsam::Key& key,
+                      CandidateScorer::KeyFeatures* features) const;
+
   void ProcessTimerCallback(const ros::TimerEvent& ev);
 
-  // Store keyed scans
-  std::unordered_map<gtsam::Key, double> keyed_observability_;
+  // Keys of the received scans
+  std::unordered_set<gtsam::Key> keyed_scan_keys_;
+
+  // Learned score, the sum of the observabilities if no model is loaded
+  CandidateScorer scorer_;
 
   // Define subscriber
   ros::Subscriber keyed_scans_sub_;
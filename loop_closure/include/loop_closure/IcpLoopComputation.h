@@ -5,19 +5,41 @@
  */
 #pragma once
 
+#include "CudaGicp.h"
 #include "ThreadPool.h"
+#include "Vgicp.h"
 #include "lamp_utils/PointCloudUtils.h"
 #include <geometry_utils/GeometryUtils.h>
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/inference/Symbol.h>
+#include <lamp_utils/KeyedScanStore.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/Metrics.h>
+#include <lamp_utils/PriorMap.h>
 #include <lamp_utils/gicp.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl_ros/point_cloud.h>
 #include <pose_graph_msgs/KeyedScan.h>
+#include <pose_graph_msgs/LoopComputationLease.h>
+#include <pose_graph_msgs/LoopComputationResult.h>
+#include <pose_graph_msgs/LoopComputationWorker.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
 #include <unordered_map>
 #include <lamp_utils/CommonStructs.h>
 
+#include "loop_closure/AlignmentCache.h"
+#include "loop_closure/CandidateLeases.h"
+#include "loop_closure/CandidateWaitList.h"
+#include "loop_closure/LoopClosureSet.h"
 #include "loop_closure/LoopComputation.h"
+#include "loop_closure/SubmapCache.h"
 
 namespace lamp_loop_closure {
 
@@ -25,6 +47,15 @@ class IcpLoopComputation : public LoopComputation {
   typedef pcl::PointCloud<pcl::Normal> Normals;
   typedef pcl::PointCloud<pcl::FPFHSignature33> Features;
   typedef pcl::search::KdTree<Point> KdTree;
+  typedef pcl::KdTreeFLANN<pcl::FPFHSignature33> FeatureTree;
+  // Float Mahalanobis matrices and plane covariances, enough for downsampled
+  // scans and a quarter of the covariance memory of the double matrices
+  typedef pcl::MultithreadedGeneralizedIterativeClosestPoint<
+      Point,
+      Point,
+      float,
+      PlaneCovariance<float>>
+      Gicp;
   friend class TestLoopComputation;
   friend class EvalIcpLoopCompute;
 
@@ -47,10 +78,43 @@ public:
 
   void KeyedPoseCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
 
-  void ProcessTimerCallback(const ros::TimerEvent& ev);
+  // Keeps the first pose given for a key, like KeyedPoseCallback
+  void AddKeyedPose(const gtsam::Key& key, const gtsam::Pose3& pose);
+  bool HasKeyedScan(const gtsam::Key& key) const {
+    return keyed_scans_.Has(key);
+  }
+  // Reads the scan and pose of a prior map node into the stores, when
+  // neither has key
+  void PageInPriorMapScan(const gtsam::Key& key);
+
+  // Grow the shared pool to the icp_thread_pool_thread_count workers
+  void ReserveComputationPool();
+  size_t NumComputationThreads() const {
+    return number_of_threads_in_icp_computation_pool_;
+  }
+
+  // Optimized poses, used to decide when a cached submap is out of date
+  void
+  OptimizedValuesCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
 
-  bool SetupICP(pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>& icp);
+  void ProcessTimerCallback(const ros::TimerEvent& ev);
 
+  // Distributed computation. A coordinator leases batches of candidates to
+  // the workers announcing themselves and merges their loop closures into
+  // its output, a worker aligns the candidates leased to it with its own
+  // keyed scans. A node can be both.
+  void WorkerCallback(
+      const pose_graph_msgs::LoopComputationWorker::ConstPtr& msg);
+  void LeaseResultCallback(
+      const pose_graph_msgs::LoopComputationResult::ConstPtr& msg);
+  void LeaseCallback(const pose_graph_msgs::LoopComputationLease::ConstPtr& msg);
+  void HeartbeatTimerCallback(const ros::TimerEvent& ev);
+
+  bool SetupICP(Gicp& icp);
+
+  // re_initialize_icp runs on a context of its own (pool jobs),
+  // b_candidate_guess starts from pose2.between(pose1) whatever the
+  // initialization method, e.g. for seeded loop closures with a prior
   bool PerformAlignment(const gtsam::Symbol& key1,
                         const gtsam::Symbol& key2,
                         const gtsam::Pose3& pose1,
@@ -58,44 +122,271 @@ public:
                         geometry_utils::Transform3* delta,
                         gtsam::Matrix66* covariance,
                         double* fitness_score,
-                        bool re_initialize_icp = false);
+                        bool re_initialize_icp = false,
+                        bool b_candidate_guess = false);
+
+  // Harris keypoints of a scan with their FPFH descriptors and the FLANN
+  // index over the descriptors, for the FEATURES and TEASERPP initializations
+  struct ScanFeatures {
+    PointCloud::Ptr keypoints;
+    Features::Ptr descriptors;
+    FeatureTree::Ptr tree; // null without keypoints
+  };
+  typedef std::shared_ptr<const ScanFeatures> ScanFeaturesConstPtr;
+
+  ScanFeaturesConstPtr ComputeScanFeatures(PointCloud::ConstPtr scan) const;
 
   void GetSacInitialAlignment(PointCloud::ConstPtr source,
                               PointCloud::ConstPtr target,
                               Eigen::Matrix4f* tf_out,
                               double& sac_fitness_score);
 
+  void GetSacInitialAlignment(const ScanFeatures& source,
+                              const ScanFeatures& target,
+                              Eigen::Matrix4f* tf_out,
+                              double& sac_fitness_score);
+
   void GetTeaserInitialAlignment(PointCloud::ConstPtr source,
                                  PointCloud::ConstPtr target,
                                  Eigen::Matrix4f* tf_out);
 
-  bool
-  ComputeICPCovariancePointPlane(const PointCloud::ConstPtr& query_cloud,
-                                 const PointCloud::ConstPtr& reference_cloud,
-                                 const std::vector<size_t>& correspondences,
-                                 const Eigen::Matrix4f& T,
-                                 Eigen::Matrix<double, 6, 6>* covariance);
+  void GetTeaserInitialAlignment(const ScanFeatures& source,
+                                 const ScanFeatures& target,
+                                 Eigen::Matrix4f* tf_out);
+
+  // Point to plane covariance over the matched pairs (query_indices[k],
+  // reference_indices[k]), with the normals of the reference points
+  bool ComputeICPCovariancePointPlane(const PointCloud& query_cloud,
+                                      const PointCloud& reference_cloud,
+                                      const std::vector<int>& query_indices,
+                                      const std::vector<int>& reference_indices,
+                                      const Eigen::Matrix4f& T,
+                                      Eigen::Matrix<double, 6, 6>* covariance);
 
   bool ComputeICPCovariancePointPoint(const PointCloud::ConstPtr& pointCloud,
                                       const Eigen::Matrix4f& T,
                                       const double& icp_fitness,
                                       Eigen::Matrix<double, 6, 6>& covariance);
 
-  void AccumulateScans(const gtsam::Key& key, PointCloud::Ptr scan_out);
+  // Transforms the scans of window into the frame of key and appends them
+  void AccumulateScans(const gtsam::Key& key,
+                       const SubmapWindow& window,
+                       PointCloud::Ptr scan_out);
+
+  // Neighbours of key accumulated into its submap, with their current poses
+  SubmapWindow GetSubmapWindow(const gtsam::Key& key);
+
+  // Optimized pose of key when available, the odometric one otherwise. The
+  // caller holds submap_poses_mutex_.
+  gtsam::Pose3 SubmapPose(const gtsam::Key& key) const;
+
+  // Scans of the pass of the robot through the area of anchor: the keys
+  // before and after it, up to area_max_scans_ each way, until one leaves
+  // area_radius_. The caller holds submap_poses_mutex_.
+  SubmapWindow WalkArea(const gtsam::Key& anchor) const;
+
+  // Area of anchor accumulated into its submap, with their current poses
+  SubmapWindow GetAreaWindow(const gtsam::Key& anchor);
+
+  // Anchor of the area submap key is aligned to, with the pose of key in its
+  // frame. An area covers the keys of its pass within half its radius of the
+  // anchor, a key in none starts a new area with itself as the anchor.
+  gtsam::Key GetAreaAnchor(const gtsam::Key& key, gtsam::Pose3* key_in_anchor);
 
   bool CheckReclosingDistance(gtsam::Key key_from, gtsam::Key key_to) const;
 
+  // PerformAlignment of a candidate, with its loop closure if accepted
+  bool AlignCandidate(const pose_graph_msgs::LoopCandidate& candidate,
+                      bool re_initialize_icp,
+                      pose_graph_msgs::PoseGraphEdge* loop_closure);
+
+  // Called with the index of a candidate and its result
+  typedef std::function<void(
+      size_t, const std::pair<bool, pose_graph_msgs::PoseGraphEdge>&)>
+      ResultCallback;
+  // Aligns the candidates on the pool, results in the order of the
+  // candidates. On the calling thread, on_result gets every result as it
+  // completes, and on_wait is called every stream_window_ (s) spent waiting
+  // for one.
+  std::vector<std::pair<bool, pose_graph_msgs::PoseGraphEdge>>
+  AlignBatch(const std::vector<pose_graph_msgs::LoopCandidate>& candidates,
+             const ResultCallback& on_result = nullptr,
+             const std::function<void()>& on_wait = nullptr);
+
+  // Coordinator: takes in the results received and requeues the candidates
+  // of the expired leases, and of the ones a worker had no scans for
+  void MergeLeaseResults();
+  // Coordinator: leases what the workers have room for, remote_candidates
+  // (keyed scans missing here) first. The candidates left in candidates are
+  // aligned here, the ones left in remote_candidates wait for their scans.
+  void DistributeCandidates(
+      std::vector<pose_graph_msgs::LoopCandidate>* candidates,
+      std::vector<pose_graph_msgs::LoopCandidate>* remote_candidates);
+  // Back in the input queue, never leased again
+  void RequeueCandidate(const pose_graph_msgs::LoopCandidate& candidate);
+  // Worker: aligns the leases received and publishes their results
+  void ComputeLeases();
+
+  // Scan of a key (accumulated with its neighbours if requested) with its
+  // GICP search tree and covariances, reused by every alignment with the key.
+  // An accumulated cloud is the one of submap_cache_, so the scan is rebuilt
+  // when the submap is.
+  struct PreparedScan {
+    PointCloudConstPtr cloud;
+    KdTree::Ptr tree;
+    Gicp::MatricesVectorPtr covariances;
+    // Of the points of cloud, for the alignment cache
+    uint64_t content_hash{0};
+    // Computed on first use by GetScanFeatures
+    mutable std::mutex features_mutex;
+    mutable ScanFeaturesConstPtr features;
+    // Built on first use as a VGICP target by GetScanVoxels
+    mutable std::mutex voxels_mutex;
+    mutable VoxelGaussianMapConstPtr voxels;
+  };
+  typedef std::shared_ptr<const PreparedScan> PreparedScanConstPtr;
+
+  // Scan alone, accumulated with its sac_ia neighbours or area submap
+  enum class PreparedScanKind { SCAN, SUBMAP, AREA };
+  inline PreparedScanKind SourceKind() const {
+    return b_accumulate_source_ ? PreparedScanKind::SUBMAP
+                                : PreparedScanKind::SCAN;
+  }
+
+  PreparedScanConstPtr
+  GetPreparedScan(const gtsam::Key& key, PreparedScanKind kind, Gicp& icp);
+
+  // Features of the prepared scan, computed once however many alignments
+  // (or threads) ask for them
+  ScanFeaturesConstPtr GetScanFeatures(const PreparedScan& scan) const;
+
+  // Voxel map of the prepared scan, shared by every candidate aligned to it
+  VoxelGaussianMapConstPtr GetScanVoxels(const PreparedScan& scan) const;
+
+  // Prepare the scans, and their features if the initialization uses them,
+  // of all the keys of a batch in parallel before aligning it
+  void PrefetchPreparedScans(
+      const std::vector<pose_graph_msgs::LoopCandidate>& candidates);
+
+  void InvalidatePreparedScans(const gtsam::Key& key);
+
+  // Bytes of the covariances of the prepared scans, their clouds are counted
+  // with the keyed scans and submaps
+  size_t PreparedScanBytes();
+  // Drops the least recently used prepared scans until at least bytes are
+  // freed or none is left, returns the bytes freed
+  size_t ShrinkPreparedScans(size_t bytes);
+
+  // Downsampled scan with a search tree, for the coarse check of a batch
+  struct CoarseScan {
+    PointCloud::Ptr cloud;
+    pcl::KdTreeFLANN<Point>::Ptr tree;
+  };
+
+  // Groups candidates of neighbouring keys, rejects the ones that fail a
+  // coarse overlap check and keeps the best one of every group
+  std::vector<pose_graph_msgs::LoopCandidate> SelectCandidatesForAlignment(
+      const std::vector<pose_graph_msgs::LoopCandidate>& candidates);
+
+  // One source aligned against one of several targets
+  struct OneToManyResult {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    bool b_computed{false}; // false if skipped after a confident match
+    bool b_success{false};  // false past the best k as well
+    geometry_utils::Transform3 delta;
+    gtsam::Matrix66 covariance = gtsam::Matrix66::Zero();
+    double fitness_score{0};
+  };
+  typedef std::vector<OneToManyResult, Eigen::aligned_allocator<OneToManyResult>>
+      OneToManyResults;
+
+  // Aligns the source shared by the candidates (same key_from) against each
+  // of their targets in parallel on the pool, the source scan prepared once.
+  // Only the best_k successful alignments by fitness stay successful, and the
+  // targets not started yet are skipped once one scores within
+  // confident_fitness. Results are in the order of the candidates.
+  OneToManyResults PerformOneToManyAlignment(
+      const std::vector<pose_graph_msgs::LoopCandidate>& candidates,
+      size_t best_k,
+      double confident_fitness);
+
+  // Runs the candidates sharing a source through PerformOneToManyAlignment
+  // into the output queue, returns the ones left (single per source)
+  std::vector<pose_graph_msgs::LoopCandidate> AlignSharedSources(
+      const std::vector<pose_graph_msgs::LoopCandidate>& candidates);
+
+  // Keyed poses of one robot with a keyed scan, in the frame of the robot
+  typedef std::vector<std::pair<gtsam::Key, gtsam::Pose3>> RobotKeyedPoses;
+
+  // Every robot_alignment/period, aligns in the background the maps of the
+  // robot pairs whose frames are not aligned yet
+  void UpdateRobotFramePriors();
+
+  // Up to robot_alignment/max_scans keyed scans of a robot in its frame,
+  // downsampled to robot_alignment/voxel_size
+  PointCloud::Ptr BuildRobotMap(const RobotKeyedPoses& poses);
+
+  // Global registration (TEASER++ on FPFH) of the map of robot_a onto the
+  // one of robot_b, kept as the frame prior of the pair if the maps overlap
+  bool AlignRobotMaps(char robot_a,
+                      const RobotKeyedPoses& poses_a,
+                      char robot_b,
+                      const RobotKeyedPoses& poses_b);
+
+  // Transform from the frame of robot_from into the one of robot_to
+  bool GetRobotFramePrior(char robot_from, char robot_to, gtsam::Pose3* prior);
+
+  const CoarseScan& GetCoarseScan(const gtsam::Key& key,
+                                  std::map<gtsam::Key, CoarseScan>& cache);
+
+  // Fraction of the downsampled source within batch_corr_dist_ of the
+  // downsampled target, with the candidate poses as alignment
+  double EstimateCoarseOverlap(const pose_graph_msgs::LoopCandidate& candidate,
+                               std::map<gtsam::Key, CoarseScan>& cache);
+
+  static size_t KeyDistance(size_t a, size_t b) { return a > b ? a - b : b - a; }
+
+  // Reason to give up on a GICP after an iteration, empty to go on.
+  // previous_sq_distance is the correspondence distance of the iteration
+  // before.
+  std::string EarlyAbortReason(const pcl::GicpIterationState& state,
+                               double previous_sq_distance) const;
+
+  // Wall time (s) spent in the stages of one PerformAlignment call
+  struct AlignmentTimings {
+    double accumulation{0}; // accumulated scans, search trees, covariances
+    double initialization{0}; // initial guess (features, TEASER++)
+    double gicp{0};
+    double covariance{0};
+    bool b_success{false};
+    // Registration iterations, and why they were cut short if they were
+    int gicp_iterations{0};
+    std::string abort_reason;
+  };
+
+  // Keep the timings of every alignment until taken, for benchmarking
+  void SetRecordTimings(bool b_record);
+  void RecordTimings(const AlignmentTimings& timings);
+  std::vector<AlignmentTimings> TakeRecordedTimings();
+
 protected:
   // Define subscriber
   ros::Subscriber keyed_scans_sub_;
   ros::Subscriber keyed_poses_sub_;
+  ros::Subscriber optimized_values_sub_;
 
   // Timer
   ros::Timer update_timer_;
+  lamp_utils::MetricsPublisher metrics_publisher_;
 
-  // Store keyed scans
-  std::unordered_map<gtsam::Key, PointCloudConstPtr> keyed_scans_;
+  // Store keyed scans (RAM bounded, cold scans spill to disk)
+  lamp_utils::KeyedScanStore keyed_scans_;
+  // Candidates waiting for the keyed scans of their keys
+  CandidateWaitList awaiting_scans_;
   std::unordered_map<gtsam::Key, gtsam::Pose3> keyed_poses_;
+  // Map of a former session (prior_map/file), its scans are paged into
+  // keyed_scans_ as candidates reach them
+  lamp_utils::PriorMap prior_map_;
 
   double max_tolerable_fitness_;
   double icp_tf_epsilon_;
@@ -119,6 +410,12 @@ protected:
   double rotation_max_iterations_;
   double noise_bound_;
   double TEASER_FPFH_features_radius_;
+  // Correspondence pruning and max clique budget
+  int teaser_correspondence_neighbours_;
+  double teaser_max_descriptor_ratio_;
+  int teaser_max_correspondences_;
+  double teaser_max_clique_time_limit_;
+  int teaser_max_clique_threads_;
 
   unsigned int dist_before_reclosing_;
   int teaser_count_ = 0;
@@ -132,6 +429,32 @@ protected:
 
   bool b_accumulate_source_;
 
+  // Batch verification parameters
+  bool b_batch_verification_;
+  unsigned int batch_group_key_radius_;
+  double batch_voxel_size_;
+  double batch_corr_dist_;
+  double batch_min_overlap_;
+
+  // One-to-many registration of candidates sharing a source (with a pool)
+  bool b_one_to_many_{false};
+  size_t one_to_many_best_k_{1};
+  double one_to_many_confident_fitness_{0};
+
+  // Map level alignment of the robot frames, the prior of inter robot
+  // candidates initialized with IDENTITY, ODOMETRY or ODOM_ROTATION
+  bool b_robot_alignment_{false};
+  double robot_alignment_period_{0};
+  size_t robot_alignment_min_keys_{1};
+  size_t robot_alignment_max_scans_{1};
+  double robot_alignment_voxel_size_{0};
+  double robot_alignment_corr_dist_{0};
+  double robot_alignment_min_overlap_{0};
+  double last_robot_alignment_{0};
+  std::atomic<bool> b_robot_alignment_running_{false};
+  std::mutex robot_frame_priors_mutex_;
+  std::map<std::pair<char, char>, gtsam::Pose3> robot_frame_priors_;
+
   enum class IcpInitMethod {
     IDENTITY,
     ODOMETRY,
@@ -147,15 +470,126 @@ protected:
 
   IcpCovarianceMethod icp_covariance_method_;
 
-  // ICP
-  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point> icp_;
+  // Where the GICP iterations run, or VGICP against voxel maps on the CPU
+  enum class IcpBackend { CPU, CUDA, VGICP };
 
+  IcpBackend icp_backend_;
 
-  ThreadPool icp_computation_pool_;
+  // ICP
+  Gicp icp_;
+
+  // GICP and output cloud of the jobs of the pool, set up once and handed
+  // from job to job instead of built for every alignment. There are at most
+  // as many as jobs running at once, i.e. about one per worker.
+  struct AlignmentContext {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Gicp icp;
+    PointCloud::Ptr icp_result;
+    size_t generation;
+  };
+  // Returned to the free list when the last copy goes, unless the contexts
+  // were cleared in the meantime
+  std::shared_ptr<AlignmentContext> AcquireAlignmentContext();
+  // Drops the free contexts, e.g. after the ICP parameters change
+  void ClearAlignmentContexts();
+  std::mutex alignment_contexts_mutex_;
+  std::vector<std::unique_ptr<AlignmentContext>> alignment_contexts_;
+  size_t alignment_contexts_generation_{0};
+  CudaGicpParams cuda_icp_params_;
+  VgicpParams vgicp_params_;
+
+  // Early abort of hopeless GICP alignments, judged from min_iterations on
+  bool b_early_abort_;
+  int early_abort_min_iterations_;
+  double early_abort_min_inlier_ratio_;
+  double early_abort_min_improvement_;
+
+
+  // Process wide pool, shared with the other loop closure modules
+  ThreadPool& icp_computation_pool_;
 
   size_t number_of_threads_in_icp_computation_pool_;
 
   std::set<gtsam::Key> closed_keyes_;
+  // Candidates already closed, skipped without the distance check
+  LoopClosureSet closed_loop_closures_;
+
+  // Prepared scans by (key, kind), most recently used first
+  typedef std::pair<gtsam::Key, PreparedScanKind> PreparedScanId;
+  struct PreparedScanEntry {
+    PreparedScanConstPtr scan;
+    std::list<PreparedScanId>::iterator lru_it;
+  };
+  std::mutex prepared_scans_mutex_;
+  std::map<PreparedScanId, PreparedScanEntry> prepared_scans_;
+  std::list<PreparedScanId> prepared_scans_lru_;
+  int prepared_scan_cache_size_;
+
+  // Accumulated source and target submaps
+  SubmapCache submap_cache_;
+  bool b_submap_optimized_poses_;
+  std::mutex submap_poses_mutex_;
+  std::unordered_map<gtsam::Key, gtsam::Pose3> submap_poses_;
+
+  // Scan to submap mode, targets are the area submaps of their anchors
+  bool b_area_submaps_{false};
+  double area_radius_;
+  int area_max_scans_;
+  SubmapCache area_submap_cache_;
+  std::mutex area_mutex_;
+  // First and last key of the pass of each anchor
+  std::map<gtsam::Key, std::pair<gtsam::Key, gtsam::Key>> area_anchors_;
+  // Sources aligned to the current submap of an anchor, (anchor, source)
+  std::set<std::pair<gtsam::Key, gtsam::Key>> area_attempts_;
+
+  // Outcomes of earlier runs, reused for the same scans and settings
+  AlignmentCache alignment_cache_;
+  uint64_t alignment_params_hash_{0};
+
+  // Distributed computation
+  bool b_coordinator_{false};
+  bool b_worker_{false};
+  CandidateLeases leases_;
+  // Candidates back from the workers, aligned here
+  LoopClosureSet returned_candidates_;
+  std::mutex lease_results_mutex_;
+  std::vector<pose_graph_msgs::LoopComputationResult::ConstPtr> lease_results_;
+  std::string worker_name_;
+  int worker_capacity_{0};
+  std::vector<uint8_t> worker_robot_prefixes_;
+  double heartbeat_period_{1.0};
+  std::mutex pending_leases_mutex_;
+  std::vector<pose_graph_msgs::LoopComputationLease::ConstPtr> pending_leases_;
+  ros::Publisher lease_pub_;
+  ros::Publisher lease_result_pub_;
+  ros::Publisher worker_pub_;
+  ros::Subscriber worker_sub_;
+  ros::Subscriber lease_result_sub_;
+  ros::Subscriber lease_sub_;
+  ros::Timer heartbeat_timer_;
+
+  std::atomic<bool> b_record_timings_{false};
+  std::mutex timings_mutex_;
+  std::vector<AlignmentTimings> recorded_timings_;
+
+  // Memory of the caches, declared last to unregister before the caches go.
+  // Under memory pressure the prepared scans go first, then the submaps.
+  lamp_utils::MemoryAccount keyed_scans_account_{
+      "loop_closure.keyed_scans",
+      [this]() { return keyed_scans_.GetStats().resident_bytes; }};
+  lamp_utils::MemoryAccount prepared_scans_account_{
+      "loop_closure.prepared_scans",
+      [this]() { return PreparedScanBytes(); },
+      [this](size_t bytes) { return ShrinkPreparedScans(bytes); }};
+  lamp_utils::MemoryAccount submaps_account_{
+      "loop_closure.submaps",
+      [this]() { return submap_cache_.Bytes() + area_submap_cache_.Bytes(); },
+      [this](size_t bytes) {
+        const size_t freed = submap_cache_.Shrink(bytes);
+        return freed < bytes
+            ? freed + area_submap_cache_.Shrink(bytes - freed)
+            : freed;
+      }};
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
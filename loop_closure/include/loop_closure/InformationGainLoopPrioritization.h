@@ -0,0 +1,82 @@
+/**
+ * @file   InformationGainLoopPrioritization.h
+ * @brief  Prioritize loop closures by expected information gain per ICP time
+ */
+#pragma once
+
+#include <unordered_set>
+#include <vector>
+
+#include <gtsam/inference/Symbol.h>
+#include <pose_graph_msgs/KeyedScan.h>
+#include <pose_graph_msgs/PoseGraph.h>
+#include <ros/console.h>
+#include <ros/ros.h>
+
+#include "loop_closure/InformationGainSelector.h"
+#include "loop_closure/LoopPrioritization.h"
+
+namespace lamp_loop_closure {
+
+// Candidates wait until the horizon, each tick the ones of the highest
+// expected gain per ICP second fitting the budget are published. The
+// marginals come from the marginal_covariance service of the optimizer,
+// requested again after every solve, the graph from the pose graph stream.
+class InformationGainLoopPrioritization : public LoopPrioritization {
+  friend class TestLoopPrioritization;
+
+public:
+  InformationGainLoopPrioritization();
+  ~InformationGainLoopPrioritization();
+
+  bool Initialize(const ros::NodeHandle& n) override;
+
+  bool LoadParameters(const ros::NodeHandle& n) override;
+
+  bool CreatePublishers(const ros::NodeHandle& n) override;
+
+  bool RegisterCallbacks(const ros::NodeHandle& n) override;
+
+protected:
+  void PopulatePriorityQueue() override;
+
+  void PublishBestCandidates() override;
+
+  pose_graph_msgs::LoopCandidateArray GetBestCandidates() override;
+
+  void ComputationStatusCallback(
+      const pose_graph_msgs::LoopComputationStatus::ConstPtr& status) override;
+
+  void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
+
+  void PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
+
+  void OptimizedValuesCallback(
+      const pose_graph_msgs::PoseGraph::ConstPtr& values_msg);
+
+  // Requests the marginals of the waiting candidates after a new solve
+  void UpdateMarginals();
+
+  void ProcessTimerCallback(const ros::TimerEvent& ev);
+
+  // Guarded by priority_queue_mutex_
+  InformationGainSelector selector_;
+  std::vector<pose_graph_msgs::LoopCandidate> pending_;
+  std::unordered_set<gtsam::Key> keyed_scan_keys_;
+  bool b_new_solve_{false};
+
+  ros::ServiceClient marginal_covariance_client_;
+
+  ros::Subscriber keyed_scans_sub_;
+  ros::Subscriber pose_graph_sub_;
+  ros::Subscriber optimized_values_sub_;
+
+  ros::Timer update_timer_;
+
+  // Parameters
+  InformationGainParams params_;
+  double publish_period_; // time between selections (s)
+  double horizon_;        // time until a candidate is discarded
+};
+
+} // namespace lamp_loop_closure
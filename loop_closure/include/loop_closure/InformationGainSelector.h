@@ -0,0 +1,110 @@
+/**
+ * @file   InformationGainSelector.h
+ * @brief  Loop candidates selected by expected information gain per ICP time
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/base/Matrix.h>
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/LoopCandidate.h>
+#include <pose_graph_msgs/LoopComputationStatus.h>
+
+namespace lamp_loop_closure {
+
+struct InformationGainParams {
+  // ICP time (s) spent per selection
+  double icp_budget{2.0};
+  // ICP time (s) of a candidate until loop computation reported some
+  double default_icp_time{0.2};
+  // Weight of the latest status in the running ICP time
+  double icp_time_smoothing{0.2};
+  // Shortest paths are searched up to this many edges, farther nodes count
+  // as max_hops + 1 away
+  int max_hops{100};
+  // Hops over which the marginals of two nodes decorrelate
+  double correlation_hops{20};
+  // Odometry uncertainty per hop, for nodes without a marginal
+  double odom_rotation_sigma{0.01};
+  double odom_position_sigma{0.05};
+  // Expected noise of a loop closure
+  double loop_rotation_sigma{0.01};
+  double loop_position_sigma{0.05};
+  // Candidates of a lower expected gain (nats) are not worth aligning
+  double min_gain{0.1};
+  // A candidate with both keys within this many hops of those of a selected
+  // one closes mostly the same loop, it waits for the next selection
+  int redundancy_hops{3};
+};
+
+// Expected information gain of a loop candidate, the mutual information
+// 0.5 log det(I + S_loop^-1 S_rel) between the loop measurement and the
+// relative pose of its nodes. S_rel is the sum of the marginals of the last
+// solve, scaled down for nodes close in the graph as their marginals are
+// correlated (recently connected nodes gain little), or the odometry
+// uncertainty accumulated along the shortest path without marginals.
+// Candidates are selected greedily by gain per expected ICP second under the
+// budget, skipping those closing about the same loop as one already taken.
+// The ICP time is learned from the loop computation statuses and scaled by
+// the size of the scans. Not thread safe.
+class InformationGainSelector {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  void SetParams(const InformationGainParams& params);
+  inline const InformationGainParams& Params() const { return params_; }
+
+  // Edge of the pose graph, of any type
+  void AddEdge(gtsam::Key from, gtsam::Key to);
+  // Marginal covariance (gtsam Pose3 order) of the last solve
+  void SetMarginal(gtsam::Key key, const gtsam::Matrix66& covariance);
+  void ClearMarginals();
+  inline bool HasMarginal(gtsam::Key key) const {
+    return marginals_.count(key) > 0;
+  }
+  void SetScanSize(gtsam::Key key, size_t num_points);
+  void UpdateIcpTime(const pose_graph_msgs::LoopComputationStatus& status);
+  inline double IcpTime() const { return icp_time_; }
+
+  // Edges on the shortest path from a to b, max_hops + 1 if farther
+  int GraphDistance(gtsam::Key a, gtsam::Key b) const;
+  double ExpectedGain(const pose_graph_msgs::LoopCandidate& candidate) const;
+  // Expected ICP time (s)
+  double ExpectedCost(const pose_graph_msgs::LoopCandidate& candidate) const;
+
+  // Moves the candidates of the highest total gain fitting the budget from
+  // candidates to selected, in order of gain per second, with their gain as
+  // value. Candidates below min_gain are dropped, the others left in
+  // candidates. Returns the expected ICP time of the selection.
+  double Select(std::vector<pose_graph_msgs::LoopCandidate>* candidates,
+                std::vector<pose_graph_msgs::LoopCandidate>* selected) const;
+
+private:
+  // Breadth first search up to limit edges, limit + 1 if farther
+  int Distance(gtsam::Key a, gtsam::Key b, int limit) const;
+  bool IsRedundant(const pose_graph_msgs::LoopCandidate& candidate,
+                   const pose_graph_msgs::LoopCandidate& selected) const;
+
+  InformationGainParams params_;
+  gtsam::Matrix66 odom_covariance_ = gtsam::Matrix66::Identity();
+  gtsam::Matrix66 loop_covariance_ = gtsam::Matrix66::Identity();
+  double loop_log_det_{0};
+
+  std::unordered_map<gtsam::Key, std::vector<gtsam::Key>> adjacency_;
+  std::unordered_map<
+      gtsam::Key,
+      gtsam::Matrix66,
+      std::hash<gtsam::Key>,
+      std::equal_to<gtsam::Key>,
+      Eigen::aligned_allocator<std::pair<const gtsam::Key, gtsam::Matrix66>>>
+      marginals_;
+  std::unordered_map<gtsam::Key, size_t> scan_sizes_;
+  double mean_scan_size_{0};
+  double icp_time_{0};
+};
+
+} // namespace lamp_loop_closure
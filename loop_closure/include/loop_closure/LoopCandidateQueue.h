@@ -8,13 +8,13 @@
 
 #include <deque>
 #include <map>
+#include <memory>
 #include <queue>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 #include <tuple>
 #include <string>
-#include <sstream>
 
 #include <pose_graph_msgs/LoopCandidate.h>
 #include <pose_graph_msgs/LoopCandidateArray.h>
@@ -22,6 +22,9 @@
 #include <ros/console.h>
 #include <ros/ros.h>
 
+#include "loop_closure/CandidateChannel.h"
+#include "loop_closure/LoopClosureSet.h"
+
 namespace lamp_loop_closure {
 
 class LoopCandidateQueue {
@@ -44,16 +47,22 @@ public:
 
   void LoopComputationStatusCallback(const pose_graph_msgs::LoopComputationStatus::ConstPtr& status);
 
+  void ChannelTimerCallback(const ros::TimerEvent& ev);
+
   virtual void OnNewLoopClosure();
 
   virtual void OnLoopComputationCompleted();
 
+  // Feedback of the computation, before OnLoopComputationCompleted
+  virtual void
+  OnLoopComputationStatus(const pose_graph_msgs::LoopComputationStatus& status) {}
+
 
 
   void PublishLoopCandidate(
       const pose_graph_msgs::LoopCandidateArray& candidates, bool check_sent=true);
 
-  std::string make_key(const pose_graph_msgs::LoopCandidate& loop_closure);
+  LoopClosureId make_key(const pose_graph_msgs::LoopCandidate& loop_closure);
   virtual bool LoopClosureHasBeenSent(const pose_graph_msgs::LoopCandidate& loop_closure);
 
   virtual void AddLoopClosureToSent(const pose_graph_msgs::LoopCandidate& loop_closure);
@@ -66,9 +75,15 @@ public:
   ros::Subscriber loop_closure_status_sub_;
   std::unordered_map<int, std::deque<pose_graph_msgs::LoopCandidate>> queues;
 
-  //Keys are: key_from, key_to, type
-  std::unordered_set<std::string> sent_loop_closures_;
+  //Keys are: key_from, key_to, type. Aged past queue/max_sent_loop_closures
+  LoopClosureSet sent_loop_closures_;
   std::string param_ns_;
+
+  // In-process input and output, when the stages share a nodelet manager
+  CandidateChannelParams channel_params_;
+  std::unique_ptr<CandidateChannelReader> input_channel_;
+  std::shared_ptr<CandidateChannel> loop_candidate_channel_;
+  ros::Timer channel_timer_;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -44,6 +44,9 @@ protected:
 
   void InputCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
 
+  // Stores the pose of every node received, new or not
+  virtual void AddKeyedPose(gtsam::Key key, const gtsam::Pose3& pose);
+
   void PublishLoopClosures(
       const std::vector<pose_graph_msgs::PoseGraphEdge> edges) const;
 
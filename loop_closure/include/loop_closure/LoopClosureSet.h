@@ -0,0 +1,83 @@
+/**
+ * @file   LoopClosureSet.h
+ * @brief  Compact identity of a loop closure (key_from, key_to, type) and a
+ *         set of them, for the already sent and already closed checks
+ */
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+#include <gtsam/inference/Key.h>
+#include <lamp_utils/FlatHashMap.h>
+
+namespace lamp_loop_closure {
+
+// The type (8 bits) goes in the bits of key_to between its symbol character
+// and its index, which leaves 48 bits to the indices
+struct LoopClosureId {
+  uint64_t key_from{0};
+  uint64_t key_to_type{0};
+
+  bool operator==(const LoopClosureId& other) const {
+    return key_from == other.key_from && key_to_type == other.key_to_type;
+  }
+};
+
+inline LoopClosureId
+MakeLoopClosureId(gtsam::Key key_from, gtsam::Key key_to, int type) {
+  LoopClosureId id;
+  id.key_from = key_from;
+  id.key_to_type = key_to ^ ((static_cast<uint64_t>(type) & 0xff) << 48);
+  return id;
+}
+
+struct LoopClosureIdHash {
+  size_t operator()(const LoopClosureId& id) const {
+    return static_cast<size_t>(id.key_from * 0x9E3779B97F4A7C15ull ^
+                               id.key_to_type);
+  }
+};
+
+// Set of loop closure ids in flat hash tables. With a capacity the ids are
+// aged in two generations: once the current one holds capacity / 2 ids it
+// replaces the previous one, so memory stays bounded and the ids inserted
+// last are always kept.
+class LoopClosureSet {
+public:
+  // 0 keeps every id
+  explicit LoopClosureSet(size_t capacity = 0) : capacity_(capacity) {}
+
+  void SetCapacity(size_t capacity) { capacity_ = capacity; }
+
+  inline bool Contains(const LoopClosureId& id) const {
+    return current_.Contains(id) || previous_.Contains(id);
+  }
+
+  // Returns false if the id was in the set
+  bool Insert(const LoopClosureId& id) {
+    if (Contains(id)) {
+      return false;
+    }
+    if (capacity_ > 0 && 2 * current_.size() >= capacity_) {
+      std::swap(current_, previous_);
+      current_.clear();
+    }
+    current_.Insert(id, true);
+    return true;
+  }
+
+  inline size_t size() const { return current_.size() + previous_.size(); }
+
+  void clear() {
+    current_.clear();
+    previous_.clear();
+  }
+
+private:
+  size_t capacity_;
+  lamp_utils::FlatHashMap<LoopClosureId, bool, LoopClosureIdHash> current_;
+  lamp_utils::FlatHashMap<LoopClosureId, bool, LoopClosureIdHash> previous_;
+};
+
+} // namespace lamp_loop_closure
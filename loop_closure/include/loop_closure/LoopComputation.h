@@ -6,6 +6,7 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <queue>
 #include <vector>
 
@@ -17,6 +18,8 @@
 #include <ros/console.h>
 #include <ros/ros.h>
 
+#include "loop_closure/CandidateChannel.h"
+
 namespace lamp_loop_closure {
 
 class LoopComputation {
@@ -37,12 +40,23 @@ public:
 
   void PublishLoopClosures();
 
-
+  // Publishes the loop closures computed so far during a batch, with a
+  // COMPLETED_SOME status, once the oldest of them waited stream_window_ (s)
+  void StreamLoopClosures();
 
   void InputCallback(
       const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates);
 
+  // Move what the in-process input channel holds to the input queue
+  void ReadInputChannel();
+
   void PublishCompletedAllStatus();
+  // Status of the alignments since the last one, of the given type
+  void PublishStatus(int type);
+
+  // Feedback for the candidate queue, reported with the next status
+  void RecordAlignment(const pose_graph_msgs::LoopCandidate& candidate,
+                       bool b_accepted);
 
   pose_graph_msgs::PoseGraphEdge
   CreateLoopClosureEdge(const gtsam::Symbol& key1,
@@ -59,12 +73,32 @@ protected:
 
   // Computed loop closures
   std::vector<pose_graph_msgs::PoseGraphEdge> output_queue_;
+  // Negative to publish the loop closures once the batch is done
+  double stream_window_ = -1;
+  // Wall time (s) the loop closures not streamed yet started waiting
+  double stream_pending_since_ = -1;
   // Loop closure queue as received from candidate generation
   std::queue<pose_graph_msgs::LoopCandidate> input_queue_;
   // Duration (sec) allowed to wait for keyed scans until removed
   double keyed_scans_max_delay_;
+  // Candidates dropped before full alignment, reported with the next status
+  int num_early_rejected_ = 0;
+  int num_deduplicated_ = 0;
+  // Aligned candidates since the last status, total and per robot pair
+  int num_computed_ = 0;
+  int num_accepted_ = 0;
+  double compute_time_ = 0;
+  int num_workers_ = 1;
+  // Candidates waiting when the last batch started, and when the last status
+  // was published (s), for the throughput
+  int queue_depth_ = 0;
+  double last_status_time_ = 0;
+  std::map<std::string, std::pair<int, int>> pair_alignments_;
 
   std::string param_ns_;
+
+  CandidateChannelParams channel_params_;
+  std::unique_ptr<CandidateChannelReader> input_channel_;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
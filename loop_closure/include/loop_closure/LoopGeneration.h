@@ -7,22 +7,27 @@
 
 #include <gtsam/geometry/Pose3.h>
 #include <map>
+#include <memory>
 #include <queue>
 #include <unordered_map>
 #include <vector>
 
 #include <pose_graph_msgs/LoopCandidate.h>
 #include <pose_graph_msgs/LoopCandidateArray.h>
+#include <pose_graph_msgs/LoopComputationStatus.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <ros/console.h>
 #include <ros/ros.h>
 
+#include "loop_closure/Backpressure.h"
+#include "loop_closure/CandidateChannel.h"
+
 namespace lamp_loop_closure {
 
 class LoopGeneration {
 public:
   LoopGeneration();
-  ~LoopGeneration();
+  virtual ~LoopGeneration();
 
   virtual bool Initialize(const ros::NodeHandle& n) = 0;
 
@@ -41,16 +46,24 @@ protected:
   // Define publishers and subscribers
   ros::Publisher loop_candidate_pub_;
   ros::Subscriber keyed_poses_sub_;
+  ros::Subscriber computation_status_sub_;
 
   virtual void
   KeyedPoseCallback(const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) = 0;
 
+  // Follow the load of loop computation, when back-pressure is enabled
+  void SubscribeComputationStatus(const ros::NodeHandle& n);
+
+  void ComputationStatusCallback(
+      const pose_graph_msgs::LoopComputationStatus::ConstPtr& status);
+
   inline void PublishLoops() const {
     if (candidates_.size() == 0)
       return;
     pose_graph_msgs::LoopCandidateArray candidates_msg;
     candidates_msg.candidates = candidates_;
-    loop_candidate_pub_.publish(candidates_msg);
+    PublishCandidates(
+        loop_candidate_pub_, loop_candidate_channel_.get(), candidates_msg);
   }
 
   inline void ClearLoops() {
@@ -60,6 +73,14 @@ protected:
   std::string param_ns_;
 
   bool b_check_for_loop_closures_;
+
+  // Generation keeps fewer candidates while computation is saturated
+  BackpressureParams backpressure_params_;
+  Backpressure backpressure_;
+
+  // In-process output, when the stages share a nodelet manager
+  CandidateChannelParams channel_params_;
+  std::shared_ptr<CandidateChannel> loop_candidate_channel_;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -8,15 +8,21 @@
 
 #include <deque>
 #include <map>
+#include <memory>
 #include <queue>
 #include <vector>
 #include <mutex>
 
 #include <pose_graph_msgs/LoopCandidate.h>
 #include <pose_graph_msgs/LoopCandidateArray.h>
+#include <pose_graph_msgs/LoopComputationStatus.h>
 #include <ros/console.h>
 #include <ros/ros.h>
 #include <ros/callback_queue.h>
+#include <lamp_utils/Metrics.h>
+
+#include "loop_closure/Backpressure.h"
+#include "loop_closure/CandidateChannel.h"
 
 namespace lamp_loop_closure {
 
@@ -46,7 +52,13 @@ protected:
   void InputCallback(
       const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates);
 
+  virtual void ComputationStatusCallback(
+      const pose_graph_msgs::LoopComputationStatus::ConstPtr& status);
 
+  // While loop computation is saturated, keep only the share of candidates
+  // of highest value it can take, returns how many were dropped
+  size_t ShedLowValueCandidates(
+      std::vector<pose_graph_msgs::LoopCandidate>* candidates);
 
   void ProcessPopulateCallback(const ros::TimerEvent& ev);
 
@@ -55,7 +67,9 @@ protected:
 
   // Define publishers and subscribers
   ros::Publisher loop_candidate_pub_;
+  lamp_utils::MetricsPublisher metrics_publisher_;
   ros::Subscriber loop_candidate_sub_;
+  ros::Subscriber computation_status_sub_;
 
   // Loop closure candidates priority queue (high to low)
   std::deque<pose_graph_msgs::LoopCandidate> priority_queue_;
@@ -66,6 +80,15 @@ protected:
 
   double keyed_scans_max_delay_;
 
+  BackpressureParams backpressure_params_;
+  Backpressure backpressure_;
+
+  // In-process input and output, when the stages share a nodelet manager.
+  // The input is read by the populate timer, before populating.
+  CandidateChannelParams channel_params_;
+  std::unique_ptr<CandidateChannelReader> input_channel_;
+  std::shared_ptr<CandidateChannel> loop_candidate_channel_;
+
 
   std::mutex priority_queue_mutex_;
 };
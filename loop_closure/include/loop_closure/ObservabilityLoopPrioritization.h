@@ -9,11 +9,14 @@
 #include <gtsam/inference/Symbol.h>
 #include <map>
 #include <mutex>
+#include <unordered_set>
 #include <pose_graph_msgs/KeyedScan.h>
 #include <ros/console.h>
 #include <ros/ros.h>
 #include <lamp_utils/CommonStructs.h>
 
+#include "loop_closure/CandidateHeap.h"
+#include "loop_closure/CandidateWaitList.h"
 #include "loop_closure/LoopPrioritization.h"
 
 namespace lamp_loop_closure {
@@ -46,13 +49,26 @@ protected:
 
   void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
 
+  // Normalized observability of a keyed scan, false if the shared cache has
+  // not computed it yet
+  bool GetObservability(const gtsam::Key& key, double* observability);
+
   void ProcessTimerCallback(const ros::TimerEvent& ev);
 
-  // Store keyed scans
+  // Keys of the received scans, and the normalized observability of those
+  // scored so far
+  std::unordered_set<gtsam::Key> keyed_scan_keys_;
   std::unordered_map<gtsam::Key, double> keyed_observability_;
 
-  // Store observability in deque along with candidate
-  std::deque<double> observability_score_;
+  // Candidates by observability score, expiring after the horizon. Guarded
+  // by priority_queue_mutex_
+  CandidateHeap candidate_heap_;
+
+  // Candidates waiting for the observability of their keys, released by the
+  // listener on the shared cache
+  CandidateWaitList awaiting_observability_;
+  size_t observability_listener_;
+  bool b_observability_listener_{false};
 
   // Track max observability for each robot (different so need to normalize)
   std::unordered_map<char, double> max_observability_;
@@ -69,7 +85,7 @@ protected:
                              // below threshold
   double horizon_;           // time until a candidate is discarded
 
-  int num_threads_; // number of threads for normal computation
+  int num_threads_; // threads of the shared observability cache
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -6,7 +6,9 @@
  */
 #pragma once
 
+#include "loop_closure/CandidateWaitList.h"
 #include "loop_closure/LoopCandidateQueue.h"
+#include "loop_closure/ThreadPool.h"
 #include "lamp_utils/PointCloudUtils.h"
 #include <deque>
 #include <gtsam/inference/Symbol.h>
@@ -46,12 +48,23 @@ class ObservabilityQueue : public LoopCandidateQueue  {
 
   double ComputeObservability(const pose_graph_msgs::LoopCandidate& candidate);
 
+  // Scores the new candidates and those whose observability arrived, the
+  // others wait for it
+  void ScoreCandidates();
+
   void FindNextSet();
   int key_;
   int amount_per_round_;
   double normals_radius_;     // radius used for cloud normal computation
   double min_observability_;
   int num_threads_;
+  double keyed_scans_max_delay_;
+
+  // Candidates waiting for the observability of their keys, released by the
+  // listener on the shared cache
+  CandidateWaitList awaiting_observability_;
+  size_t observability_listener_;
+  bool b_observability_listener_{false};
 
   ros::Subscriber keyed_scans_sub_;
 
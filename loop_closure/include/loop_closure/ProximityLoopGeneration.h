@@ -5,7 +5,12 @@
  */
 #pragma once
 
+#include <mutex>
+#include <unordered_map>
+
 #include <gtsam/inference/Symbol.h>
+#include <lamp_utils/KeyedSpatialIndex.h>
+#include <lamp_utils/PriorMap.h>
 
 #include "loop_closure/LoopGeneration.h"
 
@@ -32,14 +37,49 @@ protected:
   void KeyedPoseCallback(
       const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) override;
 
+  // Replace the poses with the optimized ones and keep their marginal
+  // position variance to bound the search radius
+  void OptimizedValuesCallback(
+      const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg);
+
   double DistanceBetweenKeys(const gtsam::Symbol& key1,
                              const gtsam::Symbol& key2) const;
 
+  // Radius from the marginals, false if they are unknown for either key
+  bool CovarianceRadius(const gtsam::Symbol& key,
+                        const gtsam::Symbol& other_key,
+                        double* radius) const;
+
+  // Spatial index over the translations of keyed_poses_
+  lamp_utils::KeyedSpatialIndex keyed_positions_index_;
+
   double proximity_threshold_max_;
   double proximity_threshold_min_;
   double increase_rate_;
   int n_closest_;
   size_t skip_recent_poses_;
+  // Candidates between keys of the same robot, and of different robots
+  bool b_intra_robot_{true};
+  bool b_inter_robot_{true};
+
+  // Map of a former session (prior_map/file), looked up around each new key.
+  // Its candidates skip prioritization, which never gets its scans, and go
+  // to loop computation on prior_map_candidates
+  lamp_utils::PriorMap prior_map_;
+  double prior_map_radius_{0.0};
+  std::vector<pose_graph_msgs::LoopCandidate> prior_map_candidates_;
+  ros::Publisher prior_map_candidate_pub_;
+
+  ros::Subscriber optimized_values_sub_;
+  // Pose and optimized values callbacks may run concurrently in a nodelet
+  std::mutex poses_mutex_;
+  bool b_use_optimized_values_;
+  double covariance_sigma_scale_;
+  double covariance_min_radius_;
+  // Trace of the marginal position covariance of the optimized keys
+  std::unordered_map<gtsam::Key, double> position_variances_;
+  // Last optimized key per robot prefix, the newer keys extend it by odometry
+  std::unordered_map<unsigned char, gtsam::Symbol> last_optimized_keys_;
 };
 
 } // namespace lamp_loop_closure
\ No newline at end of file
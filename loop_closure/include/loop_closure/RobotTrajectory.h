@@ -0,0 +1,54 @@
+/**
+ * @file   RobotTrajectory.h
+ * @brief  Poses of one robot sorted by time, indexed by key and by position
+ */
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include <geometry_msgs/Pose.h>
+#include <gtsam/inference/Key.h>
+#include <pose_graph_msgs/PoseGraphNode.h>
+
+#include <lamp_utils/KeyedSpatialIndex.h>
+
+namespace lamp_loop_closure {
+
+// Compact trajectory: stamps, keys and poses in parallel arrays sorted by
+// stamp, so time lookups are binary searches, key lookups are hashed and
+// proximity queries go through a voxel hash.
+class RobotTrajectory {
+public:
+  explicit RobotTrajectory(double cell_size = 10.0);
+
+  // Adds the node, or updates the pose of its key if it is already there
+  void Insert(const pose_graph_msgs::PoseGraphNode& node);
+  void Clear();
+
+  inline size_t size() const { return stamps_.size(); }
+  inline bool empty() const { return stamps_.empty(); }
+
+  inline double Stamp(size_t i) const { return stamps_[i]; }
+  inline gtsam::Key Key(size_t i) const { return keys_[i]; }
+  inline const geometry_msgs::Pose& Pose(size_t i) const { return poses_[i]; }
+  // Node message with the stamp, key and pose of entry i
+  pose_graph_msgs::PoseGraphNode Node(size_t i) const;
+
+  // First entry with a stamp not before stamp, size() if none
+  size_t LowerBound(double stamp) const;
+  // False if the key is not in the trajectory
+  bool Find(const gtsam::Key& key, size_t* index) const;
+  // Keys of the entries within radius of position
+  std::vector<gtsam::Key> KeysWithin(const geometry_msgs::Point& position,
+                                     double radius) const;
+
+private:
+  std::vector<double> stamps_;
+  std::vector<gtsam::Key> keys_;
+  std::vector<geometry_msgs::Pose> poses_;
+  std::unordered_map<gtsam::Key, size_t> index_;
+  lamp_utils::KeyedSpatialIndex spatial_index_;
+};
+
+} // namespace lamp_loop_closure
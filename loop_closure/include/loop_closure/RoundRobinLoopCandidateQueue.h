@@ -9,6 +9,8 @@
 #include <deque>
 #include <map>
 #include <queue>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "loop_closure/LoopCandidateQueue.h"
@@ -35,9 +37,42 @@ class RoundRobinLoopCandidateQueue : public LoopCandidateQueue  {
 
   virtual void OnLoopComputationCompleted();
 
+  virtual void
+  OnLoopComputationStatus(const pose_graph_msgs::LoopComputationStatus& status);
+
   void FindNextSet();
+
+  // Deficit round robin over originator and robot pair, releasing as many
+  // candidates as the computation can align in target_round_time_ and
+  // favouring the robot pairs that produce loop closures
+  void FindAdaptiveSet();
+  int AdaptiveBatchSize() const;
+  double PairWeight(const std::string& robot_pair) const;
+
   int key_;
   int amount_per_round_;
+
+  // Adaptive scheduling
+  struct PairStats {
+    // Decayed counts of aligned and accepted candidates
+    double computed{0};
+    double accepted{0};
+  };
+  struct Bucket {
+    std::deque<pose_graph_msgs::LoopCandidate> candidates;
+    double deficit{0};
+  };
+  bool b_adaptive_;
+  int min_per_round_;
+  double target_round_time_;  // (s) wall time of a released batch
+  double latency_smoothing_;  // weight of the newest latency measurement
+  double min_pair_share_;     // weight of the pairs that never close
+  double success_decay_;      // per batch with alignments
+  double candidate_latency_{-1}; // (s) per candidate and worker
+  bool b_batch_decayed_{false};
+  int num_workers_{1};
+  std::map<std::string, PairStats> pair_stats_;
+  std::map<std::pair<int, std::string>, Bucket> buckets_;
 };
 
 }  // namespace lamp_loop_closure
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include "loop_closure/LoopGeneration.h"
+#include "loop_closure/RobotTrajectory.h"
 #include "loop_closure/colors.h"
 #include <pose_graph_msgs/CommNodeInfo.h>
 #include <pose_graph_msgs/CommNodeStatus.h>
@@ -8,6 +9,7 @@
 #include <parameter_utils/ParameterUtils.h>
 
 #include <silvus_msgs/SilvusStreamscape.h>
+#include <set>
 #include <std_msgs/Float64.h>
 #include <string>
 #include <lamp_utils/CommonFunctions.h>
@@ -95,8 +97,11 @@ private:
                              //  std::map<std::string, ros::Time>
   std::map<gtsam::Key, gtsam::Pose3> keyed_poses_;
   std::map<gtsam::Key, float> lowest_distance_;
-  std::map<unsigned char, std::map<double, pose_graph_msgs::PoseGraphNode>>
-      robots_trajectory_;
+  std::map<unsigned char, RobotTrajectory> robots_trajectory_;
+  // scom-{robot} radios with new raw info since the last Update
+  std::set<std::string> pending_robot_radios_;
+  // dropped scom-{number} radios whose flybys grew since the last loops
+  std::set<std::string> changed_dropped_radios_;
 
   // const
   const int ANTENAS_NUMBER_IN_ROBOT{2};
@@ -134,12 +139,12 @@ private:
   void RadioToNodesLoopClosure();
   void NodesToNodesLoopClosures();
   pose_graph_msgs::PoseGraphNode GetClosestPoseAtTime(
-      const std::map<double, pose_graph_msgs::PoseGraphNode>& robot_trajectory,
+      const RobotTrajectory& robot_trajectory,
       const ros::Time& stamp,
       double time_threshold = 2.0,
       bool check_threshold = false) const;
   pose_graph_msgs::PoseGraphNode GetPoseGraphNodeFromKey(
-      const std::map<double, pose_graph_msgs::PoseGraphNode>& robot_trajectory,
+      const RobotTrajectory& robot_trajectory,
       const gtsam::Symbol& key) const;
   bool is_robot_radio(const std::string& hostname) const;
 
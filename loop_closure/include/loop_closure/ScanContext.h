@@ -0,0 +1,115 @@
+/**
+ * @file   ScanContext.h
+ * @brief  Scan Context global descriptor of keyed scans, and a nearest
+ * neighbour index over them
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_loop_closure {
+
+struct ScanContextParams {
+  int num_rings{20};
+  int num_sectors{60};
+  double max_radius{80.0};
+  // Added to z so the cells of the ground are not empty
+  double lidar_height{2.0};
+};
+
+// Polar grid of the scan around the sensor (G. Kim, A. Kim, IROS 2018),
+// each cell holding the maximum height of its points. Stored sector major,
+// so every sector is a contiguous column of num_rings values, with the
+// rotation invariant ring key (occupancy per ring) and the sector key
+// (mean height per sector) used to prefilter and to align.
+class ScanContext {
+public:
+  ScanContext() = default;
+  ScanContext(const PointCloud& scan, const ScanContextParams& params);
+
+  inline bool Empty() const { return descriptor_.empty(); }
+  inline int NumRings() const { return num_rings_; }
+  inline int NumSectors() const { return num_sectors_; }
+  inline const std::vector<float>& RingKey() const { return ring_key_; }
+  inline const std::vector<float>& SectorKey() const { return sector_key_; }
+
+  // Column shifted cosine distance in [0, 1]. shift is the sector offset of
+  // other that matches this descriptor best, searched within search_radius
+  // of the sector key alignment.
+  double Distance(const ScanContext& other,
+                  int search_radius,
+                  int* shift) const;
+
+  // Yaw of the frame of this scan in the frame of other for a sector shift
+  double YawOfShift(int shift) const;
+
+private:
+  double ShiftedDistance(const ScanContext& other, int shift) const;
+  int AlignSectorKeys(const ScanContext& other) const;
+
+  int num_rings_{0};
+  int num_sectors_{0};
+  std::vector<float> descriptor_;
+  std::vector<float> column_norms_;
+  std::vector<float> ring_key_;
+  std::vector<float> sector_key_;
+};
+
+// Ring keys of the inserted descriptors in a kd-tree, rebuilt in batches.
+// The descriptors inserted since the last rebuild are searched linearly.
+// Query visits at most max_leaf_checks leaves of the tree, nearest first,
+// so it stays approximate and bounded as the index grows.
+class ScanContextIndex {
+public:
+  typedef std::function<bool(const gtsam::Key&)> KeyFilter;
+
+  void SetParams(size_t max_leaf_checks, size_t rebuild_size);
+
+  void Insert(const gtsam::Key& key, const ScanContext& descriptor);
+
+  // Up to k keys accepted by filter, nearest ring key first, with their
+  // squared ring key distance
+  std::vector<std::pair<gtsam::Key, float>>
+  Query(const ScanContext& descriptor, size_t k, const KeyFilter& filter) const;
+
+  const ScanContext* Get(const gtsam::Key& key) const;
+  inline size_t Size() const { return entries_.size(); }
+  void Clear();
+
+private:
+  struct Entry {
+    gtsam::Key key;
+    ScanContext descriptor;
+  };
+  struct Node {
+    // Leaves have dimension -1 and the range [begin, end) of tree_order_
+    int dimension{-1};
+    float split{0};
+    size_t begin{0};
+    size_t end{0};
+    size_t left{0};
+    size_t right{0};
+  };
+
+  void Rebuild();
+  size_t BuildNode(size_t begin, size_t end);
+  float RingDistance(const std::vector<float>& ring_key, size_t entry) const;
+
+  size_t max_leaf_checks_{64};
+  size_t rebuild_size_{1000};
+  std::vector<Entry> entries_;
+  std::unordered_map<gtsam::Key, size_t> key_index_;
+  std::vector<size_t> tree_order_;
+  std::vector<Node> nodes_;
+  // Entries [num_in_tree_, size) are not in the tree yet
+  size_t num_in_tree_{0};
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,64 @@
+/**
+ * @file   ScanContextLoopGeneration.h
+ * @brief  Find potential loop closures by place recognition on the keyed
+ * scans (Scan Context)
+ */
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+
+#include <gtsam/inference/Symbol.h>
+#include <pose_graph_msgs/KeyedScan.h>
+
+#include "loop_closure/LoopGeneration.h"
+#include "loop_closure/ScanContext.h"
+
+namespace lamp_loop_closure {
+
+// Unlike the proximity search, candidates do not depend on the odometric
+// drift: every new keyed scan is matched against the descriptors of all the
+// previous scans. The odometric poses are only used as the frames of the
+// candidate, with the descriptor yaw between them so that the CANDIDATE ICP
+// initialization starts from the recognized rotation.
+class ScanContextLoopGeneration : public LoopGeneration {
+  friend class TestLoopGeneration;
+
+public:
+  ScanContextLoopGeneration();
+  ~ScanContextLoopGeneration();
+
+  bool Initialize(const ros::NodeHandle& n) override;
+
+  bool LoadParameters(const ros::NodeHandle& n) override;
+
+  bool CreatePublishers(const ros::NodeHandle& n) override;
+
+  bool RegisterCallbacks(const ros::NodeHandle& n) override;
+
+protected:
+  void GenerateLoops(const gtsam::Key& new_key, const ScanContext& descriptor);
+
+  void KeyedPoseCallback(
+      const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) override;
+
+  void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg);
+
+  void PublishIfReady();
+
+  ros::Subscriber keyed_scans_sub_;
+  // The scan and pose callbacks may run concurrently in a nodelet
+  std::mutex mutex_;
+
+  ScanContextParams descriptor_params_;
+  ScanContextIndex descriptor_index_;
+  // Descriptors of scans that arrived before their pose
+  std::unordered_map<gtsam::Key, ScanContext> pending_descriptors_;
+
+  size_t num_candidates_;
+  double distance_threshold_;
+  int search_radius_;
+  size_t skip_recent_poses_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,74 @@
+/**
+ * @file   SubmapCache.h
+ * @brief  Accumulated neighbourhood submaps of the keyed scans, reused while
+ * the poses they were built from do not move
+ */
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Key.h>
+#include <lamp_utils/PointCloudTypes.h>
+
+namespace lamp_loop_closure {
+
+// Neighbour keys accumulated into the submap of a key, with their poses in
+// the frame of that key
+typedef std::vector<std::pair<gtsam::Key, gtsam::Pose3>> SubmapWindow;
+
+// Submaps by center key, most recently used first. A cached submap is
+// returned as long as it was built from the same neighbours, each within
+// the translation and rotation thresholds of its current relative pose, so a
+// correction that moves the whole window rigidly keeps it valid.
+class SubmapCache {
+public:
+  void SetParams(size_t capacity,
+                 double voxel_size,
+                 double translation_threshold,
+                 double rotation_threshold);
+
+  // True if a submap built from window is still valid for current
+  bool Matches(const SubmapWindow& window, const SubmapWindow& current) const;
+
+  // Cached submap of key, nullptr if missing or built from another window
+  PointCloudConstPtr Find(const gtsam::Key& key, const SubmapWindow& current);
+
+  // Downsamples the accumulated submap (in place) and caches it
+  PointCloudConstPtr Insert(const gtsam::Key& key,
+                            const SubmapWindow& window,
+                            const PointCloud::Ptr& submap);
+
+  void Invalidate(const gtsam::Key& key);
+  void Clear();
+  size_t Size() const;
+
+  // Bytes of the points of the cached submaps
+  size_t Bytes() const;
+  // Drops the least recently used submaps until at least bytes of points are
+  // dropped or the cache is empty, returns the bytes dropped. Prepared scans
+  // still holding a submap keep it alive.
+  size_t Shrink(size_t bytes);
+
+private:
+  struct Entry {
+    SubmapWindow window;
+    PointCloudConstPtr submap;
+    std::list<gtsam::Key>::iterator lru_it;
+  };
+
+  size_t capacity_{200};
+  double voxel_size_{0.0};
+  double translation_threshold_{0.05};
+  double rotation_threshold_{0.01};
+
+  mutable std::mutex mutex_;
+  std::unordered_map<gtsam::Key, Entry> entries_;
+  std::list<gtsam::Key> lru_;
+};
+
+} // namespace lamp_loop_closure
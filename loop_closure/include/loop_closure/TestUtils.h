@@ -9,6 +9,7 @@ Some utility functions for offline testing
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <pose_graph_msgs/KeyedScan.h>
 #include <pose_graph_msgs/LoopCandidate.h>
@@ -97,6 +98,64 @@ bool AppendNewCandidates(
     const std::string& label,
     TestData* data);
 
+// Procedural multi-robot workload for the scaling benchmarks. The robots
+// wander planar random walks through a world of pillars standing on flat
+// ground, their scans sample that world from the ground truth pose, and
+// their odometry drifts away from it.
+struct SyntheticWorkloadParams {
+  // One robot per prefix
+  std::string robot_prefixes{"abc"};
+  size_t keys_per_robot{1000};
+  // Distance (m) travelled between keys, and heading change (rad) per key
+  double key_spacing{2.0};
+  double max_turn{0.3};
+  // Side (m) of the square the robots stay in, they all start near its center
+  double world_size{200.0};
+  // Pillars are placed on a grid of this spacing (m), a cell holds one with
+  // probability pillar_density
+  double pillar_spacing{6.0};
+  double pillar_density{0.5};
+  double sensor_height{1.0};
+  // Odometry noise per key (m, rad)
+  double odom_translation_noise{0.01};
+  double odom_rotation_noise{0.002};
+  // 0 skips the keyed scans
+  size_t points_per_scan{2000};
+  double scan_range{20.0};
+  double scan_noise{0.02};
+  // Real candidates: ground truth distance (m) below which two keys overlap,
+  // at most max_candidates_per_key per key, keys of a robot closer than
+  // min_key_separation in index are not candidates
+  double loop_radius{8.0};
+  size_t max_candidates_per_key{5};
+  size_t min_key_separation{50};
+  unsigned int seed{0};
+  // Generation threads, 0 for the number of cores
+  size_t num_threads{0};
+};
+
+struct SyntheticWorkload {
+  // Keys in arrival order, the robots take turns
+  std::vector<gtsam::Key> keys;
+  std::vector<gtsam::Pose3> gt_keyed_poses;
+  std::vector<gtsam::Pose3> odom_keyed_poses;
+  // Empty if scans were skipped, otherwise one per key
+  std::vector<pose_graph_msgs::KeyedScan> keyed_scans;
+  // Pairs overlapping in ground truth, with their odometry poses
+  pose_graph_msgs::LoopCandidateArray candidates;
+};
+
+// Trajectories, candidates and (unless skipped) scans, in parallel
+void GenerateSyntheticWorkload(const SyntheticWorkloadParams& params,
+                               SyntheticWorkload* workload);
+
+// Scans of the keys at indices of workload, in parallel. Deterministic, a
+// key always gets the same scan.
+void GenerateSyntheticScans(const SyntheticWorkloadParams& params,
+                            const SyntheticWorkload& workload,
+                            const std::vector<size_t>& indices,
+                            std::vector<pose_graph_msgs::KeyedScan>* scans);
+
 void OutputTestSummary(
     const TestData& data,
     const std::vector<pose_graph_msgs::PoseGraphEdge>& results,
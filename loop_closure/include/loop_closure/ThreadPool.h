@@ -1,84 +1,241 @@
 //
-// Taken from : https://github.com/progschj/ThreadPool
+// Work stealing thread pool. Interface follows
+// https://github.com/progschj/ThreadPool (enqueue returns a std::future).
+//
+// Every worker owns a deque per priority level. Tasks submitted from outside
+// the pool are spread round robin over the workers, tasks submitted from a
+// worker go to its own deque. A worker runs its own newest task first and
+// steals the oldest task of another worker when it runs dry, so a batch of
+// jobs with very different costs does not wait on a single queue lock or on
+// one overloaded worker.
+//
+// Workers of a pool with a thread group join it in the ThreadGovernor, which
+// places them and caps the size the pool grows to.
 
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
-#include <vector>
-#include <queue>
-#include <memory>
-#include <thread>
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <future>
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lamp_utils/ThreadGovernor.h"
 
 class ThreadPool {
 public:
-    ThreadPool(size_t);
+    enum class Priority { HIGH = 0, NORMAL = 1, LOW = 2 };
+
+    ThreadPool(size_t, const std::string& thread_group = "");
+    ~ThreadPool();
+
+    // Pool shared by the loop closure modules of a process, so that they do
+    // not oversubscribe the cores together. Starts empty, see reserve().
+    // Thread group loop_closure_pool
+    static ThreadPool& Shared();
+
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>;
-    ~ThreadPool();
 
+    template<class F, class... Args>
+    auto enqueue_priority(Priority priority, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    // Block until every task enqueued so far has run
+    // (must not be called from a task)
+    void wait_all();
+
+    // Restarts the workers only if the number of threads changes
     void resize(size_t threads);
+    // Grow the pool to at least the given size (capped to the core count)
+    void reserve(size_t threads);
+    size_t size() const;
+
     void end_pool();
 private:
+    typedef std::function<void()> Task;
+    static const size_t kNumPriorities = 3;
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks[kNumPriorities];
+    };
+
+    void push(Task task, Priority priority);
+    bool pop(size_t index, Task& task);
+    void worker_loop(size_t index);
+    void task_done();
+
+    // Index of the calling worker in the pool it belongs to
+    static ThreadPool*& current_pool();
+    static size_t& current_index();
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
+    std::vector< std::unique_ptr<WorkerQueue> > queues;
+    std::atomic<size_t> next_queue;
 
     // synchronization
-    std::mutex queue_mutex;
-    std::condition_variable condition;
+    mutable std::mutex pool_mutex;
+    std::condition_variable wake;
+    std::atomic<size_t> pending;
+    std::condition_variable done;
+    size_t outstanding;
     bool stop;
+
+    const std::string thread_group;
 };
-void ThreadPool::end_pool() {
+
+inline ThreadPool*& ThreadPool::current_pool() {
+    static thread_local ThreadPool* pool = nullptr;
+    return pool;
+}
+
+inline size_t& ThreadPool::current_index() {
+    static thread_local size_t index = 0;
+    return index;
+}
+
+inline ThreadPool& ThreadPool::Shared() {
+    static ThreadPool pool(0, "loop_closure_pool");
+    return pool;
+}
+
+inline void ThreadPool::end_pool() {
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(pool_mutex);
         stop = true;
     }
-    condition.notify_all();
+    wake.notify_all();
     for(std::thread &worker: workers)
         worker.join();
     workers.clear();
 }
 
-void ThreadPool::resize(size_t threads) {
+inline size_t ThreadPool::size() const {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    return queues.size();
+}
+
+inline void ThreadPool::resize(size_t threads) {
+    if (threads == size() && !workers.empty())
+        return;
+    // Workers drain every queue before they exit
     end_pool();
+    queues.clear();
+    for(size_t i = 0;i<threads;++i)
+        queues.emplace_back(new WorkerQueue);
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(pool_mutex);
         stop = false;
     }
     for(size_t i = 0;i<threads;++i)
-        workers.emplace_back(
-                [this]
-                {
-                    for(;;)
-                    {
-                        std::function<void()> task;
-
-                        {
-                            std::unique_lock<std::mutex> lock(this->queue_mutex);
-                            this->condition.wait(lock,
-                                                 [this]{ return this->stop || !this->tasks.empty(); });
-                            if(this->stop && this->tasks.empty())
-                                return;
-                            task = std::move(this->tasks.front());
-                            this->tasks.pop();
-                        }
-
-                        task();
-                    }
-                }
-        );
-}
-
-// the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
-        :   stop(false)
+        workers.emplace_back([this, i] { worker_loop(i); });
+}
+
+inline void ThreadPool::reserve(size_t threads) {
+    size_t cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    threads = std::min(threads, cores);
+    if (!thread_group.empty())
+        threads = lamp_utils::ThreadGovernor::Instance().Threads(
+                thread_group, std::max(threads, size()));
+    if (threads > size())
+        resize(threads);
+}
+
+inline void ThreadPool::push(Task task, Priority priority) {
+    size_t index;
+    if (current_pool() == this)
+        index = current_index();
+    else
+        index = next_queue++ % queues.size();
+    {
+        std::unique_lock<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks[static_cast<size_t>(priority)].push_back(
+                std::move(task));
+    }
+    {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        pending++;
+    }
+    wake.notify_one();
+}
+
+inline bool ThreadPool::pop(size_t index, Task& task) {
+    for (size_t p = 0; p < kNumPriorities; ++p) {
+        // Own queue first, newest task
+        {
+            WorkerQueue& own = *queues[index];
+            std::unique_lock<std::mutex> lock(own.mutex);
+            if (!own.tasks[p].empty()) {
+                task = std::move(own.tasks[p].back());
+                own.tasks[p].pop_back();
+                pending--;
+                return true;
+            }
+        }
+        // Steal the oldest task of another worker
+        for (size_t k = 1; k < queues.size(); ++k) {
+            WorkerQueue& other = *queues[(index + k) % queues.size()];
+            std::unique_lock<std::mutex> lock(other.mutex, std::try_to_lock);
+            if (!lock.owns_lock() || other.tasks[p].empty())
+                continue;
+            task = std::move(other.tasks[p].front());
+            other.tasks[p].pop_front();
+            pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::worker_loop(size_t index) {
+    current_pool() = this;
+    current_index() = index;
+    if (!thread_group.empty())
+        lamp_utils::ThreadGovernor::Instance().RegisterThread(thread_group);
+    for(;;)
+    {
+        Task task;
+        if (pop(index, task)) {
+            task();
+            task_done();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        if (stop && pending == 0)
+            return;
+        // Timeout guards against a steal skipped on a busy queue lock
+        wake.wait_for(lock, std::chrono::milliseconds(10),
+                      [this]{ return stop || pending > 0; });
+    }
+}
+
+inline void ThreadPool::task_done() {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    if (--outstanding == 0)
+        done.notify_all();
+}
+
+inline void ThreadPool::wait_all() {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    done.wait(lock, [this]{ return outstanding == 0; });
+}
+
+inline ThreadPool::ThreadPool(size_t threads, const std::string& thread_group)
+        :   next_queue(0), pending(0), outstanding(0), stop(false),
+            thread_group(thread_group)
 {
     resize(threads);
 }
@@ -87,6 +244,15 @@ inline ThreadPool::ThreadPool(size_t threads)
 template<class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
 -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    return enqueue_priority(Priority::NORMAL,
+                            std::forward<F>(f),
+                            std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+auto ThreadPool::enqueue_priority(Priority priority, F&& f, Args&&... args)
+-> std::future<typename std::result_of<F(Args...)>::type>
 {
     using return_type = typename std::result_of<F(Args...)>::type;
 
@@ -95,16 +261,22 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
     );
 
     std::future<return_type> res = task->get_future();
+
+    // Without workers run the task on the calling thread
+    if (size() == 0) {
+        (*task)();
+        return res;
+    }
+
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(pool_mutex);
 
         // don't allow enqueueing after stopping the pool
         if(stop)
             throw std::runtime_error("enqueue on stopped ThreadPool");
-
-        tasks.emplace([task](){ (*task)(); });
+        outstanding++;
     }
-    condition.notify_one();
+    push([task](){ (*task)(); }, priority);
     return res;
 }
 
@@ -114,4 +286,4 @@ inline ThreadPool::~ThreadPool()
    end_pool();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,107 @@
+/**
+ * @file   Vgicp.h
+ * @brief  Voxelized GICP, the target scan as per voxel Gaussians looked up by
+ *         hashing instead of a KD-tree search per point and iteration
+ */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+#include <lamp_utils/FlatHashMap.h>
+#include <lamp_utils/PointCloudTypes.h>
+#include <lamp_utils/gicp_utils.h>
+
+namespace lamp_loop_closure {
+
+typedef std::vector<PlaneCovariance<float>,
+                    Eigen::aligned_allocator<PlaneCovariance<float>>>
+    PlaneCovariances;
+
+struct VgicpParams {
+  double voxel_resolution = 1.0;
+  int max_iterations = 20;
+  double transformation_epsilon = 1e-10;
+  double rotation_epsilon = 2e-3;
+};
+
+// Points of a cloud binned in voxels, each voxel keeps the mean of its points
+// and the mean of their covariances. Built once per target scan and shared
+// by every alignment against it.
+class VoxelGaussianMap {
+public:
+  struct Voxel {
+    Eigen::Vector3d mean;
+    Eigen::Matrix3d covariance;
+    int num_points;
+  };
+
+  // covariances of the cloud points, as prepared for the GICP
+  VoxelGaussianMap(const PointCloud& cloud,
+                   const PlaneCovariances& covariances,
+                   double resolution);
+
+  // Voxels with points among the one holding point and its 6 face
+  // neighbours, so surfaces on a voxel boundary still find their voxel
+  void FindNeighbors(const Eigen::Vector3d& point,
+                     std::vector<const Voxel*>* neighbors) const;
+
+  double GetResolution() const { return resolution_; }
+  size_t size() const { return voxels_.size(); }
+
+private:
+  struct VoxelIndex {
+    int32_t x{0}, y{0}, z{0};
+    bool operator==(const VoxelIndex& other) const {
+      return x == other.x && y == other.y && z == other.z;
+    }
+  };
+  struct VoxelIndexHash {
+    size_t operator()(const VoxelIndex& index) const {
+      return static_cast<size_t>(index.x) * 73856093 ^
+          static_cast<size_t>(index.y) * 19349669 ^
+          static_cast<size_t>(index.z) * 83492791;
+    }
+  };
+
+  VoxelIndex Index(const Eigen::Vector3d& point) const;
+
+  double resolution_;
+  std::vector<Voxel> voxels_;
+  lamp_utils::FlatHashMap<VoxelIndex, uint32_t, VoxelIndexHash> index_;
+};
+typedef std::shared_ptr<const VoxelGaussianMap> VoxelGaussianMapConstPtr;
+
+// Gauss-Newton on the distribution to distribution cost of every source
+// point and the voxels around it, weighted by the voxel point count. Same
+// stopping rule as pcl::MultithreadedGeneralizedIterativeClosestPoint; the
+// fitness score is left to the caller, which has the target search tree.
+class Vgicp {
+public:
+  Vgicp();
+
+  void SetParams(const VgicpParams& params);
+
+  bool Align(const PointCloud& source,
+             const PlaneCovariances& source_covariances,
+             const VoxelGaussianMap& target,
+             const Eigen::Matrix4f& guess);
+
+  const Eigen::Matrix4f& GetFinalTransformation() const {
+    return final_transformation_;
+  }
+  bool HasConverged() const { return b_converged_; }
+  int GetNumIterations() const { return num_iterations_; }
+
+private:
+  VgicpParams params_;
+
+  Eigen::Matrix4f final_transformation_;
+  bool b_converged_;
+  int num_iterations_;
+};
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+# Exports a candidate scoring network to the text format read by the native
+# runtime of GenericLoopPrioritization (CandidateScorer)
+#
+# The model is a torch.nn.Sequential of Linear layers, each optionally
+# followed by Tanh, ReLU or Sigmoid, over the 7 candidate features:
+#   observability from, observability to, log(1 + points from),
+#   log(1 + points to), odometric distance, same robot, log(1 + key gap)
+# saved with torch.save(model, ...). The input normalization is given as a
+# numpy file with the mean and the scale rows.
+from __future__ import print_function
+
+import argparse
+
+import numpy as np
+import torch
+
+NUM_FEATURES = 7
+ACTIVATIONS = {torch.nn.Tanh: "tanh", torch.nn.ReLU: "relu", torch.nn.Sigmoid: "sigmoid"}
+
+
+def layers_of(model):
+    modules = list(model.children())
+    layers = []
+    i = 0
+    while i < len(modules):
+        linear = modules[i]
+        if not isinstance(linear, torch.nn.Linear):
+            raise ValueError("Expected a Linear layer, got %s" % type(linear).__name__)
+        activation = "linear"
+        if i + 1 < len(modules) and type(modules[i + 1]) in ACTIVATIONS:
+            activation = ACTIVATIONS[type(modules[i + 1])]
+            i += 1
+        layers.append((linear, activation))
+        i += 1
+    return layers
+
+
+def write_values(f, values):
+    f.write(" ".join("%.9g" % v for v in values) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model", help="torch.save'd Sequential model")
+    parser.add_argument("normalization", help=".npy file, rows mean and scale")
+    parser.add_argument("output", help="scorer file for gen_prioritization/scorer_model")
+    args = parser.parse_args()
+
+    model = torch.load(args.model, map_location=torch.device("cpu"))
+    model.eval()
+    normalization = np.load(args.normalization)
+    if normalization.shape != (2, NUM_FEATURES):
+        raise ValueError("Normalization must be 2 x %d" % NUM_FEATURES)
+
+    layers = layers_of(model)
+    if layers[0][0].in_features != NUM_FEATURES or layers[-1][0].out_features != 1:
+        raise ValueError("The model must map %d features to one score" % NUM_FEATURES)
+
+    with open(args.output, "w") as f:
+        f.write("# Exported from %s\n" % args.model)
+        f.write("features %d\n" % NUM_FEATURES)
+        f.write("mean ")
+        write_values(f, normalization[0])
+        f.write("scale ")
+        write_values(f, normalization[1])
+        for linear, activation in layers:
+            weights = linear.weight.detach().numpy()
+            f.write("layer %d %d %s\n" % (linear.in_features, linear.out_features, activation))
+            for row in weights:
+                write_values(f, row)
+            if linear.bias is None:
+                write_values(f, np.zeros(linear.out_features))
+            else:
+                write_values(f, linear.bias.detach().numpy())
+    print("Wrote %d layers to %s" % (len(layers), args.output))
+
+
+if __name__ == "__main__":
+    main()
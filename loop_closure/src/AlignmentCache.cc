@@ -0,0 +1,261 @@
+/**
+ * @file   AlignmentCache.cc
+ * @brief  Loop closure alignments kept on disk across restarts
+ */
+
+#include "loop_closure/AlignmentCache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ros/console.h>
+
+namespace lamp_loop_closure {
+
+namespace {
+
+const char kMagic[8] = {'L', 'A', 'M', 'P', 'L', 'C', 'C', '1'};
+const uint32_t kVersion = 1;
+const size_t kMinCapacity = 256;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t num_records;
+};
+
+} // namespace
+
+struct AlignmentCache::Record {
+  uint64_t key_from;
+  uint64_t key_to;
+  uint64_t content_hash;
+  uint64_t params_hash;
+  uint32_t b_accepted;
+  uint32_t reserved;
+  double fitness;
+  double translation[3];
+  double rotation[9];
+  double covariance[36];
+  // Hash of the bytes before it
+  uint64_t checksum;
+};
+
+size_t AlignmentCacheKeyHash::operator()(const AlignmentCacheKey& key) const {
+  return static_cast<size_t>(AlignmentCache::Hash(&key, sizeof(key)));
+}
+
+uint64_t AlignmentCache::Hash(const void* data, size_t size, uint64_t seed) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64_t hash = seed;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+AlignmentCache::~AlignmentCache() {
+  Close();
+}
+
+bool AlignmentCache::Open(const std::string& filename) {
+  Close();
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  fd_ = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0) {
+    ROS_ERROR_STREAM("AlignmentCache: Could not open " << filename);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    ROS_ERROR_STREAM("AlignmentCache: Could not read " << filename);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  FileHeader header;
+  const size_t file_size = st.st_size;
+  bool b_valid = file_size >= sizeof(FileHeader) &&
+      pread(fd_, &header, sizeof(header), 0) ==
+          static_cast<ssize_t>(sizeof(header)) &&
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+      header.version == kVersion && header.record_size == sizeof(Record);
+  if (!b_valid && file_size > 0) {
+    ROS_WARN_STREAM("AlignmentCache: Starting " << filename << " over");
+  }
+  if (!b_valid) {
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.record_size = sizeof(Record);
+    header.num_records = 0;
+    if (ftruncate(fd_, 0) != 0 ||
+        pwrite(fd_, &header, sizeof(header), 0) !=
+            static_cast<ssize_t>(sizeof(header))) {
+      ROS_ERROR_STREAM("AlignmentCache: Could not write " << filename);
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+  }
+
+  const size_t file_capacity = b_valid
+      ? (file_size - sizeof(FileHeader)) / sizeof(Record)
+      : 0;
+  if (!Map(std::max(file_capacity, kMinCapacity))) {
+    ROS_ERROR_STREAM("AlignmentCache: Failed to map " << filename);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  // Index the records up to the first one cut short
+  const size_t num_records =
+      std::min<size_t>(header.num_records, file_capacity);
+  for (size_t i = 0; i < num_records; i++) {
+    const Record& record = *RecordAt(i);
+    if (Hash(&record, offsetof(Record, checksum)) != record.checksum) {
+      ROS_WARN_STREAM("AlignmentCache: Ignoring " << num_records - i
+                                                  << " damaged records of "
+                                                  << filename);
+      break;
+    }
+    AlignmentCacheKey key;
+    key.key_from = record.key_from;
+    key.key_to = record.key_to;
+    key.content_hash = record.content_hash;
+    key.params_hash = record.params_hash;
+    index_.emplace(key, i);
+    num_records_ = i + 1;
+  }
+  ROS_INFO_STREAM("AlignmentCache: " << num_records_ << " alignments in "
+                                     << filename);
+  return true;
+}
+
+bool AlignmentCache::Map(size_t capacity) {
+  Unmap();
+  const size_t size = sizeof(FileHeader) + capacity * sizeof(Record);
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    return false;
+  }
+  if (static_cast<size_t>(st.st_size) < size && ftruncate(fd_, size) != 0) {
+    return false;
+  }
+  void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  map_ = static_cast<char*>(map);
+  map_size_ = size;
+  capacity_ = capacity;
+  return true;
+}
+
+void AlignmentCache::Unmap() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
+    map_size_ = 0;
+    capacity_ = 0;
+  }
+}
+
+AlignmentCache::Record* AlignmentCache::RecordAt(size_t index) const {
+  return reinterpret_cast<Record*>(map_ + sizeof(FileHeader) +
+                                   index * sizeof(Record));
+}
+
+void AlignmentCache::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Unmap();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  num_records_ = 0;
+  index_.clear();
+}
+
+bool AlignmentCache::IsOpen() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return map_ != nullptr;
+}
+
+bool AlignmentCache::Lookup(const AlignmentCacheKey& key,
+                            AlignmentCacheEntry* entry) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return false;
+  }
+  const Record& record = *RecordAt(it->second);
+  entry->b_accepted = record.b_accepted != 0;
+  entry->fitness = record.fitness;
+  for (int i = 0; i < 3; i++) {
+    entry->delta.translation(i) = record.translation[i];
+    for (int j = 0; j < 3; j++) {
+      entry->delta.rotation(i, j) = record.rotation[3 * i + j];
+    }
+  }
+  for (int i = 0; i < 36; i++) {
+    entry->covariance(i / 6, i % 6) = record.covariance[i];
+  }
+  return true;
+}
+
+void AlignmentCache::Insert(const AlignmentCacheKey& key,
+                            const AlignmentCacheEntry& entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (map_ == nullptr || index_.count(key) > 0) {
+    return;
+  }
+  if (num_records_ == capacity_ && !Map(2 * capacity_)) {
+    ROS_ERROR("AlignmentCache: Failed to grow the cache, closing it");
+    Unmap();
+    return;
+  }
+
+  Record record;
+  std::memset(&record, 0, sizeof(record));
+  record.key_from = key.key_from;
+  record.key_to = key.key_to;
+  record.content_hash = key.content_hash;
+  record.params_hash = key.params_hash;
+  record.b_accepted = entry.b_accepted ? 1 : 0;
+  record.fitness = entry.fitness;
+  for (int i = 0; i < 3; i++) {
+    record.translation[i] = entry.delta.translation(i);
+    for (int j = 0; j < 3; j++) {
+      record.rotation[3 * i + j] = entry.delta.rotation(i, j);
+    }
+  }
+  for (int i = 0; i < 36; i++) {
+    record.covariance[i] = entry.covariance(i / 6, i % 6);
+  }
+  record.checksum = Hash(&record, offsetof(Record, checksum));
+  std::memcpy(RecordAt(num_records_), &record, sizeof(record));
+
+  // The record is complete before it is counted
+  index_.emplace(key, num_records_);
+  num_records_++;
+  FileHeader* header = reinterpret_cast<FileHeader*>(map_);
+  header->num_records = num_records_;
+}
+
+size_t AlignmentCache::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_.size();
+}
+
+} // namespace lamp_loop_closure
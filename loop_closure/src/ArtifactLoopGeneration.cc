@@ -0,0 +1,278 @@
+/**
+ * @file   ArtifactLoopGeneration.cc
+ * @brief  Find potential loop closures between the nodes observing the same
+ * artifact
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <parameter_utils/ParameterUtils.h>
+#include <pose_graph_msgs/PoseGraphEdge.h>
+#include <lamp_utils/CommonFunctions.h>
+
+#include "loop_closure/ArtifactLoopGeneration.h"
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+ArtifactLoopGeneration::ArtifactLoopGeneration() : LoopGeneration() {}
+ArtifactLoopGeneration::~ArtifactLoopGeneration() {}
+
+bool ArtifactLoopGeneration::Initialize(const ros::NodeHandle& n) {
+  std::string name =
+      ros::names::append(n.getNamespace(), "ArtifactLoopGeneration");
+  if (!LoadParameters(n)) {
+    ROS_ERROR("%s: Failed to load parameters.", name.c_str());
+    return false;
+  }
+
+  if (!RegisterCallbacks(n)) {
+    ROS_ERROR("%s: Failed to register callbacks.", name.c_str());
+    return false;
+  }
+
+  if (!CreatePublishers(n)) {
+    ROS_ERROR("%s: Failed to create publishers.", name.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool ArtifactLoopGeneration::LoadParameters(const ros::NodeHandle& n) {
+  if (!LoopGeneration::LoadParameters(n))
+    return false;
+
+  int max_candidates;
+  if (!pu::Get(param_ns_ + "/artifact_candidates/match_radius",
+               match_radius_))
+    return false;
+  if (!pu::Get(param_ns_ + "/artifact_candidates/max_sighting_distance",
+               max_sighting_distance_))
+    return false;
+  if (!pu::Get(param_ns_ + "/artifact_candidates/max_candidates",
+               max_candidates))
+    return false;
+  max_candidates_ = std::max(max_candidates, 1);
+  // Same pairs as the proximity search
+  if (!pu::Get(param_ns_ + "/proximity_pairs/intra_robot", b_intra_robot_))
+    return false;
+  if (!pu::Get(param_ns_ + "/proximity_pairs/inter_robot", b_inter_robot_))
+    return false;
+
+  double distance_to_skip_recent_poses, translation_threshold_nodes;
+  if (!pu::Get(param_ns_ + "/translation_threshold_nodes",
+               translation_threshold_nodes))
+    return false;
+  if (!pu::Get(param_ns_ + "/distance_to_skip_recent_poses",
+               distance_to_skip_recent_poses))
+    return false;
+
+  skip_recent_poses_ =
+      (int)(distance_to_skip_recent_poses / translation_threshold_nodes);
+  return true;
+}
+
+bool ArtifactLoopGeneration::CreatePublishers(const ros::NodeHandle& n) {
+  if (!LoopGeneration::CreatePublishers(n))
+    return false;
+  return true;
+}
+
+bool ArtifactLoopGeneration::RegisterCallbacks(const ros::NodeHandle& n) {
+  ros::NodeHandle nl(n);
+  keyed_poses_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+      "pose_graph_incremental",
+      100000,
+      &ArtifactLoopGeneration::KeyedPoseCallback,
+      this);
+  return true;
+}
+
+gtsam::Key ArtifactLoopGeneration::FindGroup(gtsam::Key artifact) {
+  auto it = groups_.find(artifact);
+  if (it == groups_.end())
+    return artifact;
+  if (it->second == artifact)
+    return artifact;
+  const gtsam::Key group = FindGroup(it->second);
+  groups_[artifact] = group;
+  return group;
+}
+
+void ArtifactLoopGeneration::MergeGroups(gtsam::Key artifact,
+                                         gtsam::Key other,
+                                         std::vector<size_t>* pending) {
+  gtsam::Key group = FindGroup(artifact);
+  gtsam::Key other_group = FindGroup(other);
+  if (group == other_group)
+    return;
+
+  auto members = [this](gtsam::Key root) -> std::vector<gtsam::Key>& {
+    auto& root_members = group_members_[root];
+    if (root_members.empty())
+      root_members.push_back(root);
+    return root_members;
+  };
+  if (members(group).size() < members(other_group).size())
+    std::swap(group, other_group);
+
+  // other_group joins group
+  std::vector<gtsam::Key> moved = std::move(members(other_group));
+  group_members_.erase(other_group);
+  for (const gtsam::Key& member : moved) {
+    auto sightings = artifact_sightings_.find(member);
+    if (sightings != artifact_sightings_.end()) {
+      pending->insert(pending->end(),
+                      sightings->second.begin(),
+                      sightings->second.end());
+    }
+  }
+  groups_[group] = group;
+  groups_[other_group] = group;
+  auto& group_members = members(group);
+  group_members.insert(group_members.end(), moved.begin(), moved.end());
+}
+
+bool ArtifactLoopGeneration::IsPair(const Sighting& sighting,
+                                    const Sighting& other) const {
+  if (sighting.node == other.node)
+    return false;
+  const gtsam::Symbol key(sighting.node), other_key(other.node);
+  if (key.chr() != other_key.chr())
+    return b_inter_robot_;
+  // Recent poses of the same robot are closed by odometry
+  return b_intra_robot_ &&
+      std::llabs(key.index() - other_key.index()) >=
+      static_cast<long long>(skip_recent_poses_);
+}
+
+void ArtifactLoopGeneration::GenerateLoops(size_t sighting_index) {
+  // Loop closure off. No candidates generated
+  if (!b_check_for_loop_closures_)
+    return;
+
+  const Sighting& sighting = sightings_[sighting_index];
+  auto pose_from = keyed_poses_.find(sighting.node);
+  if (pose_from == keyed_poses_.end())
+    return;
+
+  // Sightings of the group, the closest to their node first
+  std::vector<size_t> others;
+  const gtsam::Key group = FindGroup(sighting.artifact);
+  auto group_members = group_members_.find(group);
+  const std::vector<gtsam::Key> members = group_members != group_members_.end()
+      ? group_members->second
+      : std::vector<gtsam::Key>{group};
+  for (const gtsam::Key& member : members) {
+    auto sightings = artifact_sightings_.find(member);
+    if (sightings == artifact_sightings_.end())
+      continue;
+    for (size_t other : sightings->second) {
+      if (IsPair(sighting, sightings_[other]) &&
+          keyed_poses_.count(sightings_[other].node) > 0)
+        others.push_back(other);
+    }
+  }
+  auto closer = [this](size_t a, size_t b) {
+    const double distance_a = sightings_[a].position.norm();
+    const double distance_b = sightings_[b].position.norm();
+    if (distance_a != distance_b)
+      return distance_a < distance_b;
+    return sightings_[a].node < sightings_[b].node;
+  };
+  if (others.size() > max_candidates_) {
+    std::partial_sort(
+        others.begin(), others.begin() + max_candidates_, others.end(), closer);
+    others.resize(max_candidates_);
+  }
+
+  // The artifact at the same place seen from both nodes, with the rotation
+  // of the odometry
+  const gtsam::Point3 artifact_position =
+      pose_from->second.transformFrom(sighting.position);
+  for (size_t other_index : others) {
+    const Sighting& other = sightings_[other_index];
+    const std::pair<gtsam::Key, gtsam::Key> pair =
+        std::minmax(sighting.node, other.node);
+    if (!paired_.insert(pair).second)
+      continue;
+
+    const gtsam::Rot3& rotation_to = keyed_poses_.at(other.node).rotation();
+    const gtsam::Pose3 pose_to(
+        rotation_to, artifact_position - rotation_to.rotate(other.position));
+
+    pose_graph_msgs::LoopCandidate candidate;
+    candidate.header.stamp = ros::Time::now();
+    candidate.key_from = sighting.node;
+    candidate.key_to = other.node;
+    candidate.pose_from = lamp_utils::GtsamToRosMsg(pose_from->second);
+    candidate.pose_to = lamp_utils::GtsamToRosMsg(pose_to);
+    candidate.type = pose_graph_msgs::LoopCandidate::ARTIFACT;
+    candidate.value = sighting.position.norm() + other.position.norm();
+    candidates_.push_back(candidate);
+  }
+}
+
+void ArtifactLoopGeneration::KeyedPoseCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  // Sightings to pair, new or of a group that grew
+  std::vector<size_t> pending;
+
+  for (const auto& node_msg : graph_msg->nodes) {
+    const gtsam::Symbol key(node_msg.key);
+    const gtsam::Pose3 pose = lamp_utils::ToGtsam(node_msg.pose);
+    // The latest poses, the initial guesses only need them roughly
+    if (lamp_utils::IsRobotPrefix(key.chr())) {
+      keyed_poses_[key] = pose;
+      continue;
+    }
+    if (!lamp_utils::IsArtifactPrefix(key.chr()))
+      continue;
+
+    if (!node_msg.ID.empty()) {
+      auto same_id = id_artifacts_.emplace(node_msg.ID, key).first;
+      MergeGroups(key, same_id->second, &pending);
+    }
+    artifact_positions_.Insert(key, pose.translation());
+    for (const gtsam::Key& other :
+         artifact_positions_.RadiusSearch(pose.translation(), match_radius_))
+      MergeGroups(key, other, &pending);
+  }
+
+  for (const auto& edge_msg : graph_msg->edges) {
+    if (edge_msg.type != pose_graph_msgs::PoseGraphEdge::ARTIFACT)
+      continue;
+    const gtsam::Symbol node(edge_msg.key_from);
+    const gtsam::Symbol artifact(edge_msg.key_to);
+    if (!lamp_utils::IsRobotPrefix(node.chr()) ||
+        !lamp_utils::IsArtifactPrefix(artifact.chr()))
+      continue;
+    if (!sighted_.emplace(node, artifact).second)
+      continue;
+
+    Sighting sighting;
+    sighting.node = node;
+    sighting.artifact = artifact;
+    sighting.position = lamp_utils::ToGtsam(edge_msg.pose).translation();
+    // Too far for the scans of both nodes to overlap
+    if (sighting.position.norm() > max_sighting_distance_)
+      continue;
+    artifact_sightings_[artifact].push_back(sightings_.size());
+    pending.push_back(sightings_.size());
+    sightings_.push_back(sighting);
+  }
+
+  for (size_t sighting : pending)
+    GenerateLoops(sighting);
+
+  if (HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get()) &&
+      candidates_.size() > 0) {
+    PublishLoops();
+    ClearLoops();
+  }
+}
+
+} // namespace lamp_loop_closure
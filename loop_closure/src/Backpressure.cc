@@ -0,0 +1,67 @@
+/**
+ * @file   Backpressure.cc
+ * @brief  Saturation of loop computation as seen by the upstream stages
+ */
+
+#include "loop_closure/Backpressure.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <parameter_utils/ParameterUtils.h>
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+bool LoadBackpressureParams(const std::string& param_ns,
+                            BackpressureParams* params) {
+  if (!pu::Get(param_ns + "/backpressure/enable", params->b_enabled))
+    return false;
+  if (!pu::Get(param_ns + "/backpressure/max_latency", params->max_latency))
+    return false;
+  if (!pu::Get(param_ns + "/backpressure/status_timeout",
+               params->status_timeout))
+    return false;
+  return true;
+}
+
+Backpressure::Backpressure(const BackpressureParams& params)
+  : params_(params) {}
+
+void Backpressure::SetParams(const BackpressureParams& params) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  params_ = params;
+}
+
+void Backpressure::Update(
+    const pose_graph_msgs::LoopComputationStatus& status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queue_depth_ = status.queue_depth;
+  stamp_ = status.header.stamp.toSec();
+  // An idle tick says nothing about how fast the queue drains
+  if (status.throughput > 0) {
+    throughput_ = throughput_ > 0
+        ? 0.5 * (throughput_ + status.throughput)
+        : status.throughput;
+  }
+}
+
+double Backpressure::Load(double now) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!params_.b_enabled || throughput_ <= 0 || params_.max_latency <= 0)
+    return 0;
+  if (now - stamp_ > params_.status_timeout)
+    return 0;
+  return queue_depth_ / throughput_ / params_.max_latency;
+}
+
+size_t Backpressure::Keep(size_t n, size_t min_keep, double now) const {
+  const double load = Load(now);
+  if (load <= 1.0)
+    return n;
+  const size_t keep = static_cast<size_t>(std::ceil(n / load));
+  return std::min(n, std::max(keep, min_keep));
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,152 @@
+/**
+ * @file   CandidateChannel.cc
+ * @brief  In-process handoff of loop candidates between the nodelets of one
+ * manager
+ */
+
+#include "loop_closure/CandidateChannel.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <boost/make_shared.hpp>
+#include <parameter_utils/ParameterUtils.h>
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+CandidateChannel::CandidateChannel(size_t capacity)
+    : enqueue_pos_(0), dequeue_pos_(0), num_consumers_(0) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  cells_.reset(new Cell[size]);
+  mask_ = size - 1;
+  for (size_t i = 0; i < size; i++) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+std::shared_ptr<CandidateChannel>
+CandidateChannel::Get(const std::string& topic, size_t capacity) {
+  // Channels go away with the last stage that uses them
+  static std::mutex registry_mutex;
+  static std::map<std::string, std::weak_ptr<CandidateChannel>> registry;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  std::shared_ptr<CandidateChannel> channel = registry[topic].lock();
+  if (!channel) {
+    channel = std::make_shared<CandidateChannel>(capacity);
+    registry[topic] = channel;
+  }
+  return channel;
+}
+
+bool CandidateChannel::Push(const Message& message) {
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    const intptr_t diff =
+        static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->message = message;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool CandidateChannel::Pop(Message* message) {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    const intptr_t diff =
+        static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos_.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  *message = std::move(cell->message);
+  cell->message.reset();
+  cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+CandidateChannelReader::CandidateChannelReader(
+    const std::shared_ptr<CandidateChannel>& channel)
+    : channel_(channel) {
+  channel_->num_consumers_++;
+}
+
+CandidateChannelReader::~CandidateChannelReader() {
+  channel_->num_consumers_--;
+}
+
+bool LoadCandidateChannelParams(const std::string& param_ns,
+                                CandidateChannelParams* params) {
+  if (!pu::Get(param_ns + "/candidate_channels/enabled", params->b_enabled))
+    return false;
+  if (!pu::Get(param_ns + "/candidate_channels/capacity", params->capacity))
+    return false;
+  if (!pu::Get(param_ns + "/candidate_channels/poll_period",
+               params->poll_period))
+    return false;
+  return true;
+}
+
+std::shared_ptr<CandidateChannel>
+OpenCandidateOutput(const ros::NodeHandle& n,
+                    const std::string& topic,
+                    const CandidateChannelParams& params) {
+  if (!params.b_enabled) {
+    return nullptr;
+  }
+  return CandidateChannel::Get(n.resolveName(topic), params.capacity);
+}
+
+std::unique_ptr<CandidateChannelReader>
+OpenCandidateInput(const ros::NodeHandle& n,
+                   const std::string& topic,
+                   const CandidateChannelParams& params) {
+  if (!params.b_enabled) {
+    return nullptr;
+  }
+  return std::unique_ptr<CandidateChannelReader>(new CandidateChannelReader(
+      CandidateChannel::Get(n.resolveName(topic), params.capacity)));
+}
+
+void PublishCandidates(const ros::Publisher& pub,
+                       CandidateChannel* channel,
+                       const pose_graph_msgs::LoopCandidateArray& candidates) {
+  if (channel != nullptr && channel->HasConsumer() &&
+      channel->Push(boost::make_shared<pose_graph_msgs::LoopCandidateArray>(
+          candidates))) {
+    return;
+  }
+  // The consumer also subscribes to the topic, nothing is lost when full
+  pub.publish(candidates);
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,176 @@
+/**
+ * @file   CandidateHeap.cc
+ * @brief  Loop candidates ordered by score, with expiry
+ */
+
+#include "loop_closure/CandidateHeap.h"
+
+#include <utility>
+
+namespace lamp_loop_closure {
+
+void CandidateHeap::Push(const pose_graph_msgs::LoopCandidate& candidate,
+                         double score,
+                         double expiry) {
+  size_t slot;
+  if (free_slots_.empty()) {
+    slot = entries_.size();
+    entries_.emplace_back();
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  Entry& entry = entries_[slot];
+  entry.candidate = candidate;
+  entry.score = score;
+  entry.expiry = expiry;
+  entry.score_pos = by_score_.size();
+  entry.expiry_pos = by_expiry_.size();
+  by_score_.push_back(slot);
+  by_expiry_.push_back(slot);
+  SiftUpScore(entry.score_pos);
+  SiftUpExpiry(entry.expiry_pos);
+}
+
+bool CandidateHeap::Pop(pose_graph_msgs::LoopCandidate* candidate) {
+  if (by_score_.empty()) {
+    return false;
+  }
+  const size_t slot = by_score_.front();
+  *candidate = std::move(entries_[slot].candidate);
+  Remove(slot);
+  return true;
+}
+
+size_t CandidateHeap::Expire(double now) {
+  size_t n_expired = 0;
+  while (!by_expiry_.empty() && entries_[by_expiry_.front()].expiry <= now) {
+    Remove(by_expiry_.front());
+    n_expired++;
+  }
+  return n_expired;
+}
+
+void CandidateHeap::Clear() {
+  entries_.clear();
+  free_slots_.clear();
+  by_score_.clear();
+  by_expiry_.clear();
+}
+
+void CandidateHeap::Remove(size_t slot) {
+  // Move the last element of each heap into the hole and restore the order
+  const size_t score_pos = entries_[slot].score_pos;
+  const size_t last_score = by_score_.size() - 1;
+  if (score_pos != last_score) {
+    SwapScore(score_pos, last_score);
+  }
+  by_score_.pop_back();
+  if (score_pos < by_score_.size()) {
+    const size_t moved = by_score_[score_pos];
+    SiftUpScore(score_pos);
+    SiftDownScore(entries_[moved].score_pos);
+  }
+
+  const size_t expiry_pos = entries_[slot].expiry_pos;
+  const size_t last_expiry = by_expiry_.size() - 1;
+  if (expiry_pos != last_expiry) {
+    SwapExpiry(expiry_pos, last_expiry);
+  }
+  by_expiry_.pop_back();
+  if (expiry_pos < by_expiry_.size()) {
+    const size_t moved = by_expiry_[expiry_pos];
+    SiftUpExpiry(expiry_pos);
+    SiftDownExpiry(entries_[moved].expiry_pos);
+  }
+
+  entries_[slot].candidate = pose_graph_msgs::LoopCandidate();
+  free_slots_.push_back(slot);
+}
+
+bool CandidateHeap::ScoreBefore(size_t a, size_t b) const {
+  // Equal scores go out in expiry order, the oldest first
+  const Entry& ea = entries_[a];
+  const Entry& eb = entries_[b];
+  return ea.score > eb.score || (ea.score == eb.score && ea.expiry < eb.expiry);
+}
+
+bool CandidateHeap::ExpiryBefore(size_t a, size_t b) const {
+  return entries_[a].expiry < entries_[b].expiry;
+}
+
+void CandidateHeap::SwapScore(size_t i, size_t j) {
+  std::swap(by_score_[i], by_score_[j]);
+  entries_[by_score_[i]].score_pos = i;
+  entries_[by_score_[j]].score_pos = j;
+}
+
+void CandidateHeap::SwapExpiry(size_t i, size_t j) {
+  std::swap(by_expiry_[i], by_expiry_[j]);
+  entries_[by_expiry_[i]].expiry_pos = i;
+  entries_[by_expiry_[j]].expiry_pos = j;
+}
+
+void CandidateHeap::SiftUpScore(size_t pos) {
+  while (pos > 0) {
+    const size_t parent = (pos - 1) / 2;
+    if (!ScoreBefore(by_score_[pos], by_score_[parent])) {
+      break;
+    }
+    SwapScore(pos, parent);
+    pos = parent;
+  }
+}
+
+void CandidateHeap::SiftDownScore(size_t pos) {
+  const size_t n = by_score_.size();
+  while (true) {
+    size_t best = pos;
+    const size_t left = 2 * pos + 1;
+    const size_t right = left + 1;
+    if (left < n && ScoreBefore(by_score_[left], by_score_[best])) {
+      best = left;
+    }
+    if (right < n && ScoreBefore(by_score_[right], by_score_[best])) {
+      best = right;
+    }
+    if (best == pos) {
+      break;
+    }
+    SwapScore(pos, best);
+    pos = best;
+  }
+}
+
+void CandidateHeap::SiftUpExpiry(size_t pos) {
+  while (pos > 0) {
+    const size_t parent = (pos - 1) / 2;
+    if (!ExpiryBefore(by_expiry_[pos], by_expiry_[parent])) {
+      break;
+    }
+    SwapExpiry(pos, parent);
+    pos = parent;
+  }
+}
+
+void CandidateHeap::SiftDownExpiry(size_t pos) {
+  const size_t n = by_expiry_.size();
+  while (true) {
+    size_t best = pos;
+    const size_t left = 2 * pos + 1;
+    const size_t right = left + 1;
+    if (left < n && ExpiryBefore(by_expiry_[left], by_expiry_[best])) {
+      best = left;
+    }
+    if (right < n && ExpiryBefore(by_expiry_[right], by_expiry_[best])) {
+      best = right;
+    }
+    if (best == pos) {
+      break;
+    }
+    SwapExpiry(pos, best);
+    pos = best;
+  }
+}
+
+} // namespace lamp_loop_closure
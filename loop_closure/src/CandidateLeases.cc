@@ -0,0 +1,185 @@
+/**
+ * @file   CandidateLeases.cc
+ * @brief  Loop candidates leased to remote computation workers
+ */
+
+#include "loop_closure/CandidateLeases.h"
+
+#include <algorithm>
+
+#include <gtsam/inference/Symbol.h>
+
+namespace lamp_loop_closure {
+
+void CandidateLeases::SetParams(const CandidateLeasesParams& params) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  params_ = params;
+  params_.batch_size = std::max<size_t>(params_.batch_size, 1);
+}
+
+void CandidateLeases::Heartbeat(const std::string& worker,
+                                size_t capacity,
+                                const std::vector<uint8_t>& robot_prefixes,
+                                double now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto inserted = workers_.emplace(worker, Worker());
+  Worker& entry = inserted.first->second;
+  if (inserted.second) {
+    entry.num_leased = 0;
+  }
+  entry.last_heartbeat = now;
+  entry.capacity = capacity;
+  entry.robot_prefixes = robot_prefixes;
+}
+
+bool CandidateLeases::Holds(const Worker& worker,
+                            const pose_graph_msgs::LoopCandidate& candidate) {
+  const std::vector<uint8_t>& prefixes = worker.robot_prefixes;
+  auto held = [&prefixes](gtsam::Key key) {
+    return std::find(prefixes.begin(),
+                     prefixes.end(),
+                     static_cast<uint8_t>(gtsam::Symbol(key).chr())) !=
+        prefixes.end();
+  };
+  return held(candidate.key_from) && held(candidate.key_to);
+}
+
+void CandidateLeases::Assign(
+    std::vector<pose_graph_msgs::LoopCandidate>* candidates,
+    double now,
+    std::vector<Lease>* leases) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (workers_.empty()) {
+    return;
+  }
+
+  // Open lease of each worker, filled up to batch_size
+  std::unordered_map<std::string, Lease> open;
+  auto close = [this, leases](Lease& lease) {
+    leases->push_back(lease);
+    leases_.emplace(lease.id, std::move(lease));
+  };
+
+  size_t kept = 0;
+  for (size_t i = 0; i < candidates->size(); i++) {
+    const pose_graph_msgs::LoopCandidate& candidate = (*candidates)[i];
+    // A worker holding the scans of the candidate, else the least loaded one
+    // receiving every scan
+    std::unordered_map<std::string, Worker>::iterator best = workers_.end();
+    bool b_best_holds = false;
+    for (auto it = workers_.begin(); it != workers_.end(); it++) {
+      const Worker& worker = it->second;
+      if (worker.num_leased >= worker.capacity) {
+        continue;
+      }
+      const bool b_holds = !worker.robot_prefixes.empty() &&
+          Holds(worker, candidate);
+      if (!b_holds && !worker.robot_prefixes.empty()) {
+        continue;
+      }
+      const size_t free = worker.capacity - worker.num_leased;
+      if (best == workers_.end() || (b_holds && !b_best_holds) ||
+          (b_holds == b_best_holds &&
+           free > best->second.capacity - best->second.num_leased)) {
+        best = it;
+        b_best_holds = b_holds;
+      }
+    }
+    if (best == workers_.end()) {
+      (*candidates)[kept++] = candidate;
+      continue;
+    }
+
+    auto inserted = open.emplace(best->first, Lease());
+    Lease& lease = inserted.first->second;
+    if (inserted.second) {
+      lease.id = next_id_++;
+      lease.worker = best->first;
+      lease.deadline = now + params_.lease_timeout;
+    }
+    lease.candidates.push_back(candidate);
+    best->second.num_leased++;
+    if (lease.candidates.size() >= params_.batch_size) {
+      close(lease);
+      open.erase(inserted.first);
+    }
+  }
+  candidates->resize(kept);
+
+  for (auto& worker_lease : open) {
+    close(worker_lease.second);
+  }
+}
+
+bool CandidateLeases::Complete(
+    uint64_t id,
+    const std::string& worker,
+    std::vector<pose_graph_msgs::LoopCandidate>* candidates) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = leases_.find(id);
+  if (it == leases_.end() || it->second.worker != worker) {
+    return false;
+  }
+  auto entry = workers_.find(worker);
+  if (entry != workers_.end()) {
+    entry->second.num_leased -=
+        std::min(entry->second.num_leased, it->second.candidates.size());
+  }
+  *candidates = std::move(it->second.candidates);
+  leases_.erase(it);
+  return true;
+}
+
+size_t CandidateLeases::Expire(
+    double now,
+    std::vector<pose_graph_msgs::LoopCandidate>* requeued) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = workers_.begin(); it != workers_.end();) {
+    if (now - it->second.last_heartbeat > params_.worker_timeout) {
+      it = workers_.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  size_t num_expired = 0;
+  for (auto it = leases_.begin(); it != leases_.end();) {
+    auto worker = workers_.find(it->second.worker);
+    if (it->second.deadline >= now && worker != workers_.end()) {
+      it++;
+      continue;
+    }
+    if (worker != workers_.end()) {
+      worker->second.num_leased -=
+          std::min(worker->second.num_leased, it->second.candidates.size());
+    }
+    requeued->insert(requeued->end(),
+                     it->second.candidates.begin(),
+                     it->second.candidates.end());
+    it = leases_.erase(it);
+    num_expired++;
+  }
+  return num_expired;
+}
+
+size_t CandidateLeases::NumWorkers() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return workers_.size();
+}
+
+size_t CandidateLeases::NumLeased() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t num_leased = 0;
+  for (const auto& lease : leases_) {
+    num_leased += lease.second.candidates.size();
+  }
+  return num_leased;
+}
+
+void CandidateLeases::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  workers_.clear();
+  leases_.clear();
+}
+
+} // namespace lamp_loop_closure
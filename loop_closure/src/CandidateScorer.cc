@@ -0,0 +1,162 @@
+/**
+ * @file   CandidateScorer.cc
+ * @brief  Native runtime of a learned loop candidate score
+ */
+
+#include "loop_closure/CandidateScorer.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <gtsam/inference/Symbol.h>
+
+namespace lamp_loop_closure {
+
+namespace {
+
+// Next token, skipping comment lines
+bool ReadToken(std::istream& file, std::string* token) {
+  while (file >> *token) {
+    if ((*token)[0] != '#') {
+      return true;
+    }
+    std::string rest;
+    std::getline(file, rest);
+  }
+  return false;
+}
+
+bool ReadValues(std::istream& file, size_t n, double* values) {
+  std::string token;
+  for (size_t i = 0; i < n; i++) {
+    if (!ReadToken(file, &token)) {
+      return false;
+    }
+    char* end;
+    values[i] = std::strtod(token.c_str(), &end);
+    if (*end != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+bool CandidateScorer::Load(const std::string& filename) {
+  layers_.clear();
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  std::string token;
+  int num_features = 0;
+  if (!ReadToken(file, &token) || token != "features" ||
+      !(file >> num_features) || num_features != NUM_FEATURES) {
+    return false;
+  }
+  mean_.resize(NUM_FEATURES);
+  Eigen::RowVectorXd scale(NUM_FEATURES);
+  if (!ReadToken(file, &token) || token != "mean" ||
+      !ReadValues(file, NUM_FEATURES, mean_.data()) ||
+      !ReadToken(file, &token) || token != "scale" ||
+      !ReadValues(file, NUM_FEATURES, scale.data()) ||
+      (scale.array() == 0).any()) {
+    return false;
+  }
+  inverse_scale_ = scale.cwiseInverse();
+
+  std::vector<Layer> layers;
+  int inputs = NUM_FEATURES;
+  while (ReadToken(file, &token)) {
+    int layer_inputs, outputs;
+    std::string activation;
+    if (token != "layer" || !(file >> layer_inputs >> outputs >> activation) ||
+        layer_inputs != inputs || outputs <= 0) {
+      return false;
+    }
+    Layer layer;
+    if (activation == "linear") {
+      layer.activation = Activation::LINEAR;
+    } else if (activation == "tanh") {
+      layer.activation = Activation::TANH;
+    } else if (activation == "relu") {
+      layer.activation = Activation::RELU;
+    } else if (activation == "sigmoid") {
+      layer.activation = Activation::SIGMOID;
+    } else {
+      return false;
+    }
+    // Row major in the file
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+        weights(outputs, inputs);
+    layer.bias.resize(outputs);
+    if (!ReadValues(file, weights.size(), weights.data()) ||
+        !ReadValues(file, outputs, layer.bias.data())) {
+      return false;
+    }
+    layer.weights = weights;
+    layers.push_back(layer);
+    inputs = outputs;
+  }
+  if (layers.empty() || inputs != 1) {
+    return false;
+  }
+  layers_.swap(layers);
+  return true;
+}
+
+void CandidateScorer::ComputeFeatures(
+    const pose_graph_msgs::LoopCandidate& candidate,
+    const KeyFeatures& from,
+    const KeyFeatures& to,
+    double* features) {
+  const gtsam::Symbol key_from(candidate.key_from);
+  const gtsam::Symbol key_to(candidate.key_to);
+  const double dx = candidate.pose_from.position.x - candidate.pose_to.position.x;
+  const double dy = candidate.pose_from.position.y - candidate.pose_to.position.y;
+  const double dz = candidate.pose_from.position.z - candidate.pose_to.position.z;
+  const bool b_same_robot = key_from.chr() == key_to.chr();
+
+  features[OBSERVABILITY_FROM] = from.observability;
+  features[OBSERVABILITY_TO] = to.observability;
+  features[LOG_POINTS_FROM] = std::log1p(static_cast<double>(from.num_points));
+  features[LOG_POINTS_TO] = std::log1p(static_cast<double>(to.num_points));
+  features[ODOMETRIC_DISTANCE] = std::sqrt(dx * dx + dy * dy + dz * dz);
+  features[SAME_ROBOT] = b_same_robot ? 1.0 : 0.0;
+  features[LOG_KEY_GAP] = b_same_robot
+      ? std::log1p(std::fabs(static_cast<double>(key_from.index()) -
+                             static_cast<double>(key_to.index())))
+      : 0.0;
+}
+
+void CandidateScorer::Score(const Eigen::MatrixXd& features,
+                            Eigen::VectorXd* scores) const {
+  // Candidates are rows, every layer is a single matrix product
+  Eigen::MatrixXd x =
+      (features.rowwise() - mean_).array().rowwise() * inverse_scale_.array();
+  for (const Layer& layer : layers_) {
+    Eigen::MatrixXd y = x * layer.weights.transpose();
+    y.rowwise() += layer.bias.transpose();
+    switch (layer.activation) {
+    case Activation::LINEAR:
+      break;
+    case Activation::TANH:
+      y = y.array().tanh();
+      break;
+    case Activation::RELU:
+      y = y.cwiseMax(0.0);
+      break;
+    case Activation::SIGMOID:
+      y = (1.0 + (-y.array()).exp()).inverse();
+      break;
+    }
+    x.swap(y);
+  }
+  *scores = x.col(0);
+}
+
+} // namespace lamp_loop_closure
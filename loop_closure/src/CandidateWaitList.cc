@@ -0,0 +1,133 @@
+/**
+ * @file   CandidateWaitList.cc
+ * @brief  Loop candidates parked until the data of their keys arrives
+ */
+
+#include "loop_closure/CandidateWaitList.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace lamp_loop_closure {
+
+CandidateWaitList::CandidateWaitList(double tick, size_t num_slots)
+  : tick_(tick), wheel_(std::max<size_t>(num_slots, 1)), last_tick_(0) {}
+
+int64_t CandidateWaitList::Tick(double time) const {
+  return static_cast<int64_t>(std::floor(time / tick_));
+}
+
+void CandidateWaitList::Park(const pose_graph_msgs::LoopCandidate& candidate,
+                             const std::vector<gtsam::Key>& missing,
+                             double expiry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const uint64_t id = next_id_++;
+  Entry& entry = entries_[id];
+  entry.candidate = candidate;
+  entry.num_missing = 0;
+  entry.expiry = expiry;
+  for (size_t i = 0; i < missing.size(); i++) {
+    // Listed once per key
+    if (std::find(missing.begin(), missing.begin() + i, missing[i]) !=
+        missing.begin() + i) {
+      continue;
+    }
+    waiting_[missing[i]].push_back(id);
+    entry.num_missing++;
+  }
+  if (entry.num_missing == 0) {
+    ready_.push_back(id);
+  }
+
+  // Already due entries go in the next slot to expire
+  int64_t tick = Tick(expiry);
+  if (b_started_) {
+    tick = std::max(tick, last_tick_ + 1);
+  }
+  wheel_[static_cast<uint64_t>(tick) % wheel_.size()].push_back(id);
+}
+
+void CandidateWaitList::Release(gtsam::Key key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = waiting_.find(key);
+  if (it == waiting_.end()) {
+    return;
+  }
+  for (uint64_t id : it->second) {
+    auto entry = entries_.find(id);
+    if (entry != entries_.end() && --entry->second.num_missing == 0) {
+      ready_.push_back(id);
+    }
+  }
+  waiting_.erase(it);
+}
+
+void CandidateWaitList::TakeReady(
+    std::vector<pose_graph_msgs::LoopCandidate>* ready) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (uint64_t id : ready_) {
+    auto entry = entries_.find(id);
+    if (entry == entries_.end()) {
+      continue;
+    }
+    ready->push_back(std::move(entry->second.candidate));
+    entries_.erase(entry);
+  }
+  ready_.clear();
+}
+
+size_t CandidateWaitList::Expire(double now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int64_t now_tick = Tick(now);
+  if (!b_started_) {
+    // Nothing was expired so far, every slot is due
+    last_tick_ = now_tick - static_cast<int64_t>(wheel_.size());
+    b_started_ = true;
+  }
+  if (now_tick <= last_tick_) {
+    return 0;
+  }
+
+  // A full revolution visits every slot once
+  const int64_t num_slots = static_cast<int64_t>(wheel_.size());
+  const int64_t first = std::max(last_tick_ + 1, now_tick - num_slots + 1);
+  size_t num_expired = 0;
+  for (int64_t tick = first; tick <= now_tick; tick++) {
+    std::vector<uint64_t>& slot =
+        wheel_[static_cast<uint64_t>(tick) % wheel_.size()];
+    size_t kept = 0;
+    for (uint64_t id : slot) {
+      auto entry = entries_.find(id);
+      if (entry == entries_.end()) {
+        continue;
+      }
+      // Later revolutions stay in the slot
+      if (entry->second.expiry >= now) {
+        slot[kept++] = id;
+        continue;
+      }
+      entries_.erase(entry);
+      num_expired++;
+    }
+    slot.resize(kept);
+  }
+  last_tick_ = now_tick;
+  return num_expired;
+}
+
+size_t CandidateWaitList::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void CandidateWaitList::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  waiting_.clear();
+  ready_.clear();
+  for (auto& slot : wheel_) {
+    slot.clear();
+  }
+}
+
+} // namespace lamp_loop_closure
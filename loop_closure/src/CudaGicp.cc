@@ -0,0 +1,181 @@
+/**
+ * @file   CudaGicp.cc
+ * @brief  GICP running correspondence search, covariance estimation and the
+ *         Gauss-Newton iterations on the GPU
+ */
+#include "loop_closure/CudaGicp.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <ros/console.h>
+
+#include "loop_closure/CudaGicpKernels.h"
+
+namespace lamp_loop_closure {
+
+namespace {
+
+#ifdef LOOP_CLOSURE_WITH_CUDA
+std::vector<float> PackPoints(const PointCloud& cloud) {
+  std::vector<float> packed;
+  packed.reserve(cloud.size() * cuda_gicp::kPointStride);
+  for (const auto& p : cloud.points) {
+    packed.push_back(p.x);
+    packed.push_back(p.y);
+    packed.push_back(p.z);
+    packed.push_back(p.normal_x);
+    packed.push_back(p.normal_y);
+    packed.push_back(p.normal_z);
+  }
+  return packed;
+}
+
+void ToRowMajor3x4(const Eigen::Matrix4d& T, float out[12]) {
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 4; c++)
+      out[4 * r + c] = static_cast<float>(T(r, c));
+}
+
+// exp of the left perturbation (rotation first, then translation)
+Eigen::Matrix4d Exp(const Eigen::Matrix<double, 6, 1>& xi) {
+  Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+  const Eigen::Vector3d omega = xi.head<3>();
+  const double angle = omega.norm();
+  if (angle > 1e-12) {
+    T.topLeftCorner<3, 3>() =
+        Eigen::AngleAxisd(angle, omega / angle).toRotationMatrix();
+  }
+  T.topRightCorner<3, 1>() = xi.tail<3>();
+  return T;
+}
+#endif
+
+} // namespace
+
+CudaGicp::CudaGicp()
+  : final_transformation_(Eigen::Matrix4f::Identity()),
+    b_converged_(false),
+    fitness_score_(0),
+    num_iterations_(0) {}
+
+CudaGicp::~CudaGicp() {}
+
+bool CudaGicp::IsAvailable() {
+#ifdef LOOP_CLOSURE_WITH_CUDA
+  static const bool b_available = cuda_gicp::HasDevice();
+  return b_available;
+#else
+  return false;
+#endif
+}
+
+void CudaGicp::SetParams(const CudaGicpParams& params) {
+  params_ = params;
+}
+
+bool CudaGicp::Align(const PointCloudConstPtr& source,
+                     const PointCloudConstPtr& target,
+                     const Eigen::Matrix4f& guess) {
+  final_transformation_ = guess;
+  b_converged_ = false;
+  fitness_score_ = std::numeric_limits<double>::max();
+  num_iterations_ = 0;
+
+#ifdef LOOP_CLOSURE_WITH_CUDA
+  if (source == nullptr || target == nullptr || source->empty() ||
+      target->empty()) {
+    return false;
+  }
+
+  const std::vector<float> source_packed = PackPoints(*source);
+  const std::vector<float> target_packed = PackPoints(*target);
+  cuda_gicp::DeviceClouds* clouds =
+      cuda_gicp::Upload(source_packed.data(),
+                        source->size(),
+                        target_packed.data(),
+                        target->size(),
+                        static_cast<float>(params_.gicp_epsilon));
+  if (clouds == nullptr) {
+    ROS_ERROR("CudaGicp: Failed to upload point clouds to the device");
+    return false;
+  }
+
+  const float max_sq_dist = params_.max_correspondence_distance *
+      params_.max_correspondence_distance;
+  Eigen::Matrix4d T = guess.cast<double>();
+  float transform[12];
+  double sums[cuda_gicp::kNumSums];
+  bool b_ok = true;
+
+  while (!b_converged_) {
+    ToRowMajor3x4(T, transform);
+    if (!cuda_gicp::Linearize(clouds, transform, max_sq_dist, sums)) {
+      ROS_ERROR("CudaGicp: Linearization failed on the device");
+      b_ok = false;
+      break;
+    }
+    // Not enough correspondences to constrain the six degrees of freedom
+    if (sums[cuda_gicp::kCountOffset] < 6) {
+      break;
+    }
+
+    Eigen::Matrix<double, 6, 6> H;
+    int idx = 0;
+    for (int k = 0; k < 6; k++) {
+      for (int l = k; l < 6; l++) {
+        H(k, l) = sums[idx];
+        H(l, k) = sums[idx];
+        idx++;
+      }
+    }
+    Eigen::Matrix<double, 6, 1> g;
+    for (int k = 0; k < 6; k++)
+      g(k) = sums[cuda_gicp::kGradientOffset + k];
+
+    const Eigen::Matrix<double, 6, 1> xi = -H.ldlt().solve(g);
+    if (!xi.allFinite()) {
+      break;
+    }
+    const Eigen::Matrix4d T_next = Exp(xi) * T;
+
+    // Same stopping rule as the CPU GICP
+    double delta = 0;
+    for (int k = 0; k < 3; k++) {
+      for (int l = 0; l < 4; l++) {
+        const double ratio = l < 3 ? 1.0 / params_.rotation_epsilon
+                                   : 1.0 / params_.transformation_epsilon;
+        delta = std::max(delta, ratio * std::abs(T_next(k, l) - T(k, l)));
+      }
+    }
+    T = T_next;
+    num_iterations_++;
+    if (num_iterations_ >= params_.max_iterations || delta < 1) {
+      b_converged_ = true;
+    }
+  }
+
+  // Fitness as pcl::Registration::getFitnessScore, mean squared distance of
+  // every transformed source point to its nearest target point
+  if (b_ok) {
+    ToRowMajor3x4(T, transform);
+    if (cuda_gicp::Linearize(clouds, transform, max_sq_dist, sums)) {
+      fitness_score_ = sums[cuda_gicp::kSqDistOffset] / source->size();
+    } else {
+      b_ok = false;
+    }
+  }
+  cuda_gicp::Release(clouds);
+
+  final_transformation_ = T.cast<float>();
+  return b_ok;
+#else
+  ROS_ERROR_ONCE("CudaGicp: Built without CUDA support");
+  return false;
+#endif
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,334 @@
+/**
+ * @file   CudaGicpKernels.cu
+ * @brief  Nearest neighbour search, covariances and GICP linearization on
+ *         the GPU
+ */
+#include "loop_closure/CudaGicpKernels.h"
+
+#include <cuda_runtime.h>
+#include <vector>
+
+namespace lamp_loop_closure {
+namespace cuda_gicp {
+
+namespace {
+
+const int kBlockSize = 256;
+
+// Symmetric 3x3 stored as 00 01 02 11 12 22
+struct Sym3 {
+  float m[6];
+};
+
+} // namespace
+
+struct DeviceClouds {
+  float4* source{nullptr};
+  Sym3* source_cov{nullptr};
+  size_t num_source{0};
+  float4* target{nullptr};
+  Sym3* target_cov{nullptr};
+  size_t num_target{0};
+  float* block_sums{nullptr};
+  int num_blocks{0};
+};
+
+namespace {
+
+// Same plane covariance as PCLTwoPlaneVectorsFromNormal:
+// eps * n n' + (I - n n')
+__device__ Sym3 CovarianceFromNormal(float nx, float ny, float nz, float eps) {
+  const float norm = sqrtf(nx * nx + ny * ny + nz * nz);
+  Sym3 c;
+  if (norm < 1e-7f) {
+    c.m[0] = 1.0f; c.m[1] = 0.0f; c.m[2] = 0.0f;
+    c.m[3] = 1.0f; c.m[4] = 0.0f; c.m[5] = 1.0f;
+    return c;
+  }
+  nx /= norm;
+  ny /= norm;
+  nz /= norm;
+  const float k = eps - 1.0f;
+  c.m[0] = 1.0f + k * nx * nx;
+  c.m[1] = k * nx * ny;
+  c.m[2] = k * nx * nz;
+  c.m[3] = 1.0f + k * ny * ny;
+  c.m[4] = k * ny * nz;
+  c.m[5] = 1.0f + k * nz * nz;
+  return c;
+}
+
+__global__ void UploadKernel(const float* packed,
+                             size_t num_points,
+                             float eps,
+                             float4* points,
+                             Sym3* covariances) {
+  const size_t i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= num_points)
+    return;
+  const float* p = packed + i * kPointStride;
+  points[i] = make_float4(p[0], p[1], p[2], 0.0f);
+  covariances[i] = CovarianceFromNormal(p[3], p[4], p[5], eps);
+}
+
+__device__ void Inverse(const Sym3& a, Sym3* inv) {
+  const float c00 = a.m[3] * a.m[5] - a.m[4] * a.m[4];
+  const float c01 = a.m[2] * a.m[4] - a.m[1] * a.m[5];
+  const float c02 = a.m[1] * a.m[4] - a.m[2] * a.m[3];
+  const float c11 = a.m[0] * a.m[5] - a.m[2] * a.m[2];
+  const float c12 = a.m[1] * a.m[2] - a.m[0] * a.m[4];
+  const float c22 = a.m[0] * a.m[3] - a.m[1] * a.m[1];
+  const float det = a.m[0] * c00 + a.m[1] * c01 + a.m[2] * c02;
+  const float s = 1.0f / det;
+  inv->m[0] = c00 * s; inv->m[1] = c01 * s; inv->m[2] = c02 * s;
+  inv->m[3] = c11 * s; inv->m[4] = c12 * s; inv->m[5] = c22 * s;
+}
+
+// Terms of one correspondence, d = T * p - q with M = (C_q + R C_p R')^-1
+// and the left perturbation Jacobian J = [-[T * p]x | I]
+__device__ void Accumulate(const float R[9],
+                           const float3& p_t,
+                           const float4& q,
+                           const Sym3& cov_p,
+                           const Sym3& cov_q,
+                           float sums[kNumSums]) {
+  // R C_p R'
+  float full[9] = {cov_p.m[0], cov_p.m[1], cov_p.m[2],
+                   cov_p.m[1], cov_p.m[3], cov_p.m[4],
+                   cov_p.m[2], cov_p.m[4], cov_p.m[5]};
+  float rc[9];
+  for (int r = 0; r < 3; r++)
+    for (int c = 0; c < 3; c++)
+      rc[3 * r + c] = R[3 * r] * full[c] + R[3 * r + 1] * full[3 + c] +
+          R[3 * r + 2] * full[6 + c];
+  Sym3 a;
+  a.m[0] = rc[0] * R[0] + rc[1] * R[1] + rc[2] * R[2] + cov_q.m[0];
+  a.m[1] = rc[0] * R[3] + rc[1] * R[4] + rc[2] * R[5] + cov_q.m[1];
+  a.m[2] = rc[0] * R[6] + rc[1] * R[7] + rc[2] * R[8] + cov_q.m[2];
+  a.m[3] = rc[3] * R[3] + rc[4] * R[4] + rc[5] * R[5] + cov_q.m[3];
+  a.m[4] = rc[3] * R[6] + rc[4] * R[7] + rc[5] * R[8] + cov_q.m[4];
+  a.m[5] = rc[6] * R[6] + rc[7] * R[7] + rc[8] * R[8] + cov_q.m[5];
+  Sym3 M;
+  Inverse(a, &M);
+  const float Mf[9] = {M.m[0], M.m[1], M.m[2],
+                       M.m[1], M.m[3], M.m[4],
+                       M.m[2], M.m[4], M.m[5]};
+
+  const float d[3] = {p_t.x - q.x, p_t.y - q.y, p_t.z - q.z};
+  const float J[3][6] = {{0.0f, p_t.z, -p_t.y, 1.0f, 0.0f, 0.0f},
+                         {-p_t.z, 0.0f, p_t.x, 0.0f, 1.0f, 0.0f},
+                         {p_t.y, -p_t.x, 0.0f, 0.0f, 0.0f, 1.0f}};
+
+  float Md[3];
+  float MJ[3][6];
+  for (int r = 0; r < 3; r++) {
+    Md[r] = Mf[3 * r] * d[0] + Mf[3 * r + 1] * d[1] + Mf[3 * r + 2] * d[2];
+    for (int c = 0; c < 6; c++)
+      MJ[r][c] = Mf[3 * r] * J[0][c] + Mf[3 * r + 1] * J[1][c] +
+          Mf[3 * r + 2] * J[2][c];
+  }
+
+  int idx = 0;
+  for (int k = 0; k < 6; k++)
+    for (int l = k; l < 6; l++)
+      sums[idx++] += J[0][k] * MJ[0][l] + J[1][k] * MJ[1][l] +
+          J[2][k] * MJ[2][l];
+  for (int k = 0; k < 6; k++)
+    sums[kGradientOffset + k] += J[0][k] * Md[0] + J[1][k] * Md[1] +
+        J[2][k] * Md[2];
+  sums[kErrorOffset] += d[0] * Md[0] + d[1] * Md[1] + d[2] * Md[2];
+  sums[kCountOffset] += 1.0f;
+}
+
+__global__ void LinearizeKernel(const float4* source,
+                                const Sym3* source_cov,
+                                size_t num_source,
+                                const float4* target,
+                                const Sym3* target_cov,
+                                size_t num_target,
+                                float3 R0,
+                                float3 R1,
+                                float3 R2,
+                                float3 t,
+                                float max_sq_dist,
+                                float* block_sums) {
+  __shared__ float4 tile[kBlockSize];
+  __shared__ float reduce[kBlockSize];
+
+  const size_t i = blockIdx.x * blockDim.x + threadIdx.x;
+  const bool active = i < num_source;
+
+  float3 p_t = make_float3(0.0f, 0.0f, 0.0f);
+  if (active) {
+    const float4 p = source[i];
+    p_t.x = R0.x * p.x + R0.y * p.y + R0.z * p.z + t.x;
+    p_t.y = R1.x * p.x + R1.y * p.y + R1.z * p.z + t.y;
+    p_t.z = R2.x * p.x + R2.y * p.y + R2.z * p.z + t.z;
+  }
+
+  // Brute force search through the target in shared memory tiles
+  float best_sq_dist = 3.4e38f;
+  size_t best = 0;
+  for (size_t base = 0; base < num_target; base += kBlockSize) {
+    const size_t j = base + threadIdx.x;
+    if (j < num_target)
+      tile[threadIdx.x] = target[j];
+    __syncthreads();
+    const size_t remaining = num_target - base;
+    const int tile_size =
+        remaining < static_cast<size_t>(kBlockSize) ? static_cast<int>(remaining)
+                                                    : kBlockSize;
+    if (active) {
+      for (int k = 0; k < tile_size; k++) {
+        const float dx = p_t.x - tile[k].x;
+        const float dy = p_t.y - tile[k].y;
+        const float dz = p_t.z - tile[k].z;
+        const float sq_dist = dx * dx + dy * dy + dz * dz;
+        if (sq_dist < best_sq_dist) {
+          best_sq_dist = sq_dist;
+          best = base + k;
+        }
+      }
+    }
+    __syncthreads();
+  }
+
+  float sums[kNumSums];
+  for (int k = 0; k < kNumSums; k++)
+    sums[k] = 0.0f;
+  if (active) {
+    sums[kSqDistOffset] = best_sq_dist;
+    if (best_sq_dist < max_sq_dist) {
+      const float R[9] = {R0.x, R0.y, R0.z, R1.x, R1.y, R1.z, R2.x, R2.y, R2.z};
+      Accumulate(R, p_t, target[best], source_cov[i], target_cov[best], sums);
+    }
+  }
+
+  // Block reduction, one partial sum per block goes back to the host
+  for (int k = 0; k < kNumSums; k++) {
+    reduce[threadIdx.x] = sums[k];
+    __syncthreads();
+    for (int stride = kBlockSize / 2; stride > 0; stride /= 2) {
+      if (threadIdx.x < stride)
+        reduce[threadIdx.x] += reduce[threadIdx.x + stride];
+      __syncthreads();
+    }
+    if (threadIdx.x == 0)
+      block_sums[blockIdx.x * kNumSums + k] = reduce[0];
+    __syncthreads();
+  }
+}
+
+int NumBlocks(size_t num_points) {
+  return static_cast<int>((num_points + kBlockSize - 1) / kBlockSize);
+}
+
+bool UploadCloud(const float* packed,
+                 size_t num_points,
+                 float eps,
+                 float4** points,
+                 Sym3** covariances) {
+  float* d_packed = nullptr;
+  const size_t packed_bytes = num_points * kPointStride * sizeof(float);
+  if (cudaMalloc(&d_packed, packed_bytes) != cudaSuccess)
+    return false;
+  bool ok = cudaMalloc(points, num_points * sizeof(float4)) == cudaSuccess &&
+      cudaMalloc(covariances, num_points * sizeof(Sym3)) == cudaSuccess &&
+      cudaMemcpy(d_packed, packed, packed_bytes, cudaMemcpyHostToDevice) ==
+          cudaSuccess;
+  if (ok) {
+    UploadKernel<<<NumBlocks(num_points), kBlockSize>>>(
+        d_packed, num_points, eps, *points, *covariances);
+    ok = cudaGetLastError() == cudaSuccess;
+  }
+  cudaFree(d_packed);
+  return ok;
+}
+
+} // namespace
+
+bool HasDevice() {
+  int count = 0;
+  return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+}
+
+DeviceClouds* Upload(const float* source,
+                     size_t num_source,
+                     const float* target,
+                     size_t num_target,
+                     float gicp_epsilon) {
+  if (num_source == 0 || num_target == 0)
+    return nullptr;
+  DeviceClouds* clouds = new DeviceClouds;
+  clouds->num_source = num_source;
+  clouds->num_target = num_target;
+  clouds->num_blocks = NumBlocks(num_source);
+  if (!UploadCloud(source,
+                   num_source,
+                   gicp_epsilon,
+                   &clouds->source,
+                   &clouds->source_cov) ||
+      !UploadCloud(target,
+                   num_target,
+                   gicp_epsilon,
+                   &clouds->target,
+                   &clouds->target_cov) ||
+      cudaMalloc(&clouds->block_sums,
+                 clouds->num_blocks * kNumSums * sizeof(float)) !=
+          cudaSuccess) {
+    Release(clouds);
+    return nullptr;
+  }
+  return clouds;
+}
+
+bool Linearize(DeviceClouds* clouds,
+               const float transform[12],
+               float max_sq_dist,
+               double sums[kNumSums]) {
+  const float* T = transform;
+  LinearizeKernel<<<clouds->num_blocks, kBlockSize>>>(
+      clouds->source,
+      clouds->source_cov,
+      clouds->num_source,
+      clouds->target,
+      clouds->target_cov,
+      clouds->num_target,
+      make_float3(T[0], T[1], T[2]),
+      make_float3(T[4], T[5], T[6]),
+      make_float3(T[8], T[9], T[10]),
+      make_float3(T[3], T[7], T[11]),
+      max_sq_dist,
+      clouds->block_sums);
+  if (cudaGetLastError() != cudaSuccess)
+    return false;
+
+  std::vector<float> block_sums(clouds->num_blocks * kNumSums);
+  if (cudaMemcpy(block_sums.data(),
+                 clouds->block_sums,
+                 block_sums.size() * sizeof(float),
+                 cudaMemcpyDeviceToHost) != cudaSuccess)
+    return false;
+
+  // Blocks are summed in double, float partial sums only span one block
+  for (int k = 0; k < kNumSums; k++)
+    sums[k] = 0.0;
+  for (int b = 0; b < clouds->num_blocks; b++)
+    for (int k = 0; k < kNumSums; k++)
+      sums[k] += block_sums[b * kNumSums + k];
+  return true;
+}
+
+void Release(DeviceClouds* clouds) {
+  if (clouds == nullptr)
+    return;
+  cudaFree(clouds->source);
+  cudaFree(clouds->source_cov);
+  cudaFree(clouds->target);
+  cudaFree(clouds->target_cov);
+  cudaFree(clouds->block_sums);
+  delete clouds;
+}
+
+} // namespace cuda_gicp
+} // namespace lamp_loop_closure
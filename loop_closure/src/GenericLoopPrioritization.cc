@@ -5,7 +5,10 @@
  * @author Yun Chang
  */
 
+#include "lamp_utils/ObservabilityCache.h"
 #include "lamp_utils/PointCloudUtils.h"
+#include "lamp_utils/SharedScanStore.h"
+#include "lamp_utils/Tracing.h"
 #include <Eigen/Eigenvalues>
 #include <algorithm>
 #include <numeric>
@@ -63,6 +66,20 @@ bool GenericLoopPrioritization::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/gen_prioritization/choose_best", choose_best_))
     return false;
 
+  std::string scorer_model;
+  if (!pu::Get(param_ns_ + "/gen_prioritization/scorer_model", scorer_model))
+    return false;
+  if (!scorer_model.empty()) {
+    if (scorer_.Load(scorer_model)) {
+      ROS_INFO_STREAM("GenericLoopPrioritization: Scoring candidates with "
+                      << scorer_model);
+    } else {
+      ROS_ERROR_STREAM("GenericLoopPrioritization: Failed to load candidate "
+                       "scorer "
+                       << scorer_model << ", scoring by observability");
+    }
+  }
+
   return true;
 }
 
@@ -92,26 +109,29 @@ bool GenericLoopPrioritization::RegisterCallbacks(const ros::NodeHandle& n) {
 void GenericLoopPrioritization::ProcessTimerCallback(
     const ros::TimerEvent& ev) {
   if (priority_queue_.size() > 0 &&
-      loop_candidate_pub_.getNumSubscribers() > 0) {
+      HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get())) {
     PublishBestCandidates();
   }
 }
 
 void GenericLoopPrioritization::PopulatePriorityQueue() {
+  lamp_utils::TraceSpan span("loop_prioritization.generic");
   size_t n = candidate_queue_.size();
   if (n == 0)
     return;
-  auto best_candidate = candidate_queue_.front();
-  double best_score = 0;
+
+  // Candidates whose scans are scored, with their features
+  std::vector<pose_graph_msgs::LoopCandidate> ready;
+  Eigen::MatrixXd features(n, CandidateScorer::NUM_FEATURES);
   for (size_t i = 0; i < n; i++) {
     auto candidate = candidate_queue_.front();
     candidate_queue_.pop();
 
     // Check if keyed scans exist
-    if (keyed_observability_.find(candidate.key_from) ==
-            keyed_observability_.end() ||
-        keyed_observability_.find(candidate.key_to) ==
-            keyed_observability_.end()) {
+    CandidateScorer::KeyFeatures from, to;
+    if (!GetKeyFeatures(candidate.key_from, &from) ||
+        !GetKeyFeatures(candidate.key_to, &to)) {
       ROS_WARN("Keyed scans not yet received. ");
       if ((ros::Time::now() - candidate.header.stamp).toSec() <
           keyed_scans_max_delay_)
@@ -119,37 +139,62 @@ void GenericLoopPrioritization::PopulatePriorityQueue() {
       continue;
     }
 
-    if (keyed_observability_[candidate.key_from] < min_observability_)
+    if (from.observability < min_observability_)
       continue;
 
-    if (keyed_observability_[candidate.key_to] < min_observability_)
+    if (to.observability < min_observability_)
       continue;
 
-    if (!choose_best_) {
-      priority_queue_mutex_.lock();
-      priority_queue_.push_back(candidate);
-      priority_queue_mutex_.unlock();
-    }
+    Eigen::RowVectorXd row(CandidateScorer::NUM_FEATURES);
+    CandidateScorer::ComputeFeatures(candidate, from, to, row.data());
+    features.row(ready.size()) = row;
+    ready.push_back(candidate);
+  }
+  if (ready.empty())
+    return;
+
+  // One batch through the model
+  Eigen::VectorXd scores;
+  features.conservativeResize(ready.size(), Eigen::NoChange);
+  if (scorer_.IsLoaded()) {
+    scorer_.Score(features, &scores);
+  } else {
+    scores = features.col(CandidateScorer::OBSERVABILITY_FROM) +
+        features.col(CandidateScorer::OBSERVABILITY_TO);
+  }
+
+  if (choose_best_) {
     // Track best candidate
-    double score = keyed_observability_[candidate.key_from] +
-        keyed_observability_[candidate.key_to];
-    if (score > best_score) {
-      best_candidate = candidate;
-      best_score = score;
+    Eigen::Index best;
+    scores.maxCoeff(&best);
+    ready[best].value = scores(best);
+    priority_queue_mutex_.lock();
+    priority_queue_.push_back(ready[best]);
+  } else {
+    for (size_t i = 0; i < ready.size(); i++) {
+      ready[i].value = scores(i);
+    }
+    size_t n_shed = ShedLowValueCandidates(&ready);
+    if (n_shed > 0) {
+      ROS_INFO("GenericLoopPrioritization: Loop computation saturated, "
+               "dropped %zu of %zu candidates",
+               n_shed,
+               n_shed + ready.size());
+    }
+    priority_queue_mutex_.lock();
+    for (const auto& candidate : ready) {
+      priority_queue_.push_back(candidate);
     }
   }
-  if (choose_best_ && best_score > 0) {
-      priority_queue_mutex_.lock();
-      priority_queue_.push_back(best_candidate);
-      priority_queue_mutex_.unlock();
-  }
+  priority_queue_mutex_.unlock();
 
   return;
 }
 
 void GenericLoopPrioritization::PublishBestCandidates() {
   pose_graph_msgs::LoopCandidateArray output_msg = GetBestCandidates();
-  loop_candidate_pub_.publish(output_msg);
+  PublishCandidates(
+      loop_candidate_pub_, loop_candidate_channel_.get(), output_msg);
 }
 
 pose_graph_msgs::LoopCandidateArray
@@ -162,7 +207,6 @@ GenericLoopPrioritization::GetBestCandidates() {
   for (size_t i = 0; i < n; i++) {
     output_msg.candidates.push_back(priority_queue_.front());
     priority_queue_.pop_front();
-    priority_queue_mutex_.unlock();
   }
 
   priority_queue_mutex_.unlock();
@@ -172,21 +216,29 @@ GenericLoopPrioritization::GetBestCandidates() {
 void GenericLoopPrioritization::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
-  if (keyed_observability_.find(key) != keyed_observability_.end()) {
+  if (!keyed_scan_keys_.insert(key).second) {
     ROS_DEBUG_STREAM("KeyedScanCallback: Key "
                      << gtsam::DefaultKeyFormatter(key)
                      << " already has a scan. Not adding.");
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  // Converted once per process and shared with the other scan consumers
+  PointCloudConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*scan_msg);
+
+  // Computed once per key off the callback thread
+  lamp_utils::ObservabilityCache::Instance().Request(key, scan);
+}
 
-  Eigen::Matrix<double, 3, 1> obs_eigenv;
-  lamp_utils::ComputeIcpObservability(scan, &obs_eigenv);
-  double min_obs = obs_eigenv.minCoeff();
-  // Add the key and observability
-  keyed_observability_.insert(std::pair<gtsam::Key, double>(key, min_obs));
+bool GenericLoopPrioritization::GetKeyFeatures(
+    const gtsam::Key& key, CandidateScorer::KeyFeatures* features) const {
+  lamp_utils::ScanObservability observability;
+  if (!lamp_utils::ObservabilityCache::Instance().Get(key, &observability))
+    return false;
+  features->observability = observability.eigenvalues.minCoeff();
+  features->num_points = observability.num_points;
+  return true;
 }
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -4,16 +4,31 @@
  * @author Yun Chang
  */
 #include <Eigen/LU>
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <tuple>
 #include <geometry_utils/GeometryUtilsROS.h>
 #include <parameter_utils/ParameterUtils.h>
+#include <pcl/common/transforms.h>
+#include <pcl/filters/voxel_grid.h>
 #include <pcl/registration/ia_ransac.h>
-#include <teaser/matcher.h>
 #include <teaser/evaluation.h>
 #include <teaser/registration.h>
 #include <lamp_utils/CommonFunctions.h>
 
+#include "lamp_utils/PointCloudKernels.h"
+#include "lamp_utils/PointCloudPool.h"
 #include "lamp_utils/PointCloudUtils.h"
+#include "lamp_utils/Metrics.h"
+#include "lamp_utils/SharedScanStore.h"
+#include "lamp_utils/ThreadGovernor.h"
+#include "lamp_utils/Tracing.h"
 
 #include "loop_closure/IcpLoopComputation.h"
 
@@ -22,9 +37,235 @@ namespace gu = geometry_utils;
 
 namespace lamp_loop_closure {
 
+namespace {
+
+// Hands the stage timings of an alignment to the computation on every return
+class AlignmentTimer {
+public:
+  explicit AlignmentTimer(IcpLoopComputation* computation)
+    : computation_(computation), last_(std::chrono::steady_clock::now()) {}
+  ~AlignmentTimer() {
+    computation_->RecordTimings(timings);
+  }
+
+  // Time since the previous mark
+  double Mark() {
+    const auto now = std::chrono::steady_clock::now();
+    const double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    return elapsed;
+  }
+
+  IcpLoopComputation::AlignmentTimings timings;
+
+private:
+  IcpLoopComputation* computation_;
+  std::chrono::steady_clock::time_point last_;
+};
+
+typedef pcl::PointCloud<pcl::FPFHSignature33> Features;
+typedef pcl::KdTreeFLANN<pcl::FPFHSignature33> FeatureTree;
+
+// pcl::Registration::getFitnessScore, mean squared distance of the aligned
+// points to their nearest target point
+double FitnessScore(const PointCloud& aligned,
+                    const pcl::search::KdTree<Point>& tree) {
+  std::vector<int> index(1);
+  std::vector<float> sq_distance(1);
+  double fitness = 0;
+  int num_points = 0;
+  for (const Point& point : aligned.points) {
+    if (tree.nearestKSearch(point, 1, index, sq_distance) == 0)
+      continue;
+    fitness += sq_distance[0];
+    num_points++;
+  }
+  return num_points > 0 ? fitness / num_points
+                        : std::numeric_limits<double>::max();
+}
+
+// Registration iterations and early aborts, to tune the abort thresholds
+void RecordIterations(const IcpLoopComputation::AlignmentTimings& timings) {
+  lamp_utils::MetricsRegistry& metrics = lamp_utils::MetricsRegistry::Instance();
+  static lamp_utils::Histogram& iterations = metrics.GetHistogram(
+      "icp.gicp_iterations", {1, 2, 5, 10, 20, 50, 100, 200});
+  iterations.Observe(timings.gicp_iterations);
+  if (!timings.abort_reason.empty()) {
+    metrics.GetCounter("icp.early_abort." + timings.abort_reason).Increment();
+  }
+}
+
+// SAC-IA searching a FLANN index of the target features built once per
+// target, instead of on every setTargetFeatures
+class CachedTreeSacIa
+  : public pcl::SampleConsensusInitialAlignment<Point,
+                                                Point,
+                                                pcl::FPFHSignature33> {
+public:
+  void setTargetFeatures(const Features::ConstPtr& features,
+                         const FeatureTree::Ptr& tree) {
+    target_features_ = features;
+    feature_tree_ = tree;
+  }
+};
+
+// FPFH of keypoints without enough neighbours are NaN
+bool IsValidDescriptor(const pcl::FPFHSignature33& descriptor) {
+  return std::isfinite(descriptor.histogram[0]);
+}
+
+// Pair of descriptors, with the distance between them over the distance of
+// the source descriptor to its nearest other target descriptor (below 1 for
+// the nearest, the lower the more distinctive)
+struct Correspondence {
+  int source;
+  int target;
+  float ratio;
+};
+
+// Pairs (source, target) each within the k nearest descriptors of the other
+std::vector<Correspondence>
+MutualCorrespondences(const Features& source,
+                      const FeatureTree& source_tree,
+                      const Features& target,
+                      const FeatureTree& target_tree,
+                      int k) {
+  std::vector<int> indices(k);
+  std::vector<float> sq_dists(k);
+  std::vector<std::vector<int>> target_neighbours(target.size());
+  for (size_t j = 0; j < target.size(); j++) {
+    if (!IsValidDescriptor(target[j]))
+      continue;
+    const int n = source_tree.nearestKSearch(target[j], k, indices, sq_dists);
+    target_neighbours[j].assign(indices.begin(), indices.begin() + n);
+  }
+
+  std::vector<Correspondence> correspondences;
+  for (size_t i = 0; i < source.size(); i++) {
+    if (!IsValidDescriptor(source[i]))
+      continue;
+    const int n = target_tree.nearestKSearch(source[i], k, indices, sq_dists);
+    for (int m = 0; m < n; m++) {
+      const std::vector<int>& back = target_neighbours[indices[m]];
+      if (std::find(back.begin(), back.end(), static_cast<int>(i)) ==
+          back.end())
+        continue;
+      float ratio = 1.0f;
+      if (n > 1) {
+        const float other = sq_dists[m == 0 ? 1 : 0];
+        if (other > 0.0f)
+          ratio = std::sqrt(sq_dists[m] / other);
+        else if (sq_dists[m] > 0.0f)
+          ratio = std::numeric_limits<float>::infinity();
+      }
+      correspondences.push_back({static_cast<int>(i), indices[m], ratio});
+    }
+  }
+  return correspondences;
+}
+
+// Keeps the correspondences of ratio up to max_ratio, at most the
+// max_correspondences most distinctive, in (source, target) order
+void PruneCorrespondences(std::vector<Correspondence>* correspondences,
+                          double max_ratio,
+                          size_t max_correspondences) {
+  correspondences->erase(
+      std::remove_if(correspondences->begin(),
+                     correspondences->end(),
+                     [max_ratio](const Correspondence& c) {
+                       return c.ratio > max_ratio;
+                     }),
+      correspondences->end());
+  auto by_ratio = [](const Correspondence& a, const Correspondence& b) {
+    return std::tie(a.ratio, a.source, a.target) <
+        std::tie(b.ratio, b.source, b.target);
+  };
+  if (correspondences->size() > max_correspondences) {
+    std::nth_element(correspondences->begin(),
+                     correspondences->begin() + max_correspondences,
+                     correspondences->end(),
+                     by_ratio);
+    correspondences->resize(max_correspondences);
+  }
+  std::sort(correspondences->begin(),
+            correspondences->end(),
+            [](const Correspondence& a, const Correspondence& b) {
+              return std::tie(a.source, a.target) <
+                  std::tie(b.source, b.target);
+            });
+}
+
+// Of the coordinates only, the padding of the points is left out
+uint64_t HashCloud(const PointCloud& cloud) {
+  uint64_t hash = AlignmentCache::Hash(nullptr, 0);
+  for (const Point& point : cloud.points) {
+    const float xyz[3] = {point.x, point.y, point.z};
+    hash = AlignmentCache::Hash(xyz, sizeof(xyz), hash);
+  }
+  return hash;
+}
+
+// Pose rounded to 0.1 mm and 0.1 mrad, so a guess read back from a
+// serialized graph hashes the same
+uint64_t HashPose(const gtsam::Pose3& pose, uint64_t seed) {
+  const gtsam::Vector6 log = gtsam::Pose3::Logmap(pose);
+  int64_t rounded[6];
+  for (int i = 0; i < 6; i++) {
+    rounded[i] = static_cast<int64_t>(std::llround(log(i) * 1e4));
+  }
+  return AlignmentCache::Hash(rounded, sizeof(rounded), seed);
+}
+
+// Records the outcome of an alignment in the cache on every return,
+// accepted once the alignment got through
+class CachedOutcome {
+public:
+  CachedOutcome(AlignmentCache* cache,
+                const AlignmentCacheKey& key,
+                const gu::Transform3* delta,
+                const gtsam::Matrix66* covariance,
+                const double* fitness_score)
+    : cache_(cache),
+      key_(key),
+      delta_(delta),
+      covariance_(covariance),
+      fitness_score_(fitness_score) {}
+  ~CachedOutcome() {
+    if (cache_ == nullptr) {
+      return;
+    }
+    AlignmentCacheEntry entry;
+    entry.b_accepted = b_accepted;
+    if (b_accepted) {
+      entry.delta = *delta_;
+      entry.covariance = *covariance_;
+      entry.fitness = *fitness_score_;
+    }
+    cache_->Insert(key_, entry);
+  }
+
+  bool b_accepted{false};
+
+private:
+  AlignmentCache* cache_;
+  AlignmentCacheKey key_;
+  const gu::Transform3* delta_;
+  const gtsam::Matrix66* covariance_;
+  const double* fitness_score_;
+};
+
+} // namespace
+
 IcpLoopComputation::IcpLoopComputation()
-  : icp_computation_pool_(0), b_accumulate_source_(false) {}
-IcpLoopComputation::~IcpLoopComputation() {}
+  : icp_computation_pool_(ThreadPool::Shared()),
+    b_accumulate_source_(false),
+    b_submap_optimized_poses_(false) {}
+IcpLoopComputation::~IcpLoopComputation() {
+  // The robot map alignment job may still be running on the shared pool
+  while (b_robot_alignment_running_.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
 
 bool IcpLoopComputation::Initialize(const ros::NodeHandle& n) {
   std::string name = ros::names::append(n.getNamespace(), "IcpLoopComputation");
@@ -45,14 +286,18 @@ bool IcpLoopComputation::Initialize(const ros::NodeHandle& n) {
     ROS_ERROR("%s: Failed to create publishers.", name.c_str());
     return false;
   }
+  ReserveComputationPool();
+  return true;
+}
+
+void IcpLoopComputation::ReserveComputationPool() {
   if (number_of_threads_in_icp_computation_pool_ > 1) {
       ROS_INFO_STREAM("Thread Pool Initialized with " << number_of_threads_in_icp_computation_pool_ << " threads");
-      icp_computation_pool_.resize(number_of_threads_in_icp_computation_pool_);
+      icp_computation_pool_.reserve(number_of_threads_in_icp_computation_pool_);
   }
   else{
       ROS_INFO_STREAM("Not initializing thread pool");
   }
-  return true;
 }
 
 bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
@@ -65,10 +310,85 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/max_tolerable_fitness", max_tolerable_fitness_))
     return false;
 
+  // Keyed scan storage
+  int scan_ram_budget_mb;
+  std::string scan_spill_directory;
+  if (!pu::Get(param_ns_ + "/scan_store/ram_budget_mb", scan_ram_budget_mb))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_store/spill_directory",
+               scan_spill_directory))
+    return false;
+  if (!keyed_scans_.Configure(
+          static_cast<size_t>(std::max(scan_ram_budget_mb, 0)) * 1024 * 1024,
+          scan_spill_directory)) {
+    ROS_WARN("IcpLoopComputation: Keeping all keyed scans in memory");
+  }
+  // Prepared scans go away together with the scans they were built from
+  keyed_scans_.SetEvictionCallback(
+      [this](const gtsam::Key& key) { InvalidatePreparedScans(key); });
+
+  // Shared with the other nodes of the process (lamp_settings.yaml)
+  std::string prior_map_file;
+  n.param<std::string>("prior_map/file", prior_map_file, "");
+  if (!prior_map_file.empty() && !prior_map_.Open(prior_map_file))
+    return false;
+
+  if (!pu::Get(param_ns_ + "/batch_verification/enable",
+               b_batch_verification_))
+    return false;
+  if (!pu::Get(param_ns_ + "/batch_verification/group_key_radius",
+               batch_group_key_radius_))
+    return false;
+  if (!pu::Get(param_ns_ + "/batch_verification/voxel_size",
+               batch_voxel_size_))
+    return false;
+  if (!pu::Get(param_ns_ + "/batch_verification/corr_dist", batch_corr_dist_))
+    return false;
+  if (!pu::Get(param_ns_ + "/batch_verification/min_overlap",
+               batch_min_overlap_))
+    return false;
+  int one_to_many_best_k;
+  if (!pu::Get(param_ns_ + "/one_to_many/enable", b_one_to_many_))
+    return false;
+  if (!pu::Get(param_ns_ + "/one_to_many/best_k", one_to_many_best_k))
+    return false;
+  if (!pu::Get(param_ns_ + "/one_to_many/confident_fitness",
+               one_to_many_confident_fitness_))
+    return false;
+  one_to_many_best_k_ = static_cast<size_t>(std::max(one_to_many_best_k, 1));
+
+  int robot_alignment_min_keys, robot_alignment_max_scans;
+  if (!pu::Get(param_ns_ + "/robot_alignment/enable", b_robot_alignment_))
+    return false;
+  if (!pu::Get(param_ns_ + "/robot_alignment/period", robot_alignment_period_))
+    return false;
+  if (!pu::Get(param_ns_ + "/robot_alignment/min_keys",
+               robot_alignment_min_keys))
+    return false;
+  if (!pu::Get(param_ns_ + "/robot_alignment/max_scans",
+               robot_alignment_max_scans))
+    return false;
+  if (!pu::Get(param_ns_ + "/robot_alignment/voxel_size",
+               robot_alignment_voxel_size_))
+    return false;
+  if (!pu::Get(param_ns_ + "/robot_alignment/corr_dist",
+               robot_alignment_corr_dist_))
+    return false;
+  if (!pu::Get(param_ns_ + "/robot_alignment/min_overlap",
+               robot_alignment_min_overlap_))
+    return false;
+  robot_alignment_min_keys_ =
+      static_cast<size_t>(std::max(robot_alignment_min_keys, 1));
+  robot_alignment_max_scans_ =
+      static_cast<size_t>(std::max(robot_alignment_max_scans, 1));
+
   if (!pu::Get(param_ns_ + "/distance_before_reclosing",
                dist_before_reclosing_))
     return false;
 
+  if (!pu::Get(param_ns_ + "/stream_window", stream_window_))
+    return false;
+
   // Load ICP parameters (from point_cloud localization)
   if (!pu::Get(param_ns_ + "/icp_lc/tf_epsilon", icp_tf_epsilon_))
     return false;
@@ -78,6 +398,64 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
     return false;
   if (!pu::Get(param_ns_ + "/icp_lc/threads", icp_threads_))
     return false;
+  int icp_backend;
+  if (!pu::Get(param_ns_ + "/icp_lc/backend", icp_backend))
+    return false;
+  icp_backend_ = IcpBackend(icp_backend);
+  if (icp_backend_ == IcpBackend::CUDA && !CudaGicp::IsAvailable()) {
+    ROS_WARN("IcpLoopComputation: CUDA GICP not available, using the CPU");
+    icp_backend_ = IcpBackend::CPU;
+  }
+  if (!pu::Get(param_ns_ + "/icp_lc/early_abort/b_enable", b_early_abort_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/early_abort/min_iterations",
+               early_abort_min_iterations_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/early_abort/min_inlier_ratio",
+               early_abort_min_inlier_ratio_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/early_abort/min_improvement",
+               early_abort_min_improvement_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/vgicp/voxel_resolution",
+               vgicp_params_.voxel_resolution))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/prepared_scan_cache_size",
+               prepared_scan_cache_size_))
+    return false;
+  double submap_voxel_size, submap_translation_threshold,
+      submap_rotation_threshold;
+  if (!pu::Get(param_ns_ + "/icp_lc/submap_cache/voxel_size",
+               submap_voxel_size))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/submap_cache/translation_threshold",
+               submap_translation_threshold))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/submap_cache/rotation_threshold",
+               submap_rotation_threshold))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/submap_cache/b_use_optimized_poses",
+               b_submap_optimized_poses_))
+    return false;
+  submap_cache_.SetParams(
+      static_cast<size_t>(std::max(prepared_scan_cache_size_, 1)),
+      submap_voxel_size,
+      submap_translation_threshold,
+      submap_rotation_threshold);
+  if (!pu::Get(param_ns_ + "/icp_lc/area_submap/b_enabled", b_area_submaps_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/area_submap/radius", area_radius_))
+    return false;
+  if (!pu::Get(param_ns_ + "/icp_lc/area_submap/max_scans", area_max_scans_))
+    return false;
+  double area_voxel_size;
+  if (!pu::Get(param_ns_ + "/icp_lc/area_submap/voxel_size", area_voxel_size))
+    return false;
+  area_submap_cache_.SetParams(
+      static_cast<size_t>(std::max(prepared_scan_cache_size_, 1)),
+      area_voxel_size,
+      submap_translation_threshold,
+      submap_rotation_threshold);
   if (!pu::Get(param_ns_ + "/icp_lc/transform_thresholding",
                icp_transform_thresholding_))
     return false;
@@ -116,6 +494,21 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/TEASERPP/TEASER_FPFH_features_radius",
                TEASER_FPFH_features_radius_))
     return false;
+  if (!pu::Get(param_ns_ + "/TEASERPP/correspondence_neighbours",
+               teaser_correspondence_neighbours_))
+    return false;
+  if (!pu::Get(param_ns_ + "/TEASERPP/max_descriptor_ratio",
+               teaser_max_descriptor_ratio_))
+    return false;
+  if (!pu::Get(param_ns_ + "/TEASERPP/max_correspondences",
+               teaser_max_correspondences_))
+    return false;
+  if (!pu::Get(param_ns_ + "/TEASERPP/max_clique_time_limit",
+               teaser_max_clique_time_limit_))
+    return false;
+  if (!pu::Get(param_ns_ + "/TEASERPP/max_clique_threads",
+               teaser_max_clique_threads_))
+    return false;
 
   // Load Harris parameters
   if (!pu::Get(param_ns_ + "/harris3D/harris_threshold",
@@ -145,6 +538,7 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
   icp_covariance_method_ = IcpCovarianceMethod(icp_covar_method);
 
   SetupICP(icp_);
+  ClearAlignmentContexts();
 
   // Hard coded covariances
   if (!pu::Get("laser_lc_rot_sigma", laser_lc_rot_sigma_))
@@ -154,21 +548,152 @@ bool IcpLoopComputation::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get("b_use_fixed_covariances", b_use_fixed_covariances_))
     return false;
 
+  // Thread groups of the process, the loop closure load is capped there
+  lamp_utils::ThreadGovernor& governor = lamp_utils::ThreadGovernor::Instance();
+  if (!governor.LoadParameters(n))
+    return false;
+  if (!lamp_utils::MemoryAccountant::Instance().LoadParameters(n))
+    return false;
   double icp_computation_thread_pool_size;
   if (!pu::Get(param_ns_ + "/icp_thread_pool_thread_count", icp_computation_thread_pool_size))
         return false;
   if (icp_computation_thread_pool_size >= 1.0){
       number_of_threads_in_icp_computation_pool_ = (size_t) icp_computation_thread_pool_size;
   } else {
-      double processor_count = std::thread::hardware_concurrency();
+      double processor_count = governor.CoreBudget();
       number_of_threads_in_icp_computation_pool_ = (size_t) (icp_computation_thread_pool_size * processor_count);
   }
+  if (number_of_threads_in_icp_computation_pool_ > 1) {
+    number_of_threads_in_icp_computation_pool_ = governor.Threads(
+        "loop_closure_pool", number_of_threads_in_icp_computation_pool_);
+  }
+
+  // Every alignment runs GICP with icp_lc/threads OpenMP threads, keep the
+  // total within the core budget when alignments run in parallel
+  const size_t threads_per_alignment = std::max<size_t>(
+      governor.CoreBudget() /
+          std::max<size_t>(number_of_threads_in_icp_computation_pool_, 1),
+      1);
+  if (number_of_threads_in_icp_computation_pool_ > 1) {
+    icp_threads_ = std::min<size_t>(icp_threads_, threads_per_alignment);
+  }
+  icp_threads_ =
+      static_cast<unsigned int>(governor.Threads("gicp", icp_threads_));
+  // Same for the max clique of TEASER++, 0 for the share of the alignment
+  if (teaser_max_clique_threads_ <= 0 ||
+      static_cast<size_t>(teaser_max_clique_threads_) > threads_per_alignment)
+    teaser_max_clique_threads_ = static_cast<int>(threads_per_alignment);
+  teaser_max_clique_threads_ = static_cast<int>(
+      governor.Threads("teaser", teaser_max_clique_threads_));
+
+  // Everything the outcome of an alignment depends on besides the scans and
+  // the initial guess
+  const double alignment_params[] = {
+      max_tolerable_fitness_,
+      icp_tf_epsilon_,
+      icp_corr_dist_,
+      static_cast<double>(icp_iterations_),
+      static_cast<double>(icp_backend_),
+      static_cast<double>(b_early_abort_),
+      static_cast<double>(early_abort_min_iterations_),
+      early_abort_min_inlier_ratio_,
+      early_abort_min_improvement_,
+      vgicp_params_.voxel_resolution,
+      submap_voxel_size,
+      static_cast<double>(icp_transform_thresholding_),
+      icp_max_translation_,
+      icp_max_rotation_,
+      static_cast<double>(sac_iterations_),
+      static_cast<double>(sac_num_prev_scans_),
+      static_cast<double>(sac_num_next_scans_),
+      static_cast<double>(b_accumulate_source_),
+      static_cast<double>(b_area_submaps_),
+      area_radius_,
+      static_cast<double>(area_max_scans_),
+      area_voxel_size,
+      sac_features_radius_,
+      sac_fitness_score_threshold_,
+      teaser_inlier_threshold_,
+      rotation_cost_threshold_,
+      rotation_max_iterations_,
+      noise_bound_,
+      TEASER_FPFH_features_radius_,
+      static_cast<double>(teaser_correspondence_neighbours_),
+      teaser_max_descriptor_ratio_,
+      static_cast<double>(teaser_max_correspondences_),
+      teaser_max_clique_time_limit_,
+      harris_params_.harris_threshold_,
+      static_cast<double>(harris_params_.harris_suppression_),
+      harris_params_.harris_radius_,
+      static_cast<double>(harris_params_.harris_refine_),
+      static_cast<double>(harris_params_.harris_response_),
+      static_cast<double>(icp_init_method_),
+      static_cast<double>(icp_covariance_method_),
+      laser_lc_rot_sigma_,
+      laser_lc_trans_sigma_,
+      static_cast<double>(b_use_fixed_covariances_)};
+  alignment_params_hash_ =
+      AlignmentCache::Hash(alignment_params, sizeof(alignment_params));
+  std::string alignment_cache_path;
+  if (!pu::Get(param_ns_ + "/alignment_cache/path", alignment_cache_path))
+    return false;
+  if (!alignment_cache_path.empty() &&
+      !alignment_cache_.Open(alignment_cache_path)) {
+    ROS_WARN("IcpLoopComputation: Aligning without the alignment cache");
+  }
+
+  // Distributed computation on remote workers
+  CandidateLeasesParams lease_params;
+  int lease_batch_size;
+  std::string worker_robot_prefixes;
+  if (!pu::Get(param_ns_ + "/distributed/b_coordinator", b_coordinator_))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/batch_size", lease_batch_size))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/lease_timeout",
+               lease_params.lease_timeout))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/worker_timeout",
+               lease_params.worker_timeout))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/b_worker", b_worker_))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/worker_name", worker_name_))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/capacity", worker_capacity_))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/robot_prefixes",
+               worker_robot_prefixes))
+    return false;
+  if (!pu::Get(param_ns_ + "/distributed/heartbeat_period",
+               heartbeat_period_))
+    return false;
+  lease_params.batch_size = static_cast<size_t>(std::max(lease_batch_size, 1));
+  leases_.SetParams(lease_params);
+  if (worker_name_.empty()) {
+    worker_name_ = ros::this_node::getName();
+  }
+  worker_robot_prefixes_.assign(worker_robot_prefixes.begin(),
+                                worker_robot_prefixes.end());
   return true;
 }
 
 bool IcpLoopComputation::CreatePublishers(const ros::NodeHandle& n) {
   if (!LoopComputation::CreatePublishers(n))
     return false;
+  metrics_publisher_.Start(n);
+
+  ros::NodeHandle nl(n);
+  if (b_coordinator_) {
+    lease_pub_ = nl.advertise<pose_graph_msgs::LoopComputationLease>(
+        "loop_computation_leases", 100, false);
+  }
+  if (b_worker_) {
+    lease_result_pub_ = nl.advertise<pose_graph_msgs::LoopComputationResult>(
+        "loop_computation_results", 100, false);
+    worker_pub_ = nl.advertise<pose_graph_msgs::LoopComputationWorker>(
+        "loop_computation_workers", 10, false);
+  }
   return true;
 }
 
@@ -185,13 +710,48 @@ bool IcpLoopComputation::RegisterCallbacks(const ros::NodeHandle& n) {
       100000,
       &IcpLoopComputation::KeyedPoseCallback,
       this);
+  if (b_submap_optimized_poses_) {
+    optimized_values_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+        "optimized_values",
+        10,
+        &IcpLoopComputation::OptimizedValuesCallback,
+        this);
+  }
+
+  if (b_coordinator_) {
+    worker_sub_ = nl.subscribe<pose_graph_msgs::LoopComputationWorker>(
+        "loop_computation_workers",
+        100,
+        &IcpLoopComputation::WorkerCallback,
+        this);
+    lease_result_sub_ = nl.subscribe<pose_graph_msgs::LoopComputationResult>(
+        "loop_computation_results",
+        100,
+        &IcpLoopComputation::LeaseResultCallback,
+        this);
+  }
+  if (b_worker_) {
+    lease_sub_ = nl.subscribe<pose_graph_msgs::LoopComputationLease>(
+        "loop_computation_leases", 100, &IcpLoopComputation::LeaseCallback, this);
+    heartbeat_timer_ = nl.createTimer(
+        heartbeat_period_, &IcpLoopComputation::HeartbeatTimerCallback, this);
+  }
 
   update_timer_ =
       nl.createTimer(1.0, &IcpLoopComputation::ProcessTimerCallback, this);
   return true;
 }
 
-bool IcpLoopComputation::SetupICP(pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>& icp) {
+bool IcpLoopComputation::SetupICP(Gicp& icp) {
+  // The GPU backend uses the same settings
+  cuda_icp_params_.transformation_epsilon = icp_tf_epsilon_;
+  cuda_icp_params_.max_correspondence_distance = icp_corr_dist_;
+  cuda_icp_params_.max_iterations = icp_iterations_;
+  cuda_icp_params_.rotation_epsilon = icp.getRotationEpsilon();
+  vgicp_params_.transformation_epsilon = icp_tf_epsilon_;
+  vgicp_params_.max_iterations = icp_iterations_;
+  vgicp_params_.rotation_epsilon = icp.getRotationEpsilon();
+
   icp.setTransformationEpsilon(icp_tf_epsilon_);
   icp.setMaxCorrespondenceDistance(icp_corr_dist_);
   icp.setMaximumIterations(icp_iterations_);
@@ -202,6 +762,38 @@ bool IcpLoopComputation::SetupICP(pcl::MultithreadedGeneralizedIterativeClosestP
   return true;
 }
 
+std::shared_ptr<IcpLoopComputation::AlignmentContext>
+IcpLoopComputation::AcquireAlignmentContext() {
+  std::unique_ptr<AlignmentContext> context;
+  {
+    std::lock_guard<std::mutex> lock(alignment_contexts_mutex_);
+    if (!alignment_contexts_.empty()) {
+      context = std::move(alignment_contexts_.back());
+      alignment_contexts_.pop_back();
+    }
+  }
+  if (context == nullptr) {
+    context.reset(new AlignmentContext);
+    SetupICP(context->icp);
+    context->icp_result.reset(new PointCloud);
+    std::lock_guard<std::mutex> lock(alignment_contexts_mutex_);
+    context->generation = alignment_contexts_generation_;
+  }
+  return std::shared_ptr<AlignmentContext>(
+      context.release(), [this](AlignmentContext* released) {
+        std::unique_ptr<AlignmentContext> owned(released);
+        std::lock_guard<std::mutex> lock(alignment_contexts_mutex_);
+        if (owned->generation == alignment_contexts_generation_)
+          alignment_contexts_.push_back(std::move(owned));
+      });
+}
+
+void IcpLoopComputation::ClearAlignmentContexts() {
+  std::lock_guard<std::mutex> lock(alignment_contexts_mutex_);
+  alignment_contexts_.clear();
+  alignment_contexts_generation_++;
+}
+
 bool IcpLoopComputation::CheckReclosingDistance(gtsam::Key key_from,
                                                 gtsam::Key key_to) const {
 
@@ -209,26 +801,20 @@ bool IcpLoopComputation::CheckReclosingDistance(gtsam::Key key_from,
     return true;
   }
 
+  // Closest closed key on either side of key
+  auto closest = [this](gtsam::Key key) {
+    const auto it = closed_keyes_.lower_bound(key);
+    if (it == closed_keyes_.begin())
+      return *it;
+    const auto prev_it = std::prev(it);
+    return (it == closed_keyes_.end() || key - *prev_it <= *it - key)
+        ? *prev_it
+        : *it;
+  };
+
   // Keyed scans to close to other loop closures
-  gtsam::Key closest_from, closest_to;
-
-  const auto fmit = closed_keyes_.lower_bound(key_from);
-  if (fmit == closed_keyes_.begin())
-    closest_from = *fmit;
-  const auto prev_fmit = std::prev(fmit);
-  closest_from =
-      (fmit == closed_keyes_.end() || key_from - *prev_fmit <= *fmit - key_from)
-          ? *prev_fmit
-          : *fmit;
-
-  const auto toit = closed_keyes_.lower_bound(key_to);
-  if (toit == closed_keyes_.begin())
-    closest_to = *toit;
-  const auto prev_toit = std::prev(toit);
-  closest_to =
-      (toit == closed_keyes_.end() || key_to - *prev_toit <= *toit - key_to)
-          ? *prev_toit
-          : *toit;
+  const gtsam::Key closest_from = closest(key_from);
+  const gtsam::Key closest_to = closest(key_to);
 
   if (abs(static_cast<int>(closest_from) - static_cast<int>(key_from)) <
           dist_before_reclosing_ &&
@@ -241,154 +827,849 @@ bool IcpLoopComputation::CheckReclosingDistance(gtsam::Key key_from,
 
 // Compute transform and populate output queue
 void IcpLoopComputation::ComputeTransforms() {
+  ReadInputChannel();
+  if (b_coordinator_) {
+    MergeLeaseResults();
+  }
+  if (b_worker_) {
+    ComputeLeases();
+  }
+
+  // Candidates whose keyed scans arrived since the last tick
+  std::vector<pose_graph_msgs::LoopCandidate> arrived;
+  awaiting_scans_.TakeReady(&arrived);
+  for (const auto& candidate : arrived) {
+    input_queue_.push(candidate);
+  }
+  awaiting_scans_.Expire(ros::Time::now().toSec());
+
   // First make copy of input queue
   size_t n = input_queue_.size();
 
+  std::vector<pose_graph_msgs::LoopCandidate> candidates;
+  // Candidates without their keyed scans, for the workers holding them
+  std::vector<pose_graph_msgs::LoopCandidate> remote_candidates;
+  std::vector<gtsam::Key> missing;
+  for (size_t i = 0; i < n; i++) {
+    auto candidate = input_queue_.front();
+    input_queue_.pop();
+    PageInPriorMapScan(candidate.key_to);
+    // Keyed scans do not exist, wait for KeyedScanCallback to release them
+    missing.clear();
+    if (!keyed_scans_.Has(candidate.key_from)) {
+      ROS_INFO_STREAM("Missing Candidate for " << candidate.key_from);
+      missing.push_back(candidate.key_from);
+    }
+    if (!keyed_scans_.Has(candidate.key_to)) {
+      ROS_INFO_STREAM("Missing Candidate for " << candidate.key_to);
+      missing.push_back(candidate.key_to);
+    }
+    if (!missing.empty()) {
+      if (b_coordinator_ &&
+          !returned_candidates_.Contains(MakeLoopClosureId(
+              candidate.key_from, candidate.key_to, candidate.type))) {
+        remote_candidates.push_back(candidate);
+        continue;
+      }
+      awaiting_scans_.Park(
+          candidate,
+          missing,
+          candidate.header.stamp.toSec() + keyed_scans_max_delay_);
+      continue;
+    }
+    if (closed_loop_closures_.Contains(MakeLoopClosureId(
+            candidate.key_from, candidate.key_to, candidate.type)) ||
+        !CheckReclosingDistance(candidate.key_from, candidate.key_to)) {
+      continue;
+    }
+    candidates.push_back(candidate);
+  }
+
+  if (b_batch_verification_) {
+    candidates = SelectCandidatesForAlignment(candidates);
+  }
+
+  if (b_coordinator_) {
+    DistributeCandidates(&candidates, &remote_candidates);
+    // Not leased, wait for the keyed scans here
+    for (const auto& candidate : remote_candidates) {
+      missing.clear();
+      for (gtsam::Key key : {candidate.key_from, candidate.key_to}) {
+        if (!keyed_scans_.Has(key)) {
+          missing.push_back(key);
+        }
+      }
+      awaiting_scans_.Park(
+          candidate,
+          missing,
+          candidate.header.stamp.toSec() + keyed_scans_max_delay_);
+    }
+  }
+
+  num_workers_ = std::max<int>(number_of_threads_in_icp_computation_pool_, 1);
+  ros::WallTime compute_start = ros::WallTime::now();
+  // Loop closures go out within stream_window_ of completing, with the
+  // compute time spent so far
+  auto stream = [this, &compute_start]() {
+    const ros::WallTime now = ros::WallTime::now();
+    compute_time_ += (now - compute_start).toSec();
+    compute_start = now;
+    StreamLoopClosures();
+  };
   if (number_of_threads_in_icp_computation_pool_ == 1){
       //If we have decided to not use the thread pool
       // Iterate and compute transforms
-      for (size_t i = 0; i < n; i++) {
-          auto candidate = input_queue_.front();
-          input_queue_.pop();
-
-          // Keyed scans do not exist
-          if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end() ||
-              keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-              if ((ros::Time::now() - candidate.header.stamp).toSec() <
-                  keyed_scans_max_delay_)
-                  input_queue_.push(candidate);
-              if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end()){
-                  ROS_INFO_STREAM("Missing Candidate for " << candidate.key_from);
-              }
-
-              if (keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-                  ROS_INFO_STREAM("Missing Candidate for " << candidate.key_to);
-              }
-              continue;
-
-          }
-
+      for (const auto& candidate : candidates) {
           gtsam::Key key_from = candidate.key_from;
           gtsam::Key key_to = candidate.key_to;
 
+          // Candidates of this batch may have closed nearby already
           if (!CheckReclosingDistance(key_from, key_to)) {
             continue;
           }
-          gtsam::Pose3 pose_from = lamp_utils::ToGtsam(candidate.pose_from);
-          gtsam::Pose3 pose_to = lamp_utils::ToGtsam(candidate.pose_to);
-
-          gu::Transform3 transform;
-          gtsam::Matrix66 covariance;
-          double icp_fitness;
-          if (!PerformAlignment(key_from,
-                                key_to,
-                                pose_from,
-                                pose_to,
-                                &transform,
-                                &covariance,
-                                &icp_fitness,
-                                false))
+          pose_graph_msgs::PoseGraphEdge loop_closure;
+          if (!AlignCandidate(candidate, false, &loop_closure)) {
+            RecordAlignment(candidate, false);
+            stream();
             continue;
+          }
+          RecordAlignment(candidate, true);
 
-          // If aligned create PoseGraphEdge msg
-          pose_graph_msgs::PoseGraphEdge loop_closure =
-                  CreateLoopClosureEdge(key_from, key_to, transform, covariance);
           closed_keyes_.insert(key_from);
           closed_keyes_.insert(key_to);
-          loop_closure.range_error = icp_fitness;
+          closed_loop_closures_.Insert(
+              MakeLoopClosureId(key_from, key_to, candidate.type));
           output_queue_.push_back(loop_closure);
+          stream();
       }
   } else {
-    ROS_DEBUG_STREAM("Threaded, Queue Size " << n);
-    std::vector<std::future<std::pair<bool, pose_graph_msgs::PoseGraphEdge>>>
-        futures;
-    // Iterate and compute transforms
-    for (size_t i = 0; i < n; i++) {
-      auto candidate = input_queue_.front();
-      input_queue_.pop();
-      // Keyed scans do not exist
-      if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end() ||
-          keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-        if ((ros::Time::now() - candidate.header.stamp).toSec() <
-            keyed_scans_max_delay_)
-          input_queue_.push(candidate);
-        if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end()) {
-          ROS_INFO_STREAM("Missing Candidate for " << candidate.key_from);
-        }
+    ROS_DEBUG_STREAM("Threaded, Queue Size " << candidates.size());
+    // Every scan (and feature set) of the batch is built once, in parallel,
+    // instead of by whichever alignments reach it first
+    PrefetchPreparedScans(candidates);
+    if (b_one_to_many_) {
+      candidates = AlignSharedSources(candidates);
+      stream();
+    }
+    // Closed keys are recorded here as the alignments complete, workers only
+    // read
+    AlignBatch(
+        candidates,
+        [this, &candidates, &stream](
+            size_t i,
+            const std::pair<bool, pose_graph_msgs::PoseGraphEdge>& result) {
+          bool alignment_was_successful = result.first;
+          RecordAlignment(candidates[i], alignment_was_successful);
+          if (alignment_was_successful) {
+            closed_keyes_.insert(result.second.key_from);
+            closed_keyes_.insert(result.second.key_to);
+            closed_loop_closures_.Insert(MakeLoopClosureId(
+                candidates[i].key_from,
+                candidates[i].key_to,
+                candidates[i].type));
+            output_queue_.push_back(result.second);
+          }
+          stream();
+        },
+        stream);
+  }
+  compute_time_ += (ros::WallTime::now() - compute_start).toSec();
+}
+
+bool IcpLoopComputation::AlignCandidate(
+    const pose_graph_msgs::LoopCandidate& candidate,
+    bool re_initialize_icp,
+    pose_graph_msgs::PoseGraphEdge* loop_closure) {
+  gtsam::Pose3 pose_from = lamp_utils::ToGtsam(candidate.pose_from);
+  gtsam::Pose3 pose_to = lamp_utils::ToGtsam(candidate.pose_to);
+
+  gu::Transform3 transform;
+  gtsam::Matrix66 covariance;
+  double icp_fitness;
+  if (!PerformAlignment(candidate.key_from,
+                        candidate.key_to,
+                        pose_from,
+                        pose_to,
+                        &transform,
+                        &covariance,
+                        &icp_fitness,
+                        re_initialize_icp)) {
+    return false;
+  }
+  // If aligned create PoseGraphEdge msg
+  *loop_closure = CreateLoopClosureEdge(
+      candidate.key_from, candidate.key_to, transform, covariance);
+  loop_closure->range_error = icp_fitness;
+  return true;
+}
 
-        if (keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
-          ROS_INFO_STREAM("Missing Candidate for " << candidate.key_to);
+std::vector<std::pair<bool, pose_graph_msgs::PoseGraphEdge>>
+IcpLoopComputation::AlignBatch(
+    const std::vector<pose_graph_msgs::LoopCandidate>& candidates,
+    const ResultCallback& on_result,
+    const std::function<void()>& on_wait) {
+  // Indices of the alignments done, in the order they complete
+  struct Completions {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<size_t> done;
+  };
+  auto completions = std::make_shared<Completions>();
+  std::vector<std::future<std::pair<bool, pose_graph_msgs::PoseGraphEdge>>>
+      futures;
+  futures.reserve(candidates.size());
+  for (size_t i = 0; i < candidates.size(); i++) {
+    const pose_graph_msgs::LoopCandidate& candidate = candidates[i];
+    futures.emplace_back(
+        icp_computation_pool_.enqueue([this, candidate, i, completions]() {
+          pose_graph_msgs::PoseGraphEdge loop_closure;
+          const bool b_success =
+              AlignCandidate(candidate, true, &loop_closure);
+          {
+            std::lock_guard<std::mutex> lock(completions->mutex);
+            completions->done.push_back(i);
+          }
+          completions->cv.notify_one();
+          return std::make_pair(b_success, loop_closure);
+        }));
+  }
+
+  std::vector<std::pair<bool, pose_graph_msgs::PoseGraphEdge>> results(
+      futures.size());
+  const std::chrono::duration<double> wait_period(
+      std::max(stream_window_, 0.01));
+  for (size_t n_done = 0; n_done < futures.size();) {
+    size_t i;
+    {
+      std::unique_lock<std::mutex> lock(completions->mutex);
+      if (!completions->cv.wait_for(lock, wait_period, [&completions] {
+            return !completions->done.empty();
+          })) {
+        lock.unlock();
+        if (on_wait) {
+          on_wait();
         }
         continue;
       }
+      i = completions->done.front();
+      completions->done.pop_front();
+    }
+    // Set right after the index is pushed
+    results[i] = futures[i].get();
+    n_done++;
+    if (on_result) {
+      on_result(i, results[i]);
+    }
+  }
+  return results;
+}
 
-      // pose_graph_msgs::LoopCandidate* candidate_ptr = new
-      // pose_graph_msgs::LoopCandidate(candidate);
-      futures.emplace_back(icp_computation_pool_.enqueue([&, candidate]() {
-        gtsam::Key key_from = candidate.key_from;
-        gtsam::Key key_to = candidate.key_to;
-        gtsam::Pose3 pose_from = lamp_utils::ToGtsam(candidate.pose_from);
-        gtsam::Pose3 pose_to = lamp_utils::ToGtsam(candidate.pose_to);
+void IcpLoopComputation::WorkerCallback(
+    const pose_graph_msgs::LoopComputationWorker::ConstPtr& msg) {
+  // Stamped on receipt, the clocks of the robots may be off
+  leases_.Heartbeat(msg->name,
+                    static_cast<size_t>(std::max(msg->capacity, 0)),
+                    msg->robot_prefixes,
+                    ros::Time::now().toSec());
+}
 
-        if (!CheckReclosingDistance(key_from, key_to)) {
-          return std::make_pair(false, pose_graph_msgs::PoseGraphEdge());
-        }
+void IcpLoopComputation::LeaseResultCallback(
+    const pose_graph_msgs::LoopComputationResult::ConstPtr& msg) {
+  std::lock_guard<std::mutex> lock(lease_results_mutex_);
+  lease_results_.push_back(msg);
+}
+
+void IcpLoopComputation::RequeueCandidate(
+    const pose_graph_msgs::LoopCandidate& candidate) {
+  returned_candidates_.Insert(MakeLoopClosureId(
+      candidate.key_from, candidate.key_to, candidate.type));
+  input_queue_.push(candidate);
+}
+
+void IcpLoopComputation::MergeLeaseResults() {
+  std::vector<pose_graph_msgs::LoopComputationResult::ConstPtr> results;
+  {
+    std::lock_guard<std::mutex> lock(lease_results_mutex_);
+    results.swap(lease_results_);
+  }
 
-        gu::Transform3 transform;
-        gtsam::Matrix66 covariance;
-        double icp_fitness;
-        if (!PerformAlignment(key_from,
-                              key_to,
-                              pose_from,
-                              pose_to,
-                              &transform,
-                              &covariance,
-                              &icp_fitness,
-                              true))
-          return std::make_pair(false, pose_graph_msgs::PoseGraphEdge());
-        // If aligned create PoseGraphEdge msg
-        pose_graph_msgs::PoseGraphEdge loop_closure =
-            CreateLoopClosureEdge(key_from, key_to, transform, covariance);
-        closed_keyes_.insert(key_from);
-        closed_keyes_.insert(key_to);
-        loop_closure.range_error = icp_fitness;
-        return std::make_pair(true, loop_closure);
-      }));
+  std::vector<pose_graph_msgs::LoopCandidate> candidates;
+  for (const auto& result : results) {
+    if (!leases_.Complete(result->lease_id, result->worker, &candidates)) {
+      // Requeued already, the candidates are aligned here
+      ROS_WARN_STREAM("IcpLoopComputation: Dropping late result of lease "
+                      << result->lease_id << " from " << result->worker);
+      continue;
+    }
+    if (result->outcomes.size() != candidates.size()) {
+      ROS_WARN_STREAM("IcpLoopComputation: Malformed result of lease "
+                      << result->lease_id << " from " << result->worker);
+      for (const auto& candidate : candidates) {
+        RequeueCandidate(candidate);
       }
-      for (auto &future : futures) {
-          future.wait();
-          auto result = future.get();
-          bool alignment_was_successful = result.first;
-          if (alignment_was_successful) {
-              output_queue_.push_back(result.second);
-          }
+      continue;
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+      const pose_graph_msgs::LoopCandidate& candidate = candidates[i];
+      switch (result->outcomes[i]) {
+      case pose_graph_msgs::LoopComputationResult::ACCEPTED:
+        RecordAlignment(candidate, true);
+        closed_loop_closures_.Insert(MakeLoopClosureId(
+            candidate.key_from, candidate.key_to, candidate.type));
+        break;
+      case pose_graph_msgs::LoopComputationResult::REJECTED:
+        RecordAlignment(candidate, false);
+        break;
+      default:
+        RequeueCandidate(candidate);
+      }
+    }
+    for (const auto& loop_closure : result->loop_closures) {
+      closed_keyes_.insert(loop_closure.key_from);
+      closed_keyes_.insert(loop_closure.key_to);
+      output_queue_.push_back(loop_closure);
+    }
+    compute_time_ += result->compute_time;
+  }
+
+  candidates.clear();
+  const size_t num_expired =
+      leases_.Expire(ros::Time::now().toSec(), &candidates);
+  if (num_expired > 0) {
+    ROS_WARN_STREAM("IcpLoopComputation: " << num_expired
+                                           << " leases timed out, requeued "
+                                           << candidates.size()
+                                           << " candidates");
+  }
+  for (const auto& candidate : candidates) {
+    RequeueCandidate(candidate);
+  }
+}
+
+void IcpLoopComputation::DistributeCandidates(
+    std::vector<pose_graph_msgs::LoopCandidate>* candidates,
+    std::vector<pose_graph_msgs::LoopCandidate>* remote_candidates) {
+  // Candidates back from a worker stay here
+  std::vector<pose_graph_msgs::LoopCandidate> leasable, local;
+  for (const auto& candidate : *candidates) {
+    if (returned_candidates_.Contains(MakeLoopClosureId(
+            candidate.key_from, candidate.key_to, candidate.type))) {
+      local.push_back(candidate);
+    } else {
+      leasable.push_back(candidate);
+    }
+  }
+
+  // The ones only a worker can align go first
+  const double now = ros::Time::now().toSec();
+  std::vector<CandidateLeases::Lease> leases;
+  leases_.Assign(remote_candidates, now, &leases);
+  leases_.Assign(&leasable, now, &leases);
+
+  for (const auto& lease : leases) {
+    pose_graph_msgs::LoopComputationLease msg;
+    msg.header.stamp = ros::Time::now();
+    msg.lease_id = lease.id;
+    msg.worker = lease.worker;
+    msg.deadline = ros::Time(lease.deadline);
+    msg.candidates = lease.candidates;
+    lease_pub_.publish(msg);
+  }
+
+  *candidates = std::move(local);
+  candidates->insert(candidates->end(), leasable.begin(), leasable.end());
+}
+
+void IcpLoopComputation::LeaseCallback(
+    const pose_graph_msgs::LoopComputationLease::ConstPtr& msg) {
+  if (msg->worker != worker_name_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(pending_leases_mutex_);
+  pending_leases_.push_back(msg);
+}
+
+void IcpLoopComputation::ComputeLeases() {
+  std::vector<pose_graph_msgs::LoopComputationLease::ConstPtr> leases;
+  {
+    std::lock_guard<std::mutex> lock(pending_leases_mutex_);
+    leases.swap(pending_leases_);
+  }
+
+  for (const auto& lease : leases) {
+    // The coordinator requeued it already
+    if (lease->deadline < ros::Time::now()) {
+      continue;
+    }
+    const ros::WallTime compute_start = ros::WallTime::now();
+    pose_graph_msgs::LoopComputationResult result;
+    result.lease_id = lease->lease_id;
+    result.worker = worker_name_;
+    result.outcomes.resize(lease->candidates.size(),
+                           pose_graph_msgs::LoopComputationResult::REJECTED);
+
+    // Candidates with both keyed scans here, by index in the lease
+    std::vector<pose_graph_msgs::LoopCandidate> candidates;
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < lease->candidates.size(); i++) {
+      const pose_graph_msgs::LoopCandidate& candidate = lease->candidates[i];
+      if (!keyed_scans_.Has(candidate.key_from) ||
+          !keyed_scans_.Has(candidate.key_to)) {
+        result.outcomes[i] =
+            pose_graph_msgs::LoopComputationResult::MISSING_SCANS;
+        continue;
+      }
+      candidates.push_back(candidate);
+      indices.push_back(i);
+    }
+
+    std::vector<std::pair<bool, pose_graph_msgs::PoseGraphEdge>> alignments;
+    if (number_of_threads_in_icp_computation_pool_ == 1) {
+      for (const auto& candidate : candidates) {
+        pose_graph_msgs::PoseGraphEdge loop_closure;
+        const bool b_success = AlignCandidate(candidate, false, &loop_closure);
+        alignments.emplace_back(b_success, loop_closure);
+      }
+    } else {
+      PrefetchPreparedScans(candidates);
+      alignments = AlignBatch(candidates);
+    }
+    for (size_t i = 0; i < alignments.size(); i++) {
+      if (!alignments[i].first) {
+        continue;
+      }
+      result.outcomes[indices[i]] =
+          pose_graph_msgs::LoopComputationResult::ACCEPTED;
+      result.loop_closures.push_back(alignments[i].second);
+    }
+
+    result.compute_time = (ros::WallTime::now() - compute_start).toSec();
+    result.header.stamp = ros::Time::now();
+    lease_result_pub_.publish(result);
+  }
+}
+
+void IcpLoopComputation::HeartbeatTimerCallback(const ros::TimerEvent& ev) {
+  pose_graph_msgs::LoopComputationWorker msg;
+  msg.header.stamp = ros::Time::now();
+  msg.name = worker_name_;
+  msg.capacity = worker_capacity_;
+  msg.robot_prefixes = worker_robot_prefixes_;
+  worker_pub_.publish(msg);
+}
+
+std::vector<pose_graph_msgs::LoopCandidate>
+IcpLoopComputation::AlignSharedSources(
+    const std::vector<pose_graph_msgs::LoopCandidate>& candidates) {
+  // Candidates by key_from, in the order of their first candidate
+  std::vector<std::vector<pose_graph_msgs::LoopCandidate>> groups;
+  std::unordered_map<gtsam::Key, size_t> group_of_key;
+  for (const auto& candidate : candidates) {
+    const auto inserted =
+        group_of_key.emplace(candidate.key_from, groups.size());
+    if (inserted.second) {
+      groups.emplace_back();
+    }
+    groups[inserted.first->second].push_back(candidate);
+  }
+
+  std::vector<pose_graph_msgs::LoopCandidate> remaining;
+  for (const auto& group : groups) {
+    if (group.size() == 1) {
+      remaining.push_back(group.front());
+      continue;
+    }
+    const OneToManyResults results = PerformOneToManyAlignment(
+        group, one_to_many_best_k_, one_to_many_confident_fitness_);
+    for (size_t i = 0; i < group.size(); i++) {
+      const OneToManyResult& result = results[i];
+      if (!result.b_computed) {
+        num_early_rejected_++;
+        continue;
+      }
+      RecordAlignment(group[i], result.b_success);
+      if (!result.b_success) {
+        continue;
+      }
+      pose_graph_msgs::PoseGraphEdge loop_closure = CreateLoopClosureEdge(
+          group[i].key_from, group[i].key_to, result.delta, result.covariance);
+      loop_closure.range_error = result.fitness_score;
+      closed_keyes_.insert(group[i].key_from);
+      closed_keyes_.insert(group[i].key_to);
+      closed_loop_closures_.Insert(MakeLoopClosureId(
+          group[i].key_from, group[i].key_to, group[i].type));
+      output_queue_.push_back(loop_closure);
+    }
+  }
+  return remaining;
+}
+
+IcpLoopComputation::OneToManyResults
+IcpLoopComputation::PerformOneToManyAlignment(
+    const std::vector<pose_graph_msgs::LoopCandidate>& candidates,
+    size_t best_k,
+    double confident_fitness) {
+  OneToManyResults results(candidates.size());
+  if (candidates.empty()) {
+    return results;
+  }
+
+  // The shared source is prepared here once, not by the first alignments
+  // that happen to reach it
+  {
+    const std::shared_ptr<AlignmentContext> context =
+        AcquireAlignmentContext();
+    GetPreparedScan(candidates.front().key_from, SourceKind(), context->icp);
+  }
+
+  std::atomic<bool> b_confident(false);
+  std::vector<std::future<void>> futures;
+  futures.reserve(candidates.size());
+  for (size_t i = 0; i < candidates.size(); i++) {
+    futures.emplace_back(icp_computation_pool_.enqueue([&, i]() {
+      // The targets not started yet are skipped after a confident match
+      if (b_confident.load()) {
+        return;
+      }
+      const pose_graph_msgs::LoopCandidate& candidate = candidates[i];
+      OneToManyResult& result = results[i];
+      result.b_computed = true;
+      result.b_success =
+          PerformAlignment(candidate.key_from,
+                           candidate.key_to,
+                           lamp_utils::ToGtsam(candidate.pose_from),
+                           lamp_utils::ToGtsam(candidate.pose_to),
+                           &result.delta,
+                           &result.covariance,
+                           &result.fitness_score,
+                           true);
+      if (result.b_success && result.fitness_score <= confident_fitness) {
+        b_confident.store(true);
+      }
+    }));
+  }
+  for (auto& future : futures) {
+    future.wait();
+  }
+
+  // Keep the best_k alignments by fitness
+  std::vector<size_t> successes;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (results[i].b_success) {
+      successes.push_back(i);
+    }
+  }
+  if (successes.size() > best_k) {
+    std::sort(successes.begin(), successes.end(), [&](size_t a, size_t b) {
+      return results[a].fitness_score < results[b].fitness_score;
+    });
+    for (size_t j = best_k; j < successes.size(); j++) {
+      results[successes[j]].b_success = false;
+    }
+  }
+  return results;
+}
+
+std::vector<pose_graph_msgs::LoopCandidate>
+IcpLoopComputation::SelectCandidatesForAlignment(
+    const std::vector<pose_graph_msgs::LoopCandidate>& candidates) {
+  // Group candidates whose keys are both within batch_group_key_radius_ of
+  // the first candidate of the group
+  std::vector<std::vector<size_t>> groups;
+  std::vector<size_t> group_seeds;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    const gtsam::Symbol from(candidates[i].key_from);
+    const gtsam::Symbol to(candidates[i].key_to);
+    size_t g = 0;
+    for (; g < groups.size(); g++) {
+      const gtsam::Symbol seed_from(candidates[group_seeds[g]].key_from);
+      const gtsam::Symbol seed_to(candidates[group_seeds[g]].key_to);
+      if (from.chr() == seed_from.chr() && to.chr() == seed_to.chr() &&
+          KeyDistance(from.index(), seed_from.index()) <=
+              batch_group_key_radius_ &&
+          KeyDistance(to.index(), seed_to.index()) <= batch_group_key_radius_)
+        break;
+    }
+    if (g == groups.size()) {
+      groups.push_back(std::vector<size_t>());
+      group_seeds.push_back(i);
+    }
+    groups[g].push_back(i);
+  }
+
+  // Coarse check on downsampled scans, the best member of a group goes on
+  std::map<gtsam::Key, CoarseScan> coarse_scans;
+  std::vector<pose_graph_msgs::LoopCandidate> selected;
+  for (const auto& group : groups) {
+    double best_overlap = -1;
+    size_t best = 0;
+    int num_passed = 0;
+    for (size_t i : group) {
+      const double overlap = EstimateCoarseOverlap(candidates[i], coarse_scans);
+      if (overlap < batch_min_overlap_) {
+        num_early_rejected_++;
+        continue;
       }
+      num_passed++;
+      if (overlap > best_overlap) {
+        best_overlap = overlap;
+        best = i;
+      }
+    }
+    if (num_passed == 0) {
+      continue;
+    }
+    num_deduplicated_ += num_passed - 1;
+    selected.push_back(candidates[best]);
+  }
+
+  ROS_DEBUG_STREAM("IcpLoopComputation: " << selected.size() << " of "
+                                          << candidates.size()
+                                          << " candidates selected for ICP");
+  return selected;
+}
+
+const IcpLoopComputation::CoarseScan&
+IcpLoopComputation::GetCoarseScan(const gtsam::Key& key,
+                                  std::map<gtsam::Key, CoarseScan>& cache) {
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  CoarseScan& coarse = cache[key];
+  coarse.cloud.reset(new PointCloud);
+  const PointCloudConstPtr scan = keyed_scans_.Get(key);
+  if (scan == nullptr) {
+    return coarse;
   }
+  pcl::VoxelGrid<Point> grid;
+  grid.setLeafSize(batch_voxel_size_, batch_voxel_size_, batch_voxel_size_);
+  grid.setInputCloud(scan);
+  grid.filter(*coarse.cloud);
+  if (!coarse.cloud->empty()) {
+    coarse.tree.reset(new pcl::KdTreeFLANN<Point>);
+    coarse.tree->setInputCloud(coarse.cloud);
+  }
+  return coarse;
+}
+
+double IcpLoopComputation::EstimateCoarseOverlap(
+    const pose_graph_msgs::LoopCandidate& candidate,
+    std::map<gtsam::Key, CoarseScan>& cache) {
+  const CoarseScan& source = GetCoarseScan(candidate.key_from, cache);
+  const CoarseScan& target = GetCoarseScan(candidate.key_to, cache);
+  if (source.cloud->empty() || target.tree == nullptr) {
+    return 0;
+  }
+
+  // Same initial guess as the CANDIDATE ICP initialization
+  const gtsam::Pose3 pose_21 = lamp_utils::ToGtsam(candidate.pose_to)
+                                   .between(lamp_utils::ToGtsam(candidate.pose_from));
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T.block(0, 0, 3, 3) = pose_21.rotation().matrix().cast<float>();
+  T.block(0, 3, 3, 1) = pose_21.translation().cast<float>();
+  PointCloud source_in_target;
+  pcl::transformPointCloud(*source.cloud, source_in_target, T);
+
+  const float max_sq_dist = batch_corr_dist_ * batch_corr_dist_;
+  std::vector<int> indices(1);
+  std::vector<float> sq_dists(1);
+  size_t num_overlapping = 0;
+  for (const auto& point : source_in_target.points) {
+    if (target.tree->nearestKSearch(point, 1, indices, sq_dists) > 0 &&
+        sq_dists[0] <= max_sq_dist)
+      num_overlapping++;
+  }
+  return static_cast<double>(num_overlapping) / source_in_target.size();
 }
 
 void IcpLoopComputation::ProcessTimerCallback(const ros::TimerEvent& ev) {
-  ComputeTransforms();
+  lamp_utils::MetricsRegistry& metrics = lamp_utils::MetricsRegistry::Instance();
+  static lamp_utils::Histogram& compute_ms =
+      metrics.GetHistogram("icp.compute_transforms_ms");
+  static lamp_utils::Gauge& input_queue = metrics.GetGauge("icp.input_queue");
+  static lamp_utils::Gauge& awaiting_scans =
+      metrics.GetGauge("icp.awaiting_scans");
+  static lamp_utils::Gauge& resident_bytes =
+      metrics.GetGauge("icp.scan_store_resident_bytes");
+  static lamp_utils::Gauge& spilled_bytes =
+      metrics.GetGauge("icp.scan_store_spilled_bytes");
+  queue_depth_ = input_queue_.size();
+  input_queue.Set(queue_depth_);
+  awaiting_scans.Set(awaiting_scans_.Size());
+  {
+    lamp_utils::ScopedLatency latency(compute_ms);
+    ComputeTransforms();
+  }
+  UpdateRobotFramePriors();
+
+  const lamp_utils::KeyedScanStore::Stats stats = keyed_scans_.GetStats();
+  resident_bytes.Set(stats.resident_bytes);
+  spilled_bytes.Set(stats.spilled_bytes);
+  ROS_DEBUG_STREAM("IcpLoopComputation: Scan store hits "
+                   << stats.hits << " misses " << stats.misses
+                   << " evictions " << stats.evictions << " resident "
+                   << stats.resident_bytes << "B spilled "
+                   << stats.spilled_bytes << "B");
 
   if (loop_closure_pub_.getNumSubscribers() > 0) {
     PublishLoopClosures();
   }
 }
 
+void IcpLoopComputation::UpdateRobotFramePriors() {
+  if (!b_robot_alignment_ || b_robot_alignment_running_.load()) {
+    return;
+  }
+  const double now = ros::Time::now().toSec();
+  if (now - last_robot_alignment_ < robot_alignment_period_) {
+    return;
+  }
+  last_robot_alignment_ = now;
+
+  // Poses are copied here, the job only reads the (thread safe) scan store
+  std::map<char, RobotKeyedPoses> robots;
+  for (const auto& keyed_pose : keyed_poses_) {
+    if (keyed_scans_.Has(keyed_pose.first)) {
+      robots[gtsam::Symbol(keyed_pose.first).chr()].push_back(keyed_pose);
+    }
+  }
+  std::vector<std::pair<char, char>> pairs;
+  {
+    std::lock_guard<std::mutex> lock(robot_frame_priors_mutex_);
+    for (auto a = robots.begin(); a != robots.end(); ++a) {
+      for (auto b = std::next(a); b != robots.end(); ++b) {
+        if (a->second.size() >= robot_alignment_min_keys_ &&
+            b->second.size() >= robot_alignment_min_keys_ &&
+            !robot_frame_priors_.count({a->first, b->first})) {
+          pairs.emplace_back(a->first, b->first);
+        }
+      }
+    }
+  }
+  if (pairs.empty()) {
+    return;
+  }
+
+  b_robot_alignment_running_.store(true);
+  auto job = [this, robots, pairs]() {
+    for (const auto& pair : pairs) {
+      AlignRobotMaps(pair.first,
+                     robots.at(pair.first),
+                     pair.second,
+                     robots.at(pair.second));
+    }
+    b_robot_alignment_running_.store(false);
+  };
+  // In the background behind the alignments, in the timer without a pool
+  if (icp_computation_pool_.size() > 0) {
+    icp_computation_pool_.enqueue_priority(ThreadPool::Priority::LOW, job);
+  } else {
+    job();
+  }
+}
+
+PointCloud::Ptr
+IcpLoopComputation::BuildRobotMap(const RobotKeyedPoses& poses) {
+  PointCloud::Ptr map(new PointCloud);
+  // At most robot_alignment_max_scans_ scans spread along the trajectory
+  const size_t step =
+      std::max<size_t>(poses.size() / robot_alignment_max_scans_, 1);
+  for (size_t i = 0; i < poses.size(); i += step) {
+    const PointCloudConstPtr scan = keyed_scans_.Get(poses[i].first);
+    if (scan != nullptr) {
+      lamp_utils::TransformAndAppend(*scan, poses[i].second.matrix(), map.get());
+    }
+  }
+  lamp_utils::VoxelDownsample(*map, robot_alignment_voxel_size_, map.get());
+  return map;
+}
+
+bool IcpLoopComputation::AlignRobotMaps(char robot_a,
+                                        const RobotKeyedPoses& poses_a,
+                                        char robot_b,
+                                        const RobotKeyedPoses& poses_b) {
+  lamp_utils::TraceSpan span("loop_computation.robot_alignment");
+  const PointCloud::Ptr map_a = BuildRobotMap(poses_a);
+  const PointCloud::Ptr map_b = BuildRobotMap(poses_b);
+  if (map_a->empty() || map_b->empty()) {
+    return false;
+  }
+
+  // Same global registration as the TEASERPP initialization, kept only if
+  // it does better than identity
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  GetTeaserInitialAlignment(
+      *ComputeScanFeatures(map_a), *ComputeScanFeatures(map_b), &T);
+  if (T.isIdentity()) {
+    return false;
+  }
+
+  // Fraction of map a within corr_dist of map b once aligned
+  PointCloud a_in_b;
+  lamp_utils::TransformPointCloud(*map_a, T.cast<double>(), &a_in_b);
+  pcl::KdTreeFLANN<Point> tree;
+  tree.setInputCloud(map_b);
+  const float max_sq_dist =
+      robot_alignment_corr_dist_ * robot_alignment_corr_dist_;
+  std::vector<int> indices(1);
+  std::vector<float> sq_dists(1);
+  size_t num_overlapping = 0;
+  for (const auto& point : a_in_b.points) {
+    if (tree.nearestKSearch(point, 1, indices, sq_dists) > 0 &&
+        sq_dists[0] <= max_sq_dist)
+      num_overlapping++;
+  }
+  const double overlap = static_cast<double>(num_overlapping) / a_in_b.size();
+  if (overlap < robot_alignment_min_overlap_) {
+    ROS_DEBUG_STREAM("IcpLoopComputation: Maps of robots "
+                     << robot_a << " and " << robot_b
+                     << " not aligned, overlap " << overlap);
+    return false;
+  }
+
+  const gtsam::Pose3 T_ba(T.cast<double>());
+  ROS_INFO_STREAM("IcpLoopComputation: Aligned the frames of robots "
+                  << robot_a << " and " << robot_b << " with overlap "
+                  << overlap);
+  std::lock_guard<std::mutex> lock(robot_frame_priors_mutex_);
+  robot_frame_priors_[{robot_a, robot_b}] = T_ba;
+  robot_frame_priors_[{robot_b, robot_a}] = T_ba.inverse();
+  return true;
+}
+
+bool IcpLoopComputation::GetRobotFramePrior(char robot_from,
+                                            char robot_to,
+                                            gtsam::Pose3* prior) {
+  if (robot_from == robot_to) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(robot_frame_priors_mutex_);
+  const auto it = robot_frame_priors_.find({robot_from, robot_to});
+  if (it == robot_frame_priors_.end()) {
+    return false;
+  }
+  *prior = it->second;
+  return true;
+}
+
 void IcpLoopComputation::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
-  if (keyed_scans_.find(key) != keyed_scans_.end()) {
+  if (keyed_scans_.Has(key)) {
     ROS_DEBUG_STREAM("KeyedScanCallback: Key "
                      << gtsam::DefaultKeyFormatter(key)
                      << " already has a scan. Not adding.");
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  // Converted once per process and shared with the other scan consumers
+  PointCloudConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*scan_msg);
 
   // Add the key and scan.
-  keyed_scans_.insert(std::pair<gtsam::Key, PointCloudConstPtr>(key, scan));
+  keyed_scans_.Insert(key, scan);
+  awaiting_scans_.Release(key);
 }
 
 void IcpLoopComputation::KeyedPoseCallback(
@@ -412,8 +1693,35 @@ void IcpLoopComputation::KeyedPoseCallback(
                                  node_msg.pose.orientation.z);
     new_pose = gtsam::Pose3(pose_orientation, pose_translation);
 
-    // add new key and pose to keyed_poses_
-    keyed_poses_[new_key] = new_pose;
+    AddKeyedPose(new_key, new_pose);
+  }
+}
+
+void IcpLoopComputation::AddKeyedPose(const gtsam::Key& key,
+                                      const gtsam::Pose3& pose) {
+  // add new key and pose to keyed_poses_
+  keyed_poses_.emplace(key, pose);
+}
+
+void IcpLoopComputation::PageInPriorMapScan(const gtsam::Key& key) {
+  if (!prior_map_.IsOpen() || keyed_scans_.Has(key) ||
+      keyed_poses_.count(key) > 0)
+    return;
+  gtsam::Pose3 pose;
+  if (!prior_map_.GetPose(key, &pose))
+    return;
+  const PointCloud::Ptr scan = prior_map_.ReadScan(key);
+  if (!scan)
+    return;
+  AddKeyedPose(key, pose);
+  keyed_scans_.Insert(key, scan);
+}
+
+void IcpLoopComputation::OptimizedValuesCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  std::lock_guard<std::mutex> lock(submap_poses_mutex_);
+  for (const auto& node_msg : graph_msg->nodes) {
+    submap_poses_[node_msg.key] = lamp_utils::ToGtsam(node_msg.pose);
   }
 }
 
@@ -424,7 +1732,9 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
                                           gu::Transform3* delta,
                                           gtsam::Matrix66* covariance,
                                           double* fitness_score,
-                                          bool re_initialize_icp) {
+                                          bool re_initialize_icp,
+                                          bool b_candidate_guess) {
+  lamp_utils::TraceSpan span("loop_computation.icp", key2);
   ROS_DEBUG_STREAM("Performing alignment between "
                    << gtsam::DefaultKeyFormatter(key1) << " and "
                    << gtsam::DefaultKeyFormatter(key2));
@@ -435,7 +1745,7 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   }
 
   // Check for available information
-  if (!keyed_scans_.count(key1) || !keyed_scans_.count(key2)) {
+  if (!keyed_scans_.Has(key1) || !keyed_scans_.Has(key2)) {
     ROS_WARN(
         "PerformAlignment: Missing keyed-scans when performing alignment. ");
     return false;
@@ -448,8 +1758,8 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   }
 
   // Get poses and keys
-  const PointCloudConstPtr scan1 = keyed_scans_.at(key1.key());
-  const PointCloudConstPtr scan2 = keyed_scans_.at(key2.key());
+  const PointCloudConstPtr scan1 = keyed_scans_.Get(key1.key());
+  const PointCloudConstPtr scan2 = keyed_scans_.Get(key2.key());
 
   if (scan1 == NULL || scan2 == NULL) {
     ROS_ERROR("PerformAlignment: Null point clouds.");
@@ -464,28 +1774,65 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
     return false;
   }
 
-  PointCloud::Ptr accumulated_target(new PointCloud);
-  *accumulated_target = *scan2;
-  AccumulateScans(key2, accumulated_target);
+  AlignmentTimer timer(this);
 
-  PointCloud::Ptr accumulated_source(new PointCloud);
-  *accumulated_source = *scan1;
+  Gicp* icp = &icp_;
+  PointCloud::Ptr icp_result;
+  std::shared_ptr<AlignmentContext> context;
+  if (re_initialize_icp) {
+    context = AcquireAlignmentContext();
+    icp = &context->icp;
+    icp_result = context->icp_result;
+  } else {
+    icp_result.reset(new PointCloud);
+  }
 
-  if (b_accumulate_source_) {
-    AccumulateScans(key1, accumulated_source);
+  // In area mode the target is the submap of the area key2 lies in, shared
+  // by every candidate of the area and in the frame of its anchor
+  gtsam::Key target_key = key2;
+  gtsam::Pose3 key2_in_target;
+  PreparedScanKind target_kind = PreparedScanKind::SUBMAP;
+  if (b_area_submaps_) {
+    target_key = GetAreaAnchor(key2, &key2_in_target);
+    target_kind = PreparedScanKind::AREA;
   }
 
-  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>* icp;
-  if (re_initialize_icp){
-    icp = new  pcl::MultithreadedGeneralizedIterativeClosestPoint<Point, Point>();
-    SetupICP(*icp);
-  } else {
-      icp = &icp_;
+  // Search trees and covariances are built once per scan and shared by all
+  // the alignments the scan takes part in
+  const PreparedScanConstPtr target =
+      GetPreparedScan(target_key, target_kind, *icp);
+  const PreparedScanConstPtr source = GetPreparedScan(key1, SourceKind(), *icp);
+  if (target == nullptr || source == nullptr) {
+    ROS_ERROR("PerformAlignment: Failed to prepare point clouds.");
+    return false;
   }
-  icp->setInputSource(accumulated_source);
-  icp->setInputTarget(accumulated_target);
-  if (accumulated_source->size() < 20) {
-    icp->setCorrespondenceRandomness(accumulated_source->size());
+
+  // Other candidates of the source into the same area give the same
+  // alignment, only the first one is computed until the submap is rebuilt
+  if (target_kind == PreparedScanKind::AREA) {
+    std::lock_guard<std::mutex> lock(area_mutex_);
+    if (!area_attempts_.emplace(target_key, key1).second) {
+      ROS_DEBUG_STREAM("PerformAlignment: "
+                       << gtsam::DefaultKeyFormatter(key1)
+                       << " already aligned to the area of "
+                       << gtsam::DefaultKeyFormatter(target_key));
+      return false;
+    }
+  }
+  const PointCloudConstPtr accumulated_target = target->cloud;
+  const PointCloudConstPtr accumulated_source = source->cloud;
+  timer.timings.accumulation = timer.Mark();
+
+  if (icp_backend_ == IcpBackend::CPU) {
+    icp->setInputSource(accumulated_source);
+    icp->setSourceCovariances(source->covariances);
+    icp->setSearchMethodSource(source->tree, true);
+    icp->setInputTarget(accumulated_target);
+    icp->setTargetCovariances(target->covariances);
+    icp->setSearchMethodTarget(target->tree, true);
+    if (accumulated_source->size() < 20) {
+      icp->setCorrespondenceRandomness(accumulated_source->size());
+    }
   }
 
   ///// ICP initialization scheme
@@ -494,11 +1841,72 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   // or initialize with 0 translation byt rotation from odom
   Eigen::Matrix4f initial_guess;
   gtsam::Pose3 pose_21 = keyed_poses_[key2].between(keyed_poses_[key1]);
+  IcpInitMethod init_method =
+      b_candidate_guess ? IcpInitMethod::CANDIDATE : icp_init_method_;
+  // Inter robot candidates start from the map level alignment of the two
+  // robot frames, once there is one, rather than from identity or odometry
+  gtsam::Pose3 robot_frame_prior;
+  if ((init_method == IcpInitMethod::IDENTITY ||
+       init_method == IcpInitMethod::ODOMETRY ||
+       init_method == IcpInitMethod::ODOM_ROTATION) &&
+      GetRobotFramePrior(key1.chr(), key2.chr(), &robot_frame_prior)) {
+    pose_21 =
+        keyed_poses_[key2].between(robot_frame_prior * keyed_poses_[key1]);
+    init_method = IcpInitMethod::ODOMETRY;
+  }
+
+  // The same alignment may have been computed by an earlier run
+  AlignmentCacheKey cache_key;
+  const bool b_cache = alignment_cache_.IsOpen();
+  if (b_cache) {
+    lamp_utils::MetricsRegistry& metrics =
+        lamp_utils::MetricsRegistry::Instance();
+    static lamp_utils::Counter& cache_hits =
+        metrics.GetCounter("icp.alignment_cache.hits");
+    static lamp_utils::Counter& cache_misses =
+        metrics.GetCounter("icp.alignment_cache.misses");
+    cache_key.key_from = key1.key();
+    cache_key.key_to = key2.key();
+    const int method = static_cast<int>(init_method);
+    uint64_t hash = AlignmentCache::Hash(&method, sizeof(method));
+    hash = AlignmentCache::Hash(
+        &source->content_hash, sizeof(source->content_hash), hash);
+    hash = AlignmentCache::Hash(
+        &target->content_hash, sizeof(target->content_hash), hash);
+    hash = HashPose(pose_21, hash);
+    if (init_method == IcpInitMethod::CANDIDATE) {
+      hash = HashPose(pose2.between(pose1), hash);
+    }
+    if (target_kind == PreparedScanKind::AREA) {
+      hash = HashPose(key2_in_target, hash);
+    }
+    cache_key.content_hash = hash;
+    cache_key.params_hash = alignment_params_hash_;
+
+    AlignmentCacheEntry cached;
+    if (alignment_cache_.Lookup(cache_key, &cached)) {
+      cache_hits.Increment();
+      if (cached.b_accepted) {
+        *delta = cached.delta;
+        *covariance = cached.covariance;
+        *fitness_score = cached.fitness;
+      }
+      timer.timings.b_success = cached.b_accepted;
+      return cached.b_accepted;
+    }
+    cache_misses.Increment();
+  }
+  CachedOutcome outcome(b_cache ? &alignment_cache_ : nullptr,
+                        cache_key,
+                        delta,
+                        covariance,
+                        fitness_score);
+
   initial_guess = Eigen::Matrix4f::Identity(4, 4);
   initial_guess.block(0, 0, 3, 3) = pose_21.rotation().matrix().cast<float>();
   initial_guess.block(0, 3, 3, 1) = pose_21.translation().cast<float>();
 
-  switch (icp_init_method_) {
+  switch (init_method) {
   case IcpInitMethod::IDENTITY: // initialize with idientity
   {
     initial_guess = Eigen::Matrix4f::Identity(4, 4);
@@ -516,8 +1924,8 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   } break;
   case IcpInitMethod::FEATURES: {
     double sac_fitness_score = sac_fitness_score_threshold_;
-    GetSacInitialAlignment(accumulated_source,
-                           accumulated_target,
+    GetSacInitialAlignment(*GetScanFeatures(*source),
+                           *GetScanFeatures(*target),
                            &initial_guess,
                            sac_fitness_score);
     if (sac_fitness_score >= sac_fitness_score_threshold_) {
@@ -527,7 +1935,7 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   } break;
   case IcpInitMethod::TEASERPP: {
     GetTeaserInitialAlignment(
-        accumulated_source, accumulated_target, &initial_guess);
+        *GetScanFeatures(*source), *GetScanFeatures(*target), &initial_guess);
   } break;
   case IcpInitMethod::CANDIDATE: {
     gtsam::Pose3 candidate_pose21 = pose2.between(pose1);
@@ -541,61 +1949,129 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
     initial_guess = Eigen::Matrix4f::Identity(4, 4);
   }
   }
+  // Feature guesses are found against the area submap, the others are
+  // relative to key2
+  if (init_method != IcpInitMethod::FEATURES &&
+      init_method != IcpInitMethod::TEASERPP) {
+    initial_guess = key2_in_target.matrix().cast<float>() * initial_guess;
+  }
+
+  timer.timings.initialization = timer.Mark();
 
   // Perform ICP_.
-  PointCloud::Ptr icp_result(new PointCloud);
-  icp->align(*icp_result, initial_guess);
+  Eigen::Matrix4f T;
+  bool b_icp_converged;
+  double icp_fitness_score;
+  if (icp_backend_ == IcpBackend::CUDA) {
+    CudaGicp cuda_icp;
+    cuda_icp.SetParams(cuda_icp_params_);
+    if (!cuda_icp.Align(accumulated_source, accumulated_target, initial_guess))
+      return false;
+    T = cuda_icp.GetFinalTransformation();
+    pcl::transformPointCloud(*accumulated_source, *icp_result, T);
+    b_icp_converged = cuda_icp.HasConverged();
+    icp_fitness_score = cuda_icp.GetFitnessScore();
+    timer.timings.gicp_iterations = cuda_icp.GetNumIterations();
+  } else if (icp_backend_ == IcpBackend::VGICP) {
+    Vgicp vgicp;
+    vgicp.SetParams(vgicp_params_);
+    if (!vgicp.Align(*accumulated_source,
+                     *source->covariances,
+                     *GetScanVoxels(*target),
+                     initial_guess))
+      return false;
+    T = vgicp.GetFinalTransformation();
+    pcl::transformPointCloud(*accumulated_source, *icp_result, T);
+    b_icp_converged = vgicp.HasConverged();
+    icp_fitness_score = FitnessScore(*icp_result, *target->tree);
+    timer.timings.gicp_iterations = vgicp.GetNumIterations();
+  } else {
+    double previous_sq_distance = std::numeric_limits<double>::max();
+    if (b_early_abort_) {
+      icp->setIterationCallback([&](const pcl::GicpIterationState& state) {
+        timer.timings.abort_reason =
+            EarlyAbortReason(state, previous_sq_distance);
+        previous_sq_distance = state.mean_sq_distance;
+        return timer.timings.abort_reason.empty();
+      });
+    }
+    icp->align(*icp_result, initial_guess);
+    icp->setIterationCallback(pcl::GicpIterationCallback());
+    // Get resulting transform.
+    T = icp->getFinalTransformation();
+    b_icp_converged = icp->hasConverged();
+    icp_fitness_score = icp->getFitnessScore();
+    timer.timings.gicp_iterations = icp->getNumIterations();
+  }
+  RecordIterations(timer.timings);
+  timer.timings.gicp = timer.Mark();
 
-  // Get resulting transform.
-  const Eigen::Matrix4f T = icp->getFinalTransformation();
+  // Catch nan of infs in icp result
+  if (!T.allFinite())
+    return false;
 
-  // Get the correspondence indices
-  std::vector<size_t> correspondences;
+  // Get the correspondence indices, the CPU GICP has them from its last
+  // iteration, the other backends take the nearest target point
+  std::vector<int> source_indices, target_indices;
   if (icp_covariance_method_ == IcpCovarianceMethod::POINT2PLANE) {
-    KdTree::Ptr search_tree = icp->getSearchMethodTarget();
-    for (auto point : icp_result->points) {
-      // Catch nan of infs in icp result
-      if (!pcl::isFinite(point))
+    if (icp_backend_ == IcpBackend::CPU) {
+      source_indices = icp->getFinalSourceIndices();
+      target_indices = icp->getFinalTargetIndices();
+    } else {
+      const KdTree& search_tree = *target->tree;
+      source_indices.resize(icp_result->size());
+      std::iota(source_indices.begin(), source_indices.end(), 0);
+      target_indices.assign(icp_result->size(), 0);
+      int failure = 0;
+#pragma omp parallel for schedule(dynamic, 64) num_threads(icp_threads_)
+      for (size_t i = 0; i < icp_result->size(); i++) {
+        if (!pcl::isFinite(icp_result->points[i])) {
+          failure = 1;
+          continue;
+        }
+        std::vector<int> matched_indices(1);
+        std::vector<float> matched_distances(1);
+        search_tree.nearestKSearch(
+            icp_result->points[i], 1, matched_indices, matched_distances);
+        target_indices[i] = matched_indices[0];
+      }
+      if (failure)
         return false;
-
-      std::vector<int> matched_indices;
-      std::vector<float> matched_distances;
-      search_tree->nearestKSearch(point, 1, matched_indices, matched_distances);
-      correspondences.push_back(matched_indices[0]);
     }
   }
 
-  delta->translation = gu::Vec3(T(0, 3), T(1, 3), T(2, 3));
-  delta->rotation = gu::Rot3(T(0, 0),
-                             T(0, 1),
-                             T(0, 2),
-                             T(1, 0),
-                             T(1, 1),
-                             T(1, 2),
-                             T(2, 0),
-                             T(2, 1),
-                             T(2, 2));
+  // Back from the frame of the target to the one of key2
+  const Eigen::Matrix4f T_key2 =
+      key2_in_target.inverse().matrix().cast<float>() * T;
+  delta->translation = gu::Vec3(T_key2(0, 3), T_key2(1, 3), T_key2(2, 3));
+  delta->rotation = gu::Rot3(T_key2(0, 0),
+                             T_key2(0, 1),
+                             T_key2(0, 2),
+                             T_key2(1, 0),
+                             T_key2(1, 1),
+                             T_key2(1, 2),
+                             T_key2(2, 0),
+                             T_key2(2, 1),
+                             T_key2(2, 2));
 
   // Is the transform good?
-  if (!icp->hasConverged()) {
-    ROS_DEBUG_STREAM(
-        "ICP: Not converged, score is: " << icp->getFitnessScore());
+  if (!b_icp_converged) {
+    ROS_DEBUG_STREAM("ICP: Not converged, score is: " << icp_fitness_score);
     return false;
   }
 
-  *fitness_score = icp->getFitnessScore();
+  *fitness_score = icp_fitness_score;
 
   if (*fitness_score > max_tolerable_fitness_) {
     ROS_INFO_STREAM("ICP: Converged or max iterations reached, but score: "
-                    << icp->getFitnessScore()
+                    << icp_fitness_score
                     << ", Exceeds threshold: " << max_tolerable_fitness_);
     return false;
   }
 
   // Check if the rotation exceeds thresholds
   // Get difference between odom and icp estimation
-  gtsam::Pose3 diff = (keyed_poses_[key2].between(keyed_poses_[key1]))
-                          .between(lamp_utils::ToGtsam(*delta));
+  gtsam::Pose3 diff = pose_21.between(lamp_utils::ToGtsam(*delta));
   gtsam::Vector diff_log = gtsam::Pose3::Logmap(diff);
   double trans_diff =
       std::sqrt(diff_log.tail(3).transpose() * diff_log.tail(3));
@@ -629,16 +2105,29 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
           icp_result, T, *fitness_score, *covariance);
       break;
     case (IcpCovarianceMethod::POINT2PLANE):
-      ComputeICPCovariancePointPlane(
-          scan1, scan2, correspondences, T, covariance);
+      ComputeICPCovariancePointPlane(*accumulated_source,
+                                     *accumulated_target,
+                                     source_indices,
+                                     target_indices,
+                                     T,
+                                     covariance);
       break;
     default:
       ROS_ERROR(
           "Unknown method for ICP covariance calculation for loop closures. "
           "Check config.");
     }
+    // Computed in the frame of the area anchor
+    if (target_kind == PreparedScanKind::AREA) {
+      const gtsam::Matrix66 adjoint = key2_in_target.inverse().AdjointMap();
+      *covariance = adjoint * *covariance * adjoint.transpose();
+    }
   }
 
+  timer.timings.covariance = timer.Mark();
+  timer.timings.b_success = true;
+  outcome.b_accepted = true;
+
   ROS_INFO_STREAM("Successfully completed alignment between "
                   << gtsam::DefaultKeyFormatter(key1) << " and "
                   << gtsam::DefaultKeyFormatter(key2)
@@ -647,53 +2136,119 @@ bool IcpLoopComputation::PerformAlignment(const gtsam::Symbol& key1,
   return true;
 }
 
+IcpLoopComputation::ScanFeaturesConstPtr
+IcpLoopComputation::ComputeScanFeatures(PointCloudConstPtr scan) const {
+  std::shared_ptr<ScanFeatures> features(new ScanFeatures);
+  Normals::Ptr normals(new Normals);
+  lamp_utils::ExtractNormals(scan, normals);
+
+  features->keypoints.reset(new PointCloud);
+  lamp_utils::ComputeKeypoints(
+      scan, normals, harris_params_, icp_threads_, features->keypoints);
+
+  features->descriptors.reset(new Features);
+  lamp_utils::ComputeFeatures(features->keypoints,
+                              scan,
+                              normals,
+                              sac_features_radius_,
+                              icp_threads_,
+                              features->descriptors);
+
+  if (!features->keypoints->empty()) {
+    features->tree.reset(new FeatureTree);
+    features->tree->setInputCloud(features->descriptors);
+  }
+  return features;
+}
+
+IcpLoopComputation::ScanFeaturesConstPtr
+IcpLoopComputation::GetScanFeatures(const PreparedScan& scan) const {
+  std::lock_guard<std::mutex> lock(scan.features_mutex);
+  if (!scan.features) {
+    scan.features = ComputeScanFeatures(scan.cloud);
+  }
+  return scan.features;
+}
+
+VoxelGaussianMapConstPtr
+IcpLoopComputation::GetScanVoxels(const PreparedScan& scan) const {
+  std::lock_guard<std::mutex> lock(scan.voxels_mutex);
+  if (!scan.voxels) {
+    scan.voxels = std::make_shared<VoxelGaussianMap>(
+        *scan.cloud, *scan.covariances, vgicp_params_.voxel_resolution);
+  }
+  return scan.voxels;
+}
+
+void IcpLoopComputation::PrefetchPreparedScans(
+    const std::vector<pose_graph_msgs::LoopCandidate>& candidates) {
+  const bool b_features = icp_init_method_ == IcpInitMethod::FEATURES ||
+      icp_init_method_ == IcpInitMethod::TEASERPP;
+  std::set<PreparedScanId> ids;
+  std::set<PreparedScanId> target_ids;
+  for (const auto& candidate : candidates) {
+    // The areas are assigned here in candidate order, so the candidates of
+    // a batch share the anchors
+    PreparedScanId target(candidate.key_to, PreparedScanKind::SUBMAP);
+    if (b_area_submaps_ && keyed_poses_.count(candidate.key_to)) {
+      gtsam::Pose3 key_in_anchor;
+      target = PreparedScanId(
+          GetAreaAnchor(candidate.key_to, &key_in_anchor),
+          PreparedScanKind::AREA);
+    }
+    ids.insert(target);
+    ids.insert(PreparedScanId(candidate.key_from, SourceKind()));
+    target_ids.insert(target);
+  }
+
+  std::vector<std::future<void>> futures;
+  futures.reserve(ids.size());
+  for (const PreparedScanId& id : ids) {
+    const bool b_voxels =
+        icp_backend_ == IcpBackend::VGICP && target_ids.count(id) > 0;
+    futures.emplace_back(
+        icp_computation_pool_.enqueue([this, id, b_features, b_voxels]() {
+          const std::shared_ptr<AlignmentContext> context =
+              AcquireAlignmentContext();
+          const PreparedScanConstPtr scan =
+              GetPreparedScan(id.first, id.second, context->icp);
+          if (scan != nullptr && b_features)
+            GetScanFeatures(*scan);
+          if (scan != nullptr && b_voxels)
+            GetScanVoxels(*scan);
+        }));
+  }
+  for (auto& future : futures) {
+    future.wait();
+  }
+}
+
 void IcpLoopComputation::GetSacInitialAlignment(PointCloudConstPtr source,
                                                 PointCloudConstPtr target,
                                                 Eigen::Matrix4f* tf_out,
                                                 double& sac_fitness_score) {
-  // Get Normals
-  Normals::Ptr source_normals(new Normals);
-  Normals::Ptr target_normals(new Normals);
-  lamp_utils::ExtractNormals(source, source_normals);
-  lamp_utils::ExtractNormals(target, target_normals);
+  GetSacInitialAlignment(*ComputeScanFeatures(source),
+                         *ComputeScanFeatures(target),
+                         tf_out,
+                         sac_fitness_score);
+}
 
-  // Get Harris keypoints for source and target
-  PointCloud::Ptr source_keypoints(new PointCloud);
-  PointCloud::Ptr target_keypoints(new PointCloud);
+void IcpLoopComputation::GetSacInitialAlignment(const ScanFeatures& source,
+                                                const ScanFeatures& target,
+                                                Eigen::Matrix4f* tf_out,
+                                                double& sac_fitness_score) {
+  if (!source.tree || !target.tree) {
+    ROS_DEBUG("SAC: no keypoints");
+    return;
+  }
 
-  lamp_utils::ComputeKeypoints(
-      source, source_normals, harris_params_, icp_threads_, source_keypoints);
-  lamp_utils::ComputeKeypoints(
-      target, target_normals, harris_params_, icp_threads_, target_keypoints);
-
-  Features::Ptr source_features(new Features);
-  Features::Ptr target_features(new Features);
-  lamp_utils::ComputeFeatures(source_keypoints,
-                         source,
-                         source_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         source_features);
-  lamp_utils::ComputeFeatures(target_keypoints,
-                         target,
-                         target_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         target_features);
-
-  // std::cout << "loop - SAC  src cloud size: " << source_keypoints->size() <<
-  // std::endl; std::cout << "loop - SAC target cloud size: " <<
-  // target_keypoints->size() << std::endl; std::cout << "loop - SAC src
-  // features size: " << source_features->size() << std::endl; std::cout <<
-  // "loop - SAC target features size: " << target_features->size() <<
-  // std::endl; Align
-  pcl::SampleConsensusInitialAlignment<Point, Point, pcl::FPFHSignature33>
-      sac_ia;
+  // Align
+  CachedTreeSacIa sac_ia;
   sac_ia.setMaximumIterations(sac_iterations_);
-  sac_ia.setInputSource(source_keypoints);
-  sac_ia.setSourceFeatures(source_features);
-  sac_ia.setInputTarget(target_keypoints);
-  sac_ia.setTargetFeatures(target_features);
+  sac_ia.setInputSource(source.keypoints);
+  sac_ia.setSourceFeatures(source.descriptors);
+  sac_ia.setInputTarget(target.keypoints);
+  sac_ia.setTargetFeatures(target.descriptors, target.tree);
   sac_ia.setCorrespondenceRandomness(5);
   PointCloud::Ptr aligned_output(new PointCloud);
   sac_ia.align(*aligned_output, *tf_out);
@@ -705,22 +2260,21 @@ void IcpLoopComputation::GetSacInitialAlignment(PointCloudConstPtr source,
 }
 
 bool IcpLoopComputation::ComputeICPCovariancePointPlane(
-    const PointCloudConstPtr& query_cloud,
-    const PointCloudConstPtr& reference_cloud,
-    const std::vector<size_t>& correspondences,
+    const PointCloud& query_cloud,
+    const PointCloud& reference_cloud,
+    const std::vector<int>& query_indices,
+    const std::vector<int>& reference_indices,
     const Eigen::Matrix4f& T,
     Eigen::Matrix<double, 6, 6>* covariance) {
-  // Get normals
-  Normals::Ptr reference_normals(new Normals);      // pc with normals
-  PointCloud::Ptr query_normalized(new PointCloud); // pc whose points have
-                                                    // been rearranged.
+  // The prepared scans carry the normals their GICP covariances come from
   Eigen::Matrix<double, 6, 6> Ap;
-
-  lamp_utils::ExtractNormals(reference_cloud, reference_normals);
-  lamp_utils::NormalizePCloud(query_cloud, query_normalized);
-
-  lamp_utils::ComputeAp_ForPoint2PlaneICP(
-      query_normalized, reference_normals, correspondences, T, Ap);
+  lamp_utils::ComputeAp_ForPoint2PlaneICP(query_cloud,
+                                          reference_cloud,
+                                          query_indices,
+                                          reference_indices,
+                                          T,
+                                          icp_threads_,
+                                          &Ap);
   // If matrix not invertible, use fixed
   if (Ap.determinant() == 0) {
     for (int i = 0; i < 3; ++i)
@@ -907,95 +2461,339 @@ bool IcpLoopComputation::ComputeICPCovariancePointPoint(
   return true;
 }
 
-void IcpLoopComputation::AccumulateScans(const gtsam::Key& key,
-                                         PointCloud::Ptr scan_out) {
+std::string
+IcpLoopComputation::EarlyAbortReason(const pcl::GicpIterationState& state,
+                                     double previous_sq_distance) const {
+  if (state.iteration < early_abort_min_iterations_) {
+    return "";
+  }
+  if (state.num_correspondences <
+      early_abort_min_inlier_ratio_ * state.num_points) {
+    return "low_inlier_ratio";
+  }
+  // The fitness score is the mean squared correspondence distance, one past
+  // the threshold that barely moves would be rejected after the last
+  // iteration anyway
+  if (state.mean_sq_distance > max_tolerable_fitness_ &&
+      state.mean_sq_distance >
+          (1.0 - early_abort_min_improvement_) * previous_sq_distance) {
+    return "fitness_stalled";
+  }
+  return "";
+}
+
+void IcpLoopComputation::SetRecordTimings(bool b_record) {
+  b_record_timings_ = b_record;
+}
+
+void IcpLoopComputation::RecordTimings(const AlignmentTimings& timings) {
+  if (!b_record_timings_)
+    return;
+  std::lock_guard<std::mutex> lock(timings_mutex_);
+  recorded_timings_.push_back(timings);
+}
+
+std::vector<IcpLoopComputation::AlignmentTimings>
+IcpLoopComputation::TakeRecordedTimings() {
+  std::lock_guard<std::mutex> lock(timings_mutex_);
+  std::vector<AlignmentTimings> timings;
+  timings.swap(recorded_timings_);
+  return timings;
+}
+
+SubmapWindow IcpLoopComputation::GetSubmapWindow(const gtsam::Key& key) {
+  SubmapWindow window;
+  std::vector<gtsam::Key> neighbors;
   for (int i = 0; i < sac_num_prev_scans_; i++) {
-    gtsam::Key prev_key = key - i - 1;
+    neighbors.push_back(key - i - 1);
+  }
+  for (int i = 0; i < sac_num_next_scans_; i++) {
+    neighbors.push_back(key + i + 1);
+  }
+
+  std::lock_guard<std::mutex> lock(submap_poses_mutex_);
+  if (!keyed_poses_.count(key))
+    return window;
+  const gtsam::Pose3 pose = SubmapPose(key);
+  for (const gtsam::Key& neighbor : neighbors) {
     // If scan doesn't exist, just skip it
-    if (!keyed_poses_.count(prev_key) || !keyed_scans_.count(prev_key)) {
+    if (!keyed_poses_.count(neighbor) || !keyed_scans_.Has(neighbor))
+      continue;
+    window.emplace_back(neighbor, pose.between(SubmapPose(neighbor)));
+  }
+  return window;
+}
+
+gtsam::Pose3 IcpLoopComputation::SubmapPose(const gtsam::Key& key) const {
+  auto optimized = submap_poses_.find(key);
+  return optimized != submap_poses_.end() ? optimized->second
+                                          : keyed_poses_.at(key);
+}
+
+SubmapWindow IcpLoopComputation::WalkArea(const gtsam::Key& anchor) const {
+  SubmapWindow window;
+  if (!keyed_poses_.count(anchor))
+    return window;
+  const gtsam::Symbol symbol(anchor);
+  const gtsam::Pose3 pose = SubmapPose(anchor);
+  SubmapWindow before;
+  for (int direction : {-1, 1}) {
+    SubmapWindow& side = direction < 0 ? before : window;
+    // Gaps of marginalized or missing nodes are stepped over
+    int misses = 0;
+    for (uint64_t offset = 1; static_cast<int>(side.size()) < area_max_scans_ &&
+         misses < area_max_scans_;
+         offset++) {
+      if (direction < 0 && offset > symbol.index())
+        break;
+      const gtsam::Key key = gtsam::Symbol(
+          symbol.chr(),
+          direction < 0 ? symbol.index() - offset : symbol.index() + offset);
+      if (!keyed_poses_.count(key) || !keyed_scans_.Has(key)) {
+        misses++;
+        continue;
+      }
+      const gtsam::Pose3 relative = pose.between(SubmapPose(key));
+      if (relative.translation().norm() > area_radius_)
+        break;
+      side.emplace_back(key, relative);
+    }
+  }
+  // In key order
+  window.insert(window.begin(), before.rbegin(), before.rend());
+  return window;
+}
+
+SubmapWindow IcpLoopComputation::GetAreaWindow(const gtsam::Key& anchor) {
+  SubmapWindow window;
+  {
+    std::lock_guard<std::mutex> lock(submap_poses_mutex_);
+    window = WalkArea(anchor);
+  }
+  // The pass follows the poses as they get optimized
+  std::lock_guard<std::mutex> lock(area_mutex_);
+  auto it = area_anchors_.find(anchor);
+  if (it != area_anchors_.end()) {
+    it->second.first =
+        window.empty() ? anchor : std::min(anchor, window.front().first);
+    it->second.second =
+        window.empty() ? anchor : std::max(anchor, window.back().first);
+  }
+  return window;
+}
+
+gtsam::Key IcpLoopComputation::GetAreaAnchor(const gtsam::Key& key,
+                                             gtsam::Pose3* key_in_anchor) {
+  std::lock_guard<std::mutex> lock(submap_poses_mutex_);
+  std::lock_guard<std::mutex> area_lock(area_mutex_);
+  *key_in_anchor = gtsam::Pose3();
+  const gtsam::Pose3 pose = SubmapPose(key);
+
+  // The passes of the anchors right before and after key
+  std::vector<std::map<gtsam::Key, std::pair<gtsam::Key, gtsam::Key>>::
+                  const_iterator>
+      nearest;
+  auto after = area_anchors_.upper_bound(key);
+  if (after != area_anchors_.end())
+    nearest.push_back(after);
+  if (after != area_anchors_.begin())
+    nearest.push_back(std::prev(after));
+  gtsam::Key best = key;
+  double best_distance = 0.5 * area_radius_;
+  for (const auto& it : nearest) {
+    if (key < it->second.first || key > it->second.second ||
+        !keyed_poses_.count(it->first))
       continue;
+    const gtsam::Pose3 relative = SubmapPose(it->first).between(pose);
+    const double distance = relative.translation().norm();
+    if (distance <= best_distance) {
+      best = it->first;
+      best_distance = distance;
+      *key_in_anchor = relative;
     }
-    const PointCloudConstPtr prev_scan = keyed_scans_[prev_key];
+  }
 
-    // Transform and Accumulate
-    const gtsam::Pose3 new_pose = keyed_poses_.at(key);
-    const gtsam::Pose3 old_pose = keyed_poses_.at(prev_key);
-    const gtsam::Pose3 tf = new_pose.between(old_pose);
+  if (best == key && !area_anchors_.count(key)) {
+    const SubmapWindow window = WalkArea(key);
+    area_anchors_[key] = std::make_pair(
+        window.empty() ? key : std::min(key, window.front().first),
+        window.empty() ? key : std::max(key, window.back().first));
+  }
+  return best;
+}
 
-    PointCloud::Ptr transformed(new PointCloud);
-    pcl::transformPointCloud(*prev_scan, *transformed, tf.matrix());
-    *scan_out += *transformed;
+IcpLoopComputation::PreparedScanConstPtr IcpLoopComputation::GetPreparedScan(
+    const gtsam::Key& key, PreparedScanKind kind, Gicp& icp) {
+  const PreparedScanId id(key, kind);
+  const bool accumulate = kind != PreparedScanKind::SCAN;
+  SubmapCache& cache =
+      kind == PreparedScanKind::AREA ? area_submap_cache_ : submap_cache_;
+  // Rebuild if neighbouring scans arrived or moved since it was prepared
+  SubmapWindow window;
+  PointCloudConstPtr submap;
+  if (accumulate) {
+    window = kind == PreparedScanKind::AREA ? GetAreaWindow(key)
+                                            : GetSubmapWindow(key);
+    submap = cache.Find(key, window);
+  }
+  {
+    std::lock_guard<std::mutex> lock(prepared_scans_mutex_);
+    auto it = prepared_scans_.find(id);
+    if (it != prepared_scans_.end() &&
+        (!accumulate || (submap && it->second.scan->cloud == submap))) {
+      prepared_scans_lru_.splice(
+          prepared_scans_lru_.begin(), prepared_scans_lru_, it->second.lru_it);
+      return it->second.scan;
+    }
   }
 
-  for (int i = 0; i < sac_num_next_scans_; i++) {
-    gtsam::Key next_key = key + i + 1;
-    // If scan doesn't exist, just skip it
-    if (!keyed_poses_.count(next_key) || !keyed_scans_.count(next_key)) {
+  // Build without holding the lock, other alignments keep going
+  PointCloudConstPtr cloud = submap;
+  if (cloud == nullptr) {
+    const PointCloudConstPtr scan = keyed_scans_.Get(key);
+    if (scan == nullptr) {
+      return nullptr;
+    }
+    if (accumulate) {
+      PointCloud::Ptr accumulated =
+          lamp_utils::PointCloudPool::Instance().Copy(*scan);
+      AccumulateScans(key, window, accumulated);
+      cloud = cache.Insert(key, window, accumulated);
+    } else {
+      cloud = scan;
+    }
+    // A new area submap is worth another try from every source
+    if (kind == PreparedScanKind::AREA) {
+      std::lock_guard<std::mutex> lock(area_mutex_);
+      area_attempts_.erase(
+          area_attempts_.lower_bound(std::make_pair(key, gtsam::Key(0))),
+          area_attempts_.lower_bound(std::make_pair(key + 1, gtsam::Key(0))));
+    }
+  }
+  std::shared_ptr<PreparedScan> prepared(new PreparedScan);
+  prepared->cloud = cloud;
+  icp.prepareCloud(cloud, prepared->tree, prepared->covariances);
+  if (alignment_cache_.IsOpen()) {
+    prepared->content_hash = HashCloud(*cloud);
+  }
+
+  std::lock_guard<std::mutex> lock(prepared_scans_mutex_);
+  auto it = prepared_scans_.find(id);
+  if (it != prepared_scans_.end()) {
+    prepared_scans_lru_.erase(it->second.lru_it);
+    prepared_scans_.erase(it);
+  }
+  prepared_scans_lru_.push_front(id);
+  PreparedScanEntry& entry = prepared_scans_[id];
+  entry.scan = prepared;
+  entry.lru_it = prepared_scans_lru_.begin();
+
+  while (prepared_scans_.size() >
+         static_cast<size_t>(std::max(prepared_scan_cache_size_, 1))) {
+    prepared_scans_.erase(prepared_scans_lru_.back());
+    prepared_scans_lru_.pop_back();
+  }
+  return prepared;
+}
+
+size_t IcpLoopComputation::PreparedScanBytes() {
+  std::lock_guard<std::mutex> lock(prepared_scans_mutex_);
+  size_t bytes = 0;
+  for (const auto& entry : prepared_scans_) {
+    const PreparedScan& scan = *entry.second.scan;
+    if (scan.covariances) {
+      bytes += scan.covariances->capacity() *
+          sizeof(Gicp::MatricesVector::value_type);
+    }
+  }
+  return bytes;
+}
+
+size_t IcpLoopComputation::ShrinkPreparedScans(size_t bytes) {
+  std::lock_guard<std::mutex> lock(prepared_scans_mutex_);
+  size_t freed = 0;
+  while (freed < bytes && !prepared_scans_lru_.empty()) {
+    auto it = prepared_scans_.find(prepared_scans_lru_.back());
+    const PreparedScan& scan = *it->second.scan;
+    if (scan.covariances) {
+      freed += scan.covariances->capacity() *
+          sizeof(Gicp::MatricesVector::value_type);
+    }
+    prepared_scans_.erase(it);
+    prepared_scans_lru_.pop_back();
+  }
+  return freed;
+}
+
+void IcpLoopComputation::InvalidatePreparedScans(const gtsam::Key& key) {
+  submap_cache_.Invalidate(key);
+  std::vector<PreparedScanId> ids{PreparedScanId(key, PreparedScanKind::SCAN),
+                                  PreparedScanId(key, PreparedScanKind::SUBMAP)};
+  // And the area submaps the scan is part of
+  {
+    std::lock_guard<std::mutex> lock(area_mutex_);
+    for (const auto& area : area_anchors_) {
+      if (key >= area.second.first && key <= area.second.second) {
+        area_submap_cache_.Invalidate(area.first);
+        ids.emplace_back(area.first, PreparedScanKind::AREA);
+      }
+    }
+  }
+  std::lock_guard<std::mutex> lock(prepared_scans_mutex_);
+  for (const PreparedScanId& id : ids) {
+    auto it = prepared_scans_.find(id);
+    if (it == prepared_scans_.end())
+      continue;
+    prepared_scans_lru_.erase(it->second.lru_it);
+    prepared_scans_.erase(it);
+  }
+}
+
+void IcpLoopComputation::AccumulateScans(const gtsam::Key& key,
+                                         const SubmapWindow& window,
+                                         PointCloud::Ptr scan_out) {
+  for (const auto& neighbor : window) {
+    const PointCloudConstPtr scan = keyed_scans_.Get(neighbor.first);
+    if (scan == nullptr) {
       continue;
     }
-    const PointCloudConstPtr next_scan = keyed_scans_[next_key];
 
     // Transform and Accumulate
-    const gtsam::Pose3 new_pose = keyed_poses_.at(key);
-    const gtsam::Pose3 old_pose = keyed_poses_.at(next_key);
-    const gtsam::Pose3 tf = new_pose.between(old_pose);
-
-    PointCloud::Ptr transformed(new PointCloud);
-    pcl::transformPointCloud(*next_scan, *transformed, tf.matrix());
-    *scan_out += *transformed;
+    lamp_utils::TransformAndAppend(
+        *scan, neighbor.second.matrix(), scan_out.get());
   }
 }
 
 void IcpLoopComputation::GetTeaserInitialAlignment(PointCloudConstPtr source,
                                                    PointCloudConstPtr target,
                                                    Eigen::Matrix4f* tf_out) {
-  // Get Normals
-  Normals::Ptr source_normals(new Normals);
-  Normals::Ptr target_normals(new Normals);
-  lamp_utils::ExtractNormals(source, source_normals);
-  lamp_utils::ExtractNormals(target, target_normals);
-
-  // Get Harris keypoints for source and target
-  PointCloud::Ptr source_keypoints(new PointCloud);
-  PointCloud::Ptr target_keypoints(new PointCloud);
+  GetTeaserInitialAlignment(
+      *ComputeScanFeatures(source), *ComputeScanFeatures(target), tf_out);
+}
 
-  lamp_utils::ComputeKeypoints(
-      source, source_normals, harris_params_, icp_threads_, source_keypoints);
-  lamp_utils::ComputeKeypoints(
-      target, target_normals, harris_params_, icp_threads_, target_keypoints);
-
-  Features::Ptr source_features(new Features);
-  Features::Ptr target_features(new Features);
-  lamp_utils::ComputeFeatures(source_keypoints,
-                         source,
-                         source_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         source_features);
-  lamp_utils::ComputeFeatures(target_keypoints,
-                         target,
-                         target_normals,
-                         sac_features_radius_,
-                         icp_threads_,
-                         target_features);
-
-  // std::cout << "loop - src cloud size: " << source_keypoints->size() <<
-  // std::endl; std::cout << "loop - target cloud size: " <<
-  // target_keypoints->size() << std::endl; std::cout << "loop - src features
-  // size: " << source_features->size() << std::endl; std::cout << "loop -
-  // target features size: " << target_features->size() << std::endl; std::cout
-  // << "Number of inlier threshold is: " << teaser_inlier_threshold_ <<
-  // std::endl;
-
-  if (source_keypoints->size() == 0 || target_keypoints->size() == 0) {
+void IcpLoopComputation::GetTeaserInitialAlignment(const ScanFeatures& source,
+                                                   const ScanFeatures& target,
+                                                   Eigen::Matrix4f* tf_out) {
+  if (!source.tree || !target.tree) {
     return;
   }
+  const PointCloud::Ptr& source_keypoints = source.keypoints;
+  const PointCloud::Ptr& target_keypoints = target.keypoints;
 
   // Align
   ROS_DEBUG("Finding TEASER Correspondences!");
-  teaser::Matcher matcher;
-  auto correspondences = matcher.calculateKCorrespondences(
-      source_keypoints, target_keypoints, source_features, target_features, 5);
+  // Both FLANN indices are cached with the scans
+  auto correspondences =
+      MutualCorrespondences(*source.descriptors,
+                            *source.tree,
+                            *target.descriptors,
+                            *target.tree,
+                            teaser_correspondence_neighbours_);
+  // The max clique grows with the square of the correspondences, bounded to
+  // keep TEASER++ within its time budget
+  PruneCorrespondences(&correspondences,
+                       teaser_max_descriptor_ratio_,
+                       static_cast<size_t>(teaser_max_correspondences_));
   int corres_size = correspondences.size();
 
   // ROS_DEBUG("Found %d correspondences.", corres_size);
@@ -1006,13 +2804,13 @@ void IcpLoopComputation::GetTeaserInitialAlignment(PointCloudConstPtr source,
     Eigen::Matrix<double, 3, Eigen::Dynamic> tgt_corres_points(3, corres_size);
     for (size_t i = 0; i < corres_size; ++i) {
       src_corres_points.col(i)
-          << (*source_keypoints)[correspondences[i].first].x,
-          (*source_keypoints)[correspondences[i].first].y,
-          (*source_keypoints)[correspondences[i].first].z;
+          << (*source_keypoints)[correspondences[i].source].x,
+          (*source_keypoints)[correspondences[i].source].y,
+          (*source_keypoints)[correspondences[i].source].z;
       tgt_corres_points.col(i)
-          << (*target_keypoints)[correspondences[i].second].x,
-          (*target_keypoints)[correspondences[i].second].y,
-          (*target_keypoints)[correspondences[i].second].z;
+          << (*target_keypoints)[correspondences[i].target].x,
+          (*target_keypoints)[correspondences[i].target].y,
+          (*target_keypoints)[correspondences[i].target].z;
     }
 
     ROS_DEBUG("Completed TEASER Correspondences!");
@@ -1030,6 +2828,10 @@ void IcpLoopComputation::GetTeaserInitialAlignment(PointCloudConstPtr source,
     params.rotation_cost_threshold = 1e-6;
     params.inlier_selection_mode =
         teaser::RobustRegistrationSolver::INLIER_SELECTION_MODE::PMC_HEU;
+    // Time budget and threads of the max clique, on the pool worker
+    // running the alignment
+    params.max_clique_time_limit = teaser_max_clique_time_limit_;
+    params.max_clique_num_threads = teaser_max_clique_threads_;
     // Solve with TEASER++
     teaser::RobustRegistrationSolver solver(params);
     solver.solve(src_corres_points, tgt_corres_points);
@@ -0,0 +1,269 @@
+/**
+ * @file   InformationGainLoopPrioritization.cc
+ * @brief  Prioritize loop closures by expected information gain per ICP time
+ */
+
+#include "loop_closure/InformationGainLoopPrioritization.h"
+
+#include <algorithm>
+
+#include <parameter_utils/ParameterUtils.h>
+#include <pose_graph_msgs/MarginalCovariance.h>
+
+#include "lamp_utils/SharedScanStore.h"
+#include "lamp_utils/Tracing.h"
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+InformationGainLoopPrioritization::InformationGainLoopPrioritization() {}
+InformationGainLoopPrioritization::~InformationGainLoopPrioritization() {}
+
+bool InformationGainLoopPrioritization::Initialize(const ros::NodeHandle& n) {
+  std::string name =
+      ros::names::append(n.getNamespace(), "InformationGainLoopPrioritization");
+  if (!LoadParameters(n)) {
+    ROS_ERROR("%s: Failed to load parameters.", name.c_str());
+    return false;
+  }
+
+  if (!RegisterCallbacks(n)) {
+    ROS_ERROR("%s: Failed to register callbacks.", name.c_str());
+    return false;
+  }
+
+  if (!CreatePublishers(n)) {
+    ROS_ERROR("%s: Failed to create publishers.", name.c_str());
+    return false;
+  }
+
+  ROS_INFO_STREAM("Initialized InformationGainLoopPrioritization."
+                  << "\nicp_budget: " << params_.icp_budget
+                  << "\nmin_gain: " << params_.min_gain);
+
+  return true;
+}
+
+bool InformationGainLoopPrioritization::LoadParameters(
+    const ros::NodeHandle& n) {
+  if (!LoopPrioritization::LoadParameters(n))
+    return false;
+
+  const std::string ns = param_ns_ + "/ig_prioritization/";
+  if (!pu::Get(ns + "icp_budget", params_.icp_budget))
+    return false;
+  if (!pu::Get(ns + "publish_period", publish_period_))
+    return false;
+  if (!pu::Get(ns + "horizon", horizon_))
+    return false;
+  if (!pu::Get(ns + "default_icp_time", params_.default_icp_time))
+    return false;
+  if (!pu::Get(ns + "icp_time_smoothing", params_.icp_time_smoothing))
+    return false;
+  if (!pu::Get(ns + "max_hops", params_.max_hops))
+    return false;
+  if (!pu::Get(ns + "correlation_hops", params_.correlation_hops))
+    return false;
+  if (!pu::Get(ns + "odom_rotation_sigma", params_.odom_rotation_sigma))
+    return false;
+  if (!pu::Get(ns + "odom_position_sigma", params_.odom_position_sigma))
+    return false;
+  if (!pu::Get(ns + "loop_rotation_sigma", params_.loop_rotation_sigma))
+    return false;
+  if (!pu::Get(ns + "loop_position_sigma", params_.loop_position_sigma))
+    return false;
+  if (!pu::Get(ns + "min_gain", params_.min_gain))
+    return false;
+  if (!pu::Get(ns + "redundancy_hops", params_.redundancy_hops))
+    return false;
+  if (publish_period_ <= 0 || params_.loop_rotation_sigma <= 0 ||
+      params_.loop_position_sigma <= 0) {
+    ROS_ERROR("ig_prioritization: publish_period and loop sigmas must be "
+              "positive");
+    return false;
+  }
+  selector_.SetParams(params_);
+
+  return true;
+}
+
+bool InformationGainLoopPrioritization::CreatePublishers(
+    const ros::NodeHandle& n) {
+  if (!LoopPrioritization::CreatePublishers(n))
+    return false;
+
+  return true;
+}
+
+bool InformationGainLoopPrioritization::RegisterCallbacks(
+    const ros::NodeHandle& n) {
+  if (!LoopPrioritization::RegisterCallbacks(n))
+    return false;
+
+  ros::NodeHandle nl(n);
+  keyed_scans_sub_ = nl.subscribe<pose_graph_msgs::KeyedScan>(
+      "keyed_scans",
+      100000,
+      &InformationGainLoopPrioritization::KeyedScanCallback,
+      this);
+  pose_graph_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+      "pose_graph_incremental",
+      100000,
+      &InformationGainLoopPrioritization::PoseGraphCallback,
+      this);
+  optimized_values_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+      "optimized_values",
+      10,
+      &InformationGainLoopPrioritization::OptimizedValuesCallback,
+      this);
+  // The ICP time is learned from the statuses, backpressure or not
+  if (!computation_status_sub_) {
+    computation_status_sub_ =
+        nl.subscribe<pose_graph_msgs::LoopComputationStatus>(
+            "loop_computation_status",
+            10,
+            &InformationGainLoopPrioritization::ComputationStatusCallback,
+            this);
+  }
+  marginal_covariance_client_ =
+      nl.serviceClient<pose_graph_msgs::MarginalCovariance>(
+          "marginal_covariance");
+
+  update_timer_ =
+      nl.createTimer(ros::Duration(publish_period_),
+                     &InformationGainLoopPrioritization::ProcessTimerCallback,
+                     this);
+
+  return true;
+}
+
+void InformationGainLoopPrioritization::ProcessTimerCallback(
+    const ros::TimerEvent& ev) {
+  bool b_pending;
+  {
+    std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+    const double now = ros::Time::now().toSec();
+    pending_.erase(
+        std::remove_if(pending_.begin(),
+                       pending_.end(),
+                       [this, now](const pose_graph_msgs::LoopCandidate& c) {
+                         return c.header.stamp.toSec() + horizon_ < now;
+                       }),
+        pending_.end());
+    b_pending = !pending_.empty();
+  }
+  if (b_pending &&
+      HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get())) {
+    UpdateMarginals();
+    PublishBestCandidates();
+  }
+}
+
+void InformationGainLoopPrioritization::UpdateMarginals() {
+  pose_graph_msgs::MarginalCovariance srv;
+  {
+    std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+    if (!b_new_solve_ || !marginal_covariance_client_.exists()) {
+      return;
+    }
+    std::unordered_set<gtsam::Key> keys;
+    for (const auto& candidate : pending_) {
+      keys.insert(candidate.key_from);
+      keys.insert(candidate.key_to);
+    }
+    srv.request.keys.assign(keys.begin(), keys.end());
+    b_new_solve_ = false;
+  }
+
+  // Outside the lock, the optimizer answers once done with its solve
+  if (!marginal_covariance_client_.call(srv)) {
+    ROS_WARN("InformationGainLoopPrioritization: Marginal covariances not "
+             "available");
+    return;
+  }
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  selector_.ClearMarginals();
+  for (const auto& node : srv.response.nodes) {
+    selector_.SetMarginal(
+        node.key,
+        Eigen::Map<const Eigen::Matrix<double, 6, 6, Eigen::RowMajor>>(
+            node.covariance.data()));
+  }
+}
+
+void InformationGainLoopPrioritization::PopulatePriorityQueue() {
+  lamp_utils::TraceSpan span("loop_prioritization.information_gain");
+  size_t n = candidate_queue_.size();
+  if (n == 0)
+    return;
+
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  for (size_t i = 0; i < n; i++) {
+    pending_.push_back(candidate_queue_.front());
+    candidate_queue_.pop();
+  }
+  ROS_DEBUG("InformationGainLoopPrioritization: %lu candidates waiting",
+            pending_.size());
+}
+
+void InformationGainLoopPrioritization::PublishBestCandidates() {
+  pose_graph_msgs::LoopCandidateArray output_msg = GetBestCandidates();
+  if (output_msg.candidates.empty())
+    return;
+  ROS_DEBUG("Published %lu prioritized candidates. ",
+            output_msg.candidates.size());
+  PublishCandidates(
+      loop_candidate_pub_, loop_candidate_channel_.get(), output_msg);
+}
+
+pose_graph_msgs::LoopCandidateArray
+InformationGainLoopPrioritization::GetBestCandidates() {
+  static lamp_utils::Gauge& selected_icp_time =
+      lamp_utils::MetricsRegistry::Instance().GetGauge(
+          "loop_prioritization.selected_icp_time");
+  pose_graph_msgs::LoopCandidateArray output_msg;
+  output_msg.originator = 2;
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  selected_icp_time.Set(selector_.Select(&pending_, &output_msg.candidates));
+  return output_msg;
+}
+
+void InformationGainLoopPrioritization::ComputationStatusCallback(
+    const pose_graph_msgs::LoopComputationStatus::ConstPtr& status) {
+  LoopPrioritization::ComputationStatusCallback(status);
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  selector_.UpdateIcpTime(*status);
+}
+
+void InformationGainLoopPrioritization::KeyedScanCallback(
+    const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
+  const gtsam::Key key = scan_msg->key;
+  if (!keyed_scan_keys_.insert(key).second)
+    return;
+
+  // Converted once per process and shared with the other scan consumers
+  PointCloudConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*scan_msg);
+  if (scan == nullptr)
+    return;
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  selector_.SetScanSize(key, scan->size());
+}
+
+void InformationGainLoopPrioritization::PoseGraphCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  for (const auto& edge : graph_msg->edges) {
+    selector_.AddEdge(edge.key_from, edge.key_to);
+  }
+}
+
+void InformationGainLoopPrioritization::OptimizedValuesCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& values_msg) {
+  std::lock_guard<std::mutex> lock(priority_queue_mutex_);
+  b_new_solve_ = true;
+}
+
+} // namespace lamp_loop_closure
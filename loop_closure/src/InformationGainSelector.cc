@@ -0,0 +1,259 @@
+/**
+ * @file   InformationGainSelector.cc
+ * @brief  Loop candidates selected by expected information gain per ICP time
+ */
+
+#include "loop_closure/InformationGainSelector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+#include <Eigen/Cholesky>
+
+namespace lamp_loop_closure {
+
+namespace {
+
+// log det of a symmetric positive definite matrix, false if it is not
+bool LogDet(const gtsam::Matrix66& matrix, double* log_det) {
+  Eigen::LLT<gtsam::Matrix66> llt(matrix);
+  if (llt.info() != Eigen::Success) {
+    return false;
+  }
+  *log_det = 2 * llt.matrixL().toDenseMatrix().diagonal().array().log().sum();
+  return true;
+}
+
+gtsam::Matrix66 DiagonalCovariance(double rotation_sigma,
+                                   double position_sigma) {
+  gtsam::Vector6 variances;
+  variances.head<3>().setConstant(rotation_sigma * rotation_sigma);
+  variances.tail<3>().setConstant(position_sigma * position_sigma);
+  return variances.asDiagonal();
+}
+
+} // namespace
+
+void InformationGainSelector::SetParams(const InformationGainParams& params) {
+  params_ = params;
+  params_.max_hops = std::max(params_.max_hops, 1);
+  params_.correlation_hops = std::max(params_.correlation_hops, 1e-3);
+  odom_covariance_ = DiagonalCovariance(params_.odom_rotation_sigma,
+                                        params_.odom_position_sigma);
+  loop_covariance_ = DiagonalCovariance(params_.loop_rotation_sigma,
+                                        params_.loop_position_sigma);
+  LogDet(loop_covariance_, &loop_log_det_);
+  if (icp_time_ <= 0) {
+    icp_time_ = params_.default_icp_time;
+  }
+}
+
+void InformationGainSelector::AddEdge(gtsam::Key from, gtsam::Key to) {
+  if (from == to) {
+    return;
+  }
+  std::vector<gtsam::Key>& from_neighbours = adjacency_[from];
+  if (std::find(from_neighbours.begin(), from_neighbours.end(), to) !=
+      from_neighbours.end()) {
+    return;
+  }
+  from_neighbours.push_back(to);
+  adjacency_[to].push_back(from);
+}
+
+void InformationGainSelector::SetMarginal(gtsam::Key key,
+                                          const gtsam::Matrix66& covariance) {
+  marginals_[key] = covariance;
+}
+
+void InformationGainSelector::ClearMarginals() {
+  marginals_.clear();
+}
+
+void InformationGainSelector::SetScanSize(gtsam::Key key, size_t num_points) {
+  auto inserted = scan_sizes_.emplace(key, num_points);
+  if (!inserted.second) {
+    return;
+  }
+  mean_scan_size_ +=
+      (static_cast<double>(num_points) - mean_scan_size_) / scan_sizes_.size();
+}
+
+void InformationGainSelector::UpdateIcpTime(
+    const pose_graph_msgs::LoopComputationStatus& status) {
+  if (status.num_computed <= 0 || status.compute_time <= 0) {
+    return;
+  }
+  // Wall time of the batch, the alignments ran num_workers at a time
+  const double icp_time = status.compute_time *
+      std::max(status.num_workers, 1) / status.num_computed;
+  icp_time_ += params_.icp_time_smoothing * (icp_time - icp_time_);
+}
+
+int InformationGainSelector::Distance(gtsam::Key a,
+                                      gtsam::Key b,
+                                      int limit) const {
+  if (a == b) {
+    return 0;
+  }
+  std::unordered_map<gtsam::Key, int> depth{{a, 0}};
+  std::deque<gtsam::Key> queue{a};
+  while (!queue.empty()) {
+    const gtsam::Key key = queue.front();
+    queue.pop_front();
+    const int next = depth[key] + 1;
+    if (next > limit) {
+      break;
+    }
+    auto neighbours = adjacency_.find(key);
+    if (neighbours == adjacency_.end()) {
+      continue;
+    }
+    for (gtsam::Key neighbour : neighbours->second) {
+      if (neighbour == b) {
+        return next;
+      }
+      if (depth.emplace(neighbour, next).second) {
+        queue.push_back(neighbour);
+      }
+    }
+  }
+  return limit + 1;
+}
+
+int InformationGainSelector::GraphDistance(gtsam::Key a, gtsam::Key b) const {
+  return Distance(a, b, params_.max_hops);
+}
+
+double InformationGainSelector::ExpectedGain(
+    const pose_graph_msgs::LoopCandidate& candidate) const {
+  const int hops = GraphDistance(candidate.key_from, candidate.key_to);
+  gtsam::Matrix66 relative;
+  auto from = marginals_.find(candidate.key_from);
+  auto to = marginals_.find(candidate.key_to);
+  if (from != marginals_.end() && to != marginals_.end()) {
+    relative = (1 - std::exp(-hops / params_.correlation_hops)) *
+        (from->second + to->second);
+  } else {
+    relative = static_cast<double>(hops) * odom_covariance_;
+  }
+
+  double log_det;
+  if (!LogDet(relative + loop_covariance_, &log_det)) {
+    return 0;
+  }
+  return std::max(0.0, 0.5 * (log_det - loop_log_det_));
+}
+
+double InformationGainSelector::ExpectedCost(
+    const pose_graph_msgs::LoopCandidate& candidate) const {
+  auto from = scan_sizes_.find(candidate.key_from);
+  auto to = scan_sizes_.find(candidate.key_to);
+  if (from == scan_sizes_.end() || to == scan_sizes_.end() ||
+      mean_scan_size_ <= 0) {
+    return icp_time_;
+  }
+  // ICP time grows with the points aligned
+  return icp_time_ * (from->second + to->second) / (2 * mean_scan_size_);
+}
+
+bool InformationGainSelector::IsRedundant(
+    const pose_graph_msgs::LoopCandidate& candidate,
+    const pose_graph_msgs::LoopCandidate& selected) const {
+  const int limit = params_.redundancy_hops;
+  if (limit < 0) {
+    return false;
+  }
+  auto near = [this, limit](gtsam::Key a, gtsam::Key b) {
+    return Distance(a, b, limit) <= limit;
+  };
+  return (near(candidate.key_from, selected.key_from) &&
+          near(candidate.key_to, selected.key_to)) ||
+      (near(candidate.key_from, selected.key_to) &&
+       near(candidate.key_to, selected.key_from));
+}
+
+double InformationGainSelector::Select(
+    std::vector<pose_graph_msgs::LoopCandidate>* candidates,
+    std::vector<pose_graph_msgs::LoopCandidate>* selected) const {
+  struct Scored {
+    size_t index;
+    double gain;
+    double cost;
+  };
+  std::vector<Scored> scored;
+  scored.reserve(candidates->size());
+  std::vector<bool> b_keep(candidates->size(), false);
+  for (size_t i = 0; i < candidates->size(); i++) {
+    const double gain = ExpectedGain((*candidates)[i]);
+    if (gain < params_.min_gain) {
+      continue;
+    }
+    b_keep[i] = true;
+    scored.push_back({i, gain, std::max(ExpectedCost((*candidates)[i]), 1e-6)});
+  }
+  std::sort(scored.begin(), scored.end(), [](const Scored& a, const Scored& b) {
+    return a.gain * b.cost > b.gain * a.cost;
+  });
+
+  // Greedy by gain per second, then the single best candidate if it alone
+  // gains more, which bounds the greedy loss on the knapsack
+  std::vector<size_t> greedy;
+  double greedy_gain = 0, greedy_cost = 0;
+  std::vector<pose_graph_msgs::LoopCandidate> taken;
+  for (size_t i = 0; i < scored.size(); i++) {
+    const Scored& s = scored[i];
+    if (greedy_cost + s.cost > params_.icp_budget) {
+      continue;
+    }
+    const pose_graph_msgs::LoopCandidate& candidate = (*candidates)[s.index];
+    bool b_redundant = false;
+    for (const auto& other : taken) {
+      if (IsRedundant(candidate, other)) {
+        b_redundant = true;
+        break;
+      }
+    }
+    if (b_redundant) {
+      continue;
+    }
+    greedy.push_back(i);
+    taken.push_back(candidate);
+    greedy_gain += s.gain;
+    greedy_cost += s.cost;
+  }
+  size_t best = scored.size();
+  for (size_t i = 0; i < scored.size(); i++) {
+    if (scored[i].cost <= params_.icp_budget &&
+        (best == scored.size() || scored[i].gain > scored[best].gain)) {
+      best = i;
+    }
+  }
+  if (best != scored.size() && scored[best].gain > greedy_gain) {
+    greedy = {best};
+    greedy_cost = scored[best].cost;
+  }
+  // A budget below a single alignment still aligns the best one
+  if (greedy.empty() && !scored.empty()) {
+    greedy = {0};
+    greedy_cost = scored[0].cost;
+  }
+
+  for (size_t i : greedy) {
+    pose_graph_msgs::LoopCandidate candidate = (*candidates)[scored[i].index];
+    candidate.value = scored[i].gain;
+    selected->push_back(candidate);
+    b_keep[scored[i].index] = false;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < candidates->size(); i++) {
+    if (b_keep[i]) {
+      (*candidates)[kept++] = (*candidates)[i];
+    }
+  }
+  candidates->resize(kept);
+  return greedy_cost;
+}
+
+} // namespace lamp_loop_closure
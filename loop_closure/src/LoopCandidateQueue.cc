@@ -6,10 +6,15 @@
  */
 #pragma once
 
+#include <algorithm>
+
 #include <lamp_utils/CommonFunctions.h>
+#include <parameter_utils/ParameterUtils.h>
 
 #include "loop_closure/LoopCandidateQueue.h"
 
+namespace pu = parameter_utils;
+
 namespace lamp_loop_closure {
 
 LoopCandidateQueue::LoopCandidateQueue() {}
@@ -41,6 +46,13 @@ bool LoopCandidateQueue::Initialize(const ros::NodeHandle& n) {
 bool LoopCandidateQueue::LoadParameters(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   param_ns_ = lamp_utils::GetParamNamespace(n.getNamespace());
+  if (!LoadCandidateChannelParams(param_ns_, &channel_params_))
+    return false;
+  int max_sent_loop_closures = 0;
+  if (!pu::Get(param_ns_ + "/queue/max_sent_loop_closures",
+               max_sent_loop_closures))
+    return false;
+  sent_loop_closures_.SetCapacity(std::max(max_sent_loop_closures, 0));
 
   return true;
 }
@@ -49,6 +61,8 @@ bool LoopCandidateQueue::CreatePublishers(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_pub_ = nl.advertise<pose_graph_msgs::LoopCandidateArray>(
       "output_loop_candidates", 10, false);
+  loop_candidate_channel_ =
+      OpenCandidateOutput(nl, "output_loop_candidates", channel_params_);
   return true;
 }
 
@@ -60,6 +74,15 @@ bool LoopCandidateQueue::RegisterCallbacks(const ros::NodeHandle& n) {
   loop_closure_status_sub_ = nl.subscribe<pose_graph_msgs::LoopComputationStatus>(
       "loop_computation_status", 100, &LoopCandidateQueue::LoopComputationStatusCallback, this);
 
+  input_channel_ = OpenCandidateInput(
+      nl, "input_loop_candidates_prioritized", channel_params_);
+  if (input_channel_) {
+    channel_timer_ =
+        nl.createTimer(ros::Duration(channel_params_.poll_period),
+                       &LoopCandidateQueue::ChannelTimerCallback,
+                       this);
+  }
+
   return true;
 }
 
@@ -72,6 +95,13 @@ void LoopCandidateQueue::InputCallback(
   OnNewLoopClosure();
 }
 
+void LoopCandidateQueue::ChannelTimerCallback(const ros::TimerEvent& ev) {
+  CandidateChannel::Message input_candidates;
+  while (input_channel_->Pop(&input_candidates)) {
+    InputCallback(input_candidates);
+  }
+}
+
 void LoopCandidateQueue::PublishAllLoopClosures(){
   pose_graph_msgs::LoopCandidateArray candidate_array;
   for (auto const& cur_queue : queues)
@@ -97,6 +127,8 @@ void LoopCandidateQueue::OnLoopComputationCompleted(){
 
 void LoopCandidateQueue::LoopComputationStatusCallback(const pose_graph_msgs::LoopComputationStatus::ConstPtr& status){
 
+  // Statuses streamed during a batch carry its alignments so far
+  OnLoopComputationStatus(*status);
   if (status->type == status->COMPLETED_ALL){
     OnLoopComputationCompleted();
   }
@@ -114,26 +146,26 @@ void LoopCandidateQueue::PublishLoopCandidate(
 
       }
     }
-    loop_candidate_pub_.publish(out_candidate_array);
+    PublishCandidates(loop_candidate_pub_,
+                      loop_candidate_channel_.get(),
+                      out_candidate_array);
   } else {
-    loop_candidate_pub_.publish(candidates);
+    PublishCandidates(
+        loop_candidate_pub_, loop_candidate_channel_.get(), candidates);
   }
 }
-std::string LoopCandidateQueue::make_key(const pose_graph_msgs::LoopCandidate& loop_closure){
-  std::stringstream ss;
-  ss << loop_closure.key_from <<"-" <<loop_closure.key_to <<"-"<<loop_closure.type;
-  return ss.str();
+LoopClosureId LoopCandidateQueue::make_key(const pose_graph_msgs::LoopCandidate& loop_closure){
+  return MakeLoopClosureId(
+      loop_closure.key_from, loop_closure.key_to, loop_closure.type);
 }
 
 
 bool LoopCandidateQueue::LoopClosureHasBeenSent(const pose_graph_msgs::LoopCandidate& loop_closure){
-  auto got = sent_loop_closures_.find (make_key(loop_closure));
-
-  return (got != sent_loop_closures_.end() );
+  return sent_loop_closures_.Contains(make_key(loop_closure));
 }
 
 void LoopCandidateQueue::AddLoopClosureToSent(const pose_graph_msgs::LoopCandidate& loop_closure){
-  sent_loop_closures_.emplace(make_key(loop_closure));
+  sent_loop_closures_.Insert(make_key(loop_closure));
 }
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -61,8 +61,7 @@ void LoopClosure::InputCallback(
     // add new key and stamp to keyed_stamps_
     keyed_stamps_[new_key] = timestamp;
     
-    // add new key and pose to keyed_poses_
-    keyed_poses_[new_key] = new_pose;
+    AddKeyedPose(new_key, new_pose);
 
     // Skip next part if not checking for loop closures
     if (!b_check_for_loop_closures_ || !b_is_new_node) {
@@ -81,6 +80,11 @@ void LoopClosure::InputCallback(
   }
 }
 
+void LoopClosure::AddKeyedPose(gtsam::Key key, const gtsam::Pose3& pose) {
+  // add new key and pose to keyed_poses_
+  keyed_poses_[key] = pose;
+}
+
 void LoopClosure::PublishLoopClosures(
     const std::vector<pose_graph_msgs::PoseGraphEdge> edges) const {
   // For now publish PoseGraph messsage type (but only populate edges)
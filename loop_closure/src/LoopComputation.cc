@@ -3,6 +3,7 @@
  * @brief  Base class for classes to find transform of loop closures
  * @author Yun Chang
  */
+#include <gtsam/inference/Symbol.h>
 #include <lamp_utils/CommonFunctions.h>
 
 #include "loop_closure/LoopComputation.h"
@@ -15,6 +16,8 @@ LoopComputation::~LoopComputation() {}
 bool LoopComputation::LoadParameters(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n); // Nodehandle for subscription/publishing
   param_ns_ = lamp_utils::GetParamNamespace(n.getNamespace());
+  if (!LoadCandidateChannelParams(param_ns_, &channel_params_))
+    return false;
   return true;
 }
 
@@ -27,15 +30,58 @@ bool LoopComputation::CreatePublishers(const ros::NodeHandle& n) {
 }
 
 void LoopComputation::PublishCompletedAllStatus() {
+  PublishStatus(pose_graph_msgs::LoopComputationStatus::COMPLETED_ALL);
+}
+
+void LoopComputation::PublishStatus(int type) {
   pose_graph_msgs::LoopComputationStatus status;
-  status.type = status.COMPLETED_ALL;
+  status.header.stamp = ros::Time::now();
+  status.type = type;
+  status.num_early_rejected = num_early_rejected_;
+  status.num_deduplicated = num_deduplicated_;
+  status.num_computed = num_computed_;
+  status.num_accepted = num_accepted_;
+  status.compute_time = compute_time_;
+  status.num_workers = num_workers_;
+  status.queue_depth = queue_depth_;
+  const double now = status.header.stamp.toSec();
+  if (last_status_time_ > 0 && now > last_status_time_) {
+    status.throughput = num_computed_ / (now - last_status_time_);
+  }
+  last_status_time_ = now;
+  for (const auto& pair : pair_alignments_) {
+    status.robot_pairs.push_back(pair.first);
+    status.pair_computed.push_back(pair.second.first);
+    status.pair_accepted.push_back(pair.second.second);
+  }
+  num_early_rejected_ = 0;
+  num_deduplicated_ = 0;
+  num_computed_ = 0;
+  num_accepted_ = 0;
+  compute_time_ = 0;
+  pair_alignments_.clear();
   status_pub_.publish(status);
 }
 
+void LoopComputation::RecordAlignment(
+    const pose_graph_msgs::LoopCandidate& candidate, bool b_accepted) {
+  const std::string pair{gtsam::Symbol(candidate.key_from).chr(),
+                         gtsam::Symbol(candidate.key_to).chr()};
+  std::pair<int, int>& counts = pair_alignments_[pair];
+  counts.first++;
+  num_computed_++;
+  if (b_accepted) {
+    counts.second++;
+    num_accepted_++;
+  }
+}
+
 bool LoopComputation::RegisterCallbacks(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_sub_ = nl.subscribe<pose_graph_msgs::LoopCandidateArray>(
       "prioritized_loop_candidates", 100, &LoopComputation::InputCallback, this);
+  input_channel_ =
+      OpenCandidateInput(nl, "prioritized_loop_candidates", channel_params_);
 
   return true;
 }
@@ -53,9 +99,30 @@ void LoopComputation::PublishLoopClosures() {
   loop_closures_msg.edges = output_queue_;
   loop_closure_pub_.publish(loop_closures_msg);
   output_queue_.clear();
+  stream_pending_since_ = -1;
   PublishCompletedAllStatus();
 }
 
+void LoopComputation::StreamLoopClosures() {
+  if (stream_window_ < 0 || output_queue_.empty() ||
+      loop_closure_pub_.getNumSubscribers() == 0) {
+    return;
+  }
+  const double now = ros::WallTime::now().toSec();
+  if (stream_pending_since_ < 0) {
+    stream_pending_since_ = now;
+  }
+  if (now - stream_pending_since_ < stream_window_) {
+    return;
+  }
+  pose_graph_msgs::PoseGraph loop_closures_msg;
+  loop_closures_msg.edges = output_queue_;
+  loop_closure_pub_.publish(loop_closures_msg);
+  output_queue_.clear();
+  stream_pending_since_ = -1;
+  PublishStatus(pose_graph_msgs::LoopComputationStatus::COMPLETED_SOME);
+}
+
 void LoopComputation::InputCallback(
     const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates) {
   for (auto candidate : input_candidates->candidates) {
@@ -64,6 +131,15 @@ void LoopComputation::InputCallback(
   return;
 }
 
+void LoopComputation::ReadInputChannel() {
+  if (!input_channel_)
+    return;
+  CandidateChannel::Message input_candidates;
+  while (input_channel_->Pop(&input_candidates)) {
+    InputCallback(input_candidates);
+  }
+}
+
 pose_graph_msgs::PoseGraphEdge LoopComputation::CreateLoopClosureEdge(
     const gtsam::Symbol& key1,
     const gtsam::Symbol& key2,
@@ -22,6 +22,11 @@ bool LoopGeneration::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/b_find_laser_loop_closures",
                b_check_for_loop_closures_))
     return false;
+  if (!LoadCandidateChannelParams(param_ns_, &channel_params_))
+    return false;
+  if (!LoadBackpressureParams(param_ns_, &backpressure_params_))
+    return false;
+  backpressure_.SetParams(backpressure_params_);
   return true;
 }
 
@@ -29,7 +34,26 @@ bool LoopGeneration::CreatePublishers(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_pub_ = nl.advertise<pose_graph_msgs::LoopCandidateArray>(
       "loop_candidates", 10, false);
+  loop_candidate_channel_ =
+      OpenCandidateOutput(nl, "loop_candidates", channel_params_);
   return true;
 }
 
+void LoopGeneration::SubscribeComputationStatus(const ros::NodeHandle& n) {
+  if (!backpressure_params_.b_enabled)
+    return;
+  ros::NodeHandle nl(n);
+  computation_status_sub_ =
+      nl.subscribe<pose_graph_msgs::LoopComputationStatus>(
+          "loop_computation_status",
+          10,
+          &LoopGeneration::ComputationStatusCallback,
+          this);
+}
+
+void LoopGeneration::ComputationStatusCallback(
+    const pose_graph_msgs::LoopComputationStatus::ConstPtr& status) {
+  backpressure_.Update(*status);
+}
+
 } // namespace lamp_loop_closure
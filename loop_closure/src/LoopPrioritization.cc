@@ -4,7 +4,10 @@
  * candidates
  * @author Yun Chang
  */
+#include <algorithm>
+
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/ThreadGovernor.h>
 
 #include "loop_closure/LoopPrioritization.h"
 
@@ -16,13 +19,21 @@ LoopPrioritization::~LoopPrioritization() {}
 bool LoopPrioritization::LoadParameters(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n); // Nodehandle for subscription/publishing
   param_ns_ = lamp_utils::GetParamNamespace(n.getNamespace());
-  return true;
+  if (!LoadCandidateChannelParams(param_ns_, &channel_params_))
+    return false;
+  if (!LoadBackpressureParams(param_ns_, &backpressure_params_))
+    return false;
+  backpressure_.SetParams(backpressure_params_);
+  return lamp_utils::ThreadGovernor::Instance().LoadParameters(n);
 }
 
 bool LoopPrioritization::CreatePublishers(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_pub_ = nl.advertise<pose_graph_msgs::LoopCandidateArray>(
       "prioritized_loop_candidates", 10, false);
+  loop_candidate_channel_ =
+      OpenCandidateOutput(nl, "prioritized_loop_candidates", channel_params_);
+  metrics_publisher_.Start(nl);
   return true;
 }
 
@@ -30,8 +41,15 @@ bool LoopPrioritization::RegisterCallbacks(const ros::NodeHandle& n) {
   ros::NodeHandle nl(n);
   loop_candidate_sub_ = nl.subscribe<pose_graph_msgs::LoopCandidateArray>(
       "loop_candidates", 100, &LoopPrioritization::InputCallback, this);
-
-
+  input_channel_ = OpenCandidateInput(nl, "loop_candidates", channel_params_);
+  if (backpressure_params_.b_enabled) {
+    computation_status_sub_ =
+        nl.subscribe<pose_graph_msgs::LoopComputationStatus>(
+            "loop_computation_status",
+            10,
+            &LoopPrioritization::ComputationStatusCallback,
+            this);
+  }
 
   return true;
 }
@@ -47,14 +65,60 @@ std::vector<ros::AsyncSpinner> LoopPrioritization::SetAsyncSpinners(const ros::N
 }
 
 void LoopPrioritization::ProcessPopulateCallback(const ros::TimerEvent& ev) {
+  lamp_utils::ThreadGovernor::Instance().RegisterThread("prioritization");
+  if (input_channel_) {
+    CandidateChannel::Message input_candidates;
+    while (input_channel_->Pop(&input_candidates)) {
+      InputCallback(input_candidates);
+    }
+  }
+  static lamp_utils::Histogram& populate_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram(
+          "loop_prioritization.populate_ms");
+  static lamp_utils::Gauge& input_queue =
+      lamp_utils::MetricsRegistry::Instance().GetGauge(
+          "loop_prioritization.input_queue");
+  input_queue.Set(candidate_queue_.size());
+  lamp_utils::ScopedLatency latency(populate_ms);
   PopulatePriorityQueue();
 }
 
 void LoopPrioritization::InputCallback(
     const pose_graph_msgs::LoopCandidateArray::ConstPtr& input_candidates) {
+  static lamp_utils::Counter& received =
+      lamp_utils::MetricsRegistry::Instance().GetCounter(
+          "loop_prioritization.received_candidates");
+  received.Increment(input_candidates->candidates.size());
   for (auto candidate : input_candidates->candidates) {
     candidate_queue_.push(candidate);
   }
   return;
 }
+
+void LoopPrioritization::ComputationStatusCallback(
+    const pose_graph_msgs::LoopComputationStatus::ConstPtr& status) {
+  backpressure_.Update(*status);
+}
+
+size_t LoopPrioritization::ShedLowValueCandidates(
+    std::vector<pose_graph_msgs::LoopCandidate>* candidates) {
+  static lamp_utils::Counter& shed =
+      lamp_utils::MetricsRegistry::Instance().GetCounter(
+          "loop_prioritization.shed_candidates");
+  const size_t keep =
+      backpressure_.Keep(candidates->size(), 1, ros::Time::now().toSec());
+  if (keep >= candidates->size())
+    return 0;
+  std::nth_element(candidates->begin(),
+                   candidates->begin() + keep,
+                   candidates->end(),
+                   [](const pose_graph_msgs::LoopCandidate& lhs,
+                      const pose_graph_msgs::LoopCandidate& rhs) {
+                     return lhs.value > rhs.value;
+                   });
+  const size_t dropped = candidates->size() - keep;
+  candidates->resize(keep);
+  shed.Increment(dropped);
+  return dropped;
+}
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -5,7 +5,10 @@
  * @author Yun Chang
  */
 
+#include "lamp_utils/ObservabilityCache.h"
 #include "lamp_utils/PointCloudUtils.h"
+#include "lamp_utils/SharedScanStore.h"
+#include "lamp_utils/Tracing.h"
 #include <Eigen/Eigenvalues>
 #include <algorithm>
 #include <numeric>
@@ -19,7 +22,12 @@ namespace pu = parameter_utils;
 namespace lamp_loop_closure {
 
 ObservabilityLoopPrioritization::ObservabilityLoopPrioritization() {}
-ObservabilityLoopPrioritization::~ObservabilityLoopPrioritization() {}
+ObservabilityLoopPrioritization::~ObservabilityLoopPrioritization() {
+  if (b_observability_listener_) {
+    lamp_utils::ObservabilityCache::Instance().RemoveListener(
+        observability_listener_);
+  }
+}
 
 bool ObservabilityLoopPrioritization::Initialize(const ros::NodeHandle& n) {
   std::string name =
@@ -67,6 +75,11 @@ bool ObservabilityLoopPrioritization::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get(param_ns_ + "/obs_prioritization/horizon", horizon_))
     return false;
 
+  if (!pu::Get(param_ns_ + "/obs_prioritization/cache_threads", num_threads_))
+    return false;
+  lamp_utils::ObservabilityCache::Instance().SetNumThreads(
+      std::max(1, num_threads_));
+
   return true;
 }
 
@@ -95,21 +108,32 @@ bool ObservabilityLoopPrioritization::RegisterCallbacks(
                      &ObservabilityLoopPrioritization::ProcessTimerCallback,
                      this);
 
+  if (!b_observability_listener_) {
+    observability_listener_ =
+        lamp_utils::ObservabilityCache::Instance().AddListener(
+            [this](const gtsam::Key& key) {
+              awaiting_observability_.Release(key);
+            });
+    b_observability_listener_ = true;
+  }
+
   return true;
 }
 
 void ObservabilityLoopPrioritization::ProcessTimerCallback(
     const ros::TimerEvent& ev) {
   //ROS_INFO_STREAM("Priority Queue Size:" << priority_queue_.size());
-  if (priority_queue_.size() > 0 &&
-      loop_candidate_pub_.getNumSubscribers() > 0) {
+  if (!candidate_heap_.Empty() &&
+      HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get())) {
     PrunePriorityQueue();
     PublishBestCandidates();
   }
 }
 
 void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
-  if (keyed_observability_.size() == 0) {
+  lamp_utils::TraceSpan span("loop_prioritization.observability");
+  if (keyed_scan_keys_.empty()) {
     ROS_WARN("No keyed scans received yet. Not populating priority queue.");
     return;
   }
@@ -117,29 +141,52 @@ void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
   if (n > 0) {
     ROS_INFO("ObservabilityLoopPrioritization: Received %d loop candidates", n);
   }
+
+  // Candidates whose observability was computed since the last tick
+  std::vector<pose_graph_msgs::LoopCandidate> arrived;
+  awaiting_observability_.TakeReady(&arrived);
+  for (const auto& candidate : arrived) {
+    candidate_queue_.push(candidate);
+  }
+  awaiting_observability_.Expire(ros::Time::now().toSec());
+  n = candidate_queue_.size();
+
+  lamp_utils::ObservabilityCache& cache =
+      lamp_utils::ObservabilityCache::Instance();
   size_t added = 0;
+  std::vector<gtsam::Key> missing;
   for (size_t i = 0; i < n; i++) {
     auto candidate = candidate_queue_.front();
+    candidate_queue_.pop();
 
     // Check if keyed scans exist
-    if (keyed_observability_.count(candidate.key_from) == 0 ||
-        keyed_observability_.count(candidate.key_to) == 0) {
+    double min_obs_from = 0, min_obs_to = 0;
+    missing.clear();
+    if (!GetObservability(candidate.key_from, &min_obs_from)) {
+      missing.push_back(candidate.key_from);
+    }
+    if (!GetObservability(candidate.key_to, &min_obs_to)) {
+      missing.push_back(candidate.key_to);
+    }
+    if (!missing.empty()) {
       ROS_DEBUG("Keyed scans do not exist and observability score not yet "
                 "calculated. ");
-      if ((ros::Time::now() - candidate.header.stamp).toSec() <
-          keyed_scans_max_delay_) {
-        candidate_queue_.push(candidate);
-        candidate_queue_.pop();
+      awaiting_observability_.Park(
+          candidate,
+          missing,
+          candidate.header.stamp.toSec() + keyed_scans_max_delay_);
+      // Computed between the check and the park
+      for (const gtsam::Key& key : missing) {
+        if (cache.Has(key)) {
+          awaiting_observability_.Release(key);
+        }
       }
       continue;
     }
 
-    candidate_queue_.pop();
-    double min_obs_from = keyed_observability_[candidate.key_from];
     if (min_obs_from < min_observability_)
       continue;
 
-    double min_obs_to = keyed_observability_[candidate.key_to];
     if (min_obs_to < min_observability_)
       continue;
 
@@ -147,19 +194,8 @@ void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
 
     candidate.value = score;
     priority_queue_mutex_.lock();
-    std::deque<double>::iterator score_it = observability_score_.begin();
-    std::deque<pose_graph_msgs::LoopCandidate>::iterator candidate_it =
-        priority_queue_.begin();
-    for (size_t i = 0; i < priority_queue_.size(); i++) {
-      if (score < observability_score_[i]) {
-        ++score_it;
-        ++candidate_it;
-      } else {
-        break;
-      }
-    }
-    observability_score_.insert(score_it, score);
-    priority_queue_.insert(candidate_it, candidate);
+    candidate_heap_.Push(
+        candidate, score, candidate.header.stamp.toSec() + horizon_);
     added++;
     priority_queue_mutex_.unlock();
   }
@@ -172,27 +208,14 @@ void ObservabilityLoopPrioritization::PopulatePriorityQueue() {
 }
 
 void ObservabilityLoopPrioritization::PrunePriorityQueue() {
-  static int old_size = 0;
-  if (priority_queue_.size() != old_size) {
-    ROS_DEBUG_STREAM(
-        "Prune priority queue... size: " << priority_queue_.size());
-    old_size = priority_queue_.size();
-  }
   priority_queue_mutex_.lock();
-  std::deque<double> temp_observability_score;
-  std::deque<pose_graph_msgs::LoopCandidate> temp_priority_queue;
-  for (size_t i = 0; i < priority_queue_.size(); i++) {
-    auto c = priority_queue_[i];
-    if (c.header.stamp.toSec() + horizon_ > ros::Time::now().toSec()) {
-      temp_observability_score.push_back(observability_score_[i]);
-      temp_priority_queue.push_back(priority_queue_[i]);
-    }
-  }
-  observability_score_ = temp_observability_score;
-  priority_queue_ = temp_priority_queue;
+  size_t n_expired = candidate_heap_.Expire(ros::Time::now().toSec());
+  size_t n_left = candidate_heap_.Size();
   priority_queue_mutex_.unlock();
-  ROS_DEBUG_STREAM(
-      "Discarded old measurements. size: " << priority_queue_.size());
+  if (n_expired > 0) {
+    ROS_DEBUG_STREAM("Discarded " << n_expired
+                                  << " old measurements. size: " << n_left);
+  }
   return;
 }
 
@@ -200,7 +223,8 @@ void ObservabilityLoopPrioritization::PublishBestCandidates() {
   pose_graph_msgs::LoopCandidateArray output_msg = GetBestCandidates();
   ROS_DEBUG("Published %d prioritized candidates. ",
             output_msg.candidates.size());
-  loop_candidate_pub_.publish(output_msg);
+  PublishCandidates(
+      loop_candidate_pub_, loop_candidate_channel_.get(), output_msg);
 }
 
 pose_graph_msgs::LoopCandidateArray
@@ -208,12 +232,10 @@ ObservabilityLoopPrioritization::GetBestCandidates() {
   pose_graph_msgs::LoopCandidateArray output_msg;
   output_msg.originator = 2;
   priority_queue_mutex_.lock();
-  size_t n = priority_queue_.size();
-  for (size_t i = 0; i < n; i++) {
-    if (i == publish_n_best_)
-      break;
-    output_msg.candidates.push_back(priority_queue_.front());
-    priority_queue_.pop_front();
+  pose_graph_msgs::LoopCandidate candidate;
+  while (static_cast<int>(output_msg.candidates.size()) < publish_n_best_ &&
+         candidate_heap_.Pop(&candidate)) {
+    output_msg.candidates.push_back(candidate);
   }
   priority_queue_mutex_.unlock();
   return output_msg;
@@ -222,28 +244,47 @@ ObservabilityLoopPrioritization::GetBestCandidates() {
 void ObservabilityLoopPrioritization::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
   const gtsam::Key key = scan_msg->key;
-  if (keyed_observability_.count(key) > 0) {
+  if (!keyed_scan_keys_.insert(key).second) {
     ROS_DEBUG_STREAM("KeyedScanCallback: Key "
                      << gtsam::DefaultKeyFormatter(key)
                      << " already processed. Not adding.");
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  // Converted once per process and shared with the other scan consumers
+  PointCloudConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*scan_msg);
 
+  // Computed once per key off the callback thread
+  lamp_utils::ObservabilityCache::Instance().Request(key, scan);
+}
+
+bool ObservabilityLoopPrioritization::GetObservability(const gtsam::Key& key,
+                                                       double* observability) {
+  auto it = keyed_observability_.find(key);
+  if (it != keyed_observability_.end()) {
+    *observability = it->second;
+    return true;
+  }
+  lamp_utils::ScanObservability scan_observability;
+  if (!lamp_utils::ObservabilityCache::Instance().Get(key,
+                                                      &scan_observability) ||
+      scan_observability.num_points == 0) {
+    return false;
+  }
+
+  // Normalized by the best scan of the robot scored so far
   char prefix = gtsam::Symbol(key).chr();
-  Eigen::Matrix<double, 3, 1> obs_eigenv;
-  lamp_utils::ComputeIcpObservability(scan, &obs_eigenv);
-  double obs_normalized =
-      obs_eigenv.minCoeff() / static_cast<double>(scan->size());
+  double obs_normalized = scan_observability.eigenvalues.minCoeff() /
+      static_cast<double>(scan_observability.num_points);
   if (max_observability_.count(prefix) == 0 ||
       max_observability_[prefix] < obs_normalized)
     max_observability_[prefix] = obs_normalized;
-  double observability = obs_normalized / max_observability_[prefix];
+  *observability = obs_normalized / max_observability_[prefix];
 
   keyed_observability_.insert(
-      std::pair<gtsam::Key, double>(key, observability));
+      std::pair<gtsam::Key, double>(key, *observability));
+  return true;
 }
 
 } // namespace lamp_loop_closure
\ No newline at end of file
@@ -2,15 +2,23 @@
 // Created by chris on 6/2/21.
 //
 #include "loop_closure/ObservabilityQueue.h"
+#include "lamp_utils/ObservabilityCache.h"
+#include "lamp_utils/SharedScanStore.h"
 #include <parameter_utils/ParameterUtils.h>
 #include <math.h>
+#include <algorithm>
 #include <limits>
 
 namespace pu = parameter_utils;
 namespace lamp_loop_closure {
 
 ObservabilityQueue::ObservabilityQueue() : LoopCandidateQueue() {}
-ObservabilityQueue::~ObservabilityQueue() {}
+ObservabilityQueue::~ObservabilityQueue() {
+  if (b_observability_listener_) {
+    lamp_utils::ObservabilityCache::Instance().RemoveListener(
+        observability_listener_);
+  }
+}
 
 bool ObservabilityQueue::RegisterCallbacks(const ros::NodeHandle& n) {
   if (!LoopCandidateQueue::RegisterCallbacks(n)) { return false; }
@@ -21,6 +29,15 @@ bool ObservabilityQueue::RegisterCallbacks(const ros::NodeHandle& n) {
       100,
       &ObservabilityQueue::KeyedScanCallback,
       this);
+
+  if (!b_observability_listener_) {
+    observability_listener_ =
+        lamp_utils::ObservabilityCache::Instance().AddListener(
+            [this](const gtsam::Key& key) {
+              awaiting_observability_.Release(key);
+            });
+    b_observability_listener_ = true;
+  }
   return true;
 }
 
@@ -29,6 +46,11 @@ bool ObservabilityQueue::Initialize(const ros::NodeHandle &n) {
   if(!LoopCandidateQueue::Initialize(n)) { return false;}
 
   key_ = -1;
+  if (num_threads_ > 1) {
+    ThreadPool::Shared().reserve(num_threads_);
+  }
+  lamp_utils::ObservabilityCache::Instance().SetNumThreads(
+      std::max(1, num_threads_));
   return true;
 }
 bool ObservabilityQueue::LoadParameters(const ros::NodeHandle &n) {
@@ -44,6 +66,9 @@ bool ObservabilityQueue::LoadParameters(const ros::NodeHandle &n) {
 
   if (!pu::Get(param_ns_ + "/obs_prioritization/threads", num_threads_))
     return false;
+  if (!pu::Get(param_ns_ + "/queue/keyed_scans_max_delay",
+               keyed_scans_max_delay_))
+    return false;
 
     return true;
 }
@@ -63,21 +88,17 @@ void ObservabilityQueue::FindNextSet() {
   }
 }
 double ObservabilityQueue::ComputeObservability(const pose_graph_msgs::LoopCandidate& candidate){
-  // Check if keyed scans exist
-  if (keyed_scans_.find(candidate.key_from) == keyed_scans_.end() ||
-      keyed_scans_.find(candidate.key_to) == keyed_scans_.end()) {
+  // Check if the observability of both keyed scans is computed
+  lamp_utils::ObservabilityCache& cache =
+      lamp_utils::ObservabilityCache::Instance();
+  lamp_utils::ScanObservability obs_from, obs_to;
+  if (!cache.Get(candidate.key_from, &obs_from) ||
+      !cache.Get(candidate.key_to, &obs_to)) {
     return std::numeric_limits<double>::quiet_NaN();
   }
 
-  Eigen::Matrix<double, 3, 1> obs_eigenv_from;
-  lamp_utils::ComputeIcpObservability(keyed_scans_[candidate.key_from],
-                                 &obs_eigenv_from);
-  double min_obs_from = obs_eigenv_from.minCoeff();
-
-  Eigen::Matrix<double, 3, 1> obs_eigenv_to;
-  lamp_utils::ComputeIcpObservability(keyed_scans_[candidate.key_to],
-                                 &obs_eigenv_to);
-  double min_obs_to = obs_eigenv_to.minCoeff();
+  double min_obs_from = obs_from.eigenvalues.minCoeff();
+  double min_obs_to = obs_to.eigenvalues.minCoeff();
 
   double score = min_obs_from + min_obs_to;
 
@@ -85,24 +106,66 @@ double ObservabilityQueue::ComputeObservability(const pose_graph_msgs::LoopCandi
 }
 
 
-void ObservabilityQueue::OnNewLoopClosure() {
+void ObservabilityQueue::ScoreCandidates() {
+  // Candidates whose observability was computed since, then the new ones
+  std::vector<pose_graph_msgs::LoopCandidate> candidates;
+  awaiting_observability_.TakeReady(&candidates);
+  awaiting_observability_.Expire(ros::Time::now().toSec());
   for (auto& cur_queue : queues) {
     while(!cur_queue.second.empty()){
-      auto candidate = cur_queue.second.back();
-      double score = ComputeObservability(candidate);
-      if (isnan(score)) continue; //Retry, this happens when keyed scan isn't found
+      candidates.push_back(cur_queue.second.back());
       cur_queue.second.pop_back();
-      if (score >= min_observability_) {
-        auto pair = std::make_pair(score, candidate);
-        observability_queue_.push(pair);
-      } else {
-        //ROS_INFO_STREAM("Dropped closure with Observability " << score);
+    }
+  }
+
+  // Score all candidates in parallel on the shared pool
+  std::vector<std::future<double>> scores;
+  for (const auto& candidate : candidates) {
+    scores.emplace_back(ThreadPool::Shared().enqueue(
+        [this, candidate]() { return ComputeObservability(candidate); }));
+  }
+
+  lamp_utils::ObservabilityCache& cache =
+      lamp_utils::ObservabilityCache::Instance();
+  std::vector<gtsam::Key> missing;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    double score = scores[i].get();
+    if (isnan(score)) {
+      // Keyed scan not scored yet, released once the cache has it
+      missing.clear();
+      for (const gtsam::Key key :
+           {gtsam::Key(candidates[i].key_from),
+            gtsam::Key(candidates[i].key_to)}) {
+        if (!cache.Has(key))
+          missing.push_back(key);
       }
+      awaiting_observability_.Park(
+          candidates[i],
+          missing,
+          candidates[i].header.stamp.toSec() + keyed_scans_max_delay_);
+      // Computed between the check and the park
+      for (const gtsam::Key& key : missing) {
+        if (cache.Has(key))
+          awaiting_observability_.Release(key);
+      }
+      continue;
+    }
+    if (score >= min_observability_) {
+      auto pair = std::make_pair(score, candidates[i]);
+      observability_queue_.push(pair);
+    } else {
+      //ROS_INFO_STREAM("Dropped closure with Observability " << score);
     }
   }
 }
 
+void ObservabilityQueue::OnNewLoopClosure() {
+  ScoreCandidates();
+}
+
 void ObservabilityQueue::OnLoopComputationCompleted() {
+  // Include the candidates released while the computation was busy
+  ScoreCandidates();
   FindNextSet();
 }
 
@@ -116,11 +179,15 @@ void ObservabilityQueue::KeyedScanCallback(
     return;
   }
 
-  pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-  pcl::fromROSMsg(scan_msg->scan, *scan);
+  // Converted once per process and shared with the other scan consumers
+  PointCloudConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*scan_msg);
 
   // Add the key and scan.
   keyed_scans_.insert(std::pair<gtsam::Key, PointCloud::ConstPtr>(key, scan));
+
+  // Computed once per key off the callback thread
+  lamp_utils::ObservabilityCache::Instance().Request(key, scan);
 }
 
 }
@@ -4,9 +4,12 @@
  * @author Yun Chang
  */
 
+#include <algorithm>
+#include <cmath>
 #include <parameter_utils/ParameterUtils.h>
 #include <string>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/Tracing.h>
 
 #include "loop_closure/ProximityLoopGeneration.h"
 
@@ -14,7 +17,8 @@ namespace pu = parameter_utils;
 
 namespace lamp_loop_closure {
 
-ProximityLoopGeneration::ProximityLoopGeneration() : LoopGeneration() {}
+ProximityLoopGeneration::ProximityLoopGeneration()
+  : LoopGeneration(), b_use_optimized_values_(false) {}
 ProximityLoopGeneration::~ProximityLoopGeneration() {}
 
 bool ProximityLoopGeneration::Initialize(const ros::NodeHandle& n) {
@@ -73,12 +77,43 @@ bool ProximityLoopGeneration::LoadParameters(const ros::NodeHandle& n) {
 
   skip_recent_poses_ =
       (int)(distance_to_skip_recent_poses / translation_threshold_nodes);
+
+  if (!pu::Get(param_ns_ + "/proximity_pairs/intra_robot", b_intra_robot_))
+    return false;
+  if (!pu::Get(param_ns_ + "/proximity_pairs/inter_robot", b_inter_robot_))
+    return false;
+
+  if (!pu::Get(param_ns_ + "/proximity_updates/enabled",
+               b_use_optimized_values_))
+    return false;
+  if (!pu::Get(param_ns_ + "/proximity_updates/sigma_scale",
+               covariance_sigma_scale_))
+    return false;
+  if (!pu::Get(param_ns_ + "/proximity_updates/min_radius",
+               covariance_min_radius_))
+    return false;
+
+  // Search radius is bounded by the max threshold
+  keyed_positions_index_.SetCellSize(proximity_threshold_max_);
+
+  // Shared with the other nodes of the process (lamp_settings.yaml)
+  std::string prior_map_file;
+  n.param<std::string>("prior_map/file", prior_map_file, "");
+  n.param<double>("prior_map/radius", prior_map_radius_, 10.0);
+  if (!prior_map_file.empty() && !prior_map_.Open(prior_map_file))
+    return false;
   return true;
 }
 
 bool ProximityLoopGeneration::CreatePublishers(const ros::NodeHandle& n) {
   if (!LoopGeneration::CreatePublishers(n))
     return false;
+  if (prior_map_.IsOpen()) {
+    ros::NodeHandle nl(n);
+    prior_map_candidate_pub_ =
+        nl.advertise<pose_graph_msgs::LoopCandidateArray>(
+            "prior_map_candidates", 10, false);
+  }
   return true;
 }
 
@@ -89,6 +124,14 @@ bool ProximityLoopGeneration::RegisterCallbacks(const ros::NodeHandle& n) {
       100000,
       &ProximityLoopGeneration::KeyedPoseCallback,
       this);
+  if (b_use_optimized_values_) {
+    optimized_values_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+        "optimized_values",
+        10,
+        &ProximityLoopGeneration::OptimizedValuesCallback,
+        this);
+  }
+  SubscribeComputationStatus(nl);
   return true;
 }
 
@@ -102,28 +145,76 @@ ProximityLoopGeneration::DistanceBetweenKeys(const gtsam::Symbol& key1,
   return delta.translation().norm();
 }
 
+bool ProximityLoopGeneration::CovarianceRadius(const gtsam::Symbol& key,
+                                               const gtsam::Symbol& other_key,
+                                               double* radius) const {
+  auto other_variance = position_variances_.find(other_key);
+  if (other_variance == position_variances_.end())
+    return false;
+
+  // A key newer than the last optimization inherits the variance of the
+  // last optimized key of its robot, grown by the odometry since
+  double variance, growth = 0;
+  auto key_variance = position_variances_.find(key);
+  if (key_variance != position_variances_.end()) {
+    variance = key_variance->second;
+  } else {
+    auto last = last_optimized_keys_.find(key.chr());
+    if (last == last_optimized_keys_.end())
+      return false;
+    auto last_variance = position_variances_.find(last->second);
+    if (last_variance == position_variances_.end())
+      return false;
+    variance = last_variance->second;
+    growth = std::max(0.0,
+                      (static_cast<double>(key.index()) -
+                       static_cast<double>(last->second.index())) *
+                          increase_rate_);
+  }
+
+  *radius = std::max(covariance_min_radius_,
+                     covariance_sigma_scale_ *
+                             std::sqrt(variance + other_variance->second) +
+                         growth);
+  return true;
+}
+
 void ProximityLoopGeneration::GenerateLoops(const gtsam::Key& new_key) {
+  lamp_utils::TraceSpan span("loop_generation.proximity", new_key);
   // Loop closure off. No candidates generated
   if (!b_check_for_loop_closures_)
     return;
 
   const gtsam::Symbol key = gtsam::Symbol(new_key);
   std::vector<pose_graph_msgs::LoopCandidate> potential_candidates;
-  for (auto it = keyed_poses_.begin(); it != keyed_poses_.end(); ++it) {
-    const gtsam::Symbol other_key = it->first;
+  const size_t num_candidates = candidates_.size();
+
+  // Only check the keys within the max radius (sorted to keep the candidate
+  // order independent of the index layout)
+  std::vector<gtsam::Key> nearby_keys = keyed_positions_index_.RadiusSearch(
+      keyed_poses_.at(new_key).translation(), proximity_threshold_max_);
+  std::sort(nearby_keys.begin(), nearby_keys.end());
+
+  for (const gtsam::Key& nearby_key : nearby_keys) {
+    const gtsam::Symbol other_key = nearby_key;
 
     // Don't self-check.
     if (key == other_key)
       continue;
 
+    // Pairs closed elsewhere, e.g. intra-robot loops on the robots
+    const bool b_same_robot = lamp_utils::IsKeyFromSameRobot(key, other_key);
+    if (b_same_robot ? !b_intra_robot_ : !b_inter_robot_)
+      continue;
+
     // Don't compare against poses that were recently collected.
-    if (lamp_utils::IsKeyFromSameRobot(key, other_key) &&
+    if (b_same_robot &&
         std::llabs(key.index() - other_key.index()) < skip_recent_poses_)
       continue;
 
     double distance = DistanceBetweenKeys(key, other_key);
     double radius;
-    if (lamp_utils::IsKeyFromSameRobot(key, other_key)) {
+    if (b_same_robot) {
       radius = std::max(
           0.0,
           std::min(proximity_threshold_max_,
@@ -133,6 +224,11 @@ void ProximityLoopGeneration::GenerateLoops(const gtsam::Key& new_key) {
           proximity_threshold_min_,
           std::min(proximity_threshold_max_, key.index() * increase_rate_));
     }
+    // The marginals replace the drift model where they are known
+    double covariance_radius;
+    if (b_use_optimized_values_ &&
+        CovarianceRadius(key, other_key, &covariance_radius))
+      radius = std::min(radius, covariance_radius);
 
     if (distance > radius) {
       continue;
@@ -150,27 +246,70 @@ void ProximityLoopGeneration::GenerateLoops(const gtsam::Key& new_key) {
 
     potential_candidates.push_back(candidate);
   }
-  if (potential_candidates.size() < n_closest_) {
+
+  // Nodes of the prior map around the new key, unless the graph holds them
+  if (prior_map_.IsOpen()) {
+    const gtsam::Pose3& pose = keyed_poses_.at(new_key);
+    for (const auto& prior :
+         prior_map_.Query(pose.translation(), prior_map_radius_)) {
+      if (keyed_poses_.count(prior.first))
+        continue;
+      pose_graph_msgs::LoopCandidate candidate;
+      candidate.header.stamp = ros::Time::now();
+      candidate.key_from = new_key;
+      candidate.key_to = prior.first;
+      candidate.pose_from = lamp_utils::GtsamToRosMsg(pose);
+      candidate.pose_to = lamp_utils::GtsamToRosMsg(prior.second);
+      candidate.type = pose_graph_msgs::LoopCandidate::PROXIMITY;
+      candidate.value =
+          (pose.translation() - prior.second.translation()).norm();
+      potential_candidates.push_back(candidate);
+    }
+  }
+
+  // Only the closest ones while loop computation is saturated
+  const size_t n_closest = backpressure_.Keep(
+      std::min(potential_candidates.size(), static_cast<size_t>(n_closest_)),
+      1,
+      ros::Time::now().toSec());
+  if (potential_candidates.size() <= n_closest) {
     candidates_.insert(candidates_.end(),
                        potential_candidates.begin(),
                        potential_candidates.end());
   } else {
-    sort(potential_candidates.begin(),
-         potential_candidates.end(),
-         [](const pose_graph_msgs::LoopCandidate& lhs,
-            const pose_graph_msgs::LoopCandidate& rhs) {
-           return lhs.value < rhs.value;
-         });
+    // Partial selection of the n closest, only those are sorted
+    auto closer = [](const pose_graph_msgs::LoopCandidate& lhs,
+                     const pose_graph_msgs::LoopCandidate& rhs) {
+      return lhs.value < rhs.value;
+    };
+    std::nth_element(potential_candidates.begin(),
+                     potential_candidates.begin() + n_closest,
+                     potential_candidates.end(),
+                     closer);
+    std::sort(potential_candidates.begin(),
+              potential_candidates.begin() + n_closest,
+              closer);
     candidates_.insert(candidates_.end(),
                        potential_candidates.begin(),
-                       potential_candidates.begin() + n_closest_);
+                       potential_candidates.begin() + n_closest);
+  }
+  if (prior_map_.IsOpen()) {
+    auto first_prior = std::stable_partition(
+        candidates_.begin() + num_candidates,
+        candidates_.end(),
+        [this](const pose_graph_msgs::LoopCandidate& candidate) {
+          return keyed_poses_.count(candidate.key_to) > 0;
+        });
+    prior_map_candidates_.insert(
+        prior_map_candidates_.end(), first_prior, candidates_.end());
+    candidates_.erase(first_prior, candidates_.end());
   }
   return;
 }
 
 void ProximityLoopGeneration::KeyedPoseCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
-  pose_graph_msgs::PoseGraphNode node_msg;
+  std::lock_guard<std::mutex> lock(poses_mutex_);
   for (const auto& node_msg : graph_msg->nodes) {
     gtsam::Symbol new_key = gtsam::Symbol(node_msg.key); // extract new key
     ros::Time timestamp = node_msg.header.stamp; // extract new timestamp
@@ -183,7 +322,7 @@ void ProximityLoopGeneration::KeyedPoseCallback(
       continue; // Not a new node
     }
 
-    // also extract poses (NOTE(Yun) this pose will not be updated...)
+    // also extract poses (updated by OptimizedValuesCallback if enabled)
     gtsam::Pose3 new_pose;
     gtsam::Point3 pose_translation(node_msg.pose.position.x,
                                    node_msg.pose.position.y,
@@ -196,15 +335,60 @@ void ProximityLoopGeneration::KeyedPoseCallback(
 
     // add new key and pose to keyed_poses_
     keyed_poses_[new_key] = new_pose;
+    keyed_positions_index_.Insert(new_key, new_pose.translation());
 
     GenerateLoops(new_key);
   }
 
-  if (loop_candidate_pub_.getNumSubscribers() > 0 && candidates_.size() > 0) {
+  if (HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get()) &&
+      candidates_.size() > 0) {
     PublishLoops();
     ClearLoops();
   }
+  // Not kept for later subscribers, the next keys bring their own
+  if (!prior_map_candidates_.empty()) {
+    pose_graph_msgs::LoopCandidateArray candidates_msg;
+    candidates_msg.candidates.swap(prior_map_candidates_);
+    if (prior_map_candidate_pub_.getNumSubscribers() > 0)
+      prior_map_candidate_pub_.publish(candidates_msg);
+  }
   return;
 }
 
+void ProximityLoopGeneration::OptimizedValuesCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  std::lock_guard<std::mutex> lock(poses_mutex_);
+  std::vector<std::pair<gtsam::Key, gtsam::Point3>> moved;
+  moved.reserve(graph_msg->nodes.size());
+  for (const auto& node_msg : graph_msg->nodes) {
+    const gtsam::Symbol key(node_msg.key);
+    if (!lamp_utils::IsRobotPrefix(key.chr()))
+      continue;
+
+    // Marginal covariance in the gtsam Pose3 order, rotation first
+    const double variance = node_msg.covariance[21] +
+        node_msg.covariance[28] + node_msg.covariance[35];
+    if (std::isfinite(variance) && variance > 0) {
+      position_variances_[key] = variance;
+      auto last = last_optimized_keys_.find(key.chr());
+      if (last == last_optimized_keys_.end()) {
+        last_optimized_keys_.emplace(key.chr(), key);
+      } else if (last->second.index() < key.index()) {
+        last->second = key;
+      }
+    } else {
+      position_variances_.erase(key);
+    }
+
+    // Keys not seen yet are added by KeyedPoseCallback
+    auto pose = keyed_poses_.find(key);
+    if (pose == keyed_poses_.end())
+      continue;
+    pose->second = lamp_utils::ToGtsam(node_msg.pose);
+    moved.emplace_back(key, pose->second.translation());
+  }
+  keyed_positions_index_.InsertBatch(moved);
+}
+
 } // namespace lamp_loop_closure
\ No newline at end of file
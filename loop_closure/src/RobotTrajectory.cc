@@ -0,0 +1,88 @@
+/**
+ * @file   RobotTrajectory.cc
+ * @brief  Poses of one robot sorted by time, indexed by key and by position
+ */
+
+#include "loop_closure/RobotTrajectory.h"
+
+#include <algorithm>
+
+namespace lamp_loop_closure {
+
+namespace {
+gtsam::Point3 ToPoint3(const geometry_msgs::Point& p) {
+  return gtsam::Point3(p.x, p.y, p.z);
+}
+} // namespace
+
+RobotTrajectory::RobotTrajectory(double cell_size)
+  : spatial_index_(cell_size) {}
+
+void RobotTrajectory::Insert(const pose_graph_msgs::PoseGraphNode& node) {
+  const gtsam::Key key = node.key;
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    // Graphs are sent whole, so most nodes are already there
+    geometry_msgs::Pose& pose = poses_[it->second];
+    if (pose.position.x != node.pose.position.x ||
+        pose.position.y != node.pose.position.y ||
+        pose.position.z != node.pose.position.z) {
+      spatial_index_.Insert(key, ToPoint3(node.pose.position));
+    }
+    pose = node.pose;
+    return;
+  }
+
+  const double stamp = node.header.stamp.toSec();
+  size_t i = stamps_.size();
+  if (!stamps_.empty() && stamp < stamps_.back()) {
+    // Out of order, the entries after it shift by one
+    i = std::upper_bound(stamps_.begin(), stamps_.end(), stamp) -
+        stamps_.begin();
+    for (size_t j = i; j < keys_.size(); j++) {
+      index_[keys_[j]] = j + 1;
+    }
+  }
+  stamps_.insert(stamps_.begin() + i, stamp);
+  keys_.insert(keys_.begin() + i, key);
+  poses_.insert(poses_.begin() + i, node.pose);
+  index_[key] = i;
+  spatial_index_.Insert(key, ToPoint3(node.pose.position));
+}
+
+void RobotTrajectory::Clear() {
+  stamps_.clear();
+  keys_.clear();
+  poses_.clear();
+  index_.clear();
+  spatial_index_.Clear();
+}
+
+pose_graph_msgs::PoseGraphNode RobotTrajectory::Node(size_t i) const {
+  pose_graph_msgs::PoseGraphNode node;
+  node.header.stamp.fromSec(stamps_[i]);
+  node.key = keys_[i];
+  node.pose = poses_[i];
+  return node;
+}
+
+size_t RobotTrajectory::LowerBound(double stamp) const {
+  return std::lower_bound(stamps_.begin(), stamps_.end(), stamp) -
+      stamps_.begin();
+}
+
+bool RobotTrajectory::Find(const gtsam::Key& key, size_t* index) const {
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return false;
+  *index = it->second;
+  return true;
+}
+
+std::vector<gtsam::Key>
+RobotTrajectory::KeysWithin(const geometry_msgs::Point& position,
+                            double radius) const {
+  return spatial_index_.RadiusSearch(ToPoint3(position), radius);
+}
+
+} // namespace lamp_loop_closure
@@ -2,6 +2,9 @@
 // Created by chris on 6/2/21.
 //
 #include "loop_closure/RoundRobinLoopCandidateQueue.h"
+#include <algorithm>
+#include <cmath>
+#include <gtsam/inference/Symbol.h>
 #include <parameter_utils/ParameterUtils.h>
 namespace pu = parameter_utils;
 namespace lamp_loop_closure {
@@ -20,6 +23,20 @@ bool RoundRobinLoopCandidateQueue::LoadParameters(const ros::NodeHandle &n) {
 
   if (!pu::Get(param_ns_ + "/queue/amount_per_round",
                amount_per_round_)) {return false;}
+  if (!pu::Get(param_ns_ + "/queue/adaptive/enabled", b_adaptive_)) {return false;}
+  if (!pu::Get(param_ns_ + "/queue/adaptive/min_per_round",
+               min_per_round_)) {return false;}
+  if (!pu::Get(param_ns_ + "/queue/adaptive/target_round_time",
+               target_round_time_)) {return false;}
+  if (!pu::Get(param_ns_ + "/queue/adaptive/latency_smoothing",
+               latency_smoothing_)) {return false;}
+  if (!pu::Get(param_ns_ + "/queue/adaptive/min_pair_share",
+               min_pair_share_)) {return false;}
+  if (!pu::Get(param_ns_ + "/queue/adaptive/success_decay",
+               success_decay_)) {return false;}
+  // Every bucket has to gain some credit per pass
+  min_pair_share_ = std::min(std::max(min_pair_share_, 0.01), 1.0);
+  min_per_round_ = std::max(std::min(min_per_round_, amount_per_round_), 1);
   return true;
 }
 
@@ -81,11 +98,127 @@ void RoundRobinLoopCandidateQueue::FindNextSet() {
     LoopCandidateQueue::PublishLoopCandidate(out_array);
 }
 
+void RoundRobinLoopCandidateQueue::FindAdaptiveSet() {
+  // Sort the pending candidates by originator and robot pair, oldest first
+  for (auto& cur_queue : queues) {
+    for (const auto& candidate : cur_queue.second) {
+      const std::string robot_pair{gtsam::Symbol(candidate.key_from).chr(),
+                                   gtsam::Symbol(candidate.key_to).chr()};
+      buckets_[std::make_pair(cur_queue.first, robot_pair)]
+          .candidates.push_back(candidate);
+    }
+    cur_queue.second.clear();
+  }
+
+  const size_t batch_size = AdaptiveBatchSize();
+  pose_graph_msgs::LoopCandidateArray out_array;
+  bool b_pending = true;
+  while (b_pending && out_array.candidates.size() < batch_size) {
+    b_pending = false;
+    for (auto& bucket : buckets_) {
+      Bucket& b = bucket.second;
+      if (b.candidates.empty()) {
+        b.deficit = 0;
+        continue;
+      }
+      b_pending = true;
+      b.deficit += PairWeight(bucket.first.second);
+      // Newest first, as the plain round robin
+      while (b.deficit >= 1.0 && !b.candidates.empty() &&
+             out_array.candidates.size() < batch_size) {
+        out_array.candidates.push_back(b.candidates.back());
+        b.candidates.pop_back();
+        b.deficit -= 1.0;
+      }
+      if (out_array.candidates.size() >= batch_size)
+        break;
+    }
+  }
+
+  static int info_count = 0;
+  if (info_count % 10 == 0) {
+    for (const auto& bucket : buckets_) {
+      ROS_INFO_STREAM("Queue " << bucket.first.first << " pair "
+                               << bucket.first.second << " has "
+                               << bucket.second.candidates.size()
+                               << " elements, weight "
+                               << PairWeight(bucket.first.second));
+    }
+    ROS_INFO_STREAM("Releasing " << out_array.candidates.size() << " of at most "
+                                 << batch_size << " candidates");
+  }
+  info_count++;
+  if (out_array.candidates.size() > 0)
+    LoopCandidateQueue::PublishLoopCandidate(out_array);
+}
+
+int RoundRobinLoopCandidateQueue::AdaptiveBatchSize() const {
+  if (candidate_latency_ <= 0)
+    return amount_per_round_;
+  const double batch =
+      std::round(num_workers_ * target_round_time_ / candidate_latency_);
+  return static_cast<int>(std::min<double>(
+      std::max<double>(batch, min_per_round_), amount_per_round_));
+}
+
+double RoundRobinLoopCandidateQueue::PairWeight(
+    const std::string& robot_pair) const {
+  // Laplace smoothed success rate, so untried pairs start at one half
+  double rate = 0.5;
+  const auto it = pair_stats_.find(robot_pair);
+  if (it != pair_stats_.end()) {
+    rate = (it->second.accepted + 1.0) / (it->second.computed + 2.0);
+  }
+  return min_pair_share_ + (1.0 - min_pair_share_) * rate;
+}
+
+void RoundRobinLoopCandidateQueue::OnLoopComputationStatus(
+    const pose_graph_msgs::LoopComputationStatus& status) {
+  num_workers_ = std::max(status.num_workers, 1);
+  // After COMPLETED_ALL, the next status with alignments starts a new batch
+  const bool b_batch_done = status.type == status.COMPLETED_ALL;
+  // Idle statuses carry no measurement
+  if (status.num_computed == 0) {
+    if (b_batch_done)
+      b_batch_decayed_ = false;
+    return;
+  }
+
+  const double latency =
+      status.compute_time * num_workers_ / status.num_computed;
+  candidate_latency_ = candidate_latency_ < 0
+      ? latency
+      : latency_smoothing_ * latency +
+          (1.0 - latency_smoothing_) * candidate_latency_;
+
+  // Decayed once per batch with alignments, however many statuses it
+  // streamed
+  if (!b_batch_decayed_) {
+    for (auto& stats : pair_stats_) {
+      stats.second.computed *= success_decay_;
+      stats.second.accepted *= success_decay_;
+    }
+  }
+  b_batch_decayed_ = !b_batch_done;
+  const size_t n_pairs = std::min(
+      status.robot_pairs.size(),
+      std::min(status.pair_computed.size(), status.pair_accepted.size()));
+  for (size_t i = 0; i < n_pairs; i++) {
+    PairStats& stats = pair_stats_[status.robot_pairs[i]];
+    stats.computed += status.pair_computed[i];
+    stats.accepted += status.pair_accepted[i];
+  }
+}
+
 void RoundRobinLoopCandidateQueue::OnNewLoopClosure() {
 }
 
 void RoundRobinLoopCandidateQueue::OnLoopComputationCompleted() {
-  FindNextSet();
+  if (b_adaptive_) {
+    FindAdaptiveSet();
+  } else {
+    FindNextSet();
+  }
 }
 
 }
@@ -1,4 +1,5 @@
 #include <loop_closure/RssiLoopClosure.h>
+#include <lamp_utils/Tracing.h>
 
 namespace lamp_loop_closure {
 RssiLoopClosure::RssiLoopClosure() {}
@@ -110,9 +111,8 @@ void RssiLoopClosure::KeyedPoseCallback(
     // if node has a robot prefix
     if (!lamp_utils::IsRobotPrefix(new_key.chr()))
       continue;
-    // append to the trajectory with time stamp
-    robots_trajectory_[new_key.chr()].insert(
-        {node_msg.header.stamp.toSec(), node_msg});
+    // append to the trajectory with time stamp, or update its pose
+    robots_trajectory_[new_key.chr()].Insert(node_msg);
     // if (Debug) // FOR DEBUGGING PURPOSES
     //    {
     //    if (keyed_poses_.count(new_key) > 0) {
@@ -192,8 +192,11 @@ void RssiLoopClosure::CommNodeAggregatedStatusCallback(
 }
 
 void RssiLoopClosure::Update(const ros::Time& time_stamp) {
-  // for every scom-{robot} (radio on the robot) look for loop closure
-  for (auto& scom_robot : rssi_scom_robot_list_) {
+  lamp_utils::TraceSpan span("loop_generation.rssi");
+  // for every scom-{robot} (radio on the robot) that reported since the last
+  // update look for loop closure
+  for (const auto& robot_radio : pending_robot_radios_) {
+    const auto& scom_robot = *rssi_scom_robot_list_.find(robot_radio);
     // iterate over radios that are connected to the scom-{robot} radio
     for (const auto& neighbour : scom_robot.second.neighbors) {
       // if radio conntected to the scom-{robot} and was dropped (so it must
@@ -258,6 +261,7 @@ void RssiLoopClosure::Update(const ros::Time& time_stamp) {
                               .append_node(scom_pose_associated_for_scom_robot);
           // visualization
           if (appended) {
+            changed_dropped_radios_.insert(neighbour.neighbor_node_label);
             auto color = getColorByIndex(
                 rssi_scom_dropped_list_[neighbour.neighbor_node_label]
                     .flyby_number);
@@ -274,6 +278,7 @@ void RssiLoopClosure::Update(const ros::Time& time_stamp) {
       }
     }
   }
+  pending_robot_radios_.clear();
   GenerateLoops();
 }
 
@@ -293,9 +298,13 @@ void RssiLoopClosure::CommNodeRawCallback(
         //        ROS_INFO_STREAM("Update communication msgs with" <<
         //        node.node_label);
         rssi_scom_robot_list_[node.node_label] = node;
+        pending_robot_radios_.insert(node.node_label);
       }
     }
   }
+  // no robot we look for loop closures from reported, nothing to do
+  if (pending_robot_radios_.empty())
+    return;
   // calling for loop closure proposal generation from the given signals
   auto t_start = std::chrono::high_resolution_clock::now();
   Update(msg->header.stamp);
@@ -307,7 +316,7 @@ void RssiLoopClosure::CommNodeRawCallback(
 //*************HELPER FUNCTIONS*******************/
 // it is adapted from pose_graph class
 pose_graph_msgs::PoseGraphNode RssiLoopClosure::GetClosestPoseAtTime(
-    const std::map<double, pose_graph_msgs::PoseGraphNode>& robot_trajectory,
+    const RobotTrajectory& robot_trajectory,
     const ros::Time& stamp,
     double time_threshold,
     bool check_threshold) const {
@@ -318,39 +327,25 @@ pose_graph_msgs::PoseGraphNode RssiLoopClosure::GetClosestPoseAtTime(
     return pose_graph_msgs::PoseGraphNode();
   }
 
-  // Output key
-  pose_graph_msgs::PoseGraphNode pose_out;
-
-  // Iterators pointing immediately before and after the target time
-  auto iterAfter = robot_trajectory.lower_bound(stamp.toSec());
-  auto iterBefore = std::prev(iterAfter);
-  double t1 = iterBefore->first;
-  double t2 = iterAfter->first;
-  double t_closest;
-  bool b_is_end_case = false;
+  // Entries immediately before and after the target time
+  const size_t after = robot_trajectory.LowerBound(stamp.toSec());
+  size_t closest;
 
   // If time is before the start or after the end, return first/last key
-  if (iterAfter == robot_trajectory.begin()) {
+  if (after == 0) {
     ROS_ERROR("Time stamp before start of range (GetClosestKeyAtTime)");
-    pose_out = iterAfter->second;
-    t_closest = t2;
-    b_is_end_case = true;
-  } else if (iterAfter == robot_trajectory.end()) {
+    closest = after;
+  } else if (after == robot_trajectory.size()) {
     ROS_ERROR("Time past end of the range (GetClosestKeyAtTime).");
-    pose_out = iterBefore->second;
-    t_closest = t1;
-    b_is_end_case = true;
-  }
-  if (!b_is_end_case) {
+    closest = after - 1;
+  } else {
     // Otherwise return the closer key
-    if (stamp.toSec() - t1 < t2 - stamp.toSec()) {
-      pose_out = iterBefore->second;
-      t_closest = t1;
-    } else {
-      pose_out = iterAfter->second;
-      t_closest = t2;
-    }
+    const double t1 = robot_trajectory.Stamp(after - 1);
+    const double t2 = robot_trajectory.Stamp(after);
+    closest = stamp.toSec() - t1 < t2 - stamp.toSec() ? after - 1 : after;
   }
+  const double t_closest = robot_trajectory.Stamp(closest);
+  pose_graph_msgs::PoseGraphNode pose_out = robot_trajectory.Node(closest);
   // Check threshold
   if (check_threshold && std::abs(t_closest - stamp.toSec()) > time_threshold) {
     ROS_ERROR("Delta between queried time and closest time in graph too large");
@@ -372,12 +367,11 @@ pose_graph_msgs::PoseGraphNode RssiLoopClosure::GetClosestPoseAtTime(
 }
 
 pose_graph_msgs::PoseGraphNode RssiLoopClosure::GetPoseGraphNodeFromKey(
-    const std::map<double, pose_graph_msgs::PoseGraphNode>& robot_trajectory,
+    const RobotTrajectory& robot_trajectory,
     const gtsam::Symbol& key) const {
-  for (const auto& robot_pose : robot_trajectory) {
-    if (robot_pose.second.key == key) {
-      return robot_pose.second;
-    }
+  size_t index;
+  if (robot_trajectory.Find(key, &index)) {
+    return robot_trajectory.Node(index);
   }
   return pose_graph_msgs::PoseGraphNode();
 }
@@ -386,18 +380,24 @@ void RssiLoopClosure::GenerateLoops() {
   // Loop closure off. No candidates generated
   if (!b_check_for_loop_closures_)
     return;
-  // by default "nodes_to_nodes"
-  if (radio_loop_closure_method_ == "radio_to_nodes") {
-    RadioToNodesLoopClosure();
-  } else if (radio_loop_closure_method_ == "nodes_to_nodes") {
-    NodesToNodesLoopClosures();
-  } else {
-    // TODO: I prefer doing this with enum and switch statement
-    ROS_WARN_STREAM("GenerateLoops: Something is wrong in RSSI loop generation "
-                    "since the method doesn't exist. ");
+  // only flybys that grew can give new candidates
+  if (!changed_dropped_radios_.empty()) {
+    // by default "nodes_to_nodes"
+    if (radio_loop_closure_method_ == "radio_to_nodes") {
+      RadioToNodesLoopClosure();
+    } else if (radio_loop_closure_method_ == "nodes_to_nodes") {
+      NodesToNodesLoopClosures();
+    } else {
+      // TODO: I prefer doing this with enum and switch statement
+      ROS_WARN_STREAM("GenerateLoops: Something is wrong in RSSI loop "
+                      "generation since the method doesn't exist. ");
+    }
+    changed_dropped_radios_.clear();
   }
 
-  if (loop_candidate_pub_.getNumSubscribers() > 0 && candidates_.size() > 0) {
+  if (HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get()) &&
+      candidates_.size() > 0) {
     ROS_INFO_STREAM("Sending potential loop closures: " << candidates_.size());
     PublishLoops();
     ClearLoops();
@@ -407,7 +407,8 @@ void RssiLoopClosure::GenerateLoops() {
 
 //[[deprecated]]
 void RssiLoopClosure::RadioToNodesLoopClosure() {
-  for (auto& rssi_node_dropped : rssi_scom_dropped_list_) {
+  for (const auto& hostname : changed_dropped_radios_) {
+    auto& rssi_node_dropped = *rssi_scom_dropped_list_.find(hostname);
     for (size_t i = 0;
          i < rssi_node_dropped.second.all_nodes_around_comm.size();
          i++) {
@@ -437,8 +438,9 @@ void RssiLoopClosure::RadioToNodesLoopClosure() {
   }
 }
 void RssiLoopClosure::NodesToNodesLoopClosures() {
-  // for every scom-{number} dropped
-  for (auto& rssi_node_dropped : rssi_scom_dropped_list_) {
+  // for every scom-{number} dropped whose flybys grew
+  for (const auto& hostname : changed_dropped_radios_) {
+    auto& rssi_node_dropped = *rssi_scom_dropped_list_.find(hostname);
     // for every flyby of the robot by the node (so basically the robot was
     // close to the node)
     for (size_t flyby_i = 0;
@@ -0,0 +1,308 @@
+/**
+ * @file   ScanContext.cc
+ * @brief  Scan Context global descriptor of keyed scans, and a nearest
+ * neighbour index over them
+ */
+
+#include "loop_closure/ScanContext.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <queue>
+
+namespace lamp_loop_closure {
+
+namespace {
+
+const size_t kLeafSize = 16;
+
+} // namespace
+
+ScanContext::ScanContext(const PointCloud& scan,
+                         const ScanContextParams& params)
+    : num_rings_(params.num_rings), num_sectors_(params.num_sectors) {
+  descriptor_.assign(num_rings_ * num_sectors_, 0.0f);
+  const double ring_scale = num_rings_ / params.max_radius;
+  const double sector_scale = num_sectors_ / (2.0 * M_PI);
+  size_t num_binned = 0;
+  for (const Point& p : scan.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    const double radius = std::sqrt(p.x * p.x + p.y * p.y);
+    if (radius <= 0.0 || radius >= params.max_radius)
+      continue;
+    double azimuth = std::atan2(p.y, p.x);
+    if (azimuth < 0.0)
+      azimuth += 2.0 * M_PI;
+    const int ring = std::min(static_cast<int>(radius * ring_scale),
+                              num_rings_ - 1);
+    const int sector = std::min(static_cast<int>(azimuth * sector_scale),
+                                num_sectors_ - 1);
+    float& cell = descriptor_[sector * num_rings_ + ring];
+    cell = std::max(cell, static_cast<float>(p.z + params.lidar_height));
+    num_binned++;
+  }
+  // Nothing to recognize, stays Empty()
+  if (num_binned == 0) {
+    descriptor_.clear();
+    return;
+  }
+
+  column_norms_.assign(num_sectors_, 0.0f);
+  ring_key_.assign(num_rings_, 0.0f);
+  sector_key_.assign(num_sectors_, 0.0f);
+  for (int s = 0; s < num_sectors_; s++) {
+    const float* column = &descriptor_[s * num_rings_];
+    float norm = 0.0f;
+    float sum = 0.0f;
+    for (int r = 0; r < num_rings_; r++) {
+      norm += column[r] * column[r];
+      sum += column[r];
+      if (column[r] > 0.0f)
+        ring_key_[r] += 1.0f;
+    }
+    column_norms_[s] = std::sqrt(norm);
+    sector_key_[s] = sum / num_rings_;
+  }
+  for (float& occupancy : ring_key_) {
+    occupancy /= num_sectors_;
+  }
+}
+
+double ScanContext::Distance(const ScanContext& other,
+                             int search_radius,
+                             int* shift) const {
+  *shift = 0;
+  if (Empty() || other.Empty() || num_rings_ != other.num_rings_ ||
+      num_sectors_ != other.num_sectors_)
+    return 1.0;
+
+  // Coarse alignment on the sector keys, refined with the full columns
+  const int aligned = AlignSectorKeys(other);
+  double best = std::numeric_limits<double>::max();
+  for (int offset = -search_radius; offset <= search_radius; offset++) {
+    const int s = ((aligned + offset) % num_sectors_ + num_sectors_) %
+        num_sectors_;
+    const double distance = ShiftedDistance(other, s);
+    if (distance < best) {
+      best = distance;
+      *shift = s;
+    }
+  }
+  return best;
+}
+
+double ScanContext::YawOfShift(int shift) const {
+  double yaw = 2.0 * M_PI * shift / num_sectors_;
+  if (yaw > M_PI)
+    yaw -= 2.0 * M_PI;
+  return yaw;
+}
+
+double ScanContext::ShiftedDistance(const ScanContext& other,
+                                    int shift) const {
+  double similarity = 0.0;
+  int num_valid = 0;
+  for (int s = 0; s < num_sectors_; s++) {
+    const int other_s = (s + shift) % num_sectors_;
+    const float norm = column_norms_[s] * other.column_norms_[other_s];
+    if (norm == 0.0f)
+      continue;
+    const float* a = &descriptor_[s * num_rings_];
+    const float* b = &other.descriptor_[other_s * num_rings_];
+    float dot = 0.0f;
+#pragma omp simd reduction(+ : dot)
+    for (int r = 0; r < num_rings_; r++) {
+      dot += a[r] * b[r];
+    }
+    similarity += dot / norm;
+    num_valid++;
+  }
+  if (num_valid == 0)
+    return 1.0;
+  return 1.0 - similarity / num_valid;
+}
+
+int ScanContext::AlignSectorKeys(const ScanContext& other) const {
+  int best_shift = 0;
+  float best = std::numeric_limits<float>::max();
+  for (int shift = 0; shift < num_sectors_; shift++) {
+    float distance = 0.0f;
+    for (int s = 0; s < num_sectors_; s++) {
+      const float diff =
+          sector_key_[s] - other.sector_key_[(s + shift) % num_sectors_];
+      distance += diff * diff;
+    }
+    if (distance < best) {
+      best = distance;
+      best_shift = shift;
+    }
+  }
+  return best_shift;
+}
+
+void ScanContextIndex::SetParams(size_t max_leaf_checks, size_t rebuild_size) {
+  max_leaf_checks_ = std::max<size_t>(max_leaf_checks, 1);
+  rebuild_size_ = std::max<size_t>(rebuild_size, 1);
+}
+
+void ScanContextIndex::Insert(const gtsam::Key& key,
+                              const ScanContext& descriptor) {
+  if (descriptor.Empty() || key_index_.count(key) > 0)
+    return;
+  key_index_[key] = entries_.size();
+  entries_.push_back(Entry{key, descriptor});
+  if (entries_.size() - num_in_tree_ >= rebuild_size_)
+    Rebuild();
+}
+
+std::vector<std::pair<gtsam::Key, float>>
+ScanContextIndex::Query(const ScanContext& descriptor,
+                        size_t k,
+                        const KeyFilter& filter) const {
+  std::vector<std::pair<gtsam::Key, float>> neighbours;
+  if (k == 0 || descriptor.Empty())
+    return neighbours;
+  const std::vector<float>& ring_key = descriptor.RingKey();
+
+  // Max heap of the k best so far
+  std::priority_queue<std::pair<float, size_t>> best;
+  auto consider = [&](size_t entry) {
+    if (filter && !filter(entries_[entry].key))
+      return;
+    const float distance = RingDistance(ring_key, entry);
+    if (best.size() < k) {
+      best.emplace(distance, entry);
+    } else if (distance < best.top().first) {
+      best.pop();
+      best.emplace(distance, entry);
+    }
+  };
+
+  for (size_t entry = num_in_tree_; entry < entries_.size(); entry++) {
+    consider(entry);
+  }
+
+  // Best bin first: branches by their lower bound distance
+  typedef std::pair<float, size_t> Branch;
+  std::priority_queue<Branch, std::vector<Branch>, std::greater<Branch>>
+      branches;
+  if (!nodes_.empty())
+    branches.emplace(0.0f, 0);
+  size_t leaf_checks = 0;
+  while (!branches.empty() && leaf_checks < max_leaf_checks_) {
+    const Branch branch = branches.top();
+    branches.pop();
+    if (best.size() == k && branch.first >= best.top().first)
+      break;
+    size_t node = branch.second;
+    while (nodes_[node].dimension >= 0) {
+      const Node& n = nodes_[node];
+      const float diff = ring_key[n.dimension] - n.split;
+      const size_t near = diff < 0.0f ? n.left : n.right;
+      const size_t far = diff < 0.0f ? n.right : n.left;
+      branches.emplace(std::max(branch.first, diff * diff), far);
+      node = near;
+    }
+    for (size_t i = nodes_[node].begin; i < nodes_[node].end; i++) {
+      consider(tree_order_[i]);
+    }
+    leaf_checks++;
+  }
+
+  neighbours.resize(best.size());
+  for (size_t i = neighbours.size(); i > 0; i--) {
+    neighbours[i - 1] = std::make_pair(entries_[best.top().second].key,
+                                       best.top().first);
+    best.pop();
+  }
+  return neighbours;
+}
+
+const ScanContext* ScanContextIndex::Get(const gtsam::Key& key) const {
+  auto it = key_index_.find(key);
+  if (it == key_index_.end())
+    return nullptr;
+  return &entries_[it->second].descriptor;
+}
+
+void ScanContextIndex::Clear() {
+  entries_.clear();
+  key_index_.clear();
+  tree_order_.clear();
+  nodes_.clear();
+  num_in_tree_ = 0;
+}
+
+void ScanContextIndex::Rebuild() {
+  tree_order_.resize(entries_.size());
+  for (size_t i = 0; i < tree_order_.size(); i++) {
+    tree_order_[i] = i;
+  }
+  nodes_.clear();
+  if (!tree_order_.empty())
+    BuildNode(0, tree_order_.size());
+  num_in_tree_ = entries_.size();
+}
+
+size_t ScanContextIndex::BuildNode(size_t begin, size_t end) {
+  const size_t index = nodes_.size();
+  nodes_.emplace_back();
+  nodes_[index].begin = begin;
+  nodes_[index].end = end;
+  if (end - begin <= kLeafSize)
+    return index;
+
+  // Split the dimension of largest spread at its median
+  const size_t dims = entries_[tree_order_[begin]].descriptor.RingKey().size();
+  int dimension = -1;
+  float max_spread = 0.0f;
+  for (size_t d = 0; d < dims; d++) {
+    float lo = std::numeric_limits<float>::max();
+    float hi = std::numeric_limits<float>::lowest();
+    for (size_t i = begin; i < end; i++) {
+      const float v = entries_[tree_order_[i]].descriptor.RingKey()[d];
+      lo = std::min(lo, v);
+      hi = std::max(hi, v);
+    }
+    if (hi - lo > max_spread) {
+      max_spread = hi - lo;
+      dimension = d;
+    }
+  }
+  if (dimension < 0)
+    return index;
+
+  const size_t mid = begin + (end - begin) / 2;
+  auto value = [&](size_t entry) {
+    return entries_[entry].descriptor.RingKey()[dimension];
+  };
+  std::nth_element(tree_order_.begin() + begin,
+                   tree_order_.begin() + mid,
+                   tree_order_.begin() + end,
+                   [&](size_t a, size_t b) { return value(a) < value(b); });
+  const float split = value(tree_order_[mid]);
+  const size_t left = BuildNode(begin, mid);
+  const size_t right = BuildNode(mid, end);
+  nodes_[index].dimension = dimension;
+  nodes_[index].split = split;
+  nodes_[index].left = left;
+  nodes_[index].right = right;
+  return index;
+}
+
+float ScanContextIndex::RingDistance(const std::vector<float>& ring_key,
+                                     size_t entry) const {
+  const std::vector<float>& other = entries_[entry].descriptor.RingKey();
+  const size_t n = std::min(ring_key.size(), other.size());
+  float distance = 0.0f;
+#pragma omp simd reduction(+ : distance)
+  for (size_t i = 0; i < n; i++) {
+    const float diff = ring_key[i] - other[i];
+    distance += diff * diff;
+  }
+  return distance;
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,218 @@
+/**
+ * @file   ScanContextLoopGeneration.cc
+ * @brief  Find potential loop closures by place recognition on the keyed
+ * scans (Scan Context)
+ */
+
+#include <algorithm>
+#include <parameter_utils/ParameterUtils.h>
+#include <string>
+#include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/SharedScanStore.h>
+
+#include "loop_closure/ScanContextLoopGeneration.h"
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+ScanContextLoopGeneration::ScanContextLoopGeneration() : LoopGeneration() {}
+ScanContextLoopGeneration::~ScanContextLoopGeneration() {}
+
+bool ScanContextLoopGeneration::Initialize(const ros::NodeHandle& n) {
+  std::string name =
+      ros::names::append(n.getNamespace(), "ScanContextLoopGeneration");
+  if (!LoadParameters(n)) {
+    ROS_ERROR("%s: Failed to load parameters.", name.c_str());
+    return false;
+  }
+
+  if (!RegisterCallbacks(n)) {
+    ROS_ERROR("%s: Failed to register callbacks.", name.c_str());
+    return false;
+  }
+
+  if (!CreatePublishers(n)) {
+    ROS_ERROR("%s: Failed to create publishers.", name.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool ScanContextLoopGeneration::LoadParameters(const ros::NodeHandle& n) {
+  if (!LoopGeneration::LoadParameters(n))
+    return false;
+
+  if (!pu::Get(param_ns_ + "/scan_context/num_rings",
+               descriptor_params_.num_rings))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/num_sectors",
+               descriptor_params_.num_sectors))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/max_radius",
+               descriptor_params_.max_radius))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/lidar_height",
+               descriptor_params_.lidar_height))
+    return false;
+
+  int num_candidates, max_leaf_checks, rebuild_size;
+  if (!pu::Get(param_ns_ + "/scan_context/num_candidates", num_candidates))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/distance_threshold",
+               distance_threshold_))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/search_radius", search_radius_))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/max_leaf_checks", max_leaf_checks))
+    return false;
+  if (!pu::Get(param_ns_ + "/scan_context/rebuild_size", rebuild_size))
+    return false;
+  num_candidates_ = std::max(num_candidates, 1);
+  descriptor_index_.SetParams(std::max(max_leaf_checks, 1),
+                              std::max(rebuild_size, 1));
+
+  double distance_to_skip_recent_poses, translation_threshold_nodes;
+  if (!pu::Get(param_ns_ + "/translation_threshold_nodes",
+               translation_threshold_nodes))
+    return false;
+  if (!pu::Get(param_ns_ + "/distance_to_skip_recent_poses",
+               distance_to_skip_recent_poses))
+    return false;
+
+  skip_recent_poses_ =
+      (int)(distance_to_skip_recent_poses / translation_threshold_nodes);
+  return true;
+}
+
+bool ScanContextLoopGeneration::CreatePublishers(const ros::NodeHandle& n) {
+  if (!LoopGeneration::CreatePublishers(n))
+    return false;
+  return true;
+}
+
+bool ScanContextLoopGeneration::RegisterCallbacks(const ros::NodeHandle& n) {
+  ros::NodeHandle nl(n);
+  keyed_poses_sub_ = nl.subscribe<pose_graph_msgs::PoseGraph>(
+      "pose_graph_incremental",
+      100000,
+      &ScanContextLoopGeneration::KeyedPoseCallback,
+      this);
+  keyed_scans_sub_ = nl.subscribe<pose_graph_msgs::KeyedScan>(
+      "keyed_scans",
+      100000,
+      &ScanContextLoopGeneration::KeyedScanCallback,
+      this);
+  return true;
+}
+
+void ScanContextLoopGeneration::GenerateLoops(const gtsam::Key& new_key,
+                                              const ScanContext& descriptor) {
+  // Loop closure off. No candidates generated
+  if (!b_check_for_loop_closures_)
+    return;
+
+  const gtsam::Symbol key(new_key);
+  // Recent poses of the same robot match trivially
+  auto is_candidate = [&](const gtsam::Key& other) {
+    const gtsam::Symbol other_key(other);
+    return !(lamp_utils::IsKeyFromSameRobot(key, other_key) &&
+             std::llabs(key.index() - other_key.index()) <
+                 static_cast<long long>(skip_recent_poses_));
+  };
+
+  // Prefilter on the ring keys, then check the full descriptors
+  for (const auto& match :
+       descriptor_index_.Query(descriptor, num_candidates_, is_candidate)) {
+    const ScanContext* other = descriptor_index_.Get(match.first);
+    int shift = 0;
+    const double distance =
+        descriptor.Distance(*other, search_radius_, &shift);
+    if (distance > distance_threshold_)
+      continue;
+
+    // pose_to such that pose_to.between(pose_from) is the recognized yaw
+    const gtsam::Pose3& pose_from = keyed_poses_.at(new_key);
+    const gtsam::Pose3 delta(gtsam::Rot3::Yaw(descriptor.YawOfShift(shift)),
+                             gtsam::Point3(0, 0, 0));
+
+    pose_graph_msgs::LoopCandidate candidate;
+    candidate.header.stamp = ros::Time::now();
+    candidate.key_from = new_key;
+    candidate.key_to = match.first;
+    candidate.pose_from = lamp_utils::GtsamToRosMsg(pose_from);
+    candidate.pose_to =
+        lamp_utils::GtsamToRosMsg(pose_from.compose(delta.inverse()));
+    candidate.type = pose_graph_msgs::LoopCandidate::APPEARANCE;
+    candidate.value = distance;
+    candidates_.push_back(candidate);
+  }
+}
+
+void ScanContextLoopGeneration::KeyedPoseCallback(
+    const pose_graph_msgs::PoseGraph::ConstPtr& graph_msg) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& node_msg : graph_msg->nodes) {
+    const gtsam::Symbol new_key(node_msg.key);
+    if (!lamp_utils::IsRobotPrefix(new_key.chr()))
+      continue;
+    if (keyed_poses_.count(new_key) > 0)
+      continue;
+
+    keyed_poses_[new_key] = lamp_utils::ToGtsam(node_msg.pose);
+
+    auto pending = pending_descriptors_.find(new_key);
+    if (pending == pending_descriptors_.end())
+      continue;
+    GenerateLoops(new_key, pending->second);
+    descriptor_index_.Insert(new_key, pending->second);
+    pending_descriptors_.erase(pending);
+  }
+  PublishIfReady();
+}
+
+void ScanContextLoopGeneration::KeyedScanCallback(
+    const pose_graph_msgs::KeyedScan::ConstPtr& scan_msg) {
+  const gtsam::Key key = scan_msg->key;
+  if (!lamp_utils::IsRobotPrefix(gtsam::Symbol(key).chr()))
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (descriptor_index_.Get(key) != nullptr ||
+        pending_descriptors_.count(key) > 0) {
+      ROS_DEBUG_STREAM("KeyedScanCallback: Key "
+                       << gtsam::DefaultKeyFormatter(key)
+                       << " already has a descriptor. Not adding.");
+      return;
+    }
+  }
+
+  // Computed outside the lock
+  const PointCloudConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*scan_msg);
+  ScanContext descriptor(*scan, descriptor_params_);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (descriptor_index_.Get(key) != nullptr ||
+      pending_descriptors_.count(key) > 0)
+    return;
+  if (keyed_poses_.count(key) == 0) {
+    pending_descriptors_.emplace(key, std::move(descriptor));
+    return;
+  }
+  GenerateLoops(key, descriptor);
+  descriptor_index_.Insert(key, descriptor);
+  PublishIfReady();
+}
+
+void ScanContextLoopGeneration::PublishIfReady() {
+  if (HasCandidateSubscribers(loop_candidate_pub_,
+                              loop_candidate_channel_.get()) &&
+      candidates_.size() > 0) {
+    PublishLoops();
+    ClearLoops();
+  }
+}
+
+} // namespace lamp_loop_closure
@@ -0,0 +1,131 @@
+/**
+ * @file   SubmapCache.cc
+ * @brief  Accumulated neighbourhood submaps of the keyed scans, reused while
+ * the poses they were built from do not move
+ */
+
+#include "loop_closure/SubmapCache.h"
+
+#include <algorithm>
+
+#include <lamp_utils/PointCloudKernels.h>
+
+namespace lamp_loop_closure {
+
+void SubmapCache::SetParams(size_t capacity,
+                            double voxel_size,
+                            double translation_threshold,
+                            double rotation_threshold) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = std::max<size_t>(capacity, 1);
+  voxel_size_ = voxel_size;
+  translation_threshold_ = translation_threshold;
+  rotation_threshold_ = rotation_threshold;
+  while (entries_.size() > capacity_) {
+    entries_.erase(lru_.back());
+    lru_.pop_back();
+  }
+}
+
+bool SubmapCache::Matches(const SubmapWindow& window,
+                          const SubmapWindow& current) const {
+  if (window.size() != current.size())
+    return false;
+  for (size_t i = 0; i < window.size(); i++) {
+    if (window[i].first != current[i].first)
+      return false;
+    const gtsam::Pose3 delta = window[i].second.between(current[i].second);
+    if (delta.translation().norm() > translation_threshold_ ||
+        gtsam::Rot3::Logmap(delta.rotation()).norm() > rotation_threshold_)
+      return false;
+  }
+  return true;
+}
+
+PointCloudConstPtr SubmapCache::Find(const gtsam::Key& key,
+                                     const SubmapWindow& current) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return nullptr;
+  if (!Matches(it->second.window, current)) {
+    lru_.erase(it->second.lru_it);
+    entries_.erase(it);
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+  return it->second.submap;
+}
+
+PointCloudConstPtr SubmapCache::Insert(const gtsam::Key& key,
+                                       const SubmapWindow& window,
+                                       const PointCloud::Ptr& submap) {
+  double voxel_size;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    voxel_size = voxel_size_;
+  }
+  // Downsampled without holding the lock
+  if (voxel_size > 0.0)
+    lamp_utils::VoxelDownsample(*submap, voxel_size, submap.get());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    lru_.erase(it->second.lru_it);
+    entries_.erase(it);
+  }
+  lru_.push_front(key);
+  Entry& entry = entries_[key];
+  entry.window = window;
+  entry.submap = submap;
+  entry.lru_it = lru_.begin();
+
+  while (entries_.size() > capacity_) {
+    entries_.erase(lru_.back());
+    lru_.pop_back();
+  }
+  return submap;
+}
+
+void SubmapCache::Invalidate(const gtsam::Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return;
+  lru_.erase(it->second.lru_it);
+  entries_.erase(it);
+}
+
+void SubmapCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+}
+
+size_t SubmapCache::Size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t SubmapCache::Bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t bytes = 0;
+  for (const auto& entry : entries_)
+    bytes += entry.second.submap->points.capacity() * sizeof(Point);
+  return bytes;
+}
+
+size_t SubmapCache::Shrink(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t dropped = 0;
+  while (dropped < bytes && !lru_.empty()) {
+    auto it = entries_.find(lru_.back());
+    dropped += it->second.submap->points.capacity() * sizeof(Point);
+    entries_.erase(it);
+    lru_.pop_back();
+  }
+  return dropped;
+}
+
+} // namespace lamp_loop_closure
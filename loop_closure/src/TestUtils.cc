@@ -4,11 +4,16 @@ Author: Yun Chang
 Some utility functions for wokring with Point Clouds
 */
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <fstream>
+#include <functional>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <pcl/io/pcd_io.h>
@@ -18,7 +23,9 @@ Some utility functions for wokring with Point Clouds
 
 #include "loop_closure/TestUtils.h"
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/KeyedSpatialIndex.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/ScanCompression.h>
 
 namespace test_utils {
 
@@ -268,7 +275,7 @@ bool WriteKeyedScansToFile(
     const std::string& output_folder) {
   for (const auto& ks : keyed_scans) {
     pcl::PointCloud<Point>::Ptr scan(new pcl::PointCloud<Point>);
-    pcl::fromROSMsg(ks.scan, *scan);
+    lamp_utils::KeyedScanMsgToScan(ks, scan.get());
     std::string pcd_file =
         output_folder + "/" + std::to_string(ks.key) + ".pcd";
     pcl::io::savePCDFileBinary(pcd_file, *scan);
@@ -551,6 +558,299 @@ bool AppendNewCandidates(
   return true;
 }
 
+namespace {
+
+// splitmix64, the world and the noise of each key only depend on the seed
+uint64_t Mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+// In [0, 1)
+double ToUniform(uint64_t x) {
+  return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct Pillar {
+  double x;
+  double y;
+  double radius;
+  double height;
+};
+
+bool PillarInCell(const SyntheticWorkloadParams& params,
+                  int64_t i,
+                  int64_t j,
+                  Pillar* pillar) {
+  uint64_t h = Mix(Mix(params.seed ^ static_cast<uint64_t>(i)) ^
+                   static_cast<uint64_t>(j));
+  if (ToUniform(h) >= params.pillar_density)
+    return false;
+  h = Mix(h);
+  pillar->x = (i + 0.2 + 0.6 * ToUniform(h)) * params.pillar_spacing;
+  h = Mix(h);
+  pillar->y = (j + 0.2 + 0.6 * ToUniform(h)) * params.pillar_spacing;
+  h = Mix(h);
+  pillar->radius = 0.2 + 0.8 * ToUniform(h);
+  h = Mix(h);
+  pillar->height = 2.0 + 6.0 * ToUniform(h);
+  return true;
+}
+
+// Runs job(i) for every i in [0, n), the threads take the next i in turn
+void ParallelFor(size_t num_threads,
+                 size_t n,
+                 const std::function<void(size_t)>& job) {
+  if (num_threads == 0)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  num_threads = std::max<size_t>(1, std::min(num_threads, n));
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++) {
+      job(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void GenerateTrajectory(const SyntheticWorkloadParams& params,
+                        size_t robot,
+                        std::vector<gtsam::Pose3>* gt_poses,
+                        std::vector<gtsam::Pose3>* odom_poses) {
+  std::mt19937_64 rng(Mix(params.seed ^ Mix(robot + 1)));
+  std::uniform_real_distribution<double> turn(-params.max_turn,
+                                              params.max_turn);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  const double half_size = 0.5 * params.world_size;
+
+  // The robots start next to each other, heading apart
+  double heading = 2.0 * M_PI * robot /
+      std::max<size_t>(params.robot_prefixes.size(), 1);
+  gtsam::Point3 position(2.0 * std::cos(heading), 2.0 * std::sin(heading), 0);
+  auto step = [&params](const gtsam::Point3& from, double heading) {
+    return from +
+        gtsam::Point3(params.key_spacing * std::cos(heading),
+                      params.key_spacing * std::sin(heading),
+                      0);
+  };
+
+  gt_poses->reserve(params.keys_per_robot);
+  odom_poses->reserve(params.keys_per_robot);
+  for (size_t k = 0; k < params.keys_per_robot; k++) {
+    const gtsam::Pose3 pose(gtsam::Rot3::Yaw(heading), position);
+    if (k == 0) {
+      odom_poses->push_back(pose);
+    } else {
+      // Drift in the plane, (rotation, translation)
+      gtsam::Vector6 xi;
+      xi << 0, 0, params.odom_rotation_noise * noise(rng),
+          params.odom_translation_noise * noise(rng),
+          params.odom_translation_noise * noise(rng), 0;
+      odom_poses->push_back(odom_poses->back() *
+                            gt_poses->back().between(pose) *
+                            gtsam::Pose3::Expmap(xi));
+    }
+    gt_poses->push_back(pose);
+
+    heading += turn(rng);
+    gtsam::Point3 next = step(position, heading);
+    // Turn back to the center at the borders
+    if (std::abs(next.x()) > half_size || std::abs(next.y()) > half_size) {
+      heading = std::atan2(-position.y(), -position.x()) + turn(rng);
+      next = step(position, heading);
+    }
+    position = next;
+  }
+}
+
+pose_graph_msgs::KeyedScan
+GenerateScan(const SyntheticWorkloadParams& params,
+             const gtsam::Key& key,
+             const gtsam::Pose3& pose) {
+  std::mt19937_64 rng(Mix(params.seed ^ Mix(key)));
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  const gtsam::Point3 center = pose.translation();
+  const double range = params.scan_range;
+
+  // Pillars in range
+  std::vector<Pillar> pillars;
+  const int64_t i_min =
+      std::floor((center.x() - range) / params.pillar_spacing);
+  const int64_t i_max =
+      std::floor((center.x() + range) / params.pillar_spacing);
+  const int64_t j_min =
+      std::floor((center.y() - range) / params.pillar_spacing);
+  const int64_t j_max =
+      std::floor((center.y() + range) / params.pillar_spacing);
+  for (int64_t i = i_min; i <= i_max; i++) {
+    for (int64_t j = j_min; j <= j_max; j++) {
+      Pillar pillar;
+      if (!PillarInCell(params, i, j, &pillar))
+        continue;
+      const double distance =
+          std::hypot(pillar.x - center.x(), pillar.y - center.y());
+      if (distance > pillar.radius && distance < range)
+        pillars.push_back(pillar);
+    }
+  }
+
+  PointCloud cloud;
+  cloud.reserve(params.points_per_scan);
+  for (size_t n = 0; n < params.points_per_scan; n++) {
+    gtsam::Point3 point, normal;
+    // A third of the points on the ground, the others on the pillars
+    if (pillars.empty() || uniform(rng) < 1.0 / 3.0) {
+      const double r = range * std::sqrt(uniform(rng));
+      const double angle = 2.0 * M_PI * uniform(rng);
+      point = gtsam::Point3(center.x() + r * std::cos(angle),
+                            center.y() + r * std::sin(angle),
+                            -params.sensor_height);
+      normal = gtsam::Point3(0, 0, 1);
+    } else {
+      const Pillar& pillar = pillars[std::min<size_t>(
+          pillars.size() - 1, uniform(rng) * pillars.size())];
+      // On the side facing the sensor
+      const double angle =
+          std::atan2(center.y() - pillar.y, center.x() - pillar.x) +
+          (uniform(rng) - 0.5) * M_PI;
+      normal = gtsam::Point3(std::cos(angle), std::sin(angle), 0);
+      point = gtsam::Point3(pillar.x + pillar.radius * normal.x(),
+                            pillar.y + pillar.radius * normal.y(),
+                            pillar.height * uniform(rng) -
+                                params.sensor_height);
+    }
+    point = point + params.scan_noise * noise(rng) * normal;
+
+    const gtsam::Point3 local = pose.transformTo(point);
+    const gtsam::Point3 local_normal = pose.rotation().unrotate(normal);
+    Point p;
+    p.x = local.x();
+    p.y = local.y();
+    p.z = local.z();
+    p.intensity = 0;
+    p.normal_x = local_normal.x();
+    p.normal_y = local_normal.y();
+    p.normal_z = local_normal.z();
+    cloud.push_back(p);
+  }
+
+  pose_graph_msgs::KeyedScan keyed_scan;
+  keyed_scan.key = key;
+  pcl::toROSMsg(cloud, keyed_scan.scan);
+  return keyed_scan;
+}
+
+} // namespace
+
+void GenerateSyntheticWorkload(const SyntheticWorkloadParams& params,
+                               SyntheticWorkload* workload) {
+  const size_t num_robots = params.robot_prefixes.size();
+  std::vector<std::vector<gtsam::Pose3>> gt_poses(num_robots);
+  std::vector<std::vector<gtsam::Pose3>> odom_poses(num_robots);
+  ParallelFor(params.num_threads, num_robots, [&](size_t robot) {
+    GenerateTrajectory(params, robot, &gt_poses[robot], &odom_poses[robot]);
+  });
+
+  // The robots take turns
+  const size_t num_keys = num_robots * params.keys_per_robot;
+  workload->keys.clear();
+  workload->gt_keyed_poses.clear();
+  workload->odom_keyed_poses.clear();
+  workload->keys.reserve(num_keys);
+  workload->gt_keyed_poses.reserve(num_keys);
+  workload->odom_keyed_poses.reserve(num_keys);
+  for (size_t k = 0; k < params.keys_per_robot; k++) {
+    for (size_t robot = 0; robot < num_robots; robot++) {
+      workload->keys.push_back(gtsam::Symbol(params.robot_prefixes[robot], k));
+      workload->gt_keyed_poses.push_back(gt_poses[robot][k]);
+      workload->odom_keyed_poses.push_back(odom_poses[robot][k]);
+    }
+  }
+
+  // Candidates from each key to the keys that arrived before it
+  lamp_utils::KeyedSpatialIndex index(params.loop_radius);
+  std::unordered_map<gtsam::Key, size_t> key_indices;
+  key_indices.reserve(num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    index.Insert(workload->keys[i], workload->gt_keyed_poses[i].translation());
+    key_indices[workload->keys[i]] = i;
+  }
+  std::vector<std::vector<pose_graph_msgs::LoopCandidate>> key_candidates(
+      num_keys);
+  ParallelFor(params.num_threads, num_keys, [&](size_t i) {
+    const gtsam::Symbol key(workload->keys[i]);
+    const gtsam::Point3 position = workload->gt_keyed_poses[i].translation();
+    std::vector<std::pair<double, size_t>> overlapping;
+    for (const gtsam::Key& other : index.RadiusSearch(position,
+                                                      params.loop_radius)) {
+      const size_t j = key_indices.at(other);
+      const gtsam::Symbol other_key(other);
+      if (j >= i)
+        continue;
+      if (key.chr() == other_key.chr() &&
+          key.index() - other_key.index() < params.min_key_separation)
+        continue;
+      overlapping.emplace_back(
+          (workload->gt_keyed_poses[j].translation() - position).norm(), j);
+    }
+    const size_t n =
+        std::min(overlapping.size(), params.max_candidates_per_key);
+    std::partial_sort(
+        overlapping.begin(), overlapping.begin() + n, overlapping.end());
+    for (size_t c = 0; c < n; c++) {
+      const size_t j = overlapping[c].second;
+      pose_graph_msgs::LoopCandidate candidate;
+      candidate.key_from = workload->keys[i];
+      candidate.key_to = workload->keys[j];
+      candidate.pose_from =
+          lamp_utils::GtsamToRosMsg(workload->odom_keyed_poses[i]);
+      candidate.pose_to =
+          lamp_utils::GtsamToRosMsg(workload->odom_keyed_poses[j]);
+      candidate.type = pose_graph_msgs::LoopCandidate::PROXIMITY;
+      candidate.value = overlapping[c].first;
+      key_candidates[i].push_back(candidate);
+    }
+  });
+  workload->candidates.candidates.clear();
+  for (const auto& candidates : key_candidates) {
+    workload->candidates.candidates.insert(
+        workload->candidates.candidates.end(),
+        candidates.begin(),
+        candidates.end());
+  }
+
+  workload->keyed_scans.clear();
+  if (params.points_per_scan > 0) {
+    std::vector<size_t> indices(num_keys);
+    for (size_t i = 0; i < num_keys; i++) {
+      indices[i] = i;
+    }
+    GenerateSyntheticScans(params, *workload, indices, &workload->keyed_scans);
+  }
+}
+
+void GenerateSyntheticScans(const SyntheticWorkloadParams& params,
+                            const SyntheticWorkload& workload,
+                            const std::vector<size_t>& indices,
+                            std::vector<pose_graph_msgs::KeyedScan>* scans) {
+  scans->resize(indices.size());
+  ParallelFor(params.num_threads, indices.size(), [&](size_t i) {
+    const size_t k = indices[i];
+    (*scans)[i] =
+        GenerateScan(params, workload.keys[k], workload.gt_keyed_poses[k]);
+  });
+}
+
 void OutputTestSummary(
     const TestData& data,
     const std::vector<pose_graph_msgs::PoseGraphEdge>& results,
@@ -0,0 +1,180 @@
+/**
+ * @file   Vgicp.cc
+ * @brief  Voxelized GICP, the target scan as per voxel Gaussians looked up by
+ *         hashing instead of a KD-tree search per point and iteration
+ */
+#include "loop_closure/Vgicp.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+namespace lamp_loop_closure {
+
+namespace {
+
+// exp of the left perturbation (rotation first, then translation)
+Eigen::Matrix4d Exp(const Eigen::Matrix<double, 6, 1>& xi) {
+  Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+  const Eigen::Vector3d omega = xi.head<3>();
+  const double angle = omega.norm();
+  if (angle > 1e-12) {
+    T.topLeftCorner<3, 3>() =
+        Eigen::AngleAxisd(angle, omega / angle).toRotationMatrix();
+  }
+  T.topRightCorner<3, 1>() = xi.tail<3>();
+  return T;
+}
+
+Eigen::Matrix3d Skew(const Eigen::Vector3d& v) {
+  Eigen::Matrix3d S;
+  S << 0, -v.z(), v.y(), v.z(), 0, -v.x(), -v.y(), v.x(), 0;
+  return S;
+}
+
+} // namespace
+
+VoxelGaussianMap::VoxelGaussianMap(const PointCloud& cloud,
+                                   const PlaneCovariances& covariances,
+                                   double resolution)
+  : resolution_(resolution), index_(cloud.size()) {
+  for (size_t i = 0; i < cloud.size() && i < covariances.size(); i++) {
+    const Point& p = cloud.points[i];
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    const Eigen::Vector3d point(p.x, p.y, p.z);
+    const auto inserted = index_.Insert(
+        Index(point), static_cast<uint32_t>(voxels_.size()));
+    if (inserted.second) {
+      voxels_.push_back(
+          Voxel{Eigen::Vector3d::Zero(), Eigen::Matrix3d::Zero(), 0});
+    }
+    Voxel& voxel = voxels_[*inserted.first];
+    voxel.mean += point;
+    voxel.covariance += covariances[i].matrix().cast<double>();
+    voxel.num_points++;
+  }
+  for (Voxel& voxel : voxels_) {
+    voxel.mean /= voxel.num_points;
+    voxel.covariance /= voxel.num_points;
+  }
+}
+
+void VoxelGaussianMap::FindNeighbors(
+    const Eigen::Vector3d& point,
+    std::vector<const Voxel*>* neighbors) const {
+  static const int kOffsets[7][3] = {
+      {0, 0, 0}, {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1},
+      {0, 0, -1}};
+  neighbors->clear();
+  const VoxelIndex center = Index(point);
+  for (const auto& offset : kOffsets) {
+    VoxelIndex index = center;
+    index.x += offset[0];
+    index.y += offset[1];
+    index.z += offset[2];
+    const uint32_t* found = index_.Find(index);
+    if (found)
+      neighbors->push_back(&voxels_[*found]);
+  }
+}
+
+VoxelGaussianMap::VoxelIndex
+VoxelGaussianMap::Index(const Eigen::Vector3d& point) const {
+  VoxelIndex index;
+  index.x = static_cast<int32_t>(std::floor(point.x() / resolution_));
+  index.y = static_cast<int32_t>(std::floor(point.y() / resolution_));
+  index.z = static_cast<int32_t>(std::floor(point.z() / resolution_));
+  return index;
+}
+
+Vgicp::Vgicp()
+  : final_transformation_(Eigen::Matrix4f::Identity()),
+    b_converged_(false),
+    num_iterations_(0) {}
+
+void Vgicp::SetParams(const VgicpParams& params) {
+  params_ = params;
+}
+
+bool Vgicp::Align(const PointCloud& source,
+                  const PlaneCovariances& source_covariances,
+                  const VoxelGaussianMap& target,
+                  const Eigen::Matrix4f& guess) {
+  final_transformation_ = guess;
+  b_converged_ = false;
+  num_iterations_ = 0;
+  if (source.empty() || source_covariances.size() < source.size() ||
+      target.size() == 0) {
+    return false;
+  }
+
+  Eigen::Matrix4d T = guess.cast<double>();
+  std::vector<const VoxelGaussianMap::Voxel*> neighbors;
+  while (!b_converged_) {
+    const Eigen::Matrix3d R = T.topLeftCorner<3, 3>();
+    const Eigen::Vector3d t = T.topRightCorner<3, 1>();
+
+    Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+    Eigen::Matrix<double, 6, 1> g = Eigen::Matrix<double, 6, 1>::Zero();
+    int num_correspondences = 0;
+    for (size_t i = 0; i < source.size(); i++) {
+      const Point& p = source.points[i];
+      const Eigen::Vector3d q = R * Eigen::Vector3d(p.x, p.y, p.z) + t;
+      target.FindNeighbors(q, &neighbors);
+      if (neighbors.empty())
+        continue;
+
+      const PlaneCovariance<float>& cov = source_covariances[i];
+      const Eigen::Vector3d normal = R * cov.normal.cast<double>();
+      const Eigen::Matrix3d RCR = Eigen::Matrix3d::Identity() -
+          (1.0 - cov.epsilon) * normal * normal.transpose();
+      // d(Exp(xi) * q) / d(xi) = [-[q]x I]
+      Eigen::Matrix<double, 3, 6> J;
+      J.leftCols<3>() = -Skew(q);
+      J.rightCols<3>() = Eigen::Matrix3d::Identity();
+
+      for (const VoxelGaussianMap::Voxel* voxel : neighbors) {
+        // (C_voxel + R*C_point*R')^-1, weighted by the points in the voxel
+        const Eigen::Matrix3d M =
+            voxel->num_points * (voxel->covariance + RCR).inverse();
+        const Eigen::Vector3d residual = q - voxel->mean;
+        const Eigen::Matrix<double, 6, 3> JtM = J.transpose() * M;
+        H += JtM * J;
+        g += JtM * residual;
+      }
+      num_correspondences++;
+    }
+    // Not enough correspondences to constrain the six degrees of freedom
+    if (num_correspondences < 6) {
+      break;
+    }
+
+    const Eigen::Matrix<double, 6, 1> xi = -H.ldlt().solve(g);
+    if (!xi.allFinite()) {
+      break;
+    }
+    const Eigen::Matrix4d T_next = Exp(xi) * T;
+
+    // Same stopping rule as the CPU GICP
+    double delta = 0;
+    for (int k = 0; k < 3; k++) {
+      for (int l = 0; l < 4; l++) {
+        const double ratio = l < 3 ? 1.0 / params_.rotation_epsilon
+                                   : 1.0 / params_.transformation_epsilon;
+        delta = std::max(delta, ratio * std::abs(T_next(k, l) - T(k, l)));
+      }
+    }
+    T = T_next;
+    num_iterations_++;
+    if (num_iterations_ >= params_.max_iterations || delta < 1) {
+      b_converged_ = true;
+    }
+  }
+
+  final_transformation_ = T.cast<float>();
+  return true;
+}
+
+} // namespace lamp_loop_closure
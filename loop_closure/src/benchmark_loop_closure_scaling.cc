@@ -0,0 +1,337 @@
+/*
+ * Copyright Notes
+ *
+ * Scaling benchmark of the loop closure pipeline over synthetic multi-robot
+ * workloads (test_utils::GenerateSyntheticWorkload) of increasing size. For
+ * every size the keyed poses go through proximity loop generation in
+ * batches, a share of the candidates through generic prioritization and
+ * the best of those through IcpLoopComputation. Writes per stage latencies
+ * as JSON, the generation latency of the first and last batches shows how
+ * its cost grows with the graph.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <sys/resource.h>
+#include <thread>
+
+#include <loop_closure/GenericLoopPrioritization.h>
+#include <loop_closure/IcpLoopComputation.h>
+#include <loop_closure/ProximityLoopGeneration.h>
+#include <loop_closure/TestUtils.h>
+#include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/ObservabilityCache.h>
+#include <lamp_utils/SharedScanStore.h>
+#include <ros/ros.h>
+
+namespace tu = test_utils;
+namespace lc = lamp_loop_closure;
+
+namespace {
+
+// The stages, with their callbacks reachable without a spinner
+class ScalingLoopGeneration : public lc::ProximityLoopGeneration {
+public:
+  using lc::ProximityLoopGeneration::KeyedPoseCallback;
+
+  std::vector<pose_graph_msgs::LoopCandidate> TakeCandidates() {
+    std::vector<pose_graph_msgs::LoopCandidate> candidates;
+    candidates.swap(candidates_);
+    return candidates;
+  }
+};
+
+class ScalingLoopPrioritization : public lc::GenericLoopPrioritization {
+public:
+  using lc::GenericLoopPrioritization::GetBestCandidates;
+  using lc::GenericLoopPrioritization::InputCallback;
+  using lc::GenericLoopPrioritization::KeyedScanCallback;
+  using lc::GenericLoopPrioritization::PopulatePriorityQueue;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(const Clock::time_point& start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double Mean(const std::vector<double>& samples, size_t begin, size_t end) {
+  if (end <= begin)
+    return 0;
+  double sum = 0;
+  for (size_t i = begin; i < end; i++)
+    sum += samples[i];
+  return sum / (end - begin);
+}
+
+long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+struct ScalingResult {
+  size_t num_keys{0};
+  size_t workload_candidates{0};
+  double workload_s{0};
+  // Generation
+  size_t generated_candidates{0};
+  double generation_s{0};
+  // Mean latency (ms per key) of the first and last tenth of the batches
+  double generation_first_ms{0};
+  double generation_last_ms{0};
+  // Prioritization
+  size_t scored_candidates{0};
+  size_t prioritized_candidates{0};
+  double observability_s{0};
+  double prioritization_s{0};
+  // Computation
+  size_t aligned_candidates{0};
+  size_t loop_closures{0};
+  double keyed_poses_s{0};
+  double computation_s{0};
+  long peak_rss_kb{0};
+};
+
+void WriteResults(const std::string& path,
+                  const tu::SyntheticWorkloadParams& params,
+                  const std::vector<ScalingResult>& results) {
+  std::ofstream out(path);
+  std::time_t now = std::time(nullptr);
+  char date[32];
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+  out << "{\n  \"context\": {\"date\": \"" << date << "\", \"num_cpus\": "
+      << std::thread::hardware_concurrency() << ", \"robots\": \""
+      << params.robot_prefixes << "\", \"points_per_scan\": "
+      << params.points_per_scan << ", \"seed\": " << params.seed
+      << "},\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const ScalingResult& r = results[i];
+    out << (i == 0 ? "\n" : ",\n") << "    {\"num_keys\": " << r.num_keys
+        << ", \"workload_candidates\": " << r.workload_candidates
+        << ", \"workload_s\": " << r.workload_s
+        << ",\n      \"generation\": {\"candidates\": "
+        << r.generated_candidates << ", \"total_s\": " << r.generation_s
+        << ", \"first_batches_ms_per_key\": " << r.generation_first_ms
+        << ", \"last_batches_ms_per_key\": " << r.generation_last_ms
+        << "},\n      \"prioritization\": {\"scored\": "
+        << r.scored_candidates << ", \"prioritized\": "
+        << r.prioritized_candidates
+        << ", \"observability_s\": " << r.observability_s
+        << ", \"populate_s\": " << r.prioritization_s
+        << "},\n      \"computation\": {\"aligned\": "
+        << r.aligned_candidates << ", \"loop_closures\": " << r.loop_closures
+        << ", \"keyed_poses_s\": " << r.keyed_poses_s
+        << ", \"compute_s\": " << r.computation_s
+        << "},\n      \"peak_rss_kb\": " << r.peak_rss_kb << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "benchmark_loop_closure_scaling");
+  ros::start();
+  ros::NodeHandle n("~");
+
+  std::string output_file;
+  n.getParam("output_file", output_file);
+  std::vector<int> sizes;
+  if (!n.getParam("sizes", sizes)) {
+    ROS_ERROR("Benchmark needs a sizes list (total number of keys).");
+    return EXIT_FAILURE;
+  }
+  int batch_size = 100, max_scored = 2000, max_aligned = 200;
+  n.getParam("batch_size", batch_size);
+  n.getParam("max_scored", max_scored);
+  n.getParam("max_aligned", max_aligned);
+  batch_size = std::max(batch_size, 1);
+
+  tu::SyntheticWorkloadParams params;
+  int points_per_scan = params.points_per_scan, seed = params.seed;
+  int num_threads = params.num_threads;
+  n.getParam("robots", params.robot_prefixes);
+  n.getParam("points_per_scan", points_per_scan);
+  n.getParam("seed", seed);
+  n.getParam("num_threads", num_threads);
+  n.getParam("world_size", params.world_size);
+  n.getParam("loop_radius", params.loop_radius);
+  params.points_per_scan = std::max(points_per_scan, 0);
+  params.seed = seed;
+  params.num_threads = std::max(num_threads, 0);
+  if (params.robot_prefixes.empty()) {
+    ROS_ERROR("Benchmark needs at least one robot prefix.");
+    return EXIT_FAILURE;
+  }
+  // The scans of the stages are generated on demand
+  const size_t points_per_scan_stages = params.points_per_scan;
+  params.points_per_scan = 0;
+
+  std::vector<ScalingResult> results;
+  for (int size : sizes) {
+    ScalingResult result;
+    params.keys_per_robot = std::max<size_t>(
+        1, static_cast<size_t>(size) / params.robot_prefixes.size());
+
+    auto start = Clock::now();
+    tu::SyntheticWorkload workload;
+    tu::GenerateSyntheticWorkload(params, &workload);
+    result.workload_s = Seconds(start);
+    result.num_keys = workload.keys.size();
+    result.workload_candidates = workload.candidates.candidates.size();
+    ROS_INFO("%zu keys, %zu candidates generated in %.2f s",
+             result.num_keys,
+             result.workload_candidates,
+             result.workload_s);
+
+    // Every size starts from empty process wide caches
+    lamp_utils::ObservabilityCache::Instance().Clear();
+    lamp_utils::SharedScanStore::Instance().Clear();
+
+    // Generation, the keyed poses arrive in batches
+    ScalingLoopGeneration generation;
+    if (!generation.Initialize(n)) {
+      ROS_ERROR("Failed to initialize loop generation.");
+      return EXIT_FAILURE;
+    }
+    std::vector<pose_graph_msgs::LoopCandidate> generated;
+    std::vector<double> batch_ms;
+    for (size_t begin = 0; begin < workload.keys.size();
+         begin += batch_size) {
+      const size_t end =
+          std::min(workload.keys.size(), begin + static_cast<size_t>(batch_size));
+      pose_graph_msgs::PoseGraph::Ptr graph(new pose_graph_msgs::PoseGraph);
+      for (size_t i = begin; i < end; i++) {
+        pose_graph_msgs::PoseGraphNode node;
+        node.key = workload.keys[i];
+        node.pose = lamp_utils::GtsamToRosMsg(workload.odom_keyed_poses[i]);
+        graph->nodes.push_back(node);
+      }
+      auto batch_start = Clock::now();
+      generation.KeyedPoseCallback(graph);
+      const double batch_s = Seconds(batch_start);
+      result.generation_s += batch_s;
+      batch_ms.push_back(1e3 * batch_s / (end - begin));
+      auto candidates = generation.TakeCandidates();
+      generated.insert(generated.end(), candidates.begin(), candidates.end());
+    }
+    const size_t tenth = std::max<size_t>(1, batch_ms.size() / 10);
+    result.generation_first_ms = Mean(batch_ms, 0, tenth);
+    result.generation_last_ms =
+        Mean(batch_ms, batch_ms.size() - tenth, batch_ms.size());
+    result.generated_candidates = generated.size();
+    // Ground truth overlaps if generation is switched off
+    if (generated.empty())
+      generated = workload.candidates.candidates;
+
+    // Prioritization of an evenly spread share of the candidates
+    pose_graph_msgs::LoopCandidateArray::Ptr scored(
+        new pose_graph_msgs::LoopCandidateArray);
+    const size_t stride = std::max<size_t>(
+        1, generated.size() / std::max(max_scored, 1));
+    for (size_t i = 0; i < generated.size() &&
+         scored->candidates.size() < static_cast<size_t>(max_scored);
+         i += stride) {
+      scored->candidates.push_back(generated[i]);
+      scored->candidates.back().header.stamp = ros::Time::now();
+    }
+    result.scored_candidates = scored->candidates.size();
+
+    std::unordered_map<gtsam::Key, size_t> key_indices;
+    for (size_t i = 0; i < workload.keys.size(); i++)
+      key_indices[workload.keys[i]] = i;
+    std::vector<size_t> scan_indices;
+    for (const auto& candidate : scored->candidates) {
+      scan_indices.push_back(key_indices.at(candidate.key_from));
+      scan_indices.push_back(key_indices.at(candidate.key_to));
+    }
+    std::sort(scan_indices.begin(), scan_indices.end());
+    scan_indices.erase(std::unique(scan_indices.begin(), scan_indices.end()),
+                       scan_indices.end());
+    params.points_per_scan = points_per_scan_stages;
+    std::vector<pose_graph_msgs::KeyedScan> scans;
+    tu::GenerateSyntheticScans(params, workload, scan_indices, &scans);
+    params.points_per_scan = 0;
+
+    ScalingLoopPrioritization prioritization;
+    if (!prioritization.Initialize(n)) {
+      ROS_ERROR("Failed to initialize loop prioritization.");
+      return EXIT_FAILURE;
+    }
+    start = Clock::now();
+    for (const auto& scan : scans) {
+      prioritization.KeyedScanCallback(
+          pose_graph_msgs::KeyedScan::ConstPtr(
+              new pose_graph_msgs::KeyedScan(scan)));
+    }
+    // Computed on the observability cache workers
+    while (lamp_utils::ObservabilityCache::Instance().Size() < scans.size()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    result.observability_s = Seconds(start);
+    prioritization.InputCallback(scored);
+    start = Clock::now();
+    prioritization.PopulatePriorityQueue();
+    result.prioritization_s = Seconds(start);
+    pose_graph_msgs::LoopCandidateArray prioritized =
+        prioritization.GetBestCandidates();
+    result.prioritized_candidates = prioritized.candidates.size();
+
+    // Computation of the best prioritized candidates
+    std::sort(prioritized.candidates.begin(),
+              prioritized.candidates.end(),
+              [](const pose_graph_msgs::LoopCandidate& lhs,
+                 const pose_graph_msgs::LoopCandidate& rhs) {
+                return lhs.value > rhs.value;
+              });
+    if (prioritized.candidates.size() > static_cast<size_t>(max_aligned))
+      prioritized.candidates.resize(std::max(max_aligned, 0));
+    result.aligned_candidates = prioritized.candidates.size();
+
+    lc::IcpLoopComputation computation;
+    if (!computation.Initialize(n)) {
+      ROS_ERROR("Failed to initialize loop computation.");
+      return EXIT_FAILURE;
+    }
+    pose_graph_msgs::PoseGraph::Ptr graph(new pose_graph_msgs::PoseGraph);
+    for (size_t i = 0; i < workload.keys.size(); i++) {
+      pose_graph_msgs::PoseGraphNode node;
+      node.key = workload.keys[i];
+      node.pose = lamp_utils::GtsamToRosMsg(workload.odom_keyed_poses[i]);
+      graph->nodes.push_back(node);
+    }
+    start = Clock::now();
+    computation.KeyedPoseCallback(graph);
+    result.keyed_poses_s = Seconds(start);
+    for (const auto& scan : scans) {
+      computation.KeyedScanCallback(pose_graph_msgs::KeyedScan::ConstPtr(
+          new pose_graph_msgs::KeyedScan(scan)));
+    }
+    computation.InputCallback(pose_graph_msgs::LoopCandidateArray::ConstPtr(
+        new pose_graph_msgs::LoopCandidateArray(prioritized)));
+    start = Clock::now();
+    computation.ComputeTransforms();
+    result.computation_s = Seconds(start);
+    result.loop_closures = computation.GetCurrentOutputQueue().size();
+
+    result.peak_rss_kb = PeakRssKb();
+    ROS_INFO("%zu keys: generation %.2f s (%.3f -> %.3f ms/key), "
+             "prioritization %.2f s, computation %.2f s",
+             result.num_keys,
+             result.generation_s,
+             result.generation_first_ms,
+             result.generation_last_ms,
+             result.prioritization_s,
+             result.computation_s);
+    results.push_back(result);
+  }
+
+  params.points_per_scan = points_per_scan_stages;
+  WriteResults(output_file, params, results);
+  ROS_INFO("Wrote scaling benchmark results to %s", output_file.c_str());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright Notes
+ *
+ * Benchmark of IcpLoopComputation over a recorded dataset (same format as
+ * eval_loop_computation_test). Runs ComputeTransforms for every
+ * combination of ICP initialization method and thread count and writes the
+ * per stage latency distributions, throughput and peak RSS as JSON.
+ */
+
+#include <loop_closure/EvalIcpLoopCompute.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <sys/resource.h>
+#include <thread>
+
+namespace tu = test_utils;
+
+namespace {
+
+const char* kInitMethodNames[] = {
+    "IDENTITY", "ODOMETRY", "ODOM_ROTATION", "FEATURES", "TEASERPP", "CANDIDATE"};
+
+struct Distribution {
+  size_t count{0};
+  double mean{0};
+  double p50{0};
+  double p90{0};
+  double p99{0};
+  double max{0};
+};
+
+Distribution Summarize(std::vector<double> samples) {
+  Distribution d;
+  d.count = samples.size();
+  if (samples.empty())
+    return d;
+  std::sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (double s : samples)
+    sum += s;
+  d.mean = sum / samples.size();
+  auto percentile = [&samples](double p) {
+    size_t i = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+    return samples[std::min(i, samples.size() - 1)];
+  };
+  d.p50 = percentile(0.5);
+  d.p90 = percentile(0.9);
+  d.p99 = percentile(0.99);
+  d.max = samples.back();
+  return d;
+}
+
+void WriteDistribution(std::ostream& out,
+                       const std::string& name,
+                       const Distribution& d) {
+  out << "\"" << name << "\": {\"count\": " << d.count
+      << ", \"mean\": " << d.mean << ", \"p50\": " << d.p50
+      << ", \"p90\": " << d.p90 << ", \"p99\": " << d.p99
+      << ", \"max\": " << d.max << "}";
+}
+
+long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+struct BenchmarkResult {
+  std::string name;
+  int repetitions{0};
+  size_t candidates{0};
+  size_t loop_closures{0};
+  std::vector<double> wall_times;
+  std::vector<lamp_loop_closure::IcpLoopComputation::AlignmentTimings>
+      alignments;
+  long peak_rss_kb{0};
+};
+
+void WriteResults(const std::string& path,
+                  const std::string& dataset_path,
+                  const std::vector<BenchmarkResult>& results) {
+  std::ofstream out(path);
+  std::time_t now = std::time(nullptr);
+  char date[32];
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+  out << "{\n  \"context\": {\"date\": \"" << date << "\", \"num_cpus\": "
+      << std::thread::hardware_concurrency() << ", \"dataset\": \""
+      << dataset_path << "\"},\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchmarkResult& r = results[i];
+    std::vector<double> accumulation, initialization, gicp, covariance, total;
+    std::vector<double> iterations;
+    size_t successful = 0, aborted = 0;
+    for (const auto& t : r.alignments) {
+      accumulation.push_back(t.accumulation);
+      iterations.push_back(t.gicp_iterations);
+      if (!t.abort_reason.empty())
+        aborted++;
+      initialization.push_back(t.initialization);
+      gicp.push_back(t.gicp);
+      // Failed alignments stop before the covariance
+      if (t.b_success) {
+        covariance.push_back(t.covariance);
+        successful++;
+      }
+      total.push_back(t.accumulation + t.initialization + t.gicp +
+                      t.covariance);
+    }
+    double wall_time = 0;
+    for (double w : r.wall_times)
+      wall_time += w;
+    const double throughput =
+        wall_time > 0 ? r.candidates * r.repetitions / wall_time : 0;
+
+    out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << r.name
+        << "\", \"repetitions\": " << r.repetitions
+        << ", \"candidates\": " << r.candidates
+        << ", \"alignments\": " << r.alignments.size()
+        << ", \"successful_alignments\": " << successful
+        << ", \"early_aborts\": " << aborted
+        << ", \"loop_closures\": " << r.loop_closures
+        << ", \"candidates_per_second\": " << throughput
+        << ", \"peak_rss_kb\": " << r.peak_rss_kb << ",\n      ";
+    WriteDistribution(out, "wall_time_s", Summarize(r.wall_times));
+    out << ",\n      ";
+    WriteDistribution(out, "gicp_iterations", Summarize(iterations));
+    out << ",\n      \"stages_s\": {";
+    WriteDistribution(out, "accumulation", Summarize(accumulation));
+    out << ", ";
+    WriteDistribution(out, "initialization", Summarize(initialization));
+    out << ", ";
+    WriteDistribution(out, "gicp", Summarize(gicp));
+    out << ", ";
+    WriteDistribution(out, "covariance", Summarize(covariance));
+    out << ", ";
+    WriteDistribution(out, "alignment", Summarize(total));
+    out << "}}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "benchmark_loop_computation");
+  ros::start();
+  ros::NodeHandle n("~");
+
+  std::string dataset_path, output_file;
+  n.getParam("dataset_path", dataset_path);
+  n.getParam("output_file", output_file);
+  bool use_gt_odom = false;
+  n.getParam("use_gt_odom", use_gt_odom);
+  int repetitions = 3;
+  n.getParam("repetitions", repetitions);
+  std::vector<int> init_methods, thread_counts;
+  if (!n.getParam("init_methods", init_methods) ||
+      !n.getParam("thread_counts", thread_counts)) {
+    ROS_ERROR("Benchmark needs init_methods and thread_counts lists.");
+    return EXIT_FAILURE;
+  }
+
+  tu::TestData test_data;
+  ROS_INFO("Loading dataset from %s ...", dataset_path.c_str());
+  if (!LoadExistingTestData(dataset_path, &test_data)) {
+    ROS_ERROR("Failed to load dataset. ");
+    return EXIT_FAILURE;
+  }
+  const size_t num_candidates = test_data.real_candidates_.candidates.size();
+
+  std::vector<BenchmarkResult> results;
+  for (int method : init_methods) {
+    if (method < 0 || method > 5) {
+      ROS_WARN("Skipping unknown ICP initialization method %d", method);
+      continue;
+    }
+    for (int threads : thread_counts) {
+      BenchmarkResult result;
+      result.name = std::string("IcpLoopComputation/init:") +
+          kInitMethodNames[method] + "/threads:" + std::to_string(threads);
+      result.repetitions = repetitions;
+      result.candidates = num_candidates;
+
+      for (int rep = 0; rep < repetitions; rep++) {
+        // Fresh module every repetition so caches start cold
+        std::unique_ptr<lamp_loop_closure::EvalIcpLoopCompute> evaluate(
+            new lamp_loop_closure::EvalIcpLoopCompute);
+        if (!evaluate->LoadParameters(n)) {
+          ROS_ERROR("Failed to load parameters for EvalIcpLoopCompute. ");
+          return EXIT_FAILURE;
+        }
+        evaluate->SetIcpInitMethod(method);
+        evaluate->SetNumThreads(std::max(threads, 1));
+        evaluate->AddKeyedScans(test_data.keyed_scans_);
+        evaluate->AddKeyedPoses(use_gt_odom ? test_data.gt_keyed_poses_
+                                            : test_data.odom_keyed_poses_);
+        evaluate->AddLoopCandidates(test_data.real_candidates_);
+        evaluate->SetRecordTimings(true);
+
+        auto start = std::chrono::steady_clock::now();
+        evaluate->ComputeLoopClosures();
+        auto stop = std::chrono::steady_clock::now();
+
+        result.wall_times.push_back(
+            std::chrono::duration<double>(stop - start).count());
+        result.loop_closures += evaluate->GetLoopClosures().size();
+        auto timings = evaluate->TakeTimings();
+        result.alignments.insert(
+            result.alignments.end(), timings.begin(), timings.end());
+      }
+      // Peak of the process so far, configurations run in the given order
+      result.peak_rss_kb = PeakRssKb();
+      ROS_INFO_STREAM(result.name << ": "
+                                  << Summarize(result.wall_times).mean
+                                  << " s per run");
+      results.push_back(result);
+    }
+  }
+
+  WriteResults(output_file, dataset_path, results);
+  ROS_INFO("Wrote benchmark results to %s", output_file.c_str());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright Notes
+ *
+ * Nodelet wrappers of the loop closure modules that consume keyed scans.
+ * Loaded into one manager they share a single subscription to the keyed
+ * scans and a single converted copy of every scan (lamp_utils::SharedScanStore)
+ * and, with candidate_channels enabled, hand the candidates over from stage
+ * to stage without going through the topics (CandidateChannel)
+ */
+
+#include <loop_closure/ArtifactLoopGeneration.h>
+#include <loop_closure/GenericLoopPrioritization.h>
+#include <loop_closure/IcpLoopComputation.h>
+#include <loop_closure/InformationGainLoopPrioritization.h>
+#include <loop_closure/LoopCandidateQueue.h>
+#include <loop_closure/ObservabilityLoopPrioritization.h>
+#include <loop_closure/ObservabilityQueue.h>
+#include <loop_closure/ProximityLoopGeneration.h>
+#include <loop_closure/RoundRobinLoopCandidateQueue.h>
+#include <loop_closure/ScanContextLoopGeneration.h>
+#include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/SharedScanStore.h>
+#include <memory>
+#include <nodelet/nodelet.h>
+#include <parameter_utils/ParameterUtils.h>
+#include <pluginlib/class_list_macros.h>
+#include <ros/ros.h>
+
+namespace pu = parameter_utils;
+
+namespace lamp_loop_closure {
+
+class LoopGenerationNodelet : public nodelet::Nodelet {
+private:
+  void onInit() override {
+    ros::NodeHandle n = getMTPrivateNodeHandle();
+
+    int generation_method = 0;
+    std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+    if (!pu::Get(param_ns + "/generation_method", generation_method)) {
+      NODELET_ERROR("Failed to get generation method.");
+      return;
+    }
+
+    switch (generation_method) {
+    case 0: {
+      loop_generation_.reset(new ProximityLoopGeneration);
+    } break;
+    case 1: {
+      lamp_utils::SharedScanStore::Instance().SetEnabled(true);
+      loop_generation_.reset(new ScanContextLoopGeneration);
+    } break;
+    case 2: {
+      loop_generation_.reset(new ArtifactLoopGeneration);
+    } break;
+    default: {
+      NODELET_ERROR("Unrecognized generation method.");
+      return;
+    }
+    }
+    if (!loop_generation_->Initialize(n)) {
+      NODELET_ERROR("Failed to initialize Loop Candidate Generation module.");
+    }
+  }
+
+  std::unique_ptr<LoopGeneration> loop_generation_;
+};
+
+class LoopComputationNodelet : public nodelet::Nodelet {
+private:
+  void onInit() override {
+    lamp_utils::SharedScanStore::Instance().SetEnabled(true);
+    ros::NodeHandle n = getMTPrivateNodeHandle();
+
+    loop_computation_.reset(new IcpLoopComputation);
+    if (!loop_computation_->Initialize(n)) {
+      NODELET_ERROR("Failed to initialize Loop Candidate Computation module.");
+    }
+  }
+
+  std::unique_ptr<IcpLoopComputation> loop_computation_;
+};
+
+class LoopPrioritizationNodelet : public nodelet::Nodelet {
+private:
+  void onInit() override {
+    lamp_utils::SharedScanStore::Instance().SetEnabled(true);
+    ros::NodeHandle n = getMTPrivateNodeHandle();
+
+    int prioritization_method = 0;
+    std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+    if (!pu::Get(param_ns + "/prioritization_method", prioritization_method)) {
+      NODELET_ERROR("Failed to get prioritization method.");
+      return;
+    }
+
+    switch (prioritization_method) {
+    case 0: {
+      loop_prioritize_.reset(new GenericLoopPrioritization);
+    } break;
+    case 1: {
+      loop_prioritize_.reset(new ObservabilityLoopPrioritization);
+    } break;
+    case 2: {
+      loop_prioritize_.reset(new InformationGainLoopPrioritization);
+    } break;
+    default: {
+      NODELET_ERROR("Unrecognized prioritization method.");
+      return;
+    }
+    }
+    if (!loop_prioritize_->Initialize(n)) {
+      NODELET_ERROR("Failed to initialize Loop Candidate Prioritization module.");
+      return;
+    }
+    // Spinners stop when destroyed, keep them with the nodelet
+    async_spinners_ = loop_prioritize_->SetAsyncSpinners(n);
+    for (auto& spinner : async_spinners_)
+      spinner.start();
+  }
+
+  std::unique_ptr<LoopPrioritization> loop_prioritize_;
+  std::vector<ros::AsyncSpinner> async_spinners_;
+};
+
+class LoopCandidateQueueNodelet : public nodelet::Nodelet {
+private:
+  void onInit() override {
+    lamp_utils::SharedScanStore::Instance().SetEnabled(true);
+    ros::NodeHandle n = getMTPrivateNodeHandle();
+
+    int queue_method = 0;
+    std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+    if (!pu::Get(param_ns + "/queue/method", queue_method)) {
+      NODELET_ERROR("Failed to get queue method.");
+      return;
+    }
+
+    switch (queue_method) {
+    case 1: {
+      queue_.reset(new RoundRobinLoopCandidateQueue);
+    } break;
+    case 2: {
+      queue_.reset(new ObservabilityQueue);
+    } break;
+    default: {
+      NODELET_ERROR_STREAM("Unrecognized queue method " << queue_method);
+      return;
+    }
+    }
+
+    if (!queue_->Initialize(n)) {
+      NODELET_ERROR("Failed to initialize Loop Candidate Queue module.");
+    }
+  }
+
+  std::unique_ptr<LoopCandidateQueue> queue_;
+};
+
+} // namespace lamp_loop_closure
+
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopGenerationNodelet,
+                       nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopComputationNodelet,
+                       nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopPrioritizationNodelet,
+                       nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(lamp_loop_closure::LoopCandidateQueueNodelet,
+                       nodelet::Nodelet)
@@ -4,6 +4,7 @@
  * Authors: Yun Chang (yunchang@mit.edu)
  */
 
+#include <lamp_utils/ThreadGovernor.h>
 #include <loop_closure/IcpLoopComputation.h>
 #include <ros/ros.h>
 
@@ -19,6 +20,7 @@ int main(int argc, char** argv) {
               ros::this_node::getName().c_str());
     return EXIT_FAILURE;
   }
+  lamp_utils::ThreadGovernor::Instance().RegisterThread("ros_spinners");
   ros::spin();
 
   return EXIT_SUCCESS;
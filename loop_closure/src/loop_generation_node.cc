@@ -4,17 +4,44 @@
  * Authors: Yun Chang    (yunchang@mit.edu)
  */
 
+#include <loop_closure/ArtifactLoopGeneration.h>
 #include <loop_closure/ProximityLoopGeneration.h>
+#include <loop_closure/ScanContextLoopGeneration.h>
+#include <memory>
+#include <parameter_utils/ParameterUtils.h>
 #include <ros/ros.h>
+#include <lamp_utils/CommonFunctions.h>
 
+namespace pu = parameter_utils;
 namespace lc = lamp_loop_closure;
 
 int main(int argc, char** argv) {
   ros::init(argc, argv, "loop_generation");
   ros::NodeHandle n("~");
+  int generation_method = 0;
+  std::string param_ns = lamp_utils::GetParamNamespace(n.getNamespace());
+  if (!pu::Get(param_ns + "/generation_method", generation_method)) {
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<lc::LoopGeneration> loop_gen;
 
-  lc::ProximityLoopGeneration loop_gen;
-  if (!loop_gen.Initialize(n)) {
+  switch (generation_method) {
+  case 0: {
+    loop_gen.reset(new lc::ProximityLoopGeneration);
+  } break;
+  case 1: {
+    loop_gen.reset(new lc::ScanContextLoopGeneration);
+  } break;
+  case 2: {
+    loop_gen.reset(new lc::ArtifactLoopGeneration);
+  } break;
+  default: {
+    ROS_ERROR("loop_generation: Unrecognized generation method. ");
+    return EXIT_FAILURE;
+  }
+  }
+  if (!loop_gen->Initialize(n)) {
     ROS_ERROR("%s: Failed to initialize Loop Candidate Generation module. ",
               ros::this_node::getName().c_str());
     return EXIT_FAILURE;
@@ -4,11 +4,13 @@
  * Authors: Yun Chang (yunchang@mit.edu)
  */
 #include <loop_closure/GenericLoopPrioritization.h>
+#include <loop_closure/InformationGainLoopPrioritization.h>
 #include <loop_closure/ObservabilityLoopPrioritization.h>
 #include <memory>
 #include <parameter_utils/ParameterUtils.h>
 #include <ros/ros.h>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/ThreadGovernor.h>
 
 namespace pu = parameter_utils;
 namespace lc = lamp_loop_closure;
@@ -33,6 +35,11 @@ int main(int argc, char** argv) {
     loop_prioritize = std::unique_ptr<lc::ObservabilityLoopPrioritization>(
         new lc::ObservabilityLoopPrioritization);
   } break;
+  case 2: {
+    loop_prioritize =
+        std::unique_ptr<lc::InformationGainLoopPrioritization>(
+            new lc::InformationGainLoopPrioritization);
+  } break;
   default: {
     ROS_ERROR("loop_prioritization: Unrecognized prioritization method. ");
   }
@@ -43,6 +50,9 @@ int main(int argc, char** argv) {
         ros::this_node::getName().c_str());
     return EXIT_FAILURE;
   }
+  // The spinner threads start from here, in this group until their
+  // callbacks move them to their own
+  lamp_utils::ThreadGovernor::Instance().RegisterThread("ros_spinners");
   std::vector<ros::AsyncSpinner> async_spinners =
         loop_prioritize->SetAsyncSpinners(n);
   for (auto spinner : async_spinners)
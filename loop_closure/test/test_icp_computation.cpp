@@ -161,6 +161,32 @@ TEST_F(TestICPComputation, TestThreadedEqualsNonThreaded) {
     }
 }
 
+TEST_F(TestICPComputation, VgicpAlignsCorner) {
+    PointCloud::Ptr target = GenerateCorner();
+    PointCloud::Ptr source(new PointCloud);
+    Eigen::Matrix4f shift = Eigen::Matrix4f::Identity();
+    shift(0, 3) = 0.1;
+    shift(1, 3) = -0.05;
+    pcl::transformPointCloud(*target, *source, shift);
+
+    lamp_loop_closure::PlaneCovariances target_covariances, source_covariances;
+    CalculateCovarianceFromNormals(target, target_covariances);
+    CalculateCovarianceFromNormals(source, source_covariances);
+    lamp_loop_closure::VoxelGaussianMap voxels(*target, target_covariances, 0.5);
+
+    lamp_loop_closure::Vgicp vgicp;
+    lamp_loop_closure::VgicpParams params;
+    params.max_iterations = 50;
+    vgicp.SetParams(params);
+    ASSERT_TRUE(vgicp.Align(
+        *source, source_covariances, voxels, Eigen::Matrix4f::Identity()));
+    EXPECT_TRUE(vgicp.HasConverged());
+    const Eigen::Matrix4f T = vgicp.GetFinalTransformation();
+    EXPECT_NEAR(-0.1, T(0, 3), 0.02);
+    EXPECT_NEAR(0.05, T(1, 3), 0.02);
+    EXPECT_NEAR(0.0, T(2, 3), 0.02);
+}
+
 
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
@@ -3,11 +3,15 @@
  *
  */
 
+#include <cstdio>
+
 #include <geometry_utils/Transform3.h>
 #include <gtest/gtest.h>
 
+#include "loop_closure/AlignmentCache.h"
 #include "loop_closure/IcpLoopComputation.h"
 #include "loop_closure/LoopComputation.h"
+#include "loop_closure/SubmapCache.h"
 #include "lamp_utils/CommonFunctions.h"
 
 #include "test_artifacts.h"
@@ -65,6 +69,53 @@ class TestLoopComputation : public ::testing::Test {
     icp_compute_.GetTeaserInitialAlignment(source, target, tf_out);
   }
 
+  std::vector<pose_graph_msgs::LoopCandidate> selectCandidatesForAlignment(
+      const std::vector<pose_graph_msgs::LoopCandidate>& candidates) {
+    return icp_compute_.SelectCandidatesForAlignment(candidates);
+  }
+
+  void setBatchVerificationParams(unsigned int group_key_radius,
+                                  double voxel_size,
+                                  double corr_dist,
+                                  double min_overlap) {
+    icp_compute_.batch_group_key_radius_ = group_key_radius;
+    icp_compute_.batch_voxel_size_ = voxel_size;
+    icp_compute_.batch_corr_dist_ = corr_dist;
+    icp_compute_.batch_min_overlap_ = min_overlap;
+  }
+
+  IcpLoopComputation::OneToManyResults performOneToManyAlignment(
+      const std::vector<pose_graph_msgs::LoopCandidate>& candidates,
+      size_t best_k,
+      double confident_fitness) {
+    return icp_compute_.PerformOneToManyAlignment(
+        candidates, best_k, confident_fitness);
+  }
+
+  void setRobotFramePrior(char robot_from,
+                          char robot_to,
+                          const gtsam::Pose3& prior) {
+    icp_compute_.robot_frame_priors_[{robot_from, robot_to}] = prior;
+  }
+
+  void setIdentityInitialization() {
+    icp_compute_.icp_init_method_ = IcpLoopComputation::IcpInitMethod::IDENTITY;
+  }
+
+  void enableAreaSubmaps(double radius, int max_scans) {
+    icp_compute_.b_area_submaps_ = true;
+    icp_compute_.area_radius_ = radius;
+    icp_compute_.area_max_scans_ = max_scans;
+    icp_compute_.area_submap_cache_.SetParams(10, 0.0, 0.05, 0.01);
+  }
+
+  gtsam::Key getAreaAnchor(const gtsam::Key& key, gtsam::Pose3* key_in_anchor) {
+    return icp_compute_.GetAreaAnchor(key, key_in_anchor);
+  }
+
+  int getNumEarlyRejected() const { return icp_compute_.num_early_rejected_; }
+  int getNumDeduplicated() const { return icp_compute_.num_deduplicated_; }
+
   IcpLoopComputation icp_compute_;
   double tolerance_ = 1e-5;
 };
@@ -181,6 +232,285 @@ TEST_F(TestLoopComputation, PerformAlignment) {
       gtsam::assert_equal(lamp_utils::ToGtsam(tf_exp), lamp_utils::ToGtsam(tf), 1e-3));
 }
 
+TEST_F(TestLoopComputation, SelectCandidatesForAlignment) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  setBatchVerificationParams(2, 0.1, 0.5, 0.5);
+
+  PointCloud::Ptr corner = GenerateCorner();
+  PointCloud::Ptr corner_moved(new PointCloud);
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T(0, 3) = 1;
+  pcl::transformPointCloudWithNormals(*corner, *corner_moved, T, true);
+
+  pose_graph_msgs::KeyedScan::Ptr ks0(new pose_graph_msgs::KeyedScan);
+  *ks0 = PointCloudToKeyedScan(corner, gtsam::Symbol('a', 0));
+  pose_graph_msgs::KeyedScan::Ptr ks100(new pose_graph_msgs::KeyedScan);
+  *ks100 = PointCloudToKeyedScan(corner_moved, gtsam::Symbol('a', 100));
+  pose_graph_msgs::KeyedScan::Ptr ks101(new pose_graph_msgs::KeyedScan);
+  *ks101 = PointCloudToKeyedScan(corner_moved, gtsam::Symbol('a', 101));
+  keyedScanCallback(ks0);
+  keyedScanCallback(ks100);
+  keyedScanCallback(ks101);
+
+  // Two near duplicates and one with candidate poses far from the truth
+  pose_graph_msgs::LoopCandidate c100, c101, c_bad;
+  c100.key_from = gtsam::Symbol('a', 100);
+  c100.key_to = gtsam::Symbol('a', 0);
+  c100.pose_from.position.x = -1.0;
+  c100.pose_from.orientation.w = 1;
+  c100.pose_to.orientation.w = 1;
+  c101 = c100;
+  c101.key_from = gtsam::Symbol('a', 101);
+  c_bad = c100;
+  c_bad.pose_from.position.x = 20.0;
+
+  std::vector<pose_graph_msgs::LoopCandidate> selected =
+      selectCandidatesForAlignment({c100, c_bad, c101});
+  ASSERT_EQ(1, selected.size());
+  EXPECT_EQ(c100.key_from, selected[0].key_from);
+  EXPECT_EQ(1, getNumEarlyRejected());
+  EXPECT_EQ(1, getNumDeduplicated());
+}
+
+TEST_F(TestLoopComputation, PerformOneToManyAlignment) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  ThreadPool::Shared().reserve(2);
+
+  PointCloud::Ptr corner = GenerateCorner();
+  PointCloud::Ptr corner_moved(new PointCloud);
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T(0, 3) = 1;
+  pcl::transformPointCloudWithNormals(*corner, *corner_moved, T, true);
+
+  // One source matching two targets
+  pose_graph_msgs::KeyedScan::Ptr ks0(new pose_graph_msgs::KeyedScan);
+  *ks0 = PointCloudToKeyedScan(corner, gtsam::Symbol('a', 0));
+  pose_graph_msgs::KeyedScan::Ptr ks50(new pose_graph_msgs::KeyedScan);
+  *ks50 = PointCloudToKeyedScan(corner, gtsam::Symbol('a', 50));
+  pose_graph_msgs::KeyedScan::Ptr ks100(new pose_graph_msgs::KeyedScan);
+  *ks100 = PointCloudToKeyedScan(corner_moved, gtsam::Symbol('a', 100));
+  keyedScanCallback(ks0);
+  keyedScanCallback(ks50);
+  keyedScanCallback(ks100);
+
+  pose_graph_msgs::PoseGraph::Ptr kp(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode kp0, kp50, kp100;
+  kp0.key = gtsam::Symbol('a', 0);
+  kp50.key = gtsam::Symbol('a', 50);
+  kp100.key = gtsam::Symbol('a', 100);
+  kp0.pose.orientation.w = 1;
+  kp50.pose.orientation.w = 1;
+  kp100.pose.position.x = -1.0;
+  kp100.pose.orientation.w = 1;
+  kp->nodes = {kp0, kp50, kp100};
+  keyedPoseCallback(kp);
+
+  pose_graph_msgs::LoopCandidate c0, c50;
+  c0.key_from = gtsam::Symbol('a', 100);
+  c0.key_to = gtsam::Symbol('a', 0);
+  c0.pose_from = kp100.pose;
+  c0.pose_to = kp0.pose;
+  c50 = c0;
+  c50.key_to = gtsam::Symbol('a', 50);
+
+  // Both targets aligned, only the best one kept
+  IcpLoopComputation::OneToManyResults results =
+      performOneToManyAlignment({c0, c50}, 1, -1.0);
+  ASSERT_EQ(2, results.size());
+  EXPECT_TRUE(results[0].b_computed);
+  EXPECT_TRUE(results[1].b_computed);
+  EXPECT_EQ(1, results[0].b_success + results[1].b_success);
+
+  results = performOneToManyAlignment({c0, c50}, 2, -1.0);
+  EXPECT_TRUE(results[0].b_success);
+  EXPECT_TRUE(results[1].b_success);
+}
+
+TEST_F(TestLoopComputation, RobotFramePriorInitializesInterRobotAlignment) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  setIdentityInitialization();
+
+  PointCloud::Ptr corner = GenerateCorner();
+  PointCloud::Ptr corner_moved(new PointCloud);
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T(0, 3) = 1;
+  pcl::transformPointCloudWithNormals(*corner, *corner_moved, T, true);
+
+  // Both robots start at the origin of their own frame
+  pose_graph_msgs::KeyedScan::Ptr ksa(new pose_graph_msgs::KeyedScan);
+  *ksa = PointCloudToKeyedScan(corner, gtsam::Symbol('a', 0));
+  pose_graph_msgs::KeyedScan::Ptr ksb(new pose_graph_msgs::KeyedScan);
+  *ksb = PointCloudToKeyedScan(corner_moved, gtsam::Symbol('b', 0));
+  keyedScanCallback(ksa);
+  keyedScanCallback(ksb);
+
+  pose_graph_msgs::PoseGraph::Ptr kp(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode kpa, kpb;
+  kpa.key = gtsam::Symbol('a', 0);
+  kpb.key = gtsam::Symbol('b', 0);
+  kpa.pose.orientation.w = 1;
+  kpb.pose.orientation.w = 1;
+  kp->nodes = {kpa, kpb};
+  keyedPoseCallback(kp);
+
+  // Coarse map level alignment of frame b into frame a
+  setRobotFramePrior(
+      'b', 'a', gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(-0.9, 0.1, 0)));
+
+  geometry_utils::Transform3 tf;
+  gtsam::Matrix66 covar;
+  ASSERT_TRUE(performAlignment(gtsam::Symbol('b', 0),
+                               gtsam::Symbol('a', 0),
+                               lamp_utils::ToGtsam(kpb.pose),
+                               lamp_utils::ToGtsam(kpa.pose),
+                               &tf,
+                               &covar));
+  EXPECT_NEAR(1.0, tf.translation.X(), 1e-3);
+  EXPECT_NEAR(0.0, tf.translation.Y(), 1e-3);
+}
+
+TEST_F(TestLoopComputation, AlignsToSharedAreaSubmap) {
+  ros::NodeHandle nh;
+  icp_compute_.Initialize(nh);
+  enableAreaSubmaps(5.0, 10);
+
+  // a0 and a1 see the corner of the world origin, a100 from 1 m behind
+  PointCloud::Ptr corner = GenerateCorner();
+  auto shifted = [&corner](double x) {
+    PointCloud::Ptr moved(new PointCloud);
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(0, 3) = x;
+    pcl::transformPointCloudWithNormals(*corner, *moved, T, true);
+    return moved;
+  };
+  pose_graph_msgs::PoseGraph::Ptr kp(new pose_graph_msgs::PoseGraph);
+  const std::vector<std::pair<gtsam::Symbol, double>> scans{
+      {gtsam::Symbol('a', 0), 0.0},
+      {gtsam::Symbol('a', 1), 0.5},
+      {gtsam::Symbol('a', 100), -0.9}};
+  for (const auto& scan : scans) {
+    const double true_x = scan.first.index() == 100 ? -1.0 : scan.second;
+    pose_graph_msgs::KeyedScan::Ptr ks(new pose_graph_msgs::KeyedScan);
+    *ks = PointCloudToKeyedScan(shifted(-true_x), scan.first);
+    keyedScanCallback(ks);
+    pose_graph_msgs::PoseGraphNode node;
+    node.key = scan.first;
+    node.pose.position.x = scan.second;
+    node.pose.orientation.w = 1;
+    kp->nodes.push_back(node);
+  }
+  keyedPoseCallback(kp);
+
+  // The area of a1 takes in a0, the result is still relative to a1
+  geometry_utils::Transform3 tf;
+  gtsam::Matrix66 covar;
+  const gtsam::Pose3 p1 = lamp_utils::ToGtsam(kp->nodes[1].pose);
+  const gtsam::Pose3 p100 = lamp_utils::ToGtsam(kp->nodes[2].pose);
+  ASSERT_TRUE(performAlignment(
+      gtsam::Symbol('a', 100), gtsam::Symbol('a', 1), p100, p1, &tf, &covar));
+  EXPECT_NEAR(1.5, tf.translation.X(), 1e-3);
+  EXPECT_NEAR(0.0, tf.translation.Y(), 1e-3);
+  gtsam::Pose3 key_in_anchor;
+  EXPECT_EQ(gtsam::Key(gtsam::Symbol('a', 1)),
+            getAreaAnchor(gtsam::Symbol('a', 0), &key_in_anchor));
+  EXPECT_NEAR(-0.5, key_in_anchor.translation().x(), 1e-9);
+
+  // a0 lies in the same area, the same alignment is not computed again
+  const gtsam::Pose3 p0 = lamp_utils::ToGtsam(kp->nodes[0].pose);
+  EXPECT_FALSE(performAlignment(
+      gtsam::Symbol('a', 100), gtsam::Symbol('a', 0), p100, p0, &tf, &covar));
+}
+
+TEST(TestSubmapCache, InvalidatedByRelativeMotion) {
+  SubmapCache cache;
+  cache.SetParams(2, 0.0, 0.05, 0.01);
+  const gtsam::Symbol key('a', 10);
+  auto at = [](double x, double yaw) {
+    return gtsam::Pose3(gtsam::Rot3::Yaw(yaw), gtsam::Point3(x, 0, 0));
+  };
+  SubmapWindow window;
+  window.emplace_back(key - 1, at(-1, 0));
+  window.emplace_back(key + 1, at(1, 0));
+  PointCloud::Ptr submap(new PointCloud);
+  const PointCloudConstPtr cached = cache.Insert(key, window, submap);
+  EXPECT_EQ(cached, cache.Find(key, window));
+
+  // Small corrections keep the submap
+  SubmapWindow moved = window;
+  moved[1].second = at(1.01, 0);
+  EXPECT_EQ(cached, cache.Find(key, moved));
+
+  // A new neighbour or a large correction rebuilds it
+  SubmapWindow grown = window;
+  grown.emplace_back(key + 2, at(2, 0));
+  EXPECT_EQ(nullptr, cache.Find(key, grown));
+  cache.Insert(key, window, submap);
+  moved[1].second = at(1, 0.1);
+  EXPECT_EQ(nullptr, cache.Find(key, moved));
+  EXPECT_EQ(0u, cache.Size());
+
+  // Least recently used submaps are dropped first
+  for (size_t i = 0; i < 3; i++) {
+    cache.Insert(key + i, SubmapWindow(), PointCloud::Ptr(new PointCloud));
+  }
+  EXPECT_EQ(2u, cache.Size());
+  EXPECT_EQ(nullptr, cache.Find(key, SubmapWindow()));
+}
+
+TEST(TestAlignmentCache, KeepsOutcomesAcrossReopen) {
+  const std::string filename = "/tmp/test_alignment_cache.bin";
+  std::remove(filename.c_str());
+
+  AlignmentCacheKey accepted_key;
+  accepted_key.key_from = gtsam::Symbol('a', 1);
+  accepted_key.key_to = gtsam::Symbol('a', 20);
+  accepted_key.content_hash = 7;
+  accepted_key.params_hash = 3;
+  AlignmentCacheKey rejected_key = accepted_key;
+  rejected_key.content_hash = 8;
+
+  AlignmentCacheEntry accepted;
+  accepted.b_accepted = true;
+  accepted.fitness = 0.02;
+  accepted.delta.translation = geometry_utils::Vec3(1, 2, 3);
+  accepted.covariance = 0.1 * gtsam::Matrix66::Identity();
+  {
+    AlignmentCache cache;
+    ASSERT_TRUE(cache.Open(filename));
+    cache.Insert(accepted_key, accepted);
+    cache.Insert(rejected_key, AlignmentCacheEntry());
+    // Past the initial capacity of the file
+    AlignmentCacheKey key = accepted_key;
+    for (uint64_t i = 0; i < 300; i++) {
+      key.params_hash = 100 + i;
+      cache.Insert(key, accepted);
+    }
+    EXPECT_EQ(302u, cache.Size());
+  }
+
+  AlignmentCache cache;
+  ASSERT_TRUE(cache.Open(filename));
+  EXPECT_EQ(302u, cache.Size());
+  AlignmentCacheEntry entry;
+  ASSERT_TRUE(cache.Lookup(accepted_key, &entry));
+  EXPECT_TRUE(entry.b_accepted);
+  EXPECT_DOUBLE_EQ(0.02, entry.fitness);
+  EXPECT_DOUBLE_EQ(2, entry.delta.translation.Y());
+  EXPECT_DOUBLE_EQ(0.1, entry.covariance(5, 5));
+  ASSERT_TRUE(cache.Lookup(rejected_key, &entry));
+  EXPECT_FALSE(entry.b_accepted);
+
+  // Other settings are a miss
+  AlignmentCacheKey other_key = accepted_key;
+  other_key.params_hash = 4;
+  EXPECT_FALSE(cache.Lookup(other_key, &entry));
+  cache.Close();
+  std::remove(filename.c_str());
+}
+
 }  // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
@@ -5,8 +5,11 @@
 
 #include <gtest/gtest.h>
 
+#include "loop_closure/ArtifactLoopGeneration.h"
 #include "loop_closure/LoopGeneration.h"
 #include "loop_closure/ProximityLoopGeneration.h"
+#include "loop_closure/ScanContext.h"
+#include "loop_closure/TestUtils.h"
 
 namespace lamp_loop_closure {
 class TestLoopGeneration : public ::testing::Test {
@@ -39,6 +42,7 @@ class TestLoopGeneration : public ::testing::Test {
   }
 
   ProximityLoopGeneration proximity_lc_;
+  ArtifactLoopGeneration artifact_lc_;
 };
 
 TEST_F(TestLoopGeneration, TestInitialize) {
@@ -98,6 +102,43 @@ TEST_F(TestLoopGeneration, TestGenerateLoopsTakeAll) {
   EXPECT_EQ(gtsam::Symbol('a', 0), candidate2.key_to);
 }
 
+TEST_F(TestLoopGeneration, TestGenerateLoopsInterRobotOnly) {
+  ros::NodeHandle nh;
+  ros::param::set("base/b_take_n_closest", false);
+  ros::param::set("base/proximity_pairs/intra_robot", false);
+  bool init = proximity_lc_.Initialize(nh);
+  pose_graph_msgs::PoseGraph::Ptr graph_msg(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode node1, node2, node3, node4, node5;
+  node1.key = gtsam::Symbol('a', 0);
+  node2.key = gtsam::Symbol('b', 0);
+  node3.key = gtsam::Symbol('c', 0);
+  node4.key = gtsam::Symbol('a', 1);
+  node5.key = gtsam::Symbol('a', 100);
+  node2.pose.position.x = 3;
+  node3.pose.position.x = 1000;
+  node4.pose.position.x = 2;
+  node5.pose.position.x = 2;
+  graph_msg->nodes.push_back(node1);
+  graph_msg->nodes.push_back(node2);
+  graph_msg->nodes.push_back(node3);
+  graph_msg->nodes.push_back(node4);
+  graph_msg->nodes.push_back(node5);
+
+  keyedPoseCallback(graph_msg);
+  ros::param::set("base/proximity_pairs/intra_robot", true);
+
+  // The a100 to a0 and a1 candidates are left to the robot
+  std::vector<pose_graph_msgs::LoopCandidate> candidates = getCandidates();
+  EXPECT_EQ(3, candidates.size());
+  for (const auto& candidate : candidates) {
+    EXPECT_NE(gtsam::Symbol(candidate.key_from).chr(),
+              gtsam::Symbol(candidate.key_to).chr());
+  }
+  auto candidate2 = candidates[2];
+  EXPECT_EQ(gtsam::Symbol('a', 100), candidate2.key_from);
+  EXPECT_EQ(gtsam::Symbol('b', 0), candidate2.key_to);
+}
+
 TEST_F(TestLoopGeneration, TestGenerateLoopsTakeClosest) {
   ros::NodeHandle nh;
   ros::param::set("base/n_closest", 1);
@@ -164,6 +205,147 @@ TEST_F(TestLoopGeneration, TestAdaptiveRadius) {
   EXPECT_EQ(1, candidates.size());
 }
 
+TEST_F(TestLoopGeneration, TestArtifactLoops) {
+  ros::NodeHandle nh;
+  ros::param::set("base/artifact_candidates/max_candidates", 1);
+  ASSERT_TRUE(artifact_lc_.Initialize(nh));
+  ros::param::set("base/artifact_candidates/max_candidates", 3);
+
+  // Three robots see one artifact: A0 and B0 share the ID, C0 is next to A0.
+  // The odometry of b drifted by 6 m
+  pose_graph_msgs::PoseGraph::Ptr graph_msg(new pose_graph_msgs::PoseGraph);
+  auto add_sighting = [&](gtsam::Symbol node_key,
+                          double node_x,
+                          gtsam::Symbol artifact_key,
+                          double artifact_x,
+                          const std::string& id) {
+    pose_graph_msgs::PoseGraphNode node, artifact;
+    node.key = node_key;
+    node.pose.position.x = node_x;
+    node.pose.orientation.w = 1;
+    artifact.key = artifact_key;
+    artifact.ID = id;
+    artifact.pose.position.x = artifact_x;
+    artifact.pose.orientation.w = 1;
+    graph_msg->nodes.push_back(node);
+    graph_msg->nodes.push_back(artifact);
+    pose_graph_msgs::PoseGraphEdge edge;
+    edge.key_from = node_key;
+    edge.key_to = artifact_key;
+    edge.type = pose_graph_msgs::PoseGraphEdge::ARTIFACT;
+    edge.pose.position.x = artifact_x - node_x;
+    edge.pose.orientation.w = 1;
+    graph_msg->edges.push_back(edge);
+  };
+  add_sighting(gtsam::Symbol('a', 0), 0, gtsam::Symbol('A', 0), 2, "id_1");
+  add_sighting(gtsam::Symbol('b', 0), 9, gtsam::Symbol('B', 0), 8, "id_1");
+  add_sighting(gtsam::Symbol('c', 0), 5.5, gtsam::Symbol('C', 0), 2.5, "");
+  artifact_lc_.KeyedPoseCallback(graph_msg);
+
+  // One candidate per sighting, with the closest other sighting (b0 is 1 m
+  // from its artifact), a0 to b0 already made when b0 comes
+  std::vector<pose_graph_msgs::LoopCandidate> candidates =
+      artifact_lc_.candidates_;
+  ASSERT_EQ(2, candidates.size());
+  EXPECT_EQ(gtsam::Symbol('a', 0), candidates[0].key_from);
+  EXPECT_EQ(gtsam::Symbol('b', 0), candidates[0].key_to);
+  EXPECT_EQ(pose_graph_msgs::LoopCandidate::ARTIFACT, candidates[0].type);
+  // Puts the artifact of b0 onto the one of a0
+  EXPECT_NEAR(3, candidates[0].pose_to.position.x, 1e-9);
+  EXPECT_EQ(gtsam::Symbol('c', 0), candidates[1].key_from);
+  EXPECT_EQ(gtsam::Symbol('b', 0), candidates[1].key_to);
+
+  // Nothing new on the same graph
+  artifact_lc_.candidates_.clear();
+  artifact_lc_.KeyedPoseCallback(graph_msg);
+  EXPECT_TRUE(artifact_lc_.candidates_.empty());
+}
+
+TEST(TestScanContext, TestRecognizeRotatedScan) {
+  // Wall on one side of a flat ground
+  PointCloud scan;
+  for (int i = -300; i < 300; i++) {
+    for (int j = -300; j < 300; j += 10) {
+      Point p;
+      p.x = 0.1 * i;
+      p.y = 0.1 * j;
+      p.z = (p.x > 10 && p.y > -5 && p.y < 15) ? 3.0 : 0.0;
+      scan.push_back(p);
+    }
+  }
+  // Same place seen from a frame rotated by yaw
+  const double yaw = 1.0;
+  PointCloud rotated;
+  for (Point p : scan.points) {
+    const float x = p.x, y = p.y;
+    p.x = std::cos(yaw) * x + std::sin(yaw) * y;
+    p.y = -std::sin(yaw) * x + std::cos(yaw) * y;
+    rotated.push_back(p);
+  }
+
+  ScanContextParams params;
+  ScanContext descriptor(scan, params);
+  ScanContext rotated_descriptor(rotated, params);
+  int shift;
+  EXPECT_LT(descriptor.Distance(rotated_descriptor, 3, &shift), 0.05);
+  // This frame in the rotated one
+  EXPECT_NEAR(-yaw,
+              descriptor.YawOfShift(shift),
+              2 * M_PI / params.num_sectors);
+
+  ScanContextIndex index;
+  index.Insert(gtsam::Symbol('a', 0), rotated_descriptor);
+  index.Insert(gtsam::Symbol('a', 1), ScanContext(PointCloud(), params));
+  EXPECT_EQ(1, index.Size());
+  auto all = [](const gtsam::Key&) { return true; };
+  auto none = [](const gtsam::Key&) { return false; };
+  auto neighbours = index.Query(descriptor, 5, all);
+  ASSERT_EQ(1, neighbours.size());
+  EXPECT_EQ(gtsam::Symbol('a', 0), neighbours[0].first);
+  EXPECT_TRUE(index.Query(descriptor, 5, none).empty());
+}
+
+TEST(TestSyntheticWorkload, DeterministicOverlappingCandidates) {
+  test_utils::SyntheticWorkloadParams params;
+  params.robot_prefixes = "ab";
+  params.keys_per_robot = 200;
+  params.points_per_scan = 100;
+  params.num_threads = 4;
+  test_utils::SyntheticWorkload workload;
+  test_utils::GenerateSyntheticWorkload(params, &workload);
+
+  ASSERT_EQ(400, workload.keys.size());
+  ASSERT_EQ(400, workload.odom_keyed_poses.size());
+  ASSERT_EQ(400, workload.keyed_scans.size());
+  // The robots take turns
+  EXPECT_EQ(gtsam::Symbol('a', 0), workload.keys[0]);
+  EXPECT_EQ(gtsam::Symbol('b', 0), workload.keys[1]);
+  EXPECT_EQ(100, workload.keyed_scans[5].scan.width);
+  ASSERT_FALSE(workload.candidates.candidates.empty());
+
+  std::map<gtsam::Key, gtsam::Pose3> gt_poses;
+  for (size_t i = 0; i < workload.keys.size(); i++) {
+    gt_poses[workload.keys[i]] = workload.gt_keyed_poses[i];
+  }
+  for (const auto& candidate : workload.candidates.candidates) {
+    const gtsam::Pose3& from = gt_poses.at(candidate.key_from);
+    const gtsam::Pose3& to = gt_poses.at(candidate.key_to);
+    EXPECT_LE((from.translation() - to.translation()).norm(),
+              params.loop_radius);
+    const gtsam::Symbol key_from(candidate.key_from), key_to(candidate.key_to);
+    if (key_from.chr() == key_to.chr()) {
+      EXPECT_GE(key_from.index() - key_to.index(), params.min_key_separation);
+    }
+  }
+
+  // Same scans whatever the thread count
+  params.num_threads = 1;
+  std::vector<pose_graph_msgs::KeyedScan> scans;
+  test_utils::GenerateSyntheticScans(params, workload, {5}, &scans);
+  ASSERT_EQ(1, scans.size());
+  EXPECT_EQ(workload.keyed_scans[5].scan.data, scans[0].scan.data);
+}
+
 }  // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
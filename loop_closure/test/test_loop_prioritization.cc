@@ -6,7 +6,14 @@
 #include <gtest/gtest.h>
 
 #include "loop_closure/GenericLoopPrioritization.h"
+#include "loop_closure/InformationGainSelector.h"
 #include "loop_closure/LoopPrioritization.h"
+#include "loop_closure/Backpressure.h"
+#include "loop_closure/CandidateChannel.h"
+#include "loop_closure/CandidateHeap.h"
+#include "loop_closure/CandidateLeases.h"
+#include "loop_closure/CandidateWaitList.h"
+#include "loop_closure/LoopClosureSet.h"
 #include "loop_closure/ObservabilityLoopPrioritization.h"
 
 #include "test_artifacts.h"
@@ -187,6 +194,281 @@ TEST_F(TestLoopPrioritization, TestPrioritization) {
   //   EXPECT_EQ(gtsam::Symbol('a', 1), observ_candidates.candidates[1].key_to);
 }
 
+TEST(TestCandidateHeap, PopByScoreAndExpire) {
+  CandidateHeap heap;
+  pose_graph_msgs::LoopCandidate c;
+  for (size_t i = 0; i < 6; i++) {
+    c.key_from = gtsam::Symbol('a', i);
+    // Scores 0, 5, 4, 3, 2, 1, expiring with the key index
+    heap.Push(c, i == 0 ? 0.0 : 6.0 - i, static_cast<double>(i));
+  }
+  EXPECT_EQ(6, heap.Size());
+
+  // a0 and a1 expired
+  EXPECT_EQ(2, heap.Expire(1.0));
+  EXPECT_EQ(4, heap.Size());
+
+  ASSERT_TRUE(heap.Pop(&c));
+  EXPECT_EQ(gtsam::Symbol('a', 2), c.key_from);
+  ASSERT_TRUE(heap.Pop(&c));
+  EXPECT_EQ(gtsam::Symbol('a', 3), c.key_from);
+
+  EXPECT_EQ(1, heap.Expire(4.0));
+  ASSERT_TRUE(heap.Pop(&c));
+  EXPECT_EQ(gtsam::Symbol('a', 5), c.key_from);
+  EXPECT_FALSE(heap.Pop(&c));
+  EXPECT_TRUE(heap.Empty());
+}
+
+TEST(TestCandidateChannel, BoundedHandoff) {
+  std::shared_ptr<CandidateChannel> channel =
+      CandidateChannel::Get("/test_candidate_channel", 4);
+  EXPECT_EQ(channel, CandidateChannel::Get("/test_candidate_channel", 16));
+  EXPECT_FALSE(channel->HasConsumer());
+
+  {
+    CandidateChannelReader reader(channel);
+    EXPECT_TRUE(channel->HasConsumer());
+    for (int i = 0; i < 4; i++) {
+      pose_graph_msgs::LoopCandidateArray::Ptr msg(
+          new pose_graph_msgs::LoopCandidateArray);
+      msg->originator = i;
+      EXPECT_TRUE(channel->Push(msg));
+    }
+    // Full at the capacity
+    EXPECT_FALSE(channel->Push(CandidateChannel::Message()));
+
+    CandidateChannel::Message msg;
+    for (int i = 0; i < 4; i++) {
+      ASSERT_TRUE(reader.Pop(&msg));
+      EXPECT_EQ(i, msg->originator);
+    }
+    EXPECT_FALSE(reader.Pop(&msg));
+  }
+  EXPECT_FALSE(channel->HasConsumer());
+}
+
+TEST(TestCandidateWaitList, ReleaseAndExpire) {
+  CandidateWaitList wait_list(1.0, 4);
+  pose_graph_msgs::LoopCandidate c;
+  const gtsam::Key a0 = gtsam::Symbol('a', 0);
+  const gtsam::Key b0 = gtsam::Symbol('b', 0);
+  c.key_from = a0;
+  c.key_to = b0;
+  wait_list.Park(c, {a0, b0}, 10.0);
+  c.key_to = gtsam::Symbol('b', 1);
+  wait_list.Park(c, {c.key_to}, 2.5);
+  EXPECT_EQ(2, wait_list.Size());
+
+  // Ready once every missing key arrived
+  std::vector<pose_graph_msgs::LoopCandidate> ready;
+  wait_list.Release(a0);
+  wait_list.TakeReady(&ready);
+  EXPECT_TRUE(ready.empty());
+  wait_list.Release(b0);
+  wait_list.TakeReady(&ready);
+  ASSERT_EQ(1, ready.size());
+  EXPECT_EQ(b0, ready[0].key_to);
+
+  EXPECT_EQ(0, wait_list.Expire(2.0));
+  // Past a full revolution of the wheel
+  EXPECT_EQ(1, wait_list.Expire(7.0));
+  EXPECT_EQ(0, wait_list.Size());
+  wait_list.Release(gtsam::Symbol('b', 1));
+  ready.clear();
+  wait_list.TakeReady(&ready);
+  EXPECT_TRUE(ready.empty());
+}
+
+TEST(TestCandidateLeases, AssignCompleteAndExpire) {
+  CandidateLeases leases;
+  CandidateLeasesParams params;
+  params.batch_size = 2;
+  params.lease_timeout = 5.0;
+  params.worker_timeout = 3.0;
+  leases.SetParams(params);
+  // A robot holding the scans of a, a base machine receiving all of them
+  leases.Heartbeat("robot", 4, {'a'}, 0.0);
+  leases.Heartbeat("base", 2, {}, 0.0);
+
+  std::vector<pose_graph_msgs::LoopCandidate> candidates(4);
+  candidates[0].key_from = gtsam::Symbol('a', 0);
+  candidates[0].key_to = gtsam::Symbol('a', 10);
+  candidates[1].key_from = gtsam::Symbol('a', 1);
+  candidates[1].key_to = gtsam::Symbol('b', 0);
+  candidates[2].key_from = gtsam::Symbol('a', 2);
+  candidates[2].key_to = gtsam::Symbol('b', 1);
+  candidates[3].key_from = gtsam::Symbol('a', 3);
+  candidates[3].key_to = gtsam::Symbol('b', 2);
+  std::vector<CandidateLeases::Lease> out;
+  leases.Assign(&candidates, 0.0, &out);
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(3, leases.NumLeased());
+  // Past the capacity of the base machine, left for the coordinator
+  ASSERT_EQ(1, candidates.size());
+  EXPECT_EQ(gtsam::Symbol('b', 2), candidates[0].key_to);
+
+  const CandidateLeases::Lease& robot_lease =
+      out[0].worker == "robot" ? out[0] : out[1];
+  const CandidateLeases::Lease& base_lease =
+      out[0].worker == "robot" ? out[1] : out[0];
+  ASSERT_EQ(1, robot_lease.candidates.size());
+  EXPECT_EQ(gtsam::Symbol('a', 10), robot_lease.candidates[0].key_to);
+  EXPECT_EQ(2, base_lease.candidates.size());
+
+  // Only the worker of the lease closes it, once
+  std::vector<pose_graph_msgs::LoopCandidate> returned;
+  EXPECT_FALSE(leases.Complete(robot_lease.id, "base", &returned));
+  EXPECT_TRUE(leases.Complete(robot_lease.id, "robot", &returned));
+  EXPECT_EQ(1, returned.size());
+  EXPECT_FALSE(leases.Complete(robot_lease.id, "robot", &returned));
+
+  // The base machine went silent, its lease comes back
+  leases.Heartbeat("robot", 4, {'a'}, 3.0);
+  returned.clear();
+  EXPECT_EQ(1, leases.Expire(4.0, &returned));
+  EXPECT_EQ(2, returned.size());
+  EXPECT_EQ(1, leases.NumWorkers());
+  EXPECT_EQ(0, leases.NumLeased());
+  EXPECT_FALSE(leases.Complete(base_lease.id, "base", &returned));
+}
+
+TEST(TestLoopClosureSet, AgesOldestGeneration) {
+  const gtsam::Key a0 = gtsam::Symbol('a', 0);
+  LoopClosureSet sent(4);
+  EXPECT_TRUE(sent.Insert(MakeLoopClosureId(a0, gtsam::Symbol('b', 0), 1)));
+  EXPECT_FALSE(sent.Insert(MakeLoopClosureId(a0, gtsam::Symbol('b', 0), 1)));
+  // Same keys, other type
+  EXPECT_FALSE(sent.Contains(MakeLoopClosureId(a0, gtsam::Symbol('b', 0), 2)));
+
+  for (size_t i = 1; i < 5; i++) {
+    EXPECT_TRUE(sent.Insert(MakeLoopClosureId(a0, gtsam::Symbol('b', i), 1)));
+  }
+  // The first two were forgotten with their generation
+  EXPECT_EQ(3, sent.size());
+  EXPECT_FALSE(sent.Contains(MakeLoopClosureId(a0, gtsam::Symbol('b', 0), 1)));
+  EXPECT_FALSE(sent.Contains(MakeLoopClosureId(a0, gtsam::Symbol('b', 1), 1)));
+  for (size_t i = 2; i < 5; i++) {
+    EXPECT_TRUE(sent.Contains(MakeLoopClosureId(a0, gtsam::Symbol('b', i), 1)));
+  }
+}
+
+TEST(TestInformationGainSelector, SelectsGainPerIcpTime) {
+  InformationGainParams params;
+  params.icp_budget = 0.7;
+  params.default_icp_time = 0.2;
+  params.odom_rotation_sigma = 0.001;
+  params.odom_position_sigma = 0.005;
+  params.min_gain = 0.1;
+  params.redundancy_hops = 1;
+  InformationGainSelector selector;
+  selector.SetParams(params);
+
+  // Chain a0..a20, b0 not connected to it
+  for (size_t i = 0; i < 20; i++) {
+    selector.AddEdge(gtsam::Symbol('a', i), gtsam::Symbol('a', i + 1));
+  }
+  EXPECT_EQ(2, selector.GraphDistance(gtsam::Symbol('a', 3),
+                                      gtsam::Symbol('a', 1)));
+  EXPECT_EQ(params.max_hops + 1,
+            selector.GraphDistance(gtsam::Symbol('a', 0),
+                                   gtsam::Symbol('b', 0)));
+
+  auto candidate = [](gtsam::Key from, gtsam::Key to) {
+    pose_graph_msgs::LoopCandidate c;
+    c.key_from = from;
+    c.key_to = to;
+    return c;
+  };
+  // Far apart in the graph gains more, until a loop connects the nodes
+  const auto far = candidate(gtsam::Symbol('a', 1), gtsam::Symbol('a', 19));
+  const auto near = candidate(gtsam::Symbol('a', 0), gtsam::Symbol('a', 1));
+  EXPECT_GT(selector.ExpectedGain(far), selector.ExpectedGain(near));
+  EXPECT_LT(selector.ExpectedGain(near), params.min_gain);
+
+  // Marginals of the last solve replace the accumulated odometry
+  const double gain_odometry = selector.ExpectedGain(far);
+  selector.SetMarginal(far.key_from, 0.1 * gtsam::Matrix66::Identity());
+  selector.SetMarginal(far.key_to, 0.1 * gtsam::Matrix66::Identity());
+  EXPECT_GT(selector.ExpectedGain(far), gain_odometry);
+  selector.ClearMarginals();
+
+  // The unconnected robot first, then one of the two candidates closing the
+  // same loop although the budget fits three. The near one is dropped.
+  std::vector<pose_graph_msgs::LoopCandidate> candidates{
+      far,
+      candidate(gtsam::Symbol('a', 2), gtsam::Symbol('a', 18)),
+      near,
+      candidate(gtsam::Symbol('a', 10), gtsam::Symbol('b', 0))};
+  std::vector<pose_graph_msgs::LoopCandidate> selected;
+  EXPECT_NEAR(0.4, selector.Select(&candidates, &selected), 1e-9);
+  ASSERT_EQ(2, selected.size());
+  EXPECT_EQ(gtsam::Symbol('b', 0), selected[0].key_to);
+  EXPECT_EQ(far.key_from, selected[1].key_from);
+  EXPECT_GT(selected[0].value, selected[1].value);
+  ASSERT_EQ(1, candidates.size());
+  EXPECT_EQ(gtsam::Symbol('a', 2), candidates[0].key_from);
+
+  // Larger scans and slower alignments cost more
+  pose_graph_msgs::LoopComputationStatus status;
+  status.num_computed = 4;
+  status.num_workers = 2;
+  status.compute_time = 2.0;
+  selector.UpdateIcpTime(status);
+  EXPECT_NEAR(0.36, selector.IcpTime(), 1e-9);
+  selector.SetScanSize(far.key_from, 100);
+  selector.SetScanSize(far.key_to, 100);
+  selector.SetScanSize(near.key_from, 400);
+  selector.SetScanSize(near.key_to, 400);
+  EXPECT_GT(selector.ExpectedCost(near), selector.ExpectedCost(far));
+
+  // Once a loop closure connects the nodes little is left to gain
+  selector.AddEdge(far.key_from, far.key_to);
+  EXPECT_EQ(1, selector.GraphDistance(far.key_from, far.key_to));
+  EXPECT_LT(selector.ExpectedGain(far), gain_odometry);
+}
+
+TEST(TestBackpressure, KeepsShareWhileSaturated) {
+  BackpressureParams params;
+  params.b_enabled = true;
+  params.max_latency = 10.0;
+  params.status_timeout = 5.0;
+  Backpressure backpressure(params);
+
+  // No throughput measured yet
+  EXPECT_EQ(0, backpressure.Load(0));
+  EXPECT_EQ(10, backpressure.Keep(10, 1, 0));
+
+  // 100 queued at 5 per second take 20s, twice the latency allowed
+  pose_graph_msgs::LoopComputationStatus status;
+  status.header.stamp = ros::Time(100);
+  status.queue_depth = 100;
+  status.throughput = 5;
+  backpressure.Update(status);
+  EXPECT_NEAR(2.0, backpressure.Load(101), 1e-9);
+  EXPECT_TRUE(backpressure.IsSaturated(101));
+  EXPECT_EQ(5, backpressure.Keep(10, 1, 101));
+  EXPECT_EQ(8, backpressure.Keep(10, 8, 101));
+
+  // An idle status keeps the throughput, a drained queue releases
+  status.header.stamp = ros::Time(102);
+  status.queue_depth = 10;
+  status.throughput = 0;
+  backpressure.Update(status);
+  EXPECT_FALSE(backpressure.IsSaturated(102));
+  EXPECT_EQ(10, backpressure.Keep(10, 1, 102));
+
+  // Stale statuses do not throttle
+  status.queue_depth = 1000;
+  backpressure.Update(status);
+  EXPECT_TRUE(backpressure.IsSaturated(103));
+  EXPECT_FALSE(backpressure.IsSaturated(110));
+
+  params.b_enabled = false;
+  backpressure.SetParams(params);
+  EXPECT_EQ(0, backpressure.Load(103));
+}
+
 }  // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
@@ -32,7 +32,7 @@ protected:
   }
 
   pose_graph_msgs::PoseGraphNode getClosestPoseAtTime(
-      const std::map<double, pose_graph_msgs::PoseGraphNode>& robot_trajectory,
+      const RobotTrajectory& robot_trajectory,
       const ros::Time& stamp,
       double time_threshold = 2.0,
       bool check_threshold = false) {
@@ -53,8 +53,7 @@ protected:
     return rssi_lc_.is_robot_radio(hostname);
   }
 
-  std::map<double, pose_graph_msgs::PoseGraphNode>
-  getRobotTrajectory(char robot_prefix) {
+  RobotTrajectory getRobotTrajectory(char robot_prefix) {
     return rssi_lc_.robots_trajectory_[robot_prefix];
   }
 
@@ -63,6 +62,10 @@ protected:
     return rssi_lc_.rssi_scom_robot_list_;
   }
 
+  std::set<std::string> getPendingRobotRadios() {
+    return rssi_lc_.pending_robot_radios_;
+  }
+
   std::vector<pose_graph_msgs::LoopCandidate> getCandidates() {
     return rssi_lc_.candidates_;
   }
@@ -72,7 +75,7 @@ protected:
   }
 
   pose_graph_msgs::PoseGraphNode getPoseGraphNodeFromKey(
-      const std::map<double, pose_graph_msgs::PoseGraphNode>& robot_trajectory,
+      const RobotTrajectory& robot_trajectory,
       const gtsam::Symbol& key) {
     return rssi_lc_.GetPoseGraphNodeFromKey(robot_trajectory, key);
   }
@@ -302,6 +305,8 @@ TEST_F(TestRSSILoopGeneration, TestCommNodeRawCallback) {
   EXPECT_EQ(rssi_scom_robot["scom-husky4"].node_id, 1);
   EXPECT_NEAR(rssi_scom_robot["scom-husky4"].txpw_requested_dBm, 52.0, 0.1);
   EXPECT_NEAR(rssi_scom_robot["scom-husky4"].txpw_actual_dBm, 22.0, 0.1);
+  // every reported robot radio was processed by the update
+  EXPECT_TRUE(getPendingRobotRadios().empty());
 }
 
 TEST_F(TestRSSILoopGeneration, TestGetPoseGraphNodeFromKey) {
@@ -562,6 +567,41 @@ TEST(RssiRawInfo, TestAppendNode) {
   EXPECT_EQ(rssi_raw_info.has_node_pose(node1), true);
 }
 
+TEST(RobotTrajectory, TestInsertion) {
+  RobotTrajectory trajectory;
+  pose_graph_msgs::PoseGraphNode node1, node2, node3;
+  node1.key = gtsam::Symbol('a', 0);
+  node1.header.stamp = ros::Time(10.0);
+  node2.key = gtsam::Symbol('a', 1);
+  node2.header.stamp = ros::Time(30.0);
+  node2.pose.position.x = 50.0;
+  node3.key = gtsam::Symbol('a', 2);
+  node3.header.stamp = ros::Time(20.0);
+  node3.pose.position.x = 1.0;
+  trajectory.Insert(node1);
+  trajectory.Insert(node2);
+  // Out of order
+  trajectory.Insert(node3);
+  EXPECT_EQ(trajectory.size(), 3);
+  EXPECT_EQ(trajectory.Key(1), node3.key);
+  EXPECT_EQ(trajectory.LowerBound(15.0), 1);
+  EXPECT_EQ(trajectory.LowerBound(40.0), 3);
+
+  size_t index;
+  ASSERT_TRUE(trajectory.Find(node2.key, &index));
+  EXPECT_EQ(index, 2);
+  EXPECT_FALSE(trajectory.Find(gtsam::Symbol('a', 3), &index));
+
+  // A known key only moves
+  node2.pose.position.x = 2.0;
+  trajectory.Insert(node2);
+  EXPECT_EQ(trajectory.size(), 3);
+  EXPECT_EQ(trajectory.Pose(2).position.x, 2.0);
+  geometry_msgs::Point origin;
+  EXPECT_EQ(trajectory.KeysWithin(origin, 5.0).size(), 3);
+  EXPECT_EQ(trajectory.KeysWithin(origin, 1.5).size(), 2);
+}
+
 } // namespace lamp_loop_closure
 
 int main(int argc, char** argv) {
@@ -0,0 +1,52 @@
+/*
+NodePositions.h
+Node positions of a robot kept as contiguous coordinate arrays, so they can
+be culled against the level cones all at once
+*/
+
+#ifndef NODE_POSITIONS_H
+#define NODE_POSITIONS_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+#include <gtsam/inference/Key.h>
+
+class NodePositions {
+public:
+  // Adds the node, or moves it if it is already there
+  void Set(const gtsam::Key& key, const Eigen::Vector3d& position);
+  void Clear();
+
+  inline size_t Size() const { return keys_.size(); }
+  inline gtsam::Key KeyAt(size_t i) const { return keys_[i]; }
+  inline Eigen::Vector3d PositionAt(size_t i) const {
+    return Eigen::Vector3d(x_[i], y_[i], z_[i]);
+  }
+
+  // Bit i % 64 of word i / 64 is set if node i is inside the vertical cone
+  // with its apex at apex, pointing up (down if b_negative): between
+  // height_min and height_max along the axis, and no further from the axis
+  // than along / height_max * radius + offset
+  std::vector<uint64_t> CullCone(const Eigen::Vector3d& apex,
+                                 bool b_negative,
+                                 double height_min,
+                                 double height_max,
+                                 double radius,
+                                 double offset) const;
+
+  static inline bool IsSet(const std::vector<uint64_t>& mask, size_t i) {
+    return (mask[i / 64] >> (i % 64)) & 1u;
+  }
+
+private:
+  std::vector<double> x_;
+  std::vector<double> y_;
+  std::vector<double> z_;
+  std::vector<gtsam::Key> keys_;
+  std::unordered_map<gtsam::Key, size_t> index_;
+};
+
+#endif
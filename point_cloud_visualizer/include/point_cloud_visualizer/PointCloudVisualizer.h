@@ -54,7 +54,13 @@
 #include <pcl_conversions/pcl_conversions.h>
 #include <lamp_utils/ColorHandling.h>
 #include <lamp_utils/CommonFunctions.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/Metrics.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <point_cloud_visualizer/NodePositions.h>
+#include <point_cloud_visualizer/TiledMap.h>
+#include <pose_graph_msgs/MapTile.h>
+#include <pose_graph_msgs/MapView.h>
 
 #include <tf_conversions/tf_eigen.h>
 
@@ -65,7 +71,11 @@
 #include <tf/transform_broadcaster.h>
 #include <visualization_msgs/Marker.h>
 
+#include <cmath>
 #include <limits>
+#include <map>
+#include <unordered_map>
+#include <Eigen/Eigenvalues>
 #include <pcl/ModelCoefficients.h>
 #include <pcl/filters/extract_indices.h>
 #include <pcl/sample_consensus/method_types.h>
@@ -92,13 +102,25 @@ public:
 
   struct Level {
     tf::StampedTransform tf_;
-    PointCloud::Ptr points_;
     ros::Publisher pub_;
     std::vector<gu::Transform3> nodes_;
     std::vector<gu::Transform3> init_nodes_;
     pcl::ModelCoefficients coefficients_;
     bool initalized;
     BoundingBox bounding_box_;
+    // Points were added or moved since the level was last published
+    bool b_dirty_;
+    // Keys whose points (in level_points_) are in the level
+    std::vector<gtsam::Key> keys_;
+    // Sum of [x y z 1]^T [x y z 1] over nodes_, the plane is its eigenvector
+    // of least eigenvalue
+    Eigen::Matrix<double, 4, 4, Eigen::DontAlign> moments_;
+    // Number of nodes (and init nodes) per height bin
+    std::map<int, size_t> height_histogram_;
+    static constexpr double kHeightBinSize = 0.5;
+    static int HeightBin(double z) {
+      return static_cast<int>(std::floor(z / kHeightBinSize));
+    }
     bool IsInitialized() const {
       ROS_DEBUG_STREAM(
           "Diagonal distance: " << bounding_box_.DiagonalDistance());
@@ -108,7 +130,9 @@ public:
     void EstimatePlane();
     double AngleWithXYPlaneRad() const;
     void UpdateNodeInTheLevel(const gu::Transform3& node);
-    double MinDistanceFromNodes(const gu::Transform3& node) const;
+    // Vertical distance to the nearest height bin with nodes of the level
+    double HeightDistanceFromNodes(const gu::Transform3& node) const;
+    void Merge(const Level& other);
   };
   typedef pcl::PointCloud<pcl::PointXYZI> PointCloudXYZI;
   typedef pcl::PointCloud<pcl::PointXYZRGB> ColorPointCloud;
@@ -138,6 +162,11 @@ private:
   bool IsPointInsideTheNegativeCone(const gu::Transform3& current_pose,
                                     const gu::Transform3& point_to_test,
                                     double offset = 0.0) const;
+  // Same tests for all the nodes at once, as a bitmask over nodes
+  std::vector<uint64_t> CullNodesInCone(const NodePositions& nodes,
+                                        const gu::Transform3& current_pose,
+                                        bool b_negative,
+                                        double offset = 0.0) const;
   bool AllLevelsAreInitialized() const;
 
   // Callbacks
@@ -146,10 +175,27 @@ private:
   void OptimizerUpdateCallback(const pose_graph_msgs::PoseGraphConstPtr& msg);
 
   void VisualizePointCloud();
+  void PublishDirtyTiles(unsigned char robot_chr,
+                         const std::vector<TiledMap::TileIndex>& tiles);
+  pose_graph_msgs::MapTile GetTileMsg(TiledMap& map,
+                                      const TiledMap::TileIndex& index,
+                                      int lod) const;
+  bool MapViewCallback(pose_graph_msgs::MapView::Request& request,
+                       pose_graph_msgs::MapView::Response& response);
   void PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg);
+  void UpdateNodePositions(const pose_graph_msgs::PoseGraph& msg);
+  // Cones at the latest node of each robot and the nodes they contain
+  void PublishCones();
 
   bool GetTransformedPointCloudWorld(const gtsam::Symbol key,
                                      PointCloud* points);
+  // Body to world transform of a key, as used to transform its scan
+  Eigen::Matrix4d GetScanTransform(const gtsam::Pose3& pose) const;
+
+  // Transforms the points of the keys whose pose moved since they were
+  // added, in place in the robot maps and the levels
+  void ReprojectMovedKeys(
+      const std::vector<std::pair<gtsam::Key, gtsam::Pose3>>& poses);
   bool CombineKeyedScansWorld(PointCloud* points);
 
   void RefreshPlanes();
@@ -173,7 +219,10 @@ private:
   ros::Subscriber back_end_pose_graph_sub_;
 
   std::map<unsigned char, ros::Publisher> publishers_robots_point_clouds_;
+  std::map<unsigned char, ros::Publisher> publishers_robots_map_tiles_;
+  ros::ServiceServer map_view_srv_;
   ros::Publisher cone_pub_;
+  lamp_utils::MetricsPublisher metrics_publisher_;
   ros::Publisher crossed_nodes_pub_;
 
   // The node's name.
@@ -196,13 +245,42 @@ private:
   // grows, we are only publishing new changes each time, making visualization
   // constant time rather than O(n).
   PointCloud::Ptr incremental_points_;
-  std::map<unsigned char, PointCloud::Ptr> robots_point_clouds_;
+
+  // Robot maps by tile. Only the tiles changed since the last publish are
+  // serialized again, the full map is published when it changed.
+  std::map<unsigned char, TiledMap> robots_maps_;
+  std::map<unsigned char, bool> robots_maps_stale_;
+  double map_tile_size_;
+  double map_base_leaf_;
+  int map_num_lods_;
+  // Levels of detail of the full maps and of the published tiles
+  int map_publish_lod_;
+  int map_tiles_lod_;
+
+  // Points of the levels, by key. Levels only hold their keys, so merging
+  // levels moves no points.
+  PointCloud::Ptr level_points_;
+  std::unordered_map<gtsam::Key, std::pair<size_t, size_t>> level_key_ranges_;
+  std::unordered_map<gtsam::Key, size_t> key_levels_;
+
+  // Node positions of each robot, in the order they were added
+  std::map<unsigned char, NodePositions> robots_nodes_;
+
+  // Pose each key was added to the maps with
+  std::unordered_map<gtsam::Key, gtsam::Pose3> rendered_poses_;
+  double reprojection_translation_threshold_;
+  double reprojection_rotation_threshold_;
 
   // Enable or disable visualization. If this parameter is loaded as false, this
   // class object won't do anything.
   bool enable_visualization_;
   Levels levels_;
   size_t selected_level = 0;
+
+  // Bytes of the map, level and pending clouds, set after each visualization
+  // with the accounts of pose_graph_
+  void UpdateMemoryAccounts();
+  lamp_utils::MemoryAccount clouds_account_{"point_cloud_visualizer.clouds"};
   ros::NodeHandle nh_;
   tf::TransformBroadcaster broadcaster_;
   int current_level = 0; // todo: delete
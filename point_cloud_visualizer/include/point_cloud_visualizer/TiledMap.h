@@ -0,0 +1,112 @@
+/*
+TiledMap.h
+Point cloud map split into fixed size tiles, each kept at several levels of
+detail and serialized only when it changes
+*/
+
+#ifndef TILED_MAP_H
+#define TILED_MAP_H
+
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+#include <gtsam/inference/Key.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <lamp_utils/PointCloudKernels.h>
+#include <lamp_utils/PointCloudTypes.h>
+
+// Level 0 of a tile is the full resolution, level k > 0 is downsampled to a
+// voxel size of base_leaf * 2^(k - 1). The levels and their messages are
+// built on first use and dropped when the points of the tile change.
+// The points of a key are kept as slices of the tiles they first fell in,
+// so moving a key transforms them in place. They stay in those tiles; the
+// tile bounds grow to follow them.
+class TiledMap {
+public:
+  typedef lamp_utils::VoxelIndex TileIndex;
+  typedef std::shared_ptr<const sensor_msgs::PointCloud2> CloudMsgConstPtr;
+
+  TiledMap();
+
+  void SetParams(double tile_size, double base_leaf, int num_lods);
+
+  // Adds points (in the map frame) to their tiles and marks them dirty
+  void Insert(const PointCloud& points);
+  void Insert(const gtsam::Key& key, const PointCloud& points);
+
+  // Applies transform (in the map frame) to the points of key, false if the
+  // key has no points
+  bool MoveKey(const gtsam::Key& key, const Eigen::Matrix4d& transform);
+  void Clear();
+
+  // Tiles changed since the last call
+  std::vector<TileIndex> TakeDirtyTiles();
+  bool HasDirtyTiles() const;
+
+  std::vector<TileIndex> GetTiles() const;
+
+  // Tiles with points within max_range (0 for no limit) of origin, in the
+  // cone of half angle half_fov around direction
+  std::vector<TileIndex> GetTilesInView(const Eigen::Vector3d& origin,
+                                        const Eigen::Vector3d& direction,
+                                        double half_fov,
+                                        double max_range) const;
+
+  // Coarsest level with a point spacing no larger than resolution
+  int LodForResolution(double resolution) const;
+
+  // nullptr if the tile does not exist
+  PointCloudConstPtr GetTileCloud(const TileIndex& index, int lod);
+  CloudMsgConstPtr GetTileMsg(const TileIndex& index, int lod);
+  unsigned int GetTileVersion(const TileIndex& index) const;
+
+  // The whole map at a level, concatenated from the cached tile messages
+  void GetMapMsg(int lod, sensor_msgs::PointCloud2* msg);
+
+  inline double TileSize() const { return tile_size_; }
+  inline int NumLods() const { return num_lods_; }
+  inline size_t NumTiles() const { return tiles_.size(); }
+  inline size_t NumPoints() const { return num_points_; }
+
+private:
+  struct Tile {
+    PointCloud::Ptr points;
+    Eigen::Vector3f min_pt{Eigen::Vector3f::Constant(
+        std::numeric_limits<float>::infinity())};
+    Eigen::Vector3f max_pt{Eigen::Vector3f::Constant(
+        -std::numeric_limits<float>::infinity())};
+    unsigned int version{0};
+    bool b_dirty{false};
+    unsigned int last_insert{0};
+    // Per level, empty until used
+    std::vector<PointCloudConstPtr> lods;
+    std::vector<CloudMsgConstPtr> msgs;
+  };
+
+  // Points [begin, end) of a tile
+  struct Slice {
+    TileIndex tile;
+    size_t begin;
+    size_t end;
+  };
+
+  Tile* FindTile(const TileIndex& index);
+  void Touch(Tile& tile);
+  void InsertPoints(const PointCloud& points, std::vector<Slice>* slices);
+
+  double tile_size_;
+  double base_leaf_;
+  int num_lods_;
+
+  std::unordered_map<TileIndex, Tile, lamp_utils::VoxelIndexHash> tiles_;
+  std::unordered_map<gtsam::Key, std::vector<Slice>> key_slices_;
+  size_t num_points_;
+  size_t num_dirty_;
+  unsigned int insert_serial_;
+};
+
+#endif
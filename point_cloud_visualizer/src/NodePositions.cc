@@ -0,0 +1,71 @@
+/*
+NodePositions.cc
+Node positions of a robot kept as contiguous coordinate arrays, so they can
+be culled against the level cones all at once
+*/
+
+#include <point_cloud_visualizer/NodePositions.h>
+
+#include <algorithm>
+
+void NodePositions::Set(const gtsam::Key& key, const Eigen::Vector3d& position) {
+  auto it = index_.find(key);
+  size_t i;
+  if (it == index_.end()) {
+    i = keys_.size();
+    index_[key] = i;
+    keys_.push_back(key);
+    x_.push_back(0.0);
+    y_.push_back(0.0);
+    z_.push_back(0.0);
+  } else {
+    i = it->second;
+  }
+  x_[i] = position.x();
+  y_[i] = position.y();
+  z_[i] = position.z();
+}
+
+void NodePositions::Clear() {
+  x_.clear();
+  y_.clear();
+  z_.clear();
+  keys_.clear();
+  index_.clear();
+}
+
+std::vector<uint64_t> NodePositions::CullCone(const Eigen::Vector3d& apex,
+                                              bool b_negative,
+                                              double height_min,
+                                              double height_max,
+                                              double radius,
+                                              double offset) const {
+  typedef Eigen::Map<const Eigen::ArrayXd> ConstMap;
+  const size_t n = Size();
+  std::vector<uint64_t> mask((n + 63) / 64, 0);
+  const double sign = b_negative ? -1.0 : 1.0;
+  const double slope = radius / height_max;
+
+  // One word of the mask per block, the arithmetic of a block is vectorized
+  Eigen::ArrayXd along(64), limit(64), orth2(64);
+  for (size_t begin = 0; begin < n; begin += 64) {
+    const Eigen::Index count = std::min<size_t>(64, n - begin);
+    const ConstMap x(&x_[begin], count);
+    const ConstMap y(&y_[begin], count);
+    const ConstMap z(&z_[begin], count);
+    along.head(count) = sign * (z - apex.z());
+    limit.head(count) = along.head(count) * slope + offset;
+    orth2.head(count) = (x - apex.x()).square() + (y - apex.y()).square();
+    const Eigen::Array<bool, Eigen::Dynamic, 1> inside =
+        (along.head(count) >= height_min) && (along.head(count) <= height_max) &&
+        (limit.head(count) >= 0.0) &&
+        (orth2.head(count) <= limit.head(count).square());
+
+    uint64_t word = 0;
+    for (Eigen::Index i = 0; i < count; i++) {
+      word |= static_cast<uint64_t>(inside(i)) << i;
+    }
+    mask[begin / 64] = word;
+  }
+  return mask;
+}
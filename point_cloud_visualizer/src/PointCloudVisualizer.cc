@@ -42,13 +42,17 @@
 #include <pcl_conversions/pcl_conversions.h>
 #include <point_cloud_visualizer/PointCloudVisualizer.h>
 #include <tf/transform_broadcaster.h>
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudKernels.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/SharedScanStore.h>
 
 namespace pu = parameter_utils;
 
 PointCloudVisualizer::PointCloudVisualizer() {
   // Instantiate point cloud pointers.
   incremental_points_.reset(new PointCloud);
+  level_points_.reset(new PointCloud);
 }
 
 PointCloudVisualizer::~PointCloudVisualizer() {}
@@ -68,8 +72,11 @@ bool PointCloudVisualizer::Initialize(const ros::NodeHandle& n) {
 
   for (std::string robot : robot_names_) {
     ROS_INFO_STREAM("Creating point cloud for " << robot);
-    robots_point_clouds_.insert(std::pair<unsigned char, PointCloud::Ptr>(
-        lamp_utils::ROBOT_PREFIXES.at(robot), new PointCloud));
+    const unsigned char robot_chr = lamp_utils::ROBOT_PREFIXES.at(robot);
+    robots_maps_[robot_chr].SetParams(
+        map_tile_size_, map_base_leaf_, map_num_lods_);
+    robots_maps_stale_[robot_chr] = false;
+    robots_nodes_[robot_chr];
   }
 
   return true;
@@ -93,6 +100,23 @@ bool PointCloudVisualizer::LoadParameters(const ros::NodeHandle& n) {
     }
   }
 
+  if (!pu::Get("visualizer/map_tiles/tile_size", map_tile_size_))
+    return false;
+  if (!pu::Get("visualizer/map_tiles/base_leaf", map_base_leaf_))
+    return false;
+  if (!pu::Get("visualizer/map_tiles/num_lods", map_num_lods_))
+    return false;
+  if (!pu::Get("visualizer/map_tiles/publish_lod", map_publish_lod_))
+    return false;
+  if (!pu::Get("visualizer/map_tiles/tiles_lod", map_tiles_lod_))
+    return false;
+  if (!pu::Get("visualizer/reprojection/translation_threshold",
+               reprojection_translation_threshold_))
+    return false;
+  if (!pu::Get("visualizer/reprojection/rotation_threshold",
+               reprojection_rotation_threshold_))
+    return false;
+
   return true;
 }
 
@@ -101,6 +125,8 @@ bool PointCloudVisualizer::RegisterCallbacks(const ros::NodeHandle& n) {
 
   nh_ = ros::NodeHandle(n);
 
+  metrics_publisher_.Start(nh_);
+
   // Initialize publishers.
   incremental_points_pub_ =
       nh_.advertise<sensor_msgs::PointCloud2>("incremental_points", 10, false);
@@ -134,9 +160,17 @@ bool PointCloudVisualizer::RegisterCallbacks(const ros::NodeHandle& n) {
         std::pair<unsigned char, ros::Publisher>(
             lamp_utils::ROBOT_PREFIXES.at(robot),
             nh_.advertise<sensor_msgs::PointCloud2>(
-                robot + "/lamp/octree_map", 10, false)));
+                robot + "/lamp/octree_map", 1, true)));
+    publishers_robots_map_tiles_.insert(
+        std::pair<unsigned char, ros::Publisher>(
+            lamp_utils::ROBOT_PREFIXES.at(robot),
+            nh_.advertise<pose_graph_msgs::MapTile>(
+                robot + "/lamp/octree_map_tiles", 100, false)));
   }
 
+  map_view_srv_ = nh_.advertiseService(
+      "map_view", &PointCloudVisualizer::MapViewCallback, this);
+
   return true;
 }
 
@@ -162,7 +196,7 @@ void PointCloudVisualizer::PublishIncrementalPointCloud() {
 
   // Convert incremental points to ROS's sensor_msgs::PointCloud2 type.
   sensor_msgs::PointCloud2 ros_incremental_points;
-  pcl::toROSMsg(*incremental_points_, ros_incremental_points);
+  lamp_utils::ToRosMsg(*incremental_points_, &ros_incremental_points);
   ros_incremental_points.header.stamp = stamp_;
   ros_incremental_points.header.frame_id = fixed_frame_id_;
   incremental_points_pub_.publish(ros_incremental_points);
@@ -173,6 +207,10 @@ void PointCloudVisualizer::PublishIncrementalPointCloud() {
 
 void PointCloudVisualizer::KeyedScanCallback(
     const pose_graph_msgs::KeyedScan::ConstPtr& msg) {
+  static lamp_utils::Histogram& callback_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram(
+          "point_cloud_visualizer.keyed_scan_ms");
+  lamp_utils::ScopedLatency latency(callback_ms);
   const gtsam::Key& key = msg->key;
   if (pose_graph_.HasScan(key)) {
     //    ROS_ERROR("%s: Key %lu already has a laser scan.", name_.c_str(),
@@ -180,8 +218,8 @@ void PointCloudVisualizer::KeyedScanCallback(
     return;
   }
 
-  PointCloud::Ptr scan(new PointCloud);
-  pcl::fromROSMsg(msg->scan, *scan);
+  PointCloud::ConstPtr scan =
+      lamp_utils::SharedScanStore::Instance().GetOrConvert(*msg);
 
   // The first key should be treated differently; we need to use the laser
   // scan's timestamp for pose zero.
@@ -237,13 +275,24 @@ double point2planedistnaceWithSign(const gu::Transform3 pose,
 
 void PointCloudVisualizer::PoseGraphCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+  static lamp_utils::Histogram& callback_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram(
+          "point_cloud_visualizer.pose_graph_ms");
+  lamp_utils::ScopedLatency latency(callback_ms);
   if (msg->nodes.size() != pose_graph_.GetValues().size()) {
     pose_graph_.UpdateFromMsg(msg);
+    UpdateNodePositions(*msg);
     for (const auto& keyed_scan : key_scans_to_update_) {
       PointCloud::Ptr temp_cloud(new PointCloud);
-      GetTransformedPointCloudWorld(keyed_scan.first, temp_cloud.get());
+      if (GetTransformedPointCloudWorld(keyed_scan.first, temp_cloud.get())) {
+        rendered_poses_[keyed_scan.first] =
+            pose_graph_.GetPose(keyed_scan.first);
+      }
 
-      *robots_point_clouds_.at(keyed_scan.first.chr()) += *temp_cloud;
+      auto map = robots_maps_.find(keyed_scan.first.chr());
+      if (map != robots_maps_.end()) {
+        map->second.Insert(keyed_scan.first, *temp_cloud);
+      }
 
       AddPointCloudToCorrespondingLevel2(keyed_scan.first, temp_cloud);
     }
@@ -251,6 +300,19 @@ void PointCloudVisualizer::PoseGraphCallback(
     key_scans_to_update_.clear();
   }
 }
+
+void PointCloudVisualizer::UpdateNodePositions(
+    const pose_graph_msgs::PoseGraph& msg) {
+  for (const auto& node : msg.nodes) {
+    auto nodes = robots_nodes_.find(gtsam::Symbol(node.key).chr());
+    if (nodes == robots_nodes_.end())
+      continue;
+    nodes->second.Set(node.key,
+                      Eigen::Vector3d(node.pose.position.x,
+                                      node.pose.position.y,
+                                      node.pose.position.z));
+  }
+}
 geometry_msgs::Point
 PointCloudVisualizer::GetPositionMsg(gtsam::Key key) const {
   geometry_msgs::Point p;
@@ -270,23 +332,114 @@ PointCloudVisualizer::GetPositionMsg(gtsam::Key key) const {
 void PointCloudVisualizer::VisualizePointCloud() {
   for (std::string robot : robot_names_) {
     unsigned char robot_chr = lamp_utils::ROBOT_PREFIXES.at(robot);
-    if (publishers_robots_point_clouds_.at(robot_chr).getNumSubscribers() > 0) {
+    TiledMap& map = robots_maps_.at(robot_chr);
+    if (map.HasDirtyTiles()) {
+      robots_maps_stale_[robot_chr] = true;
+      PublishDirtyTiles(robot_chr, map.TakeDirtyTiles());
+    }
+
+    // The map is latched, republished only when it changed
+    if (robots_maps_stale_[robot_chr] &&
+        publishers_robots_point_clouds_.at(robot_chr).getNumSubscribers() > 0) {
       sensor_msgs::PointCloud2 pcl_pc2;
-      pcl::toROSMsg(*robots_point_clouds_.at(robot_chr), pcl_pc2);
+      map.GetMapMsg(map_publish_lod_, &pcl_pc2);
       pcl_pc2.header.stamp = stamp_;
       pcl_pc2.header.frame_id = fixed_frame_id_;
       publishers_robots_point_clouds_.at(robot_chr).publish(pcl_pc2);
+      robots_maps_stale_[robot_chr] = false;
     }
   }
   for (auto& level : levels_) {
-    if (level.pub_.getNumSubscribers() > 0) {
-      level.points_->header.stamp = stamp_.nsec;
-      level.points_->header.frame_id = level.points_->header.frame_id;
-      level.tf_.stamp_ = stamp_;
-      broadcaster_.sendTransform(level.tf_);
-      level.pub_.publish(*level.points_);
+    level.tf_.stamp_ = stamp_;
+    broadcaster_.sendTransform(level.tf_);
+    if (level.b_dirty_ && level.pub_.getNumSubscribers() > 0) {
+      // Gathered from the shared buffer only when the level changed
+      PointCloud points;
+      points.header.frame_id = level.tf_.child_frame_id_;
+      points.header.stamp = stamp_.nsec;
+      for (const gtsam::Key& key : level.keys_) {
+        const auto& range = level_key_ranges_.at(key);
+        points.insert(points.end(),
+                      level_points_->begin() + range.first,
+                      level_points_->begin() + range.second);
+      }
+      level.pub_.publish(points);
+      level.b_dirty_ = false;
     }
   }
+  PublishCones();
+  UpdateMemoryAccounts();
+}
+
+void PointCloudVisualizer::UpdateMemoryAccounts() {
+  auto cloud_bytes = [](const PointCloud::ConstPtr& cloud) -> size_t {
+    return cloud == nullptr
+        ? 0
+        : sizeof(PointCloud) + cloud->points.capacity() * sizeof(Point);
+  };
+  size_t bytes = cloud_bytes(level_points_) + cloud_bytes(incremental_points_);
+  for (const auto& scan : key_scans_to_update_)
+    bytes += cloud_bytes(scan.second);
+  // Base level of detail only, the coarser ones add a fraction of it
+  for (const auto& map : robots_maps_)
+    bytes += map.second.NumPoints() * sizeof(Point);
+  clouds_account_.Set(bytes);
+  pose_graph_.UpdateMemoryAccounts();
+}
+
+void PointCloudVisualizer::PublishDirtyTiles(
+    unsigned char robot_chr, const std::vector<TiledMap::TileIndex>& tiles) {
+  // Late subscribers get the rest of the map from the map_view service
+  const ros::Publisher& pub = publishers_robots_map_tiles_.at(robot_chr);
+  if (pub.getNumSubscribers() == 0)
+    return;
+  TiledMap& map = robots_maps_.at(robot_chr);
+  for (const auto& index : tiles) {
+    pub.publish(GetTileMsg(map, index, map_tiles_lod_));
+  }
+}
+
+pose_graph_msgs::MapTile
+PointCloudVisualizer::GetTileMsg(TiledMap& map,
+                                 const TiledMap::TileIndex& index,
+                                 int lod) const {
+  pose_graph_msgs::MapTile tile;
+  tile.header.stamp = stamp_;
+  tile.header.frame_id = fixed_frame_id_;
+  tile.x = index.x;
+  tile.y = index.y;
+  tile.z = index.z;
+  tile.tile_size = map.TileSize();
+  tile.lod = std::min(std::max(lod, 0), map.NumLods() - 1);
+  tile.version = map.GetTileVersion(index);
+  const TiledMap::CloudMsgConstPtr cloud = map.GetTileMsg(index, lod);
+  if (cloud) {
+    tile.cloud = *cloud;
+  }
+  tile.cloud.header = tile.header;
+  return tile;
+}
+
+bool PointCloudVisualizer::MapViewCallback(
+    pose_graph_msgs::MapView::Request& request,
+    pose_graph_msgs::MapView::Response& response) {
+  const gtsam::Pose3 viewpoint = lamp_utils::ToGtsam(request.viewpoint);
+  const Eigen::Vector3d origin = viewpoint.translation();
+  const Eigen::Vector3d direction = viewpoint.rotation().matrix().col(0);
+
+  for (auto& robot_map : robots_maps_) {
+    if (!request.robot.empty() &&
+        (lamp_utils::ROBOT_PREFIXES.count(request.robot) == 0 ||
+         lamp_utils::ROBOT_PREFIXES.at(request.robot) != robot_map.first))
+      continue;
+    TiledMap& map = robot_map.second;
+    const int lod = map.LodForResolution(request.resolution);
+    for (const auto& index : map.GetTilesInView(
+             origin, direction, request.half_fov, request.max_range)) {
+      response.tiles.push_back(GetTileMsg(map, index, lod));
+    }
+  }
+  return true;
 }
 
 bool PointCloudVisualizer::GetTransformedPointCloudWorld(
@@ -311,7 +464,15 @@ bool PointCloudVisualizer::GetTransformedPointCloudWorld(
     return false;
   }
 
-  const gu::Transform3 pose = lamp_utils::ToGu(pose_graph_.GetPose(key));
+  const Eigen::Matrix4d b2w = GetScanTransform(pose_graph_.GetPose(key));
+  lamp_utils::TransformPointCloud(*pose_graph_.keyed_scans[key], b2w, points);
+
+  return true;
+}
+
+Eigen::Matrix4d
+PointCloudVisualizer::GetScanTransform(const gtsam::Pose3& pose3) const {
+  const gu::Transform3 pose = lamp_utils::ToGu(pose3);
   Eigen::Matrix4d b2w;
   b2w.setZero();
   b2w.block(0, 0, 3, 3) = pose.rotation.Eigen();
@@ -321,10 +482,42 @@ bool PointCloudVisualizer::GetTransformedPointCloudWorld(
   Eigen::Quaterniond quat(pose.rotation.Eigen());
   quat.normalize();
   b2w.block(0, 0, 3, 3) = quat.matrix();
+  return b2w;
+}
 
-  pcl::transformPointCloud(*pose_graph_.keyed_scans[key], *points, b2w);
+void PointCloudVisualizer::ReprojectMovedKeys(
+    const std::vector<std::pair<gtsam::Key, gtsam::Pose3>>& poses) {
+  size_t num_moved = 0;
+  for (const auto& keyed_pose : poses) {
+    auto rendered = rendered_poses_.find(keyed_pose.first);
+    if (rendered == rendered_poses_.end())
+      continue;
+    const gtsam::Pose3 moved = rendered->second.between(keyed_pose.second);
+    if (moved.translation().norm() < reprojection_translation_threshold_ &&
+        gtsam::Rot3::Logmap(moved.rotation()).norm() <
+            reprojection_rotation_threshold_)
+      continue;
 
-  return true;
+    // From the world points of the old pose to the ones of the new pose
+    const Eigen::Matrix4d delta = GetScanTransform(keyed_pose.second) *
+        GetScanTransform(rendered->second).inverse();
+    const gtsam::Symbol key(keyed_pose.first);
+    auto map = robots_maps_.find(key.chr());
+    if (map != robots_maps_.end()) {
+      map->second.MoveKey(key, delta);
+    }
+    auto range = level_key_ranges_.find(key);
+    if (range != level_key_ranges_.end()) {
+      Point* begin = &level_points_->points[range->second.first];
+      lamp_utils::TransformPoints(
+          begin, range->second.second - range->second.first, delta, begin);
+      levels_[key_levels_.at(key)].b_dirty_ = true;
+    }
+    rendered->second = keyed_pose.second;
+    num_moved++;
+  }
+  ROS_DEBUG_STREAM("Reprojected " << num_moved << " of " << poses.size()
+                                  << " keys");
 }
 int id = 0;
 
@@ -474,6 +667,83 @@ bool PointCloudVisualizer::IsPointInsideTheNegativeCone(
   return (orth_distance <= cone_radius + offset);
 }
 
+std::vector<uint64_t>
+PointCloudVisualizer::CullNodesInCone(const NodePositions& nodes,
+                                      const gu::Transform3& current_pose,
+                                      bool b_negative,
+                                      double offset /*= 0.0*/) const {
+  return nodes.CullCone(Eigen::Vector3d(current_pose.translation.X(),
+                                        current_pose.translation.Y(),
+                                        current_pose.translation.Z()),
+                        b_negative,
+                        height_min_,
+                        base_height,
+                        base_radius,
+                        offset);
+}
+
+void PointCloudVisualizer::PublishCones() {
+  const bool b_cones = cone_pub_.getNumSubscribers() > 0;
+  const bool b_crossed = crossed_nodes_pub_.getNumSubscribers() > 0;
+  if (!b_cones && !b_crossed)
+    return;
+
+  visualization_msgs::MarkerArray cones;
+  visualization_msgs::Marker crossed;
+  crossed.header.stamp = ros::Time::now();
+  crossed.header.frame_id = fixed_frame_id_;
+  crossed.ns = "crossed_nodes";
+  crossed.action = visualization_msgs::Marker::ADD;
+  crossed.type = visualization_msgs::Marker::SPHERE_LIST;
+  crossed.pose.orientation.w = 1.0;
+  crossed.color.a = 0.5;
+  crossed.color.r = 1.0;
+  crossed.color.g = 1.0;
+  crossed.scale.x = 1.0;
+  crossed.scale.y = 1.0;
+  crossed.scale.z = 1.0;
+  for (const auto& robot_nodes : robots_nodes_) {
+    const NodePositions& nodes = robot_nodes.second;
+    if (nodes.Size() == 0)
+      continue;
+    const Eigen::Vector3d latest = nodes.PositionAt(nodes.Size() - 1);
+    gu::Transform3 current_pose = gu::Transform3::Identity();
+    current_pose.translation =
+        gu::Vector3Base<double>(latest.x(), latest.y(), latest.z());
+    if (b_cones) {
+      geometry_msgs::Pose pose;
+      pose.position.x = latest.x();
+      pose.position.y = latest.y();
+      pose.position.z = latest.z();
+      cones.markers.push_back(CreateConeMarker(pose, base_height, base_radius));
+      cones.markers.back().id = robot_nodes.first;
+    }
+    if (!b_crossed)
+      continue;
+    // Nodes of the trajectory above or below the latest one
+    const std::vector<uint64_t> above =
+        CullNodesInCone(nodes, current_pose, false);
+    const std::vector<uint64_t> below =
+        CullNodesInCone(nodes, current_pose, true);
+    for (size_t i = 0; i < nodes.Size(); i++) {
+      if (!NodePositions::IsSet(above, i) && !NodePositions::IsSet(below, i))
+        continue;
+      const Eigen::Vector3d position = nodes.PositionAt(i);
+      geometry_msgs::Point p;
+      p.x = position.x();
+      p.y = position.y();
+      p.z = position.z();
+      crossed.points.push_back(p);
+    }
+  }
+  if (b_cones) {
+    cone_pub_.publish(cones);
+  }
+  if (b_crossed) {
+    crossed_nodes_pub_.publish(crossed);
+  }
+}
+
 double CalculateEuclideanDistance(const gu::Transform3& current_pose,
                                   const gu::Transform3& node) {
   double dx2 = std::pow(current_pose.translation.X() - node.translation.X(), 2);
@@ -528,11 +798,9 @@ PointCloudVisualizer::SelectLevelForNode2(const gtsam::Symbol current_key) {
       ROS_DEBUG_STREAM("Level "
                       << i << " has " << levels_[i].nodes_.size()
                       << " init nodes: " << levels_[i].init_nodes_.size());
-      ROS_DEBUG_STREAM("Distance: "
-                      << levels_[i].MinDistanceFromNodes(current_pose)
-                      << " for " << i);
-      potential_levels.emplace_back(std::pair<double, size_t>(
-          levels_[i].MinDistanceFromNodes(current_pose), i));
+      const double distance = levels_[i].HeightDistanceFromNodes(current_pose);
+      ROS_DEBUG_STREAM("Distance: " << distance << " for " << i);
+      potential_levels.emplace_back(std::pair<double, size_t>(distance, i));
     }
   }
 
@@ -567,35 +835,38 @@ PointCloudVisualizer::SelectLevelForNode2(const gtsam::Symbol current_key) {
 }
 
 void PointCloudVisualizer::RefreshPlanes() {
-  std::vector<size_t> to_remove;
-  for (size_t i = 0; i < levels_.size(); i++) {
-    if (levels_[i].AngleWithXYPlaneRad() > 0.75) {
-      ROS_DEBUG_STREAM("REMOVING " << i << " DUE TO ANGLE");
-      to_remove.push_back(i);
-      continue;
-    }
-    if (std::find(to_remove.begin(), to_remove.end(), i) == to_remove.end()) {
-      for (size_t j = i + 1; j < levels_.size(); j++) {
-        if (std::abs(levels_[i].coefficients_.values[3] -
-                     levels_[j].coefficients_.values[3]) < 0.5f) {
-          to_remove.push_back(j);
-          ROS_DEBUG_STREAM("REMOVING " << j << " DUE TO being close");
-          levels_[i].nodes_.insert(levels_[i].nodes_.end(),
-                                   levels_[j].nodes_.begin(),
-                                   levels_[j].nodes_.end());
-          *levels_[i].points_ += *levels_[j].points_;
-          levels_[i].EstimatePlane();
-        }
-      }
+  // Tilted planes are not floors
+  levels_.erase(std::remove_if(levels_.begin(),
+                               levels_.end(),
+                               [](const Level& level) {
+                                 return level.AngleWithXYPlaneRad() > 0.75;
+                               }),
+                levels_.end());
+  std::sort(levels_.begin(), levels_.end(), [](const Level& x, const Level& y) {
+    return (x.coefficients_.values[3] < y.coefficients_.values[3]);
+  });
+
+  // Sorted by offset, so only neighbours can be close enough to merge
+  size_t last = 0;
+  for (size_t i = 1; i < levels_.size(); i++) {
+    if (std::abs(levels_[last].coefficients_.values[3] -
+                 levels_[i].coefficients_.values[3]) < 0.5f) {
+      ROS_DEBUG_STREAM("MERGING " << i << " INTO " << last);
+      levels_[last].Merge(levels_[i]);
+    } else if (++last != i) {
+      levels_[last] = std::move(levels_[i]);
     }
   }
+  if (!levels_.empty()) {
+    levels_.resize(last + 1);
+  }
 
-  for (int i = to_remove.size() - 1; i >= 0; i--) {
-    levels_.erase(levels_.begin() + to_remove[i]);
+  key_levels_.clear();
+  for (size_t i = 0; i < levels_.size(); i++) {
+    for (const gtsam::Key& key : levels_[i].keys_) {
+      key_levels_[key] = i;
+    }
   }
-  std::sort(levels_.begin(), levels_.end(), [](const Level& x, const Level& y) {
-    return (x.coefficients_.values[3] < y.coefficients_.values[3]);
-  });
 }
 
 void PointCloudVisualizer::AddPointCloudToCorrespondingLevel2(
@@ -608,8 +879,15 @@ void PointCloudVisualizer::AddPointCloudToCorrespondingLevel2(
 
   size_t selected_level = SelectLevelForNode2(key);
 
-  if (levels_[selected_level].init_nodes_.size() > 15) {
-    *levels_[selected_level].points_ += *pc;
+  if (levels_[selected_level].init_nodes_.size() > 15 &&
+      level_key_ranges_.count(key) == 0) {
+    Level& level = levels_[selected_level];
+    const size_t begin = level_points_->size();
+    *level_points_ += *pc;
+    level_key_ranges_[key] = std::make_pair(begin, level_points_->size());
+    key_levels_[key] = selected_level;
+    level.keys_.push_back(key);
+    level.b_dirty_ = true;
   }
 
   if (levels_[selected_level].nodes_.size() != 0) {
@@ -634,10 +912,6 @@ void PointCloudVisualizer::CreateNewLevel() {
       ros::Time(0),
       fixed_frame_id_,
       name);
-  PointCloud::Ptr pc_level{new PointCloud};
-  pc_level->reserve(
-      1000000); // to have capacity enough to not allocate memory all the time
-  pc_level->header.frame_id = name;
 
   pcl::ModelCoefficients coeff;
 
@@ -651,70 +925,34 @@ void PointCloudVisualizer::CreateNewLevel() {
   std::vector<gu::Transform3> init_nodes;
   init_nodes.reserve(10);
   ros::Publisher pub =
-      nh_.advertise<PointCloud>("multilevel_map/" + name, 1, false);
-  levels_.emplace_back(
-      Level{transform, pc_level, pub, nodes, init_nodes, coeff, false});
+      nh_.advertise<PointCloud>("multilevel_map/" + name, 1, true);
+  levels_.emplace_back(Level{transform, pub, nodes, init_nodes, coeff, false});
+  levels_.back().moments_.setZero();
 }
 
 void PointCloudVisualizer::OptimizerUpdateCallback(
     const pose_graph_msgs::PoseGraphConstPtr& msg) {
-  //  pose_graph_.UpdateFromMsg(msg);
-  //  ROS_INFO_STREAM("OptimizerUpdateCallback!");
-  //  for (auto& robot_point_cloud : robots_point_clouds_) {
-  //    robot_point_cloud.second->clear();
-  //  }
-
-  //  for (auto& level : levels_) {
-  //    level.nodes_.clear();
-  //    level.points_->clear();
-  //  }
-
-  //  for (const auto& keyed_pose : pose_graph_.GetValues()) {
-  //    const gtsam::Symbol key = keyed_pose.key;
-
-  //    // Append the world-frame point cloud to the output.
-  //    PointCloud::Ptr temp_cloud(new PointCloud);
-  //    GetTransformedPointCloudWorld(key, temp_cloud.get());
-  //    if (robots_point_clouds_.find(key.chr()) !=
-  //    robots_point_clouds_.end())
-  //    {
-  //      *robots_point_clouds_.at(key.chr()) += *temp_cloud;
-  //    }
-  //  }
-  //  SegmentLevelsBasedOnGraph();
-  //  VisualizePointCloud();
+  // Only the keys that moved are transformed again, in place
+  std::vector<std::pair<gtsam::Key, gtsam::Pose3>> poses;
+  poses.reserve(msg->nodes.size());
+  for (const auto& node : msg->nodes) {
+    poses.emplace_back(node.key, lamp_utils::ToGtsam(node.pose));
+  }
+  ReprojectMovedKeys(poses);
+  UpdateNodePositions(*msg);
+  VisualizePointCloud();
 }
 
 void PointCloudVisualizer::Level::EstimatePlane() {
   if (nodes_.size() == 0)
     return;
-  if (nodes_.size() % 5 != 0)
-    return;
-  ROS_DEBUG_STREAM("ESTIMATING!");
-  Eigen::MatrixXd A(nodes_.size(), 4);
-  ROS_DEBUG_STREAM("ESTIMATING!");
-  for (size_t i = 0; i < nodes_.size(); i++) {
-    A(i, 0) = nodes_[i].translation.X();
-    A(i, 1) = nodes_[i].translation.Y();
-    A(i, 2) = nodes_[i].translation.Z();
-    A(i, 3) = 1.0;
-  }
-  ROS_DEBUG_STREAM("ESTIMATING!");
-  Eigen::JacobiSVD<Eigen::MatrixXd> svd(
-      A, Eigen::ComputeThinU | Eigen::ComputeThinV);
-
-  ROS_DEBUG_STREAM("SVD: \n " << svd.matrixV().col(3));
-  coefficients_.values[0] = svd.matrixV().col(3)(0);
-  coefficients_.values[1] = svd.matrixV().col(3)(1);
-  coefficients_.values[2] = svd.matrixV().col(3)(2);
-  coefficients_.values[3] = svd.matrixV().col(3)(3);
-
-  auto norm = std::sqrt(std::pow(coefficients_.values[0], 2) +
-                        std::pow(coefficients_.values[1], 2) +
-                        std::pow(coefficients_.values[2], 2));
-
+  // Least squares plane through the nodes, from their running moments
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d> solver(
+      Eigen::Matrix4d(moments_));
+  const Eigen::Vector4d plane = solver.eigenvectors().col(0);
+  const double norm = plane.head<3>().norm();
   for (size_t i = 0; i < coefficients_.values.size(); i++) {
-    coefficients_.values[i] = coefficients_.values[i] / norm;
+    coefficients_.values[i] = plane(i) / norm;
   }
 
   ROS_DEBUG_STREAM("Estimate plane: " << coefficients_.values[0] << " "
@@ -725,35 +963,61 @@ void PointCloudVisualizer::Level::EstimatePlane() {
 
 void PointCloudVisualizer::Level::UpdateNodeInTheLevel(
     const gu::Transform3& node) {
+  const Eigen::Vector4d p(
+      node.translation.X(), node.translation.Y(), node.translation.Z(), 1.0);
+  bool b_added = false;
   if (init_nodes_.size() < 20) {
     init_nodes_.push_back(node);
+    b_added = true;
   }
   if (init_nodes_.size() >= 15) {
     nodes_.push_back(node);
-    bounding_box_.Update(Eigen::Vector3d(
-        node.translation.X(), node.translation.Y(), node.translation.Z()));
+    moments_ += p * p.transpose();
+    bounding_box_.Update(p.head<3>());
+    b_added = true;
+  }
+  if (b_added) {
+    height_histogram_[HeightBin(p(2))]++;
   }
 }
 
-double PointCloudVisualizer::Level::MinDistanceFromNodes(
+double PointCloudVisualizer::Level::HeightDistanceFromNodes(
     const gu::Transform3& node) const {
+  if (height_histogram_.empty())
+    return std::numeric_limits<double>::infinity();
+  const double z = node.translation.Z();
+  const int bin = HeightBin(z);
+  // Distance from z to the span of a bin, 0 inside it
+  auto distance = [z](int b) {
+    const double low = b * kHeightBinSize;
+    return std::max(std::max(low - z, z - (low + kHeightBinSize)), 0.0);
+  };
   double min_distance = std::numeric_limits<double>::infinity();
-  double distance = 0.0;
-  for (size_t k = 0; k < init_nodes_.size(); ++k) {
-    distance = CalculateEuclideanDistance(node, init_nodes_[k]);
-    if (distance < min_distance) {
-      min_distance = distance;
-    }
+  auto above = height_histogram_.lower_bound(bin);
+  if (above != height_histogram_.end()) {
+    min_distance = distance(above->first);
   }
-  for (size_t k = 0; k < nodes_.size(); ++k) {
-    distance = CalculateEuclideanDistance(node, nodes_[k]);
-    if (distance < min_distance) {
-      min_distance = distance;
-    }
+  if (above != height_histogram_.begin()) {
+    min_distance = std::min(min_distance, distance(std::prev(above)->first));
   }
   return min_distance;
 }
 
+void PointCloudVisualizer::Level::Merge(const Level& other) {
+  nodes_.insert(nodes_.end(), other.nodes_.begin(), other.nodes_.end());
+  keys_.insert(keys_.end(), other.keys_.begin(), other.keys_.end());
+  moments_ += other.moments_;
+  for (const auto& bin : other.height_histogram_) {
+    height_histogram_[bin.first] += bin.second;
+  }
+  if (!other.nodes_.empty()) {
+    bounding_box_.Update(other.bounding_box_.min_pt);
+    bounding_box_.Update(other.bounding_box_.max_pt);
+  }
+  b_dirty_ = true;
+  EstimatePlane();
+}
+
 double PointCloudVisualizer::Level::AngleWithXYPlaneRad() const {
   Eigen::Vector3d plane_normal{static_cast<double>(coefficients_.values[0]),
                                static_cast<double>(coefficients_.values[1]),
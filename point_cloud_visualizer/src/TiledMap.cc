@@ -0,0 +1,257 @@
+/*
+TiledMap.cc
+Point cloud map split into fixed size tiles, each kept at several levels of
+detail and serialized only when it changes
+*/
+
+#include <point_cloud_visualizer/TiledMap.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <lamp_utils/PointCloudConversions.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+TiledMap::TiledMap()
+  : tile_size_(20.0),
+    base_leaf_(0.1),
+    num_lods_(4),
+    num_points_(0),
+    num_dirty_(0),
+    insert_serial_(0) {}
+
+void TiledMap::SetParams(double tile_size, double base_leaf, int num_lods) {
+  tile_size_ = tile_size;
+  base_leaf_ = base_leaf;
+  num_lods_ = std::max(num_lods, 1);
+  // Tiles of the old size are no longer valid
+  Clear();
+}
+
+void TiledMap::Insert(const PointCloud& points) {
+  InsertPoints(points, nullptr);
+}
+
+void TiledMap::Insert(const gtsam::Key& key, const PointCloud& points) {
+  InsertPoints(points, &key_slices_[key]);
+}
+
+void TiledMap::Touch(Tile& tile) {
+  // Once per insertion or move
+  if (tile.last_insert == insert_serial_)
+    return;
+  tile.last_insert = insert_serial_;
+  tile.version++;
+  tile.lods.clear();
+  tile.msgs.clear();
+  if (!tile.b_dirty) {
+    tile.b_dirty = true;
+    num_dirty_++;
+  }
+}
+
+void TiledMap::InsertPoints(const PointCloud& points,
+                            std::vector<Slice>* slices) {
+  const double inverse_tile = 1.0 / tile_size_;
+  insert_serial_++;
+  // Slice of each tile in this insertion, the points of a tile are appended
+  // contiguously
+  std::unordered_map<TileIndex, size_t, lamp_utils::VoxelIndexHash> slice_of;
+  for (const Point& p : points.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    const TileIndex index = lamp_utils::ToVoxelIndex(p, inverse_tile);
+    Tile& tile = tiles_[index];
+    if (!tile.points) {
+      tile.points.reset(new PointCloud);
+    }
+    Touch(tile);
+    if (slices != nullptr) {
+      auto slice = slice_of.find(index);
+      if (slice == slice_of.end()) {
+        slice = slice_of.emplace(index, slices->size()).first;
+        const size_t size = tile.points->size();
+        slices->push_back(Slice{index, size, size});
+      }
+      (*slices)[slice->second].end++;
+    }
+    tile.points->push_back(p);
+    const Eigen::Vector3f position(p.x, p.y, p.z);
+    tile.min_pt = tile.min_pt.cwiseMin(position);
+    tile.max_pt = tile.max_pt.cwiseMax(position);
+    num_points_++;
+  }
+}
+
+bool TiledMap::MoveKey(const gtsam::Key& key,
+                       const Eigen::Matrix4d& transform) {
+  auto slices = key_slices_.find(key);
+  if (slices == key_slices_.end())
+    return false;
+  insert_serial_++;
+  for (const Slice& slice : slices->second) {
+    Tile& tile = tiles_.at(slice.tile);
+    Point* begin = &tile.points->points[slice.begin];
+    lamp_utils::TransformPoints(
+        begin, slice.end - slice.begin, transform, begin);
+    for (size_t i = slice.begin; i < slice.end; i++) {
+      const Point& p = tile.points->points[i];
+      const Eigen::Vector3f position(p.x, p.y, p.z);
+      tile.min_pt = tile.min_pt.cwiseMin(position);
+      tile.max_pt = tile.max_pt.cwiseMax(position);
+    }
+    Touch(tile);
+  }
+  return true;
+}
+
+void TiledMap::Clear() {
+  tiles_.clear();
+  key_slices_.clear();
+  num_points_ = 0;
+  num_dirty_ = 0;
+}
+
+std::vector<TiledMap::TileIndex> TiledMap::TakeDirtyTiles() {
+  std::vector<TileIndex> dirty;
+  dirty.reserve(num_dirty_);
+  for (auto& tile : tiles_) {
+    if (!tile.second.b_dirty)
+      continue;
+    tile.second.b_dirty = false;
+    dirty.push_back(tile.first);
+  }
+  num_dirty_ = 0;
+  return dirty;
+}
+
+bool TiledMap::HasDirtyTiles() const {
+  return num_dirty_ > 0;
+}
+
+std::vector<TiledMap::TileIndex> TiledMap::GetTiles() const {
+  std::vector<TileIndex> indices;
+  indices.reserve(tiles_.size());
+  for (const auto& tile : tiles_) {
+    indices.push_back(tile.first);
+  }
+  return indices;
+}
+
+std::vector<TiledMap::TileIndex>
+TiledMap::GetTilesInView(const Eigen::Vector3d& origin,
+                         const Eigen::Vector3d& direction,
+                         double half_fov,
+                         double max_range) const {
+  std::vector<TileIndex> indices;
+  const Eigen::Vector3d axis = direction.normalized();
+  // Tiles are tested by the bounding sphere of their points
+  for (const auto& tile : tiles_) {
+    if (tile.second.points->empty())
+      continue;
+    const Eigen::Vector3d center =
+        0.5 * (tile.second.min_pt + tile.second.max_pt).cast<double>();
+    const double radius =
+        0.5 * (tile.second.max_pt - tile.second.min_pt).cast<double>().norm();
+    const Eigen::Vector3d v = center - origin;
+    const double distance = v.norm();
+    if (max_range > 0.0 && distance - radius > max_range)
+      continue;
+    if (half_fov < M_PI && distance > radius) {
+      // Angle to the axis, less the angle the sphere covers
+      const double along = v.dot(axis);
+      const double across = (v - along * axis).norm();
+      if (std::atan2(across, along) - std::asin(radius / distance) > half_fov)
+        continue;
+    }
+    indices.push_back(tile.first);
+  }
+  return indices;
+}
+
+int TiledMap::LodForResolution(double resolution) const {
+  int lod = 0;
+  double leaf = base_leaf_;
+  while (lod + 1 < num_lods_ && leaf <= resolution) {
+    lod++;
+    leaf *= 2.0;
+  }
+  return lod;
+}
+
+TiledMap::Tile* TiledMap::FindTile(const TileIndex& index) {
+  auto it = tiles_.find(index);
+  return it == tiles_.end() ? nullptr : &it->second;
+}
+
+PointCloudConstPtr TiledMap::GetTileCloud(const TileIndex& index, int lod) {
+  Tile* tile = FindTile(index);
+  if (tile == nullptr)
+    return nullptr;
+  lod = std::min(std::max(lod, 0), num_lods_ - 1);
+  if (lod == 0)
+    return tile->points;
+
+  tile->lods.resize(num_lods_);
+  if (!tile->lods[lod]) {
+    PointCloud::Ptr downsampled(new PointCloud);
+    lamp_utils::VoxelDownsample(
+        *tile->points, base_leaf_ * std::pow(2.0, lod - 1), downsampled.get());
+    tile->lods[lod] = downsampled;
+  }
+  return tile->lods[lod];
+}
+
+TiledMap::CloudMsgConstPtr TiledMap::GetTileMsg(const TileIndex& index,
+                                                int lod) {
+  const PointCloudConstPtr cloud = GetTileCloud(index, lod);
+  if (!cloud)
+    return nullptr;
+  Tile& tile = *FindTile(index);
+  lod = std::min(std::max(lod, 0), num_lods_ - 1);
+  tile.msgs.resize(num_lods_);
+  if (!tile.msgs[lod]) {
+    std::shared_ptr<sensor_msgs::PointCloud2> msg(new sensor_msgs::PointCloud2);
+    lamp_utils::ToRosMsg(*cloud, msg.get());
+    tile.msgs[lod] = msg;
+  }
+  return tile.msgs[lod];
+}
+
+unsigned int TiledMap::GetTileVersion(const TileIndex& index) const {
+  auto it = tiles_.find(index);
+  return it == tiles_.end() ? 0 : it->second.version;
+}
+
+void TiledMap::GetMapMsg(int lod, sensor_msgs::PointCloud2* msg) {
+  std::vector<CloudMsgConstPtr> parts;
+  parts.reserve(tiles_.size());
+  size_t num_bytes = 0;
+  for (const auto& tile : tiles_) {
+    CloudMsgConstPtr part = GetTileMsg(tile.first, lod);
+    if (!part || part->width * part->height == 0)
+      continue;
+    num_bytes += part->data.size();
+    parts.push_back(part);
+  }
+
+  if (parts.empty()) {
+    lamp_utils::ToRosMsg(PointCloud(), msg);
+    return;
+  }
+  // Same point type everywhere, so the tiles are appended as they are
+  msg->fields = parts.front()->fields;
+  msg->is_bigendian = parts.front()->is_bigendian;
+  msg->point_step = parts.front()->point_step;
+  msg->height = 1;
+  msg->width = 0;
+  msg->is_dense = true;
+  msg->data.clear();
+  msg->data.reserve(num_bytes);
+  for (const auto& part : parts) {
+    msg->data.insert(msg->data.end(), part->data.begin(), part->data.end());
+    msg->width += part->width * part->height;
+    msg->is_dense = msg->is_dense && part->is_dense;
+  }
+  msg->row_step = msg->width * msg->point_step;
+}
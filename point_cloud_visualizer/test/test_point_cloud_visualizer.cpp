@@ -5,7 +5,9 @@
 
 #include <gtest/gtest.h>
 
+#include "point_cloud_visualizer/NodePositions.h"
 #include "point_cloud_visualizer/PointCloudVisualizer.h"
+#include "point_cloud_visualizer/TiledMap.h"
 
 class TestPointCloudVisualizer : public ::testing::Test {
 protected:
@@ -25,6 +27,11 @@ protected:
                                     const gu::Transform3 pose) {
     return pc_vis_.IsPointInsideTheNegativeCone(current_pose, pose);
   }
+  std::vector<uint64_t> cullNodesInCone(const NodePositions& nodes,
+                                        const gu::Transform3& current_pose,
+                                        bool b_negative) {
+    return pc_vis_.CullNodesInCone(nodes, current_pose, b_negative);
+  }
 };
 
 // TEST_F(TestPointCloudVisualizer, TestSetInitialPositionNoParam) {
@@ -69,6 +76,124 @@ TEST_F(TestPointCloudVisualizer, TestNegative) {
   }
 }
 
+TEST(TestTiledMap, DirtyTilesAndViews) {
+  TiledMap map;
+  map.SetParams(10.0, 0.5, 3);
+  PointCloud points;
+  for (int i = 0; i < 100; ++i) {
+    Point p;
+    p.x = 0.01 * i;
+    p.y = 0.0;
+    p.z = 0.0;
+    points.push_back(p);
+  }
+  Point far;
+  far.x = -25.0;
+  far.y = 0.0;
+  far.z = 0.0;
+  points.push_back(far);
+  map.Insert(points);
+  EXPECT_EQ(2u, map.NumTiles());
+  EXPECT_EQ(101u, map.NumPoints());
+  EXPECT_EQ(2u, map.TakeDirtyTiles().size());
+  EXPECT_FALSE(map.HasDirtyTiles());
+
+  // Only the changed tile is dirty again
+  PointCloud more;
+  more.push_back(far);
+  map.Insert(more);
+  const std::vector<TiledMap::TileIndex> dirty = map.TakeDirtyTiles();
+  ASSERT_EQ(1u, dirty.size());
+  EXPECT_EQ(-3, dirty[0].x);
+  EXPECT_EQ(2u, map.GetTileVersion(dirty[0]));
+
+  // Looking along +x from behind the first tile does not see the far one
+  EXPECT_EQ(1u,
+            map.GetTilesInView(Eigen::Vector3d(-1, 0, 0),
+                               Eigen::Vector3d(1, 0, 0),
+                               0.3,
+                               0.0)
+                .size());
+  EXPECT_EQ(2u,
+            map.GetTilesInView(Eigen::Vector3d(-1, 0, 0),
+                               Eigen::Vector3d(1, 0, 0),
+                               M_PI,
+                               0.0)
+                .size());
+
+  // Coarser levels downsample the tile
+  EXPECT_EQ(0, map.LodForResolution(0.0));
+  EXPECT_EQ(2, map.LodForResolution(2.0));
+  const TiledMap::TileIndex near{0, 0, 0};
+  EXPECT_EQ(100u, map.GetTileCloud(near, 0)->size());
+  EXPECT_EQ(2u, map.GetTileCloud(near, 1)->size());
+}
+
+TEST(TestTiledMap, MoveKeyInPlace) {
+  TiledMap map;
+  map.SetParams(10.0, 0.5, 3);
+  PointCloud points;
+  Point p;
+  p.x = 1.0;
+  p.y = 1.0;
+  p.z = 0.0;
+  points.push_back(p);
+  p.x = 12.0;
+  points.push_back(p);
+  map.Insert(7, points);
+  map.Insert(8, points);
+  map.TakeDirtyTiles();
+
+  Eigen::Matrix4d shift = Eigen::Matrix4d::Identity();
+  shift(2, 3) = 3.0;
+  EXPECT_TRUE(map.MoveKey(7, shift));
+  EXPECT_FALSE(map.MoveKey(9, shift));
+  EXPECT_EQ(2u, map.TakeDirtyTiles().size());
+
+  // The points of key 7 moved, the ones of key 8 did not
+  const TiledMap::TileIndex tile{0, 0, 0};
+  PointCloudConstPtr cloud = map.GetTileCloud(tile, 0);
+  ASSERT_EQ(2u, cloud->size());
+  EXPECT_NEAR(3.0, cloud->points[0].z, 1e-6);
+  EXPECT_NEAR(0.0, cloud->points[1].z, 1e-6);
+
+  // Moved points are still found by the views
+  EXPECT_EQ(2u,
+            map.GetTilesInView(Eigen::Vector3d(0, 0, 20),
+                               Eigen::Vector3d(0, 0, -1),
+                               0.8,
+                               0.0)
+                .size());
+}
+
+TEST_F(TestPointCloudVisualizer, CullNodesMatchesConeTests) {
+  gu::Transform3 current_pose = gu::Transform3::Identity();
+  current_pose.translation = gu::Vector3Base<double>(0.5, -0.5, 0.0);
+  NodePositions nodes;
+  std::vector<gu::Transform3> poses;
+  for (int i = -10; i < 10; ++i) {
+    for (int j = -10; j < 10; ++j) {
+      for (int k = -10; k < 10; ++k) {
+        gu::Transform3 pose = gu::Transform3::Identity();
+        pose.translation = gu::Vector3Base<double>(i, j, k);
+        nodes.Set(poses.size(), Eigen::Vector3d(i, j, k));
+        poses.push_back(pose);
+      }
+    }
+  }
+
+  const std::vector<uint64_t> above =
+      cullNodesInCone(nodes, current_pose, false);
+  const std::vector<uint64_t> below =
+      cullNodesInCone(nodes, current_pose, true);
+  for (size_t i = 0; i < poses.size(); ++i) {
+    EXPECT_EQ(isPointInsideTheCone(current_pose, poses[i]),
+              NodePositions::IsSet(above, i));
+    EXPECT_EQ(isPointInsideTheNegativeCone(current_pose, poses[i]),
+              NodePositions::IsSet(below, i));
+  }
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "PointCloudVisualizerTest");
@@ -52,6 +52,12 @@ class TwoPoseGraphMerge {
     pose_graph_msgs::PoseGraph GetMergedGraph();
     void PublishPoses();
 
+    // Caches the transform from the robot (world) frame to the merged
+    // (world2) frame, including the drift correction, at the latest node
+    void UpdatePoseCorrection();
+    // Robot pose in the merged frame, only uses the cached correction
+    geometry_msgs::Pose CorrectRobotPose(const geometry_msgs::Pose& pose) const;
+
     // Publishers
     ros::Publisher merged_graph_pub_;
     ros::Publisher rob_node_pose_pub_;
@@ -85,6 +91,9 @@ class TwoPoseGraphMerge {
     geometry_msgs::PoseStamped robot_pose_;
     geometry_msgs::PoseStamped merged_pose_;
 
+    // Robot frame to merged frame, refreshed when a graph is merged
+    gtsam::Pose3 pose_correction_;
+
     // Store latest robot graph
     pose_graph_msgs::PoseGraphConstPtr last_robot_graph_;
 
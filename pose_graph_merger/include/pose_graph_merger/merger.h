@@ -13,14 +13,16 @@
 
 #include <gtsam/inference/Symbol.h>
 
+#include <lamp_utils/FlatHashMap.h>
+#include <lamp_utils/MemoryAccounting.h>
+#include <lamp_utils/PoseGraph.h>
 #include <lamp_utils/PrefixHandling.h>
+#include <lamp_utils/TimeIndexedBuffer.h>
 
 #include <tf2/transform_datatypes.h>
 
 #include <gtsam/inference/Symbol.h>
 
-#include <lamp_utils/PrefixHandling.h>
-
 #include <string>
 
 #include <Eigen/Eigen>
@@ -38,6 +40,23 @@ public:
 
   void OnSlowGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg);
 
+  // Merges a slow (optimized) graph straight into graph, which plays the
+  // role of the fast graph. Optimized poses replace the graph values and
+  // nodes the optimizer has not seen are re-anchored on their predecessor.
+  // Returns the keys whose pose changed.
+  std::vector<gtsam::Key>
+  MergeIntoGraph(const pose_graph_msgs::PoseGraphConstPtr& msg,
+                 lamp_utils::PoseGraph* graph);
+
+  // Merges a batch of incremental (fast) robot graphs straight into graph,
+  // the up to date base station graph, with the rules of OnFastGraphMsg.
+  // Only the nodes and edges of the batch are visited and the graphs of each
+  // robot are merged together. Returns the keys of the nodes added or
+  // re-anchored.
+  std::vector<gtsam::Key>
+  MergeFastGraphs(const std::vector<pose_graph_msgs::PoseGraphConstPtr>& msgs,
+                  lamp_utils::PoseGraph* graph);
+
   void OnFastPoseMsg(const geometry_msgs::PoseStamped::ConstPtr& msg);
 
   void OnSlowPoseMsg(const geometry_msgs::PoseStamped::ConstPtr& msg);
@@ -56,9 +75,25 @@ public:
   pose_graph_msgs::PoseGraph GetCurrentGraph();
   void NormalizeNodeOrientation(pose_graph_msgs::PoseGraphNode & msg);
 
+  // Fast pose at stamp, interpolated between the poses around it. Outside
+  // the history the closest pose is returned
   geometry_utils::Transform3 GetPoseAtTime(const ros::Time& stamp);
 
+  // Keeps the fast poses of the last horizon seconds, in a ring of
+  // horizon * max_rate poses allocated once
+  void SetPoseHistory(double horizon, double max_rate);
+
 private:
+  // Merges the graphs of one robot into graph, see MergeFastGraphs
+  void MergeRobotGraphs(
+      const std::vector<pose_graph_msgs::PoseGraphConstPtr>& msgs,
+      lamp_utils::PoseGraph* graph,
+      std::vector<gtsam::Key>* merged_keys);
+
+  // True if graph already has nodes of the robot. robots_ is refreshed from
+  // the graph when the prefix is not known yet
+  bool IsRobotInGraph(char prefix, const lamp_utils::PoseGraph& graph);
+
   pose_graph_msgs::PoseGraph current_graph_;
   pose_graph_msgs::PoseGraphConstPtr lastSlow;
   geometry_utils::Transform3 current_pose_est_;
@@ -66,7 +101,9 @@ private:
   geometry_utils::Transform3 current_fast_pose_;
   geometry_utils::Transform3 fast_pose_at_slow_;
 
-  std::map<double, geometry_utils::Transform3> timestamped_poses_;
+  // Fast poses by time stamp, trimmed to the history horizon
+  lamp_utils::TimeIndexedBuffer<geometry_utils::Transform3> timestamped_poses_;
+  double pose_history_horizon_;
 
   bool b_received_first_fast_pose_;
   bool b_received_first_slow_pose_;
@@ -81,17 +118,54 @@ private:
   ros::Publisher mergedGraphPub;
   ros::Publisher mergedPosePub;
 
-  // unique edges stored in the graph, tracked by <key_from, key_to, type>
-  std::set< std::tuple<gtsam::Key, gtsam::Key, int> > unique_edges_;
+  // Identity of an edge in the merged graph
+  struct EdgeId {
+    gtsam::Key key_from{0};
+    gtsam::Key key_to{0};
+    int type{0};
+    EdgeId() {}
+    explicit EdgeId(const GraphEdge& edge)
+      : key_from(edge.key_from), key_to(edge.key_to), type(edge.type) {}
+    inline bool operator==(const EdgeId& other) const {
+      return key_from == other.key_from && key_to == other.key_to &&
+          type == other.type;
+    }
+  };
+  struct EdgeIdHash {
+    inline size_t operator()(const EdgeId& id) const {
+      return std::hash<gtsam::Key>()(id.key_from) * 31 +
+          std::hash<gtsam::Key>()(id.key_to) * 7 + id.type;
+    }
+  };
+
+  // unique edges stored in the graph, mapped to their index in the edges
+  // vector
+  lamp_utils::FlatHashMap<EdgeId, size_t, EdgeIdHash> unique_edges_;
 
   // Robots included in the merged graph, specified by prefix char
   std::set<char> robots_;
 
+  // Correction of the odometry (fast graph) poses of a robot onto the slow
+  // graph, taken at the newest node of the robot in the slow graph
+  struct RobotCorrection {
+    gtsam::Key last_optimized_key{0};
+    bool b_have_correction{false};
+    gtsam::Pose3 correction;
+  };
+
+  // Reset by each slow graph, the correction is taken from the fast graphs
+  // holding the last optimized node. Per robot prefix
+  std::map<char, RobotCorrection> robot_corrections_;
+
   // Storing map from key to the index in the nodes vector
-  std::map<long unsigned int, int> merged_graph_KeyToIndex_;
+  lamp_utils::FlatHashMap<gtsam::Key, size_t> merged_graph_KeyToIndex_;
 
   pose_graph_msgs::PoseGraph merged_graph_;
 
+  // Bytes of the graphs and indices held, set after each graph received
+  void UpdateMemoryAccount();
+  lamp_utils::MemoryAccount memory_account_{"merger.graphs"};
+
   // Test class fixtures
   friend class TestMerger;
 };
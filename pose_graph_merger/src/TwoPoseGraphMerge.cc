@@ -130,6 +130,7 @@ void TwoPoseGraphMerge::ProcessRobotGraph(const pose_graph_msgs::PoseGraphConstP
   robot_pose_.header.frame_id = this->world_fid_;
   merged_pose_ = GetLatestOdomPose(fused_graph, robot_prefix_);
   merged_pose_.header.frame_id = this->world2_fid_;
+  UpdatePoseCorrection();
 
   // Publish
   PublishPoses();
@@ -138,23 +139,28 @@ void TwoPoseGraphMerge::ProcessRobotGraph(const pose_graph_msgs::PoseGraphConstP
 }
 
 void TwoPoseGraphMerge::ProcessRobotPose(const geometry_msgs::PoseStampedConstPtr& msg) {
-  gtsam::Pose3 robot_pose = lamp_utils::ToGtsam(msg->pose);
-
-  gtsam::Pose3 robot_node_pose = lamp_utils::ToGtsam(robot_pose_.pose);
-  gtsam::Pose3 merged_node_pose = lamp_utils::ToGtsam(merged_pose_.pose);
-
-  gtsam::Pose3 delta = robot_node_pose.between(robot_pose);
-  gtsam::Pose3 new_pose = merged_node_pose.compose(delta);
-
-  // Convert to ROS to publish
+  // Runs at pose rate, the graphs are only merged when they arrive
   geometry_msgs::PoseStamped output;
-  output.pose = lamp_utils::GtsamToRosMsg(new_pose);
+  output.pose = CorrectRobotPose(msg->pose);
   output.header.frame_id = this->world2_fid_;
   output.header.stamp = msg->header.stamp;
 
   merged_pose_pub_.publish(output);
 }
 
+void TwoPoseGraphMerge::UpdatePoseCorrection() {
+  gtsam::Pose3 robot_node_pose = lamp_utils::ToGtsam(robot_pose_.pose);
+  gtsam::Pose3 merged_node_pose = lamp_utils::ToGtsam(merged_pose_.pose);
+
+  pose_correction_ = merged_node_pose.compose(robot_node_pose.inverse());
+}
+
+geometry_msgs::Pose
+TwoPoseGraphMerge::CorrectRobotPose(const geometry_msgs::Pose& pose) const {
+  return lamp_utils::GtsamToRosMsg(
+      pose_correction_.compose(lamp_utils::ToGtsam(pose)));
+}
+
 pose_graph_msgs::PoseGraph TwoPoseGraphMerge::GetMergedGraph(){
   return merger_.GetCurrentGraph();
 }
@@ -1,85 +1,89 @@
 #include <pose_graph_merger/merger.h>
 
+#include <lamp_utils/CommonFunctions.h>
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+
 namespace gu = geometry_utils;
 
+namespace {
+
+// Default fast pose history, seconds and poses per second
+const double kPoseHistoryHorizon = 10.0;
+const double kMaxFastPoseRate = 200.0;
+
+size_t GraphMsgBytes(const pose_graph_msgs::PoseGraph& graph) {
+  size_t bytes = graph.nodes.capacity() * sizeof(GraphNode) +
+      graph.edges.capacity() * sizeof(GraphEdge) +
+      graph.marginalized_keys.capacity() * sizeof(gtsam::Key);
+  for (const GraphNode& node : graph.nodes)
+    bytes += node.ID.capacity() + node.header.frame_id.capacity();
+  return bytes;
+}
+
+} // namespace
+
 Merger::Merger()
   : b_received_first_fast_pose_(false),
     b_received_first_slow_pose_(false),
     b_block_slow_pose_update(false),
-    lastSlow(nullptr) {}
-
-void Merger::InsertNewEdges(const pose_graph_msgs::PoseGraphConstPtr& msg) {
+    lastSlow(nullptr) {
+  SetPoseHistory(kPoseHistoryHorizon, kMaxFastPoseRate);
+}
 
-  if (msg->edges.size() == 0){
-    // No edges - nothing to add
-    return;
-  }
+void Merger::SetPoseHistory(double horizon, double max_rate) {
+  pose_history_horizon_ = horizon;
+  timestamped_poses_.SetCapacity(
+      std::max<size_t>(2, static_cast<size_t>(std::ceil(horizon * max_rate))));
+}
 
-  // New edges that we want to update with
-  std::map<std::tuple<gtsam::Key, gtsam::Key, int>,
-           pose_graph_msgs::PoseGraphEdge>
-      updated_artifact_edges;
+void Merger::UpdateMemoryAccount() {
+  size_t bytes = GraphMsgBytes(merged_graph_) + GraphMsgBytes(current_graph_);
+  if (lastSlow)
+    bytes += GraphMsgBytes(*lastSlow);
+  bytes += timestamped_poses_.StorageBytes();
+  bytes += unique_edges_.size() * (sizeof(EdgeId) + sizeof(size_t)) +
+      merged_graph_KeyToIndex_.size() * (sizeof(gtsam::Key) + sizeof(size_t));
+  memory_account_.Set(bytes);
+}
 
-  // Add new edges and skip existing edges
+void Merger::InsertNewEdges(const pose_graph_msgs::PoseGraphConstPtr& msg) {
+  // Add new edges and skip existing edges, except for artifact edges which
+  // are replaced in place
   for (const GraphEdge& edge : msg->edges) {
-    std::tuple<gtsam::Key, gtsam::Key, int> id =
-        std::make_tuple(edge.key_from, edge.key_to, edge.type);
-    if (IsEdgeNew(edge)){
+    auto stored =
+        unique_edges_.Insert(EdgeId(edge), merged_graph_.edges.size());
+    if (stored.second) {
       // Add to the merged graph
       merged_graph_.edges.push_back(edge);
-
-      // Add to stored set of edges
-      unique_edges_.insert(id);
     } else if (edge.type == pose_graph_msgs::PoseGraphEdge::ARTIFACT) {
       ROS_DEBUG_STREAM("\nMerger: Repeated artifact edge with key to "
                        << gtsam::DefaultKeyFormatter(edge.key_to));
-      updated_artifact_edges[id] = edge;
-    }
-  }
-
-  // Replace the existing artifact edges with updated_artifact_edges
-  pose_graph_msgs::PoseGraph new_graph;
-
-  auto e = merged_graph_.edges.begin();
-  while (e != merged_graph_.edges.end()) {
-    auto edge_itr = *e;
-    if (edge_itr.type == pose_graph_msgs::PoseGraphEdge::ARTIFACT) {
-      std::tuple<gtsam::Key, gtsam::Key, int> id =
-          std::make_tuple(edge_itr.key_from, edge_itr.key_to, edge_itr.type);
-      if (updated_artifact_edges.find(id) != updated_artifact_edges.end()) {
-        e++;
-        continue;
-      }
+      merged_graph_.edges[*stored.first] = edge;
     }
-    new_graph.edges.push_back(edge_itr);
-    e++;
-  }
-
-  auto itr = updated_artifact_edges.begin();
-  while (itr != updated_artifact_edges.end()) {
-    new_graph.edges.push_back(itr->second);
-    itr++;
   }
-  merged_graph_.edges = new_graph.edges;
 }
 
 void Merger::InsertNode(const pose_graph_msgs::PoseGraphNode& node) {
-  // Just update the node if it is already exist
-  if (merged_graph_KeyToIndex_.find(node.key) !=
-      merged_graph_KeyToIndex_.end()) {
-    merged_graph_.nodes[merged_graph_KeyToIndex_[node.key]] = node;
+  // Track the index at which the node is inserted, or just update the node
+  // if it already exists
+  auto index =
+      merged_graph_KeyToIndex_.Insert(node.key, merged_graph_.nodes.size());
+  if (!index.second) {
+    merged_graph_.nodes[*index.first] = node;
     ROS_DEBUG_STREAM(
         "\n[Insert Node] key to index mapping already exists, with key: "
         << gtsam::DefaultKeyFormatter(node.key) << " and index "
-        << merged_graph_KeyToIndex_[node.key]);
+        << *index.first);
     return;
   }
 
-  // Track the index at which the node was inserted
   ROS_DEBUG_STREAM("\nAdding new key to index mapping, with key: "
                    << gtsam::DefaultKeyFormatter(node.key) << " and index "
                    << merged_graph_.nodes.size());
-  merged_graph_KeyToIndex_[node.key] = merged_graph_.nodes.size();
 
   // Add the node to the graph
   merged_graph_.nodes.push_back(node);
@@ -98,8 +102,7 @@ void Merger::ClearNodes() {
 
 bool Merger::IsEdgeNew(const pose_graph_msgs::PoseGraphEdge& msg) {
   // Checks to see if an edge is new
-  std::tuple<gtsam::Key, gtsam::Key, int> id = std::make_tuple(msg.key_from, msg.key_to, msg.type);
-  return unique_edges_.count(id) == 0;
+  return !unique_edges_.Contains(EdgeId(msg));
 }
 
 std::set<char> Merger::GetNewRobots(const pose_graph_msgs::PoseGraphConstPtr& msg) {
@@ -128,11 +131,256 @@ void Merger::OnSlowGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
   ClearNodes();
 
   // Insert all Nodes - slow graph should be the most accurate and up to date
+  robot_corrections_.clear();
   for (const GraphNode& node : msg->nodes) {
     InsertNode(node);
+
+    // Track the newest optimized node of each robot
+    auto prefix = gtsam::Symbol(node.key).chr();
+    if (lamp_utils::IsRobotPrefix(prefix)) {
+      RobotCorrection& correction = robot_corrections_[prefix];
+      correction.last_optimized_key =
+          std::max(correction.last_optimized_key, node.key);
+    }
   }
 
   InsertNewEdges(msg);
+  UpdateMemoryAccount();
+}
+
+std::vector<gtsam::Key>
+Merger::MergeIntoGraph(const pose_graph_msgs::PoseGraphConstPtr& msg,
+                       lamp_utils::PoseGraph* graph) {
+  ROS_DEBUG_STREAM("Merging slow graph of size " << msg->nodes.size()
+                   << " into graph of size " << graph->GetNodes().size());
+
+  std::vector<gtsam::Key> changed_keys;
+  auto set_pose = [&](gtsam::Key key, const gtsam::Pose3& pose) {
+    if (graph->GetPose(key).equals(pose, 1e-9))
+      return;
+    graph->UpdateNodePose(key, pose);
+    changed_keys.push_back(key);
+  };
+
+  // Keys that hold their merged pose
+  std::unordered_set<gtsam::Key> merged_keys;
+  for (const GraphNode& node : msg->nodes) {
+    robots_.insert(gtsam::Symbol(node.key).chr());
+    merged_keys.insert(node.key);
+  }
+
+  // As in OnFastGraphMsg, the first merge with a robot the slow graph does
+  // not know keeps the fast values
+  bool b_new_robot = msg->nodes.empty();
+  for (gtsam::Key key : graph->GetNodes().keys()) {
+    auto prefix = gtsam::Symbol(key).chr();
+    if (lamp_utils::IsRobotPrefix(prefix) && robots_.insert(prefix).second)
+      b_new_robot = true;
+  }
+  if (b_new_robot) {
+    ROS_DEBUG_STREAM("Merge with a new robot, keeping the current values");
+    return changed_keys;
+  }
+
+  for (const GraphNode& node : msg->nodes) {
+    if (graph->IsMarginalized(node.key)) {
+      continue;
+    }
+    if (!graph->HasKey(node.key)) {
+      graph->TrackNode(node);
+      changed_keys.push_back(node.key);
+      continue;
+    }
+    set_pose(node.key, lamp_utils::MessageToPose(node));
+  }
+
+  // Nodes added after the slow graph was computed and reobserved artifacts,
+  // in the order they were created in
+  const lamp_utils::EdgeStore& edges = graph->GetEdges();
+  std::vector<gtsam::Key> fast_keys;
+  for (gtsam::Key key : graph->GetNodes().keys()) {
+    if (merged_keys.count(key) == 0) {
+      fast_keys.push_back(key);
+      continue;
+    }
+    auto edge = edges.FindKeyTo(key);
+    if (edge && edge->type == pose_graph_msgs::PoseGraphEdge::ARTIFACT) {
+      ROS_DEBUG_STREAM("\nDebug Merger: Re-anchoring the reobserved artifact "
+                       << gtsam::DefaultKeyFormatter(key));
+      fast_keys.push_back(key);
+    }
+  }
+  std::sort(fast_keys.begin(), fast_keys.end());
+
+  for (gtsam::Key key : fast_keys) {
+    auto edge = edges.FindKeyTo(key);
+    if (!edge || merged_keys.count(edge->key_from) == 0) {
+      // Prior node doesn't exist - don't adjust
+      ROS_WARN_STREAM("[FastGraph] Have missing node with an edge-from. Key: "
+                      << (edge ? gtsam::DefaultKeyFormatter(edge->key_from)
+                               : std::string("none"))
+                      << ", edge to: " << gtsam::DefaultKeyFormatter(key)
+                      << ". Using current robot-graph value.");
+      merged_keys.insert(key);
+      continue;
+    }
+
+    // Apply the edge transformation to the merged previous node
+    set_pose(key,
+             graph->GetPose(edge->key_from) *
+                 lamp_utils::MessageToPose(*edge));
+    merged_keys.insert(key);
+  }
+
+  ROS_DEBUG_STREAM("Finished merging graph, " << changed_keys.size()
+                   << " poses changed");
+  return changed_keys;
+}
+
+std::vector<gtsam::Key> Merger::MergeFastGraphs(
+    const std::vector<pose_graph_msgs::PoseGraphConstPtr>& msgs,
+    lamp_utils::PoseGraph* graph) {
+  // Group the graphs by the robot that sent them
+  std::map<char, std::vector<pose_graph_msgs::PoseGraphConstPtr>> robot_msgs;
+  for (const auto& msg : msgs) {
+    char robot = 0;
+    for (const GraphNode& node : msg->nodes) {
+      auto prefix = gtsam::Symbol(node.key).chr();
+      if (lamp_utils::IsRobotPrefix(prefix)) {
+        robot = prefix;
+        break;
+      }
+    }
+    if (robot == 0 && !msg->edges.empty()) {
+      robot = gtsam::Symbol(msg->edges.front().key_from).chr();
+    }
+    if (robot == 0 && !msg->marginalized_keys.empty()) {
+      robot = gtsam::Symbol(msg->marginalized_keys.front()).chr();
+    }
+    robot_msgs[robot].push_back(msg);
+  }
+
+  std::vector<gtsam::Key> merged_keys;
+  for (const auto& kv : robot_msgs) {
+    MergeRobotGraphs(kv.second, graph, &merged_keys);
+  }
+
+  ROS_DEBUG_STREAM("Merged " << msgs.size() << " fast graphs from "
+                   << robot_msgs.size() << " robots, "
+                   << merged_keys.size() << " nodes added or re-anchored");
+  return merged_keys;
+}
+
+void Merger::MergeRobotGraphs(
+    const std::vector<pose_graph_msgs::PoseGraphConstPtr>& msgs,
+    lamp_utils::PoseGraph* graph,
+    std::vector<gtsam::Key>* merged_keys) {
+  // Latest version of each node of the batch, ordered by key so nodes are
+  // merged in the order they were created in
+  std::map<gtsam::Key, const GraphNode*> nodes;
+  // First edge of the batch to each node
+  std::unordered_map<gtsam::Key, const GraphEdge*> edges_to;
+
+  bool b_new_robot = graph->GetNodes().size() == 0;
+  for (const auto& msg : msgs) {
+    for (const GraphNode& node : msg->nodes) {
+      nodes[node.key] = &node;
+      auto prefix = gtsam::Symbol(node.key).chr();
+      if (lamp_utils::IsRobotPrefix(prefix) &&
+          !IsRobotInGraph(prefix, *graph)) {
+        b_new_robot = true;
+      }
+    }
+    for (const GraphEdge& edge : msg->edges) {
+      edges_to.emplace(edge.key_to, &edge);
+    }
+  }
+
+  // Add new edges, existing ones are skipped and artifact edges updated. The
+  // nodes the robot marginalized go first, with the odometry over nodes
+  // still held
+  EdgeMessages edges;
+  std::vector<gtsam::Key> marginalized;
+  for (const auto& msg : msgs) {
+    edges.insert(edges.end(), msg->edges.begin(), msg->edges.end());
+    marginalized.insert(marginalized.end(),
+                        msg->marginalized_keys.begin(),
+                        msg->marginalized_keys.end());
+  }
+  graph->ApplyMarginalizations(marginalized, &edges);
+  graph->TrackFactors(edges);
+  for (auto it = nodes.begin(); it != nodes.end();) {
+    if (graph->IsMarginalized(it->first)) {
+      it = nodes.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  // Nothing to anchor on, the robot values are used as they are
+  if (b_new_robot) {
+    ROS_DEBUG_STREAM("Fast graphs from a robot not in the graph yet");
+    for (const auto& kv : nodes) {
+      graph->TrackNode(*kv.second);
+      merged_keys->push_back(kv.first);
+      robots_.insert(gtsam::Symbol(kv.first).chr());
+    }
+    return;
+  }
+
+  for (const auto& kv : nodes) {
+    const GraphNode& node = *kv.second;
+    auto edge = edges_to.find(node.key);
+
+    if (graph->HasKey(node.key)) {
+      if (edge == edges_to.end() ||
+          edge->second->type != pose_graph_msgs::PoseGraphEdge::ARTIFACT) {
+        // Keep the merged pose, the fast graph stamp is the most correct
+        auto stored = graph->FindNode(node.key);
+        if (stored && stored->header.stamp != node.header.stamp) {
+          stored->header = node.header;
+          graph->TrackNode(*stored);
+        }
+        continue;
+      }
+      ROS_DEBUG_STREAM("\nDebug Merger: Re-anchoring the reobserved artifact "
+                       << gtsam::DefaultKeyFormatter(node.key));
+    }
+
+    GraphNode merged_node = node;
+    if (edge == edges_to.end() || !graph->HasKey(edge->second->key_from)) {
+      // Prior node doesn't exist - don't adjust
+      ROS_WARN_STREAM("[FastGraph] Have missing node with an edge-from. Key: "
+                      << (edge != edges_to.end()
+                              ? gtsam::DefaultKeyFormatter(
+                                    edge->second->key_from)
+                              : std::string("none"))
+                      << ", edge to: " << gtsam::DefaultKeyFormatter(node.key)
+                      << ". Using current robot-graph value.");
+    } else {
+      // Apply the edge transformation to the merged previous node
+      merged_node.pose = lamp_utils::GtsamToRosMsg(
+          graph->GetPose(edge->second->key_from) *
+          lamp_utils::MessageToPose(*edge->second));
+      NormalizeNodeOrientation(merged_node);
+    }
+
+    ROS_DEBUG_STREAM("\n[Fast Graph Add] Adding new node with key "
+                     << gtsam::DefaultKeyFormatter(merged_node.key));
+    graph->TrackNode(merged_node);
+    merged_keys->push_back(node.key);
+  }
+}
+
+bool Merger::IsRobotInGraph(char prefix, const lamp_utils::PoseGraph& graph) {
+  if (robots_.count(prefix)) {
+    return true;
+  }
+  // Only reached for robots not seen before, e.g. after loading a graph
+  for (gtsam::Key key : graph.GetNodes().keys()) {
+    robots_.insert(gtsam::Symbol(key).chr());
+  }
+  return robots_.count(prefix) > 0;
 }
 
 void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
@@ -152,6 +400,7 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
     }
 
     InsertNewEdges(msg);
+    UpdateMemoryAccount();
     return;
   }
 
@@ -161,11 +410,20 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
   // Get header from the fastGraph - most recent graph
   merged_graph_.header = msg->header;
 
-  std::map<long unsigned int, std::set<const GraphEdge*>> fastOutAdjList;
+  // Nodes at or before the newest optimized node of their robot keep the slow
+  // graph values, only the tail past it is merged
+  auto is_optimized = [this](gtsam::Key key) {
+    auto correction = robot_corrections_.find(gtsam::Symbol(key).chr());
+    return correction != robot_corrections_.end() &&
+        key <= correction->second.last_optimized_key &&
+        merged_graph_KeyToIndex_.Contains(key);
+  };
+
   std::map<long unsigned int, std::set<const GraphEdge*>> fastInAdjList;
   for (const GraphEdge& edge : msg->edges) {
-    fastOutAdjList[edge.key_from].insert(&edge);
-    fastInAdjList[edge.key_to].insert(&edge);
+    if (!is_optimized(edge.key_to)) {
+      fastInAdjList[edge.key_to].insert(&edge);
+    }
   }
 
   // use map to order the new fast nodes by the order they were created in
@@ -173,10 +431,25 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
   std::map<long unsigned int, const GraphNode*> fastKeyToNode;
 
   for (const GraphNode& node : msg->nodes) {
-    if (merged_graph_KeyToIndex_.count(node.key) != 0) {
+    if (is_optimized(node.key)) {
+      RobotCorrection& robot =
+          robot_corrections_[gtsam::Symbol(node.key).chr()];
+      if (node.key == robot.last_optimized_key) {
+        // Odometry pose of the node to its optimized pose, refreshed as the
+        // same graph may be merged as a fast graph first
+        const GraphNode& optimized =
+            merged_graph_.nodes[*merged_graph_KeyToIndex_.Find(node.key)];
+        robot.correction = lamp_utils::MessageToPose(optimized) *
+            lamp_utils::MessageToPose(node).inverse();
+        robot.b_have_correction = true;
+      }
+      continue;
+    }
+
+    const size_t* index = merged_graph_KeyToIndex_.Find(node.key);
+    if (index) {
       // Replace the stamp with the fast graph stamp (most correct)
-      merged_graph_.nodes[merged_graph_KeyToIndex_[node.key]].header =
-          node.header;
+      merged_graph_.nodes[*index].header = node.header;
       // TODO 1: we want to add the artifact anyway
       // if artifact node -> add that
 
@@ -204,6 +477,26 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
     // ROS_INFO_STREAM("Adding new node");
     // the fast node to add to the merged_graph_
     const GraphNode* fastNode = kv.second;
+
+    // Tail of a robot past its last optimized node, the cached correction
+    // moves it without walking the edges
+    auto correction =
+        robot_corrections_.find(gtsam::Symbol(fastNode->key).chr());
+    if (correction != robot_corrections_.end() &&
+        correction->second.b_have_correction &&
+        fastNode->key > correction->second.last_optimized_key) {
+      GraphNode new_merged_graph_node = *fastNode;
+      new_merged_graph_node.pose = lamp_utils::GtsamToRosMsg(
+          correction->second.correction *
+          lamp_utils::MessageToPose(*fastNode));
+      NormalizeNodeOrientation(new_merged_graph_node);
+      ROS_DEBUG_STREAM("\n[Fast Graph Add] Adding new node with key "
+                       << gtsam::DefaultKeyFormatter(new_merged_graph_node.key)
+                       << " from the robot correction");
+      InsertNode(new_merged_graph_node);
+      continue;
+    }
+
     // TODO 2: we skip the artifact edge if there is no edge. Find == end
 
     // edge in the fast graph to this fast node
@@ -217,7 +510,8 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
     // graph
     long unsigned int prevFastKey = edgeToFastNode->key_from;
     // Check if the prior node exists
-    if (merged_graph_KeyToIndex_.count(prevFastKey) == 0) {
+    const size_t* prevIndex = merged_graph_KeyToIndex_.Find(prevFastKey);
+    if (!prevIndex) {
       // Prior node doesn't exist - don't adjust
       ROS_WARN_STREAM("[FastGraph] Have missing node with an edge-from. Key: "
                       << gtsam::DefaultKeyFormatter(prevFastKey)
@@ -234,7 +528,7 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
     }
 
     const GraphNode* merged_graph_PrevNode =
-        &merged_graph_.nodes[merged_graph_KeyToIndex_[prevFastKey]];
+        &merged_graph_.nodes[*prevIndex];
 
     // calculate the pose of the new merged graph node by applying the edge
     // transformation to the previous node
@@ -263,6 +557,7 @@ void Merger::OnFastGraphMsg(const pose_graph_msgs::PoseGraphConstPtr& msg) {
 
   ROS_DEBUG_STREAM("Finished merging graph, size "
                   << merged_graph_.nodes.size());
+  UpdateMemoryAccount();
 }
 
 void Merger::NormalizeNodeOrientation(pose_graph_msgs::PoseGraphNode & msg){
@@ -291,8 +586,16 @@ void Merger::OnFastPoseMsg(const geometry_msgs::PoseStamped::ConstPtr& msg) {
   // Update current fast pose
   current_fast_pose_ = gu::ros::FromROS(msg->pose);
 
-  // Add to keyed buffer
-  timestamped_poses_[msg->header.stamp.toSec()] = current_fast_pose_;
+  // Add to the history, replacing a pose with the same stamp, and drop the
+  // poses past the horizon
+  const double stamp = msg->header.stamp.toSec();
+  if (!timestamped_poses_.Insert(stamp, current_fast_pose_)) {
+    const size_t i = timestamped_poses_.LowerBound(stamp);
+    if (i < timestamped_poses_.size() && timestamped_poses_.TimeAt(i) == stamp)
+      timestamped_poses_.At(i) = current_fast_pose_;
+  }
+  timestamped_poses_.EraseBefore(timestamped_poses_.LowerBound(
+      timestamped_poses_.BackTime() - pose_history_horizon_));
 
   if (!b_received_first_slow_pose_) {
     // Publish the fast message directly.
@@ -325,56 +628,40 @@ void Merger::OnFastPoseMsg(const geometry_msgs::PoseStamped::ConstPtr& msg) {
 
 // Get the pose at a given time
 geometry_utils::Transform3 Merger::GetPoseAtTime(const ros::Time& stamp) {
-  geometry_utils::Transform3 pose;
-
-  if (timestamped_poses_.size() == 0) {
+  if (timestamped_poses_.empty()) {
     ROS_WARN("No poses in map..., returning identity");
-    return pose;
-  }
-
-  if (timestamped_poses_.size() == 1) {
-    ROS_DEBUG("Only one fast pose in map, using it");
-    return std::prev(timestamped_poses_.end(), 1)->second;
+    return geometry_utils::Transform3();
   }
 
-  auto iter = timestamped_poses_.lower_bound(
-      stamp.toSec()); // First key that is not less than timestamp
   ROS_DEBUG_STREAM("slow timestamp is " << stamp.toSec());
-
-  double t2 = iter->first;
-  double t1 = std::prev(iter, 1)->first;
-
-  if (t2 - stamp.toSec() < stamp.toSec() - t1) {
-    // t2 is closer - use that poes
-    pose = iter->second;
-  } else {
-    // t1 is closer - use that key
-    pose = std::prev(iter, 1)->second;
-    iter--;
+  const double query = stamp.toSec();
+  const size_t lower = timestamped_poses_.LowerBound(query);
+  if (lower == 0) {
+    ROS_DEBUG("Slow timestamp before the fast poses, taking the oldest");
+    return timestamped_poses_.Front();
   }
-  if (iter == std::prev(timestamped_poses_.begin())) {
-    iter++;
-    pose = iter->second;
-  } else if (iter == timestamped_poses_.end()) {
+  if (lower == timestamped_poses_.size()) {
     ROS_WARN(
         "Invalid time for graph (past end of graph range). take latest pose");
-    pose = std::prev(timestamped_poses_.end(), 1)->second;
-    iter--;
+    return timestamped_poses_.Back();
   }
 
-  ROS_DEBUG_STREAM("Corresponding fast timestamp is " << iter->first);
-
-  return pose;
+  // Between the poses around the slow timestamp
+  const double t1 = timestamped_poses_.TimeAt(lower - 1);
+  const double t2 = timestamped_poses_.TimeAt(lower);
+  const gtsam::Pose3 pose1 =
+      lamp_utils::ToGtsam(timestamped_poses_.At(lower - 1));
+  const gtsam::Pose3 pose2 = lamp_utils::ToGtsam(timestamped_poses_.At(lower));
+  return lamp_utils::ToGu(pose1.interpolateRt(pose2, (query - t1) / (t2 - t1)));
 }
 
 void Merger::CleanUpMap(const ros::Time& stamp) {
-  auto iter = timestamped_poses_.lower_bound(
-      stamp.toSec()); // First key that is not less than timestamp
-
-  // Erase from the start to the last time below the current.
+  // Erase from the start to the last time below the current
+  const size_t lower = timestamped_poses_.LowerBound(stamp.toSec());
   ROS_DEBUG_STREAM("Size of timestamped poses before erase is: "
                   << timestamped_poses_.size());
-  timestamped_poses_.erase(timestamped_poses_.begin(), std::prev(iter, 1));
+  if (lower > 0)
+    timestamped_poses_.EraseBefore(lower - 1);
   ROS_DEBUG_STREAM("Size of timestamped poses after erase is: "
                   << timestamped_poses_.size());
 }
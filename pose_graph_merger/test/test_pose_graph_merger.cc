@@ -5,6 +5,8 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <map>
 #include <math.h>
 #include <ros/ros.h>
 
@@ -16,6 +18,7 @@
 #include <gtsam/inference/Key.h>
 #include <gtsam/inference/Symbol.h>
 
+#include <lamp_utils/CommonFunctions.h>
 #include <pose_graph_merger/merger.h>
 
 class TestMerger : public ::testing::Test {
@@ -27,6 +30,13 @@ public:
 
   Merger merger;
 
+  void AddFastPose(double t, const gtsam::Pose3& pose) {
+    merger.timestamped_poses_.Insert(t, lamp_utils::ToGu(pose));
+  }
+  size_t NumFastPoses() const {
+    return merger.timestamped_poses_.size();
+  }
+
 protected:
   // Tolerance on EXPECT_NEAR assertions
   double tolerance_ = 1e-5;
@@ -728,6 +738,244 @@ TEST_F(TestMerger, MergeWithArtifactInFastGraph) {
   EXPECT_NEAR(0.0, z, tolerance_);
 }
 
+TEST_F(TestMerger, MergeTailWithRobotCorrection) {
+  auto make_node = [](gtsam::Key key, double x) {
+    pose_graph_msgs::PoseGraphNode node;
+    node.key = key;
+    node.pose.position.x = x;
+    node.pose.orientation.w = 1.0;
+    return node;
+  };
+  auto make_edge = [](gtsam::Key key_from, gtsam::Key key_to, double x) {
+    pose_graph_msgs::PoseGraphEdge edge;
+    edge.key_from = key_from;
+    edge.key_to = key_to;
+    edge.pose.position.x = x;
+    edge.pose.orientation.w = 1.0;
+    edge.type = pose_graph_msgs::PoseGraphEdge::ODOM;
+    return edge;
+  };
+
+  // Slow graph has a0 and a1, a1 turned to face +y
+  pose_graph_msgs::PoseGraph::Ptr slow(new pose_graph_msgs::PoseGraph);
+  slow->nodes.push_back(make_node(gtsam::Symbol('a', 0), 0.0));
+  slow->nodes.push_back(make_node(gtsam::Symbol('a', 1), 0.0));
+  slow->nodes[1].pose.position.y = 1.0;
+  slow->nodes[1].pose.orientation.z = sqrt(0.5);
+  slow->nodes[1].pose.orientation.w = sqrt(0.5);
+  merger.OnSlowGraphMsg(slow);
+
+  // Robot odometry along x
+  pose_graph_msgs::PoseGraph::Ptr fast(new pose_graph_msgs::PoseGraph);
+  for (int i = 0; i < 3; i++) {
+    fast->nodes.push_back(make_node(gtsam::Symbol('a', i), i));
+  }
+  fast->edges.push_back(
+      make_edge(gtsam::Symbol('a', 0), gtsam::Symbol('a', 1), 1.0));
+  fast->edges.push_back(
+      make_edge(gtsam::Symbol('a', 1), gtsam::Symbol('a', 2), 1.0));
+  merger.OnFastGraphMsg(fast);
+
+  // Next fast graph without an edge to the newest node, the cached correction
+  // still places it
+  pose_graph_msgs::PoseGraph::Ptr fast2(new pose_graph_msgs::PoseGraph(*fast));
+  fast2->nodes.push_back(make_node(gtsam::Symbol('a', 3), 3.0));
+  merger.OnFastGraphMsg(fast2);
+
+  pose_graph_msgs::PoseGraph current_graph = merger.GetCurrentGraph();
+  ASSERT_EQ(4, current_graph.nodes.size());
+  EXPECT_EQ(2, current_graph.edges.size());
+
+  std::map<gtsam::Key, pose_graph_msgs::PoseGraphNode> nodes;
+  for (const GraphNode& node : current_graph.nodes) {
+    nodes[node.key] = node;
+  }
+  // Optimized nodes keep the slow graph values
+  EXPECT_NEAR(0.0, nodes[gtsam::Symbol('a', 1)].pose.position.x, tolerance_);
+  EXPECT_NEAR(1.0, nodes[gtsam::Symbol('a', 1)].pose.position.y, tolerance_);
+  // Tail follows a1
+  EXPECT_NEAR(0.0, nodes[gtsam::Symbol('a', 2)].pose.position.x, tolerance_);
+  EXPECT_NEAR(2.0, nodes[gtsam::Symbol('a', 2)].pose.position.y, tolerance_);
+  EXPECT_NEAR(0.0, nodes[gtsam::Symbol('a', 3)].pose.position.x, tolerance_);
+  EXPECT_NEAR(3.0, nodes[gtsam::Symbol('a', 3)].pose.position.y, tolerance_);
+  EXPECT_NEAR(sqrt(0.5),
+              nodes[gtsam::Symbol('a', 3)].pose.orientation.z,
+              tolerance_);
+}
+
+TEST_F(TestMerger, MergeIntoGraph) {
+  ros::Time::init();
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+  gtsam::noiseModel::Diagonal::shared_ptr prior_noise(
+      gtsam::noiseModel::Diagonal::Sigmas(gtsam::Vector6::Constant(0.1)));
+
+  // Robot graph a0 -> a1 -> a2, the optimizer only saw a0 and a1
+  lamp_utils::PoseGraph graph;
+  graph.Initialize(gtsam::Symbol('a', 0), gtsam::Pose3(), prior_noise);
+  graph.TrackNode(ros::Time(1.0),
+                  gtsam::Symbol('a', 1),
+                  gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(1.0, 0.0, 0.0)),
+                  noise);
+  graph.TrackNode(ros::Time(2.0),
+                  gtsam::Symbol('a', 2),
+                  gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(3.0, 0.0, 0.0)),
+                  noise);
+  graph.TrackFactor(gtsam::Symbol('a', 0),
+                    gtsam::Symbol('a', 1),
+                    pose_graph_msgs::PoseGraphEdge::ODOM,
+                    gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(1.0, 0.0, 0.0)),
+                    noise);
+  graph.TrackFactor(gtsam::Symbol('a', 1),
+                    gtsam::Symbol('a', 2),
+                    pose_graph_msgs::PoseGraphEdge::ODOM,
+                    gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(2.0, 0.0, 0.0)),
+                    noise);
+  graph.ClearIncrementalMessages();
+
+  pose_graph_msgs::PoseGraph::Ptr optimized(new pose_graph_msgs::PoseGraph);
+  pose_graph_msgs::PoseGraphNode n0, n1;
+  n0.key = gtsam::Symbol('a', 0);
+  n0.pose.orientation.w = 1.0;
+  n1.key = gtsam::Symbol('a', 1);
+  n1.pose.position.y = 1.0;
+  n1.pose.orientation.w = 1.0;
+  optimized->nodes.push_back(n0);
+  optimized->nodes.push_back(n1);
+
+  std::vector<gtsam::Key> changed = merger.MergeIntoGraph(optimized, &graph);
+
+  // a0 did not move
+  std::sort(changed.begin(), changed.end());
+  ASSERT_EQ(2, changed.size());
+  EXPECT_EQ(gtsam::Symbol('a', 1), changed[0]);
+  EXPECT_EQ(gtsam::Symbol('a', 2), changed[1]);
+  EXPECT_EQ(2, graph.GetNewValues().size());
+
+  // Optimized pose applied, newer node re-anchored through its edge
+  gtsam::Pose3 a1 = graph.GetPose(gtsam::Symbol('a', 1));
+  gtsam::Pose3 a2 = graph.GetPose(gtsam::Symbol('a', 2));
+  EXPECT_NEAR(0.0, a1.x(), tolerance_);
+  EXPECT_NEAR(1.0, a1.y(), tolerance_);
+  EXPECT_NEAR(2.0, a2.x(), tolerance_);
+  EXPECT_NEAR(1.0, a2.y(), tolerance_);
+
+  // Node messages follow, stamps are kept
+  auto node = graph.FindNode(gtsam::Symbol('a', 2));
+  ASSERT_TRUE(node);
+  EXPECT_NEAR(2.0, node->pose.position.x, tolerance_);
+  EXPECT_NEAR(1.0, node->pose.position.y, tolerance_);
+  EXPECT_EQ(ros::Time(2.0), node->header.stamp);
+  EXPECT_EQ(2, graph.GetEdges().size());
+}
+
+TEST_F(TestMerger, MergeFastGraphs) {
+  ros::Time::init();
+  static const gtsam::SharedNoiseModel& noise =
+      gtsam::noiseModel::Isotropic::Variance(6, 0.1);
+  gtsam::noiseModel::Diagonal::shared_ptr prior_noise(
+      gtsam::noiseModel::Diagonal::Sigmas(gtsam::Vector6::Constant(0.1)));
+
+  // Base graph a0 -> a1, a1 moved by the optimizer
+  lamp_utils::PoseGraph graph;
+  graph.Initialize(gtsam::Symbol('a', 0), gtsam::Pose3(), prior_noise);
+  graph.TrackNode(ros::Time(1.0),
+                  gtsam::Symbol('a', 1),
+                  gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(0.0, 1.0, 0.0)),
+                  noise);
+  graph.TrackFactor(gtsam::Symbol('a', 0),
+                    gtsam::Symbol('a', 1),
+                    pose_graph_msgs::PoseGraphEdge::ODOM,
+                    gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(1.0, 0.0, 0.0)),
+                    noise);
+  graph.ClearIncrementalMessages();
+
+  auto make_node = [](gtsam::Key key, double x, double t) {
+    pose_graph_msgs::PoseGraphNode n;
+    n.key = key;
+    n.header.stamp = ros::Time(t);
+    n.pose.position.x = x;
+    n.pose.orientation.w = 1.0;
+    return n;
+  };
+  auto make_edge = [](gtsam::Key from, gtsam::Key to) {
+    pose_graph_msgs::PoseGraphEdge e;
+    e.key_from = from;
+    e.key_to = to;
+    e.type = pose_graph_msgs::PoseGraphEdge::ODOM;
+    e.pose.position.x = 1.0;
+    e.pose.orientation.w = 1.0;
+    for (int i = 0; i < 36; i += 7)
+      e.covariance[i] = 0.1;
+    return e;
+  };
+
+  // Two incremental graphs of robot a, chained, and the first graph of b
+  pose_graph_msgs::PoseGraph::Ptr g1(new pose_graph_msgs::PoseGraph);
+  g1->nodes.push_back(make_node(gtsam::Symbol('a', 2), 2.0, 2.0));
+  g1->edges.push_back(make_edge(gtsam::Symbol('a', 1), gtsam::Symbol('a', 2)));
+  pose_graph_msgs::PoseGraph::Ptr g2(new pose_graph_msgs::PoseGraph);
+  g2->nodes.push_back(make_node(gtsam::Symbol('a', 3), 3.0, 3.0));
+  g2->edges.push_back(make_edge(gtsam::Symbol('a', 2), gtsam::Symbol('a', 3)));
+  pose_graph_msgs::PoseGraph::Ptr g3(new pose_graph_msgs::PoseGraph);
+  g3->nodes.push_back(make_node(gtsam::Symbol('b', 0), 5.0, 1.0));
+
+  std::vector<pose_graph_msgs::PoseGraphConstPtr> batch{g1, g3, g2};
+  std::vector<gtsam::Key> merged = merger.MergeFastGraphs(batch, &graph);
+
+  EXPECT_EQ(3, merged.size());
+  EXPECT_EQ(3, graph.GetEdges().size());
+  EXPECT_EQ(5, graph.GetNodes().size());
+
+  // New nodes anchored on the merged a1, new robot kept as received
+  gtsam::Pose3 a2 = graph.GetPose(gtsam::Symbol('a', 2));
+  gtsam::Pose3 a3 = graph.GetPose(gtsam::Symbol('a', 3));
+  gtsam::Pose3 b0 = graph.GetPose(gtsam::Symbol('b', 0));
+  EXPECT_NEAR(1.0, a2.x(), tolerance_);
+  EXPECT_NEAR(1.0, a2.y(), tolerance_);
+  EXPECT_NEAR(2.0, a3.x(), tolerance_);
+  EXPECT_NEAR(1.0, a3.y(), tolerance_);
+  EXPECT_NEAR(5.0, b0.x(), tolerance_);
+  EXPECT_EQ(ros::Time(3.0), graph.keyed_stamps.At(gtsam::Symbol('a', 3)));
+
+  // Resending a known node only updates its stamp
+  pose_graph_msgs::PoseGraph::Ptr g4(new pose_graph_msgs::PoseGraph);
+  g4->nodes.push_back(make_node(gtsam::Symbol('a', 3), 10.0, 4.0));
+  merged = merger.MergeFastGraphs({g4}, &graph);
+  EXPECT_TRUE(merged.empty());
+  EXPECT_NEAR(2.0, graph.GetPose(gtsam::Symbol('a', 3)).x(), tolerance_);
+  EXPECT_EQ(ros::Time(4.0), graph.keyed_stamps.At(gtsam::Symbol('a', 3)));
+}
+
+TEST_F(TestMerger, FastPoseHistoryInterpolates) {
+  EXPECT_NEAR(
+      0.0, merger.GetPoseAtTime(ros::Time(1.0)).translation(0), tolerance_);
+
+  // Moving along x and turning a quarter turn between 2 and 3 s
+  AddFastPose(1.0, gtsam::Pose3());
+  AddFastPose(2.0, gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(1, 0, 0)));
+  AddFastPose(
+      3.0, gtsam::Pose3(gtsam::Rot3::Yaw(M_PI / 2), gtsam::Point3(3, 0, 0)));
+
+  gtsam::Pose3 pose = lamp_utils::ToGtsam(merger.GetPoseAtTime(ros::Time(1.5)));
+  EXPECT_NEAR(0.5, pose.translation().x(), tolerance_);
+  pose = lamp_utils::ToGtsam(merger.GetPoseAtTime(ros::Time(2.5)));
+  EXPECT_NEAR(2.0, pose.translation().x(), tolerance_);
+  EXPECT_NEAR(M_PI / 4, pose.rotation().yaw(), tolerance_);
+
+  // Outside the history, the closest pose
+  pose = lamp_utils::ToGtsam(merger.GetPoseAtTime(ros::Time(0.5)));
+  EXPECT_NEAR(0.0, pose.translation().x(), tolerance_);
+  pose = lamp_utils::ToGtsam(merger.GetPoseAtTime(ros::Time(4.0)));
+  EXPECT_NEAR(3.0, pose.translation().x(), tolerance_);
+
+  // Keeps the pose before the slow stamp
+  merger.CleanUpMap(ros::Time(2.5));
+  EXPECT_EQ(2, NumFastPoses());
+  pose = lamp_utils::ToGtsam(merger.GetPoseAtTime(ros::Time(2.5)));
+  EXPECT_NEAR(2.0, pose.translation().x(), tolerance_);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_pose_graph_merger");
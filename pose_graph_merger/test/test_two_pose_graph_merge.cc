@@ -69,6 +69,9 @@ protected:
   geometry_msgs::PoseStamped GetRobotPose(){return merge_.robot_pose_;}
   geometry_msgs::PoseStamped GetMergedPose(){return merge_.merged_pose_;}
   char GetRobotPrefix(){return merge_.robot_prefix_;}
+  geometry_msgs::Pose CorrectRobotPose(const geometry_msgs::Pose& pose){
+    return merge_.CorrectRobotPose(pose);
+  }
 
 private:
 };
@@ -462,6 +465,43 @@ TEST_F(TestTwoPoseGraphMerge, NewBaseRobot1NotMoving) {
   EXPECT_NEAR(0.0, merged_pose.pose.position.z, tolerance_);
 }
 
+TEST_F(TestTwoPoseGraphMerge, CorrectRobotPose) {
+  ros::NodeHandle nh, pnh("/husky1/two_pose_graph_merge");
+
+  merge_.Initialize(pnh);
+
+  // Base station graph has the robot further ahead and turned to face +y
+  pose_graph_msgs::PoseGraph g;
+  g.nodes.push_back(CreateNode('a',0, 0.0, 0.0, 0.0));
+  g.nodes.push_back(CreateNode('a',1, 1.0, 1.0, 0.0));
+  g.nodes[1].pose.orientation.z = sqrt(0.5);
+  g.nodes[1].pose.orientation.w = sqrt(0.5);
+  g.edges.push_back(CreateEdge(g.nodes[0].key, g.nodes[1].key, 1.0, 0.0, 0.0));
+  pose_graph_msgs::PoseGraphConstPtr base_graph(
+      new pose_graph_msgs::PoseGraph(g));
+
+  g = pose_graph_msgs::PoseGraph();
+  g.nodes.push_back(CreateNode('a',0, 0.0, 0.0, 0.0));
+  g.nodes.push_back(CreateNode('a',1, 1.0, 0.0, 0.0));
+  g.edges.push_back(CreateEdge(g.nodes[0].key, g.nodes[1].key, 1.0, 0.0, 0.0));
+  pose_graph_msgs::PoseGraphConstPtr robot_graph(
+      new pose_graph_msgs::PoseGraph(g));
+
+  ProcessBaseGraph(base_graph);
+  ProcessRobotGraph(robot_graph);
+
+  // Robot moved 1 m past its last node, along +y in the merged frame
+  geometry_msgs::Pose robot_pose;
+  robot_pose.position.x = 2.0;
+  robot_pose.orientation.w = 1.0;
+  geometry_msgs::Pose merged_pose = CorrectRobotPose(robot_pose);
+
+  EXPECT_NEAR(1.0, merged_pose.position.x, tolerance_);
+  EXPECT_NEAR(2.0, merged_pose.position.y, tolerance_);
+  EXPECT_NEAR(0.0, merged_pose.position.z, tolerance_);
+  EXPECT_NEAR(sqrt(0.5), merged_pose.orientation.z, tolerance_);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "test_pose_graph_merger");
@@ -0,0 +1,56 @@
+#ifndef MARKER_CHUNKS_H
+#define MARKER_CHUNKS_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include <geometry_msgs/Point.h>
+#include <gtsam/inference/Key.h>
+#include <visualization_msgs/Marker.h>
+
+// Point or line list marker split into chunks of a fixed number of
+// elements, each published with a stable id (its index). A chunk is only
+// sent again when elements were added to it or one of its keys moved.
+class MarkerChunks {
+public:
+  typedef std::function<geometry_msgs::Point(gtsam::Key)> PositionLookup;
+
+  // keys_per_element is 1 for point lists and 2 for line lists
+  void SetParams(size_t keys_per_element,
+                 size_t chunk_size,
+                 double move_threshold);
+
+  // Adds an element with keys_per_element keys
+  void Add(gtsam::Key key);
+  void Add(gtsam::Key key_from, gtsam::Key key_to);
+  void Clear();
+
+  // Refreshes the positions of the keys, and returns the chunks that changed
+  // since the last call (all of them if b_all) built from prototype
+  std::vector<visualization_msgs::Marker>
+  TakeChanged(const visualization_msgs::Marker& prototype,
+              const PositionLookup& position,
+              bool b_all = false);
+
+  inline size_t NumChunks() const { return chunks_.size(); }
+  inline size_t NumElements() const { return num_elements_; }
+
+private:
+  struct Chunk {
+    std::vector<gtsam::Key> keys;
+    std::vector<geometry_msgs::Point> points;
+    bool b_dirty{true};
+  };
+
+  void AddKey(gtsam::Key key);
+
+  size_t keys_per_element_{2};
+  size_t chunk_size_{1000};
+  double move_threshold_{0.01};
+
+  std::vector<Chunk> chunks_;
+  size_t num_elements_{0};
+};
+
+#endif
@@ -3,15 +3,20 @@
 
 #include <functional>
 #include <ros/ros.h>
+#include <set>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <pose_graph_visualizer/HighlightEdge.h>
 #include <pose_graph_visualizer/HighlightNode.h>
+#include <pose_graph_visualizer/MarkerChunks.h>
+#include <pose_graph_visualizer/ShowInteractiveMarkers.h>
 
 #include <geometry_utils/GeometryUtilsROS.h>
 #include <parameter_utils/ParameterUtils.h>
 
-#include <pose_graph_msgs/KeyedScan.h>
+#include <pose_graph_msgs/KeyedScans.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <pose_graph_msgs/PoseGraphEdge.h>
 #include <pose_graph_msgs/PoseGraphNode.h>
@@ -44,7 +49,9 @@
 
 #include <lamp_utils/CommonFunctions.h>
 #include <lamp_utils/CommonStructs.h>
+#include <lamp_utils/Metrics.h>
 #include <lamp_utils/PoseGraph.h>
+#include <lamp_utils/SymbolIdIndex.h>
 
 namespace gu = geometry_utils;
 
@@ -76,12 +83,29 @@ public:
   struct ArtifactInfo {
     // gtsam::Key pose_key;
     artifact_msgs::Artifact msg;
+    // Handle of msg.id, the artifact shown for its parent ID
+    lamp_utils::SymbolIdIndex::Handle id;
   };
 
   void VisualizeSingleRealisticArtifact(visualization_msgs::Marker& m,
                                         const ArtifactInfo& art);
   void VisualizeSingleSimpleArtifact(visualization_msgs::Marker& m,
                                      const ArtifactInfo& art);
+
+  // Markers of an artifact as last published
+  struct ArtifactMarkers {
+    visualization_msgs::Marker m;
+    visualization_msgs::Marker m_id;
+    // Graph position the markers were built or shifted for
+    geometry_msgs::Point position;
+    bool b_blacklisted{false};
+  };
+
+  // Publishes the markers of the new and changed artifacts, and of those
+  // that moved more than artifact_move_threshold_
+  void PublishArtifacts();
+  ArtifactMarkers BuildArtifactMarkers(const ArtifactInfo& info,
+                                       const geometry_msgs::Point& p);
   void VisualizeSingleArtifactId(visualization_msgs::Marker& m,
                                  const ArtifactInfo& art);
 
@@ -91,7 +115,9 @@ private:
   bool LoadParameters(const ros::NodeHandle& n);
   bool RegisterCallbacks(const ros::NodeHandle& nh, const ros::NodeHandle& pnh);
 
-  void KeyedScanCallback(const pose_graph_msgs::KeyedScan::ConstPtr& msg);
+  // Fetches the scan of the node from LAMP and publishes it in the world
+  // frame on highlighted_scan. Scans are not kept here, LAMP holds them.
+  bool ShowKeyedScan(gtsam::Key key);
   void ErasePosegraphCallback(const std_msgs::Bool::ConstPtr& msg);
   void RemoveFactorVizCallback(const std_msgs::Bool::ConstPtr& msg);
   void PoseGraphCallback(const pose_graph_msgs::PoseGraph::ConstPtr& msg);
@@ -110,15 +136,39 @@ private:
   HighlightEdgeService(pose_graph_visualizer::HighlightEdgeRequest& request,
                        pose_graph_visualizer::HighlightEdgeResponse& response);
 
+  bool ShowInteractiveMarkersService(
+      pose_graph_visualizer::ShowInteractiveMarkersRequest& request,
+      pose_graph_visualizer::ShowInteractiveMarkersResponse& response);
+
   geometry_msgs::Point GetPositionMsg(gtsam::Key key) const;
 
-  bool IsArtifactBlacklisted(const std::string& parent_id) {
-    if (std::find(artifact_parentID_blacklist_.begin(),
-                  artifact_parentID_blacklist_.end(),
-                  parent_id) != artifact_parentID_blacklist_.end())
-      return true;
-    else
-      return false;
+  // Marker topic split in chunks, only the changed chunks are published
+  struct ChunkedMarkers {
+    ros::Publisher pub;
+    MarkerChunks chunks;
+    visualization_msgs::Marker prototype;
+    // Subscribers at the last publish, new ones get all the chunks
+    uint32_t num_subscribers{0};
+    // Chunks were cleared, the old ones have to be deleted
+    bool b_reset{false};
+  };
+  void InitializeChunkedMarkers(ChunkedMarkers& markers,
+                                size_t keys_per_element,
+                                int type,
+                                double r,
+                                double g,
+                                double b,
+                                double a,
+                                double scale);
+  void PublishChunkedMarkers(ChunkedMarkers& markers);
+  void PublishNodeIds();
+  // Drops all the markers, after the graph was reset
+  void ResetMarkers();
+  // Adds the interactive marker of key, or moves it to its current pose
+  void ShowInteractiveMarker(gtsam::Key key);
+
+  bool IsArtifactBlacklisted(lamp_utils::SymbolIdIndex::Handle parent_id) {
+    return artifact_parentID_blacklist_.count(parent_id) > 0;
   }
 
   // Node name.
@@ -128,34 +178,35 @@ private:
   std::string base_frame_id_;
   bool artifacts_in_global_;
 
-  std::unordered_map<std::string, ArtifactInfo>
-      artifacts_; // Keyed with UUID so can build this when we get artifact
-                  // messages
-  std::unordered_map<std::string, gtsam::Key> artifact_id2key_hash_;
-  std::unordered_map<gtsam::Key, std::string> artifact_key2id_hash_;
-  std::unordered_map<std::string, std::string> artifact_ID2ParentID_;
-  std::unordered_map<std::string, std::string> current_parentID2ID_;
-  std::hash<std::string> parent_id2int_;
-  std::vector<std::string> artifact_parentID_blacklist_;
+  // Artifact IDs are handles of the ID index of the pose graph, which also
+  // links them with the keys of the artifact nodes
+  std::unordered_map<lamp_utils::SymbolIdIndex::Handle, ArtifactInfo>
+      artifacts_; // Keyed with parent UUID so can build this when we get
+                  // artifact messages
+  // Parent ID of every artifact ID, by ID handle (kNoId if not received)
+  std::vector<lamp_utils::SymbolIdIndex::Handle> artifact_ID2ParentID_;
+  std::unordered_set<lamp_utils::SymbolIdIndex::Handle>
+      artifact_parentID_blacklist_;
   Eigen::Vector3d GetArtifactPosition(const gtsam::Key& artifact_key) const;
 
   // Visualization publishers.
-  ros::Publisher odometry_edge_pub_;
-  ros::Publisher loop_edge_pub_;
-  ros::Publisher artifact_edge_pub_;
-  ros::Publisher uwb_edge_pub_;
-  ros::Publisher uwb_edge_between_pub_;
-  ros::Publisher uwb_node_pub_;
-  ros::Publisher graph_node_pub_;
+  ChunkedMarkers odometry_edges_;
+  ChunkedMarkers loop_edges_;
+  ChunkedMarkers artifact_edges_;
+  ChunkedMarkers uwb_edges_;
+  ChunkedMarkers uwb_between_edges_;
+  ChunkedMarkers uwb_nodes_;
+  ChunkedMarkers graph_nodes_;
   ros::Publisher graph_node_id_pub_;
   ros::Publisher closure_area_pub_;
   ros::Publisher highlight_pub_;
   ros::Publisher artifact_marker_pub_;
   ros::Publisher artifact_id_marker_pub_;
   ros::Publisher stair_marker_pub_;
+  ros::Publisher highlighted_scan_pub_;
+  lamp_utils::MetricsPublisher metrics_publisher_;
 
   // Subscribers.
-  ros::Subscriber keyed_scan_sub_;
   ros::Subscriber pose_graph_sub_;
   ros::Subscriber pose_graph_node_sub_;
   ros::Subscriber pose_graph_edge_sub_;
@@ -172,8 +223,31 @@ private:
   // Services.
   ros::ServiceServer highlight_node_srv_;
   ros::ServiceServer highlight_edge_srv_;
+  ros::ServiceServer show_interactive_markers_srv_;
+  ros::ServiceClient keyed_scans_client_;
 
   bool publish_interactive_markers_{true};
+  // Nodes with an interactive marker, created on request only
+  std::set<gtsam::Key> interactive_keys_;
+
+  // Elements per marker chunk, and motion that makes a chunk be sent again
+  int marker_chunk_size_{1000};
+  double marker_move_threshold_{0.01};
+
+  // Edges (key_from, key_to, type) and nodes already in the chunks
+  std::set<std::tuple<gtsam::Key, gtsam::Key, int>> chunked_edges_;
+  std::unordered_set<gtsam::Key> chunked_nodes_;
+
+  // Node id texts at the position they were last published at
+  std::unordered_map<gtsam::Key, geometry_msgs::Point> node_id_positions_;
+  uint32_t node_id_subscribers_{0};
+
+  // Artifact markers by parent ID, dropped when the artifact shown for the
+  // parent ID changes
+  std::unordered_map<lamp_utils::SymbolIdIndex::Handle, ArtifactMarkers>
+      artifact_markers_;
+  uint32_t artifact_subscribers_{0};
+  double artifact_move_threshold_{0.05};
 
   bool b_use_base_reconciliation_{false};
 
@@ -0,0 +1,71 @@
+#include <pose_graph_visualizer/MarkerChunks.h>
+
+#include <algorithm>
+
+void MarkerChunks::SetParams(size_t keys_per_element,
+                             size_t chunk_size,
+                             double move_threshold) {
+  keys_per_element_ = std::max<size_t>(keys_per_element, 1);
+  chunk_size_ = std::max<size_t>(chunk_size, 1);
+  move_threshold_ = move_threshold;
+  Clear();
+}
+
+void MarkerChunks::AddKey(gtsam::Key key) {
+  if (chunks_.empty() ||
+      chunks_.back().keys.size() >= chunk_size_ * keys_per_element_) {
+    chunks_.emplace_back();
+    chunks_.back().keys.reserve(chunk_size_ * keys_per_element_);
+  }
+  chunks_.back().keys.push_back(key);
+  chunks_.back().b_dirty = true;
+}
+
+void MarkerChunks::Add(gtsam::Key key) {
+  AddKey(key);
+  num_elements_++;
+}
+
+void MarkerChunks::Add(gtsam::Key key_from, gtsam::Key key_to) {
+  // Both ends of a line always land in the same chunk
+  AddKey(key_from);
+  AddKey(key_to);
+  num_elements_++;
+}
+
+void MarkerChunks::Clear() {
+  chunks_.clear();
+  num_elements_ = 0;
+}
+
+std::vector<visualization_msgs::Marker>
+MarkerChunks::TakeChanged(const visualization_msgs::Marker& prototype,
+                          const PositionLookup& position,
+                          bool b_all) {
+  const double threshold2 = move_threshold_ * move_threshold_;
+  std::vector<visualization_msgs::Marker> markers;
+  std::vector<geometry_msgs::Point> current;
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    Chunk& chunk = chunks_[i];
+    current.resize(chunk.keys.size());
+    bool b_send = chunk.b_dirty || b_all;
+    for (size_t k = 0; k < chunk.keys.size(); k++) {
+      current[k] = position(chunk.keys[k]);
+      if (b_send || k >= chunk.points.size())
+        continue;
+      // Compared to the positions last sent
+      const double dx = current[k].x - chunk.points[k].x;
+      const double dy = current[k].y - chunk.points[k].y;
+      const double dz = current[k].z - chunk.points[k].z;
+      b_send = dx * dx + dy * dy + dz * dz > threshold2;
+    }
+    if (!b_send)
+      continue;
+    chunk.points = current;
+    chunk.b_dirty = false;
+    markers.push_back(prototype);
+    markers.back().id = i;
+    markers.back().points = chunk.points;
+  }
+  return markers;
+}
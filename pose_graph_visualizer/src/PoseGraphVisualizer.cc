@@ -3,12 +3,13 @@
 #include <interactive_markers/interactive_marker_server.h>
 #include <interactive_markers/menu_handler.h>
 #include <parameter_utils/ParameterUtils.h>
-#include <pose_graph_msgs/KeyedScan.h>
 #include <pose_graph_msgs/PoseGraph.h>
 #include <std_msgs/Bool.h>
 #include <std_msgs/Empty.h>
 #include <visualization_msgs/Marker.h>
 
+#include <lamp_utils/PointCloudConversions.h>
+#include <lamp_utils/PointCloudKernels.h>
 #include <lamp_utils/PrefixHandling.h>
 
 #include <pcl/io/pcd_io.h>
@@ -17,6 +18,7 @@
 #include <tf_conversions/tf_eigen.h>
 
 #include <fstream>
+#include <limits>
 
 #include <time.h>
 
@@ -97,6 +99,13 @@ bool PoseGraphVisualizer::LoadParameters(const ros::NodeHandle& n) {
   if (!pu::Get("artifact_confidence_limit", artifact_confidence_limit_))
     return false;
 
+  if (!pu::Get("marker_chunk_size", marker_chunk_size_))
+    return false;
+  if (!pu::Get("marker_move_threshold", marker_move_threshold_))
+    return false;
+  if (!pu::Get("artifact_move_threshold", artifact_move_threshold_))
+    return false;
+
   // Initialize interactive marker server
   if (publish_interactive_markers_) {
     server.reset(new interactive_markers::InteractiveMarkerServer(
@@ -112,25 +121,61 @@ bool PoseGraphVisualizer::RegisterCallbacks(const ros::NodeHandle& nh_,
 
   ros::NodeHandle nh(nh_);
 
+  metrics_publisher_.Start(pnh);
+
   highlight_node_srv_ = pnh.advertiseService(
       "highlight_node", &PoseGraphVisualizer::HighlightNodeService, this);
   highlight_edge_srv_ = pnh.advertiseService(
       "highlight_edge", &PoseGraphVisualizer::HighlightEdgeService, this);
 
-  odometry_edge_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("odometry_edges", 10, false);
-  loop_edge_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("loop_edges", 10, false);
-  artifact_edge_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("artifact_edges", 10, false);
-  uwb_edge_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("uwb_edges", 10, false);
-  uwb_edge_between_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("uwb_edges_between", 10, false);
-  uwb_node_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("uwb_nodes", 10, false);
-  graph_node_pub_ =
-      pnh.advertise<visualization_msgs::Marker>("graph_nodes", 10, false);
+  show_interactive_markers_srv_ = pnh.advertiseService(
+      "show_interactive_markers",
+      &PoseGraphVisualizer::ShowInteractiveMarkersService,
+      this);
+
+  // Queues large enough for all the chunks to a new subscriber
+  const uint32_t chunk_queue_size = 1000;
+  odometry_edges_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "odometry_edges", chunk_queue_size, false);
+  loop_edges_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "loop_edges", chunk_queue_size, false);
+  artifact_edges_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "artifact_edges", chunk_queue_size, false);
+  uwb_edges_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "uwb_edges", chunk_queue_size, false);
+  uwb_between_edges_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "uwb_edges_between", chunk_queue_size, false);
+  uwb_nodes_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "uwb_nodes", chunk_queue_size, false);
+  graph_nodes_.pub = pnh.advertise<visualization_msgs::Marker>(
+      "graph_nodes", chunk_queue_size, false);
+
+  const int line_list = visualization_msgs::Marker::LINE_LIST;
+  InitializeChunkedMarkers(
+      odometry_edges_, 2, line_list, 1.0, 0.0, 0.0, 0.8, 0.02);
+  InitializeChunkedMarkers(loop_edges_, 2, line_list, 0.0, 0.2, 1.0, 0.8, 0.02);
+  InitializeChunkedMarkers(
+      artifact_edges_, 2, line_list, 0.2, 1.0, 0.0, 0.6, 0.02);
+  InitializeChunkedMarkers(uwb_edges_, 2, line_list, 0.0, 1.0, 0.0, 0.8, 0.02);
+  InitializeChunkedMarkers(
+      uwb_between_edges_, 2, line_list, 0.0, 1.0, 0.0, 0.8, 0.04);
+  InitializeChunkedMarkers(graph_nodes_,
+                           1,
+                           visualization_msgs::Marker::SPHERE_LIST,
+                           0.3,
+                           0.0,
+                           1.0,
+                           0.8,
+                           0.1);
+  InitializeChunkedMarkers(uwb_nodes_,
+                           1,
+                           visualization_msgs::Marker::CUBE_LIST,
+                           0.0,
+                           1.0,
+                           0.0,
+                           0.4,
+                           0.5);
+
   graph_node_id_pub_ =
       pnh.advertise<visualization_msgs::Marker>("graph_node_ids", 10, false);
 
@@ -145,8 +190,10 @@ bool PoseGraphVisualizer::RegisterCallbacks(const ros::NodeHandle& nh_,
   artifact_id_marker_pub_ = pnh.advertise<visualization_msgs::Marker>(
       "artifact_id_markers", 10, true);
 
-  keyed_scan_sub_ = nh.subscribe<pose_graph_msgs::KeyedScan>(
-      "lamp/keyed_scans", 10, &PoseGraphVisualizer::KeyedScanCallback, this);
+  highlighted_scan_pub_ =
+      pnh.advertise<PointCloud>("highlighted_scan", 1, false);
+  keyed_scans_client_ = nh.serviceClient<pose_graph_msgs::KeyedScans>(
+      "lamp/get_keyed_scans");
   pose_graph_sub_ = nh.subscribe<pose_graph_msgs::PoseGraph>(
       "lamp/pose_graph", 10, &PoseGraphVisualizer::PoseGraphCallback, this);
   pose_graph_edge_sub_ = nh.subscribe<pose_graph_msgs::PoseGraphEdge>(
@@ -210,34 +257,27 @@ bool PoseGraphVisualizer::RegisterCallbacks(const ros::NodeHandle& nh_,
 
 void PoseGraphVisualizer::PoseGraphCallback(
     const pose_graph_msgs::PoseGraph::ConstPtr& msg) {
+  static lamp_utils::Histogram& callback_ms =
+      lamp_utils::MetricsRegistry::Instance().GetHistogram(
+          "pose_graph_visualizer.pose_graph_ms");
+  lamp_utils::ScopedLatency latency(callback_ms);
   if (!msg->incremental) {
     pose_graph_.Reset();
   }
   // ROS_INFO("PGV: updating pose graph from message");
   pose_graph_.UpdateFromMsg(msg);
-  for (const pose_graph_msgs::PoseGraphNode& msg_node : msg->nodes) {
-    tf::Pose pose;
-    tf::poseMsgToTF(msg_node.pose, pose);
-
-    gtsam::Symbol sym_key(gtsam::Key(msg_node.key));
-
-    // ROS_INFO_STREAM("Symbol key is " << gtsam::DefaultKeyFormatter(sym_key));
-    // ROS_INFO_STREAM("Symbol key (directly) is "
-    //                 << gtsam::DefaultKeyFormatter(msg_node.key));
-
-    // ROS_INFO_STREAM("Symbol key (int) is " << msg_node.key);
-
-    // Add UUID if an artifact or uwb node
-    if (lamp_utils::IsArtifactPrefix(sym_key.chr())) {
-      // ROS_INFO_STREAM("Have an artifact node with key "
-      //                 << gtsam::DefaultKeyFormatter(sym_key));
-
-      // node.ID = artifacts_[keyed_pose.key].msg.id;
-      artifact_id2key_hash_[msg_node.ID] = gtsam::Symbol(msg_node.key);
-      artifact_key2id_hash_[gtsam::Symbol(msg_node.key)] = msg_node.ID;
-      continue;
+  if (!msg->incremental) {
+    // The chunks are kept across keyframes, unless edges were dropped
+    for (const auto& edge : chunked_edges_) {
+      if (!pose_graph_.GetEdges().Contains(
+              std::get<0>(edge), std::get<1>(edge), std::get<2>(edge))) {
+        ResetMarkers();
+        break;
+      }
     }
   }
+  // The UUIDs of the artifact nodes are linked with their keys by the pose
+  // graph as it tracks them
 
   VisualizePoseGraph();
 }
@@ -260,6 +300,7 @@ void PoseGraphVisualizer::ErasePosegraphCallback(
   // loading the graph
   if (erase_all == true) {
     pose_graph_.Reset();
+    ResetMarkers();
     if (publish_interactive_markers_) {
       server.reset(new interactive_markers::InteractiveMarkerServer(
           "interactive_node", "", false));
@@ -280,28 +321,22 @@ void PoseGraphVisualizer::RemoveFactorVizCallback(
   }
 }
 
-void PoseGraphVisualizer::KeyedScanCallback(
-    const pose_graph_msgs::KeyedScan::ConstPtr& msg) {
-  const gtsam::Key& key = msg->key;
-  if (pose_graph_.HasScan(key)) {
-    ROS_ERROR("%s: Key %lu already has a laser scan.", name_.c_str(), key);
-    return;
-  }
-
-  PointCloud::Ptr scan(new PointCloud);
-  pcl::fromROSMsg(msg->scan, *scan);
-
-  // The first key should be treated differently; we need to use the laser
-  // scan's timestamp for pose zero.
-  if (key == 0) {
-    const ros::Time stamp = pcl_conversions::fromPCL(scan->header.stamp);
-    pose_graph_.InsertKeyedStamp(key, stamp);
+bool PoseGraphVisualizer::ShowKeyedScan(gtsam::Key key) {
+  pose_graph_msgs::KeyedScans srv;
+  srv.request.keys.push_back(key);
+  if (!keyed_scans_client_.call(srv) || srv.response.scans.empty()) {
+    ROS_DEBUG("%s: No keyed scan for key %lu.", name_.c_str(), key);
+    return false;
   }
 
-  // ROS_INFO_STREAM("AddKeyScanPair " << key);
-
-  // Add the key and scan.
-  pose_graph_.InsertKeyedScan(key, scan);
+  PointCloud scan;
+  lamp_utils::FromRosMsg(srv.response.scans[0].scan, &scan);
+  PointCloud scan_world;
+  lamp_utils::TransformPointCloud(
+      scan, pose_graph_.GetPose(key).matrix(), &scan_world);
+  scan_world.header.frame_id = pose_graph_.fixed_frame_id;
+  highlighted_scan_pub_.publish(scan_world);
+  return true;
 }
 
 Eigen::Vector3d
@@ -337,21 +372,28 @@ void PoseGraphVisualizer::ArtifactCallback(const artifact_msgs::Artifact& msg) {
   }
 
   // Update id to parent ID mapping
-  artifact_ID2ParentID_[msg.id] = msg.parent_id;
+  lamp_utils::SymbolIdIndex& artifact_ids = pose_graph_.GetArtifactIds();
+  const lamp_utils::SymbolIdIndex::Handle id = artifact_ids.Intern(msg.id);
+  const lamp_utils::SymbolIdIndex::Handle parent_id =
+      artifact_ids.Intern(msg.parent_id);
+  if (id >= artifact_ID2ParentID_.size())
+    artifact_ID2ParentID_.resize(id + 1, lamp_utils::SymbolIdIndex::kNoId);
+  artifact_ID2ParentID_[id] = parent_id;
 
   ArtifactInfo artifactinfo;
   artifactinfo.msg = msg;
+  artifactinfo.id = id;
 
-  if (artifacts_.count(msg.parent_id)) {
+  auto it = artifacts_.find(parent_id);
+  if (it != artifacts_.end()) {
     // ROS_DEBUG("Have a repeat observation of an existing artifact");
-    if (msg.confidence > artifacts_[msg.parent_id].msg.confidence) {
+    if (msg.confidence > it->second.msg.confidence) {
       // ROS_DEBUG_STREAM("Updating artifact visualization, with larger
       // confidence.\n Increasing from " << msg.confidence << " to " <<
       // artifacts_[msg.parent_id].msg.confidence);
-      artifacts_[msg.parent_id] = artifactinfo;
-
-      // Update current parent id to id mapping
-      current_parentID2ID_[msg.parent_id] = msg.id;
+      // Also makes this id the current one of the parent id
+      it->second = artifactinfo;
+      artifact_markers_.erase(parent_id);
     } else {
       // ROS_INFO_STREAM("Keeping old artifact with confidence " <<
       // artifacts_[msg.parent_id].msg.confidence << ", which is more than new
@@ -359,8 +401,7 @@ void PoseGraphVisualizer::ArtifactCallback(const artifact_msgs::Artifact& msg) {
     }
   } else {
     // ROS_INFO("New artifact");
-    artifacts_[msg.parent_id] = artifactinfo;
-    current_parentID2ID_[msg.parent_id] = msg.id;
+    artifacts_.emplace(parent_id, artifactinfo);
   }
 
   // ROS_INFO_STREAM("Artifact parent UUID is " << msg.parent_id);
@@ -374,19 +415,15 @@ void PoseGraphVisualizer::ArtifactCallback(const artifact_msgs::Artifact& msg) {
 void PoseGraphVisualizer::IgnoreArtifactCallback(
     const std_msgs::String::ConstPtr& msg) {
   ROS_INFO("Remove artifact %s from markers", msg->data.c_str());
-  if (!IsArtifactBlacklisted(msg->data)) {
-    artifact_parentID_blacklist_.push_back(msg->data);
-  }
+  artifact_parentID_blacklist_.insert(
+      pose_graph_.GetArtifactIds().Intern(msg->data));
 }
 
 void PoseGraphVisualizer::ReviveArtifactCallback(
     const std_msgs::String::ConstPtr& msg) {
   ROS_INFO("Revert artifact %s to markers", msg->data.c_str());
   artifact_parentID_blacklist_.erase(
-      std::remove(artifact_parentID_blacklist_.begin(),
-                  artifact_parentID_blacklist_.end(),
-                  msg->data),
-      artifact_parentID_blacklist_.end());
+      pose_graph_.GetArtifactIds().Find(msg->data));
 }
 
 bool PoseGraphVisualizer::HighlightEdge(gtsam::Key key1, gtsam::Key key2) {
@@ -443,6 +480,15 @@ bool PoseGraphVisualizer::HighlightNode(gtsam::Key key) {
   m.pose.position = GetPositionMsg(key);
   highlight_pub_.publish(m);
 
+  if (highlighted_scan_pub_.getNumSubscribers() > 0)
+    ShowKeyedScan(key);
+
+  // Highlighted nodes can be acted on
+  ShowInteractiveMarker(key);
+  if (server != nullptr) {
+    server->applyChanges();
+  }
+
   return true;
 }
 
@@ -471,6 +517,11 @@ void PoseGraphVisualizer::UnhighlightNode(gtsam::Key key) {
   else
     m.action = visualization_msgs::Marker::DELETE;
   highlight_pub_.publish(m);
+
+  // Clears the shown scan
+  PointCloud empty;
+  empty.header.frame_id = pose_graph_.fixed_frame_id;
+  highlighted_scan_pub_.publish(empty);
 }
 
 bool PoseGraphVisualizer::HighlightNodeService(
@@ -505,6 +556,161 @@ bool PoseGraphVisualizer::HighlightEdgeService(
   return true;
 }
 
+bool PoseGraphVisualizer::ShowInteractiveMarkersService(
+    pose_graph_visualizer::ShowInteractiveMarkersRequest& request,
+    pose_graph_visualizer::ShowInteractiveMarkersResponse& response) {
+  response.num_markers = 0;
+  if (!publish_interactive_markers_ || server == nullptr)
+    return true;
+
+  server->clear();
+  interactive_keys_.clear();
+  const double radius2 = request.radius * request.radius;
+  for (const auto& keyed_pose : pose_graph_.GetValues()) {
+    const gtsam::Symbol key(keyed_pose.key);
+    if (!lamp_utils::IsRobotPrefix(key.chr()))
+      continue;
+    const gtsam::Point3 p = pose_graph_.GetPose(key).translation();
+    const double dx = p.x() - request.x;
+    const double dy = p.y() - request.y;
+    const double dz = p.z() - request.z;
+    if (dx * dx + dy * dy + dz * dz > radius2)
+      continue;
+    ShowInteractiveMarker(key);
+  }
+  server->applyChanges();
+  response.num_markers = interactive_keys_.size();
+  return true;
+}
+
+void PoseGraphVisualizer::ShowInteractiveMarker(gtsam::Key key) {
+  if (!publish_interactive_markers_ || server == nullptr)
+    return;
+  const std::string name = std::string(gtsam::Symbol(key));
+  if (interactive_keys_.insert(key).second) {
+    MakeMenuMarker(pose_graph_.GetPose(key), name);
+  } else {
+    server->setPose(name, lamp_utils::GtsamToRosMsg(pose_graph_.GetPose(key)));
+  }
+}
+
+void PoseGraphVisualizer::InitializeChunkedMarkers(ChunkedMarkers& markers,
+                                                   size_t keys_per_element,
+                                                   int type,
+                                                   double r,
+                                                   double g,
+                                                   double b,
+                                                   double a,
+                                                   double scale) {
+  markers.chunks.SetParams(
+      keys_per_element, marker_chunk_size_, marker_move_threshold_);
+  visualization_msgs::Marker& m = markers.prototype;
+  m.header.frame_id = pose_graph_.fixed_frame_id;
+  m.ns = pose_graph_.fixed_frame_id;
+  m.action = visualization_msgs::Marker::ADD;
+  m.type = type;
+  m.pose.orientation.w = 1.0;
+  m.color.r = r;
+  m.color.g = g;
+  m.color.b = b;
+  m.color.a = a;
+  m.scale.x = scale;
+  if (keys_per_element == 1) {
+    m.scale.y = scale;
+    m.scale.z = scale;
+  }
+}
+
+void PoseGraphVisualizer::PublishChunkedMarkers(ChunkedMarkers& markers) {
+  const uint32_t num_subscribers = markers.pub.getNumSubscribers();
+  if (num_subscribers == 0) {
+    markers.num_subscribers = 0;
+    return;
+  }
+  bool b_all = num_subscribers > markers.num_subscribers;
+  markers.num_subscribers = num_subscribers;
+  if (markers.b_reset) {
+    visualization_msgs::Marker m = markers.prototype;
+    m.action = visualization_msgs::Marker::DELETEALL;
+    markers.pub.publish(m);
+    markers.b_reset = false;
+    b_all = true;
+  }
+
+  const ros::Time stamp = ros::Time::now();
+  for (auto& m : markers.chunks.TakeChanged(
+           markers.prototype,
+           [this](gtsam::Key key) { return GetPositionMsg(key); },
+           b_all)) {
+    m.header.stamp = stamp;
+    markers.pub.publish(m);
+  }
+}
+
+void PoseGraphVisualizer::PublishNodeIds() {
+  const uint32_t num_subscribers = graph_node_id_pub_.getNumSubscribers();
+  if (num_subscribers == 0) {
+    node_id_subscribers_ = 0;
+    return;
+  }
+  // New subscribers get all the ids, the others the new and moved ones
+  const bool b_all = num_subscribers > node_id_subscribers_;
+  node_id_subscribers_ = num_subscribers;
+
+  visualization_msgs::Marker m;
+  m.header.frame_id = pose_graph_.fixed_frame_id;
+  m.ns = pose_graph_.fixed_frame_id;
+
+  m.action = visualization_msgs::Marker::ADD;
+  m.type = visualization_msgs::Marker::TEXT_VIEW_FACING;
+  m.color.r = 1.0;
+  m.color.g = 1.0;
+  m.color.b = 0.2;
+  m.color.a = 0.8;
+  m.scale.z = 0.02; // Only Scale z is used - height of capital A in the text
+
+  const double threshold2 = marker_move_threshold_ * marker_move_threshold_;
+  int id_base = 100;
+  for (auto& entry : node_id_positions_) {
+    const gtsam::Key key = entry.first;
+    const geometry_msgs::Point p = GetPositionMsg(key);
+    const double dx = p.x - entry.second.x;
+    const double dy = p.y - entry.second.y;
+    const double dz = p.z - entry.second.z;
+    if (!b_all && dx * dx + dy * dy + dz * dz <= threshold2)
+      continue;
+    entry.second = p;
+    m.pose = lamp_utils::GtsamToRosMsg(pose_graph_.GetPose(key));
+    // Display text for the node
+    m.text = std::to_string(key);
+    m.id = id_base + key;
+    graph_node_id_pub_.publish(m);
+  }
+}
+
+void PoseGraphVisualizer::ResetMarkers() {
+  for (ChunkedMarkers* markers : {&odometry_edges_,
+                                  &loop_edges_,
+                                  &artifact_edges_,
+                                  &uwb_edges_,
+                                  &uwb_between_edges_,
+                                  &uwb_nodes_,
+                                  &graph_nodes_}) {
+    markers->chunks.Clear();
+    markers->b_reset = true;
+  }
+  chunked_edges_.clear();
+  chunked_nodes_.clear();
+  node_id_positions_.clear();
+  artifact_markers_.clear();
+  artifact_subscribers_ = 0;
+  interactive_keys_.clear();
+  if (server != nullptr) {
+    server->clear();
+    server->applyChanges();
+  }
+}
+
 // Interactive Marker Menu
 void PoseGraphVisualizer::MakeMenuMarker(const gtsam::Pose3& pose,
                                          const std::string& id_number) {
@@ -539,203 +745,74 @@ void PoseGraphVisualizer::MakeMenuMarker(const gtsam::Pose3& pose,
 }
 
 void PoseGraphVisualizer::VisualizePoseGraph() {
-  visualization_msgs::Marker odometry_edges;
-  visualization_msgs::Marker loop_edges;
-  visualization_msgs::Marker artifact_edges;
-  visualization_msgs::Marker uwb_edges;
-  visualization_msgs::Marker uwb_between_edges;
-
-  visualization_msgs::Marker* edge_target;
-  // TODO visualize new edges/nodes or all?
+  // Only what was added since the last call is chunked, the chunks keep
+  // track of the positions of their keys
   for (const auto& edge : pose_graph_.GetNewEdges()) {
-    edge_target = nullptr;
+    ChunkedMarkers* edge_target = nullptr;
     switch (edge.type) {
     case pose_graph_msgs::PoseGraphEdge::ODOM:
-      edge_target = &odometry_edges;
+      edge_target = &odometry_edges_;
       break;
     case pose_graph_msgs::PoseGraphEdge::LOOPCLOSE:
-      edge_target = &loop_edges;
+      edge_target = &loop_edges_;
       break;
     case pose_graph_msgs::PoseGraphEdge::ARTIFACT:
-      edge_target = &artifact_edges;
+      edge_target = &artifact_edges_;
       break;
     case pose_graph_msgs::PoseGraphEdge::UWB_RANGE:
-      edge_target = &uwb_edges;
+      edge_target = &uwb_edges_;
       break;
     case pose_graph_msgs::PoseGraphEdge::UWB_BETWEEN:
-      edge_target = &uwb_between_edges;
+      edge_target = &uwb_between_edges_;
       break;
     }
     // TODO - look at how to handle Priors - a small edge - 1 m down in z
-    if (edge_target) {
-      edge_target->points.push_back(GetPositionMsg(edge.key_from));
-      edge_target->points.push_back(GetPositionMsg(edge.key_to));
+    if (edge_target == nullptr)
+      continue;
+    // Keyframes track all their edges again, they are chunked once
+    const auto edge_id = std::make_tuple(gtsam::Key(edge.key_from),
+                                         gtsam::Key(edge.key_to),
+                                         static_cast<int>(edge.type));
+    if (chunked_edges_.insert(edge_id).second) {
+      edge_target->chunks.Add(edge.key_from, edge.key_to);
     }
   }
 
-  // Publish odometry edges.
-  if (odometry_edge_pub_.getNumSubscribers() > 0) {
-    odometry_edges.header.frame_id = pose_graph_.fixed_frame_id;
-    odometry_edges.ns = pose_graph_.fixed_frame_id;
-    odometry_edges.id = 0;
-    odometry_edges.action = visualization_msgs::Marker::ADD;
-    odometry_edges.type = visualization_msgs::Marker::LINE_LIST;
-    odometry_edges.color.r = 1.0;
-    odometry_edges.color.g = 0.0;
-    odometry_edges.color.b = 0.0;
-    odometry_edges.color.a = 0.8;
-    odometry_edges.scale.x = 0.02;
-    odometry_edge_pub_.publish(odometry_edges);
-  }
-
-  // Publish loop closure edges.
-  if (loop_edge_pub_.getNumSubscribers() > 0) {
-    loop_edges.header.frame_id = pose_graph_.fixed_frame_id;
-    loop_edges.ns = pose_graph_.fixed_frame_id;
-    loop_edges.id = 1;
-    loop_edges.action = visualization_msgs::Marker::ADD;
-    loop_edges.type = visualization_msgs::Marker::LINE_LIST;
-    loop_edges.color.r = 0.0;
-    loop_edges.color.g = 0.2;
-    loop_edges.color.b = 1.0;
-    loop_edges.color.a = 0.8;
-    loop_edges.scale.x = 0.02;
-    loop_edge_pub_.publish(loop_edges);
-  }
-
-  // Publish artifact edges.
-  if (artifact_edge_pub_.getNumSubscribers() > 0) {
-    artifact_edges.header.frame_id = pose_graph_.fixed_frame_id;
-    artifact_edges.ns = pose_graph_.fixed_frame_id;
-    artifact_edges.id = 2;
-    artifact_edges.action = visualization_msgs::Marker::ADD;
-    artifact_edges.type = visualization_msgs::Marker::LINE_LIST;
-    artifact_edges.color.r = 0.2;
-    artifact_edges.color.g = 1.0;
-    artifact_edges.color.b = 0.0;
-    artifact_edges.color.a = 0.6;
-    artifact_edges.scale.x = 0.02;
-    artifact_edge_pub_.publish(artifact_edges);
-  }
-
-  // Publish UWB edges.
-  if (uwb_edge_pub_.getNumSubscribers() > 0) {
-    // visualization_msgs::Marker m;
-    uwb_edges.header.frame_id = pose_graph_.fixed_frame_id;
-    uwb_edges.ns = pose_graph_.fixed_frame_id;
-    uwb_edges.id = 3;
-    uwb_edges.action = visualization_msgs::Marker::ADD;
-    uwb_edges.type = visualization_msgs::Marker::LINE_LIST;
-    uwb_edges.color.r = 0.0;
-    uwb_edges.color.g = 1.0;
-    uwb_edges.color.b = 0.0;
-    uwb_edges.color.a = 0.8;
-    uwb_edges.scale.x = 0.02;
-    uwb_edge_pub_.publish(uwb_edges);
-  }
-
-  // Publish UWB between edges.
-  if (uwb_edge_between_pub_.getNumSubscribers() > 0) {
-    // visualization_msgs::Marker m;
-    uwb_between_edges.header.frame_id = pose_graph_.fixed_frame_id;
-    uwb_between_edges.ns = pose_graph_.fixed_frame_id;
-    uwb_between_edges.id = 4;
-    uwb_between_edges.action = visualization_msgs::Marker::ADD;
-    uwb_between_edges.type = visualization_msgs::Marker::LINE_LIST;
-    uwb_between_edges.color.r = 0.0;
-    uwb_between_edges.color.g = 1.0;
-    uwb_between_edges.color.b = 0.0;
-    uwb_between_edges.color.a = 0.8;
-    uwb_between_edges.scale.x = 0.04;
-    uwb_edge_between_pub_.publish(uwb_between_edges);
-  }
-
-  visualization_msgs::Marker generic_nodes;
-  visualization_msgs::Marker uwb_nodes;
-
-  // Store keys for generic (non-UWB, non-artifact) nodes for text markers
-  std::set<gtsam::Symbol> pose_keys;
-
   for (const auto& node : pose_graph_.GetNewNodes()) {
-    tf::Pose pose;
-    tf::poseMsgToTF(node.pose, pose);
-
     gtsam::Symbol sym_key(gtsam::Key(node.key));
 
-    if (sym_key.chr() == 'u') {
-      // UWB
-      uwb_nodes.points.push_back(GetPositionMsg(node.key));
+    if (lamp_utils::IsArtifactPrefix(sym_key.chr())) {
+      // handle artifacts separately (below)
       continue;
     }
+    // Nodes are tracked again on each update, they are chunked once
+    if (!chunked_nodes_.insert(node.key).second)
+      continue;
 
-    if (lamp_utils::IsArtifactPrefix(sym_key.chr())) {
-      // handle artifacts separately (below)
+    if (sym_key.chr() == 'u') {
+      // UWB
+      uwb_nodes_.chunks.Add(node.key);
       continue;
     }
 
     // Fill pose nodes (representing the robot position)
-    generic_nodes.points.push_back(GetPositionMsg(node.key));
-    pose_keys.insert(sym_key);
+    graph_nodes_.chunks.Add(node.key);
+    // Not published yet, so it differs from any position
+    geometry_msgs::Point unpublished;
+    unpublished.x = std::numeric_limits<double>::quiet_NaN();
+    node_id_positions_[node.key] = unpublished;
   }
 
-  // Publish nodes in the pose graph.
-  if (graph_node_pub_.getNumSubscribers() > 0) {
-    generic_nodes.header.frame_id = pose_graph_.fixed_frame_id;
-    generic_nodes.ns = pose_graph_.fixed_frame_id;
-    generic_nodes.id = 4;
-    generic_nodes.action = visualization_msgs::Marker::ADD;
-    generic_nodes.type = visualization_msgs::Marker::SPHERE_LIST;
-    generic_nodes.color.r = 0.3;
-    generic_nodes.color.g = 0.0;
-    generic_nodes.color.b = 1.0;
-    generic_nodes.color.a = 0.8;
-    generic_nodes.scale.x = 0.1;
-    generic_nodes.scale.y = 0.1;
-    generic_nodes.scale.z = 0.1;
-    graph_node_pub_.publish(generic_nodes);
-  }
-
-  // Publish UWB nodes.
-  if (uwb_node_pub_.getNumSubscribers() > 0) {
-    uwb_nodes.header.frame_id = pose_graph_.fixed_frame_id;
-    uwb_nodes.ns = pose_graph_.fixed_frame_id;
-    uwb_nodes.id = 6;
-    uwb_nodes.action = visualization_msgs::Marker::ADD;
-    uwb_nodes.type = visualization_msgs::Marker::CUBE_LIST;
-    uwb_nodes.color.r = 0.0;
-    uwb_nodes.color.g = 1.0;
-    uwb_nodes.color.b = 0.0;
-    uwb_nodes.color.a = 0.4;
-    uwb_nodes.scale.x = 0.5;
-    uwb_nodes.scale.y = 0.5;
-    uwb_nodes.scale.z = 0.5;
-    uwb_node_pub_.publish(uwb_nodes);
-  }
+  PublishChunkedMarkers(odometry_edges_);
+  PublishChunkedMarkers(loop_edges_);
+  PublishChunkedMarkers(artifact_edges_);
+  PublishChunkedMarkers(uwb_edges_);
+  PublishChunkedMarkers(uwb_between_edges_);
+  PublishChunkedMarkers(graph_nodes_);
+  PublishChunkedMarkers(uwb_nodes_);
 
   // Publish text markers for node IDs in the pose graph.
-  if (graph_node_id_pub_.getNumSubscribers() > 0) {
-    visualization_msgs::Marker m;
-    m.header.frame_id = pose_graph_.fixed_frame_id;
-    m.ns = pose_graph_.fixed_frame_id;
-
-    m.action = visualization_msgs::Marker::ADD;
-    m.type = visualization_msgs::Marker::TEXT_VIEW_FACING;
-    m.color.r = 1.0;
-    m.color.g = 1.0;
-    m.color.b = 0.2;
-    m.color.a = 0.8;
-    m.scale.z = 0.02; // Only Scale z is used - height of capital A in the text
-
-    int id_base = 100;
-    int counter = 0;
-    for (const auto& key : pose_keys) {
-      m.pose = lamp_utils::GtsamToRosMsg(pose_graph_.GetPose(key));
-      // Display text for the node
-      m.text = std::to_string(key);
-      m.id = id_base + key;
-      graph_node_id_pub_.publish(m);
-    }
-  }
+  PublishNodeIds();
 
   // Draw a sphere around the current sensor frame to show the area in which we
   // are checking for loop closures.
@@ -759,130 +836,158 @@ void PoseGraphVisualizer::VisualizePoseGraph() {
     closure_area_pub_.publish(m);
   }
 
-  // Publish Artifacts
-  if (artifact_marker_pub_.getNumSubscribers() > 0 ||
-      artifact_id_marker_pub_.getNumSubscribers() > 0 ||
-      stair_marker_pub_.getNumSubscribers() > 0) {
-    visualization_msgs::Marker m, m_id;
-    m.header.frame_id = pose_graph_.fixed_frame_id;
-    m_id.header.frame_id = m.header.frame_id;
-    m.ns = "artifact";
-    m_id.ns = "artifact_id";
-
-    // ROS_INFO("Publishing artifacts!");
-    // TODO - use the pose from the pose-graph for the artifacts
-    for (const auto& entry : artifact_key2id_hash_) {
-      m.header.stamp = ros::Time::now();
-      m_id.header.stamp = ros::Time::now();
-
-      // get the gtsam key
-      gtsam::Key key(entry.first);
-
-      // ROS_INFO_STREAM("[Publishing Artifact] Artifact key (raw) is: " <<
-      // entry.second); ROS_INFO_STREAM("Artifact key is " << key);
-      // ROS_INFO_STREAM("Artifact hash key is "
-      //                 << gtsam::DefaultKeyFormatter(key));
-      if (!lamp_utils::IsArtifactPrefix(gtsam::Symbol(key).chr())) {
-        ROS_WARN("ERROR - have a non-landmark ID");
-        ROS_INFO_STREAM("Bad ID is " << gtsam::DefaultKeyFormatter(key));
-        continue;
-      }
-
-      // Check that we have recieved the artifact
-      if (artifact_ID2ParentID_.count(entry.second) == 0) {
-        ROS_DEBUG_STREAM("Have not recevied artifact message for artifact "
-                         << gtsam::DefaultKeyFormatter(key)
-                         << " that is in the graph yet. Have ID: "
-                         << entry.second);
-        continue;
-      }
-
-      // Get the parent ID
-      std::string parent_id = artifact_ID2ParentID_[entry.second];
-
-      // Continue only if this ID is what is linked to an ative parent ID
-      if (entry.second != current_parentID2ID_[parent_id]) {
-        ROS_DEBUG_STREAM("Artifact with ID: "
-                         << entry.second
-                         << " is not the active artifact for parent id: "
-                         << parent_id);
-        continue;
-      }
+  PublishArtifacts();
 
-      // TODO only publish what has changed
-      // ROS_INFO_STREAM("Artifact key to publish is "
-      //                 << gtsam::DefaultKeyFormatter(key));
-
-      // ROS_INFO_STREAM("ID from key for the artifact is: " << entry.second <<
-      // ", with parent id " << parent_id);
-
-      // Get the artifact information
-      if (artifacts_.find(parent_id) == artifacts_.end()) {
-        ROS_DEBUG_STREAM(
-            "No artifact info for artifact that is in the graph, key: "
-            << gtsam::DefaultKeyFormatter(key));
-        continue;
-      }
-
-      int id_marker = parent_id2int_(parent_id);
-
-      m.id = id_marker;
-      m_id.id = id_marker;
-
-      ArtifactInfo art = artifacts_[parent_id];
+  // Interactive markers follow their nodes.
+  if (!interactive_keys_.empty() && server != nullptr) {
+    for (const gtsam::Key key : interactive_keys_) {
+      server->setPose(std::string(gtsam::Symbol(key)),
+                      lamp_utils::GtsamToRosMsg(pose_graph_.GetPose(key)));
+    }
+    server->applyChanges();
+  }
 
-      // Update the artifact position from the graph
-      art.msg.point.point = GetPositionMsg(gtsam::Symbol(key));
-      art.msg.point.header.stamp = ros::Time::now();
+  // Everything new is in the chunks now
+  pose_graph_.ClearIncrementalMessages();
+}
 
-      if (art.msg.confidence < 60.0) {
-        confidence_scale_ = 0.90;
-      } else {
-        // Scale by confidence
-        confidence_scale_ =
-            0.90 + (art.msg.confidence - 60.0) * (2.0 - 0.9) / 40.0;
-      }
+void PoseGraphVisualizer::PublishArtifacts() {
+  const uint32_t num_subscribers = artifact_marker_pub_.getNumSubscribers() +
+      artifact_id_marker_pub_.getNumSubscribers() +
+      stair_marker_pub_.getNumSubscribers();
+  if (num_subscribers == 0) {
+    artifact_subscribers_ = 0;
+    return;
+  }
+  // New subscribers get all the artifacts, the others the changed ones
+  const bool b_all = num_subscribers > artifact_subscribers_;
+  artifact_subscribers_ = num_subscribers;
+
+  const double threshold2 =
+      artifact_move_threshold_ * artifact_move_threshold_;
+  const lamp_utils::SymbolIdIndex& artifact_ids = pose_graph_.GetArtifactIds();
+  for (const auto& entry : artifact_ids) {
+    // get the gtsam key
+    gtsam::Key key(entry.first);
+
+    // Check that we have recieved the artifact
+    if (entry.second >= artifact_ID2ParentID_.size() ||
+        artifact_ID2ParentID_[entry.second] ==
+            lamp_utils::SymbolIdIndex::kNoId) {
+      ROS_DEBUG_STREAM("Have not recevied artifact message for artifact "
+                       << gtsam::DefaultKeyFormatter(key)
+                       << " that is in the graph yet. Have ID: "
+                       << artifact_ids.Id(entry.second));
+      continue;
+    }
 
-      // Populate the artifact marker
-      if (use_realistic_artifact_models_) {
-        VisualizeSingleRealisticArtifact(m, art);
-      } else {
-        VisualizeSingleSimpleArtifact(m, art);
-      }
+    // Get the parent ID
+    const lamp_utils::SymbolIdIndex::Handle parent_id =
+        artifact_ID2ParentID_[entry.second];
 
-      VisualizeSingleArtifactId(m_id, art);
+    // Get the artifact information
+    auto art_it = artifacts_.find(parent_id);
+    if (art_it == artifacts_.end()) {
+      ROS_DEBUG_STREAM(
+          "No artifact info for artifact that is in the graph, key: "
+          << gtsam::DefaultKeyFormatter(key));
+      continue;
+    }
 
-      // Add or delete markers depending on user rejection status
-      if (IsArtifactBlacklisted(art.msg.parent_id)) {
-        m.action = visualization_msgs::Marker::DELETE;
-        m_id.action = visualization_msgs::Marker::DELETE;
-      } else {
-        m.action = visualization_msgs::Marker::ADD;
-        m_id.action = visualization_msgs::Marker::ADD;
-      }
+    // Continue only if this ID is what is linked to an ative parent ID
+    if (entry.second != art_it->second.id) {
+      ROS_DEBUG_STREAM("Artifact with ID: "
+                       << artifact_ids.Id(entry.second)
+                       << " is not the active artifact for parent id: "
+                       << artifact_ids.Id(parent_id));
+      continue;
+    }
 
-      // Publish
-      if (art.msg.label == "Negative Obstacle") {
-        stair_marker_pub_.publish(m);
-      } else {
-        artifact_marker_pub_.publish(m);
-        artifact_id_marker_pub_.publish(m_id);
+    // Skip artifacts that neither moved nor changed since they were sent
+    const geometry_msgs::Point p = GetPositionMsg(gtsam::Symbol(key));
+    const bool b_blacklisted = IsArtifactBlacklisted(parent_id);
+    auto cached = artifact_markers_.find(parent_id);
+    if (cached != artifact_markers_.end()) {
+      ArtifactMarkers& markers = cached->second;
+      const double dx = p.x - markers.position.x;
+      const double dy = p.y - markers.position.y;
+      const double dz = p.z - markers.position.z;
+      if (!b_all && markers.b_blacklisted == b_blacklisted &&
+          dx * dx + dy * dy + dz * dz <= threshold2)
+        continue;
+      // Only the position changed, shift the markers built before
+      for (visualization_msgs::Marker* m : {&markers.m, &markers.m_id}) {
+        m->pose.position.x += dx;
+        m->pose.position.y += dy;
+        m->pose.position.z += dz;
       }
+      markers.position = p;
+    } else {
+      cached = artifact_markers_
+                   .emplace(parent_id, BuildArtifactMarkers(art_it->second, p))
+                   .first;
+    }
+    ArtifactMarkers& markers = cached->second;
+    markers.b_blacklisted = b_blacklisted;
+
+    // Add or delete markers depending on user rejection status
+    const int action = b_blacklisted ? visualization_msgs::Marker::DELETE
+                                     : visualization_msgs::Marker::ADD;
+    markers.m.action = action;
+    markers.m_id.action = action;
+    markers.m.header.stamp = ros::Time::now();
+    markers.m_id.header.stamp = markers.m.header.stamp;
+
+    // Publish
+    if (art_it->second.msg.label == "Negative Obstacle") {
+      stair_marker_pub_.publish(markers.m);
+    } else {
+      artifact_marker_pub_.publish(markers.m);
+      artifact_id_marker_pub_.publish(markers.m_id);
     }
   }
+}
 
-  // Interactive markers.
-  if (publish_interactive_markers_) {
-    for (const auto& keyed_pose :
-         pose_graph_.GetNewValues()) { // TODO - just generic nodes
-      gtsam::Symbol key_id = gtsam::Symbol(keyed_pose.key);
-      std::string robot_id = std::string(key_id);
-      MakeMenuMarker(pose_graph_.GetPose(keyed_pose.key), robot_id);
-    }
-    if (server != nullptr) {
-      server->applyChanges();
-    }
+PoseGraphVisualizer::ArtifactMarkers
+PoseGraphVisualizer::BuildArtifactMarkers(const ArtifactInfo& info,
+                                          const geometry_msgs::Point& p) {
+  ArtifactMarkers markers;
+  markers.position = p;
+  visualization_msgs::Marker& m = markers.m;
+  visualization_msgs::Marker& m_id = markers.m_id;
+  m.header.frame_id = pose_graph_.fixed_frame_id;
+  m_id.header.frame_id = m.header.frame_id;
+  m.ns = "artifact";
+  m_id.ns = "artifact_id";
+
+  // The parent ID handle is unique and stable, so it is the marker id
+  const lamp_utils::SymbolIdIndex::Handle parent_id =
+      artifact_ID2ParentID_[info.id];
+  m.id = parent_id;
+  m_id.id = parent_id;
+
+  // Update the artifact position from the graph
+  ArtifactInfo art = info;
+  art.msg.point.point = p;
+  art.msg.point.header.stamp = ros::Time::now();
+
+  if (art.msg.confidence < 60.0) {
+    confidence_scale_ = 0.90;
+  } else {
+    // Scale by confidence
+    confidence_scale_ =
+        0.90 + (art.msg.confidence - 60.0) * (2.0 - 0.9) / 40.0;
   }
+
+  // Populate the artifact marker
+  if (use_realistic_artifact_models_) {
+    VisualizeSingleRealisticArtifact(m, art);
+  } else {
+    VisualizeSingleSimpleArtifact(m, art);
+  }
+
+  VisualizeSingleArtifactId(m_id, art);
+  return markers;
 }
 
 void PoseGraphVisualizer::VisualizeSingleArtifactId(
@@ -1115,12 +1220,16 @@ void PoseGraphVisualizer::VisualizeArtifacts() {
     // ID
     // Any marker sent with the same namespace and id will overwrite the old one
     marker.ns = "artifact";
-    marker.id = artifact_id2key_hash_[it->first];
     marker.action = visualization_msgs::Marker::ADD;
 
     // ROS_INFO_STREAM("Iterator first is: " << it->first);
 
-    gtsam::Key key(artifact_id2key_hash_[it->first]);
+    // Key of the node with the parent ID, skip until it is in the graph
+    gtsam::Key key;
+    if (!pose_graph_.GetArtifactIds().KeyOf(it->first, &key)) {
+      continue;
+    }
+    marker.id = key;
     // ROS_INFO_STREAM("Artifact hash key is " <<
     // gtsam::DefaultKeyFormatter(key));
     if (gtsam::Symbol(key).chr() != 'A' && gtsam::Symbol(key).chr() != 'B' &&